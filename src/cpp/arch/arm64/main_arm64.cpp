@@ -30,6 +30,9 @@
 #include <drivers/virtio_net.h>
 #include <drivers/virtio_scsi.h>
 #include <drivers/virtio_rng.h>
+#include <block/raid.h>
+#include <block/ramdisk.h>
+#include <block/block_completion.h>
 
 #include <net/tcp.h>
 
@@ -228,6 +231,8 @@ static void BpStartupArm(void* ctx)
     Trace(0, "After test");
 
     rust_init();
+    RamDisk::CreateFromParameters();
+    RaidDevice::AssembleFromParameters();
     rust_test();
 
     if (!SoftIrq::GetInstance().Init())
@@ -235,6 +240,7 @@ static void BpStartupArm(void* ctx)
         Panic("Can't init softirq");
         return;
     }
+    BlockCompletion::GetInstance().Init();
 
     Tcp::GetInstance().Init();
 
@@ -217,4 +217,11 @@ void MsixTable::Retarget(u16 index, u32 apicId)
     (void)apicId;
 }
 
+bool MsixTable::SetAffinity(u16 index, ulong cpu)
+{
+    (void)index;
+    (void)cpu;
+    return false;
+}
+
 }
@@ -169,4 +169,36 @@ void RustMsixStub28() {}
 void RustMsixStub29() {}
 void RustMsixStub30() {}
 void RustMsixStub31() {}
+void VirtioScsiQueueStub0() {}
+void VirtioScsiQueueStub1() {}
+void VirtioScsiQueueStub2() {}
+void VirtioScsiQueueStub3() {}
+void VirtioScsiQueueStub4() {}
+void VirtioScsiQueueStub5() {}
+void VirtioScsiQueueStub6() {}
+void VirtioScsiQueueStub7() {}
+void VirtioScsiQueueStub8() {}
+void VirtioScsiQueueStub9() {}
+void VirtioScsiQueueStub10() {}
+void VirtioScsiQueueStub11() {}
+void VirtioScsiQueueStub12() {}
+void VirtioScsiQueueStub13() {}
+void VirtioScsiQueueStub14() {}
+void VirtioScsiQueueStub15() {}
+void VirtioScsiQueueStub16() {}
+void VirtioScsiQueueStub17() {}
+void VirtioScsiQueueStub18() {}
+void VirtioScsiQueueStub19() {}
+void VirtioScsiQueueStub20() {}
+void VirtioScsiQueueStub21() {}
+void VirtioScsiQueueStub22() {}
+void VirtioScsiQueueStub23() {}
+void VirtioScsiQueueStub24() {}
+void VirtioScsiQueueStub25() {}
+void VirtioScsiQueueStub26() {}
+void VirtioScsiQueueStub27() {}
+void VirtioScsiQueueStub28() {}
+void VirtioScsiQueueStub29() {}
+void VirtioScsiQueueStub30() {}
+void VirtioScsiQueueStub31() {}
 }
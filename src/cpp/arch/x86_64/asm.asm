@@ -15,6 +15,7 @@ extern VirtioScsiInterrupt
 extern SharedInterrupt
 extern RustInterruptDispatch
 extern RustMsixDispatch
+extern VirtioScsiQueueInterrupt
 
 extern ExcDivideByZero
 extern ExcDebugger
@@ -146,6 +147,38 @@ global RustMsixStub28
 global RustMsixStub29
 global RustMsixStub30
 global RustMsixStub31
+global VirtioScsiQueueStub0
+global VirtioScsiQueueStub1
+global VirtioScsiQueueStub2
+global VirtioScsiQueueStub3
+global VirtioScsiQueueStub4
+global VirtioScsiQueueStub5
+global VirtioScsiQueueStub6
+global VirtioScsiQueueStub7
+global VirtioScsiQueueStub8
+global VirtioScsiQueueStub9
+global VirtioScsiQueueStub10
+global VirtioScsiQueueStub11
+global VirtioScsiQueueStub12
+global VirtioScsiQueueStub13
+global VirtioScsiQueueStub14
+global VirtioScsiQueueStub15
+global VirtioScsiQueueStub16
+global VirtioScsiQueueStub17
+global VirtioScsiQueueStub18
+global VirtioScsiQueueStub19
+global VirtioScsiQueueStub20
+global VirtioScsiQueueStub21
+global VirtioScsiQueueStub22
+global VirtioScsiQueueStub23
+global VirtioScsiQueueStub24
+global VirtioScsiQueueStub25
+global VirtioScsiQueueStub26
+global VirtioScsiQueueStub27
+global VirtioScsiQueueStub28
+global VirtioScsiQueueStub29
+global VirtioScsiQueueStub30
+global VirtioScsiQueueStub31
 
 global ExcDivideByZeroStub
 global ExcDebuggerStub
@@ -632,6 +665,50 @@ RustMsixSlot 29
 RustMsixSlot 30
 RustMsixSlot 31
 
+%macro VirtioScsiQueueSlot 1
+VirtioScsiQueueStub%1:
+	PushAll
+	mov rdi, rsp
+	mov esi, %1
+	cld
+	call VirtioScsiQueueInterrupt
+	PopAll
+	iretq
+%endmacro
+
+VirtioScsiQueueSlot 0
+VirtioScsiQueueSlot 1
+VirtioScsiQueueSlot 2
+VirtioScsiQueueSlot 3
+VirtioScsiQueueSlot 4
+VirtioScsiQueueSlot 5
+VirtioScsiQueueSlot 6
+VirtioScsiQueueSlot 7
+VirtioScsiQueueSlot 8
+VirtioScsiQueueSlot 9
+VirtioScsiQueueSlot 10
+VirtioScsiQueueSlot 11
+VirtioScsiQueueSlot 12
+VirtioScsiQueueSlot 13
+VirtioScsiQueueSlot 14
+VirtioScsiQueueSlot 15
+VirtioScsiQueueSlot 16
+VirtioScsiQueueSlot 17
+VirtioScsiQueueSlot 18
+VirtioScsiQueueSlot 19
+VirtioScsiQueueSlot 20
+VirtioScsiQueueSlot 21
+VirtioScsiQueueSlot 22
+VirtioScsiQueueSlot 23
+VirtioScsiQueueSlot 24
+VirtioScsiQueueSlot 25
+VirtioScsiQueueSlot 26
+VirtioScsiQueueSlot 27
+VirtioScsiQueueSlot 28
+VirtioScsiQueueSlot 29
+VirtioScsiQueueSlot 30
+VirtioScsiQueueSlot 31
+
 ExceptionStub ExcDivideByZero
 ExceptionStub ExcDebugger
 ExceptionStub ExcNMI
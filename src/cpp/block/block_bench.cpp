@@ -0,0 +1,260 @@
+#include "block_bench.h"
+
+#include <include/const.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/time.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+void BlockBench::Issue(BlockDevice* dev, Slot& slot, bool write, u64 sector,
+                       ulong pages, ulong sectorsPerPage)
+{
+    /* Requests are reused: re-initialise the completed ones in place */
+    for (ulong i = 0; i < pages; i++)
+    {
+        BlockRequest* req = new (&slot.Reqs[i]) BlockRequest();
+        req->RequestType = write ? BlockRequest::Write : BlockRequest::Read;
+        req->Sector = sector + i * sectorsPerPage;
+        req->SectorCount = (u32)sectorsPerPage;
+        req->Buffer = slot.Buf + i * Const::PageSize;
+        slot.Ptrs[i] = req;
+    }
+
+    slot.Busy = true;
+    dev->SubmitBatch(slot.Ptrs, pages);
+}
+
+bool BlockBench::Reap(BlockDevice* dev, Slot& slot, ulong pages)
+{
+    bool ok = true;
+    for (ulong i = 0; i < pages; i++)
+    {
+        dev->WaitRequest(slot.Reqs[i]);
+        if (!slot.Reqs[i].Success)
+            ok = false;
+    }
+    slot.Busy = false;
+    return ok;
+}
+
+bool BlockBench::Run(BlockDevice* dev, bool write, bool random,
+                     ulong blockSize, ulong ops, ulong depth, Result& result)
+{
+    Job job;
+    job.Dev = dev;
+    job.Write = write;
+    job.Random = random;
+    job.BlockSize = blockSize;
+    job.Ops = ops;
+    job.Depth = depth;
+    job.Seed = 0;
+
+    bool ok = RunJob(job);
+    result = job.Res;
+    return ok;
+}
+
+bool BlockBench::RunJob(Job& job)
+{
+    BlockDevice* dev = job.Dev;
+    bool write = job.Write;
+    bool random = job.Random;
+    ulong blockSize = job.BlockSize;
+    ulong ops = job.Ops;
+    ulong depth = job.Depth;
+    Result& result = job.Res;
+
+    result.Ops = 0;
+    result.Bytes = 0;
+    result.ElapsedNs = 0;
+    result.Errors = 0;
+    result.Cpus = 1;
+
+    u64 sectorSize = dev->GetSectorSize();
+    if (sectorSize == 0 || sectorSize > Const::PageSize)
+        return false;
+    if (blockSize < Const::PageSize || blockSize > MaxBlockSize ||
+        (blockSize % Const::PageSize) != 0)
+        return false;
+    if (ops == 0 || depth == 0 || depth > MaxDepth)
+        return false;
+
+    ulong pages = blockSize / Const::PageSize;
+    ulong sectorsPerPage = Const::PageSize / sectorSize;
+    u64 blockSectors = blockSize / sectorSize;
+    u64 blocks = dev->GetCapacity() / blockSectors;
+    if (blocks == 0)
+        return false;
+
+    Slot slots[MaxDepth];
+    bool ok = true;
+    for (ulong i = 0; i < depth; i++)
+    {
+        /* Raw memory: requests are constructed by Issue and never
+           destroyed, so unused ones do not trip the WaitGroup check */
+        slots[i].Reqs = static_cast<BlockRequest*>(Mm::Alloc(pages * sizeof(BlockRequest), 0));
+        slots[i].Ptrs = static_cast<BlockRequest**>(Mm::Alloc(pages * sizeof(BlockRequest*), 0));
+        slots[i].Buf = static_cast<u8*>(Mm::Alloc(blockSize, 0));
+        slots[i].Busy = false;
+        if (slots[i].Reqs == nullptr || slots[i].Ptrs == nullptr || slots[i].Buf == nullptr)
+            ok = false;
+        else
+            Stdlib::MemSet(slots[i].Buf, (int)(0xA5 + i), blockSize);
+    }
+
+    if (ok)
+    {
+        u64 rng = (GetBootTime().GetValue() ^ (job.Seed * 0x9E3779B97F4A7C15ULL)) | 1;
+        u64 next = (job.Seed * (blocks / MaxCpus + 1)) % blocks;
+
+        Stdlib::Time start = GetBootTime();
+        for (ulong issued = 0; issued < ops; issued++)
+        {
+            /* Slots are used round-robin, so the one refilled next always
+               holds the oldest I/O in flight */
+            Slot& slot = slots[issued % depth];
+            if (slot.Busy && !Reap(dev, slot, pages))
+                result.Errors++;
+
+            u64 block;
+            if (random)
+            {
+                rng ^= rng << 13;
+                rng ^= rng >> 7;
+                rng ^= rng << 17;
+                block = rng % blocks;
+            }
+            else
+            {
+                block = next;
+                next = (next + 1) % blocks;
+            }
+            Issue(dev, slot, write, block * blockSectors, pages, sectorsPerPage);
+        }
+        for (ulong i = 0; i < depth; i++)
+        {
+            if (slots[i].Busy && !Reap(dev, slots[i], pages))
+                result.Errors++;
+        }
+        result.ElapsedNs = (GetBootTime() - start).GetValue();
+        result.Ops = ops;
+        result.Bytes = (u64)ops * blockSize;
+    }
+
+    for (ulong i = 0; i < depth; i++)
+    {
+        if (slots[i].Busy)
+            Reap(dev, slots[i], pages);
+        if (slots[i].Buf != nullptr)
+            Mm::Free(slots[i].Buf);
+        if (slots[i].Ptrs != nullptr)
+            Mm::Free(slots[i].Ptrs);
+        if (slots[i].Reqs != nullptr)
+            Mm::Free(slots[i].Reqs);
+    }
+    return ok;
+}
+
+void BlockBench::JobTaskFunc(void* ctx)
+{
+    Job* job = static_cast<Job*>(ctx);
+    job->Ok = RunJob(*job);
+}
+
+bool BlockBench::RunParallel(BlockDevice* dev, bool write, bool random,
+                             ulong blockSize, ulong ops, ulong depth, ulong cpus,
+                             Result& result)
+{
+    result.Ops = 0;
+    result.Bytes = 0;
+    result.ElapsedNs = 0;
+    result.Errors = 0;
+    result.Cpus = 0;
+
+    if (cpus <= 1)
+        return Run(dev, write, random, blockSize, ops, depth, result);
+    if (cpus > MaxCpus || ops < cpus)
+        return false;
+
+    /* The first cpus running CPUs */
+    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus();
+    ulong cpuIds[MaxCpus];
+    ulong count = 0;
+    for (ulong i = 0; i < MaxCpus && count < cpus; i++)
+    {
+        if (cpuMask & (1UL << i))
+            cpuIds[count++] = i;
+    }
+    if (count < cpus)
+        return false;
+
+    Job jobs[MaxCpus];
+    Task* tasks[MaxCpus] = {};
+    for (ulong i = 0; i < cpus; i++)
+    {
+        jobs[i].Dev = dev;
+        jobs[i].Write = write;
+        jobs[i].Random = random;
+        jobs[i].BlockSize = blockSize;
+        jobs[i].Ops = ops / cpus + ((i < ops % cpus) ? 1 : 0);
+        jobs[i].Depth = depth;
+        jobs[i].Seed = i;
+        jobs[i].Ok = false;
+
+        tasks[i] = Mm::TAlloc<Task, Tag>("blkbench/%u", cpuIds[i]);
+        if (tasks[i] == nullptr)
+            break;
+        tasks[i]->SetCpuAffinity(1UL << cpuIds[i]);
+    }
+
+    bool ok = true;
+    Stdlib::Time start = GetBootTime();
+    for (ulong i = 0; i < cpus; i++)
+    {
+        if (tasks[i] == nullptr || !tasks[i]->Start(&BlockBench::JobTaskFunc, &jobs[i]))
+        {
+            ok = false;
+            break;
+        }
+        result.Cpus++;
+    }
+    for (ulong i = 0; i < result.Cpus; i++)
+        tasks[i]->Wait();
+    result.ElapsedNs = (GetBootTime() - start).GetValue();
+
+    for (ulong i = 0; i < cpus; i++)
+    {
+        if (tasks[i] != nullptr)
+            tasks[i]->Put();
+        if (i >= result.Cpus)
+            continue;
+
+        if (!jobs[i].Ok)
+            ok = false;
+        result.Ops += jobs[i].Res.Ops;
+        result.Bytes += jobs[i].Res.Bytes;
+        result.Errors += jobs[i].Res.Errors;
+    }
+    return ok;
+}
+
+void BlockBench::Print(BlockDevice* dev, const Result& result, Stdlib::Printer& printer)
+{
+    u64 us = result.ElapsedNs / Const::NanoSecsInUsec;
+    if (us == 0)
+        us = 1;
+
+    printer.Printf("%s: %u ops  %u KB  %u ms  %u IOPS  %u MB/s  %u errors",
+        dev->GetName(), result.Ops, result.Bytes / Const::KB,
+        us / 1000, (u64)result.Ops * 1000000 / us,
+        result.Bytes / us, result.Errors);
+    if (result.Cpus > 1)
+        printer.Printf("  %u cpus", result.Cpus);
+    printer.Printf("\n");
+}
+
+}
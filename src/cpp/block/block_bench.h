@@ -0,0 +1,85 @@
+#pragma once
+
+#include "block_device.h"
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* Raw block device benchmark.
+
+   Each I/O of BlockSize bytes is issued as page-sized requests in one
+   SubmitBatch, so queues with a scheduler merge it back into a single
+   device request.  Depth I/Os are kept in flight; they are reaped in
+   submission order and the slot is refilled immediately.  Random mode
+   picks BlockSize-aligned offsets uniformly over the device.
+   Write mode overwrites the device contents.
+
+   RunParallel splits the ops over one task pinned to each of the first
+   Cpus running CPUs, each with its own Depth slots, and reports the
+   combined rate over the wall time; on a multi-queue device every CPU
+   then submits on its own hardware queue. */
+class BlockBench
+{
+public:
+    struct Result
+    {
+        ulong Ops;
+        u64 Bytes;
+        u64 ElapsedNs;
+        ulong Errors;
+        ulong Cpus;
+    };
+
+    static bool Run(BlockDevice* dev, bool write, bool random,
+                    ulong blockSize, ulong ops, ulong depth, Result& result);
+
+    static bool RunParallel(BlockDevice* dev, bool write, bool random,
+                            ulong blockSize, ulong ops, ulong depth, ulong cpus,
+                            Result& result);
+
+    static void Print(BlockDevice* dev, const Result& result, Stdlib::Printer& printer);
+
+    static const ulong MaxDepth = 32;
+    static const ulong MaxBlockSize = 1024 * 1024;
+    static const ulong Tag = 'BBch';
+
+private:
+    BlockBench() = delete;
+    BlockBench(const BlockBench& other) = delete;
+    BlockBench(BlockBench&& other) = delete;
+    BlockBench& operator=(const BlockBench& other) = delete;
+    BlockBench& operator=(BlockBench&& other) = delete;
+
+    struct Slot
+    {
+        BlockRequest* Reqs;
+        BlockRequest** Ptrs;
+        u8* Buf;
+        bool Busy;
+    };
+
+    struct Job
+    {
+        BlockDevice* Dev;
+        bool Write;
+        bool Random;
+        ulong BlockSize;
+        ulong Ops;
+        ulong Depth;
+        ulong Seed;         /* varies the random offsets and sequential start */
+        bool Ok;
+        Result Res;
+    };
+
+    static bool RunJob(Job& job);
+    static void JobTaskFunc(void* ctx);
+
+    static void Issue(BlockDevice* dev, Slot& slot, bool write, u64 sector,
+                      ulong pages, ulong sectorsPerPage);
+    static bool Reap(BlockDevice* dev, Slot& slot, ulong pages);
+};
+
+}
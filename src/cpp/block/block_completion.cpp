@@ -0,0 +1,143 @@
+#include "block_completion.h"
+
+#include <kernel/softirq.h>
+#include <kernel/trace.h>
+
+namespace Kernel
+{
+
+BlockCompletion::BlockCompletion()
+    : Enabled(1)
+{
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        Cpus[i].Head.Set(0);
+        Cpus[i].Local.Set(0);
+        Cpus[i].Steered.Set(0);
+        Cpus[i].Batches.Set(0);
+    }
+}
+
+BlockCompletion::~BlockCompletion()
+{
+}
+
+void BlockCompletion::Init()
+{
+    SoftIrq::GetInstance().RegisterPerCpu(SoftIrq::TypeBlkDone, &BlockCompletion::SoftIrqHandler, this);
+    Trace(0, "BlockCompletion: steering %s", Enabled.Get() ? "on" : "off");
+}
+
+void BlockCompletion::MarkSubmit(BlockRequest* req)
+{
+    req->SubmitCpu = (u32)CpuTable::GetInstance().GetCurrentCpuId();
+}
+
+void BlockCompletion::Complete(BlockRequest* req, bool success)
+{
+    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
+    ulong target = req->SubmitCpu;
+
+    if (target == cpu || target >= MaxCpus || cpu >= MaxCpus || !Enabled.Get() ||
+        !SoftIrq::GetInstance().IsReadyOn(target))
+    {
+        if (cpu < MaxCpus)
+            Cpus[cpu].Local.Inc();
+        req->Complete(success);
+        return;
+    }
+
+    req->Success = success;
+
+    CpuList& list = Cpus[target];
+    long head;
+    for (;;)
+    {
+        head = list.Head.Get();
+        req->DoneNext = reinterpret_cast<BlockRequest*>(head);
+        if (list.Head.Cmpxchg((long)req, head) == head)
+            break;
+    }
+    list.Steered.Inc();
+
+    /* Whoever finds the list empty kicks the owner; later pushes ride
+       along with that soft IRQ */
+    if (head == 0)
+    {
+        list.Batches.Inc();
+        SoftIrq::GetInstance().RaiseOn(target, SoftIrq::TypeBlkDone);
+    }
+}
+
+void BlockCompletion::SoftIrqHandler(void* ctx)
+{
+    static_cast<BlockCompletion*>(ctx)->Drain();
+}
+
+void BlockCompletion::Drain()
+{
+    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
+    if (cpu >= MaxCpus)
+        return;
+
+    CpuList& list = Cpus[cpu];
+    long head;
+    for (;;)
+    {
+        head = list.Head.Get();
+        if (head == 0)
+            return;
+        if (list.Head.Cmpxchg(0, head) == head)
+            break;
+    }
+
+    /* Newest first: reverse to complete in arrival order */
+    BlockRequest* req = reinterpret_cast<BlockRequest*>(head);
+    BlockRequest* ordered = nullptr;
+    while (req != nullptr)
+    {
+        BlockRequest* next = req->DoneNext;
+        req->DoneNext = ordered;
+        ordered = req;
+        req = next;
+    }
+
+    /* Read the link before completing: the waiter may free the request */
+    while (ordered != nullptr)
+    {
+        BlockRequest* next = ordered->DoneNext;
+        ordered->DoneNext = nullptr;
+        ordered->Complete(ordered->Success);
+        ordered = next;
+    }
+}
+
+void BlockCompletion::SetEnabled(bool on)
+{
+    Enabled.Set(on ? 1 : 0);
+}
+
+bool BlockCompletion::GetEnabled()
+{
+    return Enabled.Get() != 0;
+}
+
+void BlockCompletion::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("steering %s\n", GetEnabled() ? "on" : "off");
+    printer.Printf("%-5s %10s %10s %10s %8s\n", "cpu", "local", "steered", "batches", "per-ipi");
+
+    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus();
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        if (!(cpuMask & (1UL << i)))
+            continue;
+
+        ulong steered = (ulong)Cpus[i].Steered.Get();
+        ulong batches = (ulong)Cpus[i].Batches.Get();
+        printer.Printf("cpu%-2u %10u %10u %10u %8u\n", i, (ulong)Cpus[i].Local.Get(),
+            steered, batches, batches ? steered / batches : 0);
+    }
+}
+
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/cpu.h>
+#include <lib/printer.h>
+#include "block_request.h"
+
+namespace Kernel
+{
+
+/* Completion steering: a request completed by an interrupt on another
+   CPU than the one it was submitted on is handed back to the submitting
+   CPU instead of waking its waiter remotely, so the waiter, its
+   WaitGroup and the request stay in that CPU's cache.
+
+   Each CPU has a lockless list of requests to complete (a stack pushed
+   with compare-and-swap and taken whole by its soft IRQ).  Only the push
+   onto an empty list raises the soft IRQ, so a burst of completions for
+   one CPU costs one IPI.  Requests complete locally when steering is
+   off, the submitting CPU is unknown or its soft IRQ is not running yet
+   (early boot polls for completion).
+
+   Multi-queue devices avoid the hop instead by pinning each queue's
+   completion vector to the CPU that submits on it. */
+class BlockCompletion
+{
+public:
+    static BlockCompletion& GetInstance()
+    {
+        static BlockCompletion Instance;
+        return Instance;
+    }
+
+    /* Register the soft IRQ handler; called once soft IRQs are up. */
+    void Init();
+
+    /* Remember the current CPU as req's submitter. */
+    static void MarkSubmit(BlockRequest* req);
+
+    /* Complete req, on its submitting CPU if that is another one.  The
+       request may be freed by the time this returns. */
+    void Complete(BlockRequest* req, bool success);
+
+    void SetEnabled(bool on);
+    bool GetEnabled();
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    BlockCompletion();
+    ~BlockCompletion();
+    BlockCompletion(const BlockCompletion& other) = delete;
+    BlockCompletion(BlockCompletion&& other) = delete;
+    BlockCompletion& operator=(const BlockCompletion& other) = delete;
+    BlockCompletion& operator=(BlockCompletion&& other) = delete;
+
+    struct CpuList
+    {
+        Atomic Head;        /* BlockRequest*, newest first */
+        Atomic Local;       /* completed on the submitting CPU */
+        Atomic Steered;     /* handed over from another CPU */
+        Atomic Batches;     /* soft IRQs raised for steered requests */
+    } __attribute__((aligned(64)));
+
+    static void SoftIrqHandler(void* ctx);
+    void Drain();
+
+    CpuList Cpus[MaxCpus];
+    Atomic Enabled;
+};
+
+}
@@ -1,7 +1,10 @@
 #include "block_device.h"
 
 #include <kernel/trace.h>
+#include <kernel/parameters.h>
 #include <lib/stdlib.h>
+#include <include/const.h>
+#include <mm/new.h>
 
 namespace Kernel
 {
@@ -18,6 +21,78 @@ bool BlockDevice::GetInterruptsStarted()
     return InterruptsStarted;
 }
 
+void BlockDevice::Submit(BlockRequest* req)
+{
+    bool ok;
+    switch (req->RequestType)
+    {
+    case BlockRequest::Read:
+        ok = ReadSectors(req->Sector, req->Buffer, req->SectorCount);
+        break;
+    case BlockRequest::Write:
+        ok = WriteSectors(req->Sector, req->Buffer, req->SectorCount, req->Fua);
+        break;
+    case BlockRequest::Flush:
+        ok = Flush();
+        break;
+    case BlockRequest::Discard:
+        ok = Discard(req->Sector, req->SectorCount);
+        break;
+    case BlockRequest::WriteZeroes:
+        ok = WriteZeroes(req->Sector, req->SectorCount);
+        break;
+    default:
+        ok = false;
+        break;
+    }
+
+    req->Complete(ok);
+}
+
+bool BlockDevice::Discard(u64 sector, u64 count)
+{
+    (void)sector;
+    (void)count;
+    return false;
+}
+
+bool BlockDevice::WriteZeroes(u64 sector, u64 count)
+{
+    u64 sectorSize = GetSectorSize();
+    if (sectorSize == 0 || sectorSize > Const::PageSize)
+        return false;
+    if (sector > GetCapacity() || count > GetCapacity() - sector)
+        return false;
+
+    void* zeros = Mm::Alloc(Const::PageSize, 0);
+    if (zeros == nullptr)
+        return false;
+    Stdlib::MemSet(zeros, 0, Const::PageSize);
+
+    u32 perPage = (u32)(Const::PageSize / sectorSize);
+    bool ok = true;
+    while (count != 0)
+    {
+        u32 n = (count < perPage) ? (u32)count : perPage;
+        if (!WriteSectors(sector, zeros, n))
+        {
+            ok = false;
+            break;
+        }
+        sector += n;
+        count -= n;
+    }
+
+    Mm::Free(zeros);
+    return ok;
+}
+
+void BlockDevice::SubmitBatch(BlockRequest* const* reqs, ulong count)
+{
+    for (ulong i = 0; i < count; i++)
+        Submit(reqs[i]);
+}
+
 BlockDeviceTable::BlockDeviceTable()
     : Count(0)
 {
@@ -40,9 +115,56 @@ bool BlockDeviceTable::Register(BlockDevice* dev)
     Trace(0, "BlockDevice registered: %s capacity %u sectors",
         dev->GetName(), dev->GetCapacity());
 
+    ApplyPollParameter(dev);
     return true;
 }
 
+/* blkpoll=<mode> applies to every device; blkpoll=<dev>:<mode>[,...]
+   selects per device.  Partitions forward to their parent disk. */
+void BlockDeviceTable::ApplyPollParameter(BlockDevice* dev)
+{
+    const char* spec = Parameters::GetInstance().GetBlkPoll();
+    const char* name = dev->GetName();
+    ulong nameLen = Stdlib::StrLen(name);
+
+    while (*spec != '\0')
+    {
+        const char* end = spec;
+        while (*end != '\0' && *end != ',')
+            end++;
+
+        char entry[32];
+        ulong len = (ulong)(end - spec);
+        if (len >= sizeof(entry))
+            len = sizeof(entry) - 1;
+        Stdlib::MemCpy(entry, spec, len);
+        entry[len] = '\0';
+
+        const char* modeStr = entry;
+        const char* colon = Stdlib::StrChrOnce(entry, ':');
+        bool match = true;
+        if (colon != nullptr)
+        {
+            match = ((ulong)(colon - entry) == nameLen &&
+                     Stdlib::StrnCmp(entry, name, nameLen) == 0);
+            modeStr = colon + 1;
+        }
+
+        if (match)
+        {
+            BlockPollState::Mode mode;
+            if (!BlockPollState::ParseMode(modeStr, mode))
+                Trace(0, "BlockDevice %s: bad blkpoll mode %s", name, modeStr);
+            else if (!dev->SetPollMode(mode))
+                Trace(0, "BlockDevice %s: poll mode %s not supported", name, modeStr);
+            else
+                Trace(0, "BlockDevice %s: poll mode %s", name, modeStr);
+        }
+
+        spec = (*end == ',') ? end + 1 : end;
+    }
+}
+
 BlockDevice* BlockDeviceTable::Find(const char* name)
 {
     for (ulong i = 0; i < Count; i++)
@@ -70,8 +192,15 @@ void BlockDeviceTable::Dump(Stdlib::Printer& printer)
         u64 secSize = Devices[i]->GetSectorSize();
         u64 mb = (cap * secSize) / (1024 * 1024);
 
-        printer.Printf("%s  %u sectors (%u MB)  %u bytes/sector\n",
-            Devices[i]->GetName(), cap, mb, secSize);
+        printer.Printf("%s  %u sectors (%u MB)  %u bytes/sector%s%s",
+            Devices[i]->GetName(), cap, mb, secSize,
+            Devices[i]->SupportsDiscard() ? "  discard" : "",
+            Devices[i]->SupportsWriteZeroes() ? "  write-zeroes" : "");
+
+        ulong queues = Devices[i]->GetQueueCount();
+        if (queues > 1)
+            printer.Printf("  %u queues", queues);
+        printer.Printf("\n");
     }
 }
 
@@ -2,13 +2,19 @@
 
 #include <include/types.h>
 #include <lib/printer.h>
+#include "block_poll.h"
+#include "block_request.h"
+#include "io_scheduler.h"
 
 namespace Kernel
 {
 
+class BlockStats;
+
 class BlockDevice
 {
 public:
+    BlockDevice() : TraceId(0) {}
     virtual ~BlockDevice() {}
     virtual const char* GetName() = 0;
     virtual u64 GetCapacity() = 0;         /* Total sectors */
@@ -17,6 +23,49 @@ public:
     virtual bool ReadSectors(u64 sector, void* buf, u32 count) = 0;
     virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) = 0;
 
+    /* Discard tells the device the sectors are unused; afterwards they
+       read back as undefined data.  Devices without support return
+       false.  WriteZeroes zeroes sectors without a data transfer where
+       the device supports it and falls back to writing zero pages. */
+    virtual bool SupportsDiscard() { return false; }
+    virtual bool SupportsWriteZeroes() { return false; }
+    virtual bool Discard(u64 sector, u64 count);
+    virtual bool WriteZeroes(u64 sector, u64 count);
+
+    /* Asynchronous interface.  Submit queues req and returns; the device
+       sets req->Success and signals req->Completion when done.  Buffers
+       follow the ReadSectors/WriteSectors rules.  SubmitBatch queues all
+       requests before starting any, so the scheduler can merge them.
+       Stacking devices may rewrite req->Sector.  The default
+       implementation completes synchronously. */
+    virtual void Submit(BlockRequest* req);
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count);
+
+    /* Wait for a submitted request (polls before interrupts are up). */
+    virtual void WaitRequest(BlockRequest& req) { req.Completion.Wait(); }
+
+    /* Hardware submission queues; multi-queue devices submit on the
+       current CPU's queue. */
+    virtual ulong GetQueueCount() { return 1; }
+
+    /* I/O statistics, nullptr if the device does not keep them. */
+    virtual BlockStats* GetStats() { return nullptr; }
+
+    /* Request tracing (see BlockTrace): devices with a request queue
+       record their queue events while TraceId is nonzero. */
+    virtual bool SupportsTrace() { return false; }
+    u8 GetTraceId() { return TraceId; }
+    void SetTraceId(u8 id) { TraceId = id; }
+
+    /* Request queue with the I/O scheduler, nullptr if the device has none. */
+    virtual IoQueue* GetIoQueue() { return nullptr; }
+
+    /* Completion mode for synchronous I/O (see BlockPollState).
+       Devices that cannot poll only accept Off. */
+    virtual bool SetPollMode(BlockPollState::Mode mode) { return mode == BlockPollState::Off; }
+    virtual BlockPollState::Mode GetPollMode() { return BlockPollState::Off; }
+    virtual void DumpPollStats(Stdlib::Printer& printer) { (void)printer; }
+
     /* Set once interrupts and the scheduler are running.
        Before this, synchronous I/O must poll for completion. */
     static void SetInterruptsStarted();
@@ -24,6 +73,8 @@ public:
 
 private:
     static bool InterruptsStarted;
+
+    volatile u8 TraceId;
 };
 
 class BlockDeviceTable
@@ -48,6 +99,9 @@ public:
     static const ulong MaxDevices = 48;
 
 private:
+    /* Apply the blkpoll= kernel parameter to a newly registered device. */
+    void ApplyPollParameter(BlockDevice* dev);
+
     BlockDeviceTable();
     ~BlockDeviceTable();
     BlockDeviceTable(const BlockDeviceTable& other) = delete;
@@ -0,0 +1,105 @@
+#include "block_poll.h"
+
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+BlockPollState::BlockPollState()
+    : PollMode(Off)
+    , AvgLatencyNs(0)
+{
+}
+
+BlockPollState::~BlockPollState()
+{
+}
+
+void BlockPollState::SetMode(Mode mode)
+{
+    PollMode = mode;
+}
+
+BlockPollState::Mode BlockPollState::GetMode()
+{
+    return PollMode;
+}
+
+ulong BlockPollState::GetSleepNs()
+{
+    if (PollMode != Hybrid)
+        return 0;
+
+    ulong sleepNs = AvgLatencyNs / 2;
+    if (sleepNs < MinSleepNs)
+        return 0;
+    return sleepNs;
+}
+
+ulong BlockPollState::GetSpinBudgetNs()
+{
+    ulong avg = AvgLatencyNs;
+    if (avg == 0)
+        return MaxSpinNs;  /* no samples yet: learn from the first I/Os */
+    if (avg > MaxSpinNs)
+        return MinSpinNs;
+
+    ulong budget = 2 * avg;
+    if (budget < MinSpinNs)
+        budget = MinSpinNs;
+    if (budget > MaxSpinNs)
+        budget = MaxSpinNs;
+    return budget;
+}
+
+void BlockPollState::Account(ulong latencyNs, bool polled)
+{
+    ulong avg = AvgLatencyNs;
+    if (avg == 0)
+        avg = latencyNs;
+    else
+        avg = avg - avg / 8 + latencyNs / 8;
+    AvgLatencyNs = avg;
+
+    if (polled)
+        PolledCount.Inc();
+    else
+        FallbackCount.Inc();
+}
+
+void BlockPollState::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("mode %s avg %u ns budget %u ns polled %u fallback %u\n",
+        ModeName(PollMode), AvgLatencyNs, GetSpinBudgetNs(),
+        PolledCount.Get(), FallbackCount.Get());
+}
+
+const char* BlockPollState::ModeName(Mode mode)
+{
+    switch (mode)
+    {
+    case Off:
+        return "off";
+    case Spin:
+        return "poll";
+    case Hybrid:
+        return "hybrid";
+    default:
+        return "unknown";
+    }
+}
+
+bool BlockPollState::ParseMode(const char* str, Mode& mode)
+{
+    if (Stdlib::StrCmp(str, "off") == 0)
+        mode = Off;
+    else if (Stdlib::StrCmp(str, "poll") == 0)
+        mode = Spin;
+    else if (Stdlib::StrCmp(str, "hybrid") == 0)
+        mode = Hybrid;
+    else
+        return false;
+    return true;
+}
+
+}
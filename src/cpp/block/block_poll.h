@@ -0,0 +1,65 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* Adaptive state for polled I/O completion, one per device (or queue).
+
+   The spin budget tracks an EWMA of observed completion latency: the
+   submitter spins for about twice the expected latency, clamped to
+   [MinSpinNs, MaxSpinNs].  A device slower than MaxSpinNs only gets
+   MinSpinNs of spinning -- there polling buys nothing over the
+   interrupt and would just burn the CPU.  Hybrid mode first sleeps for
+   half the expected latency, then spins for the remainder. */
+class BlockPollState
+{
+public:
+    enum Mode : u8
+    {
+        Off = 0,    /* wait for the completion interrupt */
+        Spin,       /* spin on the completion ring, then fall back */
+        Hybrid,     /* sleep ~half the expected latency, then spin */
+    };
+
+    BlockPollState();
+    ~BlockPollState();
+
+    void SetMode(Mode mode);
+    Mode GetMode();
+
+    /* Nanoseconds to sleep before spinning (Hybrid only, 0 otherwise). */
+    ulong GetSleepNs();
+
+    /* Nanoseconds to spin before falling back to the interrupt. */
+    ulong GetSpinBudgetNs();
+
+    /* Record one completed request.  latencyNs is measured from submit;
+       polled is true if the completion was observed while spinning. */
+    void Account(ulong latencyNs, bool polled);
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const char* ModeName(Mode mode);
+    static bool ParseMode(const char* str, Mode& mode);
+
+    static const ulong MinSpinNs = 2000;
+    static const ulong MaxSpinNs = 100000;
+    static const ulong MinSleepNs = 10000;
+
+private:
+    BlockPollState(const BlockPollState& other) = delete;
+    BlockPollState(BlockPollState&& other) = delete;
+    BlockPollState& operator=(const BlockPollState& other) = delete;
+    BlockPollState& operator=(BlockPollState&& other) = delete;
+
+    volatile Mode PollMode;
+    volatile ulong AvgLatencyNs;    /* EWMA, weight 1/8; racy updates are benign */
+    Atomic PolledCount;
+    Atomic FallbackCount;
+};
+
+}
@@ -0,0 +1,518 @@
+#include "block_qos.h"
+#include "block_device.h"
+#include "io_scheduler.h"
+
+#include <kernel/softirq.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+const ulong BlockQos::DefaultWeight[ClassMax] = { 8, 4, 1 };
+
+static BlockRequest* LinkToRequest(Stdlib::ListEntry* entry)
+{
+    return CONTAINING_RECORD(entry, BlockRequest, Link);
+}
+
+BlockQos::BlockQos(SpinLock& queueLock)
+    : QueueLock(queueLock)
+    , Enabled(false)
+    , QueuedFlushes(0)
+    , GlobalVTime(0)
+    , TargetNs(0)
+    , BackgroundDepth(AdmitWindow)
+    , WindowStart(0)
+    , WindowSamples(0)
+    , WindowMisses(0)
+{
+    Stdlib::MemSet(Classes, 0, sizeof(Classes));
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        Classes[i].Fifo.Init();
+        Classes[i].Weight = DefaultWeight[i];
+    }
+    Stdlib::MemSet(WindowHist, 0, sizeof(WindowHist));
+}
+
+BlockQos::~BlockQos()
+{
+}
+
+bool BlockQos::SetIopsLimit(BlockRequest::Class cls, ulong iops)
+{
+    if (cls >= ClassMax)
+        return false;
+
+    Stdlib::AutoLock lock(QueueLock);
+    Classes[cls].IopsLimit = iops;
+    Classes[cls].IopsFullTime = 0;
+    return true;
+}
+
+bool BlockQos::SetKbpsLimit(BlockRequest::Class cls, ulong kbps)
+{
+    if (cls >= ClassMax)
+        return false;
+
+    Stdlib::AutoLock lock(QueueLock);
+    Classes[cls].KbpsLimit = kbps;
+    Classes[cls].BytesFullTime = 0;
+    return true;
+}
+
+bool BlockQos::SetWeight(BlockRequest::Class cls, ulong weight)
+{
+    if (cls >= ClassMax || weight == 0 || weight > MaxWeight)
+        return false;
+
+    Stdlib::AutoLock lock(QueueLock);
+    Classes[cls].Weight = weight;
+    return true;
+}
+
+void BlockQos::SetLatencyTarget(u64 targetNs)
+{
+    Stdlib::AutoLock lock(QueueLock);
+    TargetNs = targetNs;
+    BackgroundDepth = AdmitWindow;
+    WindowStart = GetBootTime().GetValue();
+    WindowSamples = 0;
+    Stdlib::MemSet(WindowHist, 0, sizeof(WindowHist));
+}
+
+bool BlockQos::GetEnabled()
+{
+    return Enabled;
+}
+
+void BlockQos::SetEnabledLocked(bool enabled)
+{
+    Enabled = enabled;
+}
+
+void BlockQos::Queue(BlockRequest* req)
+{
+    ClassState& cs = Classes[req->IoClass];
+
+    /* An idle class does not keep the credit it would have earned */
+    if (cs.Queued == 0 && cs.VTime < GlobalVTime)
+        cs.VTime = GlobalVTime;
+
+    cs.Fifo.InsertTail(&req->Link);
+    cs.Queued++;
+    if (req->RequestType == BlockRequest::Flush)
+        QueuedFlushes++;
+}
+
+ulong BlockQos::Cost(BlockRequest* req)
+{
+    /* Sectors plus a fixed per-request cost of a 4 KB transfer */
+    return (req->HasData() ? req->SectorCount : 0) + 8;
+}
+
+u64 BlockQos::OldestFlushSeq()
+{
+    u64 oldest = ~0ULL;
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ClassState& cs = Classes[i];
+        for (Stdlib::ListEntry* e = cs.Fifo.Flink; e != &cs.Fifo; e = e->Flink)
+        {
+            BlockRequest* req = LinkToRequest(e);
+            if (req->RequestType == BlockRequest::Flush)
+            {
+                if (req->Seq < oldest)
+                    oldest = req->Seq;
+                break;
+            }
+        }
+    }
+    return oldest;
+}
+
+bool BlockQos::Throttle(ClassState& cs, u64 now)
+{
+    bool held = false;
+
+    if (&cs == &Classes[BlockRequest::ClassBackground] && TargetNs != 0 &&
+        cs.Outstanding >= BackgroundDepth)
+    {
+        /* Completions of the outstanding requests re-run dispatch */
+        held = true;
+    }
+    else if ((cs.IopsLimit != 0 && cs.IopsFullTime > now + BurstNs) ||
+             (cs.KbpsLimit != 0 && cs.BytesFullTime > now + BurstNs))
+    {
+        held = true;
+        BlockQosTimer::GetInstance().Arm();
+    }
+
+    if (held && !cs.HeadHeld)
+    {
+        cs.HeadHeld = true;
+        cs.Throttled++;
+    }
+    return held;
+}
+
+BlockRequest* BlockQos::Admit(u64 now, u32 sectorSize)
+{
+    u64 barrier = (QueuedFlushes != 0) ? OldestFlushSeq() : ~0ULL;
+
+    ClassState* best = nullptr;
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ClassState& cs = Classes[i];
+        if (cs.Queued == 0)
+            continue;
+
+        BlockRequest* req = LinkToRequest(cs.Fifo.Flink);
+        if (req->Seq > barrier)
+            continue;
+
+        if (req->RequestType == BlockRequest::Flush)
+        {
+            /* The barrier itself: only once every older request is gone */
+            bool older = false;
+            for (ulong j = 0; j < ClassMax; j++)
+            {
+                if (j != i && Classes[j].Queued != 0 &&
+                    LinkToRequest(Classes[j].Fifo.Flink)->Seq < req->Seq)
+                    older = true;
+            }
+            if (older)
+                continue;
+        }
+        else if (QueuedFlushes != 0 && req->Seq < barrier)
+        {
+            /* Ahead of a flush: not held back, or the flush and whoever
+               waits on it would inherit this class's limits */
+        }
+        else if (Throttle(cs, now))
+        {
+            continue;
+        }
+
+        if (best == nullptr || cs.VTime < best->VTime)
+            best = &cs;
+    }
+
+    if (best == nullptr)
+        return nullptr;
+
+    BlockRequest* req = LinkToRequest(best->Fifo.RemoveHead());
+    best->Queued--;
+    best->HeadHeld = false;
+    if (req->RequestType == BlockRequest::Flush)
+        QueuedFlushes--;
+
+    if (best->IopsLimit != 0)
+    {
+        u64 start = (best->IopsFullTime > now) ? best->IopsFullTime : now;
+        best->IopsFullTime = start + Const::NanoSecsInSec / best->IopsLimit;
+    }
+    if (best->KbpsLimit != 0 && req->HasData())
+    {
+        u64 bytes = (u64)req->SectorCount * sectorSize;
+        u64 start = (best->BytesFullTime > now) ? best->BytesFullTime : now;
+        best->BytesFullTime = start + bytes * Const::NanoSecsInSec / (best->KbpsLimit * Const::KB);
+    }
+
+    GlobalVTime = best->VTime;
+    best->VTime += Cost(req) * MaxWeight / best->Weight;
+    return req;
+}
+
+BlockRequest* BlockQos::TakeOldest()
+{
+    ClassState* oldest = nullptr;
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ClassState& cs = Classes[i];
+        if (cs.Queued == 0)
+            continue;
+        if (oldest == nullptr ||
+            LinkToRequest(cs.Fifo.Flink)->Seq < LinkToRequest(oldest->Fifo.Flink)->Seq)
+            oldest = &cs;
+    }
+
+    if (oldest == nullptr)
+        return nullptr;
+
+    BlockRequest* req = LinkToRequest(oldest->Fifo.RemoveHead());
+    oldest->Queued--;
+    oldest->HeadHeld = false;
+    if (req->RequestType == BlockRequest::Flush)
+        QueuedFlushes--;
+    return req;
+}
+
+void BlockQos::Admitted(BlockRequest* req)
+{
+    Classes[req->IoClass].Outstanding++;
+}
+
+void BlockQos::Done(BlockRequest* req, bool success, u64 now, u32 sectorSize)
+{
+    ClassState& cs = Classes[req->IoClass];
+    u64 latency = (now > req->SubmitTime) ? now - req->SubmitTime : 0;
+    ulong bucket = BlockStats::Bucket(latency);
+
+    cs.Ops++;
+    if (success && req->HasData())
+        cs.Bytes += (u64)req->SectorCount * sectorSize;
+    cs.LatencyNs += latency;
+    cs.Hist[bucket]++;
+    if (cs.Outstanding != 0)
+        cs.Outstanding--;
+
+    if (TargetNs == 0)
+        return;
+
+    if (req->IoClass == BlockRequest::ClassForeground)
+    {
+        WindowHist[bucket]++;
+        WindowSamples++;
+    }
+
+    if (now - WindowStart >= WindowNs)
+        EndWindow(now);
+}
+
+void BlockQos::EndWindow(u64 now)
+{
+    if (WindowSamples >= WindowMinSamples)
+    {
+        ulong target = (WindowSamples * 990 + 999) / 1000;
+        ulong seen = 0;
+        ulong bucket = 0;
+        for (; bucket < BlockStats::HistBuckets - 1; bucket++)
+        {
+            seen += WindowHist[bucket];
+            if (seen >= target)
+                break;
+        }
+
+        if (BlockStats::BucketLimitNs(bucket) > TargetNs)
+        {
+            BackgroundDepth = (BackgroundDepth > 1) ? BackgroundDepth / 2 : 1;
+            WindowMisses++;
+        }
+        else if (BackgroundDepth < AdmitWindow)
+        {
+            BackgroundDepth++;
+        }
+    }
+    else if (WindowSamples == 0 && BackgroundDepth < AdmitWindow)
+    {
+        /* No foreground I/O to protect */
+        BackgroundDepth++;
+    }
+
+    WindowStart = now;
+    WindowSamples = 0;
+    Stdlib::MemSet(WindowHist, 0, sizeof(WindowHist));
+}
+
+void BlockQos::Read(Snapshot& snap)
+{
+    Stdlib::AutoLock lock(QueueLock);
+
+    snap.TimeNs = GetBootTime().GetValue();
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ClassState& cs = Classes[i];
+        snap.Ops[i] = cs.Ops;
+        snap.Bytes[i] = cs.Bytes;
+        snap.Throttled[i] = cs.Throttled;
+        snap.Outstanding[i] = cs.Outstanding + cs.Queued;
+        snap.LatencyNs[i] = cs.LatencyNs;
+        Stdlib::MemCpy(snap.Hist[i], cs.Hist, sizeof(cs.Hist));
+    }
+}
+
+const char* BlockQos::ClassName(BlockRequest::Class cls)
+{
+    switch (cls)
+    {
+    case BlockRequest::ClassForeground:
+        return "fg";
+    case BlockRequest::ClassDefault:
+        return "default";
+    case BlockRequest::ClassBackground:
+        return "bg";
+    default:
+        return "?";
+    }
+}
+
+bool BlockQos::ParseClass(const char* name, BlockRequest::Class& cls)
+{
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        if (Stdlib::StrCmp(name, ClassName((BlockRequest::Class)i)) == 0)
+        {
+            cls = (BlockRequest::Class)i;
+            return true;
+        }
+    }
+    return false;
+}
+
+static u64 ClassPercentile(const BlockQos::Snapshot& cur, const BlockQos::Snapshot* prev,
+                           ulong cls, ulong permille)
+{
+    ulong total = 0;
+    for (ulong b = 0; b < BlockStats::HistBuckets; b++)
+        total += cur.Hist[cls][b] - (prev ? prev->Hist[cls][b] : 0);
+    if (total == 0)
+        return 0;
+
+    ulong target = (total * permille + 999) / 1000;
+    ulong seen = 0;
+    for (ulong b = 0; b < BlockStats::HistBuckets; b++)
+    {
+        seen += cur.Hist[cls][b] - (prev ? prev->Hist[cls][b] : 0);
+        if (seen >= target)
+            return BlockStats::BucketLimitNs(b);
+    }
+    return BlockStats::BucketLimitNs(BlockStats::HistBuckets - 1);
+}
+
+void BlockQos::PrintHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%-8s %-7s %8s %8s %10s %5s %7s %8s %8s %8s\n",
+        "device", "class", "ops", "iops", "KB/s", "queue", "thrtl",
+        "avg-us", "p50-us", "p99-us");
+}
+
+void BlockQos::Print(const char* name, const Snapshot& cur, const Snapshot* prev,
+                     Stdlib::Printer& printer)
+{
+    u64 spanNs = prev ? cur.TimeNs - prev->TimeNs : cur.TimeNs;
+    u64 spanUs = spanNs / Const::NanoSecsInUsec;
+    if (spanUs == 0)
+        spanUs = 1;
+
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ulong ops = cur.Ops[i] - (prev ? prev->Ops[i] : 0);
+        if (ops == 0 && cur.Outstanding[i] == 0)
+            continue;
+
+        u64 bytes = cur.Bytes[i] - (prev ? prev->Bytes[i] : 0);
+        ulong throttled = cur.Throttled[i] - (prev ? prev->Throttled[i] : 0);
+        u64 latency = cur.LatencyNs[i] - (prev ? prev->LatencyNs[i] : 0);
+
+        printer.Printf("%-8s %-7s %8u %8u %10u %5u %7u %8u %8u %8u\n",
+            name, ClassName((BlockRequest::Class)i), ops,
+            (u64)ops * 1000000 / spanUs,
+            bytes / Const::KB * 1000000 / spanUs,
+            cur.Outstanding[i], throttled,
+            ops ? latency / ops / Const::NanoSecsInUsec : 0,
+            ClassPercentile(cur, prev, i, 500) / Const::NanoSecsInUsec,
+            ClassPercentile(cur, prev, i, 990) / Const::NanoSecsInUsec);
+    }
+}
+
+void BlockQos::DumpAll(Stdlib::Printer& printer)
+{
+    Snapshot* snap = new (Mm::NoThrow) Snapshot;
+    if (snap == nullptr)
+        return;
+
+    auto& table = BlockDeviceTable::GetInstance();
+    PrintHeader(printer);
+    for (ulong i = 0; i < table.GetCount(); i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        IoQueue* queue = dev ? dev->GetIoQueue() : nullptr;
+        if (queue == nullptr)
+            continue;
+
+        /* Partitions share their disk's queue */
+        bool shared = false;
+        for (ulong j = 0; j < i; j++)
+        {
+            BlockDevice* other = table.GetDevice(j);
+            if (other && other->GetIoQueue() == queue)
+                shared = true;
+        }
+        if (shared)
+            continue;
+
+        queue->GetQos().Read(*snap);
+        Print(dev->GetName(), *snap, nullptr, printer);
+    }
+    delete snap;
+}
+
+void BlockQos::Dump(Stdlib::Printer& printer)
+{
+    ClassState snap[ClassMax];
+    bool enabled;
+    u64 targetNs;
+    ulong depth;
+    ulong misses;
+    {
+        Stdlib::AutoLock lock(QueueLock);
+        Stdlib::MemCpy(snap, Classes, sizeof(snap));
+        enabled = Enabled;
+        targetNs = TargetNs;
+        depth = BackgroundDepth;
+        misses = WindowMisses;
+    }
+
+    printer.Printf("  qos %s", enabled ? "on" : "off");
+    if (targetNs != 0)
+        printer.Printf(", fg p99 target %u us, bg depth %u/%u, %u windows missed",
+            targetNs / Const::NanoSecsInUsec, depth, AdmitWindow, misses);
+    printer.Printf("\n");
+
+    for (ulong i = 0; i < ClassMax; i++)
+    {
+        ClassState& cs = snap[i];
+        printer.Printf("  %-7s weight %u iops %u KB/s %u queued %u outstanding %u throttled %u\n",
+            ClassName((BlockRequest::Class)i), cs.Weight, cs.IopsLimit, cs.KbpsLimit,
+            cs.Queued, cs.Outstanding, cs.Throttled);
+    }
+}
+
+BlockQosTimer::BlockQosTimer()
+{
+}
+
+BlockQosTimer::~BlockQosTimer()
+{
+}
+
+void BlockQosTimer::Start()
+{
+    if (Started.Cmpxchg(1, 0) != 0)
+        return;
+
+    Stdlib::Time period(BlockQos::RekickPeriodMs * Const::NanoSecsInMs);
+    if (!TimerTable::GetInstance().StartTimer(*this, period))
+    {
+        Trace(0, "BlockQos: failed to start timer");
+        Started.Set(0);
+    }
+}
+
+void BlockQosTimer::Arm()
+{
+    Armed.Set(1);
+}
+
+void BlockQosTimer::OnTick(TimerCallback& callback)
+{
+    (void)callback;
+    if (Armed.Cmpxchg(0, 1) == 1)
+        SoftIrq::GetInstance().Raise(SoftIrq::TypeBlkIo);
+}
+
+}
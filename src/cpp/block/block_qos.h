@@ -0,0 +1,196 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <block/block_request.h>
+#include <block/block_stats.h>
+#include <kernel/atomic.h>
+#include <kernel/spin_lock.h>
+#include <kernel/timer.h>
+#include <lib/list_entry.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+class IoQueue;
+
+namespace Test
+{
+class BlockQosTest;
+}
+
+/* Per-class QoS in front of a device's I/O scheduler.
+
+   While enabled, queued requests wait in one FIFO per I/O class
+   (BlockRequest::Class) and the IoQueue admits them into the scheduler
+   only a few at a time (AdmitWindow), so the order the classes reach
+   the device is decided here:
+
+   - weighted fair queueing: among the classes allowed to go, the one
+     with the smallest virtual time is admitted and its virtual time
+     advances by the request cost divided by the class weight; a class
+     that was idle restarts at the current virtual time instead of
+     spending credit it banked while idle;
+   - token buckets: optional IOPS and KB/s caps per class, kept as the
+     time at which each bucket is full again (a request goes when that
+     time is at most BurstNs ahead);
+   - latency target: with a foreground p99 target set, every
+     WindowNs the foreground p99 of the window is compared against it;
+     a miss halves the number of background requests allowed
+     outstanding, a met window raises it by one up to AdmitWindow.
+
+   Flushes keep their barrier semantics across classes: requests
+   submitted before a queued flush are admitted regardless of their
+   class limits, the flush goes once nothing older is left here and
+   nothing younger passes it.
+
+   Per-class accounting (requests, bytes, requests held back, latency
+   from queueing to completion and its histogram) is kept whether or not
+   QoS is enabled.  Everything except the public configuration and
+   statistics methods runs under the owning IoQueue's lock. */
+class BlockQos
+{
+public:
+    static const ulong ClassMax = BlockRequest::ClassMax;
+
+    struct Snapshot
+    {
+        u64 TimeNs;
+        ulong Ops[ClassMax];
+        u64 Bytes[ClassMax];
+        ulong Throttled[ClassMax];
+        ulong Outstanding[ClassMax];
+        u64 LatencyNs[ClassMax];
+        ulong Hist[ClassMax][BlockStats::HistBuckets];
+    };
+
+    BlockQos(SpinLock& queueLock);
+    ~BlockQos();
+
+    /* 0 removes the cap; weights are 1..MaxWeight. */
+    bool SetIopsLimit(BlockRequest::Class cls, ulong iops);
+    bool SetKbpsLimit(BlockRequest::Class cls, ulong kbps);
+    bool SetWeight(BlockRequest::Class cls, ulong weight);
+
+    /* Foreground p99 target in ns, 0 turns latency-target mode off. */
+    void SetLatencyTarget(u64 targetNs);
+
+    bool GetEnabled();
+
+    void Read(Snapshot& snap);
+
+    static const char* ClassName(BlockRequest::Class cls);
+    static bool ParseClass(const char* name, BlockRequest::Class& cls);
+
+    /* Rates over [prev, cur) per class with any activity, or averages
+       since boot if prev is nullptr. */
+    static void Print(const char* name, const Snapshot& cur, const Snapshot* prev,
+                      Stdlib::Printer& printer);
+    static void PrintHeader(Stdlib::Printer& printer);
+
+    /* Totals since boot for every request queue. */
+    static void DumpAll(Stdlib::Printer& printer);
+
+    /* Configuration and per-class state. */
+    void Dump(Stdlib::Printer& printer);
+
+    static const ulong AdmitWindow = 8;
+    static const ulong MaxWeight = 1000;
+    static const ulong DefaultWeight[ClassMax];
+    static const u64 BurstNs = 20 * Const::NanoSecsInMs;
+    static const u64 WindowNs = 250 * Const::NanoSecsInMs;
+    static const ulong WindowMinSamples = 8;
+    static const ulong RekickPeriodMs = 5;
+
+private:
+    BlockQos(const BlockQos& other) = delete;
+    BlockQos(BlockQos&& other) = delete;
+    BlockQos& operator=(const BlockQos& other) = delete;
+    BlockQos& operator=(BlockQos&& other) = delete;
+
+    friend class IoQueue;
+
+    /* Drives admission with its own clock */
+    friend class Test::BlockQosTest;
+
+    struct ClassState
+    {
+        Stdlib::ListEntry Fifo;
+        ulong Queued;
+        ulong Weight;
+        ulong IopsLimit;
+        ulong KbpsLimit;
+        u64 IopsFullTime;      /* token buckets, see above */
+        u64 BytesFullTime;
+        u64 VTime;
+        bool HeadHeld;          /* head already counted as throttled */
+
+        ulong Ops;
+        u64 Bytes;
+        ulong Throttled;
+        ulong Outstanding;      /* admitted to the scheduler, not completed */
+        u64 LatencyNs;
+        ulong Hist[BlockStats::HistBuckets];
+    };
+
+    /* Called by IoQueue under its lock. */
+    void SetEnabledLocked(bool enabled);
+    void Queue(BlockRequest* req);
+    BlockRequest* Admit(u64 now, u32 sectorSize);
+    BlockRequest* TakeOldest();
+    void Admitted(BlockRequest* req);
+    void Done(BlockRequest* req, bool success, u64 now, u32 sectorSize);
+
+    static ulong Cost(BlockRequest* req);
+    bool Throttle(ClassState& cs, u64 now);
+    u64 OldestFlushSeq();
+    void EndWindow(u64 now);
+
+    SpinLock& QueueLock;
+    bool Enabled;
+    ClassState Classes[ClassMax];
+    ulong QueuedFlushes;
+    u64 GlobalVTime;
+
+    u64 TargetNs;
+    ulong BackgroundDepth;
+    u64 WindowStart;
+    ulong WindowHist[BlockStats::HistBuckets];
+    ulong WindowSamples;
+    ulong WindowMisses;
+};
+
+/* Periodic kick for queues whose classes are held back by a token
+   bucket: completions do not arrive to re-run dispatch when nothing is
+   in flight, so the timer raises the block I/O soft IRQ instead. */
+class BlockQosTimer final : public TimerCallback
+{
+public:
+    static BlockQosTimer& GetInstance()
+    {
+        static BlockQosTimer instance;
+        return instance;
+    }
+
+    /* Start the timer on first use. */
+    void Start();
+
+    /* Request a soft IRQ on the next tick. */
+    void Arm();
+
+    virtual void OnTick(TimerCallback& callback) override;
+
+private:
+    BlockQosTimer();
+    ~BlockQosTimer();
+    BlockQosTimer(const BlockQosTimer& other) = delete;
+    BlockQosTimer(BlockQosTimer&& other) = delete;
+    BlockQosTimer& operator=(const BlockQosTimer& other) = delete;
+    BlockQosTimer& operator=(BlockQosTimer&& other) = delete;
+
+    Atomic Started;
+    Atomic Armed;
+};
+
+}
@@ -9,9 +9,23 @@ namespace Kernel
 
 struct BlockRequest
 {
-    enum Type : u8 { Read, Write, Flush };
+    /* Discard and WriteZeroes describe the sector range only and carry
+       no Buffer. */
+    enum Type : u8 { Read, Write, Flush, Discard, WriteZeroes };
+
+    /* I/O class for QoS (see BlockQos).  Requests left at ClassUnset
+       take the class of the submitting task. */
+    enum Class : u8
+    {
+        ClassForeground = 0,
+        ClassDefault,
+        ClassBackground,
+        ClassMax,
+        ClassUnset = 0xFF,
+    };
 
     Type RequestType;
+    Class IoClass;
     bool Fua;
     u64 Sector;
     u32 SectorCount;
@@ -20,14 +34,69 @@ struct BlockRequest
     WaitGroup Completion;   /* Init to 1 */
     Stdlib::ListEntry Link;
 
+    /* Optional completion hook for stacking devices: when set, Complete()
+       calls it instead of signalling Completion.  It runs in the
+       completing context, possibly an interrupt handler. */
+    void (*EndIo)(BlockRequest* req);
+    void* EndIoCtx;
+
+    /* I/O scheduler state, owned by the device queue between Submit and
+       completion.  A dispatched request may carry a chain of requests
+       merged behind it (MergeNext, in sector order); the head describes
+       the whole chain through TotalSectors/Segments, every member keeps
+       its own Sector/SectorCount/Buffer and is completed individually. */
+    Stdlib::ListEntry SortLink;
+    BlockRequest* MergeNext;
+    BlockRequest* MergeTail;
+    u32 TotalSectors;
+    u32 Segments;
+    u64 Seq;                /* submission order, for barriers */
+    u64 SubmitTime;         /* boot time ns */
+    u64 StatTime;           /* boot time ns, set by BlockStats::Start */
+
+    /* Completion steering (see BlockCompletion): the CPU the request was
+       queued on and the link in that CPU's completion list. */
+    u32 SubmitCpu;
+    BlockRequest* DoneNext;
+
+    static const u32 NoCpu = ~0U;
+
+    bool HasData() const
+    {
+        return RequestType == Read || RequestType == Write;
+    }
+
+    /* Set the result and signal the submitter.  The request may be freed
+       by the time this returns. */
+    void Complete(bool success)
+    {
+        Success = success;
+        if (EndIo != nullptr)
+            EndIo(this);
+        else
+            Completion.Done();
+    }
+
     BlockRequest()
         : RequestType(Read)
+        , IoClass(ClassUnset)
         , Fua(false)
         , Sector(0)
         , SectorCount(0)
         , Buffer(nullptr)
         , Success(false)
         , Completion(1)
+        , EndIo(nullptr)
+        , EndIoCtx(nullptr)
+        , MergeNext(nullptr)
+        , MergeTail(nullptr)
+        , TotalSectors(0)
+        , Segments(0)
+        , Seq(0)
+        , SubmitTime(0)
+        , StatTime(0)
+        , SubmitCpu(NoCpu)
+        , DoneNext(nullptr)
     {
     }
 };
@@ -0,0 +1,236 @@
+#include "block_stats.h"
+#include "block_device.h"
+
+#include <include/const.h>
+#include <kernel/time.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+BlockStats::BlockStats()
+    : SectorSize(512)
+{
+}
+
+BlockStats::~BlockStats()
+{
+}
+
+BlockStats::Op BlockStats::GetOp(BlockRequest::Type type)
+{
+    switch (type)
+    {
+    case BlockRequest::Read:
+        return OpRead;
+    case BlockRequest::Write:
+        return OpWrite;
+    case BlockRequest::Flush:
+        return OpFlush;
+    default:
+        return OpDiscard;
+    }
+}
+
+void BlockStats::SetSectorSize(u32 sectorSize)
+{
+    SectorSize = sectorSize;
+}
+
+const char* BlockStats::OpName(Op op)
+{
+    switch (op)
+    {
+    case OpRead:
+        return "read";
+    case OpWrite:
+        return "write";
+    case OpFlush:
+        return "flush";
+    case OpDiscard:
+        return "discard";
+    default:
+        return "?";
+    }
+}
+
+ulong BlockStats::Bucket(u64 latencyNs)
+{
+    u64 us = latencyNs / Const::NanoSecsInUsec;
+    if (us == 0)
+        return 0;
+
+    ulong log = 63 - (ulong)__builtin_clzll(us);
+    ulong half = (log > 0) ? (ulong)((us >> (log - 1)) & 1) : 0;
+    ulong bucket = 1 + 2 * log + half;
+    return (bucket < HistBuckets) ? bucket : HistBuckets - 1;
+}
+
+u64 BlockStats::BucketLimitNs(ulong bucket)
+{
+    if (bucket == 0)
+        return Const::NanoSecsInUsec;
+
+    ulong log = (bucket - 1) / 2;
+    ulong half = (bucket - 1) % 2;
+    u64 us = (1ULL << log) + (half + 1) * ((log > 0) ? (1ULL << (log - 1)) : 1);
+    return us * Const::NanoSecsInUsec;
+}
+
+BlockStats::CpuStats& BlockStats::Local()
+{
+    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
+    return Cpus[(cpu < MaxCpus) ? cpu : 0];
+}
+
+void BlockStats::Account(CpuStats& cpu, Op op, u64 latencyNs, u64 bytes, bool success)
+{
+    cpu.Inflight[op].Dec();
+    cpu.Ops[op].Inc();
+    if (success)
+        cpu.Bytes[op].Add((long)bytes);
+    else
+        cpu.Errors[op].Inc();
+    cpu.LatencyNs[op].Add((long)latencyNs);
+    cpu.Hist[op][Bucket(latencyNs)].Inc();
+}
+
+void BlockStats::Start(BlockRequest* req)
+{
+    req->StatTime = GetBootTime().GetValue();
+    Local().Inflight[GetOp(req->RequestType)].Inc();
+}
+
+void BlockStats::Done(BlockRequest* req, bool success)
+{
+    u64 now = GetBootTime().GetValue();
+    CpuStats& cpu = Local();
+
+    for (BlockRequest* cur = req; cur != nullptr; cur = cur->MergeNext)
+    {
+        Op op = GetOp(cur->RequestType);
+        u64 latency = (now > cur->StatTime) ? now - cur->StatTime : 0;
+        u64 bytes = cur->HasData() ? (u64)cur->SectorCount * SectorSize : 0;
+
+        Account(cpu, op, latency, bytes, success);
+        if (cur != req)
+            cpu.Merges[op].Inc();
+    }
+}
+
+u64 BlockStats::Begin(Op op)
+{
+    Local().Inflight[op].Inc();
+    return GetBootTime().GetValue();
+}
+
+void BlockStats::End(Op op, u64 startNs, u64 bytes, bool success)
+{
+    u64 now = GetBootTime().GetValue();
+    Account(Local(), op, (now > startNs) ? now - startNs : 0, bytes, success);
+}
+
+void BlockStats::Read(Snapshot& snap)
+{
+    Stdlib::MemSet(&snap, 0, sizeof(snap));
+    snap.TimeNs = GetBootTime().GetValue();
+
+    for (ulong c = 0; c < MaxCpus; c++)
+    {
+        CpuStats& cpu = Cpus[c];
+        for (ulong op = 0; op < OpMax; op++)
+        {
+            snap.Ops[op] += (ulong)cpu.Ops[op].Get();
+            snap.Bytes[op] += (u64)cpu.Bytes[op].Get();
+            snap.Errors[op] += (ulong)cpu.Errors[op].Get();
+            snap.Merges[op] += (ulong)cpu.Merges[op].Get();
+            snap.Inflight[op] += cpu.Inflight[op].Get();
+            snap.LatencyNs[op] += (u64)cpu.LatencyNs[op].Get();
+            for (ulong b = 0; b < HistBuckets; b++)
+                snap.Hist[op][b] += (ulong)cpu.Hist[op][b].Get();
+        }
+    }
+}
+
+u64 BlockStats::Percentile(const Snapshot& cur, const Snapshot* prev, Op op, ulong permille)
+{
+    ulong total = 0;
+    for (ulong b = 0; b < HistBuckets; b++)
+        total += cur.Hist[op][b] - (prev ? prev->Hist[op][b] : 0);
+    if (total == 0)
+        return 0;
+
+    /* Smallest bucket holding the ceil(total * permille / 1000)-th request */
+    ulong target = (total * permille + 999) / 1000;
+    ulong seen = 0;
+    for (ulong b = 0; b < HistBuckets; b++)
+    {
+        seen += cur.Hist[op][b] - (prev ? prev->Hist[op][b] : 0);
+        if (seen >= target)
+            return BucketLimitNs(b);
+    }
+    return BucketLimitNs(HistBuckets - 1);
+}
+
+void BlockStats::PrintHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%-8s %-7s %8s %8s %10s %5s %7s %6s %8s %8s %8s %8s\n",
+        "device", "op", "ops", "iops", "KB/s", "infl", "merges", "errs",
+        "avg-us", "p50-us", "p99-us", "p999-us");
+}
+
+void BlockStats::Print(const char* name, const Snapshot& cur, const Snapshot* prev,
+                       Stdlib::Printer& printer)
+{
+    u64 spanNs = prev ? cur.TimeNs - prev->TimeNs : cur.TimeNs;
+    u64 spanUs = spanNs / Const::NanoSecsInUsec;
+    if (spanUs == 0)
+        spanUs = 1;
+
+    for (ulong i = 0; i < OpMax; i++)
+    {
+        Op op = static_cast<Op>(i);
+        ulong ops = cur.Ops[op] - (prev ? prev->Ops[op] : 0);
+        if (ops == 0 && cur.Inflight[op] == 0)
+            continue;
+
+        u64 bytes = cur.Bytes[op] - (prev ? prev->Bytes[op] : 0);
+        ulong merges = cur.Merges[op] - (prev ? prev->Merges[op] : 0);
+        ulong errors = cur.Errors[op] - (prev ? prev->Errors[op] : 0);
+        u64 latency = cur.LatencyNs[op] - (prev ? prev->LatencyNs[op] : 0);
+
+        printer.Printf("%-8s %-7s %8u %8u %10u %5d %7u %6u %8u %8u %8u %8u\n",
+            name, OpName(op), ops,
+            (u64)ops * 1000000 / spanUs,
+            bytes / Const::KB * 1000000 / spanUs,
+            cur.Inflight[op], merges, errors,
+            ops ? latency / ops / Const::NanoSecsInUsec : 0,
+            Percentile(cur, prev, op, 500) / Const::NanoSecsInUsec,
+            Percentile(cur, prev, op, 990) / Const::NanoSecsInUsec,
+            Percentile(cur, prev, op, 999) / Const::NanoSecsInUsec);
+    }
+}
+
+void BlockStats::DumpAll(Stdlib::Printer& printer)
+{
+    Snapshot* snap = new (Mm::NoThrow) Snapshot;
+    if (snap == nullptr)
+        return;
+
+    auto& table = BlockDeviceTable::GetInstance();
+    PrintHeader(printer);
+    for (ulong i = 0; i < table.GetCount(); i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        BlockStats* stats = dev ? dev->GetStats() : nullptr;
+        if (stats == nullptr)
+            continue;
+
+        stats->Read(*snap);
+        Print(dev->GetName(), *snap, nullptr, printer);
+    }
+    delete snap;
+}
+
+}
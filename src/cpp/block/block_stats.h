@@ -0,0 +1,116 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/cpu.h>
+#include <lib/printer.h>
+#include "block_request.h"
+
+namespace Kernel
+{
+
+/* Per-device I/O accounting, per operation (read, write, flush and
+   discard/write-zeroes): completed requests, bytes, errors, requests
+   merged into others, requests in flight and a log-scale latency
+   histogram from submit to complete.
+
+   Counters are kept per CPU and only summed when read, so the hot path
+   touches cache lines no other CPU writes.  A request may complete on a
+   different CPU than it was submitted on; per-CPU in-flight counts can
+   go negative, only the sum is meaningful.
+
+   Histogram bucket 0 is below 1 us, bucket 1 + 2 * log2(us) + h holds
+   latencies in the lower (h = 0) or upper half of that power of two,
+   the last bucket everything above.  Percentiles report the upper edge
+   of their bucket, so they are exact to within 50%. */
+class BlockStats
+{
+public:
+    enum Op : u8
+    {
+        OpRead = 0,
+        OpWrite,
+        OpFlush,
+        OpDiscard,      /* discard and write zeroes */
+        OpMax,
+    };
+
+    static const ulong HistBuckets = 48;
+
+    struct Snapshot
+    {
+        u64 TimeNs;
+        ulong Ops[OpMax];
+        u64 Bytes[OpMax];
+        ulong Errors[OpMax];
+        ulong Merges[OpMax];
+        long Inflight[OpMax];
+        u64 LatencyNs[OpMax];
+        ulong Hist[OpMax][HistBuckets];
+    };
+
+    BlockStats();
+    ~BlockStats();
+
+    static Op GetOp(BlockRequest::Type type);
+
+    /* Bytes per sector of the device, for the byte counts. */
+    void SetSectorSize(u32 sectorSize);
+
+    /* Asynchronous path: Start at submit stamps req; Done at completion
+       accounts req and every request merged behind it.  Call Done before
+       completing the requests, they may be freed right after. */
+    void Start(BlockRequest* req);
+    void Done(BlockRequest* req, bool success);
+
+    /* Synchronous path: Begin returns the start time for End. */
+    u64 Begin(Op op);
+    void End(Op op, u64 startNs, u64 bytes, bool success);
+
+    void Read(Snapshot& snap);
+
+    /* Latency in ns below which permille of the requests of op in
+       [prev, cur) completed; prev may be nullptr (since boot). */
+    static u64 Percentile(const Snapshot& cur, const Snapshot* prev, Op op, ulong permille);
+
+    /* Histogram bucket of a latency and the upper edge of a bucket,
+       shared with the per-class histograms of BlockQos. */
+    static ulong Bucket(u64 latencyNs);
+    static u64 BucketLimitNs(ulong bucket);
+
+    /* One line per op with any activity: rates over [prev, cur), or
+       averages since boot if prev is nullptr. */
+    static void Print(const char* name, const Snapshot& cur, const Snapshot* prev,
+                      Stdlib::Printer& printer);
+    static void PrintHeader(Stdlib::Printer& printer);
+
+    static const char* OpName(Op op);
+
+    /* Totals since boot of every registered device that keeps stats. */
+    static void DumpAll(Stdlib::Printer& printer);
+
+private:
+    BlockStats(const BlockStats& other) = delete;
+    BlockStats(BlockStats&& other) = delete;
+    BlockStats& operator=(const BlockStats& other) = delete;
+    BlockStats& operator=(BlockStats&& other) = delete;
+
+    struct CpuStats
+    {
+        Atomic Ops[OpMax];
+        Atomic Bytes[OpMax];
+        Atomic Errors[OpMax];
+        Atomic Merges[OpMax];
+        Atomic Inflight[OpMax];
+        Atomic LatencyNs[OpMax];
+        Atomic Hist[OpMax][HistBuckets];
+    } __attribute__((aligned(64)));
+
+    CpuStats& Local();
+    void Account(CpuStats& cpu, Op op, u64 latencyNs, u64 bytes, bool success);
+
+    CpuStats Cpus[MaxCpus];
+    u32 SectorSize;
+};
+
+}
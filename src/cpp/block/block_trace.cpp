@@ -0,0 +1,323 @@
+#include "block_trace.h"
+
+#include <include/const.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <hal/barrier.h>
+#include <fs/vfs.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+BlockTrace::BlockTrace()
+{
+    for (ulong i = 0; i < MaxCpus; i++)
+        Rings[i].Events = nullptr;
+}
+
+BlockTrace::~BlockTrace()
+{
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        if (Rings[i].Events != nullptr)
+            Mm::Free(Rings[i].Events);
+    }
+}
+
+const char* BlockTrace::ActionName(Action act)
+{
+    switch (act)
+    {
+    case ActQueue:
+        return "Q";
+    case ActMerge:
+        return "M";
+    case ActDispatch:
+        return "D";
+    case ActRequeue:
+        return "R";
+    case ActComplete:
+        return "C";
+    default:
+        return "?";
+    }
+}
+
+static const char* TypeName(u8 type)
+{
+    switch (type)
+    {
+    case BlockRequest::Read:
+        return "R";
+    case BlockRequest::Write:
+        return "W";
+    case BlockRequest::Flush:
+        return "F";
+    case BlockRequest::Discard:
+        return "D";
+    case BlockRequest::WriteZeroes:
+        return "Z";
+    default:
+        return "?";
+    }
+}
+
+bool BlockTrace::AllocRings()
+{
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        if (Rings[i].Events != nullptr)
+            continue;
+
+        Event* events = static_cast<Event*>(Mm::Alloc(RingEvents * sizeof(Event), 0));
+        if (events == nullptr)
+            return false;
+        Stdlib::MemSet(events, 0, RingEvents * sizeof(Event));
+        Rings[i].Head.Set(0);
+        Rings[i].Events = events;
+    }
+    return true;
+}
+
+bool BlockTrace::Enable(BlockDevice* dev, bool on)
+{
+    if (!dev->SupportsTrace())
+        return false;
+
+    auto& table = BlockDeviceTable::GetInstance();
+    ulong index = 0;
+    while (index < table.GetCount() && table.GetDevice(index) != dev)
+        index++;
+    if (index == table.GetCount() || index >= 255)
+        return false;
+
+    if (on)
+    {
+        if (!AllocRings())
+            return false;
+        dev->SetTraceId((u8)(index + 1));
+    }
+    else
+    {
+        dev->SetTraceId(0);
+    }
+    return true;
+}
+
+void BlockTrace::Record(u8 devId, Action act, const BlockRequest* req, bool error)
+{
+    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
+    if (cpu >= MaxCpus)
+        return;
+
+    Ring& ring = Rings[cpu];
+    if (ring.Events == nullptr)
+        return;
+
+    /* An interrupt on this CPU may record in between: reserve first */
+    long pos;
+    for (;;)
+    {
+        pos = ring.Head.Get();
+        if (ring.Head.Cmpxchg(pos + 1, pos) == pos)
+            break;
+    }
+
+    Event& ev = ring.Events[(ulong)pos & (RingEvents - 1)];
+    ev.Seq = 0;
+    Hal::SmpWmb();
+
+    ev.Time = GetBootTime().GetValue();
+    ev.Sector = req->Sector;
+    ev.Sectors = (req->TotalSectors > req->SectorCount) ? req->TotalSectors : req->SectorCount;
+    ev.DevId = devId;
+    ev.Act = act;
+    ev.Type = req->RequestType;
+    ev.Flags = (error ? FlagError : 0) | (req->Fua ? FlagFua : 0);
+    ev.Cpu = (u8)cpu;
+
+    Hal::SmpWmb();
+    ev.Seq = (u32)(pos + 1);
+}
+
+void BlockTrace::Clear()
+{
+    for (ulong i = 0; i < MaxCpus; i++)
+    {
+        if (Rings[i].Events == nullptr)
+            continue;
+        Rings[i].Head.Set(0);
+        Stdlib::MemSet(Rings[i].Events, 0, RingEvents * sizeof(Event));
+    }
+}
+
+BlockTrace::Event* BlockTrace::Collect(ulong& count)
+{
+    count = 0;
+
+    /* Per-CPU copies, each already in time order */
+    Event* copies[MaxCpus];
+    ulong lens[MaxCpus];
+    ulong total = 0;
+    for (ulong c = 0; c < MaxCpus; c++)
+    {
+        copies[c] = nullptr;
+        lens[c] = 0;
+
+        Ring& ring = Rings[c];
+        if (ring.Events == nullptr)
+            continue;
+
+        long head = ring.Head.Get();
+        long start = (head > (long)RingEvents) ? head - (long)RingEvents : 0;
+        if (head == start)
+            continue;
+
+        copies[c] = static_cast<Event*>(Mm::Alloc((ulong)(head - start) * sizeof(Event), 0));
+        if (copies[c] == nullptr)
+            continue;
+
+        for (long pos = start; pos < head; pos++)
+        {
+            volatile Event& slot = ring.Events[(ulong)pos & (RingEvents - 1)];
+            u32 seq = slot.Seq;
+            Hal::SmpRmb();
+            Event& out = copies[c][lens[c]];
+            Stdlib::MemCpy(&out, const_cast<Event*>(&slot), sizeof(Event));
+            Hal::SmpRmb();
+
+            /* Skip slots being rewritten or already reused */
+            if (seq != (u32)(pos + 1) || slot.Seq != seq)
+                continue;
+            lens[c]++;
+        }
+        total += lens[c];
+    }
+
+    Event* all = (total != 0) ? static_cast<Event*>(Mm::Alloc(total * sizeof(Event), 0)) : nullptr;
+    if (all != nullptr)
+    {
+        /* Merge the per-CPU runs by time */
+        ulong idx[MaxCpus] = {};
+        for (ulong n = 0; n < total; n++)
+        {
+            ulong best = MaxCpus;
+            for (ulong c = 0; c < MaxCpus; c++)
+            {
+                if (idx[c] < lens[c] &&
+                    (best == MaxCpus || copies[c][idx[c]].Time < copies[best][idx[best]].Time))
+                    best = c;
+            }
+            all[n] = copies[best][idx[best]++];
+        }
+        count = total;
+    }
+
+    for (ulong c = 0; c < MaxCpus; c++)
+    {
+        if (copies[c] != nullptr)
+            Mm::Free(copies[c]);
+    }
+    return all;
+}
+
+void BlockTrace::Dump(Stdlib::Printer& printer, ulong max)
+{
+    ulong count;
+    Event* events = Collect(count);
+    if (events == nullptr)
+    {
+        printer.Printf("no events\n");
+        return;
+    }
+
+    auto& table = BlockDeviceTable::GetInstance();
+    ulong first = (max != 0 && count > max) ? count - max : 0;
+    for (ulong i = first; i < count; i++)
+    {
+        const Event& ev = events[i];
+        BlockDevice* dev = (ev.DevId != 0) ? table.GetDevice(ev.DevId - 1) : nullptr;
+
+        printer.Printf("%5u.%09u %u %-6s %s %s%s %u + %u%s\n",
+            ev.Time / Const::NanoSecsInSec, ev.Time % Const::NanoSecsInSec,
+            (ulong)ev.Cpu, dev ? dev->GetName() : "?",
+            ActionName(static_cast<Action>(ev.Act)), TypeName(ev.Type),
+            (ev.Flags & FlagFua) ? "F" : "", ev.Sector, (ulong)ev.Sectors,
+            (ev.Flags & FlagError) ? " error" : "");
+    }
+    Mm::Free(events);
+}
+
+bool BlockTrace::Save(const char* path, ulong& events)
+{
+    events = 0;
+    ulong count;
+    Event* all = Collect(count);
+
+    auto& table = BlockDeviceTable::GetInstance();
+    ulong devCount = table.GetCount();
+    ulong size = sizeof(FileHeader) + devCount * NameSize + count * sizeof(Event);
+
+    u8* buf = static_cast<u8*>(Mm::Alloc(size, 0));
+    if (buf == nullptr)
+    {
+        if (all != nullptr)
+            Mm::Free(all);
+        return false;
+    }
+    Stdlib::MemSet(buf, 0, size);
+
+    FileHeader* hdr = reinterpret_cast<FileHeader*>(buf);
+    hdr->Magic = FileMagic;
+    hdr->Version = FileVersion;
+    hdr->EventSize = sizeof(Event);
+    hdr->DevCount = (u32)devCount;
+    hdr->EventCount = (u32)count;
+
+    char* names = reinterpret_cast<char*>(buf + sizeof(FileHeader));
+    for (ulong i = 0; i < devCount; i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        if (dev != nullptr)
+            Stdlib::StrnCpy(names + i * NameSize, dev->GetName(), NameSize);
+    }
+
+    if (count != 0)
+        Stdlib::MemCpy(buf + sizeof(FileHeader) + devCount * NameSize, all, count * sizeof(Event));
+
+    bool ok = Vfs::GetInstance().WriteFile(path, buf, size);
+    if (ok)
+        events = count;
+
+    Mm::Free(buf);
+    if (all != nullptr)
+        Mm::Free(all);
+    return ok;
+}
+
+void BlockTrace::DumpStatus(Stdlib::Printer& printer)
+{
+    auto& table = BlockDeviceTable::GetInstance();
+    for (ulong i = 0; i < table.GetCount(); i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        if (dev == nullptr || !dev->SupportsTrace())
+            continue;
+        printer.Printf("%s: %s\n", dev->GetName(), dev->GetTraceId() ? "on" : "off");
+    }
+
+    for (ulong c = 0; c < MaxCpus; c++)
+    {
+        if (Rings[c].Events == nullptr)
+            continue;
+
+        long head = Rings[c].Head.Get();
+        if (head != 0)
+            printer.Printf("cpu%u: %u events recorded, %u kept\n", c, (ulong)head,
+                (ulong)((head > (long)RingEvents) ? RingEvents : (ulong)head));
+    }
+}
+
+}
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/cpu.h>
+#include <lib/printer.h>
+#include "block_request.h"
+#include "block_device.h"
+
+namespace Kernel
+{
+
+/* blktrace-style block request tracer.
+
+   Events are 32-byte binary records in per-CPU rings that keep the
+   most recent RingEvents events each.  Recording is lock-free: a
+   producer (task or interrupt on that CPU) reserves a slot by
+   advancing the ring head with a compare-and-swap, fills it in and
+   publishes it by writing the slot's sequence number last.  A reader
+   only accepts slots whose sequence matches their position, so slots
+   being overwritten are skipped rather than torn.
+
+   Tracing is enabled per device; a disabled device costs one load of
+   its trace id in the hooks (see TraceBlock).  Rings are allocated on
+   first enable and kept. */
+class BlockTrace
+{
+public:
+    static BlockTrace& GetInstance()
+    {
+        static BlockTrace Instance;
+        return Instance;
+    }
+
+    enum Action : u8
+    {
+        ActQueue = 1,       /* accepted by the device queue */
+        ActMerge,           /* merged into a queued request */
+        ActDispatch,        /* handed to the hardware (chain head) */
+        ActRequeue,         /* hardware ring full, retried from SoftIrq */
+        ActComplete,        /* completed (chain head) */
+        ActMax,
+    };
+
+    struct Event
+    {
+        u64 Time;           /* GetBootTime ns */
+        u64 Sector;
+        u32 Sectors;
+        u32 Seq;            /* low bits of ring position + 1, written last */
+        u8 DevId;           /* BlockDeviceTable index + 1 */
+        u8 Act;
+        u8 Type;            /* BlockRequest::Type */
+        u8 Flags;           /* FlagError, FlagFua */
+        u8 Cpu;
+        u8 Reserved[3];
+    };
+
+    static_assert(sizeof(Event) == 32, "Invalid size");
+
+    static const u8 FlagError = 0x1;
+    static const u8 FlagFua = 0x2;
+
+    /* Raw file layout: FileHeader, DevCount names, then EventCount
+       events in time order. */
+    struct FileHeader
+    {
+        u32 Magic;
+        u16 Version;
+        u16 EventSize;
+        u32 DevCount;
+        u32 EventCount;
+    };
+
+    static const u32 FileMagic = 0x43525442; /* "BTRC" */
+    static const u16 FileVersion = 1;
+    static const ulong NameSize = 16;
+    static const ulong RingEvents = 2048;   /* per CPU, power of two */
+
+    /* Start or stop tracing dev; false if dev cannot be traced or the
+       rings cannot be allocated. */
+    bool Enable(BlockDevice* dev, bool on);
+
+    void Record(u8 devId, Action act, const BlockRequest* req, bool error);
+
+    /* Forget all recorded events. */
+    void Clear();
+
+    /* Decoded events in time order, the last max of them. */
+    void Dump(Stdlib::Printer& printer, ulong max);
+
+    /* Write the raw events to path; returns the event count written. */
+    bool Save(const char* path, ulong& events);
+
+    void DumpStatus(Stdlib::Printer& printer);
+
+    static const char* ActionName(Action act);
+
+private:
+    BlockTrace();
+    ~BlockTrace();
+    BlockTrace(const BlockTrace& other) = delete;
+    BlockTrace(BlockTrace&& other) = delete;
+    BlockTrace& operator=(const BlockTrace& other) = delete;
+    BlockTrace& operator=(BlockTrace&& other) = delete;
+
+    struct Ring
+    {
+        Atomic Head;        /* next position to reserve */
+        Event* Events;
+    } __attribute__((aligned(64)));
+
+    bool AllocRings();
+
+    /* Copy the valid events of all rings into a time-sorted array;
+       caller frees it. */
+    Event* Collect(ulong& count);
+
+    Ring Rings[MaxCpus];
+};
+
+/* Trace hook: near free when dev is not being traced.  For a merged
+   chain head the event covers the whole chain. */
+static inline void TraceBlock(BlockDevice* dev, BlockTrace::Action act, const BlockRequest* req,
+                              bool error = false)
+{
+    if (unlikely(dev != nullptr && dev->GetTraceId() != 0))
+        BlockTrace::GetInstance().Record(dev->GetTraceId(), act, req, error);
+}
+
+}
@@ -0,0 +1,636 @@
+#include "io_scheduler.h"
+#include "block_trace.h"
+#include "block_completion.h"
+
+#include <kernel/task.h>
+#include <kernel/time.h>
+#include <kernel/trace.h>
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+static BlockRequest* LinkToRequest(Stdlib::ListEntry* entry)
+{
+    return CONTAINING_RECORD(entry, BlockRequest, Link);
+}
+
+static BlockRequest* SortLinkToRequest(Stdlib::ListEntry* entry)
+{
+    return CONTAINING_RECORD(entry, BlockRequest, SortLink);
+}
+
+/* Put entry at old's position in whatever list old is on. */
+static void ReplaceEntry(Stdlib::ListEntry* old, Stdlib::ListEntry* entry)
+{
+    old->InsertHead(entry);
+    old->Remove();
+}
+
+IoScheduler::IoScheduler()
+    : Queue(nullptr)
+    , LastBarrierSeq(0)
+{
+}
+
+void IoScheduler::Attach(IoQueue* queue)
+{
+    Queue = queue;
+}
+
+bool IoScheduler::CanMerge(BlockRequest* front, BlockRequest* back)
+{
+    if (!front->HasData() || front->RequestType != back->RequestType)
+        return false;
+    if (front->Fua != back->Fua)
+        return false;
+    if (front->Sector + front->TotalSectors != back->Sector)
+        return false;
+
+    /* Never merge across a barrier */
+    if (front->Seq <= LastBarrierSeq || back->Seq <= LastBarrierSeq)
+        return false;
+
+    if (front->Segments + back->Segments > Queue->MaxSegments)
+        return false;
+    if (front->TotalSectors + back->TotalSectors > Queue->MaxSectors)
+        return false;
+    return true;
+}
+
+void IoScheduler::MergeChains(BlockRequest* front, BlockRequest* back)
+{
+    TraceBlock(Queue->Owner, BlockTrace::ActMerge, back);
+
+    front->MergeTail->MergeNext = back;
+    front->MergeTail = back->MergeTail;
+    front->TotalSectors += back->TotalSectors;
+    front->Segments += back->Segments;
+
+    /* The chain inherits the oldest member's age */
+    if (back->Seq < front->Seq)
+        front->Seq = back->Seq;
+    if (back->SubmitTime < front->SubmitTime)
+        front->SubmitTime = back->SubmitTime;
+}
+
+/* --- none --- */
+
+NoneScheduler::NoneScheduler()
+{
+    Fifo.Init();
+}
+
+const char* NoneScheduler::GetName()
+{
+    return "none";
+}
+
+void NoneScheduler::Add(BlockRequest* req)
+{
+    Fifo.InsertTail(&req->Link);
+}
+
+BlockRequest* NoneScheduler::Dispatch()
+{
+    if (Fifo.IsEmpty())
+        return nullptr;
+    return LinkToRequest(Fifo.RemoveHead());
+}
+
+/* --- noop --- */
+
+NoopScheduler::NoopScheduler()
+{
+    Fifo.Init();
+}
+
+const char* NoopScheduler::GetName()
+{
+    return "noop";
+}
+
+void NoopScheduler::Add(BlockRequest* req)
+{
+    if (req->RequestType == BlockRequest::Flush)
+    {
+        if (req->Seq > LastBarrierSeq)
+            LastBarrierSeq = req->Seq;
+        Fifo.InsertTail(&req->Link);
+        return;
+    }
+
+    ulong scanned = 0;
+    for (Stdlib::ListEntry* e = Fifo.Blink; e != &Fifo && scanned < MergeScan;
+         e = e->Blink, scanned++)
+    {
+        BlockRequest* cand = LinkToRequest(e);
+        if (cand->RequestType == BlockRequest::Flush)
+            break;
+
+        if (CanMerge(cand, req))
+        {
+            MergeChains(cand, req);
+            Queue->SchedStats[Queue->Active].BackMerges++;
+            return;
+        }
+
+        if (CanMerge(req, cand))
+        {
+            /* req takes cand's place in the FIFO */
+            MergeChains(req, cand);
+            ReplaceEntry(&cand->Link, &req->Link);
+            Queue->SchedStats[Queue->Active].FrontMerges++;
+            return;
+        }
+    }
+
+    Fifo.InsertTail(&req->Link);
+}
+
+BlockRequest* NoopScheduler::Dispatch()
+{
+    if (Fifo.IsEmpty())
+        return nullptr;
+    return LinkToRequest(Fifo.RemoveHead());
+}
+
+/* --- deadline --- */
+
+DeadlineScheduler::DeadlineScheduler()
+    : BatchDir(DirRead)
+    , BatchCount(0)
+    , StarvedWrites(0)
+{
+    for (ulong dir = 0; dir < 2; dir++)
+    {
+        Fifo[dir].Init();
+        Sorted[dir].Init();
+        NextReq[dir] = nullptr;
+    }
+    Barriers.Init();
+}
+
+const char* DeadlineScheduler::GetName()
+{
+    return "deadline";
+}
+
+ulong DeadlineScheduler::Dir(BlockRequest* req)
+{
+    return (req->RequestType == BlockRequest::Read) ? DirRead : DirWrite;
+}
+
+BlockRequest* DeadlineScheduler::SortedPrev(BlockRequest* req)
+{
+    Stdlib::ListEntry* e = req->SortLink.Blink;
+    if (e == &Sorted[Dir(req)])
+        return nullptr;
+    return SortLinkToRequest(e);
+}
+
+BlockRequest* DeadlineScheduler::SortedNext(BlockRequest* req)
+{
+    Stdlib::ListEntry* e = req->SortLink.Flink;
+    if (e == &Sorted[Dir(req)])
+        return nullptr;
+    return SortLinkToRequest(e);
+}
+
+BlockRequest* DeadlineScheduler::FifoHead(ulong dir)
+{
+    if (Fifo[dir].IsEmpty())
+        return nullptr;
+    return LinkToRequest(Fifo[dir].Flink);
+}
+
+void DeadlineScheduler::Remove(BlockRequest* req)
+{
+    ulong dir = Dir(req);
+    if (NextReq[dir] == req)
+        NextReq[dir] = SortedNext(req);
+    req->Link.Remove();
+    req->SortLink.Remove();
+}
+
+/* Merge back into front; front keeps its sorted position and takes the
+   older FIFO position of the two. */
+void DeadlineScheduler::Absorb(BlockRequest* front, BlockRequest* back)
+{
+    bool backOlder = (back->Seq < front->Seq);
+
+    MergeChains(front, back);
+
+    ulong dir = Dir(back);
+    if (NextReq[dir] == back)
+        NextReq[dir] = front;
+
+    if (backOlder)
+        ReplaceEntry(&back->Link, &front->Link);
+    else
+        back->Link.Remove();
+    back->SortLink.Remove();
+}
+
+void DeadlineScheduler::Add(BlockRequest* req)
+{
+    if (req->RequestType == BlockRequest::Flush)
+    {
+        if (req->Seq > LastBarrierSeq)
+            LastBarrierSeq = req->Seq;
+        Barriers.InsertTail(&req->Link);
+        return;
+    }
+
+    ulong dir = Dir(req);
+
+    /* Insert before the first request with a higher start sector */
+    Stdlib::ListEntry* pos = Sorted[dir].Flink;
+    while (pos != &Sorted[dir] && SortLinkToRequest(pos)->Sector <= req->Sector)
+        pos = pos->Flink;
+    pos->InsertTail(&req->SortLink);
+    Fifo[dir].InsertTail(&req->Link);
+
+    BlockRequest* prev = SortedPrev(req);
+    if (prev != nullptr && CanMerge(prev, req))
+    {
+        Absorb(prev, req);
+        Queue->SchedStats[Queue->Active].BackMerges++;
+        req = prev;
+    }
+
+    BlockRequest* next = SortedNext(req);
+    if (next != nullptr && CanMerge(req, next))
+    {
+        Absorb(req, next);
+        Queue->SchedStats[Queue->Active].FrontMerges++;
+    }
+}
+
+BlockRequest* DeadlineScheduler::Dispatch()
+{
+    BlockRequest* readHead = FifoHead(DirRead);
+    BlockRequest* writeHead = FifoHead(DirWrite);
+
+    if (!Barriers.IsEmpty())
+    {
+        /* Drain everything older than the barrier oldest-first, then the
+           barrier itself; nothing newer goes ahead of it. */
+        BlockRequest* barrier = LinkToRequest(Barriers.Flink);
+        BlockRequest* oldest = readHead;
+        if (oldest == nullptr || (writeHead != nullptr && writeHead->Seq < oldest->Seq))
+            oldest = writeHead;
+
+        if (oldest == nullptr || oldest->Seq > barrier->Seq)
+        {
+            barrier->Link.Remove();
+            return barrier;
+        }
+
+        Remove(oldest);
+        return oldest;
+    }
+
+    BlockRequest* req = nullptr;
+    ulong dir;
+
+    if (BatchCount < FifoBatch && NextReq[BatchDir] != nullptr)
+    {
+        dir = BatchDir;
+        req = NextReq[dir];
+    }
+    else
+    {
+        if (readHead != nullptr && (writeHead == nullptr || StarvedWrites < WritesStarved))
+        {
+            dir = DirRead;
+            if (writeHead != nullptr)
+                StarvedWrites++;
+        }
+        else if (writeHead != nullptr)
+        {
+            dir = DirWrite;
+            StarvedWrites = 0;
+        }
+        else
+        {
+            return nullptr;
+        }
+
+        /* Start the batch at the oldest request if it has expired,
+           otherwise continue the sweep */
+        BlockRequest* head = FifoHead(dir);
+        ulong expire = (dir == DirRead) ? ReadExpireNs : WriteExpireNs;
+        ulong now = GetBootTime().GetValue();
+        if (NextReq[dir] == nullptr || now - head->SubmitTime >= expire)
+            req = head;
+        else
+            req = NextReq[dir];
+
+        BatchDir = dir;
+        BatchCount = 0;
+    }
+
+    BatchCount++;
+    NextReq[dir] = SortedNext(req);
+    Remove(req);
+    return req;
+}
+
+/* --- queue --- */
+
+IoQueue::IoQueue()
+    : Qos(Lock)
+    , Owner(nullptr)
+    , Active(SchedNoop)
+    , SectorSize(512)
+    , MaxSegments(1)
+    , MaxSectors(8)
+    , NextSeq(1)
+    , Inflight(0)
+    , Scheduled(0)
+    , BusyStart(0)
+{
+    None.Attach(this);
+    Noop.Attach(this);
+    Deadline.Attach(this);
+    Requeued.Init();
+    Stdlib::MemSet(SchedStats, 0, sizeof(SchedStats));
+}
+
+IoQueue::~IoQueue()
+{
+}
+
+void IoQueue::Init(u32 sectorSize, u32 maxSegments, u32 maxSectors)
+{
+    SectorSize = sectorSize;
+    MaxSegments = (maxSegments != 0) ? maxSegments : 1;
+    MaxSectors = maxSectors;
+}
+
+void IoQueue::SetOwner(BlockDevice* owner)
+{
+    Owner = owner;
+}
+
+IoScheduler* IoQueue::GetScheduler(SchedType type)
+{
+    switch (type)
+    {
+    case SchedNone:
+        return &None;
+    case SchedDeadline:
+        return &Deadline;
+    case SchedNoop:
+    default:
+        return &Noop;
+    }
+}
+
+void IoQueue::AddLocked(BlockRequest* req)
+{
+    req->MergeNext = nullptr;
+    req->MergeTail = req;
+    req->TotalSectors = (req->RequestType == BlockRequest::Flush) ? 0 : req->SectorCount;
+    req->Segments = req->HasData() ? 1 : 0;
+    req->Seq = NextSeq++;
+    req->SubmitTime = GetBootTime().GetValue();
+    BlockCompletion::MarkSubmit(req);
+
+    if (req->IoClass >= BlockRequest::ClassMax)
+    {
+        Task* task = Task::TryGetCurrentTask();
+        req->IoClass = (task != nullptr && task->IoClass < BlockRequest::ClassMax) ?
+            static_cast<BlockRequest::Class>(task->IoClass) : BlockRequest::ClassDefault;
+    }
+
+    SchedStats[Active].Requests++;
+    TraceBlock(Owner, BlockTrace::ActQueue, req);
+    if (Qos.Enabled)
+        Qos.Queue(req);
+    else
+        Schedule(req);
+}
+
+void IoQueue::Schedule(BlockRequest* req)
+{
+    Qos.Admitted(req);
+    Scheduled++;
+    GetScheduler(Active)->Add(req);
+}
+
+void IoQueue::Add(BlockRequest* req)
+{
+    Stdlib::AutoLock lock(Lock);
+    AddLocked(req);
+}
+
+void IoQueue::AddBatch(BlockRequest* const* reqs, ulong count)
+{
+    Stdlib::AutoLock lock(Lock);
+    for (ulong i = 0; i < count; i++)
+        AddLocked(reqs[i]);
+}
+
+BlockRequest* IoQueue::Dispatch()
+{
+    Stdlib::AutoLock lock(Lock);
+
+    BlockRequest* req;
+    if (!Requeued.IsEmpty())
+    {
+        req = LinkToRequest(Requeued.RemoveHead());
+    }
+    else
+    {
+        /* Keep only a few requests in the scheduler, so the QoS
+           admission order is what reaches the device */
+        if (Qos.Enabled)
+        {
+            u64 now = GetBootTime().GetValue();
+            while (Scheduled < BlockQos::AdmitWindow)
+            {
+                BlockRequest* next = Qos.Admit(now, SectorSize);
+                if (next == nullptr)
+                    break;
+                Schedule(next);
+            }
+        }
+
+        req = GetScheduler(Active)->Dispatch();
+        for (BlockRequest* member = req; member != nullptr; member = member->MergeNext)
+            Scheduled--;
+    }
+
+    if (req == nullptr)
+        return nullptr;
+
+    if (Inflight == 0)
+        BusyStart = GetBootTime().GetValue();
+    Inflight++;
+    SchedStats[Active].Dispatched++;
+    TraceBlock(Owner, BlockTrace::ActDispatch, req);
+    return req;
+}
+
+void IoQueue::Requeue(BlockRequest* req)
+{
+    Stdlib::AutoLock lock(Lock);
+
+    TraceBlock(Owner, BlockTrace::ActRequeue, req);
+    Requeued.InsertHead(&req->Link);
+    SchedStats[Active].Dispatched--;
+    Inflight--;
+}
+
+void IoQueue::Complete(BlockRequest* req, bool success)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+
+        Stats& stats = SchedStats[Active];
+        stats.Completed++;
+        if (!success)
+            stats.Errors++;
+        else if (req->HasData())
+            stats.Bytes += (ulong)req->TotalSectors * SectorSize;
+
+        u64 now = GetBootTime().GetValue();
+        Inflight--;
+        if (Inflight == 0)
+            stats.BusyNs += now - BusyStart;
+
+        for (BlockRequest* member = req; member != nullptr; member = member->MergeNext)
+            Qos.Done(member, success, now, SectorSize);
+    }
+
+    TraceBlock(Owner, BlockTrace::ActComplete, req, !success);
+
+    /* Read the link before Done(): the waiter may free the request.
+       Merged requests may come from different CPUs, each is steered to
+       its own submitter. */
+    auto& completion = BlockCompletion::GetInstance();
+    while (req != nullptr)
+    {
+        BlockRequest* next = req->MergeNext;
+        req->MergeNext = nullptr;
+        completion.Complete(req, success);
+        req = next;
+    }
+}
+
+bool IoQueue::SetScheduler(const char* name)
+{
+    SchedType type;
+    if (Stdlib::StrCmp(name, "none") == 0)
+        type = SchedNone;
+    else if (Stdlib::StrCmp(name, "noop") == 0)
+        type = SchedNoop;
+    else if (Stdlib::StrCmp(name, "deadline") == 0)
+        type = SchedDeadline;
+    else
+        return false;
+
+    Stdlib::AutoLock lock(Lock);
+    if (type == Active)
+        return true;
+
+    /* Move queued requests over in the old policy's dispatch order,
+       which already honors its barriers */
+    IoScheduler* from = GetScheduler(Active);
+    IoScheduler* to = GetScheduler(type);
+    for (;;)
+    {
+        BlockRequest* req = from->Dispatch();
+        if (req == nullptr)
+            break;
+        to->Add(req);
+    }
+
+    Active = type;
+    return true;
+}
+
+const char* IoQueue::GetSchedulerName()
+{
+    return GetScheduler(Active)->GetName();
+}
+
+ulong IoQueue::GetErrors()
+{
+    Stdlib::AutoLock lock(Lock);
+
+    ulong errors = 0;
+    for (ulong i = 0; i < SchedMax; i++)
+        errors += SchedStats[i].Errors;
+    return errors;
+}
+
+void IoQueue::SetQosEnabled(bool enabled)
+{
+    {
+        Stdlib::AutoLock lock(Lock);
+        if (!enabled)
+        {
+            for (;;)
+            {
+                BlockRequest* req = Qos.TakeOldest();
+                if (req == nullptr)
+                    break;
+                Schedule(req);
+            }
+        }
+        Qos.SetEnabledLocked(enabled);
+    }
+
+    /* Timer for throttled classes; after disabling, it also gets the
+       released requests dispatched if nothing is in flight */
+    auto& timer = BlockQosTimer::GetInstance();
+    timer.Start();
+    if (!enabled)
+        timer.Arm();
+}
+
+BlockQos& IoQueue::GetQos()
+{
+    return Qos;
+}
+
+void IoQueue::Dump(Stdlib::Printer& printer)
+{
+    Stats snap[SchedMax];
+    SchedType active;
+    ulong inflight;
+    {
+        Stdlib::AutoLock lock(Lock);
+        Stdlib::MemCpy(snap, SchedStats, sizeof(snap));
+        active = Active;
+        inflight = Inflight;
+    }
+
+    printer.Printf("  scheduler %s inflight %u max %u segs %u sectors\n",
+        GetScheduler(active)->GetName(), inflight,
+        (ulong)MaxSegments, (ulong)MaxSectors);
+
+    for (ulong i = 0; i < SchedMax; i++)
+    {
+        Stats& st = snap[i];
+        if (st.Requests == 0 && (SchedType)i != active)
+            continue;
+
+        ulong busyMs = st.BusyNs / Const::NanoSecsInMs;
+        ulong kbps = (busyMs != 0) ? (st.Bytes / 1024) * 1000 / busyMs : 0;
+        printer.Printf("  %s: req %u merged %u (back %u front %u) dispatched %u err %u\n",
+            GetScheduler((SchedType)i)->GetName(), st.Requests,
+            st.BackMerges + st.FrontMerges, st.BackMerges, st.FrontMerges,
+            st.Dispatched, st.Errors);
+        printer.Printf("  %s: %u KB in %u ms busy, %u KB/s\n",
+            GetScheduler((SchedType)i)->GetName(), st.Bytes / 1024, busyMs, kbps);
+    }
+
+    if (Qos.GetEnabled())
+        Qos.Dump(printer);
+}
+
+}
@@ -0,0 +1,227 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <block/block_request.h>
+#include <block/block_qos.h>
+#include <kernel/spin_lock.h>
+#include <lib/list_entry.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+class IoQueue;
+class BlockDevice;
+
+/* Dispatch policy between BlockDevice::Submit and the driver.
+
+   Ordering contract: requests in flight at the same time must not
+   overlap; relative order is only guaranteed across Flush requests,
+   which act as barriers -- nothing submitted before a flush is
+   dispatched after it, nothing submitted after it is dispatched (or
+   merged) before it.  Only reads and writes merge; Discard and
+   WriteZeroes are dispatched alone.  All methods run under the IoQueue
+   lock. */
+class IoScheduler
+{
+public:
+    IoScheduler();
+    virtual ~IoScheduler() {}
+
+    virtual const char* GetName() = 0;
+
+    /* Queue req (possibly a merged chain); may merge it into a queued
+       request or merge a queued request into it. */
+    virtual void Add(BlockRequest* req) = 0;
+
+    /* Next request (chain head) to send to the device, or nullptr. */
+    virtual BlockRequest* Dispatch() = 0;
+
+    void Attach(IoQueue* queue);
+
+protected:
+    /* front and back are both queued; back starts where front ends */
+    bool CanMerge(BlockRequest* front, BlockRequest* back);
+
+    /* Link back's chain behind front's. */
+    void MergeChains(BlockRequest* front, BlockRequest* back);
+
+    IoQueue* Queue;
+    u64 LastBarrierSeq;
+
+private:
+    IoScheduler(const IoScheduler& other) = delete;
+    IoScheduler(IoScheduler&& other) = delete;
+    IoScheduler& operator=(const IoScheduler& other) = delete;
+    IoScheduler& operator=(IoScheduler&& other) = delete;
+};
+
+/* Pure FIFO, no merging (the pre-scheduler behaviour). */
+class NoneScheduler final : public IoScheduler
+{
+public:
+    NoneScheduler();
+    virtual ~NoneScheduler() {}
+
+    virtual const char* GetName() override;
+    virtual void Add(BlockRequest* req) override;
+    virtual BlockRequest* Dispatch() override;
+
+private:
+    Stdlib::ListEntry Fifo;
+};
+
+/* FIFO with back/front merging against the most recent requests. */
+class NoopScheduler final : public IoScheduler
+{
+public:
+    NoopScheduler();
+    virtual ~NoopScheduler() {}
+
+    virtual const char* GetName() override;
+    virtual void Add(BlockRequest* req) override;
+    virtual BlockRequest* Dispatch() override;
+
+    /* Queued requests inspected for a merge, newest first */
+    static const ulong MergeScan = 8;
+
+private:
+    Stdlib::ListEntry Fifo;
+};
+
+/* Deadline: per-direction sector-sorted queues served in batches
+   (elevator order), per-direction FIFOs that bound latency, reads
+   preferred over writes up to WritesStarved batches in a row.
+   Discard and WriteZeroes are scheduled as writes. */
+class DeadlineScheduler final : public IoScheduler
+{
+public:
+    DeadlineScheduler();
+    virtual ~DeadlineScheduler() {}
+
+    virtual const char* GetName() override;
+    virtual void Add(BlockRequest* req) override;
+    virtual BlockRequest* Dispatch() override;
+
+    static const ulong ReadExpireNs = 500 * Const::NanoSecsInMs;
+    static const ulong WriteExpireNs = 5000 * Const::NanoSecsInMs;
+    static const ulong FifoBatch = 16;
+    static const ulong WritesStarved = 2;
+
+private:
+    static const ulong DirRead = 0;
+    static const ulong DirWrite = 1;
+
+    static ulong Dir(BlockRequest* req);
+    BlockRequest* SortedPrev(BlockRequest* req);
+    BlockRequest* SortedNext(BlockRequest* req);
+    BlockRequest* FifoHead(ulong dir);
+    void Remove(BlockRequest* req);
+    void Absorb(BlockRequest* front, BlockRequest* back);
+
+    Stdlib::ListEntry Fifo[2];
+    Stdlib::ListEntry Sorted[2];
+    Stdlib::ListEntry Barriers;
+    BlockRequest* NextReq[2];
+    ulong BatchDir;
+    ulong BatchCount;
+    ulong StarvedWrites;
+};
+
+/* Per-device request queue: the active scheduler plus a requeue list
+   for requests the driver could not hand to the hardware, merge and
+   throughput accounting.  Throughput is bytes completed over the time
+   the device had at least one request in flight, kept per scheduler so
+   policies can be compared on the same device.  With QoS enabled,
+   requests pass the per-class admission of BlockQos before they reach
+   the scheduler. */
+class IoQueue
+{
+public:
+    enum SchedType : u8
+    {
+        SchedNone = 0,
+        SchedNoop,
+        SchedDeadline,
+        SchedMax,
+    };
+
+    IoQueue();
+    ~IoQueue();
+
+    /* Driver limits for a merged chain. */
+    void Init(u32 sectorSize, u32 maxSegments, u32 maxSectors);
+
+    /* Device the queue belongs to, for the block tracer. */
+    void SetOwner(BlockDevice* owner);
+
+    void Add(BlockRequest* req);
+    void AddBatch(BlockRequest* const* reqs, ulong count);
+    BlockRequest* Dispatch();
+
+    /* Return a dispatched chain the hardware had no room for; it is
+       dispatched again before anything else. */
+    void Requeue(BlockRequest* req);
+
+    /* Complete every request of a dispatched chain. */
+    void Complete(BlockRequest* req, bool success);
+
+    bool SetScheduler(const char* name);
+    const char* GetSchedulerName();
+
+    /* Requests completed with an error, all schedulers. */
+    ulong GetErrors();
+
+    /* Disabling QoS hands every request it holds to the scheduler. */
+    void SetQosEnabled(bool enabled);
+    BlockQos& GetQos();
+
+    void Dump(Stdlib::Printer& printer);
+
+private:
+    IoQueue(const IoQueue& other) = delete;
+    IoQueue(IoQueue&& other) = delete;
+    IoQueue& operator=(const IoQueue& other) = delete;
+    IoQueue& operator=(IoQueue&& other) = delete;
+
+    friend class IoScheduler;
+    friend class NoopScheduler;
+    friend class DeadlineScheduler;
+
+    struct Stats
+    {
+        ulong Requests;
+        ulong BackMerges;
+        ulong FrontMerges;
+        ulong Dispatched;
+        ulong Completed;
+        ulong Errors;
+        ulong Bytes;
+        ulong BusyNs;
+    };
+
+    void AddLocked(BlockRequest* req);
+    void Schedule(BlockRequest* req);
+    IoScheduler* GetScheduler(SchedType type);
+
+    SpinLock Lock;
+    BlockQos Qos;
+    BlockDevice* Owner;
+    NoneScheduler None;
+    NoopScheduler Noop;
+    DeadlineScheduler Deadline;
+    SchedType Active;
+    Stdlib::ListEntry Requeued;
+
+    u32 SectorSize;
+    u32 MaxSegments;
+    u32 MaxSectors;
+    u64 NextSeq;
+    ulong Inflight;
+    ulong Scheduled;        /* requests handed to the scheduler, not dispatched */
+    u64 BusyStart;
+    Stats SchedStats[SchedMax];
+};
+
+}
@@ -0,0 +1,597 @@
+#include "loop.h"
+
+#include <include/const.h>
+#include <fs/buffer_cache.h>
+#include <kernel/sched.h>
+#include <kernel/trace.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+LoopDevice LoopDevice::Instances[MaxDevices];
+ulong LoopDevice::InstanceCount;
+
+LoopDevice::LoopDevice()
+    : Dev(nullptr)
+    , Fs(nullptr)
+    , Node(nullptr)
+    , Capacity(0)
+    , SectorSize(512)
+    , ReadOnly(false)
+{
+    Name[0] = '\0';
+    Path[0] = '\0';
+}
+
+LoopDevice::~LoopDevice()
+{
+}
+
+const char* LoopDevice::GetName()
+{
+    return Name;
+}
+
+u64 LoopDevice::GetCapacity()
+{
+    return Capacity;
+}
+
+u64 LoopDevice::GetSectorSize()
+{
+    return SectorSize;
+}
+
+bool LoopDevice::Init(const char* path, bool readOnly)
+{
+    if (!Vfs::GetInstance().MapFile(path, !readOnly, Map, Fs, Node))
+        return false;
+
+    Dev = Fs->GetDevice();
+    SectorSize = Dev->GetSectorSize();
+    if (SectorSize == 0 || Map.GetBlockSectors() == 0)
+    {
+        Vfs::GetInstance().UnmapFile(Fs, Node);
+        Map.Clear();
+        return false;
+    }
+
+    Capacity = Map.GetSize() / SectorSize;
+    if (Capacity > Map.GetSectors())
+        Capacity = Map.GetSectors();
+    ReadOnly = readOnly;
+    Stdlib::StrnCpy(Path, path, sizeof(Path));
+    Reads.Set(0);
+    Writes.Set(0);
+    Flushes.Set(0);
+    Attached.Set(1);
+    return true;
+}
+
+bool LoopDevice::Enter()
+{
+    /* Inflight is raised before Attached is checked, so Detach either
+       sees the request or the request sees the detach */
+    Inflight.Inc();
+    if (Attached.Get() == 0)
+    {
+        Inflight.Dec();
+        return false;
+    }
+    return true;
+}
+
+void LoopDevice::Leave()
+{
+    Inflight.Dec();
+}
+
+void LoopDevice::ForgetCached(u64 devSector, u64 count)
+{
+    /* Cached blocks are keyed by their first sector */
+    u32 step = Map.GetBlockSectors();
+    u64 first = devSector - devSector % step;
+    u64 end = devSector + count;
+    end += (step - end % step) % step;
+    BufferCache::GetInstance().ForgetRange(Dev, first, end - first, step);
+}
+
+LoopDevice::LoopIo* LoopDevice::Prepare(BlockRequest* req)
+{
+    bool write = (req->RequestType == BlockRequest::Write);
+    if (req->RequestType != BlockRequest::Flush &&
+        (!req->HasData() || (write && ReadOnly) ||
+         req->Sector > Capacity || req->SectorCount > Capacity - req->Sector))
+    {
+        return nullptr;
+    }
+
+    /* Pieces: one per extent the request spans, holes need none; a
+       read-only device has nothing to write back, its flushes need none
+       either */
+    ulong children = 0;
+    if (!req->HasData())
+    {
+        children = ReadOnly ? 0 : 1;
+    }
+    else
+    {
+        u64 sector = req->Sector;
+        u64 end = req->Sector + req->SectorCount;
+        while (sector < end)
+        {
+            const FileExtentMap::Extent* ext = Map.Find(sector);
+            if (ext == nullptr)
+                return nullptr;
+            if (ext->DevSector == FileExtentMap::Hole)
+            {
+                if (write)
+                {
+                    Trace(0, "LoopDevice %s: write into a hole at %u", Name, sector);
+                    return nullptr;
+                }
+            }
+            else
+            {
+                children++;
+            }
+            sector = ext->FileSector + ext->SectorCount;
+        }
+    }
+
+    LoopIo* io = new (Mm::NoThrow) LoopIo();
+    if (io == nullptr)
+        return nullptr;
+
+    io->Owner = this;
+    io->Parent = req;
+    io->Children = nullptr;
+    io->Count = 0;
+
+    if (children != 0)
+    {
+        io->Children = new (Mm::NoThrow) ChildIo[children];
+        if (io->Children == nullptr)
+        {
+            delete io;
+            return nullptr;
+        }
+    }
+
+    if (!req->HasData())
+    {
+        if (children != 0)
+        {
+            ChildIo& child = io->Children[io->Count++];
+            child.Io = io;
+            child.Req.RequestType = BlockRequest::Flush;
+            child.Req.IoClass = req->IoClass;
+        }
+    }
+    else
+    {
+        u64 sector = req->Sector;
+        u64 end = req->Sector + req->SectorCount;
+        u8* buf = static_cast<u8*>(req->Buffer);
+        while (sector < end)
+        {
+            const FileExtentMap::Extent* ext = Map.Find(sector);
+            u64 inExt = sector - ext->FileSector;
+            u64 n = ext->SectorCount - inExt;
+            if (n > end - sector)
+                n = end - sector;
+
+            u8* data = buf + (sector - req->Sector) * SectorSize;
+            if (ext->DevSector == FileExtentMap::Hole)
+            {
+                Stdlib::MemSet(data, 0, (ulong)(n * SectorSize));
+            }
+            else
+            {
+                ChildIo& child = io->Children[io->Count++];
+                child.Io = io;
+                child.Req.RequestType = req->RequestType;
+                child.Req.Fua = req->Fua;
+                child.Req.IoClass = req->IoClass;
+                child.Req.Sector = ext->DevSector + inExt;
+                child.Req.SectorCount = (u32)n;
+                child.Req.Buffer = data;
+                if (write)
+                    ForgetCached(child.Req.Sector, n);
+            }
+            sector += n;
+        }
+    }
+
+    io->Pending.Set((long)io->Count);
+    return io;
+}
+
+void LoopDevice::Finish(LoopIo* io)
+{
+    BlockRequest* parent = io->Parent;
+    bool ok = (io->Errors.Get() == 0);
+
+    delete[] io->Children;
+    delete io;
+
+    Leave();
+    parent->Complete(ok);
+}
+
+void LoopDevice::ChildEndIo(BlockRequest* req)
+{
+    ChildIo* child = CONTAINING_RECORD(req, ChildIo, Req);
+    LoopIo* io = child->Io;
+
+    if (!req->Success)
+        io->Errors.Inc();
+
+    /* Balance the WaitGroup before the child array can be freed */
+    req->Completion.Done();
+
+    if (io->Pending.DecAndTest())
+        io->Owner->Finish(io);
+}
+
+void LoopDevice::Submit(BlockRequest* req)
+{
+    SubmitBatch(&req, 1);
+}
+
+void LoopDevice::SubmitBatch(BlockRequest* const* reqs, ulong count)
+{
+    LoopIo** ios = new (Mm::NoThrow) LoopIo*[count];
+    if (ios == nullptr)
+    {
+        for (ulong i = 0; i < count; i++)
+            reqs[i]->Complete(false);
+        return;
+    }
+
+    bool async = GetInterruptsStarted();
+    ulong total = 0;
+
+    for (ulong i = 0; i < count; i++)
+    {
+        BlockRequest* req = reqs[i];
+        ios[i] = nullptr;
+
+        if (req->RequestType == BlockRequest::Discard)
+        {
+            req->Complete(Discard(req->Sector, req->SectorCount));
+            continue;
+        }
+        if (req->RequestType == BlockRequest::WriteZeroes)
+        {
+            req->Complete(WriteZeroes(req->Sector, req->SectorCount));
+            continue;
+        }
+
+        if (!Enter())
+        {
+            req->Complete(false);
+            continue;
+        }
+
+        LoopIo* io = Prepare(req);
+        if (io == nullptr)
+        {
+            Leave();
+            req->Complete(false);
+            continue;
+        }
+
+        if (req->RequestType == BlockRequest::Read)
+            Reads.Inc();
+        else if (req->RequestType == BlockRequest::Write)
+            Writes.Inc();
+        else
+            Flushes.Inc();
+
+        if (io->Count == 0)
+        {
+            Finish(io);
+            continue;
+        }
+
+        ios[i] = io;
+        total += io->Count;
+    }
+
+    /* Collect the pieces before submitting any: once submitted, a
+       LoopIo may complete and be freed at any time */
+    BlockRequest** batch = (total != 0) ? new (Mm::NoThrow) BlockRequest*[total] : nullptr;
+    if (total != 0 && batch == nullptr)
+    {
+        for (ulong i = 0; i < count; i++)
+        {
+            if (ios[i] == nullptr)
+                continue;
+            for (ulong j = 0; j < ios[i]->Count; j++)
+                ios[i]->Children[j].Req.Completion.Done();
+            ios[i]->Errors.Inc();
+            Finish(ios[i]);
+        }
+        delete[] ios;
+        return;
+    }
+
+    ulong fill = 0;
+    for (ulong i = 0; i < count; i++)
+    {
+        LoopIo* io = ios[i];
+        if (io == nullptr)
+            continue;
+
+        for (ulong j = 0; j < io->Count; j++)
+        {
+            ChildIo& child = io->Children[j];
+            if (async)
+                child.Req.EndIo = &LoopDevice::ChildEndIo;
+            batch[fill++] = &child.Req;
+        }
+    }
+
+    if (total != 0)
+        Dev->SubmitBatch(batch, total);
+
+    if (!async)
+    {
+        /* Early boot: the device completes by polling inside WaitRequest */
+        for (ulong i = 0; i < count; i++)
+        {
+            LoopIo* io = ios[i];
+            if (io == nullptr)
+                continue;
+
+            for (ulong j = 0; j < io->Count; j++)
+            {
+                ChildIo& child = io->Children[j];
+                Dev->WaitRequest(child.Req);
+                if (!child.Req.Success)
+                    io->Errors.Inc();
+            }
+            Finish(io);
+        }
+    }
+
+    delete[] batch;
+    delete[] ios;
+}
+
+bool LoopDevice::ReadSectors(u64 sector, void* buf, u32 count)
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Read;
+    req.Sector = sector;
+    req.SectorCount = count;
+    req.Buffer = buf;
+
+    Submit(&req);
+    WaitRequest(req);
+    return req.Success;
+}
+
+bool LoopDevice::WriteSectors(u64 sector, const void* buf, u32 count, bool fua)
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Write;
+    req.Fua = fua;
+    req.Sector = sector;
+    req.SectorCount = count;
+    req.Buffer = const_cast<void*>(buf);
+
+    Submit(&req);
+    WaitRequest(req);
+    return req.Success;
+}
+
+bool LoopDevice::Flush()
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Flush;
+
+    Submit(&req);
+    WaitRequest(req);
+    return req.Success;
+}
+
+bool LoopDevice::ForEachRange(u64 sector, u64 count,
+                              bool (*fn)(BlockDevice* dev, u64 sector, u64 count))
+{
+    if (ReadOnly || sector > Capacity || count > Capacity - sector)
+        return false;
+
+    bool ok = true;
+    u64 end = sector + count;
+    while (sector < end)
+    {
+        const FileExtentMap::Extent* ext = Map.Find(sector);
+        if (ext == nullptr)
+            return false;
+
+        u64 inExt = sector - ext->FileSector;
+        u64 n = ext->SectorCount - inExt;
+        if (n > end - sector)
+            n = end - sector;
+
+        if (ext->DevSector != FileExtentMap::Hole)
+        {
+            ForgetCached(ext->DevSector + inExt, n);
+            if (!fn(Dev, ext->DevSector + inExt, n))
+                ok = false;
+        }
+        sector += n;
+    }
+    return ok;
+}
+
+static bool DiscardRange(BlockDevice* dev, u64 sector, u64 count)
+{
+    return dev->Discard(sector, count);
+}
+
+static bool ZeroRange(BlockDevice* dev, u64 sector, u64 count)
+{
+    return dev->WriteZeroes(sector, count);
+}
+
+bool LoopDevice::SupportsDiscard()
+{
+    return Attached.Get() != 0 && !ReadOnly && Dev->SupportsDiscard();
+}
+
+bool LoopDevice::SupportsWriteZeroes()
+{
+    return Attached.Get() != 0 && !ReadOnly && Dev->SupportsWriteZeroes();
+}
+
+/* Discarded file blocks read back as whatever the device returns, which
+   a discard allows; holes already read as zeros */
+bool LoopDevice::Discard(u64 sector, u64 count)
+{
+    if (!Enter())
+        return false;
+
+    bool ok = Dev->SupportsDiscard() && ForEachRange(sector, count, &DiscardRange);
+    Leave();
+    return ok;
+}
+
+bool LoopDevice::WriteZeroes(u64 sector, u64 count)
+{
+    if (!Enter())
+        return false;
+
+    bool ok = ForEachRange(sector, count, &ZeroRange);
+    Leave();
+    return ok;
+}
+
+bool LoopDevice::Detach()
+{
+    if (Attached.Get() == 0)
+        return false;
+
+    if (Vfs::GetInstance().IsDeviceMounted(this))
+    {
+        Trace(0, "LoopDevice %s: still mounted", Name);
+        return false;
+    }
+
+    if (Attached.Cmpxchg(0, 1) != 1)
+        return false;
+
+    while (Inflight.Get() != 0)
+        Sleep(Const::NanoSecsInMs);
+
+    /* Blocks cached for this device describe a file that goes away */
+    BufferCache::GetInstance().Sync(this);
+    BufferCache::GetInstance().Invalidate(this);
+
+    bool ok = ReadOnly || Dev->Flush();
+    if (!ok)
+        Trace(0, "LoopDevice %s: flush of %s failed", Name, Dev->GetName());
+
+    Vfs::GetInstance().UnmapFile(Fs, Node);
+    Map.Clear();
+    Capacity = 0;
+    Fs = nullptr;
+    Node = nullptr;
+    Trace(0, "LoopDevice %s: detached %s", Name, Path);
+    Path[0] = '\0';
+    return ok;
+}
+
+void LoopDevice::Dump(Stdlib::Printer& printer)
+{
+    if (Attached.Get() == 0)
+    {
+        printer.Printf("%s  detached\n", Name);
+        return;
+    }
+
+    printer.Printf("%s  %s on %s  %s  %u sectors (%u KB)  %u extents\n",
+        Name, Path, Dev->GetName(), ReadOnly ? "ro" : "rw",
+        Capacity, Capacity * SectorSize / Const::KB, Map.GetCount());
+    printer.Printf("  reads %u  writes %u  flushes %u  inflight %u\n",
+        (ulong)Reads.Get(), (ulong)Writes.Get(), (ulong)Flushes.Get(),
+        (ulong)Inflight.Get());
+}
+
+void LoopDevice::DumpAll(Stdlib::Printer& printer)
+{
+    if (InstanceCount == 0)
+    {
+        printer.Printf("no loop devices\n");
+        return;
+    }
+
+    for (ulong i = 0; i < InstanceCount; i++)
+        Instances[i].Dump(printer);
+}
+
+LoopDevice* LoopDevice::Find(const char* name)
+{
+    for (ulong i = 0; i < InstanceCount; i++)
+    {
+        if (Stdlib::StrCmp(Instances[i].Name, name) == 0)
+            return &Instances[i];
+    }
+    return nullptr;
+}
+
+LoopDevice* LoopDevice::Attach(const char* path, bool readOnly)
+{
+    LoopDevice* inst = nullptr;
+    for (ulong i = 0; i < InstanceCount; i++)
+    {
+        if (Instances[i].Attached.Get() == 0)
+        {
+            inst = &Instances[i];
+            break;
+        }
+    }
+
+    bool fresh = false;
+    if (inst == nullptr)
+    {
+        if (InstanceCount >= MaxDevices)
+        {
+            Trace(0, "LoopDevice: max devices reached");
+            return nullptr;
+        }
+
+        /* Instances live in BSS; global constructors are not run */
+        inst = &Instances[InstanceCount];
+        new (inst) LoopDevice();
+        Stdlib::SnPrintf(inst->Name, sizeof(inst->Name), "loop%u", InstanceCount);
+        fresh = true;
+    }
+
+    if (!inst->Init(path, readOnly))
+    {
+        Trace(0, "LoopDevice %s: cannot map %s", inst->Name, path);
+        return nullptr;
+    }
+
+    if (fresh)
+    {
+        if (!BlockDeviceTable::GetInstance().Register(inst))
+        {
+            inst->Detach();
+            return nullptr;
+        }
+        InstanceCount++;
+    }
+
+    Trace(0, "LoopDevice %s: %s on %s, %u sectors in %u extents%s",
+        inst->Name, path, inst->Dev->GetName(), inst->Capacity,
+        inst->Map.GetCount(), readOnly ? ", read-only" : "");
+    return inst;
+}
+
+}
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "block_device.h"
+
+#include <fs/vfs.h>
+#include <kernel/atomic.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* File-backed block device (loop0, loop1, ...) over a file on a mounted
+   block file system (nanofs, ext2).
+
+   Attaching maps the file through Vfs::MapFile and caches its extent
+   map until detach.  A request is translated through the map into
+   requests on the file system's device that point into the caller's
+   buffer, so data moves between the caller and the disk without a copy
+   through the VFS or the buffer cache.  Pieces in different extents are
+   submitted as one batch and complete the original through
+   BlockRequest::EndIo, as RAID members do.  Flush and FUA are passed
+   through to the device; writes drop cached copies of the blocks they
+   overwrite.  A read-write attach allocates zeroed blocks for the
+   holes of a sparse file first and fails if the file system is out of
+   space; read-only maps keep the holes, which read as zeros.
+
+   Capacity is the file size rounded down to whole sectors.  While
+   attached the file cannot be rewritten or removed and its mount cannot
+   be unmounted; reading it through the file system meanwhile may
+   return stale data.  Detached devices stay registered with capacity 0
+   and are reused by the next attach. */
+class LoopDevice : public BlockDevice
+{
+public:
+    LoopDevice();
+    virtual ~LoopDevice();
+
+    virtual const char* GetName() override;
+    virtual u64 GetCapacity() override;
+    virtual u64 GetSectorSize() override;
+    virtual bool Flush() override;
+    virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
+    virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual bool SupportsDiscard() override;
+    virtual bool SupportsWriteZeroes() override;
+    virtual bool Discard(u64 sector, u64 count) override;
+    virtual bool WriteZeroes(u64 sector, u64 count) override;
+    virtual void Submit(BlockRequest* req) override;
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count) override;
+
+    /* Flush and release the file; fails while a file system is mounted
+       on the device. */
+    bool Detach();
+
+    void Dump(Stdlib::Printer& printer);
+
+    /* Attach the file at path to the first free loop device, registering
+       a new one if none is free. */
+    static LoopDevice* Attach(const char* path, bool readOnly);
+
+    static LoopDevice* Find(const char* name);
+    static void DumpAll(Stdlib::Printer& printer);
+
+    static const ulong MaxDevices = 8;
+
+private:
+    LoopDevice(const LoopDevice& other) = delete;
+    LoopDevice(LoopDevice&& other) = delete;
+    LoopDevice& operator=(const LoopDevice& other) = delete;
+    LoopDevice& operator=(LoopDevice&& other) = delete;
+
+    struct ChildIo;
+
+    /* One request being served by the backing device */
+    struct LoopIo
+    {
+        LoopDevice* Owner;
+        BlockRequest* Parent;
+        ChildIo* Children;
+        ulong Count;
+        Atomic Pending;
+        Atomic Errors;
+    };
+
+    struct ChildIo
+    {
+        BlockRequest Req;
+        LoopIo* Io;
+    };
+
+    bool Init(const char* path, bool readOnly);
+
+    /* Translate req into backing device requests; nullptr if out of
+       range, read-only or out of memory. */
+    LoopIo* Prepare(BlockRequest* req);
+
+    /* Apply fn to the device ranges behind [sector, sector + count);
+       holes are skipped. */
+    bool ForEachRange(u64 sector, u64 count, bool (*fn)(BlockDevice* dev, u64 sector, u64 count));
+
+    /* Drop cached copies of the device blocks behind a write. */
+    void ForgetCached(u64 devSector, u64 count);
+
+    void Finish(LoopIo* io);
+    static void ChildEndIo(BlockRequest* req);
+
+    bool Enter();
+    void Leave();
+
+    char Name[8];
+    char Path[Vfs::MaxPath];
+    BlockDevice* Dev;
+    FileSystem* Fs;
+    VNode* Node;
+    FileExtentMap Map;
+    u64 Capacity;
+    u64 SectorSize;
+    bool ReadOnly;
+    Atomic Attached;
+    Atomic Inflight;        /* requests between Enter and Leave */
+
+    Atomic Reads;
+    Atomic Writes;
+    Atomic Flushes;
+
+    static LoopDevice Instances[MaxDevices];
+    static ulong InstanceCount;
+};
+
+}
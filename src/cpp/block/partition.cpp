@@ -76,6 +76,94 @@ bool PartitionDevice::WriteSectors(u64 sector, const void* buf, u32 count, bool
     return Parent->WriteSectors(StartSector + sector, buf, count, fua);
 }
 
+bool PartitionDevice::SupportsDiscard()
+{
+    return Parent->SupportsDiscard();
+}
+
+bool PartitionDevice::SupportsWriteZeroes()
+{
+    return Parent->SupportsWriteZeroes();
+}
+
+bool PartitionDevice::Discard(u64 sector, u64 count)
+{
+    if (sector > SectorCount || count > SectorCount - sector)
+        return false;
+    return Parent->Discard(StartSector + sector, count);
+}
+
+bool PartitionDevice::WriteZeroes(u64 sector, u64 count)
+{
+    if (sector > SectorCount || count > SectorCount - sector)
+        return false;
+    return Parent->WriteZeroes(StartSector + sector, count);
+}
+
+/* Translate req to parent sectors in place; false if out of range. */
+bool PartitionDevice::Remap(BlockRequest* req)
+{
+    if (req->RequestType == BlockRequest::Flush)
+        return true;
+    if (req->Sector > SectorCount || req->SectorCount > SectorCount - req->Sector)
+        return false;
+    req->Sector += StartSector;
+    return true;
+}
+
+void PartitionDevice::Submit(BlockRequest* req)
+{
+    if (!Remap(req))
+    {
+        req->Complete(false);
+        return;
+    }
+    Parent->Submit(req);
+}
+
+void PartitionDevice::SubmitBatch(BlockRequest* const* reqs, ulong count)
+{
+    for (ulong i = 0; i < count; i++)
+    {
+        if (!Remap(reqs[i]))
+        {
+            /* Keep the batch all-or-nothing for the caller's error path */
+            for (ulong j = 0; j < count; j++)
+            {
+                reqs[j]->Complete(false);
+            }
+            return;
+        }
+    }
+    Parent->SubmitBatch(reqs, count);
+}
+
+void PartitionDevice::WaitRequest(BlockRequest& req)
+{
+    Parent->WaitRequest(req);
+}
+
+IoQueue* PartitionDevice::GetIoQueue()
+{
+    return Parent->GetIoQueue();
+}
+
+/* Completion polling is a property of the parent's queue */
+bool PartitionDevice::SetPollMode(BlockPollState::Mode mode)
+{
+    return Parent->SetPollMode(mode);
+}
+
+BlockPollState::Mode PartitionDevice::GetPollMode()
+{
+    return Parent->GetPollMode();
+}
+
+void PartitionDevice::DumpPollStats(Stdlib::Printer& printer)
+{
+    Parent->DumpPollStats(printer);
+}
+
 bool PartitionDevice::ProbeDevice(BlockDevice* dev)
 {
     Stdlib::UniquePtr<u8, Mm::FreeDeleter> buf(static_cast<u8*>(Mm::Alloc(Const::PageSize, 0)));
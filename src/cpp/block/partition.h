@@ -42,6 +42,17 @@ public:
     virtual bool Flush() override;
     virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
     virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual bool SupportsDiscard() override;
+    virtual bool SupportsWriteZeroes() override;
+    virtual bool Discard(u64 sector, u64 count) override;
+    virtual bool WriteZeroes(u64 sector, u64 count) override;
+    virtual void Submit(BlockRequest* req) override;
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count) override;
+    virtual void WaitRequest(BlockRequest& req) override;
+    virtual IoQueue* GetIoQueue() override;
+    virtual bool SetPollMode(BlockPollState::Mode mode) override;
+    virtual BlockPollState::Mode GetPollMode() override;
+    virtual void DumpPollStats(Stdlib::Printer& printer) override;
 
     static void ProbeAll();
 
@@ -52,6 +63,7 @@ private:
     PartitionDevice& operator=(PartitionDevice&& other) = delete;
 
     static bool ProbeDevice(BlockDevice* dev);
+    bool Remap(BlockRequest* req);
 
     BlockDevice* Parent;
     u64 StartSector;
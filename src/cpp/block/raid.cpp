@@ -0,0 +1,662 @@
+#include "raid.h"
+
+#include <include/const.h>
+#include <kernel/trace.h>
+#include <kernel/parameters.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+RaidDevice RaidDevice::Instances[MaxArrays];
+ulong RaidDevice::InstanceCount;
+
+RaidDevice::RaidDevice()
+    : RaidLevel(Raid0)
+    , MemberCount(0)
+    , ChunkSectors(0)
+    , Capacity(0)
+    , SectorSize(0)
+{
+    Name[0] = '\0';
+    for (ulong i = 0; i < MaxMembers; i++)
+    {
+        Members[i] = nullptr;
+        LastSector[i] = 0;
+    }
+}
+
+RaidDevice::~RaidDevice()
+{
+}
+
+bool RaidDevice::Init(const char* name, Level level, u32 chunkSectors,
+                      BlockDevice* const* members, ulong memberCount)
+{
+    if (memberCount < 2 || memberCount > MaxMembers)
+        return false;
+
+    SectorSize = members[0]->GetSectorSize();
+    u64 minCapacity = members[0]->GetCapacity();
+    for (ulong i = 0; i < memberCount; i++)
+    {
+        if (members[i]->GetSectorSize() != SectorSize)
+        {
+            Trace(0, "RaidDevice %s: %s sector size differs", name, members[i]->GetName());
+            return false;
+        }
+        if (members[i]->GetCapacity() < minCapacity)
+            minCapacity = members[i]->GetCapacity();
+        Members[i] = members[i];
+    }
+
+    MemberCount = memberCount;
+    RaidLevel = level;
+    ChunkSectors = chunkSectors;
+
+    if (level == Raid0)
+        Capacity = (minCapacity / ChunkSectors) * ChunkSectors * MemberCount;
+    else
+        Capacity = minCapacity;
+
+    if (Capacity == 0)
+        return false;
+
+    ulong nameLen = Stdlib::StrLen(name);
+    if (nameLen >= sizeof(Name))
+        nameLen = sizeof(Name) - 1;
+    Stdlib::MemCpy(Name, name, nameLen);
+    Name[nameLen] = '\0';
+
+    return true;
+}
+
+const char* RaidDevice::GetName()
+{
+    return Name;
+}
+
+u64 RaidDevice::GetCapacity()
+{
+    return Capacity;
+}
+
+u64 RaidDevice::GetSectorSize()
+{
+    return SectorSize;
+}
+
+u64 RaidDevice::MemberSectorsBelow(ulong m, u64 sector)
+{
+    u64 stripe = (u64)ChunkSectors * MemberCount;
+    u64 below = (sector / stripe) * ChunkSectors;
+    u64 inStripe = sector % stripe;
+    u64 memberStart = (u64)m * ChunkSectors;
+
+    if (inStripe > memberStart)
+    {
+        u64 part = inStripe - memberStart;
+        below += (part < ChunkSectors) ? part : ChunkSectors;
+    }
+    return below;
+}
+
+ulong RaidDevice::PickReadMember(u64 sector)
+{
+    ulong best = 0;
+    long bestInflight = 0;
+    u64 bestDist = 0;
+
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        long inflight = Inflight[m].Get();
+        u64 last = LastSector[m];
+        u64 dist = (last > sector) ? last - sector : sector - last;
+
+        if (m == 0 || inflight < bestInflight ||
+            (inflight == bestInflight && dist < bestDist))
+        {
+            best = m;
+            bestInflight = inflight;
+            bestDist = dist;
+        }
+    }
+    return best;
+}
+
+void RaidDevice::AddChild(RaidIo* io, ulong member, BlockRequest* req,
+                          u64 memberSector, u32 sectors, ulong bufOffset)
+{
+    ChildIo& child = io->Children[io->Count++];
+    child.Io = io;
+    child.Member = member;
+    child.Req.RequestType = req->RequestType;
+    child.Req.Sector = memberSector;
+    child.Req.Fua = req->Fua;
+    child.Req.SectorCount = sectors;
+    child.Req.Buffer = req->HasData() ? static_cast<u8*>(req->Buffer) + bufOffset : nullptr;
+
+    if (req->RequestType == BlockRequest::Read)
+        LastSector[member] = memberSector + sectors;
+}
+
+RaidDevice::RaidIo* RaidDevice::Prepare(BlockRequest* req)
+{
+    bool data = req->HasData();
+    if (!data && req->RequestType != BlockRequest::Flush)
+        return nullptr;
+    if (data && (req->Sector > Capacity || req->SectorCount > Capacity - req->Sector))
+        return nullptr;
+
+    ulong children;
+    if (!data || (RaidLevel == Raid1 && req->RequestType == BlockRequest::Write))
+        children = MemberCount;
+    else if (RaidLevel == Raid1)
+        children = (req->SectorCount != 0) ? 1 : 0;
+    else
+        children = ((req->Sector % ChunkSectors) + req->SectorCount + ChunkSectors - 1) / ChunkSectors;
+
+    RaidIo* io = new (Mm::NoThrow) RaidIo();
+    if (io == nullptr)
+        return nullptr;
+
+    io->Owner = this;
+    io->Parent = req;
+    io->Children = nullptr;
+    io->Count = 0;
+
+    if (children != 0)
+    {
+        io->Children = new (Mm::NoThrow) ChildIo[children];
+        if (io->Children == nullptr)
+        {
+            delete io;
+            return nullptr;
+        }
+    }
+
+    if (!data || (RaidLevel == Raid1 && req->RequestType == BlockRequest::Write))
+    {
+        for (ulong m = 0; m < MemberCount; m++)
+            AddChild(io, m, req, req->Sector, req->SectorCount, 0);
+    }
+    else if (RaidLevel == Raid1)
+    {
+        if (children != 0)
+            AddChild(io, PickReadMember(req->Sector), req, req->Sector, req->SectorCount, 0);
+    }
+    else
+    {
+        u64 sector = req->Sector;
+        u32 left = req->SectorCount;
+        ulong offset = 0;
+        while (left != 0)
+        {
+            u64 chunk = sector / ChunkSectors;
+            u32 inChunk = (u32)(sector % ChunkSectors);
+            u32 n = ChunkSectors - inChunk;
+            if (n > left)
+                n = left;
+
+            AddChild(io, (ulong)(chunk % MemberCount), req,
+                     (chunk / MemberCount) * ChunkSectors + inChunk, n, offset);
+
+            sector += n;
+            left -= n;
+            offset += (ulong)n * SectorSize;
+        }
+    }
+
+    io->Pending.Set((long)io->Count);
+    return io;
+}
+
+void RaidDevice::Finish(RaidIo* io)
+{
+    BlockRequest* parent = io->Parent;
+    bool ok = (io->Errors.Get() == 0);
+
+    delete[] io->Children;
+    delete io;
+
+    parent->Complete(ok);
+}
+
+void RaidDevice::ChildEndIo(BlockRequest* req)
+{
+    ChildIo* child = CONTAINING_RECORD(req, ChildIo, Req);
+    RaidIo* io = child->Io;
+    RaidDevice* owner = io->Owner;
+
+    owner->Inflight[child->Member].Dec();
+    if (!req->Success)
+        io->Errors.Inc();
+
+    /* Balance the WaitGroup before the child array can be freed */
+    req->Completion.Done();
+
+    if (io->Pending.DecAndTest())
+        owner->Finish(io);
+}
+
+void RaidDevice::Submit(BlockRequest* req)
+{
+    SubmitBatch(&req, 1);
+}
+
+void RaidDevice::SubmitBatch(BlockRequest* const* reqs, ulong count)
+{
+    RaidIo** ios = new (Mm::NoThrow) RaidIo*[count];
+    if (ios == nullptr)
+    {
+        for (ulong i = 0; i < count; i++)
+            reqs[i]->Complete(false);
+        return;
+    }
+
+    bool async = GetInterruptsStarted();
+    ulong perMember[MaxMembers] = {};
+    ulong total = 0;
+
+    for (ulong i = 0; i < count; i++)
+    {
+        BlockRequest* req = reqs[i];
+        ios[i] = nullptr;
+
+        if (req->RequestType == BlockRequest::Discard)
+        {
+            req->Complete(Discard(req->Sector, req->SectorCount));
+            continue;
+        }
+        if (req->RequestType == BlockRequest::WriteZeroes)
+        {
+            req->Complete(WriteZeroes(req->Sector, req->SectorCount));
+            continue;
+        }
+
+        RaidIo* io = Prepare(req);
+        if (io == nullptr)
+        {
+            req->Complete(false);
+            continue;
+        }
+        if (io->Count == 0)
+        {
+            Finish(io);
+            continue;
+        }
+
+        ios[i] = io;
+        for (ulong j = 0; j < io->Count; j++)
+            perMember[io->Children[j].Member]++;
+        total += io->Count;
+    }
+
+    /* Group the member requests per member before submitting any: once
+       submitted, a RaidIo may complete and be freed at any time. */
+    BlockRequest** batch = (total != 0) ? new (Mm::NoThrow) BlockRequest*[total] : nullptr;
+    if (total != 0 && batch == nullptr)
+    {
+        for (ulong i = 0; i < count; i++)
+        {
+            if (ios[i] == nullptr)
+                continue;
+            for (ulong j = 0; j < ios[i]->Count; j++)
+                ios[i]->Children[j].Req.Completion.Done();
+            ios[i]->Errors.Inc();
+            Finish(ios[i]);
+        }
+        delete[] ios;
+        return;
+    }
+
+    ulong start[MaxMembers];
+    ulong fill[MaxMembers];
+    ulong next = 0;
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        start[m] = next;
+        fill[m] = next;
+        next += perMember[m];
+    }
+
+    for (ulong i = 0; i < count; i++)
+    {
+        RaidIo* io = ios[i];
+        if (io == nullptr)
+            continue;
+
+        for (ulong j = 0; j < io->Count; j++)
+        {
+            ChildIo& child = io->Children[j];
+            if (async)
+                child.Req.EndIo = &RaidDevice::ChildEndIo;
+
+            Inflight[child.Member].Inc();
+            if (child.Req.RequestType == BlockRequest::Read)
+                Reads[child.Member].Inc();
+            else if (child.Req.RequestType == BlockRequest::Write)
+                Writes[child.Member].Inc();
+
+            batch[fill[child.Member]++] = &child.Req;
+        }
+    }
+
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        if (perMember[m] != 0)
+            Members[m]->SubmitBatch(&batch[start[m]], perMember[m]);
+    }
+
+    if (!async)
+    {
+        /* Early boot: members complete by polling inside WaitRequest */
+        for (ulong i = 0; i < count; i++)
+        {
+            RaidIo* io = ios[i];
+            if (io == nullptr)
+                continue;
+
+            for (ulong j = 0; j < io->Count; j++)
+            {
+                ChildIo& child = io->Children[j];
+                Members[child.Member]->WaitRequest(child.Req);
+                Inflight[child.Member].Dec();
+                if (!child.Req.Success)
+                    io->Errors.Inc();
+            }
+            Finish(io);
+        }
+    }
+
+    delete[] batch;
+    delete[] ios;
+}
+
+bool RaidDevice::ReadSectors(u64 sector, void* buf, u32 count)
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Read;
+    req.Sector = sector;
+    req.SectorCount = count;
+    req.Buffer = buf;
+
+    Submit(&req);
+    WaitRequest(req);
+    return req.Success;
+}
+
+bool RaidDevice::WriteSectors(u64 sector, const void* buf, u32 count, bool fua)
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Write;
+    req.Sector = sector;
+    req.SectorCount = count;
+    req.Buffer = const_cast<void*>(buf);
+
+    Submit(&req);
+    WaitRequest(req);
+
+    if (!req.Success)
+        return false;
+    if (fua)
+        return Flush();
+    return true;
+}
+
+bool RaidDevice::Flush()
+{
+    BlockRequest req;
+    req.RequestType = BlockRequest::Flush;
+
+    Submit(&req);
+    WaitRequest(req);
+    return req.Success;
+}
+
+bool RaidDevice::SupportsDiscard()
+{
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        if (!Members[m]->SupportsDiscard())
+            return false;
+    }
+    return MemberCount != 0;
+}
+
+bool RaidDevice::SupportsWriteZeroes()
+{
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        if (!Members[m]->SupportsWriteZeroes())
+            return false;
+    }
+    return MemberCount != 0;
+}
+
+/* A logical range covers one contiguous range on every RAID-0 member */
+bool RaidDevice::Discard(u64 sector, u64 count)
+{
+    if (sector > Capacity || count > Capacity - sector || !SupportsDiscard())
+        return false;
+
+    bool ok = true;
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        u64 first = sector;
+        u64 last = sector + count;
+        if (RaidLevel == Raid0)
+        {
+            first = MemberSectorsBelow(m, sector);
+            last = MemberSectorsBelow(m, sector + count);
+        }
+        if (last > first && !Members[m]->Discard(first, last - first))
+            ok = false;
+    }
+    return ok;
+}
+
+bool RaidDevice::WriteZeroes(u64 sector, u64 count)
+{
+    if (sector > Capacity || count > Capacity - sector)
+        return false;
+
+    bool ok = true;
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        u64 first = sector;
+        u64 last = sector + count;
+        if (RaidLevel == Raid0)
+        {
+            first = MemberSectorsBelow(m, sector);
+            last = MemberSectorsBelow(m, sector + count);
+        }
+        if (last > first && !Members[m]->WriteZeroes(first, last - first))
+            ok = false;
+    }
+    return ok;
+}
+
+void RaidDevice::Dump(Stdlib::Printer& printer)
+{
+    if (RaidLevel == Raid0)
+        printer.Printf("%s  raid0  chunk %u KB  %u members  %u sectors (%u MB)\n",
+            Name, (ulong)ChunkSectors * SectorSize / Const::KB, MemberCount,
+            Capacity, Capacity * SectorSize / Const::MB);
+    else
+        printer.Printf("%s  raid1  %u members  %u sectors (%u MB)\n",
+            Name, MemberCount, Capacity, Capacity * SectorSize / Const::MB);
+
+    for (ulong m = 0; m < MemberCount; m++)
+    {
+        printer.Printf("  %s  reads %u  writes %u  inflight %u\n",
+            Members[m]->GetName(), (ulong)Reads[m].Get(),
+            (ulong)Writes[m].Get(), (ulong)Inflight[m].Get());
+    }
+}
+
+void RaidDevice::DumpAll(Stdlib::Printer& printer)
+{
+    if (InstanceCount == 0)
+    {
+        printer.Printf("no raid devices\n");
+        return;
+    }
+
+    for (ulong i = 0; i < InstanceCount; i++)
+        Instances[i].Dump(printer);
+}
+
+bool RaidDevice::ParseLevel(const char* str, Level& level)
+{
+    if (Stdlib::StrCmp(str, "raid0") == 0 || Stdlib::StrCmp(str, "0") == 0)
+    {
+        level = Raid0;
+        return true;
+    }
+    if (Stdlib::StrCmp(str, "raid1") == 0 || Stdlib::StrCmp(str, "1") == 0)
+    {
+        level = Raid1;
+        return true;
+    }
+    return false;
+}
+
+RaidDevice* RaidDevice::Create(const char* name, Level level, ulong chunkKb,
+                               const char* const* memberNames, ulong memberCount)
+{
+    auto& table = BlockDeviceTable::GetInstance();
+
+    if (InstanceCount >= MaxArrays)
+    {
+        Trace(0, "RaidDevice %s: max arrays reached", name);
+        return nullptr;
+    }
+    if (name[0] == '\0' || table.Find(name) != nullptr)
+    {
+        Trace(0, "RaidDevice %s: bad or duplicate name", name);
+        return nullptr;
+    }
+    if (memberCount < 2 || memberCount > MaxMembers)
+    {
+        Trace(0, "RaidDevice %s: need 2..%u members", name, MaxMembers);
+        return nullptr;
+    }
+    if (level == Raid0 && (chunkKb == 0 || (chunkKb * Const::KB) % Const::PageSize != 0))
+    {
+        Trace(0, "RaidDevice %s: chunk %u KB is not a multiple of the page size", name, chunkKb);
+        return nullptr;
+    }
+
+    BlockDevice* members[MaxMembers];
+    for (ulong i = 0; i < memberCount; i++)
+    {
+        members[i] = table.Find(memberNames[i]);
+        if (members[i] == nullptr)
+        {
+            Trace(0, "RaidDevice %s: member %s not found", name, memberNames[i]);
+            return nullptr;
+        }
+        for (ulong j = 0; j < i; j++)
+        {
+            if (members[j] == members[i])
+            {
+                Trace(0, "RaidDevice %s: member %s listed twice", name, memberNames[i]);
+                return nullptr;
+            }
+        }
+    }
+
+    u64 sectorSize = members[0]->GetSectorSize();
+    if (sectorSize == 0)
+        return nullptr;
+    u32 chunkSectors = (u32)(chunkKb * Const::KB / sectorSize);
+
+    /* Instances live in BSS; global constructors are not run */
+    auto& inst = Instances[InstanceCount];
+    new (&inst) RaidDevice();
+    if (!inst.Init(name, level, chunkSectors, members, memberCount))
+    {
+        Trace(0, "RaidDevice %s: init failed", name);
+        return nullptr;
+    }
+
+    if (!table.Register(&inst))
+        return nullptr;
+
+    InstanceCount++;
+    Trace(0, "RaidDevice %s: raid%u over %u members, %u sectors",
+        name, (ulong)level, memberCount, inst.Capacity);
+    return &inst;
+}
+
+/* raid=<name>:<raid0|raid1>[:<chunkKB>]:<disk>+<disk>[+...][,...] */
+void RaidDevice::AssembleFromParameters()
+{
+    const char* spec = Parameters::GetInstance().GetRaid();
+
+    while (*spec != '\0')
+    {
+        const char* end = spec;
+        while (*end != '\0' && *end != ',')
+            end++;
+
+        char entry[64];
+        ulong len = (ulong)(end - spec);
+        if (len >= sizeof(entry))
+            len = sizeof(entry) - 1;
+        Stdlib::MemCpy(entry, spec, len);
+        entry[len] = '\0';
+        spec = (*end == ',') ? end + 1 : end;
+
+        /* Split into ':' fields */
+        char* fields[4];
+        ulong fieldCount = 0;
+        char* p = entry;
+        while (fieldCount < 4)
+        {
+            fields[fieldCount++] = p;
+            while (*p != '\0' && *p != ':')
+                p++;
+            if (*p == '\0')
+                break;
+            *p++ = '\0';
+        }
+
+        Level level;
+        if (fieldCount < 3 || !ParseLevel(fields[1], level))
+        {
+            Trace(0, "RaidDevice: bad raid parameter entry %s", fields[0]);
+            continue;
+        }
+
+        ulong chunkKb = DefaultChunkKb;
+        char* memberList = fields[2];
+        if (fieldCount == 4)
+        {
+            if (!Stdlib::ParseUlong(fields[2], chunkKb))
+            {
+                Trace(0, "RaidDevice: bad chunk size %s", fields[2]);
+                continue;
+            }
+            memberList = fields[3];
+        }
+
+        const char* names[MaxMembers];
+        ulong count = 0;
+        p = memberList;
+        while (*p != '\0' && count < MaxMembers)
+        {
+            names[count++] = p;
+            while (*p != '\0' && *p != '+')
+                p++;
+            if (*p == '+')
+                *p++ = '\0';
+        }
+
+        Create(fields[0], level, chunkKb, names, count);
+    }
+}
+
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "block_device.h"
+
+#include <kernel/atomic.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* Software RAID over registered block devices.
+
+   RAID-0 stripes the address space across the members in chunks of
+   ChunkSectors; capacity is the smallest member rounded down to whole
+   chunks, times the member count.  RAID-1 mirrors every write to all
+   members and sends each read to one of them: the member with the
+   fewest reads in flight, ties going to the one whose last read ended
+   closest to the new one.  Capacity is the smallest member.
+
+   A request is split into member requests that are submitted per member
+   as one batch (so the member's scheduler can merge them) and complete
+   the original through BlockRequest::EndIo once the last one finishes.
+   Before interrupts are up the members are waited for in Submit. */
+class RaidDevice : public BlockDevice
+{
+public:
+    enum Level : u8
+    {
+        Raid0 = 0,
+        Raid1 = 1,
+    };
+
+    RaidDevice();
+    virtual ~RaidDevice();
+
+    virtual const char* GetName() override;
+    virtual u64 GetCapacity() override;
+    virtual u64 GetSectorSize() override;
+    virtual bool Flush() override;
+    virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
+    virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual bool SupportsDiscard() override;
+    virtual bool SupportsWriteZeroes() override;
+    virtual bool Discard(u64 sector, u64 count) override;
+    virtual bool WriteZeroes(u64 sector, u64 count) override;
+    virtual void Submit(BlockRequest* req) override;
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count) override;
+
+    void Dump(Stdlib::Printer& printer);
+
+    /* Assemble and register an array from the named members.  chunkKb
+       is the RAID-0 stripe chunk (a multiple of the page size) and is
+       ignored for RAID-1. */
+    static RaidDevice* Create(const char* name, Level level, ulong chunkKb,
+                              const char* const* memberNames, ulong memberCount);
+
+    /* Assemble the arrays listed in the raid= kernel parameter. */
+    static void AssembleFromParameters();
+
+    static bool ParseLevel(const char* str, Level& level);
+    static void DumpAll(Stdlib::Printer& printer);
+
+    static const ulong MaxMembers = 8;
+    static const ulong MaxArrays = 4;
+    static const ulong DefaultChunkKb = 64;
+
+private:
+    RaidDevice(const RaidDevice& other) = delete;
+    RaidDevice(RaidDevice&& other) = delete;
+    RaidDevice& operator=(const RaidDevice& other) = delete;
+    RaidDevice& operator=(RaidDevice&& other) = delete;
+
+    struct ChildIo;
+
+    /* One request being served by the members */
+    struct RaidIo
+    {
+        RaidDevice* Owner;
+        BlockRequest* Parent;
+        ChildIo* Children;
+        ulong Count;
+        Atomic Pending;
+        Atomic Errors;
+    };
+
+    struct ChildIo
+    {
+        BlockRequest Req;
+        RaidIo* Io;
+        ulong Member;
+    };
+
+    bool Init(const char* name, Level level, u32 chunkSectors,
+              BlockDevice* const* members, ulong memberCount);
+
+    /* Split req into member requests; nullptr if out of range or out of
+       memory. */
+    RaidIo* Prepare(BlockRequest* req);
+    void AddChild(RaidIo* io, ulong member, BlockRequest* req,
+                  u64 memberSector, u32 sectors, ulong bufOffset);
+    ulong PickReadMember(u64 sector);
+
+    /* Sectors of member m that lie below logical sector (RAID-0). */
+    u64 MemberSectorsBelow(ulong m, u64 sector);
+
+    void Finish(RaidIo* io);
+    static void ChildEndIo(BlockRequest* req);
+
+    char Name[16];
+    Level RaidLevel;
+    BlockDevice* Members[MaxMembers];
+    ulong MemberCount;
+    u32 ChunkSectors;
+    u64 Capacity;
+    u64 SectorSize;
+
+    /* Per member */
+    Atomic Inflight[MaxMembers];
+    volatile u64 LastSector[MaxMembers];
+    Atomic Reads[MaxMembers];
+    Atomic Writes[MaxMembers];
+
+    static RaidDevice Instances[MaxArrays];
+    static ulong InstanceCount;
+};
+
+}
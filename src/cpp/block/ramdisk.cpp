@@ -0,0 +1,364 @@
+#include "ramdisk.h"
+
+#include <include/const.h>
+#include <kernel/trace.h>
+#include <kernel/sched.h>
+#include <kernel/parameters.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+RamDisk RamDisk::Instances[MaxDisks];
+ulong RamDisk::InstanceCount;
+
+RamDisk::RamDisk()
+    : Pages(nullptr)
+    , PageCount(0)
+    , Capacity(0)
+    , LatencyUs(0)
+{
+    Name[0] = '\0';
+}
+
+RamDisk::~RamDisk()
+{
+    if (Pages != nullptr)
+    {
+        for (ulong i = 0; i < PageCount; i++)
+        {
+            if (Pages[i] != nullptr)
+                Mm::Free(Pages[i]);
+        }
+        Mm::Free(Pages);
+    }
+}
+
+bool RamDisk::Init(ulong index, ulong sizeMb, ulong latencyUs)
+{
+    PageCount = sizeMb * Const::MB / Const::PageSize;
+    Pages = static_cast<u8**>(Mm::Alloc(PageCount * sizeof(u8*), 0));
+    if (Pages == nullptr)
+        return false;
+    Stdlib::MemSet(Pages, 0, PageCount * sizeof(u8*));
+
+    Capacity = (u64)PageCount * (Const::PageSize / SectorSize);
+    LatencyUs = latencyUs;
+    Stdlib::SnPrintf(Name, sizeof(Name), "ram%u", index);
+    return true;
+}
+
+const char* RamDisk::GetName()
+{
+    return Name;
+}
+
+u64 RamDisk::GetCapacity()
+{
+    return Capacity;
+}
+
+u64 RamDisk::GetSectorSize()
+{
+    return SectorSize;
+}
+
+SpinLock& RamDisk::PageLock(ulong page)
+{
+    return Locks[page % LockStripes];
+}
+
+bool RamDisk::Transfer(u64 sector, void* buf, u64 count, bool write)
+{
+    if (sector > Capacity || count > Capacity - sector)
+        return false;
+
+    u8* data = static_cast<u8*>(buf);
+    u64 offset = sector * SectorSize;
+    u64 left = count * SectorSize;
+
+    while (left != 0)
+    {
+        ulong page = (ulong)(offset / Const::PageSize);
+        ulong inPage = (ulong)(offset % Const::PageSize);
+        ulong n = Const::PageSize - inPage;
+        if (n > left)
+            n = (ulong)left;
+
+        if (write)
+        {
+            /* Allocate outside the lock; a racing writer may win */
+            u8* fresh = nullptr;
+            if (Pages[page] == nullptr)
+            {
+                fresh = static_cast<u8*>(Mm::Alloc(Const::PageSize, 0));
+                if (fresh == nullptr)
+                    return false;
+                if (n != Const::PageSize)
+                    Stdlib::MemSet(fresh, 0, Const::PageSize);
+            }
+
+            {
+                Stdlib::AutoLock lock(PageLock(page));
+                if (Pages[page] == nullptr && fresh != nullptr)
+                {
+                    Pages[page] = fresh;
+                    fresh = nullptr;
+                    Allocated.Inc();
+                }
+                Stdlib::MemCpy(Pages[page] + inPage, data, n);
+            }
+
+            if (fresh != nullptr)
+                Mm::Free(fresh);
+        }
+        else
+        {
+            Stdlib::AutoLock lock(PageLock(page));
+            if (Pages[page] != nullptr)
+                Stdlib::MemCpy(data, Pages[page] + inPage, n);
+            else
+                Stdlib::MemSet(data, 0, n);
+        }
+
+        data += n;
+        offset += n;
+        left -= n;
+    }
+    return true;
+}
+
+bool RamDisk::Release(u64 sector, u64 count)
+{
+    if (sector > Capacity || count > Capacity - sector)
+        return false;
+
+    u64 offset = sector * SectorSize;
+    u64 end = offset + count * SectorSize;
+
+    while (offset < end)
+    {
+        ulong page = (ulong)(offset / Const::PageSize);
+        ulong inPage = (ulong)(offset % Const::PageSize);
+        ulong n = Const::PageSize - inPage;
+        if (n > end - offset)
+            n = (ulong)(end - offset);
+
+        u8* victim = nullptr;
+        {
+            Stdlib::AutoLock lock(PageLock(page));
+            if (Pages[page] != nullptr)
+            {
+                if (n == Const::PageSize)
+                {
+                    victim = Pages[page];
+                    Pages[page] = nullptr;
+                    Allocated.Dec();
+                }
+                else
+                {
+                    Stdlib::MemSet(Pages[page] + inPage, 0, n);
+                }
+            }
+        }
+
+        if (victim != nullptr)
+            Mm::Free(victim);
+        offset += n;
+    }
+    return true;
+}
+
+bool RamDisk::ReadSectors(u64 sector, void* buf, u32 count)
+{
+    bool ok = Transfer(sector, buf, count, false);
+    Delay();
+    return ok;
+}
+
+bool RamDisk::WriteSectors(u64 sector, const void* buf, u32 count, bool fua)
+{
+    (void)fua;  /* nothing volatile to flush */
+    bool ok = Transfer(sector, const_cast<void*>(buf), count, true);
+    Delay();
+    return ok;
+}
+
+bool RamDisk::SupportsDiscard()
+{
+    return true;
+}
+
+bool RamDisk::SupportsWriteZeroes()
+{
+    return true;
+}
+
+/* Discarded sectors read back as zeros, which is one of the allowed
+   outcomes, so both share Release. */
+bool RamDisk::Discard(u64 sector, u64 count)
+{
+    return Release(sector, count);
+}
+
+bool RamDisk::WriteZeroes(u64 sector, u64 count)
+{
+    return Release(sector, count);
+}
+
+bool RamDisk::Execute(BlockRequest* req)
+{
+    switch (req->RequestType)
+    {
+    case BlockRequest::Read:
+        return Transfer(req->Sector, req->Buffer, req->SectorCount, false);
+    case BlockRequest::Write:
+        return Transfer(req->Sector, req->Buffer, req->SectorCount, true);
+    case BlockRequest::Flush:
+        return true;
+    case BlockRequest::Discard:
+    case BlockRequest::WriteZeroes:
+        return Release(req->Sector, req->SectorCount);
+    default:
+        return false;
+    }
+}
+
+void RamDisk::Delay()
+{
+    ulong us = LatencyUs;
+    if (us != 0)
+        Sleep(us * Const::NanoSecsInUsec);
+}
+
+void RamDisk::Submit(BlockRequest* req)
+{
+    SubmitBatch(&req, 1);
+}
+
+void RamDisk::SubmitBatch(BlockRequest* const* reqs, ulong count)
+{
+    /* Requests complete in the submitter's context; results are kept in
+       Success so the latency is paid once before any completes */
+    for (ulong i = 0; i < count; i++)
+        reqs[i]->Success = Execute(reqs[i]);
+
+    if (count != 0)
+        Delay();
+
+    for (ulong i = 0; i < count; i++)
+        reqs[i]->Complete(reqs[i]->Success);
+}
+
+void RamDisk::SetLatencyUs(ulong us)
+{
+    LatencyUs = us;
+}
+
+ulong RamDisk::GetLatencyUs()
+{
+    return LatencyUs;
+}
+
+void RamDisk::Dump(Stdlib::Printer& printer)
+{
+    printer.Printf("%s  %u MB  %u KB allocated  latency %u us\n",
+        Name, (ulong)(Capacity * SectorSize / Const::MB),
+        (ulong)Allocated.Get() * Const::PageSize / Const::KB, (ulong)LatencyUs);
+}
+
+void RamDisk::DumpAll(Stdlib::Printer& printer)
+{
+    if (InstanceCount == 0)
+    {
+        printer.Printf("no ram disks\n");
+        return;
+    }
+
+    for (ulong i = 0; i < InstanceCount; i++)
+        Instances[i].Dump(printer);
+}
+
+RamDisk* RamDisk::Find(const char* name)
+{
+    for (ulong i = 0; i < InstanceCount; i++)
+    {
+        if (Stdlib::StrCmp(Instances[i].Name, name) == 0)
+            return &Instances[i];
+    }
+    return nullptr;
+}
+
+RamDisk* RamDisk::Create(ulong sizeMb, ulong latencyUs)
+{
+    if (InstanceCount >= MaxDisks)
+    {
+        Trace(0, "RamDisk: max disks reached");
+        return nullptr;
+    }
+    if (sizeMb == 0 || sizeMb > MaxSizeMb)
+    {
+        Trace(0, "RamDisk: invalid size %u MB", sizeMb);
+        return nullptr;
+    }
+
+    /* Instances live in BSS; global constructors are not run */
+    auto& inst = Instances[InstanceCount];
+    new (&inst) RamDisk();
+    if (!inst.Init(InstanceCount, sizeMb, latencyUs))
+    {
+        Trace(0, "RamDisk: no memory for %u MB page table", sizeMb);
+        return nullptr;
+    }
+
+    if (!BlockDeviceTable::GetInstance().Register(&inst))
+    {
+        inst.~RamDisk();
+        return nullptr;
+    }
+
+    InstanceCount++;
+    Trace(0, "RamDisk %s: %u MB, latency %u us", inst.Name, sizeMb, latencyUs);
+    return &inst;
+}
+
+/* ramdisk=<sizeMB>[:<latencyUs>][,...] */
+void RamDisk::CreateFromParameters()
+{
+    const char* spec = Parameters::GetInstance().GetRamdisk();
+
+    while (*spec != '\0')
+    {
+        const char* end = spec;
+        while (*end != '\0' && *end != ',')
+            end++;
+
+        char entry[32];
+        ulong len = (ulong)(end - spec);
+        if (len >= sizeof(entry))
+            len = sizeof(entry) - 1;
+        Stdlib::MemCpy(entry, spec, len);
+        entry[len] = '\0';
+        spec = (*end == ',') ? end + 1 : end;
+
+        char* latency = entry;
+        while (*latency != '\0' && *latency != ':')
+            latency++;
+        if (*latency == ':')
+            *latency++ = '\0';
+
+        ulong sizeMb = 0;
+        ulong latencyUs = 0;
+        if (!Stdlib::ParseUlong(entry, sizeMb) ||
+            (*latency != '\0' && !Stdlib::ParseUlong(latency, latencyUs)))
+        {
+            Trace(0, "RamDisk: bad ramdisk parameter entry %s", entry);
+            continue;
+        }
+
+        Create(sizeMb, latencyUs);
+    }
+}
+
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include "block_device.h"
+
+#include <kernel/spin_lock.h>
+#include <kernel/atomic.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* RAM-backed block device (ram0, ram1, ...) for measuring the storage
+   stack without a hypervisor in the path.
+
+   The disk is a table of page pointers, one per page of capacity.
+   Pages are allocated on first write; a page never written, or
+   discarded or zeroed since, has no backing and reads as zeros, so a
+   fresh disk costs only its page table and discard really frees memory.
+   Requests are served page by page straight between the caller buffer
+   and the backing page: a page-aligned request is one copy per page
+   with no bounce buffer or partial-page handling.
+
+   An optional artificial latency is added once per submitted batch,
+   modelling one device round trip; 0 (the default) completes inline. */
+class RamDisk : public BlockDevice
+{
+public:
+    RamDisk();
+    virtual ~RamDisk();
+
+    virtual const char* GetName() override;
+    virtual u64 GetCapacity() override;
+    virtual u64 GetSectorSize() override;
+    virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
+    virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual bool SupportsDiscard() override;
+    virtual bool SupportsWriteZeroes() override;
+    virtual bool Discard(u64 sector, u64 count) override;
+    virtual bool WriteZeroes(u64 sector, u64 count) override;
+    virtual void Submit(BlockRequest* req) override;
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count) override;
+
+    void SetLatencyUs(ulong us);
+    ulong GetLatencyUs();
+    void Dump(Stdlib::Printer& printer);
+
+    /* Create and register the next ramN of sizeMb megabytes. */
+    static RamDisk* Create(ulong sizeMb, ulong latencyUs);
+
+    /* Create the disks listed in the ramdisk= kernel parameter. */
+    static void CreateFromParameters();
+
+    static RamDisk* Find(const char* name);
+    static void DumpAll(Stdlib::Printer& printer);
+
+    static const ulong MaxDisks = 8;
+    static const ulong MaxSizeMb = 4096;
+    static const ulong SectorSize = 512;
+    static const ulong LockStripes = 64;
+
+private:
+    RamDisk(const RamDisk& other) = delete;
+    RamDisk(RamDisk&& other) = delete;
+    RamDisk& operator=(const RamDisk& other) = delete;
+    RamDisk& operator=(RamDisk&& other) = delete;
+
+    bool Init(ulong index, ulong sizeMb, ulong latencyUs);
+
+    /* Copy between buf and the disk; false if out of range or a page
+       cannot be allocated. */
+    bool Transfer(u64 sector, void* buf, u64 count, bool write);
+
+    /* Free the pages of [sector, sector + count), zeroing the partial
+       pages at the ends. */
+    bool Release(u64 sector, u64 count);
+
+    bool Execute(BlockRequest* req);
+    void Delay();
+
+    SpinLock& PageLock(ulong page);
+
+    char Name[8];
+    u8** Pages;
+    ulong PageCount;
+    u64 Capacity;
+    volatile ulong LatencyUs;
+    Atomic Allocated;
+    SpinLock Locks[LockStripes];
+
+    static RamDisk Instances[MaxDisks];
+    static ulong InstanceCount;
+};
+
+}
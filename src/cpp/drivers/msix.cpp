@@ -315,4 +315,12 @@ void MsixTable::Retarget(u16 index, u32 apicId)
     MmioWrite32(entry + 12, ctrl);
 }
 
+bool MsixTable::SetAffinity(u16 index, ulong cpu)
+{
+    if (!Table || index >= Count || EntryVector[index] == 0)
+        return false;
+
+    return IrqBalance::GetInstance().PinMsix(this, index, cpu);
+}
+
 }
@@ -29,6 +29,9 @@ public:
     /* Redirect an enabled entry to another CPU (used by IrqBalance) */
     void Retarget(u16 index, u32 apicId);
 
+    /* Ask IrqBalance to keep an enabled entry on cpu (per-CPU queues) */
+    bool SetAffinity(u16 index, ulong cpu);
+
     u16 GetTableSize() const { return Count; }
     bool IsReady() const { return Table != nullptr && Count > 0; }
 
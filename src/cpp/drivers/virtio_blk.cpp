@@ -4,6 +4,7 @@
 #include <arch/x86_64/ioapic.h>
 
 #include <kernel/trace.h>
+#include <block/block_trace.h>
 #include <hal/cpu.h>
 #include <hal/context.h>
 #include <hal/irq_stubs.h>
@@ -12,6 +13,8 @@
 #include <kernel/interrupt.h>
 #include <arch/x86_64/idt.h>
 #include <kernel/softirq.h>
+#include <kernel/sched.h>
+#include <kernel/time.h>
 #include <mm/new.h>
 #include <mm/page_table.h>
 #include <include/const.h>
@@ -29,6 +32,8 @@ VirtioBlk::VirtioBlk()
     , IntVector(-1)
     , Initialized(false)
     , HasFlush(false)
+    , MaxDiscardSectors(0)
+    , MaxWriteZeroesSectors(0)
 {
     DevName[0] = '\0';
     Stdlib::MemSet(Slots, 0, sizeof(Slots));
@@ -97,8 +102,9 @@ bool VirtioBlk::InitCommon(const char* name, u8 irq, u8 vector)
     u32 devFeatures0 = Transport->ReadDeviceFeature(0);
     Trace(0, "VirtioBlk %s: device features[0] 0x%p", name, (ulong)devFeatures0);
 
-    /* Negotiate FLUSH if device offers it. */
-    u32 drvFeatures0 = devFeatures0 & FeatureFlush;
+    /* Negotiate FLUSH, SEG_MAX, DISCARD and WRITE_ZEROES if device offers them. */
+    u32 drvFeatures0 = devFeatures0 &
+        (FeatureFlush | FeatureSegMax | FeatureDiscard | FeatureWriteZeroes);
     Transport->WriteDriverFeature(0, drvFeatures0);
     HasFlush = (drvFeatures0 & FeatureFlush) != 0;
 
@@ -167,15 +173,49 @@ bool VirtioBlk::InitCommon(const char* name, u8 irq, u8 vector)
     Transport->SetStatus(okStatus);
 
     /* Read device config: capacity (u64 at offset 0) */
-    CapacitySectors = Transport->ReadDevCfg64(0);
+    CapacitySectors = Transport->ReadDevCfg64(CfgCapacity);
 
     Trace(0, "VirtioBlk %s: capacity %u sectors (%u MB)",
         name, CapacitySectors, (CapacitySectors * 512) / (1024 * 1024));
 
-    /* Allocate 1 DMA page for all slot headers and status bytes.
-       Layout: MaxSlots * VirtioBlkReq (16 bytes each) followed by
-               MaxSlots * 1-byte status buffers.
-       Total: MaxSlots * 17 bytes = 136 bytes, fits in one 4KB page. */
+    /* A merged request is header + segments + status descriptors */
+    ulong maxSegs = MaxSegments;
+    if (maxSegs > (ulong)queueSize - 2)
+        maxSegs = (ulong)queueSize - 2;
+    if (drvFeatures0 & FeatureSegMax)
+    {
+        u32 segMax = Transport->ReadDevCfg32(CfgSegMax);
+        if (segMax != 0 && segMax < maxSegs)
+            maxSegs = segMax;
+    }
+    if (maxSegs == 0)
+        maxSegs = 1;
+    Requests.Init(512, (u32)maxSegs, MaxRequestSectors);
+    Requests.SetOwner(this);
+
+    /* Discard chunks stay aligned when the limit is a multiple of the
+       device's discard granularity */
+    if (drvFeatures0 & FeatureDiscard)
+    {
+        u32 maxDiscard = Transport->ReadDevCfg32(CfgMaxDiscardSectors);
+        u32 align = Transport->ReadDevCfg32(CfgDiscardAlignment);
+        if (align != 0 && maxDiscard >= align)
+            maxDiscard -= maxDiscard % align;
+        MaxDiscardSectors = maxDiscard;
+    }
+    if (drvFeatures0 & FeatureWriteZeroes)
+        MaxWriteZeroesSectors = Transport->ReadDevCfg32(CfgMaxWriteZeroesSectors);
+
+    if (MaxDiscardSectors != 0 || MaxWriteZeroesSectors != 0)
+        Trace(0, "VirtioBlk %s: max discard %u sectors, max write zeroes %u sectors",
+            name, (ulong)MaxDiscardSectors, (ulong)MaxWriteZeroesSectors);
+
+    /* Allocate 1 DMA page for all slot headers, status bytes and ranges.
+       Layout: MaxSlots * VirtioBlkReq (16 bytes each), MaxSlots * 1-byte
+               status buffers, then from offset RangeOffset MaxSlots *
+               VirtioBlkRange (16 bytes each).
+       Total: 256 + MaxSlots * 16 = 384 bytes, fits in one 4KB page. */
+    const ulong RangeOffset = 2 * MaxSlots * sizeof(VirtioBlkReq);
     ulong dmaPhys;
     void* dmaPtr = Mm::AllocMapPages(1, &dmaPhys);
     if (!dmaPtr)
@@ -194,6 +234,8 @@ bool VirtioBlk::InitCommon(const char* name, u8 irq, u8 vector)
         Slots[i].ReqHeaderPhys = dmaPhys + i * sizeof(VirtioBlkReq);
         Slots[i].StatusBuf = (u8*)(dmaVirt + MaxSlots * sizeof(VirtioBlkReq) + i);
         Slots[i].StatusBufPhys = dmaPhys + MaxSlots * sizeof(VirtioBlkReq) + i;
+        Slots[i].Range = (VirtioBlkRange*)(dmaVirt + RangeOffset + i * sizeof(VirtioBlkRange));
+        Slots[i].RangePhys = dmaPhys + RangeOffset + i * sizeof(VirtioBlkRange);
         Slots[i].Request = nullptr;
         Slots[i].Head = -1;
     }
@@ -201,8 +243,6 @@ bool VirtioBlk::InitCommon(const char* name, u8 irq, u8 vector)
     /* All slots start free */
     FreeSlotMask.Set((1L << MaxSlots) - 1);
 
-    RequestQueue.Init();
-
     Initialized = true;
 
     if (!Transport->UsingMsix())
@@ -258,54 +298,52 @@ void VirtioBlk::FreeSlot(int idx)
 
 void VirtioBlk::Submit(BlockRequest* req)
 {
-    {
-        Stdlib::AutoLock lock(QueueLock);
-        RequestQueue.InsertTail(&req->Link);
-    }
+    Stats.Start(req);
+    Requests.Add(req);
     DrainQueue();
 }
 
-void VirtioBlk::DrainQueue()
+void VirtioBlk::SubmitBatch(BlockRequest* const* reqs, ulong count)
 {
-    if (!Initialized)
-        return;
+    for (ulong i = 0; i < count; i++)
+        Stats.Start(reqs[i]);
+    Requests.AddBatch(reqs, count);
+    DrainQueue();
+}
 
-    /* Dequeue up to MaxSlots requests under the lock */
-    BlockRequest* batch[MaxSlots];
-    ulong batchCount = 0;
+IoQueue* VirtioBlk::GetIoQueue()
+{
+    return &Requests;
+}
 
-    {
-        Stdlib::AutoLock lock(QueueLock);
-        while (batchCount < MaxSlots && !RequestQueue.IsEmpty())
-        {
-            Stdlib::ListEntry* entry = RequestQueue.RemoveHead();
-            if (!entry)
-                break;
-            BlockRequest* req = CONTAINING_RECORD(entry, BlockRequest, Link);
-            batch[batchCount] = req;
-            batchCount++;
-        }
-    }
+BlockStats* VirtioBlk::GetStats()
+{
+    return &Stats;
+}
 
-    if (batchCount == 0)
+bool VirtioBlk::SupportsTrace()
+{
+    return true;
+}
+
+void VirtioBlk::DrainQueue()
+{
+    if (!Initialized)
         return;
 
     auto& pt = Mm::PageTable::GetInstance();
     bool kicked = false;
 
-    for (ulong i = 0; i < batchCount; i++)
+    for (;;)
     {
-        BlockRequest* req = batch[i];
-
         int slotIdx = AllocSlot();
         if (slotIdx < 0)
+            break;
+
+        BlockRequest* req = Requests.Dispatch();
+        if (!req)
         {
-            /* No free slots -- put the whole remaining batch back at the
-               head in reverse so the original order is preserved (a later
-               flush must not leapfrog earlier writes) */
-            Stdlib::AutoLock lock(QueueLock);
-            for (ulong j = batchCount; j > i; j--)
-                RequestQueue.InsertHead(&batch[j - 1]->Link);
+            FreeSlot(slotIdx);
             break;
         }
 
@@ -314,104 +352,111 @@ void VirtioBlk::DrainQueue()
 
         /* Build request header */
         VirtioBlkReq* hdr = slot.ReqHeader;
-        if (req->RequestType == BlockRequest::Flush)
+        hdr->Reserved = 0;
+        hdr->Sector = req->HasData() ? req->Sector : 0;
+        switch (req->RequestType)
         {
+        case BlockRequest::Flush:
             hdr->Type = TypeFlush;
-            hdr->Reserved = 0;
-            hdr->Sector = 0;
-        }
-        else
-        {
-            hdr->Type = (req->RequestType == BlockRequest::Write) ? TypeOut : TypeIn;
-            hdr->Reserved = 0;
-            hdr->Sector = req->Sector;
+            break;
+        case BlockRequest::Discard:
+            hdr->Type = TypeDiscard;
+            break;
+        case BlockRequest::WriteZeroes:
+            hdr->Type = TypeWriteZeroes;
+            break;
+        case BlockRequest::Write:
+            hdr->Type = TypeOut;
+            break;
+        default:
+            hdr->Type = TypeIn;
+            break;
         }
 
         *slot.StatusBuf = 0xFF;
 
-        Hal::DmaWmb();
-
-        int head = -1;
-
-        if (req->RequestType == BlockRequest::Flush)
+        /* Descriptor chain: header, one data descriptor per merged
+           request (flush has none, discard and write zeroes carry one
+           range), status */
+        VirtQueue::BufDesc bufs[MaxSegments + 2];
+        ulong count = 0;
+        bufs[count].Addr = slot.ReqHeaderPhys;
+        bufs[count].Len = sizeof(VirtioBlkReq);
+        bufs[count].Writable = false;
+        count++;
+
+        if (req->RequestType == BlockRequest::Discard ||
+            req->RequestType == BlockRequest::WriteZeroes)
         {
-            /* Flush: 2-descriptor chain (header + status, no data) */
-            VirtQueue::BufDesc bufs[2];
-            bufs[0].Addr = slot.ReqHeaderPhys;
-            bufs[0].Len = sizeof(VirtioBlkReq);
-            bufs[0].Writable = false;
-
-            bufs[1].Addr = slot.StatusBufPhys;
-            bufs[1].Len = 1;
-            bufs[1].Writable = true;
-
-            ulong flags = VirtQueueLock.LockIrqSave();
-            head = Queue.AddBufs(bufs, 2);
-            /* Publish the slot mapping in the same critical section as
-               AddBufs: once the lock drops, a completion on another CPU may
-               already reference this head. */
-            if (head >= 0 && (ulong)head < sizeof(SlotByHead) / sizeof(SlotByHead[0]))
-            {
-                slot.Head = head;
-                SlotByHead[head] = &slot;
-            }
-            VirtQueueLock.UnlockIrqRestore(flags);
+            slot.Range->Sector = req->Sector;
+            slot.Range->NumSectors = req->SectorCount;
+            slot.Range->Flags = 0;
+            bufs[count].Addr = slot.RangePhys;
+            bufs[count].Len = sizeof(VirtioBlkRange);
+            bufs[count].Writable = false;
+            count++;
         }
-        else
+
+        bool mapped = true;
+        for (BlockRequest* seg = req->HasData() ? req : nullptr;
+             seg != nullptr; seg = seg->MergeNext)
         {
-            /* Data I/O: 3-descriptor chain (header, data, status) */
-            ulong bufPhys = pt.VirtToPhys((ulong)req->Buffer);
-            if (bufPhys == 0)
+            ulong bufPhys = pt.VirtToPhys((ulong)seg->Buffer);
+            if (bufPhys == 0 || count >= MaxSegments + 1)
             {
-                Trace(0, "VirtioBlk %s: VirtToPhys failed for buf 0x%p", DevName, (ulong)req->Buffer);
-                req->Success = false;
-                req->Completion.Done();
-                FreeSlot(slotIdx);
-                continue;
+                Trace(0, "VirtioBlk %s: cannot map buf 0x%p", DevName, (ulong)seg->Buffer);
+                mapped = false;
+                break;
             }
 
-            u32 dataLen = req->SectorCount * 512;
+            bufs[count].Addr = bufPhys;
+            bufs[count].Len = seg->SectorCount * 512;
+            bufs[count].Writable = (req->RequestType == BlockRequest::Read);
+            count++;
+        }
 
-            VirtQueue::BufDesc bufs[3];
-            bufs[0].Addr = slot.ReqHeaderPhys;
-            bufs[0].Len = sizeof(VirtioBlkReq);
-            bufs[0].Writable = false;
+        if (!mapped)
+        {
+            FreeSlot(slotIdx);
+            Stats.Done(req, false);
+            Requests.Complete(req, false);
+            continue;
+        }
 
-            bufs[1].Addr = bufPhys;
-            bufs[1].Len = dataLen;
-            bufs[1].Writable = (req->RequestType == BlockRequest::Read);
+        bufs[count].Addr = slot.StatusBufPhys;
+        bufs[count].Len = 1;
+        bufs[count].Writable = true;
+        count++;
 
-            bufs[2].Addr = slot.StatusBufPhys;
-            bufs[2].Len = 1;
-            bufs[2].Writable = true;
+        Hal::DmaWmb();
 
-            ulong flags = VirtQueueLock.LockIrqSave();
-            head = Queue.AddBufs(bufs, 3);
-            if (head >= 0 && (ulong)head < sizeof(SlotByHead) / sizeof(SlotByHead[0]))
-            {
-                slot.Head = head;
-                SlotByHead[head] = &slot;
-            }
-            VirtQueueLock.UnlockIrqRestore(flags);
+        /* Publish the slot mapping in the same critical section as
+           AddBufs: once the lock drops, a completion on another CPU may
+           already reference this head. */
+        ulong flags = VirtQueueLock.LockIrqSave();
+        int head = Queue.AddBufs(bufs, count);
+        if (head >= 0 && (ulong)head < sizeof(SlotByHead) / sizeof(SlotByHead[0]))
+        {
+            slot.Head = head;
+            SlotByHead[head] = &slot;
         }
+        VirtQueueLock.UnlockIrqRestore(flags);
 
         if (head < 0)
         {
-            /* Ring full -- return the remaining batch to the queue head
-               in reverse to preserve the original order */
+            /* Ring full -- hand the request back; it goes out first once
+               completions free descriptors */
             FreeSlot(slotIdx);
-            Stdlib::AutoLock lock(QueueLock);
-            for (ulong j = batchCount; j > i; j--)
-                RequestQueue.InsertHead(&batch[j - 1]->Link);
+            Requests.Requeue(req);
             break;
         }
 
         if ((ulong)head >= sizeof(SlotByHead) / sizeof(SlotByHead[0]))
         {
             Trace(0, "VirtioBlk %s: head %u out of range", DevName, (ulong)head);
-            req->Success = false;
-            req->Completion.Done();
             FreeSlot(slotIdx);
+            Stats.Done(req, false);
+            Requests.Complete(req, false);
             continue;
         }
 
@@ -460,12 +505,13 @@ void VirtioBlk::CompleteIO()
         }
 
         BlockRequest* req = slot->Request;
-        req->Success = (*slot->StatusBuf == 0);
+        bool success = (*slot->StatusBuf == 0);
 
         int slotIdx = (int)(slot - Slots);
         FreeSlot(slotIdx);
 
-        req->Completion.Done();
+        Stats.Done(req, success);
+        Requests.Complete(req, success);
         completed = true;
     }
 
@@ -474,20 +520,54 @@ void VirtioBlk::CompleteIO()
         SoftIrq::GetInstance().Raise(SoftIrq::TypeBlkIo);
 }
 
+bool VirtioBlk::PollForCompletion(BlockRequest& req, ulong budgetNs)
+{
+    ulong start = GetBootTime().GetValue();
+
+    while (req.Completion.GetCounter() != 0)
+    {
+        if (Queue.HasUsed())
+            CompleteIO();
+        else if (GetBootTime().GetValue() - start >= budgetNs)
+            return false;
+        else
+            Pause();
+    }
+    return true;
+}
+
 void VirtioBlk::WaitForCompletion(BlockRequest& req)
 {
-    if (GetInterruptsStarted())
+    if (!GetInterruptsStarted())
     {
-        req.Completion.Wait();
+        /* Early boot: interrupts not yet enabled, poll for completion */
+        while (req.Completion.GetCounter() != 0)
+        {
+            CompleteIO();
+            Pause(100);
+        }
         return;
     }
 
-    /* Early boot: interrupts not yet enabled, poll for completion */
-    while (req.Completion.GetCounter() != 0)
+    BlockPollState::Mode mode = Poll.GetMode();
+    if (mode == BlockPollState::Off)
     {
-        CompleteIO();
-        Pause(100);
+        req.Completion.Wait();
+        return;
     }
+
+    /* Spin on the used ring; the interrupt stays armed, so a request that
+       outlives the budget simply completes through the normal path. */
+    ulong start = GetBootTime().GetValue();
+    ulong sleepNs = Poll.GetSleepNs();
+    if (sleepNs != 0)
+        Sleep(sleepNs);
+
+    bool polled = PollForCompletion(req, Poll.GetSpinBudgetNs());
+    if (!polled)
+        req.Completion.Wait();
+
+    Poll.Account(GetBootTime().GetValue() - start, polled);
 }
 
 bool VirtioBlk::ReadSectors(u64 sector, void* buf, u32 count)
@@ -556,6 +636,84 @@ bool VirtioBlk::Flush()
     return req.Success;
 }
 
+bool VirtioBlk::SupportsDiscard()
+{
+    return MaxDiscardSectors != 0;
+}
+
+bool VirtioBlk::SupportsWriteZeroes()
+{
+    return MaxWriteZeroesSectors != 0;
+}
+
+bool VirtioBlk::SubmitRange(BlockRequest::Type type, u64 sector, u64 count, u32 maxSectors)
+{
+    if (sector > CapacitySectors || count > CapacitySectors - sector)
+        return false;
+
+    bool ok = true;
+    while (count != 0 && ok)
+    {
+        BlockRequest reqs[MaxSlots];
+        BlockRequest* batch[MaxSlots];
+        ulong n = 0;
+        for (; n < MaxSlots && count != 0; n++)
+        {
+            u32 chunk = (count < maxSectors) ? (u32)count : maxSectors;
+            reqs[n].RequestType = type;
+            reqs[n].Sector = sector;
+            reqs[n].SectorCount = chunk;
+            batch[n] = &reqs[n];
+            sector += chunk;
+            count -= chunk;
+        }
+
+        SubmitBatch(batch, n);
+        for (ulong i = 0; i < n; i++)
+        {
+            WaitForCompletion(reqs[i]);
+            if (!reqs[i].Success)
+                ok = false;
+        }
+    }
+    return ok;
+}
+
+bool VirtioBlk::Discard(u64 sector, u64 count)
+{
+    if (MaxDiscardSectors == 0)
+        return false;
+    return SubmitRange(BlockRequest::Discard, sector, count, MaxDiscardSectors);
+}
+
+bool VirtioBlk::WriteZeroes(u64 sector, u64 count)
+{
+    if (MaxWriteZeroesSectors == 0)
+        return BlockDevice::WriteZeroes(sector, count);
+    return SubmitRange(BlockRequest::WriteZeroes, sector, count, MaxWriteZeroesSectors);
+}
+
+void VirtioBlk::WaitRequest(BlockRequest& req)
+{
+    WaitForCompletion(req);
+}
+
+bool VirtioBlk::SetPollMode(BlockPollState::Mode mode)
+{
+    Poll.SetMode(mode);
+    return true;
+}
+
+BlockPollState::Mode VirtioBlk::GetPollMode()
+{
+    return Poll.GetMode();
+}
+
+void VirtioBlk::DumpPollStats(Stdlib::Printer& printer)
+{
+    Poll.Dump(printer);
+}
+
 void VirtioBlk::OnInterruptRegister(u8 irq, u8 vector)
 {
     (void)irq;
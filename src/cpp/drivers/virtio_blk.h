@@ -4,6 +4,7 @@
 #include <kernel/interrupt.h>
 #include <block/block_device.h>
 #include <block/block_request.h>
+#include <block/block_stats.h>
 #include <kernel/spin_lock.h>
 #include <kernel/raw_spin_lock.h>
 #include <kernel/atomic.h>
@@ -33,6 +34,19 @@ public:
     virtual bool Flush() override;
     virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
     virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual bool SupportsDiscard() override;
+    virtual bool SupportsWriteZeroes() override;
+    virtual bool Discard(u64 sector, u64 count) override;
+    virtual bool WriteZeroes(u64 sector, u64 count) override;
+    virtual void Submit(BlockRequest* req) override;
+    virtual void SubmitBatch(BlockRequest* const* reqs, ulong count) override;
+    virtual void WaitRequest(BlockRequest& req) override;
+    virtual IoQueue* GetIoQueue() override;
+    virtual BlockStats* GetStats() override;
+    virtual bool SupportsTrace() override;
+    virtual bool SetPollMode(BlockPollState::Mode mode) override;
+    virtual BlockPollState::Mode GetPollMode() override;
+    virtual void DumpPollStats(Stdlib::Printer& printer) override;
 
     /* InterruptHandler interface */
     virtual void OnInterruptRegister(u8 irq, u8 vector) override;
@@ -41,9 +55,6 @@ public:
 
     void Interrupt(Context* ctx);
 
-    /* Submit a block request (caller context). */
-    void Submit(BlockRequest* req);
-
     /* Drain pending requests and submit to hardware (softirq context). */
     void DrainQueue();
 
@@ -64,9 +75,26 @@ private:
     static const u32 TypeIn    = 0; /* Read */
     static const u32 TypeOut   = 1; /* Write */
     static const u32 TypeFlush = 4; /* Flush */
+    static const u32 TypeDiscard = 11;
+    static const u32 TypeWriteZeroes = 13;
 
     /* Feature bits */
+    static const u32 FeatureSegMax = (1 << 2);
     static const u32 FeatureFlush = (1 << 9);
+    static const u32 FeatureDiscard = (1 << 13);
+    static const u32 FeatureWriteZeroes = (1 << 14);
+
+    /* Device config offsets */
+    static const ulong CfgCapacity = 0;
+    static const ulong CfgSegMax = 12;
+    static const ulong CfgMaxDiscardSectors = 36;
+    static const ulong CfgDiscardAlignment = 44;
+    static const ulong CfgMaxWriteZeroesSectors = 48;
+
+    /* Merged request limits: data segments per descriptor chain and
+       total size (128 KB) */
+    static const ulong MaxSegments = 32;
+    static const ulong MaxRequestSectors = 256;
 
     struct VirtioBlkReq
     {
@@ -77,6 +105,17 @@ private:
 
     static_assert(sizeof(VirtioBlkReq) == 16, "Invalid size");
 
+    /* Payload of discard and write zeroes requests; one range per
+       request. */
+    struct VirtioBlkRange
+    {
+        u64 Sector;
+        u32 NumSectors;
+        u32 Flags;
+    } __attribute__((packed));
+
+    static_assert(sizeof(VirtioBlkRange) == 16, "Invalid size");
+
     static const ulong MaxSlots = 8;
 
     struct DmaSlot
@@ -85,11 +124,18 @@ private:
         ulong ReqHeaderPhys;
         u8* StatusBuf;
         ulong StatusBufPhys;
+        VirtioBlkRange* Range;
+        ulong RangePhys;
         BlockRequest* Request;
         int Head;
     };
 
+    /* Issue type (Discard or WriteZeroes) over [sector, sector + count)
+       in requests of at most maxSectors, up to MaxSlots at a time. */
+    bool SubmitRange(BlockRequest::Type type, u64 sector, u64 count, u32 maxSectors);
+
     void WaitForCompletion(BlockRequest& req);
+    bool PollForCompletion(BlockRequest& req, ulong budgetNs);
     int AllocSlot();
     void FreeSlot(int idx);
 
@@ -108,16 +154,20 @@ private:
     char DevName[8];
     bool Initialized;
     bool HasFlush;
+    u32 MaxDiscardSectors;      /* 0: discard not negotiated */
+    u32 MaxWriteZeroesSectors;  /* 0: write zeroes not negotiated */
 
-    /* Request queue (protected by QueueLock) */
-    SpinLock QueueLock;
-    Stdlib::ListEntry RequestQueue;
+    /* I/O scheduler between Submit and DrainQueue */
+    IoQueue Requests;
+    BlockStats Stats;
 
     /* DMA slot pool */
     DmaSlot Slots[MaxSlots];
     DmaSlot* SlotByHead[VirtQueue::MaxDescriptors]; /* descriptor head -> slot lookup */
     Atomic FreeSlotMask;      /* bitmap, bit set = slot free */
 
+    BlockPollState Poll;
+
     static const ulong MaxInstances = 8;
 
 public:
@@ -60,6 +60,7 @@ public:
     bool IsMsixEnabled() const override { return false; }
     u8   EnableMsixVector(u16 index, InterruptHandler& handler) override;
     bool UsingMsix() const override { return false; }
+    bool SetMsixAffinity(u16 index, ulong cpu) override { (void)index; (void)cpu; return false; }
 
 private:
     VirtioMmio(const VirtioMmio& other) = delete;
@@ -55,6 +55,7 @@ public:
     bool IsMsixEnabled() const override { return Msix.IsReady(); }
     u8 EnableMsixVector(u16 index, InterruptHandler& handler) override;
     bool UsingMsix() const override { return MsixActive; }
+    bool SetMsixAffinity(u16 index, ulong cpu) override { return Msix.SetAffinity(index, cpu); }
 
     /* Virtio PCI capability cfg_type values */
     static const u8 CapCommonCfg  = 1;
@@ -89,7 +90,7 @@ private:
     volatile u8* DeviceCfg;
 
     /* Cached per-queue notify addresses (modern only) */
-    static const ulong MaxCachedQueues = 4;
+    static const ulong MaxCachedQueues = 16;
     volatile u8* NotifyAddr[MaxCachedQueues];
 
     /* Cached mapped BAR virtual addresses */
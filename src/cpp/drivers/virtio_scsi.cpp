@@ -3,6 +3,8 @@
 #include <arch/x86_64/ioapic.h>
 
 #include <kernel/trace.h>
+#include <block/block_trace.h>
+#include <block/block_completion.h>
 #include <hal/cpu.h>
 #include <hal/context.h>
 #include <hal/irq_stubs.h>
@@ -11,6 +13,7 @@
 #include <kernel/interrupt.h>
 #include <arch/x86_64/idt.h>
 #include <kernel/softirq.h>
+#include <kernel/cpu.h>
 #include <mm/new.h>
 #include <mm/page_table.h>
 #include <include/const.h>
@@ -18,31 +21,51 @@
 namespace Kernel
 {
 
-/* Registers MSI-X with the common VirtioScsiInterruptStub before VirtioScsi
-   instances exist (one stub serves all LUNs). */
-class VirtioScsiMsixRegistrar final : public InterruptHandler
-{
-public:
-    void OnInterruptRegister(u8 irq, u8 vector) override
-    {
-        (void)irq;
-        (void)vector;
-    }
-
-    InterruptHandlerFn GetHandlerFn() override
-    {
-        return VirtioScsiInterruptStub;
-    }
+/* One entry stub per QueueVector slot: the slot number is the only
+   context an IDT entry can carry */
+static InterruptHandlerFn VirtioScsiQueueStubs[] = {
+    VirtioScsiQueueStub0,
+    VirtioScsiQueueStub1,
+    VirtioScsiQueueStub2,
+    VirtioScsiQueueStub3,
+    VirtioScsiQueueStub4,
+    VirtioScsiQueueStub5,
+    VirtioScsiQueueStub6,
+    VirtioScsiQueueStub7,
+    VirtioScsiQueueStub8,
+    VirtioScsiQueueStub9,
+    VirtioScsiQueueStub10,
+    VirtioScsiQueueStub11,
+    VirtioScsiQueueStub12,
+    VirtioScsiQueueStub13,
+    VirtioScsiQueueStub14,
+    VirtioScsiQueueStub15,
+    VirtioScsiQueueStub16,
+    VirtioScsiQueueStub17,
+    VirtioScsiQueueStub18,
+    VirtioScsiQueueStub19,
+    VirtioScsiQueueStub20,
+    VirtioScsiQueueStub21,
+    VirtioScsiQueueStub22,
+    VirtioScsiQueueStub23,
+    VirtioScsiQueueStub24,
+    VirtioScsiQueueStub25,
+    VirtioScsiQueueStub26,
+    VirtioScsiQueueStub27,
+    VirtioScsiQueueStub28,
+    VirtioScsiQueueStub29,
+    VirtioScsiQueueStub30,
+    VirtioScsiQueueStub31,
 };
 
-static VirtioScsiMsixRegistrar ScsiMsixRegistrar;
-
 VirtioScsi VirtioScsi::Instances[MaxInstances];
 ulong VirtioScsi::InstanceCount = 0;
 
 VirtioScsi::HbaState VirtioScsi::Hbas[MaxHbas];
 ulong VirtioScsi::HbaCount = 0;
 
+VirtioScsi::QueueVector VirtioScsi::QueueVectors[MaxQueueVectors];
+
 VirtioScsi::VirtioScsi()
     : Transport(nullptr)
     , ReqQueue(nullptr)
@@ -55,6 +78,8 @@ VirtioScsi::VirtioScsi()
     , Initialized(false)
     , ReqHdrSize(0)
     , RespHdrSize(0)
+    , QueueDepth(0)
+    , MaxTransferSectors(0)
     , CmdReq(nullptr)
     , CmdReqPhys(0)
     , CmdResp(nullptr)
@@ -94,6 +119,7 @@ bool VirtioScsi::Init(VirtioTransport* transport, VirtQueue* reqQueue, SpinLock*
     LunId = lun;
     CapacitySectors = capacity;
     SectorSz = sectorSize;
+    Stats.SetSectorSize((u32)sectorSize);
     ReqHdrSize = reqHdrSize;
     RespHdrSize = respHdrSize;
 
@@ -306,6 +332,18 @@ bool VirtioScsi::ScsiCommand(const u8 cdb[32], void* dataBuf, ulong dataLen, boo
 
 void VirtioScsi::Submit(BlockRequest* req)
 {
+    Stats.Start(req);
+    BlockCompletion::MarkSubmit(req);
+    TraceBlock(this, BlockTrace::ActQueue, req);
+
+    /* No UNMAP / WRITE SAME support, no splitting of oversized requests */
+    if ((!req->HasData() && req->RequestType != BlockRequest::Flush) ||
+        (req->HasData() && (req->SectorCount == 0 || req->SectorCount > MaxTransferSectors)))
+    {
+        CompleteRequest(req, false);
+        return;
+    }
+
     {
         Stdlib::AutoLock lock(QueueLock);
         RequestQueue.InsertTail(&req->Link);
@@ -329,218 +367,257 @@ void VirtioScsi::FailQueuedRequests()
             Stdlib::ListEntry* entry = RequestQueue.RemoveHead();
             req = CONTAINING_RECORD(entry, BlockRequest, Link);
         }
-        req->Success = false;
-        req->Completion.Done();
+        CompleteRequest(req, false);
     }
 }
 
-void VirtioScsi::DrainQueue()
+void VirtioScsi::CompleteRequest(BlockRequest* req, bool success)
 {
-    if (!Initialized)
-        return;
+    Stats.Done(req, success);
+    TraceBlock(this, BlockTrace::ActComplete, req, !success);
+    BlockCompletion::GetInstance().Complete(req, success);
+}
 
-    if (!Hba)
+BlockStats* VirtioScsi::GetStats()
+{
+    return &Stats;
+}
+
+bool VirtioScsi::SupportsTrace()
+{
+    return true;
+}
+
+u32 VirtioScsi::GetMaxTransferSectors()
+{
+    return MaxTransferSectors;
+}
+
+ulong VirtioScsi::GetQueueCount()
+{
+    return Hba->QueueCount;
+}
+
+void VirtioScsi::WaitRequest(BlockRequest& req)
+{
+    WaitForCompletion(req);
+}
+
+bool VirtioScsi::TakeDepth()
+{
+    for (;;)
     {
-        FailQueuedRequests();
-        return;
+        long cur = Inflight.Get();
+        if (cur >= QueueDepth)
+            return false;
+        if (Inflight.Cmpxchg(cur + 1, cur) == cur)
+            return true;
+    }
+}
+
+void VirtioScsi::Requeue(BlockRequest* req)
+{
+    Inflight.Dec();
+    TraceBlock(this, BlockTrace::ActRequeue, req);
+
+    Stdlib::AutoLock lock(QueueLock);
+    RequestQueue.InsertHead(&req->Link);
+}
+
+void VirtioScsi::EncodeRw(u8* cdb, bool write, bool fua, u64 lba, u32 blocks)
+{
+    if (lba + blocks <= 0xFFFFFFFFULL && blocks <= 0xFFFF)
+    {
+        cdb[0] = write ? ScsiOpWrite10 : ScsiOpRead10;
+        for (ulong i = 0; i < 4; i++)
+            cdb[2 + i] = (u8)(lba >> (24 - 8 * i));
+        cdb[7] = (u8)(blocks >> 8);
+        cdb[8] = (u8)(blocks);
+    }
+    else
+    {
+        cdb[0] = write ? ScsiOpWrite16 : ScsiOpRead16;
+        for (ulong i = 0; i < 8; i++)
+            cdb[2 + i] = (u8)(lba >> (56 - 8 * i));
+        for (ulong i = 0; i < 4; i++)
+            cdb[10 + i] = (u8)(blocks >> (24 - 8 * i));
     }
 
-    /* Dequeue up to MaxSlots requests under the lock */
-    BlockRequest* batch[MaxSlots];
-    ulong batchCount = 0;
+    /* FUA bit: byte 1, bit 3 (same position in both forms) */
+    if (fua && write)
+        cdb[1] = 0x08;
+}
 
+bool VirtioScsi::MapData(void* buf, ulong len, bool writable, VirtQueue::BufDesc* bufs,
+                         ulong& count, ulong maxCount)
+{
+    auto& pt = Mm::PageTable::GetInstance();
+    ulong va = (ulong)buf;
+    ulong first = count;
+
+    while (len != 0)
     {
-        Stdlib::AutoLock lock(QueueLock);
-        while (batchCount < MaxSlots && !RequestQueue.IsEmpty())
+        ulong phys = pt.VirtToPhys(va);
+        if (phys == 0)
+            return false;
+
+        ulong n = Const::PageSize - (va & (Const::PageSize - 1));
+        if (n > len)
+            n = len;
+
+        if (count > first && bufs[count - 1].Addr + bufs[count - 1].Len == phys)
         {
-            Stdlib::ListEntry* entry = RequestQueue.RemoveHead();
-            if (!entry)
-                break;
-            BlockRequest* req = CONTAINING_RECORD(entry, BlockRequest, Link);
-            batch[batchCount] = req;
-            batchCount++;
+            bufs[count - 1].Len += (u32)n;
+        }
+        else
+        {
+            if (count >= maxCount)
+                return false;
+            bufs[count].Addr = phys;
+            bufs[count].Len = (u32)n;
+            bufs[count].Writable = writable;
+            count++;
         }
+
+        va += n;
+        len -= n;
     }
+    return true;
+}
 
-    if (batchCount == 0)
+void VirtioScsi::DrainQueue()
+{
+    if (!Initialized)
         return;
 
-    auto& pt = Mm::PageTable::GetInstance();
+    if (!Hba)
+    {
+        FailQueuedRequests();
+        return;
+    }
+
+    /* Issue on this CPU's request queue: submitters on different CPUs
+       neither share a ring lock nor a completion vector */
+    RequestVq& vq = Hba->LocalQueue();
     bool kicked = false;
 
-    for (ulong i = 0; i < batchCount; i++)
+    while (TakeDepth())
     {
-        BlockRequest* req = batch[i];
-
-        int slotIdx = Hba->AllocSlot();
-        if (slotIdx < 0)
+        BlockRequest* req = nullptr;
         {
-            /* No free slots -- put the whole remaining batch back at the
-               head in reverse so the original order is preserved (a later
-               flush must not leapfrog earlier writes) */
             Stdlib::AutoLock lock(QueueLock);
-            for (ulong j = batchCount; j > i; j--)
-                RequestQueue.InsertHead(&batch[j - 1]->Link);
+            if (!RequestQueue.IsEmpty())
+                req = CONTAINING_RECORD(RequestQueue.RemoveHead(), BlockRequest, Link);
+        }
+        if (!req)
+        {
+            Inflight.Dec();
+            break;
+        }
+
+        ulong flags = vq.Lock.LockIrqSave();
+        DmaSlot* slot = vq.AllocSlot();
+        vq.Lock.UnlockIrqRestore(flags);
+        if (!slot)
+        {
+            /* Retried from SoftIrq once a completion frees a slot */
+            Requeue(req);
             break;
         }
 
-        DmaSlot& slot = Hba->Slots[slotIdx];
-        slot.Request = req;
-        slot.Owner = this;
+        slot->Request = req;
+        slot->Owner = this;
 
         /* Build SCSI CDB from BlockRequest */
-        VirtioScsiCmdReq* cmdReq = slot.CmdReq;
+        VirtioScsiCmdReq* cmdReq = slot->CmdReq;
         Stdlib::MemSet(cmdReq, 0, sizeof(VirtioScsiCmdReq));
         EncodeLun(cmdReq->Lun, Target, LunId);
-        cmdReq->Tag = 0;
-        cmdReq->TaskAttr = 0;
-        cmdReq->Prio = 0;
-        cmdReq->Crn = 0;
 
         u8* cdb = cmdReq->Cdb;
-        Stdlib::MemSet(cdb, 0, CdbLen);
-
-        /* Clear response */
-        Stdlib::MemSet(slot.CmdResp, 0, sizeof(VirtioScsiCmdResp));
-
         if (req->RequestType == BlockRequest::Flush)
         {
+            /* LBA 0, 0 blocks: flush the entire cache */
             cdb[0] = ScsiOpSyncCache;
-            /* Bytes 2-5: LBA = 0 (flush entire cache) */
-            /* Bytes 7-8: number of blocks = 0 (flush all) */
         }
         else
         {
-            if (req->RequestType == BlockRequest::Read)
-                cdb[0] = ScsiOpRead10;
-            else
-                cdb[0] = ScsiOpWrite10;
-
-            /* FUA bit: byte 1, bit 3 */
-            if (req->Fua && req->RequestType == BlockRequest::Write)
-                cdb[1] = 0x08;
-
-            u32 lba = (u32)req->Sector;
-            cdb[2] = (u8)(lba >> 24);
-            cdb[3] = (u8)(lba >> 16);
-            cdb[4] = (u8)(lba >> 8);
-            cdb[5] = (u8)(lba);
+            EncodeRw(cdb, req->RequestType == BlockRequest::Write, req->Fua,
+                     req->Sector, req->SectorCount);
+        }
 
-            cdb[7] = (u8)(req->SectorCount >> 8);
-            cdb[8] = (u8)(req->SectorCount);
+        /* Clear response */
+        Stdlib::MemSet(slot->CmdResp, 0, sizeof(VirtioScsiCmdResp));
+
+        /* Descriptor chain, device-readable before device-writable:
+           Data-out: CmdReq(R) -> Data(R)... -> CmdResp(W)
+           Data-in:  CmdReq(R) -> CmdResp(W) -> Data(W)...
+           No data:  CmdReq(R) -> CmdResp(W) */
+        VirtQueue::BufDesc bufs[MaxSegments + 2];
+        ulong count = 0;
+        ulong maxCount = Hba->MaxSegs + 1;
+        bool mapped = true;
+
+        bufs[count].Addr = slot->CmdReqPhys;
+        bufs[count].Len = Hba->ReqHdrSize;
+        bufs[count].Writable = false;
+        count++;
+
+        if (req->RequestType == BlockRequest::Write)
+            mapped = MapData(req->Buffer, (ulong)req->SectorCount * SectorSz, false,
+                             bufs, count, maxCount);
+
+        bufs[count].Addr = slot->CmdRespPhys;
+        bufs[count].Len = Hba->RespHdrSize;
+        bufs[count].Writable = true;
+        count++;
+
+        if (mapped && req->RequestType == BlockRequest::Read)
+            mapped = MapData(req->Buffer, (ulong)req->SectorCount * SectorSz, true,
+                             bufs, count, maxCount + 1);
+
+        if (!mapped)
+        {
+            Trace(0, "VirtioScsi %s: cannot map buf 0x%p", DevName, (ulong)req->Buffer);
+            flags = vq.Lock.LockIrqSave();
+            vq.FreeSlot(slot);
+            vq.Lock.UnlockIrqRestore(flags);
+            Inflight.Dec();
+            CompleteRequest(req, false);
+            continue;
         }
 
         Hal::DmaWmb();
 
-        int head = -1;
-
-        if (req->RequestType == BlockRequest::Flush)
+        /* Publish the slot mapping in the same critical section as
+           AddBufs: once the lock drops, a completion on another CPU may
+           already reference this head. */
+        flags = vq.Lock.LockIrqSave();
+        int head = vq.Queue.AddBufs(bufs, count);
+        if (head >= 0)
         {
-            /* No data: CmdReq(R) -> CmdResp(W) */
-            VirtQueue::BufDesc bufs[2];
-
-            bufs[0].Addr = slot.CmdReqPhys;
-            bufs[0].Len = Hba->ReqHdrSize;
-            bufs[0].Writable = false;
-
-            bufs[1].Addr = slot.CmdRespPhys;
-            bufs[1].Len = Hba->RespHdrSize;
-            bufs[1].Writable = true;
-
-            ulong flags = Hba->VirtQueueLock.LockIrqSave();
-            head = Hba->ReqQueue.AddBufs(bufs, 2);
-            /* Publish the slot mapping in the same critical section as
-               AddBufs: once the lock drops, a completion on another CPU may
-               already reference this head. */
-            if (head >= 0 && (ulong)head < sizeof(Hba->SlotByHead) / sizeof(Hba->SlotByHead[0]))
-            {
-                slot.Head = head;
-                Hba->SlotByHead[head] = &slot;
-            }
-            Hba->VirtQueueLock.UnlockIrqRestore(flags);
+            slot->Head = head;
+            vq.SlotByHead[head] = slot;
         }
         else
         {
-            ulong bufPhys = pt.VirtToPhys((ulong)req->Buffer);
-            if (bufPhys == 0)
-            {
-                Trace(0, "VirtioScsi %s: VirtToPhys failed for buf 0x%p", DevName, (ulong)req->Buffer);
-                req->Success = false;
-                req->Completion.Done();
-                Hba->FreeSlot(slotIdx);
-                continue;
-            }
-
-            u32 dataLen = req->SectorCount * (u32)SectorSz;
-
-            VirtQueue::BufDesc bufs[3];
-
-            if (req->RequestType == BlockRequest::Write)
-            {
-                /* Data-out: CmdReq(R) -> DataBuf(R) -> CmdResp(W) */
-                bufs[0].Addr = slot.CmdReqPhys;
-                bufs[0].Len = Hba->ReqHdrSize;
-                bufs[0].Writable = false;
-
-                bufs[1].Addr = bufPhys;
-                bufs[1].Len = dataLen;
-                bufs[1].Writable = false;
-
-                bufs[2].Addr = slot.CmdRespPhys;
-                bufs[2].Len = Hba->RespHdrSize;
-                bufs[2].Writable = true;
-            }
-            else
-            {
-                /* Data-in: CmdReq(R) -> CmdResp(W) -> DataBuf(W) */
-                bufs[0].Addr = slot.CmdReqPhys;
-                bufs[0].Len = Hba->ReqHdrSize;
-                bufs[0].Writable = false;
-
-                bufs[1].Addr = slot.CmdRespPhys;
-                bufs[1].Len = Hba->RespHdrSize;
-                bufs[1].Writable = true;
-
-                bufs[2].Addr = bufPhys;
-                bufs[2].Len = dataLen;
-                bufs[2].Writable = true;
-            }
-
-            ulong flags = Hba->VirtQueueLock.LockIrqSave();
-            head = Hba->ReqQueue.AddBufs(bufs, 3);
-            if (head >= 0 && (ulong)head < sizeof(Hba->SlotByHead) / sizeof(Hba->SlotByHead[0]))
-            {
-                slot.Head = head;
-                Hba->SlotByHead[head] = &slot;
-            }
-            Hba->VirtQueueLock.UnlockIrqRestore(flags);
+            vq.FreeSlot(slot);
         }
+        vq.Lock.UnlockIrqRestore(flags);
 
         if (head < 0)
         {
-            /* Ring full -- return the remaining batch to the queue head
-               in reverse to preserve the original order */
-            Hba->FreeSlot(slotIdx);
-            Stdlib::AutoLock lock(QueueLock);
-            for (ulong j = batchCount; j > i; j--)
-                RequestQueue.InsertHead(&batch[j - 1]->Link);
+            /* Ring full -- retried from SoftIrq once completions free
+               descriptors */
+            Requeue(req);
             break;
         }
 
-        if ((ulong)head >= sizeof(Hba->SlotByHead) / sizeof(Hba->SlotByHead[0]))
-        {
-            Trace(0, "VirtioScsi %s: head %u out of range", DevName, (ulong)head);
-            req->Success = false;
-            req->Completion.Done();
-            Hba->FreeSlot(slotIdx);
-            continue;
-        }
-
+        TraceBlock(this, BlockTrace::ActDispatch, req);
         kicked = true;
     }
 
     if (kicked)
-        Hba->Transport->NotifyQueue(QueueRequest);
+        Hba->Transport->NotifyQueue(vq.Index);
 }
 
 void VirtioScsi::DrainAllQueues()
@@ -551,82 +628,138 @@ void VirtioScsi::DrainAllQueues()
 
 /* --- HBA-level slot management and completion --- */
 
-int VirtioScsi::HbaState::AllocSlot()
+VirtioScsi::DmaSlot* VirtioScsi::RequestVq::AllocSlot()
 {
-    for (ulong i = 0; i < MaxSlots; i++)
-    {
-        if (FreeSlotMask.TestBit(i))
-        {
-            if (FreeSlotMask.ClearBit(i))
-                return (int)i;
-        }
-    }
-    return -1;
+    DmaSlot* slot = FreeSlots;
+    if (slot)
+        FreeSlots = slot->NextFree;
+    return slot;
 }
 
-void VirtioScsi::HbaState::FreeSlot(int idx)
+void VirtioScsi::RequestVq::FreeSlot(DmaSlot* slot)
 {
-    if (idx >= 0 && (ulong)idx < MaxSlots)
-    {
-        Slots[idx].Request = nullptr;
-        Slots[idx].Owner = nullptr;
-        Slots[idx].Head = -1;
-        FreeSlotMask.SetBit((ulong)idx);
-    }
+    slot->Request = nullptr;
+    slot->Owner = nullptr;
+    slot->Head = -1;
+    slot->NextFree = FreeSlots;
+    FreeSlots = slot;
 }
 
-void VirtioScsi::HbaState::CompleteIO()
+VirtioScsi::RequestVq& VirtioScsi::HbaState::LocalQueue()
+{
+    return Queues[CpuTable::GetInstance().GetCurrentCpuId() % QueueCount];
+}
+
+bool VirtioScsi::RequestVq::CompleteIO()
 {
     bool completed = false;
 
-    for (;;)
+    while (Queue.HasUsed())
     {
         u32 usedId, usedLen;
-        DmaSlot* slot = nullptr;
-
-        /* Claim the slot mapping in the same critical section as GetUsed:
-           the freed descriptors may be reused (and SlotByHead[usedId]
-           rewritten for a new request) by DrainQueue on another CPU the
-           moment the lock drops. */
-        ulong flags = VirtQueueLock.LockIrqSave();
-        bool got = ReqQueue.GetUsed(usedId, usedLen);
-        if (got && usedId < sizeof(SlotByHead) / sizeof(SlotByHead[0]))
+        BlockRequest* req = nullptr;
+        VirtioScsi* owner = nullptr;
+        bool success = false;
+
+        /* Claim and free the slot in the same critical section as
+           GetUsed: the freed descriptors may be reused (and
+           SlotByHead[usedId] rewritten for a new request) by DrainQueue
+           on another CPU the moment the lock drops. */
+        ulong flags = Lock.LockIrqSave();
+        bool got = Queue.GetUsed(usedId, usedLen);
+        if (got && usedId < VirtQueue::MaxDescriptors)
         {
-            slot = SlotByHead[usedId];
+            DmaSlot* slot = SlotByHead[usedId];
             SlotByHead[usedId] = nullptr;
+            if (slot && slot->Request)
+            {
+                req = slot->Request;
+                owner = slot->Owner;
+                success = (slot->CmdResp->Response == ResponseOk &&
+                           slot->CmdResp->Status == ScsiStatusGood);
+                FreeSlot(slot);
+            }
         }
-        VirtQueueLock.UnlockIrqRestore(flags);
+        Lock.UnlockIrqRestore(flags);
 
         if (!got)
             break;
 
-        if (usedId >= sizeof(SlotByHead) / sizeof(SlotByHead[0]))
+        if (!req)
         {
-            Trace(0, "VirtioScsi: bad used id %u", (ulong)usedId);
+            Trace(0, "VirtioScsi: no slot for used id %u queue %u", (ulong)usedId, (ulong)Index);
             continue;
         }
 
-        if (!slot || !slot->Request)
-        {
-            Trace(0, "VirtioScsi: no slot for used id %u", (ulong)usedId);
-            continue;
-        }
+        owner->Inflight.Dec();
+        owner->CompleteRequest(req, success);
+        completed = true;
+    }
 
-        BlockRequest* req = slot->Request;
+    return completed;
+}
 
-        /* Check response */
-        if (slot->CmdResp->Response != ResponseOk || slot->CmdResp->Status != ScsiStatusGood)
-            req->Success = false;
-        else
-            req->Success = true;
+VirtioScsi::QueueVector& VirtioScsi::GetQueueVector(HbaState* hba, ulong q)
+{
+    static_assert(sizeof(VirtioScsiQueueStubs) / sizeof(VirtioScsiQueueStubs[0]) == MaxQueueVectors,
+                  "a stub per queue vector slot");
+
+    ulong slot = (ulong)(hba - Hbas) * MaxQueues + q;
+    QueueVector& qv = QueueVectors[slot];
+    qv.Hba = hba;
+    qv.Queue = q;
+    qv.Slot = slot;
+    return qv;
+}
 
-        int slotIdx = (int)(slot - Slots);
-        FreeSlot(slotIdx);
+void VirtioScsi::QueueVector::OnInterruptRegister(u8 irq, u8 vector)
+{
+    (void)irq;
+    (void)vector;
+}
 
-        req->Completion.Done();
-        completed = true;
+InterruptHandlerFn VirtioScsi::QueueVector::GetHandlerFn()
+{
+    return VirtioScsiQueueStubs[Slot];
+}
+
+void VirtioScsi::QueueVector::OnInterrupt(Context* ctx)
+{
+    (void)ctx;
+
+    /* Probing polls Queues[0] itself and the slot pools come after it */
+    if (Hba == nullptr || !Hba->Ready)
+        return;
+
+    InterruptStats::Inc(IrqVirtioScsi);
+
+    if (Shared)
+    {
+        Hba->CompleteIO();
+        return;
     }
 
+    if (Hba->Queues[Queue].CompleteIO())
+        SoftIrq::GetInstance().Raise(SoftIrq::TypeBlkIo);
+}
+
+void VirtioScsi::QueueInterrupt(ulong slot)
+{
+    if (slot < MaxQueueVectors)
+        QueueVectors[slot].OnInterrupt(nullptr);
+}
+
+void VirtioScsi::HbaState::CompleteIO()
+{
+    bool completed = false;
+
+    for (ulong q = 0; q < QueueCount; q++)
+    {
+        if (Queues[q].CompleteIO())
+            completed = true;
+    }
+
+    /* Freed slots and queue depth: drain what is waiting */
     if (completed)
         SoftIrq::GetInstance().Raise(SoftIrq::TypeBlkIo);
 }
@@ -656,7 +789,7 @@ bool VirtioScsi::ReadSectors(u64 sector, void* buf, u32 count)
         return true;
     if (sector + count > CapacitySectors)
         return false;
-    if ((u64)SectorSz * count > Const::PageSize)
+    if (count > MaxTransferSectors)
         return false;
     if ((ulong)buf & (Const::PageSize - 1))
     {
@@ -682,7 +815,7 @@ bool VirtioScsi::WriteSectors(u64 sector, const void* buf, u32 count, bool fua)
         return true;
     if (sector + count > CapacitySectors)
         return false;
-    if ((u64)SectorSz * count > Const::PageSize)
+    if (count > MaxTransferSectors)
         return false;
     if ((ulong)buf & (Const::PageSize - 1))
     {
@@ -780,39 +913,73 @@ void VirtioScsi::Interrupt(Context* ctx)
 
 /* --- HBA and device initialization --- */
 
-bool VirtioScsi::SetupHbaSlots(HbaState* hba)
+bool VirtioScsi::SetupQueueSlots(RequestVq& vq)
 {
+    ulong slots = vq.Queue.GetQueueSize() / 2;
+    if (slots > MaxQueueSlots)
+        slots = MaxQueueSlots;
+    if (slots == 0)
+        slots = 1;
+
+    /* Each slot's CmdReq (51 bytes) is followed by its CmdResp (108
+       bytes) in physically contiguous DMA pages. */
+    ulong slotBytes = sizeof(VirtioScsiCmdReq) + sizeof(VirtioScsiCmdResp);
+    ulong pages = (slots * slotBytes + Const::PageSize - 1) / Const::PageSize;
+
     ulong dmaPhys;
-    void* dmaPtr = Mm::AllocMapPages(1, &dmaPhys);
+    void* dmaPtr = Mm::AllocMapPages(pages, &dmaPhys);
     if (!dmaPtr)
     {
-        Trace(0, "VirtioScsi: failed to alloc DMA page for HBA slots");
+        Trace(0, "VirtioScsi: failed to alloc DMA pages for queue %u slots", (ulong)vq.Index);
         return false;
     }
+    Stdlib::MemSet(dmaPtr, 0, pages * Const::PageSize);
 
-    Stdlib::MemSet(dmaPtr, 0, Const::PageSize);
-    ulong dmaVirt = (ulong)dmaPtr;
+    vq.Slots = new (Mm::NoThrow) DmaSlot[slots];
+    vq.SlotByHead = new (Mm::NoThrow) DmaSlot*[VirtQueue::MaxDescriptors];
+    if (!vq.Slots || !vq.SlotByHead)
+    {
+        Trace(0, "VirtioScsi: failed to alloc queue %u slot table", (ulong)vq.Index);
+        delete[] vq.Slots;
+        delete[] vq.SlotByHead;
+        vq.Slots = nullptr;
+        vq.SlotByHead = nullptr;
+        Mm::UnmapFreePages(dmaPtr);
+        return false;
+    }
 
-    /* Layout within the DMA page:
-       MaxSlots * VirtioScsiCmdReq (51 bytes each) followed by
-       MaxSlots * VirtioScsiCmdResp (108 bytes each).
-       Total: MaxSlots * (51 + 108) = 8 * 159 = 1272 bytes. */
-    for (ulong i = 0; i < MaxSlots; i++)
+    ulong dmaVirt = (ulong)dmaPtr;
+    vq.FreeSlots = nullptr;
+    for (ulong i = slots; i > 0; i--)
     {
-        hba->Slots[i].CmdReq = (VirtioScsiCmdReq*)(dmaVirt + i * sizeof(VirtioScsiCmdReq));
-        hba->Slots[i].CmdReqPhys = dmaPhys + i * sizeof(VirtioScsiCmdReq);
-        hba->Slots[i].CmdResp = (VirtioScsiCmdResp*)(dmaVirt +
-            MaxSlots * sizeof(VirtioScsiCmdReq) + i * sizeof(VirtioScsiCmdResp));
-        hba->Slots[i].CmdRespPhys = dmaPhys +
-            MaxSlots * sizeof(VirtioScsiCmdReq) + i * sizeof(VirtioScsiCmdResp);
-        hba->Slots[i].Request = nullptr;
-        hba->Slots[i].Owner = nullptr;
-        hba->Slots[i].Head = -1;
+        DmaSlot& slot = vq.Slots[i - 1];
+        ulong offset = (i - 1) * slotBytes;
+
+        slot.CmdReq = (VirtioScsiCmdReq*)(dmaVirt + offset);
+        slot.CmdReqPhys = dmaPhys + offset;
+        slot.CmdResp = (VirtioScsiCmdResp*)(dmaVirt + offset + sizeof(VirtioScsiCmdReq));
+        slot.CmdRespPhys = dmaPhys + offset + sizeof(VirtioScsiCmdReq);
+        vq.FreeSlot(&slot);
     }
+    vq.SlotCount = slots;
+    Stdlib::MemSet(vq.SlotByHead, 0, VirtQueue::MaxDescriptors * sizeof(DmaSlot*));
 
-    hba->FreeSlotMask.Set((1L << MaxSlots) - 1);
-    Stdlib::MemSet(hba->SlotByHead, 0, sizeof(hba->SlotByHead));
+    return true;
+}
 
+bool VirtioScsi::SetupHbaSlots(HbaState* hba)
+{
+    for (ulong q = 0; q < hba->QueueCount; q++)
+    {
+        if (!SetupQueueSlots(hba->Queues[q]))
+        {
+            /* Fewer queues still work; the first one is required */
+            if (q == 0)
+                return false;
+            hba->QueueCount = q;
+            break;
+        }
+    }
     return true;
 }
 
@@ -925,38 +1092,92 @@ bool VirtioScsi::InitHbaCommon(HbaState* hba)
        Not needed without hotplug support. Skip allocation. */
     hba->Transport->SelectQueue(QueueEvent);
 
-    /* Queue 2 = first request queue -- used for SCSI commands (read, write, inquiry).
-       This is the only queue we need for block I/O. */
-    hba->Transport->SelectQueue(QueueRequest);
-    u16 queueSize = hba->Transport->GetQueueSize();
-    Trace(0, "VirtioScsi: request queue size %u", (ulong)queueSize);
-
-    if (queueSize == 0)
+    /* Queues 2.. = request queues, one per CPU up to num_queues.  Each
+       gets its own MSI-X entry where the table has room, so IrqBalance
+       spreads their completions across CPUs. */
+    ulong wanted = numQueues;
+    if (wanted == 0)
+        wanted = 1;
+    if (wanted > MaxQueues)
+        wanted = MaxQueues;
+
+    hba->QueueCount = 0;
+    for (ulong q = 0; q < wanted; q++)
     {
-        Trace(0, "VirtioScsi: request queue size is 0");
-        hba->Transport->SetStatus(VirtioTransport::StatusFailed);
-        return false;
-    }
+        RequestVq& vq = hba->Queues[q];
+        vq.Index = (u16)(QueueRequest + q);
 
-    if (!hba->ReqQueue.Setup(queueSize))
-    {
-        Trace(0, "VirtioScsi: failed to setup request queue");
-        hba->Transport->SetStatus(VirtioTransport::StatusFailed);
-        return false;
-    }
+        hba->Transport->SelectQueue(vq.Index);
+        u16 queueSize = hba->Transport->GetQueueSize();
+        if (q == 0)
+            Trace(0, "VirtioScsi: request queue size %u", (ulong)queueSize);
 
-    hba->Transport->SetQueueDesc(hba->ReqQueue.GetDescPhys());
-    hba->Transport->SetQueueDriver(hba->ReqQueue.GetAvailPhys());
-    hba->Transport->SetQueueDevice(hba->ReqQueue.GetUsedPhys());
+        if (queueSize == 0 || !vq.Queue.Setup(queueSize))
+        {
+            if (q != 0)
+                break;
 
-    if (!hba->Transport->IsLegacy() && hba->Transport->IsMsixEnabled())
-    {
-        u8 vec = hba->Transport->EnableMsixVector(0, ScsiMsixRegistrar);
-        if (vec == 0)
-            Trace(0, "VirtioScsi: MSI-X unavailable, using INTx");
+            Trace(0, "VirtioScsi: failed to setup request queue");
+            hba->Transport->SetStatus(VirtioTransport::StatusFailed);
+            return false;
+        }
+
+        hba->Transport->SetQueueDesc(vq.Queue.GetDescPhys());
+        hba->Transport->SetQueueDriver(vq.Queue.GetAvailPhys());
+        hba->Transport->SetQueueDevice(vq.Queue.GetUsedPhys());
+
+        if (!hba->Transport->IsLegacy() && hba->Transport->IsMsixEnabled())
+        {
+            if (q == 0)
+            {
+                u8 vec = hba->Transport->EnableMsixVector(0, GetQueueVector(hba, 0));
+                if (vec == 0)
+                    Trace(0, "VirtioScsi: MSI-X unavailable, using INTx");
+            }
+            else if (hba->Transport->UsingMsix())
+            {
+                /* Share entry 0 if the table or the vectors run out.
+                   Otherwise keep the queue's completions on the CPU
+                   that submits on it (see LocalQueue). */
+                if (hba->Transport->EnableMsixVector((u16)q, GetQueueVector(hba, q)) == 0)
+                {
+                    QueueVector& entry0 = GetQueueVector(hba, 0);
+                    entry0.Shared = true;
+                    hba->Transport->EnableMsixVector(0, entry0);
+                }
+                else
+                {
+                    hba->Transport->SetMsixAffinity((u16)q, q);
+                }
+            }
+        }
+
+        hba->Transport->EnableQueue();
+        hba->QueueCount++;
     }
 
-    hba->Transport->EnableQueue();
+    /* Queue 0 is CPU 0's as well once there are several; a single queue
+       serves every CPU and stays balanced */
+    if (hba->QueueCount > 1 && hba->Transport->UsingMsix())
+        hba->Transport->SetMsixAffinity(0, 0);
+
+    /* Command size limits: descriptors per chain (two go to the
+       header and response) and the device's max_sectors hint */
+    u32 segs = MaxSegments;
+    if (segMax != 0 && segMax < segs)
+        segs = segMax;
+    if (segs > (u32)hba->Queues[0].Queue.GetQueueSize() - 2)
+        segs = (u32)hba->Queues[0].Queue.GetQueueSize() - 2;
+    if (segs == 0)
+        segs = 1;
+    hba->MaxSegs = segs;
+    hba->MaxBytes = segs * (u32)Const::PageSize;
+    if (maxSectors != 0 && (u64)maxSectors * 512 < hba->MaxBytes)
+        hba->MaxBytes = maxSectors * 512;
+    hba->CmdPerLun = cmdPerLun;
+
+    Trace(0, "VirtioScsi: %u request queues, %u segments, %u KB per command",
+        hba->QueueCount, (ulong)hba->MaxSegs, (ulong)hba->MaxBytes / Const::KB);
 
     /* Set DRIVER_OK */
     u8 okStatus = VirtioTransport::StatusAcknowledge | VirtioTransport::StatusDriver |
@@ -986,7 +1207,7 @@ bool VirtioScsi::ProbeLun(HbaState* hba, u8 target, u16 lun)
 
     u32 reqHdrSize = 19 + hba->CdbSize;
     u32 respHdrSize = 12 + hba->SenseSize;
-    if (!inst.Init(hba->Transport, &hba->ReqQueue, &hba->Lock, target, lun, 0, DefaultSectorSize, tmpName,
+    if (!inst.Init(hba->Transport, &hba->Queues[0].Queue, &hba->Lock, target, lun, 0, DefaultSectorSize, tmpName,
                    reqHdrSize, respHdrSize))
         return false;
 
@@ -1043,6 +1264,29 @@ bool VirtioScsi::ProbeLun(HbaState* hba, u8 target, u16 lun)
 
     u64 capacity = (u64)lastLba + 1;
 
+    /* 0xFFFFFFFF: the disk is larger than 2 TB sectors can express,
+       ask READ CAPACITY(16) for the 64-bit last LBA */
+    if (lastLba == 0xFFFFFFFF)
+    {
+        Stdlib::MemSet(cdb, 0, sizeof(cdb));
+        cdb[0] = ScsiOpServiceIn16;
+        cdb[1] = ScsiSaReadCapacity16;
+        cdb[13] = ReadCap16RespLen;
+
+        u8 cap16[ReadCap16RespLen];
+        Stdlib::MemSet(cap16, 0, sizeof(cap16));
+
+        if (!inst.ScsiCommand(cdb, cap16, sizeof(cap16), true))
+            return false;
+
+        u64 lastLba64 = 0;
+        for (ulong i = 0; i < 8; i++)
+            lastLba64 = (lastLba64 << 8) | cap16[i];
+        blockSize = ((u32)cap16[8] << 24) | ((u32)cap16[9] << 16) |
+                    ((u32)cap16[10] << 8) | (u32)cap16[11];
+        capacity = lastLba64 + 1;
+    }
+
     Trace(0, "VirtioScsi %s: capacity %u sectors, block size %u (%u MB)",
         tmpName, capacity, (ulong)blockSize,
         (capacity * blockSize) / (1024 * 1024));
@@ -1055,6 +1299,7 @@ bool VirtioScsi::ProbeLun(HbaState* hba, u8 target, u16 lun)
 
     inst.CapacitySectors = capacity;
     inst.SectorSz = blockSize;
+    inst.Stats.SetSectorSize((u32)blockSize);
 
     /* Register as block device */
     BlockDeviceTable::GetInstance().Register(&inst);
@@ -1168,7 +1413,8 @@ void VirtioScsi::SetupHbaDevices(HbaState* hba, u8 irq, u8 vector)
 
         if (InstanceCount > firstInst)
         {
-            if (!SetupHbaSlots(hba))
+            hba->Ready = SetupHbaSlots(hba);
+            if (!hba->Ready)
             {
                 Trace(0, "VirtioScsi: failed to setup HBA slot pool, disabling %u devices",
                       InstanceCount - firstInst);
@@ -1177,6 +1423,25 @@ void VirtioScsi::SetupHbaDevices(HbaState* hba, u8 irq, u8 vector)
                 for (ulong j = firstInst; j < InstanceCount; j++)
                     Instances[j].Hba = nullptr;
             }
+            else
+            {
+                /* Per-LUN depth: cmd_per_lun, at most every slot */
+                ulong slots = 0;
+                for (ulong q = 0; q < hba->QueueCount; q++)
+                    slots += hba->Queues[q].SlotCount;
+
+                long depth = (long)slots;
+                if (hba->CmdPerLun != 0 && (long)hba->CmdPerLun < depth)
+                    depth = (long)hba->CmdPerLun;
+
+                for (ulong j = firstInst; j < InstanceCount; j++)
+                {
+                    Instances[j].QueueDepth = depth;
+                    Instances[j].MaxTransferSectors = (u32)(hba->MaxBytes / Instances[j].SectorSz);
+                    Trace(0, "VirtioScsi %s: queue depth %u, %u sectors per command",
+                        Instances[j].DevName, (ulong)depth, (ulong)Instances[j].MaxTransferSectors);
+                }
+            }
 
             if (!hba->Transport->UsingMsix())
             {
@@ -1193,7 +1458,16 @@ void VirtioScsi::SetupHbaDevices(HbaState* hba, u8 irq, u8 vector)
     }
 }
 
-/* Global interrupt handler called from assembly stub. */
+/* Completions of one request queue, from its MSI-X entry stub */
+extern "C" void VirtioScsiQueueInterrupt(Context* ctx, int slot)
+{
+    (void)ctx;
+    VirtioScsi::QueueInterrupt((ulong)slot);
+    Hal::IrqEoi();
+}
+
+/* Global interrupt handler called from assembly stub: the INTx line,
+   shared by every HBA, scans all their queues. */
 extern "C" void VirtioScsiInterrupt(Context* ctx)
 {
     for (ulong i = 0; i < VirtioScsi::InstanceCount; i++)
@@ -4,9 +4,12 @@
 #include <kernel/interrupt.h>
 #include <block/block_device.h>
 #include <block/block_request.h>
+#include <block/block_stats.h>
 #include <kernel/spin_lock.h>
 #include <kernel/raw_spin_lock.h>
 #include <kernel/atomic.h>
+#include <kernel/cpu.h>
+#include <include/const.h>
 #include <hal/context.h>
 #include <lib/list_entry.h>
 #include <drivers/virtqueue.h>
@@ -60,6 +63,9 @@ public:
     virtual bool Flush() override;
     virtual bool ReadSectors(u64 sector, void* buf, u32 count) override;
     virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override;
+    virtual BlockStats* GetStats() override;
+    virtual bool SupportsTrace() override;
+    virtual ulong GetQueueCount() override;
 
     /* InterruptHandler interface */
     virtual void OnInterruptRegister(u8 irq, u8 vector) override;
@@ -68,10 +74,15 @@ public:
 
     void Interrupt(Context* ctx);
 
-    /* Submit a block request (caller context). */
-    void Submit(BlockRequest* req);
+    /* Submit a block request (caller context).  Data requests may span
+       up to GetMaxTransferSectors() sectors of virtually contiguous,
+       page-aligned memory. */
+    virtual void Submit(BlockRequest* req) override;
+    virtual void WaitRequest(BlockRequest& req) override;
     void FailQueuedRequests();
 
+    u32 GetMaxTransferSectors();
+
     /* Drain pending requests and submit to hardware (softirq context). */
     void DrainQueue();
 
@@ -96,6 +107,10 @@ public:
     static const u8 ScsiOpRead10        = 0x28;
     static const u8 ScsiOpWrite10       = 0x2A;
     static const u8 ScsiOpSyncCache     = 0x35;
+    static const u8 ScsiOpRead16        = 0x88;
+    static const u8 ScsiOpWrite16       = 0x8A;
+    static const u8 ScsiOpServiceIn16   = 0x9E;
+    static const u8 ScsiSaReadCapacity16 = 0x10;
 
     /* SCSI device types */
     static const u8 ScsiTypeDirectAccess = 0;
@@ -106,8 +121,9 @@ public:
     static const u8 InquiryQualShift    = 5;
     static const u8 InquiryQualMask     = 0x07;
 
-    /* READ CAPACITY(10) response size */
+    /* READ CAPACITY(10) and (16) response sizes */
     static const u8 ReadCapRespLen      = 8;
+    static const u8 ReadCap16RespLen    = 32;
 
 private:
     VirtioScsi(const VirtioScsi& other) = delete;
@@ -123,6 +139,19 @@ private:
 
     void WaitForCompletion(BlockRequest& req);
 
+    /* Account req in Stats and complete it. */
+    void CompleteRequest(BlockRequest* req, bool success);
+
+    /* Take one unit of queue depth; false if the LUN is at its depth. */
+    bool TakeDepth();
+
+    /* Put a request that could not be issued back at the queue head. */
+    void Requeue(BlockRequest* req);
+
+    /* Encode a READ/WRITE CDB: the 10-byte forms while LBA and length
+       fit, READ(16)/WRITE(16) beyond 2^32 blocks or 65535 blocks. */
+    static void EncodeRw(u8* cdb, bool write, bool fua, u64 lba, u32 blocks);
+
     VirtioTransport* Transport;
     VirtQueue* ReqQueue;
     SpinLock* IoLock;          /* Points to shared HBA lock */
@@ -143,6 +172,13 @@ private:
     /* Per-instance request queue (for async I/O) */
     SpinLock QueueLock;
     Stdlib::ListEntry RequestQueue;
+    BlockStats Stats;
+
+    /* Commands of this LUN on the HBA at once, bounded by the device's
+       cmd_per_lun so one busy LUN cannot take every slot */
+    Atomic Inflight;
+    long QueueDepth;
+    u32 MaxTransferSectors;
 
     /* DMA buffers (used during probing only) */
     VirtioScsiCmdReq* CmdReq;
@@ -170,7 +206,19 @@ private:
 
     /* Shared transport and queue objects (one per PCI device) */
     static const ulong MaxHbas = 4;
-    static const ulong MaxSlots = 8;
+
+    /* Request virtqueues per HBA: one per CPU up to the device's
+       num_queues; CPUs beyond that share queues round-robin */
+    static const ulong MaxQueues = MaxCpus;
+
+    /* Slots per request virtqueue: one per two descriptors (the
+       shortest chain), so slots are never the limit before the ring */
+    static const ulong MaxQueueSlots = VirtQueue::MaxDescriptors / 2;
+
+    /* Data descriptors per command and the resulting transfer limit for
+       page-aligned buffers (256 KB) */
+    static const ulong MaxSegments = 64;
+    static const ulong MaxTransferBytes = MaxSegments * Const::PageSize;
 
     struct DmaSlot
     {
@@ -180,35 +228,71 @@ private:
         ulong CmdRespPhys;
         BlockRequest* Request;
         VirtioScsi* Owner;     /* Which instance owns this slot (for LUN encoding) */
+        DmaSlot* NextFree;
         int Head;
     };
 
+    struct RequestVq
+    {
+        VirtQueue Queue;
+        RawSpinLock Lock;      /* Protects Queue, FreeSlots and SlotByHead */
+        u16 Index;             /* virtio queue index */
+        DmaSlot* Slots;
+        ulong SlotCount;
+        DmaSlot* FreeSlots;
+        DmaSlot** SlotByHead;  /* descriptor head -> slot */
+
+        DmaSlot* AllocSlot();
+        void FreeSlot(DmaSlot* slot);
+        bool CompleteIO();
+    };
+
     struct HbaState
     {
         VirtioPci PciTransport;
         VirtioMmio MmioTransport;
         VirtioTransport* Transport;
-        VirtQueue ReqQueue;
-        RawSpinLock VirtQueueLock; /* Protects ReqQueue (AddBufs/GetUsed share free chain) */
         SpinLock Lock;        /* Serializes probing I/O on this HBA */
         u32 CdbSize;          /* Actual CDB size from device config */
         u32 SenseSize;        /* Actual sense data size from device config */
         u16 MaxTarget;        /* Max target number from device config */
         u32 ReqHdrSize;
         u32 RespHdrSize;
+        u32 MaxSegs;          /* data descriptors per command */
+        u32 MaxBytes;         /* bytes per command */
+        u32 CmdPerLun;
 
-        /* DMA slot pool (shared by all LUNs on this HBA) */
-        DmaSlot Slots[MaxSlots];
-        DmaSlot* SlotByHead[VirtQueue::MaxDescriptors];
-        Atomic FreeSlotMask;
+        /* Request queues, each with its own DMA slot pool shared by all
+           LUNs on this HBA; probing uses Queues[0] */
+        RequestVq Queues[MaxQueues];
+        ulong QueueCount;
+        bool Ready;           /* probing done, slot pools set up */
 
-        int AllocSlot();
-        void FreeSlot(int idx);
+        RequestVq& LocalQueue();
         void CompleteIO();
     };
     static HbaState Hbas[MaxHbas];
     static ulong HbaCount;
 
+    /* Registration context of a request queue's MSI-X entry: its stub
+       (VirtioScsiQueueStub<Slot>) completes only that queue.  Entry 0
+       is Shared when queues that got no entry of their own fall back to
+       it; it then scans every queue of the HBA. */
+    struct QueueVector final : public InterruptHandler
+    {
+        HbaState* Hba;
+        ulong Queue;
+        ulong Slot;
+        bool Shared;
+
+        virtual void OnInterruptRegister(u8 irq, u8 vector) override;
+        virtual InterruptHandlerFn GetHandlerFn() override;
+        virtual void OnInterrupt(Context* ctx) override;
+    };
+    static const ulong MaxQueueVectors = MaxHbas * MaxQueues; // stubs in irq_stubs.h
+    static QueueVector QueueVectors[MaxQueueVectors];
+    static QueueVector& GetQueueVector(HbaState* hba, ulong q);
+
     /* Pointer to owning HBA state (set after probing) */
     HbaState* Hba;
 
@@ -219,10 +303,18 @@ private:
     static void SetupHbaDevices(HbaState* hba, u8 irq, u8 vector);
     static bool ProbeLun(HbaState* hba, u8 target, u16 lun);
     static bool SetupHbaSlots(HbaState* hba);
+    static bool SetupQueueSlots(RequestVq& vq);
+
+    /* Append the physical segments of [buf, buf + len) to bufs,
+       coalescing physically contiguous pages. */
+    static bool MapData(void* buf, ulong len, bool writable, VirtQueue::BufDesc* bufs,
+                        ulong& count, ulong maxCount);
 
 public:
     static VirtioScsi Instances[MaxInstances];
     static ulong InstanceCount;
+
+    static void QueueInterrupt(ulong slot);
 };
 
 }
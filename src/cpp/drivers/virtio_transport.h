@@ -56,6 +56,9 @@ public:
     virtual u8   EnableMsixVector(u16 index, InterruptHandler& handler) = 0;
     virtual bool UsingMsix() const = 0;
 
+    /* Keep an enabled MSI-X entry on cpu (per-CPU queues) */
+    virtual bool SetMsixAffinity(u16 index, ulong cpu) = 0;
+
     /* Device status bits */
     static const u8 StatusAcknowledge = 1;
     static const u8 StatusDriver      = 2;
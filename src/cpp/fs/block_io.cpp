@@ -1,7 +1,9 @@
 #include "block_io.h"
+#include "buffer_cache.h"
 
 #include <lib/stdlib.h>
 #include <kernel/trace.h>
+#include <mm/new.h>
 
 namespace Kernel
 {
@@ -19,6 +21,14 @@ BlockIo::~BlockIo()
 {
 }
 
+void BlockIo::SetBlockSize(u32 blockSize)
+{
+    BlkSize = blockSize;
+    SectorsPerBlock = 0;
+    if (Dev != nullptr && Dev->GetSectorSize() > 0)
+        SectorsPerBlock = BlkSize / (u32)Dev->GetSectorSize();
+}
+
 bool BlockIo::ReadBlock(u32 blockIdx, void* buf)
 {
     if (Dev == nullptr || SectorsPerBlock == 0)
@@ -28,7 +38,7 @@ bool BlockIo::ReadBlock(u32 blockIdx, void* buf)
     }
 
     u64 startSector = (u64)blockIdx * SectorsPerBlock;
-    return Dev->ReadSectors(startSector, buf, SectorsPerBlock);
+    return BufferCache::GetInstance().Read(Dev, startSector, BlkSize, buf);
 }
 
 bool BlockIo::WriteBlock(u32 blockIdx, const void* buf, bool fua)
@@ -40,14 +50,216 @@ bool BlockIo::WriteBlock(u32 blockIdx, const void* buf, bool fua)
     }
 
     u64 startSector = (u64)blockIdx * SectorsPerBlock;
-    return Dev->WriteSectors(startSector, buf, SectorsPerBlock, fua);
+    auto& cache = BufferCache::GetInstance();
+    if (cache.IsWriteback() && cache.WriteDirty(Dev, startSector, BlkSize, buf))
+        return true;
+
+    if (!Dev->WriteSectors(startSector, buf, SectorsPerBlock, fua))
+    {
+        cache.Forget(Dev, startSector);
+        return false;
+    }
+
+    cache.Update(Dev, startSector, BlkSize, buf);
+    return true;
+}
+
+bool BlockIo::WriteBlocks(const u32* blockIdx, const void* const* bufs, u32 count)
+{
+    if (Dev == nullptr || SectorsPerBlock == 0)
+    {
+        Trace(0, "BlockIo::WriteBlocks: dev null or bad config");
+        return false;
+    }
+
+    if (count == 0)
+        return true;
+
+    if (BufferCache::GetInstance().IsWriteback())
+    {
+        bool ok = true;
+        for (u32 i = 0; i < count; i++)
+        {
+            if (!WriteBlock(blockIdx[i], bufs[i]))
+                ok = false;
+        }
+        return ok;
+    }
+
+    BlockRequest* reqs = new (Mm::NoThrow) BlockRequest[count];
+    BlockRequest** batch = new (Mm::NoThrow) BlockRequest*[count];
+    if (reqs == nullptr || batch == nullptr)
+    {
+        Trace(0, "BlockIo::WriteBlocks: alloc failed");
+        delete[] reqs;
+        delete[] batch;
+        return false;
+    }
+
+    for (u32 i = 0; i < count; i++)
+    {
+        reqs[i].RequestType = BlockRequest::Write;
+        reqs[i].Sector = (u64)blockIdx[i] * SectorsPerBlock;
+        reqs[i].SectorCount = SectorsPerBlock;
+        reqs[i].Buffer = const_cast<void*>(bufs[i]);
+        batch[i] = &reqs[i];
+    }
+
+    Dev->SubmitBatch(batch, count);
+
+    auto& cache = BufferCache::GetInstance();
+    bool ok = true;
+    for (u32 i = 0; i < count; i++)
+    {
+        Dev->WaitRequest(reqs[i]);
+        if (reqs[i].Success)
+        {
+            cache.Update(Dev, reqs[i].Sector, BlkSize, bufs[i]);
+        }
+        else
+        {
+            cache.Forget(Dev, reqs[i].Sector);
+            ok = false;
+        }
+    }
+
+    delete[] batch;
+    delete[] reqs;
+    return ok;
+}
+
+/* Block-sized requests for one contiguous run, submitted as one batch:
+   drivers take at most a page per request and the I/O scheduler merges
+   the run back into a single device request. */
+bool BlockIo::TransferRange(bool write, u32 firstBlock, u32 count, u8* buf)
+{
+    BlockRequest* reqs = new (Mm::NoThrow) BlockRequest[count];
+    BlockRequest** batch = new (Mm::NoThrow) BlockRequest*[count];
+    if (reqs == nullptr || batch == nullptr)
+    {
+        Trace(0, "BlockIo::TransferRange: alloc failed");
+        delete[] reqs;
+        delete[] batch;
+        return false;
+    }
+
+    for (u32 i = 0; i < count; i++)
+    {
+        reqs[i].RequestType = write ? BlockRequest::Write : BlockRequest::Read;
+        reqs[i].Sector = (u64)(firstBlock + i) * SectorsPerBlock;
+        reqs[i].SectorCount = SectorsPerBlock;
+        reqs[i].Buffer = buf + (ulong)i * BlkSize;
+        batch[i] = &reqs[i];
+    }
+
+    Dev->SubmitBatch(batch, count);
+
+    auto& cache = BufferCache::GetInstance();
+    bool ok = true;
+    for (u32 i = 0; i < count; i++)
+    {
+        Dev->WaitRequest(reqs[i]);
+        if (!reqs[i].Success)
+        {
+            ok = false;
+            if (write)
+                cache.Forget(Dev, reqs[i].Sector);
+        }
+        else if (write)
+        {
+            cache.Update(Dev, reqs[i].Sector, BlkSize, reqs[i].Buffer);
+        }
+        else
+        {
+            cache.Fill(Dev, reqs[i].Sector, BlkSize, reqs[i].Buffer);
+        }
+    }
+
+    delete[] batch;
+    delete[] reqs;
+    return ok;
+}
+
+bool BlockIo::ReadBlockRange(u32 firstBlock, u32 count, void* buf)
+{
+    if (Dev == nullptr || SectorsPerBlock == 0)
+    {
+        Trace(0, "BlockIo::ReadBlockRange: dev null or bad config");
+        return false;
+    }
+
+    auto& cache = BufferCache::GetInstance();
+    u8* dst = static_cast<u8*>(buf);
+    u32 i = 0;
+    while (i < count)
+    {
+        /* Cached blocks may be newer than the disk (write-back) */
+        u32 end = i;
+        while (end < count &&
+               !cache.ReadCached(Dev, (u64)(firstBlock + end) * SectorsPerBlock,
+                                 BlkSize, dst + (ulong)end * BlkSize))
+        {
+            end++;
+        }
+
+        if (end > i && !TransferRange(false, firstBlock + i, end - i, dst + (ulong)i * BlkSize))
+            return false;
+
+        /* Block end, if any, was copied from the cache */
+        i = end + 1;
+    }
+    return true;
+}
+
+bool BlockIo::WriteBlockRange(u32 firstBlock, u32 count, const void* buf)
+{
+    if (Dev == nullptr || SectorsPerBlock == 0)
+    {
+        Trace(0, "BlockIo::WriteBlockRange: dev null or bad config");
+        return false;
+    }
+
+    const u8* src = static_cast<const u8*>(buf);
+    if (BufferCache::GetInstance().IsWriteback())
+    {
+        bool ok = true;
+        for (u32 i = 0; i < count; i++)
+        {
+            if (!WriteBlock(firstBlock + i, src + (ulong)i * BlkSize))
+                ok = false;
+        }
+        return ok;
+    }
+
+    return count == 0 || TransferRange(true, firstBlock, count, const_cast<u8*>(src));
+}
+
+bool BlockIo::Discard(u32 firstBlock, u32 count)
+{
+    if (Dev == nullptr || SectorsPerBlock == 0)
+    {
+        Trace(0, "BlockIo::Discard: dev null or bad config");
+        return false;
+    }
+
+    u64 startSector = (u64)firstBlock * SectorsPerBlock;
+    u64 sectors = (u64)count * SectorsPerBlock;
+    BufferCache::GetInstance().ForgetRange(Dev, startSector, sectors, SectorsPerBlock);
+    return Dev->Discard(startSector, sectors);
 }
 
 bool BlockIo::Flush()
 {
     if (Dev == nullptr)
         return false;
-    return Dev->Flush();
+    return BufferCache::GetInstance().Sync(Dev);
+}
+
+bool BlockIo::Commit()
+{
+    if (BufferCache::GetInstance().IsWriteback())
+        return Dev != nullptr;
+    return Flush();
 }
 
 BlockDevice* BlockIo::GetDevice()
@@ -55,4 +267,19 @@ BlockDevice* BlockIo::GetDevice()
     return Dev;
 }
 
+u32 BlockIo::GetBlockSize()
+{
+    return BlkSize;
+}
+
+u64 BlockIo::GetBlockSector(u32 blockIdx)
+{
+    return (u64)blockIdx * SectorsPerBlock;
+}
+
+u32 BlockIo::GetSectorsPerBlock()
+{
+    return SectorsPerBlock;
+}
+
 }
@@ -6,17 +6,53 @@
 namespace Kernel
 {
 
+/* Block-granular access to a device for file systems.  Reads go
+   through the shared BufferCache.  Writes go to the device and then
+   refresh the cached copy, or in write-back mode only dirty the cached
+   copy (FUA included) until the next Flush(). */
 class BlockIo
 {
 public:
     BlockIo(BlockDevice* dev, u32 blockSize = 4096);
     ~BlockIo();
 
+    /* For file systems that learn their block size from the superblock. */
+    void SetBlockSize(u32 blockSize);
+
     bool ReadBlock(u32 blockIdx, void* buf);
     bool WriteBlock(u32 blockIdx, const void* buf, bool fua = false);
+
+    /* Write count blocks with a single batch submission and wait for
+       all of them, so adjacent blocks reach the device merged. */
+    bool WriteBlocks(const u32* blockIdx, const void* const* bufs, u32 count);
+
+    /* count contiguous blocks from firstBlock to or from one buffer of
+       count blocks (page-aligned).  Each run of blocks not in the cache
+       is read as one batch the device queue merges into a single
+       request, then cached; cached copies are used as they are.  Writes
+       go out as one batch in write-through mode. */
+    bool ReadBlockRange(u32 firstBlock, u32 count, void* buf);
+    bool WriteBlockRange(u32 firstBlock, u32 count, const void* buf);
+
+    /* Discard count blocks starting at firstBlock and drop their cached
+       copies.  false if the device cannot discard or failed; the blocks
+       must be unused either way. */
+    bool Discard(u32 firstBlock, u32 count);
+
+    /* Durability point: write back dirty blocks, flush the device. */
     bool Flush();
 
+    /* Ordering point inside a file system operation: a device flush in
+       write-through mode, nothing in write-back mode, where only Flush()
+       makes data durable. */
+    bool Commit();
+
     BlockDevice* GetDevice();
+    u32 GetBlockSize();
+
+    /* First device sector of block blockIdx (0 if misconfigured). */
+    u64 GetBlockSector(u32 blockIdx);
+    u32 GetSectorsPerBlock();
 
 private:
     BlockIo(const BlockIo& other) = delete;
@@ -24,6 +60,8 @@ private:
     BlockIo& operator=(const BlockIo& other) = delete;
     BlockIo& operator=(BlockIo&& other) = delete;
 
+    bool TransferRange(bool write, u32 firstBlock, u32 count, u8* buf);
+
     BlockDevice* Dev;
     u32 BlkSize;
     u32 SectorsPerBlock;
@@ -0,0 +1,1114 @@
+#include "buffer_cache.h"
+
+#include <lib/stdlib.h>
+#include <kernel/trace.h>
+#include <kernel/panic.h>
+#include <kernel/sched.h>
+#include <kernel/parameters.h>
+#include <kernel/task.h>
+#include <kernel/time.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+BufferCache::BufferCache()
+    : BudgetPages(0)
+    , DeviceCount(0)
+    , DirtyTotal(0)
+    , Writeback(false)
+{
+    for (ulong i = 0; i < ShardCount; i++)
+    {
+        Shard& shard = Shards[i];
+        shard.Count = 0;
+        shard.ProtectedCount = 0;
+        shard.Hits = 0;
+        shard.Misses = 0;
+        shard.Evictions = 0;
+        shard.Prefetched = 0;
+    }
+
+    for (ulong i = 0; i < MaxDevices; i++)
+    {
+        DeviceState& state = Devices[i];
+        state.Dev = nullptr;
+        state.DirtyCount = 0;
+        state.Flusher = nullptr;
+        state.FlusherStarting = false;
+        state.Written = 0;
+        state.WriteErrors = 0;
+    }
+
+    BudgetPages = (Parameters::GetInstance().GetBcacheMb() * Const::MB) / Const::PageSize;
+    Writeback = Parameters::GetInstance().IsWriteback();
+}
+
+BufferCache::~BufferCache()
+{
+    Invalidate(nullptr);
+}
+
+ulong BufferCache::Hash(BlockDevice* dev, u64 sector)
+{
+    ulong h = ((ulong)dev >> 4) * 31 + sector;
+    h *= 0x9E3779B97F4A7C15UL;
+    h ^= h >> 33;
+    return h;
+}
+
+BufferCache::Shard& BufferCache::GetShard(ulong hash)
+{
+    return Shards[hash % ShardCount];
+}
+
+Stdlib::ListEntry& BufferCache::GetBucket(Shard& shard, ulong hash)
+{
+    return shard.Buckets[(hash / ShardCount) % BucketsPerShard];
+}
+
+ulong BufferCache::ShardLimit()
+{
+    ulong pages = BudgetPages;
+    if (pages == 0)
+        return 0;
+
+    ulong limit = pages / ShardCount;
+    return (limit != 0) ? limit : 1;
+}
+
+BufferCache::Buffer* BufferCache::AllocBuffer(BlockDevice* dev, u64 sector, u32 size)
+{
+    Buffer* buf = new (Mm::NoThrow) Buffer();
+    if (buf == nullptr)
+        return nullptr;
+
+    buf->Data = static_cast<u8*>(Mm::Alloc(Const::PageSize, 0));
+    if (buf->Data == nullptr)
+    {
+        delete buf;
+        return nullptr;
+    }
+
+    buf->Dev = dev;
+    buf->Sector = sector;
+    buf->Size = size;
+    buf->BufState = Buffer::Loading;
+    buf->Protected = false;
+    buf->Hashed = false;
+    buf->Finishing = false;
+    buf->Dirty = false;
+    buf->DirtyTime = 0;
+    buf->RefCount = 1;
+    buf->Pending = nullptr;
+    return buf;
+}
+
+void BufferCache::FreeBuffer(Buffer* buf)
+{
+    delete buf->Pending;
+    Mm::Free(buf->Data);
+    delete buf;
+}
+
+void BufferCache::FreeList(Stdlib::ListEntry& freeList)
+{
+    while (!freeList.IsEmpty())
+    {
+        Stdlib::ListEntry* entry = freeList.RemoveHead();
+        FreeBuffer(CONTAINING_RECORD(entry, Buffer, LruLink));
+    }
+}
+
+BufferCache::Buffer* BufferCache::LookupLocked(Shard& shard, ulong hash, BlockDevice* dev, u64 sector)
+{
+    Stdlib::ListEntry& bucket = GetBucket(shard, hash);
+    for (Stdlib::ListEntry* entry = bucket.Flink; entry != &bucket; entry = entry->Flink)
+    {
+        Buffer* buf = CONTAINING_RECORD(entry, Buffer, HashLink);
+        if (buf->Dev == dev && buf->Sector == sector)
+            return buf;
+    }
+    return nullptr;
+}
+
+void BufferCache::TouchLocked(Shard& shard, Buffer* buf)
+{
+    buf->LruLink.Remove();
+    if (!buf->Protected)
+    {
+        buf->Protected = true;
+        shard.ProtectedCount++;
+    }
+    shard.Protected.InsertHead(&buf->LruLink);
+
+    ulong cap = ShardLimit() * 3 / 4;
+    while (shard.ProtectedCount > cap)
+    {
+        Stdlib::ListEntry* entry = shard.Protected.RemoveTail();
+        Buffer* victim = CONTAINING_RECORD(entry, Buffer, LruLink);
+        victim->Protected = false;
+        shard.ProtectedCount--;
+        shard.Probation.InsertHead(entry);
+    }
+}
+
+void BufferCache::InsertLocked(Shard& shard, ulong hash, Buffer* buf)
+{
+    GetBucket(shard, hash).InsertHead(&buf->HashLink);
+    shard.Probation.InsertHead(&buf->LruLink);
+    buf->Protected = false;
+    buf->Hashed = true;
+    shard.Count++;
+}
+
+void BufferCache::UnhashLocked(Shard& shard, Buffer* buf)
+{
+    if (!buf->Hashed)
+        return;
+
+    buf->HashLink.RemoveInit();
+    buf->LruLink.RemoveInit();
+    if (buf->Protected)
+    {
+        buf->Protected = false;
+        shard.ProtectedCount--;
+    }
+    buf->Hashed = false;
+    shard.Count--;
+}
+
+void BufferCache::ShrinkLocked(Shard& shard, ulong limit, Stdlib::ListEntry& freeList)
+{
+    Stdlib::ListEntry* lists[2] = { &shard.Probation, &shard.Protected };
+
+    for (ulong i = 0; i < 2; i++)
+    {
+        Stdlib::ListEntry* head = lists[i];
+        Stdlib::ListEntry* entry = head->Blink;
+        while (shard.Count > limit && entry != head)
+        {
+            Buffer* buf = CONTAINING_RECORD(entry, Buffer, LruLink);
+            entry = entry->Blink;
+            if (buf->RefCount != 0)
+                continue;
+
+            UnhashLocked(shard, buf);
+            freeList.InsertTail(&buf->LruLink);
+            shard.Evictions++;
+        }
+    }
+}
+
+BufferCache::Buffer* BufferCache::Get(BlockDevice* dev, u64 sector, u32 size)
+{
+    if (dev == nullptr || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return nullptr;
+
+    u32 sectorSize = (u32)dev->GetSectorSize();
+    if (sectorSize == 0 || (size % sectorSize) != 0)
+        return nullptr;
+
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+    Buffer* buf = nullptr;
+    Buffer* fresh = nullptr;
+    bool load = false;
+    bool uncached = false;
+
+    for (;;)
+    {
+        Stdlib::ListEntry freeList;
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+
+            buf = LookupLocked(shard, hash, dev, sector);
+            if (buf != nullptr && buf->Size != size && buf->Dirty)
+            {
+                /* Dirty under another block size: leave it to writeback */
+                buf = nullptr;
+                uncached = true;
+            }
+            else if (buf != nullptr && buf->Size != size)
+            {
+                /* Same start sector cached under another block size
+                   (device reformatted): drop the old view. */
+                UnhashLocked(shard, buf);
+                if (buf->RefCount == 0)
+                    freeList.InsertTail(&buf->LruLink);
+                buf = nullptr;
+            }
+
+            if (buf != nullptr)
+            {
+                buf->RefCount++;
+                shard.Hits++;
+                TouchLocked(shard, buf);
+            }
+            else if (fresh != nullptr)
+            {
+                shard.Misses++;
+                InsertLocked(shard, hash, fresh);
+                ShrinkLocked(shard, ShardLimit(), freeList);
+                buf = fresh;
+                fresh = nullptr;
+                load = true;
+            }
+        }
+        FreeList(freeList);
+
+        if (buf != nullptr || uncached)
+            break;
+
+        /* Allocate without the shard lock and look up again: another
+           task may have inserted the block meanwhile. */
+        fresh = AllocBuffer(dev, sector, size);
+        if (fresh == nullptr)
+            return nullptr;
+    }
+
+    if (fresh != nullptr)
+        FreeBuffer(fresh);
+
+    if (uncached)
+        return nullptr;
+
+    if (load)
+    {
+        bool ok = dev->ReadSectors(sector, buf->Data, size / sectorSize);
+
+        Stdlib::AutoLock lock(shard.Lock);
+        buf->BufState = ok ? Buffer::Valid : Buffer::Error;
+        if (!ok)
+            UnhashLocked(shard, buf);
+    }
+    else
+    {
+        Wait(buf);
+    }
+
+    if (buf->BufState != Buffer::Valid)
+    {
+        Put(buf);
+        return nullptr;
+    }
+    return buf;
+}
+
+void BufferCache::Put(Buffer* buf)
+{
+    /* Never drop the last reference under an async read */
+    if (buf->BufState == Buffer::Loading)
+        Wait(buf);
+
+    Shard& shard = GetShard(Hash(buf->Dev, buf->Sector));
+    bool free = false;
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+        BugOn(buf->RefCount == 0);
+        buf->RefCount--;
+        free = (buf->RefCount == 0 && !buf->Hashed);
+    }
+
+    if (free)
+        FreeBuffer(buf);
+}
+
+void BufferCache::Prefetch(BlockDevice* dev, const u64* sectors, ulong count, u32 size, Buffer** bufs)
+{
+    for (ulong i = 0; i < count; i++)
+        bufs[i] = nullptr;
+
+    if (dev == nullptr || count == 0 || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return;
+
+    u32 sectorSize = (u32)dev->GetSectorSize();
+    if (sectorSize == 0 || (size % sectorSize) != 0)
+        return;
+
+    BlockRequest** batch = new (Mm::NoThrow) BlockRequest*[count];
+    if (batch == nullptr)
+        return;
+
+    ulong batchCount = 0;
+    for (ulong i = 0; i < count; i++)
+    {
+        ulong hash = Hash(dev, sectors[i]);
+        Shard& shard = GetShard(hash);
+        Buffer* fresh = nullptr;
+
+        for (;;)
+        {
+            Stdlib::ListEntry freeList;
+            {
+                Stdlib::AutoLock lock(shard.Lock);
+
+                Buffer* buf = LookupLocked(shard, hash, dev, sectors[i]);
+                if (buf != nullptr && buf->Size != size && buf->Dirty)
+                    break;
+
+                if (buf != nullptr && buf->Size != size)
+                {
+                    UnhashLocked(shard, buf);
+                    if (buf->RefCount == 0)
+                        freeList.InsertTail(&buf->LruLink);
+                    buf = nullptr;
+                }
+
+                if (buf != nullptr)
+                {
+                    buf->RefCount++;
+                    bufs[i] = buf;
+                }
+                else if (fresh != nullptr)
+                {
+                    shard.Prefetched++;
+                    InsertLocked(shard, hash, fresh);
+                    ShrinkLocked(shard, ShardLimit(), freeList);
+                    batch[batchCount++] = fresh->Pending;
+                    bufs[i] = fresh;
+                    fresh = nullptr;
+                }
+            }
+            FreeList(freeList);
+
+            if (bufs[i] != nullptr)
+                break;
+
+            fresh = AllocBuffer(dev, sectors[i], size);
+            if (fresh == nullptr)
+                break;
+
+            BlockRequest* req = new (Mm::NoThrow) BlockRequest();
+            if (req == nullptr)
+            {
+                FreeBuffer(fresh);
+                fresh = nullptr;
+                break;
+            }
+            req->RequestType = BlockRequest::Read;
+            req->Sector = sectors[i];
+            req->SectorCount = size / sectorSize;
+            req->Buffer = fresh->Data;
+            fresh->Pending = req;
+        }
+
+        if (fresh != nullptr)
+            FreeBuffer(fresh);
+    }
+
+    if (batchCount != 0)
+        dev->SubmitBatch(batch, batchCount);
+    delete[] batch;
+}
+
+bool BufferCache::Wait(Buffer* buf)
+{
+    Shard& shard = GetShard(Hash(buf->Dev, buf->Sector));
+
+    for (;;)
+    {
+        BlockRequest* req = nullptr;
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+            if (buf->BufState != Buffer::Loading)
+                return buf->BufState == Buffer::Valid;
+
+            if (buf->Pending != nullptr && !buf->Finishing)
+            {
+                buf->Finishing = true;
+                req = buf->Pending;
+            }
+        }
+
+        /* A synchronous load, or another task already reaps the request */
+        if (req == nullptr)
+        {
+            Schedule();
+            continue;
+        }
+
+        buf->Dev->WaitRequest(*req);
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+            buf->BufState = req->Success ? Buffer::Valid : Buffer::Error;
+            if (!req->Success)
+                UnhashLocked(shard, buf);
+            buf->Pending = nullptr;
+            buf->Finishing = false;
+        }
+        delete req;
+    }
+}
+
+bool BufferCache::Read(BlockDevice* dev, u64 sector, u32 size, void* dst)
+{
+    Buffer* buf = Get(dev, sector, size);
+    if (buf != nullptr)
+    {
+        Stdlib::MemCpy(dst, buf->Data, size);
+        Put(buf);
+        return true;
+    }
+
+    if (dev == nullptr || dev->GetSectorSize() == 0)
+        return false;
+
+    return dev->ReadSectors(sector, dst, size / (u32)dev->GetSectorSize());
+}
+
+void BufferCache::Update(BlockDevice* dev, u64 sector, u32 size, const void* data)
+{
+    if (dev == nullptr || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return;
+
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+    Stdlib::ListEntry freeList;
+
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+
+        Buffer* buf = LookupLocked(shard, hash, dev, sector);
+        if (buf != nullptr)
+        {
+            if (buf->BufState == Buffer::Valid && buf->Size == size)
+            {
+                Stdlib::MemCpy(buf->Data, data, size);
+                TouchLocked(shard, buf);
+                return;
+            }
+
+            /* Dirty under another block size: never unhash dirty data */
+            if (buf->Dirty)
+                return;
+
+            /* A load in flight may return pre-write data to its own
+               waiters; unhash it so nobody else sees it. */
+            UnhashLocked(shard, buf);
+            if (buf->RefCount == 0)
+                freeList.InsertTail(&buf->LruLink);
+        }
+    }
+    FreeList(freeList);
+
+    Buffer* fresh = AllocBuffer(dev, sector, size);
+    if (fresh == nullptr)
+        return;
+
+    Stdlib::MemCpy(fresh->Data, data, size);
+    fresh->BufState = Buffer::Valid;
+    fresh->RefCount = 0;
+
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+
+        Buffer* buf = LookupLocked(shard, hash, dev, sector);
+        if (buf != nullptr && buf->Dirty)
+        {
+            freeList.InsertTail(&fresh->LruLink);
+            fresh = nullptr;
+        }
+        else if (buf != nullptr)
+        {
+            UnhashLocked(shard, buf);
+            if (buf->RefCount == 0)
+                freeList.InsertTail(&buf->LruLink);
+        }
+
+        if (fresh != nullptr)
+        {
+            InsertLocked(shard, hash, fresh);
+            ShrinkLocked(shard, ShardLimit(), freeList);
+        }
+    }
+    FreeList(freeList);
+}
+
+bool BufferCache::ReadCached(BlockDevice* dev, u64 sector, u32 size, void* dst)
+{
+    if (dev == nullptr || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return false;
+
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+
+    Stdlib::AutoLock lock(shard.Lock);
+
+    Buffer* buf = LookupLocked(shard, hash, dev, sector);
+    if (buf == nullptr || buf->BufState != Buffer::Valid || buf->Size != size)
+        return false;
+
+    Stdlib::MemCpy(dst, buf->Data, size);
+    shard.Hits++;
+    TouchLocked(shard, buf);
+    return true;
+}
+
+void BufferCache::Fill(BlockDevice* dev, u64 sector, u32 size, const void* data)
+{
+    if (dev == nullptr || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return;
+
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+        if (LookupLocked(shard, hash, dev, sector) != nullptr)
+            return;
+    }
+
+    Buffer* fresh = AllocBuffer(dev, sector, size);
+    if (fresh == nullptr)
+        return;
+
+    Stdlib::MemCpy(fresh->Data, data, size);
+    fresh->BufState = Buffer::Valid;
+    fresh->RefCount = 0;
+
+    Stdlib::ListEntry freeList;
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+
+        /* Inserted meanwhile: that copy is at least as new */
+        if (LookupLocked(shard, hash, dev, sector) != nullptr)
+        {
+            freeList.InsertTail(&fresh->LruLink);
+        }
+        else
+        {
+            shard.Misses++;
+            InsertLocked(shard, hash, fresh);
+            ShrinkLocked(shard, ShardLimit(), freeList);
+        }
+    }
+    FreeList(freeList);
+}
+
+void BufferCache::Forget(BlockDevice* dev, u64 sector)
+{
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+    Buffer* victim = nullptr;
+
+    {
+        Stdlib::AutoLock lock(shard.Lock);
+
+        Buffer* buf = LookupLocked(shard, hash, dev, sector);
+        if (buf == nullptr || buf->Dirty)
+            return;
+
+        UnhashLocked(shard, buf);
+        if (buf->RefCount == 0)
+            victim = buf;
+    }
+
+    if (victim != nullptr)
+        FreeBuffer(victim);
+}
+
+void BufferCache::ForgetRange(BlockDevice* dev, u64 sector, u64 count, u32 step)
+{
+    if (count == 0 || step == 0)
+        return;
+
+    /* Per-block lookups unless the range has more blocks than the cache */
+    if (count / step <= GetCachedBytes() / Const::PageSize)
+    {
+        for (u64 off = 0; off < count; off += step)
+            Forget(dev, sector + off);
+        return;
+    }
+
+    DropRange(dev, sector, count);
+}
+
+void BufferCache::DropRange(BlockDevice* dev, u64 sector, u64 count)
+{
+    for (ulong i = 0; i < ShardCount; i++)
+    {
+        Shard& shard = Shards[i];
+        Stdlib::ListEntry freeList;
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+
+            Stdlib::ListEntry* lists[2] = { &shard.Probation, &shard.Protected };
+            for (ulong j = 0; j < 2; j++)
+            {
+                Stdlib::ListEntry* head = lists[j];
+                Stdlib::ListEntry* entry = head->Flink;
+                while (entry != head)
+                {
+                    Buffer* buf = CONTAINING_RECORD(entry, Buffer, LruLink);
+                    entry = entry->Flink;
+                    if ((dev != nullptr && buf->Dev != dev) || buf->Dirty)
+                        continue;
+                    if (buf->Sector < sector || buf->Sector - sector >= count)
+                        continue;
+
+                    UnhashLocked(shard, buf);
+                    if (buf->RefCount == 0)
+                        freeList.InsertTail(&buf->LruLink);
+                }
+            }
+        }
+        FreeList(freeList);
+    }
+}
+
+void BufferCache::Invalidate(BlockDevice* dev)
+{
+    /* Dirty blocks are written back, not dropped */
+    Sync(dev);
+
+    DropRange(dev, 0, ~0ULL);
+}
+
+BufferCache::DeviceState* BufferCache::GetDeviceStateLocked(BlockDevice* dev, bool create)
+{
+    for (ulong i = 0; i < DeviceCount; i++)
+    {
+        if (Devices[i].Dev == dev)
+            return &Devices[i];
+    }
+
+    if (!create || DeviceCount >= MaxDevices)
+        return nullptr;
+
+    DeviceState* state = &Devices[DeviceCount++];
+    state->Dev = dev;
+    return state;
+}
+
+BufferCache::DeviceState* BufferCache::GetDeviceState(BlockDevice* dev, bool create)
+{
+    Stdlib::AutoLock lock(DirtyLock);
+    return GetDeviceStateLocked(dev, create);
+}
+
+bool BufferCache::MarkDirtyLocked(Buffer* buf)
+{
+    if (buf->Dirty)
+        return true;
+
+    Stdlib::AutoLock lock(DirtyLock);
+
+    DeviceState* state = GetDeviceStateLocked(buf->Dev, true);
+    if (state == nullptr)
+        return false;
+
+    buf->Dirty = true;
+    buf->DirtyTime = GetBootTime().GetValue();
+    buf->RefCount++;
+    state->DirtyList.InsertTail(&buf->DirtyLink);
+    state->DirtyCount++;
+    DirtyTotal++;
+    return true;
+}
+
+bool BufferCache::WriteDirty(BlockDevice* dev, u64 sector, u32 size, const void* data)
+{
+    if (dev == nullptr || size == 0 || size > Const::PageSize || BudgetPages == 0)
+        return false;
+
+    ulong hash = Hash(dev, sector);
+    Shard& shard = GetShard(hash);
+    Buffer* fresh = nullptr;
+    bool dirtied = false;
+
+    for (;;)
+    {
+        Stdlib::ListEntry freeList;
+        Buffer* loading = nullptr;
+        bool mismatch = false;
+        bool done = false;
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+
+            Buffer* buf = LookupLocked(shard, hash, dev, sector);
+            if (buf != nullptr && buf->Size != size && !buf->Dirty)
+            {
+                UnhashLocked(shard, buf);
+                if (buf->RefCount == 0)
+                    freeList.InsertTail(&buf->LruLink);
+                buf = nullptr;
+            }
+
+            if (buf != nullptr && buf->Size != size)
+            {
+                mismatch = true;
+            }
+            else if (buf != nullptr && buf->BufState == Buffer::Loading)
+            {
+                /* Let the read land first, it would overwrite our data */
+                buf->RefCount++;
+                loading = buf;
+            }
+            else if (buf != nullptr)
+            {
+                Stdlib::MemCpy(buf->Data, data, size);
+                TouchLocked(shard, buf);
+                dirtied = MarkDirtyLocked(buf);
+                done = true;
+            }
+            else if (fresh != nullptr)
+            {
+                InsertLocked(shard, hash, fresh);
+                dirtied = MarkDirtyLocked(fresh);
+                ShrinkLocked(shard, ShardLimit(), freeList);
+                fresh = nullptr;
+                done = true;
+            }
+        }
+        FreeList(freeList);
+
+        if (done)
+            break;
+
+        if (mismatch)
+        {
+            /* Same start sector dirty under another block size */
+            if (!Sync(dev))
+                break;
+            continue;
+        }
+
+        if (loading != nullptr)
+        {
+            Wait(loading);
+            Put(loading);
+            continue;
+        }
+
+        fresh = AllocBuffer(dev, sector, size);
+        if (fresh == nullptr)
+            break;
+
+        Stdlib::MemCpy(fresh->Data, data, size);
+        fresh->BufState = Buffer::Valid;
+        fresh->RefCount = 0;
+    }
+
+    if (fresh != nullptr)
+        FreeBuffer(fresh);
+
+    if (!dirtied)
+        return false;
+
+    DeviceState* state = GetDeviceState(dev, false);
+    if (state == nullptr)
+        return true;
+
+    if (state->Flusher == nullptr)
+        StartFlusher(state);
+
+    /* Throttle: past the hard limit the writer cleans up after itself */
+    if (state->DirtyCount > BudgetPages / 2)
+    {
+        ulong errors = 0;
+        state->WritebackMutex.Lock();
+        WritebackLocked(*state, false, errors);
+        state->WritebackMutex.Unlock();
+    }
+    return true;
+}
+
+ulong BufferCache::WritebackLocked(DeviceState& state, bool all, ulong& errors)
+{
+    Buffer* batch[WritebackBatch];
+    ulong count = 0;
+    u64 now = GetBootTime().GetValue();
+
+    {
+        Stdlib::AutoLock lock(DirtyLock);
+
+        bool over = state.DirtyCount > BudgetPages / 8;
+        for (Stdlib::ListEntry* entry = state.DirtyList.Flink;
+             entry != &state.DirtyList && count < WritebackBatch;
+             entry = entry->Flink)
+        {
+            Buffer* buf = CONTAINING_RECORD(entry, Buffer, DirtyLink);
+            if (!all && !over && now - buf->DirtyTime < DirtyExpireNs)
+                break;  /* oldest first: the rest are younger */
+
+            batch[count++] = buf;
+            if (over && state.DirtyCount - count <= BudgetPages / 8)
+                over = false;
+        }
+    }
+
+    if (count == 0)
+        return 0;
+
+    /* Sector order so the device queue merges neighbours */
+    for (ulong i = 1; i < count; i++)
+    {
+        Buffer* buf = batch[i];
+        ulong j = i;
+        while (j > 0 && batch[j - 1]->Sector > buf->Sector)
+        {
+            batch[j] = batch[j - 1];
+            j--;
+        }
+        batch[j] = buf;
+    }
+
+    /* Clean before the write: a writer dirtying the block again while
+       it is in flight puts it back on the list with its own reference.
+       The dirty reference moves to us. */
+    for (ulong i = 0; i < count; i++)
+    {
+        Buffer* buf = batch[i];
+        Shard& shard = GetShard(Hash(buf->Dev, buf->Sector));
+        Stdlib::AutoLock lock(shard.Lock);
+        Stdlib::AutoLock dirtyLock(DirtyLock);
+        buf->Dirty = false;
+        buf->DirtyLink.RemoveInit();
+        state.DirtyCount--;
+        DirtyTotal--;
+    }
+
+    BlockDevice* dev = state.Dev;
+    u32 sectorSize = (u32)dev->GetSectorSize();
+    BlockRequest* reqs = new (Mm::NoThrow) BlockRequest[count];
+    BlockRequest* ptrs[WritebackBatch];
+    if (reqs != nullptr)
+    {
+        for (ulong i = 0; i < count; i++)
+        {
+            reqs[i].RequestType = BlockRequest::Write;
+            reqs[i].Sector = batch[i]->Sector;
+            reqs[i].SectorCount = batch[i]->Size / sectorSize;
+            reqs[i].Buffer = batch[i]->Data;
+            ptrs[i] = &reqs[i];
+        }
+
+        dev->SubmitBatch(ptrs, count);
+        for (ulong i = 0; i < count; i++)
+            dev->WaitRequest(reqs[i]);
+    }
+
+    ulong failed = 0;
+    for (ulong i = 0; i < count; i++)
+    {
+        Buffer* buf = batch[i];
+        if (reqs != nullptr && reqs[i].Success)
+        {
+            Put(buf);
+            continue;
+        }
+
+        /* Keep it dirty for the next round */
+        failed++;
+        bool drop = false;
+        {
+            Shard& shard = GetShard(Hash(buf->Dev, buf->Sector));
+            Stdlib::AutoLock lock(shard.Lock);
+            Stdlib::AutoLock dirtyLock(DirtyLock);
+            if (buf->Dirty)
+            {
+                drop = true;
+            }
+            else
+            {
+                buf->Dirty = true;
+                state.DirtyList.InsertHead(&buf->DirtyLink);
+                state.DirtyCount++;
+                DirtyTotal++;
+            }
+        }
+        if (drop)
+            Put(buf);
+    }
+    delete[] reqs;
+
+    state.Written += count - failed;
+    state.WriteErrors += failed;
+    if (failed != 0)
+        Trace(0, "BufferCache: %s writeback failed for %u of %u blocks",
+              dev->GetName(), failed, count);
+
+    errors += failed;
+    return count;
+}
+
+bool BufferCache::SyncDevice(DeviceState& state)
+{
+    ulong errors = 0;
+
+    state.WritebackMutex.Lock();
+    while (state.DirtyCount != 0 && errors == 0)
+    {
+        if (WritebackLocked(state, true, errors) == 0)
+            break;
+    }
+    state.WritebackMutex.Unlock();
+
+    if (!state.Dev->Flush())
+        errors++;
+    return errors == 0;
+}
+
+bool BufferCache::Sync(BlockDevice* dev)
+{
+    if (dev != nullptr)
+    {
+        DeviceState* state = GetDeviceState(dev, false);
+        if (state == nullptr)
+            return dev->Flush();
+        return SyncDevice(*state);
+    }
+
+    bool ok = true;
+    ulong count;
+    {
+        Stdlib::AutoLock lock(DirtyLock);
+        count = DeviceCount;
+    }
+    for (ulong i = 0; i < count; i++)
+    {
+        if (!SyncDevice(Devices[i]))
+            ok = false;
+    }
+    return ok;
+}
+
+void BufferCache::StartFlusher(DeviceState* state)
+{
+    {
+        Stdlib::AutoLock lock(DirtyLock);
+        if (state->Flusher != nullptr || state->FlusherStarting)
+            return;
+        state->FlusherStarting = true;
+    }
+
+    /* Periodic writeback yields to interactive I/O under QoS */
+    Task* task = Mm::TAlloc<Task, Tag>("flush/%s", state->Dev->GetName());
+    if (task != nullptr)
+        task->IoClass = BlockRequest::ClassBackground;
+    if (task != nullptr && !task->Start(&BufferCache::FlusherFunc, state))
+    {
+        task->Put();
+        task = nullptr;
+    }
+
+    Stdlib::AutoLock lock(DirtyLock);
+    state->Flusher = task;
+    state->FlusherStarting = false;
+    if (task == nullptr)
+        Trace(0, "BufferCache: failed to start flusher for %s", state->Dev->GetName());
+}
+
+void BufferCache::FlusherFunc(void* ctx)
+{
+    BufferCache::GetInstance().RunFlusher(static_cast<DeviceState*>(ctx));
+}
+
+void BufferCache::RunFlusher(DeviceState* state)
+{
+    auto* task = Task::GetCurrentTask();
+
+    while (!task->IsStopping())
+    {
+        Sleep(FlushIntervalNs);
+
+        if (state->DirtyCount == 0)
+            continue;
+
+        ulong errors = 0;
+        state->WritebackMutex.Lock();
+        while (WritebackLocked(*state, false, errors) == WritebackBatch && errors == 0)
+        {
+        }
+        state->WritebackMutex.Unlock();
+    }
+}
+
+bool BufferCache::IsWriteback()
+{
+    return Writeback;
+}
+
+void BufferCache::SetWriteback(bool on)
+{
+    Writeback = on;
+    if (!on)
+        Sync(nullptr);
+}
+
+ulong BufferCache::GetDirtyBytes()
+{
+    Stdlib::AutoLock lock(DirtyLock);
+    return DirtyTotal * Const::PageSize;
+}
+
+void BufferCache::SetBudget(ulong bytes)
+{
+    BudgetPages = bytes / Const::PageSize;
+
+    ulong limit = ShardLimit();
+    for (ulong i = 0; i < ShardCount; i++)
+    {
+        Shard& shard = Shards[i];
+        Stdlib::ListEntry freeList;
+        {
+            Stdlib::AutoLock lock(shard.Lock);
+            ShrinkLocked(shard, limit, freeList);
+        }
+        FreeList(freeList);
+    }
+}
+
+ulong BufferCache::GetBudget()
+{
+    return BudgetPages * Const::PageSize;
+}
+
+ulong BufferCache::GetCachedBytes()
+{
+    ulong count = 0;
+    for (ulong i = 0; i < ShardCount; i++)
+    {
+        Stdlib::AutoLock lock(Shards[i].Lock);
+        count += Shards[i].Count;
+    }
+    return count * Const::PageSize;
+}
+
+void BufferCache::Dump(Stdlib::Printer& printer)
+{
+    ulong count = 0, prot = 0, hits = 0, misses = 0, evictions = 0, prefetched = 0;
+    for (ulong i = 0; i < ShardCount; i++)
+    {
+        Shard& shard = Shards[i];
+        Stdlib::AutoLock lock(shard.Lock);
+        count += shard.Count;
+        prot += shard.ProtectedCount;
+        hits += shard.Hits;
+        misses += shard.Misses;
+        evictions += shard.Evictions;
+        prefetched += shard.Prefetched;
+    }
+
+    ulong lookups = hits + misses;
+    ulong ratio = (lookups != 0) ? (hits * 100) / lookups : 0;
+
+    printer.Printf("budget %u KB cached %u KB (%u buffers, %u protected)\n",
+        GetBudget() / Const::KB, (count * Const::PageSize) / Const::KB, count, prot);
+    printer.Printf("hits %u misses %u evictions %u hit ratio %u%% prefetched %u\n",
+        hits, misses, evictions, ratio, prefetched);
+
+    printer.Printf("%s, dirty %u KB\n", Writeback ? "write-back" : "write-through",
+        GetDirtyBytes() / Const::KB);
+
+    Stdlib::AutoLock lock(DirtyLock);
+    for (ulong i = 0; i < DeviceCount; i++)
+    {
+        DeviceState& state = Devices[i];
+        printer.Printf("  %s: dirty %u written %u errors %u\n",
+            state.Dev->GetName(), state.DirtyCount, state.Written, state.WriteErrors);
+    }
+}
+
+}
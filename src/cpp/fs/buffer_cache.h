@@ -0,0 +1,234 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <block/block_device.h>
+#include <block/block_request.h>
+#include <kernel/spin_lock.h>
+#include <kernel/mutex.h>
+#include <lib/list_entry.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+class Task;
+
+/* Unified block buffer cache shared by all disk file systems.
+
+   Buffers are keyed by (device, first sector) and hold one file system
+   block of up to a page.  The index is split into shards, each with its
+   own lock, hash chains and replacement lists, so lookups on different
+   blocks rarely contend.
+
+   Replacement is segmented LRU: a block enters the probation segment on
+   its first use and moves to the protected segment when referenced
+   again.  Eviction takes unreferenced buffers from the probation tail
+   first, so a single large sequential scan only cycles through
+   probation and does not flush the hot metadata kept in protected.
+   The protected segment is capped at 3/4 of a shard; its overflow is
+   demoted back to probation.
+
+   By default the cache is write-through: writers go to the device first
+   and then refresh the cached copy (BlockIo does this).  In write-back
+   mode writes only dirty the cached copy.  Each dirty buffer holds a
+   reference, so it cannot be evicted, and sits on its device's dirty
+   list, oldest first.  A per-device flusher task writes dirty buffers
+   back in sector-sorted batches once they are DirtyExpireNs old or the
+   device has more than a background share of the budget dirty; writers
+   past the hard limit write back synchronously.  Sync() is the
+   durability point.  Write-back gives up the write ordering the file
+   systems rely on for crash consistency between Sync() calls.
+
+   Only writeback clears Dirty, under the device's WritebackMutex.  Lock
+   order: shard lock, then DirtyLock. */
+class BufferCache
+{
+public:
+    static BufferCache& GetInstance()
+    {
+        static BufferCache Instance;
+        return Instance;
+    }
+
+    struct Buffer
+    {
+        enum State : u8 { Loading, Valid, Error };
+
+        Stdlib::ListEntry HashLink;
+        Stdlib::ListEntry LruLink;
+        BlockDevice* Dev;
+        u64 Sector;
+        u32 Size;
+        volatile State BufState;
+        bool Protected;
+        bool Hashed;
+        bool Finishing;         /* a task is waiting on Pending */
+        bool Dirty;             /* newer than the disk, holds a reference */
+        u64 DirtyTime;          /* boot time ns it became dirty */
+        Stdlib::ListEntry DirtyLink;
+        ulong RefCount;         /* under the shard lock */
+        BlockRequest* Pending;  /* async read in flight (Loading) */
+        u8* Data;               /* page-aligned, Size bytes valid */
+    };
+
+    /* Referenced buffer holding size bytes at sector, read from the
+       device on a miss.  nullptr on I/O error or when the block cannot
+       be cached (size above a page, cache disabled, no memory). */
+    Buffer* Get(BlockDevice* dev, u64 sector, u32 size);
+    void Put(Buffer* buf);
+
+    /* Start asynchronous reads for the blocks at sectors[0..count) that
+       are not cached yet, submitted as one batch so the device queue can
+       merge adjacent ones.  bufs[i] receives a referenced buffer, or
+       nullptr if it could not be allocated; it may still be Loading, so
+       Wait() before touching Data.  Prefetched blocks enter probation
+       and are not promoted: readahead is not reuse. */
+    void Prefetch(BlockDevice* dev, const u64* sectors, ulong count, u32 size, Buffer** bufs);
+
+    /* Wait until buf has left the Loading state; true if it is Valid. */
+    bool Wait(Buffer* buf);
+
+    /* Get + copy out + Put; falls back to a direct device read if the
+       block cannot be cached. */
+    bool Read(BlockDevice* dev, u64 sector, u32 size, void* dst);
+
+    /* data was just written to the device at sector: refresh or insert
+       the cached copy. */
+    void Update(BlockDevice* dev, u64 sector, u32 size, const void* data);
+
+    /* Copy the cached block at sector into dst if it is cached and
+       Valid (dirty or not); false otherwise.  Never reads the device. */
+    bool ReadCached(BlockDevice* dev, u64 sector, u32 size, void* dst);
+
+    /* data was just read from the device at sector outside the cache:
+       insert it unless the block is cached already. */
+    void Fill(BlockDevice* dev, u64 sector, u32 size, const void* data);
+
+    /* Drop the cached copy of one block (e.g. after a failed write). */
+    void Forget(BlockDevice* dev, u64 sector);
+
+    /* Drop the cached blocks of dev starting in [sector, sector + count),
+       blocks being step sectors apart, e.g. after a discard.  Dirty
+       blocks are kept and written back as usual. */
+    void ForgetRange(BlockDevice* dev, u64 sector, u64 count, u32 step);
+
+    /* Drop every block of dev, or of all devices if dev is nullptr.
+       Buffers still referenced are unhashed and freed on their last Put. */
+    void Invalidate(BlockDevice* dev);
+
+    /* Write-back: copy data into the cached block and mark it dirty.
+       false if the block cannot be cached; the caller then writes
+       through. */
+    bool WriteDirty(BlockDevice* dev, u64 sector, u32 size, const void* data);
+
+    /* Write back every dirty block of dev (all devices if nullptr) and
+       flush the device cache.  false on any write error. */
+    bool Sync(BlockDevice* dev);
+
+    bool IsWriteback();
+
+    /* Switching back to write-through syncs all dirty blocks first. */
+    void SetWriteback(bool on);
+
+    ulong GetDirtyBytes();
+
+    /* Memory budget in bytes; 0 disables caching. */
+    void SetBudget(ulong bytes);
+    ulong GetBudget();
+    ulong GetCachedBytes();
+
+    void Dump(Stdlib::Printer& printer);
+
+    static const ulong ShardCount = 16;
+    static const ulong BucketsPerShard = 512;
+    static const ulong Tag = 'BCac';
+    static const ulong MaxDevices = 16;
+    static const ulong WritebackBatch = 64;
+    static const ulong FlushIntervalNs = 100 * Const::NanoSecsInMs;
+    static const ulong DirtyExpireNs = 2000 * Const::NanoSecsInMs;
+
+private:
+    BufferCache();
+    ~BufferCache();
+    BufferCache(const BufferCache& other) = delete;
+    BufferCache(BufferCache&& other) = delete;
+    BufferCache& operator=(const BufferCache& other) = delete;
+    BufferCache& operator=(BufferCache&& other) = delete;
+
+    struct Shard
+    {
+        SpinLock Lock;
+        Stdlib::ListEntry Buckets[BucketsPerShard];
+        Stdlib::ListEntry Probation;
+        Stdlib::ListEntry Protected;
+        ulong Count;
+        ulong ProtectedCount;
+        ulong Hits;
+        ulong Misses;
+        ulong Evictions;
+        ulong Prefetched;
+    };
+
+    struct DeviceState
+    {
+        BlockDevice* Dev;
+        Stdlib::ListEntry DirtyList;    /* oldest first, under DirtyLock */
+        ulong DirtyCount;
+        Mutex WritebackMutex;
+        Task* Flusher;
+        bool FlusherStarting;
+        ulong Written;
+        ulong WriteErrors;
+    };
+
+    static ulong Hash(BlockDevice* dev, u64 sector);
+    Shard& GetShard(ulong hash);
+    Stdlib::ListEntry& GetBucket(Shard& shard, ulong hash);
+
+    Buffer* LookupLocked(Shard& shard, ulong hash, BlockDevice* dev, u64 sector);
+    void TouchLocked(Shard& shard, Buffer* buf);
+    void InsertLocked(Shard& shard, ulong hash, Buffer* buf);
+    void UnhashLocked(Shard& shard, Buffer* buf);
+
+    /* Unhash the clean buffers of dev (any device if nullptr) starting in
+       [sector, sector + count), scanning every shard. */
+    void DropRange(BlockDevice* dev, u64 sector, u64 count);
+
+    /* Unhash unreferenced buffers until the shard fits limit; victims
+       are moved to freeList and freed by the caller without the lock. */
+    void ShrinkLocked(Shard& shard, ulong limit, Stdlib::ListEntry& freeList);
+
+    Buffer* AllocBuffer(BlockDevice* dev, u64 sector, u32 size);
+    void FreeBuffer(Buffer* buf);
+    void FreeList(Stdlib::ListEntry& freeList);
+    ulong ShardLimit();
+
+    DeviceState* GetDeviceState(BlockDevice* dev, bool create);
+    DeviceState* GetDeviceStateLocked(BlockDevice* dev, bool create);
+
+    /* Mark buf dirty (shard lock held); false if the device table is full. */
+    bool MarkDirtyLocked(Buffer* buf);
+
+    /* Write back up to WritebackBatch dirty buffers of state: expired ones,
+       or the oldest while over the background limit, or any if all is
+       set.  Caller holds state.WritebackMutex.  Returns the number of
+       buffers written, errors counted in errors. */
+    ulong WritebackLocked(DeviceState& state, bool all, ulong& errors);
+    bool SyncDevice(DeviceState& state);
+
+    void StartFlusher(DeviceState* state);
+    static void FlusherFunc(void* ctx);
+    void RunFlusher(DeviceState* state);
+
+    Shard Shards[ShardCount];
+    volatile ulong BudgetPages;
+
+    SpinLock DirtyLock;
+    DeviceState Devices[MaxDevices];
+    ulong DeviceCount;
+    ulong DirtyTotal;
+    volatile bool Writeback;
+};
+
+}
@@ -0,0 +1,174 @@
+#include "dentry_cache.h"
+#include "vnode.h"
+
+#include <lib/stdlib.h>
+
+namespace Kernel
+{
+
+DentryCache::DentryCache()
+    : NextId(0)
+    , Enabled(true)
+{
+    for (ulong i = 0; i < BucketCount; i++)
+    {
+        Buckets[i].Clock = 0;
+        Stdlib::MemSet(Buckets[i].Entries, 0, sizeof(Buckets[i].Entries));
+    }
+}
+
+DentryCache::~DentryCache()
+{
+}
+
+/* FNV-1a */
+u32 DentryCache::Hash(const char* name)
+{
+    u32 hash = 2166136261;
+    for (const char* p = name; *p != '\0'; p++)
+    {
+        hash ^= (u8)*p;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* The names of one directory spread over the table, and so do the
+   directories holding the same name */
+DentryCache::Bucket& DentryCache::GetBucket(u64 dirId, u32 hash)
+{
+    u64 mix = (dirId * 0x9E3779B97F4A7C15ULL) >> 32;
+    return Buckets[(hash ^ (u32)mix) & (BucketCount - 1)];
+}
+
+/* Inserts into one dir may race here; the loser's entry goes under an
+   id nobody looks up and ages out */
+u64 DentryCache::GetId(VNode* dir)
+{
+    if (dir->DentryId == 0)
+    {
+        long id;
+        do
+        {
+            id = NextId.Get() + 1;
+        } while (NextId.Cmpxchg(id, id - 1) != id - 1);
+        dir->DentryId = (u64)id;
+    }
+    return dir->DentryId;
+}
+
+bool DentryCache::Find(VNode* dir, const char* name, VNode*& child)
+{
+    u64 id = dir->DentryId;
+    if (!Enabled || id == 0)
+        return false;
+
+    u32 hash = Hash(name);
+    Bucket& bucket = GetBucket(id, hash);
+    for (;;)
+    {
+        long seq = bucket.Seq.ReadBegin();
+        Entry* found = nullptr;
+        VNode* node = nullptr;
+        for (ulong i = 0; i < Ways; i++)
+        {
+            Entry& e = bucket.Entries[i];
+            if (e.DirId == id && e.Hash == hash && Stdlib::StrnCmp(e.Name, name, MaxName) == 0)
+            {
+                found = &e;
+                node = e.Child;
+                break;
+            }
+        }
+        if (bucket.Seq.ReadRetry(seq))
+            continue;
+
+        if (found == nullptr)
+            return false;
+        child = node;
+        return true;
+    }
+}
+
+void DentryCache::Insert(VNode* dir, const char* name, VNode* child)
+{
+    if (!Enabled || Stdlib::StrLen(name) >= MaxName)
+        return;
+
+    u64 id = GetId(dir);
+    u32 hash = Hash(name);
+    Bucket& bucket = GetBucket(id, hash);
+
+    ulong flags = bucket.Lock.LockIrqSave();
+    Entry* slot = nullptr;
+    for (ulong i = 0; i < Ways && slot == nullptr; i++)
+    {
+        Entry& e = bucket.Entries[i];
+        if (e.DirId == id && e.Hash == hash && Stdlib::StrCmp(e.Name, name) == 0)
+            slot = &e;
+    }
+    for (ulong i = 0; i < Ways && slot == nullptr; i++)
+    {
+        if (bucket.Entries[i].DirId == 0)
+            slot = &bucket.Entries[i];
+    }
+    if (slot == nullptr)
+        slot = &bucket.Entries[bucket.Clock++ % Ways];
+
+    bucket.Seq.WriteBegin();
+    slot->DirId = id;
+    slot->Child = child;
+    slot->Hash = hash;
+    Stdlib::StrnCpy(slot->Name, name, MaxName);
+    bucket.Seq.WriteEnd();
+    bucket.Lock.UnlockIrqRestore(flags);
+}
+
+void DentryCache::Invalidate(VNode* dir, const char* name)
+{
+    u64 id = dir->DentryId;
+    if (id == 0)
+        return;
+
+    u32 hash = Hash(name);
+    Bucket& bucket = GetBucket(id, hash);
+
+    ulong flags = bucket.Lock.LockIrqSave();
+    for (ulong i = 0; i < Ways; i++)
+    {
+        Entry& e = bucket.Entries[i];
+        if (e.DirId == id && e.Hash == hash && Stdlib::StrCmp(e.Name, name) == 0)
+        {
+            bucket.Seq.WriteBegin();
+            e.DirId = 0;
+            e.Child = nullptr;
+            bucket.Seq.WriteEnd();
+        }
+    }
+    bucket.Lock.UnlockIrqRestore(flags);
+}
+
+void DentryCache::Purge()
+{
+    for (ulong i = 0; i < BucketCount; i++)
+    {
+        Bucket& bucket = Buckets[i];
+        ulong flags = bucket.Lock.LockIrqSave();
+        bucket.Seq.WriteBegin();
+        Stdlib::MemSet(bucket.Entries, 0, sizeof(bucket.Entries));
+        bucket.Seq.WriteEnd();
+        bucket.Lock.UnlockIrqRestore(flags);
+    }
+}
+
+void DentryCache::SetEnabled(bool on)
+{
+    Enabled = on;
+}
+
+bool DentryCache::IsEnabled()
+{
+    return Enabled;
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/raw_spin_lock.h>
+#include <kernel/seq_lock.h>
+
+namespace Kernel
+{
+
+struct VNode;
+
+/* Path component cache for Vfs::ResolvePath: (directory, name) to the
+   child VNode, or to "no such entry" (negative entries), so walking the
+   same paths again, or missing the same names again, skips
+   FileSystem::Lookup.
+
+   A fixed table of buckets of Ways entries each, replaced round robin.
+   Find takes no lock: a bucket's writers bump its sequence count and
+   readers retry when it moved.  Writers take the bucket's spin lock,
+   with preemption off so readers never spin behind a sleeping writer.
+
+   Entries are keyed by VNode::DentryId, handed out when a directory
+   first gets an entry and never reused, so the entries of a freed
+   directory cannot match whatever VNode later takes its memory and need
+   not be hunted down.  DirIndex drops the entry of a name whenever a
+   child of that name is linked into or unlinked from a directory, which
+   covers create, remove and VNodes a VNodeCache evicts.  A VNode Find
+   returns is valid as long as the caller holds dir's VNode lock: those
+   changes take it exclusively. */
+class DentryCache
+{
+public:
+    static DentryCache& GetInstance()
+    {
+        static DentryCache instance;
+        return instance;
+    }
+
+    /* true if name in dir is cached; child receives its VNode, nullptr
+       for a negative entry. */
+    bool Find(VNode* dir, const char* name, VNode*& child);
+
+    /* Cache what looking name up in dir found (nullptr: nothing). */
+    void Insert(VNode* dir, const char* name, VNode* child);
+
+    /* Forget name in dir. */
+    void Invalidate(VNode* dir, const char* name);
+
+    /* Forget everything (unmount). */
+    void Purge();
+
+    /* Off: Find misses and Insert does nothing (benchmarks); Invalidate
+       keeps working, so what is cached stays right. */
+    void SetEnabled(bool on);
+    bool IsEnabled();
+
+    static const ulong BucketCount = 512;
+    static const ulong Ways = 4;
+    static const ulong MaxName = 64;   /* VNode::Name */
+
+private:
+    DentryCache();
+    ~DentryCache();
+    DentryCache(const DentryCache& other) = delete;
+    DentryCache(DentryCache&& other) = delete;
+    DentryCache& operator=(const DentryCache& other) = delete;
+    DentryCache& operator=(DentryCache&& other) = delete;
+
+    struct Entry
+    {
+        u64 DirId;          /* 0: free */
+        VNode* Child;       /* nullptr: negative */
+        u32 Hash;
+        char Name[MaxName];
+    };
+
+    struct Bucket
+    {
+        RawSpinLock Lock;
+        SeqLock Seq;
+        ulong Clock;
+        Entry Entries[Ways];
+    };
+
+    static u32 Hash(const char* name);
+    Bucket& GetBucket(u64 dirId, u32 hash);
+    u64 GetId(VNode* dir);
+
+    Bucket Buckets[BucketCount];
+    Atomic NextId;
+    volatile bool Enabled;
+};
+
+}
@@ -0,0 +1,137 @@
+#include "dir_index.h"
+#include "dentry_cache.h"
+#include "vnode.h"
+
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+DirIndex::DirIndex()
+    : Buckets(nullptr)
+    , BucketCount(0)
+    , Count(0)
+{
+}
+
+DirIndex::~DirIndex()
+{
+    Release();
+}
+
+void DirIndex::Release()
+{
+    if (Buckets != nullptr)
+        Mm::Free(Buckets);
+    Buckets = nullptr;
+    BucketCount = 0;
+    Count = 0;
+}
+
+/* FNV-1a */
+u32 DirIndex::Hash(const char* name)
+{
+    u32 hash = 2166136261;
+    for (const char* p = name; *p != '\0'; p++)
+    {
+        hash ^= (u8)*p;
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+/* Rehash Children into bucketCount buckets; if that allocation fails
+   the old table, or the list walk, stays */
+void DirIndex::Rebuild(VNode* dir, u32 bucketCount)
+{
+    VNode** buckets = static_cast<VNode**>(Mm::Alloc(bucketCount * sizeof(VNode*), 0));
+    if (buckets == nullptr)
+        return;
+    Stdlib::MemSet(buckets, 0, bucketCount * sizeof(VNode*));
+
+    for (Stdlib::ListEntry* e = dir->Children.Flink; e != &dir->Children; e = e->Flink)
+    {
+        VNode* child = CONTAINING_RECORD(e, VNode, SiblingLink);
+        u32 b = Hash(child->Name) & (bucketCount - 1);
+        child->NameNext = buckets[b];
+        buckets[b] = child;
+    }
+
+    if (Buckets != nullptr)
+        Mm::Free(Buckets);
+    Buckets = buckets;
+    BucketCount = bucketCount;
+}
+
+void DirIndex::Link(VNode* dir, VNode* child)
+{
+    DirIndex& index = dir->Index;
+
+    DentryCache::GetInstance().Invalidate(dir, child->Name);
+    child->Parent = dir;
+    dir->Children.InsertTail(&child->SiblingLink);
+    index.Count++;
+
+    if (index.Buckets != nullptr)
+    {
+        u32 b = Hash(child->Name) & (index.BucketCount - 1);
+        child->NameNext = index.Buckets[b];
+        index.Buckets[b] = child;
+    }
+
+    if (index.Buckets == nullptr && index.Count >= MinIndexed)
+        index.Rebuild(dir, 2 * MinIndexed);
+    else if (index.Buckets != nullptr && index.Count > 2 * index.BucketCount)
+        index.Rebuild(dir, 2 * index.BucketCount);
+}
+
+void DirIndex::Unlink(VNode* child)
+{
+    VNode* dir = child->Parent;
+    if (dir != nullptr)
+        DentryCache::GetInstance().Invalidate(dir, child->Name);
+
+    if (dir != nullptr && !child->SiblingLink.IsEmpty())
+    {
+        DirIndex& index = dir->Index;
+        if (index.Buckets != nullptr)
+        {
+            VNode** link = &index.Buckets[Hash(child->Name) & (index.BucketCount - 1)];
+            while (*link != nullptr && *link != child)
+                link = &(*link)->NameNext;
+            if (*link != nullptr)
+                *link = child->NameNext;
+        }
+        if (index.Count != 0)
+            index.Count--;
+    }
+
+    child->NameNext = nullptr;
+    child->SiblingLink.RemoveInit();
+}
+
+VNode* DirIndex::Find(VNode* dir, const char* name)
+{
+    DirIndex& index = dir->Index;
+    if (index.Buckets != nullptr)
+    {
+        for (VNode* child = index.Buckets[Hash(name) & (index.BucketCount - 1)];
+             child != nullptr; child = child->NameNext)
+        {
+            if (Stdlib::StrCmp(child->Name, name) == 0)
+                return child;
+        }
+        return nullptr;
+    }
+
+    for (Stdlib::ListEntry* e = dir->Children.Flink; e != &dir->Children; e = e->Flink)
+    {
+        VNode* child = CONTAINING_RECORD(e, VNode, SiblingLink);
+        if (Stdlib::StrCmp(child->Name, name) == 0)
+            return child;
+    }
+    return nullptr;
+}
+
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Kernel
+{
+
+struct VNode;
+
+/* Name index over a directory's Children, so Lookup does not walk the
+   list: a hash of the child VNodes chained through VNode::NameNext,
+   doubled as entries are added.  Directories of fewer than MinIndexed
+   entries are not indexed, Find walks their list.  An all-zero object
+   is the empty index (file systems clear new VNodes with MemSet).
+
+   Every change to Children goes through Link/Unlink, which also drop
+   the DentryCache entry of the name; a caller emptying the list itself
+   (tearing a subtree down) calls Release after. */
+class DirIndex
+{
+public:
+    DirIndex();
+    ~DirIndex();
+
+    /* Make child a child of dir, indexed under its Name. */
+    static void Link(VNode* dir, VNode* child);
+
+    /* Take child out of its parent's Children. */
+    static void Unlink(VNode* child);
+
+    /* dir's child called name, nullptr if none */
+    static VNode* Find(VNode* dir, const char* name);
+
+    /* Forget all entries. */
+    void Release();
+
+    static const u32 MinIndexed = 16;
+
+private:
+    DirIndex(const DirIndex& other) = delete;
+    DirIndex(DirIndex&& other) = delete;
+    DirIndex& operator=(const DirIndex& other) = delete;
+    DirIndex& operator=(DirIndex&& other) = delete;
+
+    static u32 Hash(const char* name);
+    void Rebuild(VNode* dir, u32 bucketCount);
+
+    VNode** Buckets;    // nullptr: not indexed
+    u32 BucketCount;
+    u32 Count;          // entries in Children
+};
+
+}
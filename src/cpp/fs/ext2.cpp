@@ -10,17 +10,16 @@ namespace Kernel
 
 Ext2Fs::Ext2Fs(BlockDevice* dev)
     : Dev(dev)
+    , Io(dev, 1024)
     , Super(nullptr)
     , GroupDescs(nullptr)
     , BlockSize(0)
     , GroupCount(0)
     , InodeSize(128)
     , RootNode(nullptr)
-    , VNodeCount(0)
     , Mounted(false)
     , TmpBlock(nullptr)
 {
-    Stdlib::MemSet(VNodes, 0, sizeof(VNodes));
 }
 
 Ext2Fs::~Ext2Fs()
@@ -49,16 +48,7 @@ bool Ext2Fs::ReadBlock(u32 blockNum, void* buf)
     if (Dev == nullptr)
         return false;
 
-    u32 sectorsPerBlock = BlockSize / (u32)Dev->GetSectorSize();
-    if (sectorsPerBlock == 0)
-    {
-        Trace(0, "Ext2Fs: block size %u smaller than sector size %u",
-              (ulong)BlockSize, (ulong)Dev->GetSectorSize());
-        return false;
-    }
-
-    u64 startSector = (u64)blockNum * sectorsPerBlock;
-    return Dev->ReadSectors(startSector, buf, sectorsPerBlock);
+    return Io.ReadBlock(blockNum, buf);
 }
 
 bool Ext2Fs::Mount()
@@ -151,6 +141,8 @@ bool Ext2Fs::Mount()
         goto fail;
     }
 
+    Io.SetBlockSize(BlockSize);
+
     InodeSize = 128;
     if (Super->RevLevel >= 1 && Super->InodeSize > 0)
         InodeSize = Super->InodeSize;
@@ -212,13 +204,14 @@ bool Ext2Fs::Mount()
         }
     }
 
-    /* Load root directory (inode 2) */
-    RootNode = LoadDir(Ext2RootInode);
+    /* Root directory (inode 2); directories are read as they are looked up */
+    RootNode = LoadVNode(Ext2RootInode, VNode::TypeDir);
     if (RootNode == nullptr)
     {
         Trace(0, "Ext2Fs: failed to load root directory");
         goto fail;
     }
+    Stdlib::StrnCpy(RootNode->Name, "/", sizeof(RootNode->Name));
 
     Mounted = true;
     Trace(0, "Ext2Fs: mounted %s, %u blocks, %u inodes, blocksize %u",
@@ -249,13 +242,7 @@ void Ext2Fs::Unmount()
     if (!Mounted)
         return;
 
-    /* Vnodes created after the cache filled are linked into the tree but
-       not tracked in VNodes[], so free by walking the tree, not the cache
-       (every vnode is linked into exactly one Children list; see LoadDir). */
-    if (RootNode != nullptr)
-        FreeTree(RootNode);
-    Stdlib::MemSet(VNodes, 0, sizeof(VNodes));
-    VNodeCount = 0;
+    VNodes.Clear();
     RootNode = nullptr;
 
     if (GroupDescs != nullptr)
@@ -395,7 +382,27 @@ bool Ext2Fs::GetBlockNum(Ext2Inode* inode, u32 logicalBlock, u32& physBlock)
 
 /* --- Data read --- */
 
-bool Ext2Fs::ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset)
+class Ext2BlockMapper final : public BlockMapper
+{
+public:
+    Ext2BlockMapper(Ext2Fs* fs, Ext2Inode* inode)
+        : Fs(fs)
+        , Inode(inode)
+    {
+    }
+
+    virtual bool MapBlock(u32 logical, u32& physical) override
+    {
+        return Fs->GetBlockNum(Inode, logical, physical);
+    }
+
+private:
+    Ext2Fs* Fs;
+    Ext2Inode* Inode;
+};
+
+bool Ext2Fs::ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset,
+                           ReadaheadState* ra)
 {
     u32 fileSize = inode->Size;
     if (offset >= fileSize)
@@ -419,33 +426,50 @@ bool Ext2Fs::ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset)
         return false;
     }
 
+    Ext2BlockMapper mapper(this, inode);
+    u32 fileBlocks = (u32)((fileSize + BlockSize - 1) / BlockSize);
+
     while (bytesRead < len)
     {
-        u32 physBlock;
-        if (!GetBlockNum(inode, blockIdx, physBlock))
+        if (ra != nullptr)
         {
-            Trace(0, "Ext2Fs::ReadInodeData: block %u unmappable", (ulong)blockIdx);
-            Mm::Free(readBuf);
-            return false;
+            /* Regular file: sequential reads are prefetched; holes come
+               back zero-filled */
+            if (!ra->Read(Io, mapper, blockIdx, fileBlocks, readBuf))
+            {
+                Trace(0, "Ext2Fs::ReadInodeData: read block %u failed", (ulong)blockIdx);
+                Mm::Free(readBuf);
+                return false;
+            }
         }
-        if (physBlock == 0)
+        else
         {
-            /* Sparse block — fill with zeros */
-            u32 chunk = BlockSize - byteOff;
-            if (chunk > len - bytesRead)
-                chunk = (u32)(len - bytesRead);
-            Stdlib::MemSet(dst + bytesRead, 0, chunk);
-            bytesRead += chunk;
-            byteOff = 0;
-            blockIdx++;
-            continue;
-        }
+            u32 physBlock;
+            if (!GetBlockNum(inode, blockIdx, physBlock))
+            {
+                Trace(0, "Ext2Fs::ReadInodeData: block %u unmappable", (ulong)blockIdx);
+                Mm::Free(readBuf);
+                return false;
+            }
+            if (physBlock == 0)
+            {
+                /* Sparse block — fill with zeros */
+                u32 chunk = BlockSize - byteOff;
+                if (chunk > len - bytesRead)
+                    chunk = (u32)(len - bytesRead);
+                Stdlib::MemSet(dst + bytesRead, 0, chunk);
+                bytesRead += chunk;
+                byteOff = 0;
+                blockIdx++;
+                continue;
+            }
 
-        if (!ReadBlock(physBlock, readBuf))
-        {
-            Trace(0, "Ext2Fs::ReadInodeData: read block %u failed", (ulong)physBlock);
-            Mm::Free(readBuf);
-            return false;
+            if (!ReadBlock(physBlock, readBuf))
+            {
+                Trace(0, "Ext2Fs::ReadInodeData: read block %u failed", (ulong)physBlock);
+                Mm::Free(readBuf);
+                return false;
+            }
         }
 
         u32 chunk = BlockSize - byteOff;
@@ -462,123 +486,77 @@ bool Ext2Fs::ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset)
     return true;
 }
 
-/* --- VNode cache --- */
+/* --- Directory loading --- */
 
-VNode* Ext2Fs::FindVNode(u32 inodeNum)
+/* A VNode for inode inodeNum, children not loaded yet; nullptr if a dir
+   entry's type does not match the inode */
+VNode* Ext2Fs::LoadVNode(u32 inodeNum, VNode::Type type)
 {
-    for (ulong i = 0; i < VNodeCount; i++)
+    Ext2Inode inode;
+    if (!ReadInode(inodeNum, &inode))
     {
-        if (VNodes[i].InodeNum == inodeNum)
-            return VNodes[i].Node;
+        Trace(0, "Ext2Fs::LoadVNode: read inode %u failed", (ulong)inodeNum);
+        if (type == VNode::TypeDir)
+            return nullptr;
+        inode.Size = 0;
     }
-    return nullptr;
-}
-
-/* Depth is bounded by Ext2MaxDirDepth: LoadDir refuses to build a deeper
-   tree, and every vnode sits in exactly one Children list. */
-void Ext2Fs::FreeTree(VNode* node)
-{
-    while (!node->Children.IsEmpty())
+    else if (type == VNode::TypeDir && (inode.Mode & Ext2InodeModeDir) == 0)
     {
-        Stdlib::ListEntry* entry = node->Children.RemoveHead();
-        VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
-        child->SiblingLink.Init();
-        FreeTree(child);
+        Trace(0, "Ext2Fs::LoadVNode: inode %u is not a directory", (ulong)inodeNum);
+        return nullptr;
     }
-    delete node;
-}
-
-void Ext2Fs::FreeVNode(VNode* vnode)
-{
-    if (vnode == nullptr)
-        return;
 
-    for (ulong i = 0; i < VNodeCount; i++)
+    VNode* node = VNodes.Create(inodeNum, type);
+    if (node == nullptr)
     {
-        if (VNodes[i].Node == vnode)
-        {
-            VNodes[i] = VNodes[VNodeCount - 1];
-            VNodeCount--;
-            break;
-        }
+        Trace(0, "Ext2Fs::LoadVNode: alloc vnode failed for inode %u", (ulong)inodeNum);
+        return nullptr;
     }
 
-    vnode->SiblingLink.RemoveInit();
-    delete vnode;
+    Stdlib::StrnCpy(node->Name, "?", sizeof(node->Name));
+    if (type == VNode::TypeFile)
+        node->Size = inode.Size;
+    return node;
 }
 
-/* --- Directory loading --- */
-
-VNode* Ext2Fs::LoadDir(u32 inodeNum, u32 depth)
+/* Parse dir's entries and link a VNode for each.  A dir too deep stays
+   empty; false if its data cannot be read, to be retried by the next
+   caller. */
+bool Ext2Fs::LoadChildren(VNode* dir)
 {
-    VNode* existing = FindVNode(inodeNum);
-    if (existing != nullptr)
-        return existing;
+    if (dir->Loaded)
+        return true;
 
-    /* A crafted image with deeply nested directories must not overflow the
-       32 KB kernel stack (each frame holds two Ext2Inode locals). */
-    if (depth >= Ext2MaxDirDepth)
+    u32 inodeNum = (u32)dir->Capacity;
+    if (VNodeCache::GetDepth(dir) + 1 >= Ext2MaxDirDepth)
     {
-        Trace(0, "Ext2Fs::LoadDir: dir depth limit %u hit at inode %u",
+        Trace(0, "Ext2Fs::LoadChildren: dir depth limit %u hit at inode %u",
               (ulong)Ext2MaxDirDepth, (ulong)inodeNum);
-        return nullptr;
+        VNodes.SetLoaded(dir);
+        return true;
     }
 
     Ext2Inode inode;
     if (!ReadInode(inodeNum, &inode))
     {
-        Trace(0, "Ext2Fs::LoadDir: read inode %u failed", (ulong)inodeNum);
-        return nullptr;
-    }
-
-    if ((inode.Mode & Ext2InodeModeDir) == 0)
-    {
-        Trace(0, "Ext2Fs::LoadDir: inode %u is not a directory", (ulong)inodeNum);
-        return nullptr;
-    }
-
-    VNode* dirNode = new (Mm::NoThrow) VNode();
-    if (dirNode == nullptr)
-    {
-        Trace(0, "Ext2Fs::LoadDir: alloc vnode failed for inode %u", (ulong)inodeNum);
-        return nullptr;
-    }
-
-    Stdlib::MemSet(dirNode, 0, sizeof(VNode));
-    Stdlib::StrnCpy(dirNode->Name, (inodeNum == Ext2RootInode) ? "/" : "?", sizeof(dirNode->Name));
-    dirNode->NodeType = VNode::TypeDir;
-    dirNode->Parent = nullptr;
-    dirNode->Children.Init();
-    dirNode->SiblingLink.Init();
-    dirNode->Data = nullptr;
-    dirNode->Size = 0;
-    dirNode->Capacity = inodeNum;
-
-    if (VNodeCount >= MaxCachedVNodes)
-    {
-        Trace(0, "Ext2Fs::LoadDir: VNode cache full");
-        delete dirNode;
-        return nullptr;
+        Trace(0, "Ext2Fs::LoadChildren: read inode %u failed", (ulong)inodeNum);
+        return false;
     }
 
-    VNodes[VNodeCount].InodeNum = inodeNum;
-    VNodes[VNodeCount].Node = dirNode;
-    VNodeCount++;
-
     /* Read directory data and parse entries */
     u32 dirSize = inode.Size;
     u8* dirBuf = static_cast<u8*>(Mm::Alloc(dirSize < Const::PageSize ? Const::PageSize : dirSize, 0));
     if (dirBuf == nullptr)
     {
-        Trace(0, "Ext2Fs::LoadDir: alloc dir buf failed for inode %u", (ulong)inodeNum);
-        return dirNode;
+        Trace(0, "Ext2Fs::LoadChildren: alloc dir buf failed for inode %u", (ulong)inodeNum);
+        return false;
     }
 
     if (!ReadInodeData(&inode, dirBuf, dirSize, 0))
     {
-        Trace(0, "Ext2Fs::LoadDir: read dir data failed for inode %u", (ulong)inodeNum);
+        Trace(0, "Ext2Fs::LoadChildren: read dir data failed for inode %u", (ulong)inodeNum);
         Mm::Free(dirBuf);
-        return dirNode;
+        return false;
     }
 
     u32 pos = 0;
@@ -589,7 +567,7 @@ VNode* Ext2Fs::LoadDir(u32 inodeNum, u32 depth)
         if (de->RecLen < sizeof(Ext2DirEntry) + de->NameLen ||
             de->RecLen > dirSize - pos)
         {
-            Trace(0, "Ext2Fs::LoadDir: bad dirent at offset %u in inode %u",
+            Trace(0, "Ext2Fs::LoadChildren: bad dirent at offset %u in inode %u",
                   (ulong)pos, (ulong)inodeNum);
             break;
         }
@@ -607,69 +585,28 @@ VNode* Ext2Fs::LoadDir(u32 inodeNum, u32 depth)
                Lookup; skip the entry instead of silently truncating */
             if (!skip && de->NameLen >= sizeof(VNode::Name))
             {
-                Trace(0, "Ext2Fs::LoadDir: name too long (%u) in inode %u, skipped",
+                Trace(0, "Ext2Fs::LoadChildren: name too long (%u) in inode %u, skipped",
                       (ulong)de->NameLen, (ulong)inodeNum);
                 skip = true;
             }
 
-            if (!skip)
+            /* Only a vnode created by this dirent may be named,
+               parented and linked. An inode already in the cache is
+               either linked elsewhere (hard link -- first sighting
+               wins) or is an ancestor of this dir, which are all cached
+               (crafted cyclic image); renaming or re-linking it would
+               corrupt the tree ('..' escaping the mount root, cycles
+               walked forever). */
+            if (!skip && VNodes.Find(de->Inode) == nullptr)
             {
-                bool isDir = (de->FileType == Ext2DirTypeDir);
-
-                /* Only a vnode created by this dirent may be named,
-                   parented and linked. An inode already in the cache is
-                   either linked elsewhere (hard link -- first sighting
-                   wins) or is an ancestor whose LoadDir frame is still on
-                   the stack (crafted cyclic image); renaming or re-linking
-                   it would corrupt the tree ('..' escaping the mount root,
-                   cycles double-freed at Unmount). */
-                VNode* child = nullptr;
-                if (FindVNode(de->Inode) == nullptr)
-                {
-                    if (isDir)
-                    {
-                        child = LoadDir(de->Inode, depth + 1);
-                    }
-                    else
-                    {
-                        child = new (Mm::NoThrow) VNode();
-                        if (child != nullptr)
-                        {
-                            Stdlib::MemSet(child, 0, sizeof(VNode));
-                            child->NodeType = VNode::TypeFile;
-                            child->Parent = nullptr;
-                            child->Children.Init();
-                            child->SiblingLink.Init();
-                            child->Data = nullptr;
-                            child->Capacity = de->Inode;
-
-                            /* Read file inode to get size */
-                            Ext2Inode fileInode;
-                            if (ReadInode(de->Inode, &fileInode))
-                                child->Size = fileInode.Size;
-                            else
-                                child->Size = 0;
-
-                            if (VNodeCount < MaxCachedVNodes)
-                            {
-                                VNodes[VNodeCount].InodeNum = de->Inode;
-                                VNodes[VNodeCount].Node = child;
-                                VNodeCount++;
-                            }
-                        }
-                    }
-                }
-
+                VNode::Type type = (de->FileType == Ext2DirTypeDir) ? VNode::TypeDir : VNode::TypeFile;
+                VNode* child = LoadVNode(de->Inode, type);
                 if (child != nullptr)
                 {
-                    ulong nameLen = de->NameLen;
-                    if (nameLen >= sizeof(child->Name))
-                        nameLen = sizeof(child->Name) - 1;
-                    Stdlib::MemCpy(child->Name, de->Name, nameLen);
-                    child->Name[nameLen] = '\0';
-
-                    child->Parent = dirNode;
-                    dirNode->Children.InsertTail(&child->SiblingLink);
+                    Stdlib::MemCpy(child->Name, de->Name, de->NameLen);
+                    child->Name[de->NameLen] = '\0';
+
+                    DirIndex::Link(dir, child);
                 }
             }
         }
@@ -678,30 +615,72 @@ VNode* Ext2Fs::LoadDir(u32 inodeNum, u32 depth)
     }
 
     Mm::Free(dirBuf);
-    return dirNode;
+    VNodes.SetLoaded(dir);
+    return true;
 }
 
 /* --- FileSystem interface --- */
 
+bool Ext2Fs::LoadDir(VNode* dir)
+{
+    if (dir == nullptr || dir->NodeType != VNode::TypeDir)
+        return false;
+
+    if (dir->Loaded)
+    {
+        VNodes.Touch(dir);
+        return true;
+    }
+
+    VNodes.ShrinkIfLow(dir);
+    return LoadChildren(dir);
+}
+
 VNode* Ext2Fs::Lookup(VNode* dir, const char* name)
 {
     if (dir == nullptr || name == nullptr)
         return nullptr;
 
-    if (dir->NodeType != VNode::TypeDir)
+    if (!LoadDir(dir))
         return nullptr;
 
-    Stdlib::ListEntry* head = &dir->Children;
-    Stdlib::ListEntry* entry = head->Flink;
-    while (entry != head)
+    return DirIndex::Find(dir, name);
+}
+
+bool Ext2Fs::MapExtents(VNode* file, bool write, FileExtentMap& map)
+{
+    /* Read-only driver */
+    if (write || !Mounted || file == nullptr || file->NodeType != VNode::TypeFile)
+        return false;
+
+    u32 inodeNum = (u32)file->Capacity;
+    Ext2Inode inode;
+    if (!ReadInode(inodeNum, &inode))
     {
-        VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
-        if (Stdlib::StrCmp(child->Name, name) == 0)
-            return child;
-        entry = entry->Flink;
+        Trace(0, "Ext2Fs::MapExtents: read inode %u failed", (ulong)inodeNum);
+        return false;
     }
 
-    return nullptr;
+    u32 sectorsPerBlock = Io.GetSectorsPerBlock();
+    u32 fileBlocks = (u32)(((u64)inode.Size + BlockSize - 1) / BlockSize);
+
+    map.Clear();
+    map.SetBlockSectors(sectorsPerBlock);
+    for (u32 i = 0; i < fileBlocks; i++)
+    {
+        /* Block 0 is a hole in a sparse file */
+        u32 phys;
+        if (!GetBlockNum(&inode, i, phys) ||
+            !map.Add((phys != 0) ? Io.GetBlockSector(phys) : FileExtentMap::Hole, sectorsPerBlock))
+        {
+            Trace(0, "Ext2Fs::MapExtents: cannot map block %u of inode %u",
+                  (ulong)i, (ulong)inodeNum);
+            map.Clear();
+            return false;
+        }
+    }
+    map.SetSize(inode.Size);
+    return true;
 }
 
 bool Ext2Fs::Read(VNode* file, void* buf, ulong len, ulong offset)
@@ -720,7 +699,7 @@ bool Ext2Fs::Read(VNode* file, void* buf, ulong len, ulong offset)
         return false;
     }
 
-    return ReadInodeData(&inode, buf, len, offset);
+    return ReadInodeData(&inode, buf, len, offset, &file->Ra);
 }
 
 VNode* Ext2Fs::CreateFile(VNode* dir, const char* name)
@@ -2,6 +2,7 @@
 
 #include <fs/filesystem.h>
 #include <fs/block_io.h>
+#include <fs/vnode_cache.h>
 
 namespace Kernel
 {
@@ -16,7 +17,7 @@ static const u8 Ext2DirTypeDir  = 2;
 
 static const u32 Ext2RootInode = 2;
 
-/* FeatureIncompat bits. FileType is required: LoadDir keys directory
+/* FeatureIncompat bits. FileType is required: LoadChildren keys directory
    detection off the dirent FileType byte, which without this feature is the
    high half of a 16-bit NameLen. Any other incompat bit (ext3 journal
    recovery, ext4 extents/64bit, meta_bg, ...) changes the on-disk format in
@@ -34,7 +35,7 @@ static const u32 Ext2DIndirectBlock = 13;
 
 static const u32 Ext2SuperBlockOffset = 1024;
 
-static const u32 Ext2MaxDirDepth = 32; // recursion cap for LoadDir (32 KB kernel stack)
+static const u32 Ext2MaxDirDepth = 32; // deepest dir populated: bounds recursive walks of the VNode tree
 
 struct Ext2SuperBlock
 {
@@ -136,12 +137,14 @@ public:
     virtual void Unmount() override;
     virtual VNode* GetRoot() override;
     virtual VNode* Lookup(VNode* dir, const char* name) override;
+    virtual bool LoadDir(VNode* dir) override;
     virtual VNode* CreateFile(VNode* dir, const char* name) override;
     virtual VNode* CreateDir(VNode* dir, const char* name) override;
     virtual bool Write(VNode* file, const void* data, ulong len) override;
     virtual bool Read(VNode* file, void* buf, ulong len, ulong offset) override;
     virtual bool Remove(VNode* node) override;
     virtual BlockDevice* GetDevice() override;
+    virtual bool MapExtents(VNode* file, bool write, FileExtentMap& map) override;
 
 private:
     Ext2Fs(const Ext2Fs& other) = delete;
@@ -149,32 +152,25 @@ private:
     Ext2Fs& operator=(const Ext2Fs& other) = delete;
     Ext2Fs& operator=(Ext2Fs&& other) = delete;
 
+    friend class Ext2BlockMapper;
+
     bool ReadInode(u32 inodeNum, Ext2Inode* out);
-    bool ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset);
+    bool ReadInodeData(Ext2Inode* inode, void* buf, ulong len, ulong offset,
+                       ReadaheadState* ra = nullptr);
     bool GetBlockNum(Ext2Inode* inode, u32 logicalBlock, u32& physBlock);
     bool ReadBlock(u32 blockNum, void* buf);
-    VNode* LoadDir(u32 inodeNum, u32 depth = 0);
-    VNode* FindVNode(u32 inodeNum);
-    void   FreeVNode(VNode* vnode);
-    void   FreeTree(VNode* node);
-
-    static const ulong MaxCachedVNodes = 512;
-
-    struct VNodeEntry
-    {
-        u32 InodeNum;
-        VNode* Node;
-    };
+    VNode* LoadVNode(u32 inodeNum, VNode::Type type);
+    bool   LoadChildren(VNode* dir);
 
     BlockDevice* Dev;
+    BlockIo Io;
     Ext2SuperBlock* Super;
     Ext2GroupDesc* GroupDescs;
     u32 BlockSize;
     u32 GroupCount;
     u32 InodeSize;
     VNode* RootNode;
-    VNodeEntry VNodes[MaxCachedVNodes];
-    ulong VNodeCount;
+    VNodeCache VNodes;  // by inode number, dirs populated on first use
     bool Mounted;
     u8* TmpBlock; /* page-aligned temp buffer for block reads */
 };
@@ -0,0 +1,128 @@
+#include "extent_map.h"
+
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+FileExtentMap::FileExtentMap()
+    : Extents(nullptr)
+    , Count(0)
+    , Capacity(0)
+    , Sectors(0)
+    , Size(0)
+    , BlockSectors(0)
+{
+}
+
+FileExtentMap::~FileExtentMap()
+{
+    Clear();
+}
+
+bool FileExtentMap::Add(u64 devSector, u64 sectorCount)
+{
+    if (sectorCount == 0)
+        return true;
+
+    if (Count != 0)
+    {
+        Extent& last = Extents[Count - 1];
+        bool hole = (devSector == Hole);
+        if ((hole && last.DevSector == Hole) ||
+            (!hole && last.DevSector != Hole && last.DevSector + last.SectorCount == devSector))
+        {
+            last.SectorCount += sectorCount;
+            Sectors += sectorCount;
+            return true;
+        }
+    }
+
+    if (Count == Capacity)
+    {
+        ulong capacity = (Capacity != 0) ? 2 * Capacity : 16;
+        Extent* extents = new (Mm::NoThrow) Extent[capacity];
+        if (extents == nullptr)
+            return false;
+
+        if (Count != 0)
+            Stdlib::MemCpy(extents, Extents, Count * sizeof(Extent));
+        delete[] Extents;
+        Extents = extents;
+        Capacity = capacity;
+    }
+
+    Extent& ext = Extents[Count++];
+    ext.FileSector = Sectors;
+    ext.DevSector = devSector;
+    ext.SectorCount = sectorCount;
+    Sectors += sectorCount;
+    return true;
+}
+
+void FileExtentMap::Clear()
+{
+    delete[] Extents;
+    Extents = nullptr;
+    Count = 0;
+    Capacity = 0;
+    Sectors = 0;
+    Size = 0;
+}
+
+const FileExtentMap::Extent* FileExtentMap::Find(u64 fileSector) const
+{
+    if (fileSector >= Sectors)
+        return nullptr;
+
+    /* Last extent starting at or before fileSector */
+    ulong lo = 0;
+    ulong hi = Count;
+    while (hi - lo > 1)
+    {
+        ulong mid = lo + (hi - lo) / 2;
+        if (Extents[mid].FileSector <= fileSector)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return &Extents[lo];
+}
+
+ulong FileExtentMap::GetCount() const
+{
+    return Count;
+}
+
+const FileExtentMap::Extent& FileExtentMap::Get(ulong index) const
+{
+    return Extents[index];
+}
+
+u64 FileExtentMap::GetSectors() const
+{
+    return Sectors;
+}
+
+u64 FileExtentMap::GetSize() const
+{
+    return Size;
+}
+
+void FileExtentMap::SetSize(u64 size)
+{
+    Size = size;
+}
+
+u32 FileExtentMap::GetBlockSectors() const
+{
+    return BlockSectors;
+}
+
+void FileExtentMap::SetBlockSectors(u32 blockSectors)
+{
+    BlockSectors = blockSectors;
+}
+
+}
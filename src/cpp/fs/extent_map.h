@@ -0,0 +1,64 @@
+#pragma once
+
+#include <include/types.h>
+
+namespace Kernel
+{
+
+/* Where the data of a file lives on its file system's device: runs of
+   file sectors that are contiguous on the device, in file order, as
+   built by FileSystem::MapExtents for direct I/O that bypasses the file
+   system (loop devices).  Adjacent runs are merged as they are added.
+   Holes (sparse file blocks) have DevSector == Hole. */
+class FileExtentMap
+{
+public:
+    struct Extent
+    {
+        u64 FileSector;
+        u64 DevSector;
+        u64 SectorCount;
+    };
+
+    static const u64 Hole = ~0ULL;
+
+    FileExtentMap();
+    ~FileExtentMap();
+
+    /* Append sectorCount sectors at devSector (or Hole) to the end of
+       the map; false if out of memory. */
+    bool Add(u64 devSector, u64 sectorCount);
+    void Clear();
+
+    /* Extent holding fileSector, nullptr beyond the end. */
+    const Extent* Find(u64 fileSector) const;
+
+    ulong GetCount() const;
+    const Extent& Get(ulong index) const;
+
+    /* Sectors mapped, and the file size in bytes (at most the mapped
+       sectors; the last block may be partly used). */
+    u64 GetSectors() const;
+    u64 GetSize() const;
+    void SetSize(u64 size);
+
+    /* File system block size in sectors: cached copies of the data are
+       keyed by block. */
+    u32 GetBlockSectors() const;
+    void SetBlockSectors(u32 blockSectors);
+
+private:
+    FileExtentMap(const FileExtentMap& other) = delete;
+    FileExtentMap(FileExtentMap&& other) = delete;
+    FileExtentMap& operator=(const FileExtentMap& other) = delete;
+    FileExtentMap& operator=(FileExtentMap&& other) = delete;
+
+    Extent* Extents;
+    ulong Count;
+    ulong Capacity;
+    u64 Sectors;
+    u64 Size;
+    u32 BlockSectors;
+};
+
+}
@@ -0,0 +1,38 @@
+#include "file.h"
+#include "vfs.h"
+
+#include <kernel/panic.h>
+
+namespace Kernel
+{
+
+File::File(FileSystem* fs, VNode* node, ulong flags)
+    : Fs(fs)
+    , Node(node)
+    , Flags(flags)
+    , Position(0)
+    , RefCounter(1)
+{
+}
+
+File::~File()
+{
+}
+
+void File::Get()
+{
+    BugOn(RefCounter.Get() <= 0);
+    RefCounter.Inc();
+}
+
+void File::Put()
+{
+    BugOn(RefCounter.Get() <= 0);
+    if (RefCounter.DecAndTest())
+    {
+        Vfs::GetInstance().Release(this);
+        delete this;
+    }
+}
+
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <include/types.h>
+#include <kernel/atomic.h>
+#include <kernel/mutex.h>
+#include <kernel/object_table.h>
+
+namespace Kernel
+{
+
+class FileSystem;
+struct VNode;
+
+/* An open file: a VNode held open (VNode::OpenCount) and a position.
+   Vfs::Open hands it out as a descriptor, an index into its table; the
+   descriptor operations look it up there, taking a reference for the
+   duration of the call.  The last Put, after Vfs::Close, lets the VNode
+   go. */
+class File final : public Object
+{
+public:
+    File(FileSystem* fs, VNode* node, ulong flags);
+
+    virtual void Get() override;
+    virtual void Put() override;
+
+    FileSystem* const Fs;
+    VNode* const Node;
+    const ulong Flags;      /* Vfs::Open* */
+    ulong Position;         /* next Read/Write, under PositionLock */
+    Mutex PositionLock;     /* held across Read, Write and Seek */
+
+private:
+    ~File();
+    File(const File& other) = delete;
+    File(File&& other) = delete;
+    File& operator=(const File& other) = delete;
+    File& operator=(File&& other) = delete;
+
+    Atomic RefCounter;
+};
+
+}
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <fs/vnode.h>
+#include <fs/extent_map.h>
 
 namespace Kernel
 {
@@ -16,14 +17,79 @@ public:
     virtual bool Format(BlockDevice* dev) { (void)dev; return false; }
     virtual bool Mount() { return true; }
     virtual void Unmount() {}
+    virtual bool Sync() { return true; }   /* durability point */
     virtual VNode* GetRoot() = 0;
     virtual VNode* Lookup(VNode* dir, const char* name) = 0;
+
+    /* Make dir->Children hold every entry of dir.  File systems that
+       read directories on first use do so here (Lookup does it too);
+       the rest have them all in memory. */
+    virtual bool LoadDir(VNode* dir) { (void)dir; return true; }
+
     virtual VNode* CreateFile(VNode* dir, const char* name) = 0;
     virtual VNode* CreateDir(VNode* dir, const char* name) = 0;
     virtual bool Write(VNode* file, const void* data, ulong len) = 0;
     virtual bool Read(VNode* file, void* buf, ulong len, ulong offset) = 0;
     virtual bool Remove(VNode* node) = 0;
     virtual BlockDevice* GetDevice() { return nullptr; }
+
+    /* The Vfs serializes its calls into a file system (the mount's
+       lock) unless this is true: then the VNode locks it holds around
+       each call (see vfs.h) are all the file system needs, so calls on
+       different VNodes run in parallel. */
+    virtual bool IsConcurrent() { return false; }
+
+    /* Write len bytes at offset, growing the file as needed (a gap past
+       the old end reads as zeros); only the blocks the range touches are
+       rewritten.  false if unsupported. */
+    virtual bool WriteAt(VNode* file, const void* data, ulong len, ulong offset)
+    {
+        (void)file;
+        (void)data;
+        (void)len;
+        (void)offset;
+        return false;
+    }
+
+    /* Set the file size: shrinking releases the data past size, growing
+       adds zeros.  false if unsupported. */
+    virtual bool Truncate(VNode* file, ulong size)
+    {
+        (void)file;
+        (void)size;
+        return false;
+    }
+
+    /* Discard all free space on the device (fstrim); bytes receives the
+       amount discarded.  false if unsupported. */
+    virtual bool Trim(u64& bytes) { bytes = 0; return false; }
+
+    /* Journaling file systems may leave an operation's metadata in a
+       running transaction that commits later, together with whatever
+       ran meanwhile.  GetTransaction names the transaction holding the
+       changes made so far, 0 if they are durable already (the default);
+       Commit(transaction) returns once that transaction is. */
+    virtual u64 GetTransaction() { return 0; }
+    virtual bool Commit(u64 transaction) { (void)transaction; return true; }
+
+    /* Turn the metadata journal on or off until unmount, committing and
+       checkpointing what it holds; false if unsupported. */
+    virtual bool SetJournal(bool on) { (void)on; return false; }
+
+    /* Map the data blocks of file onto device sectors for direct I/O
+       that bypasses the file system (loop devices).  Dirty cached data
+       must be written back by the caller first.  With write the caller
+       will modify the data in place, so the file system allocates
+       zeroed blocks for the holes and drops whatever it cannot keep
+       valid behind its back (whole-file checksums); the map then has
+       no holes.  false if unsupported or out of space. */
+    virtual bool MapExtents(VNode* file, bool write, FileExtentMap& map)
+    {
+        (void)file;
+        (void)write;
+        (void)map;
+        return false;
+    }
 };
 
 }
@@ -0,0 +1,289 @@
+#include "fs_bench.h"
+#include "vfs.h"
+
+#include <include/const.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/time.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+bool FsBench::RunOne(const char* path, ulong fileSize, ulong readSize, ulong ops,
+                     u8* buf, Result& result)
+{
+    auto& vfs = Vfs::GetInstance();
+
+    result.FileSize = fileSize;
+    result.Ops = 0;
+    result.ElapsedNs = 0;
+    result.FullOps = 0;
+    result.FullBytes = 0;
+    result.FullElapsedNs = 0;
+    result.Errors = 0;
+
+    for (ulong i = 0; i < fileSize; i++)
+        buf[i] = (u8)(i * 7 + fileSize / Const::KB);
+
+    if (!vfs.WriteFile(path, buf, fileSize))
+        return false;
+
+    /* Warm the cache so every size is measured the same way */
+    if (!vfs.ReadFileAt(path, buf, fileSize, 0))
+        return false;
+
+    ulong size = (readSize < fileSize) ? readSize : fileSize;
+    ulong offset = 0;
+    Stdlib::Time start = GetBootTime();
+    for (ulong i = 0; i < ops; i++)
+    {
+        if (offset + size > fileSize)
+            offset = 0;
+        if (!vfs.ReadFileAt(path, buf, size, offset))
+            result.Errors++;
+        result.Ops++;
+        offset += size;
+    }
+    result.ElapsedNs = (GetBootTime() - start).GetValue();
+
+    /* Whole-file reads moving as many bytes as the small reads did */
+    ulong fullOps = (ulong)(((u64)size * ops + fileSize - 1) / fileSize);
+    start = GetBootTime();
+    for (ulong i = 0; i < fullOps; i++)
+    {
+        if (!vfs.ReadFileAt(path, buf, fileSize, 0))
+            result.Errors++;
+        result.FullOps++;
+        result.FullBytes += fileSize;
+    }
+    result.FullElapsedNs = (GetBootTime() - start).GetValue();
+    return true;
+}
+
+bool FsBench::RunRead(const char* dir, ulong readSize, ulong ops, Stdlib::Printer& printer)
+{
+    if (readSize == 0 || readSize > MaxReadSize || ops == 0 || ops > MaxOps)
+        return false;
+
+    char path[Vfs::MaxPath];
+    ulong dirLen = Stdlib::StrLen(dir);
+    if (dirLen == 0 || dirLen + 10 >= sizeof(path))
+        return false;
+    Stdlib::SnPrintf(path, sizeof(path), "%s%s.fsbench", dir,
+                     (dir[dirLen - 1] == '/') ? "" : "/");
+
+    u8* buf = (u8*)Mm::Alloc(MaxFileSize, 0);
+    if (buf == nullptr)
+        return false;
+
+    bool ok = true;
+    PrintHeader(printer);
+    for (ulong fileSize = MinFileSize; fileSize <= MaxFileSize; fileSize *= 4)
+    {
+        Result result;
+        if (!RunOne(path, fileSize, readSize, ops, buf, result))
+        {
+            printer.Printf("%u KB: cannot write or read %s\n", fileSize / Const::KB, path);
+            ok = false;
+            break;
+        }
+        Print(result, printer);
+    }
+
+    Vfs::GetInstance().Remove(path);
+    Mm::Free(buf);
+    return ok;
+}
+
+void FsBench::MetaTaskFunc(void* ctx)
+{
+    MetaJob* job = static_cast<MetaJob*>(ctx);
+    auto& vfs = Vfs::GetInstance();
+    char path[Vfs::MaxPath];
+
+    for (ulong i = job->First; i < job->First + job->Count; i++)
+    {
+        Stdlib::SnPrintf(path, sizeof(path), "%s/f%u", job->Dir, i);
+        bool ok = job->Remove ? vfs.Remove(path) : vfs.CreateFile(path);
+        if (!ok)
+            job->Errors++;
+    }
+}
+
+/* The jobs run as tasks spread over the running CPUs; one job runs
+   inline */
+bool FsBench::RunMetaPhase(MetaJob* jobs, ulong tasks, u64& elapsedNs, ulong& errors)
+{
+    Stdlib::Time start = GetBootTime();
+    if (tasks == 1)
+    {
+        MetaTaskFunc(&jobs[0]);
+        elapsedNs = (GetBootTime() - start).GetValue();
+        errors += jobs[0].Errors;
+        return true;
+    }
+
+    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus();
+    ulong cpuIds[MaxMetaTasks];
+    ulong cpus = 0;
+    for (ulong i = 0; i < 8 * sizeof(ulong) && cpus < tasks; i++)
+    {
+        if (cpuMask & (1UL << i))
+            cpuIds[cpus++] = i;
+    }
+    if (cpus == 0)
+        return false;
+
+    Task* taskObjs[MaxMetaTasks] = {};
+    for (ulong i = 0; i < tasks; i++)
+    {
+        taskObjs[i] = Mm::TAlloc<Task, Tag>("fsbench/%u", i);
+        if (taskObjs[i] == nullptr)
+            break;
+        taskObjs[i]->SetCpuAffinity(1UL << cpuIds[i % cpus]);
+    }
+
+    bool ok = true;
+    ulong started = 0;
+    start = GetBootTime();
+    for (ulong i = 0; i < tasks; i++)
+    {
+        if (taskObjs[i] == nullptr || !taskObjs[i]->Start(&FsBench::MetaTaskFunc, &jobs[i]))
+        {
+            ok = false;
+            break;
+        }
+        started++;
+    }
+    for (ulong i = 0; i < started; i++)
+        taskObjs[i]->Wait();
+    elapsedNs = (GetBootTime() - start).GetValue();
+
+    for (ulong i = 0; i < tasks; i++)
+    {
+        if (taskObjs[i] != nullptr)
+            taskObjs[i]->Put();
+        if (i < started)
+            errors += jobs[i].Errors;
+    }
+    return ok;
+}
+
+bool FsBench::RunMeta(const char* dir, ulong files, ulong tasks, Stdlib::Printer& printer)
+{
+    if (files == 0 || files > MaxMetaFiles || tasks == 0 || tasks > MaxMetaTasks || tasks > files)
+        return false;
+
+    char scratch[Vfs::MaxPath];
+    ulong dirLen = Stdlib::StrLen(dir);
+    if (dirLen == 0 || dirLen + 16 >= sizeof(scratch))
+        return false;
+    Stdlib::SnPrintf(scratch, sizeof(scratch), "%s%s.fsmeta", dir,
+                     (dir[dirLen - 1] == '/') ? "" : "/");
+
+    auto& vfs = Vfs::GetInstance();
+    if (!vfs.CreateDir(scratch))
+    {
+        printer.Printf("cannot create %s\n", scratch);
+        return false;
+    }
+
+    bool ok = true;
+    bool journal = false;
+    PrintMetaHeader(printer);
+    for (ulong pass = 0; pass < 2 && ok; pass++)
+    {
+        bool on = (pass == 0);
+        if (!vfs.SetJournal(dir, on))
+        {
+            printer.Printf("%8s not supported by the file system\n", "journal");
+            continue;
+        }
+        if (on)
+            journal = true;
+
+        MetaResult result;
+        result.Journal = on;
+        result.Tasks = tasks;
+        result.Files = files;
+        result.Errors = 0;
+
+        MetaJob jobs[MaxMetaTasks];
+        for (ulong phase = 0; phase < 2 && ok; phase++)
+        {
+            ulong first = 0;
+            for (ulong i = 0; i < tasks; i++)
+            {
+                jobs[i].Dir = scratch;
+                jobs[i].First = first;
+                jobs[i].Count = files / tasks + ((i < files % tasks) ? 1 : 0);
+                jobs[i].Remove = (phase == 1);
+                jobs[i].Errors = 0;
+                first += jobs[i].Count;
+            }
+            ok = RunMetaPhase(jobs, tasks, (phase == 0) ? result.CreateNs : result.RemoveNs,
+                              result.Errors);
+        }
+        if (ok)
+            PrintMeta(result, printer);
+    }
+
+    /* The journal stays on if the file system has one */
+    if (journal)
+        vfs.SetJournal(dir, true);
+    vfs.Remove(scratch);
+    return ok;
+}
+
+void FsBench::PrintHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%8s %10s %8s %10s %8s %6s\n",
+        "file", "reads/s", "us/read", "full MB/s", "us/full", "errors");
+}
+
+void FsBench::Print(const Result& result, Stdlib::Printer& printer)
+{
+    u64 us = result.ElapsedNs / Const::NanoSecsInUsec;
+    if (us == 0)
+        us = 1;
+    u64 fullUs = result.FullElapsedNs / Const::NanoSecsInUsec;
+    if (fullUs == 0)
+        fullUs = 1;
+
+    printer.Printf("%6u KB %10u %8u %10u %8u %6u\n",
+        result.FileSize / Const::KB,
+        (u64)result.Ops * 1000000 / us,
+        (result.Ops != 0) ? us / result.Ops : 0,
+        result.FullBytes / fullUs,
+        (result.FullOps != 0) ? fullUs / result.FullOps : 0,
+        result.Errors);
+}
+
+void FsBench::PrintMetaHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%8s %6s %6s %10s %10s %8s %6s\n",
+        "metadata", "tasks", "files", "creates/s", "removes/s", "us/op", "errors");
+}
+
+void FsBench::PrintMeta(const MetaResult& result, Stdlib::Printer& printer)
+{
+    u64 createUs = result.CreateNs / Const::NanoSecsInUsec;
+    if (createUs == 0)
+        createUs = 1;
+    u64 removeUs = result.RemoveNs / Const::NanoSecsInUsec;
+    if (removeUs == 0)
+        removeUs = 1;
+
+    printer.Printf("%8s %6u %6u %10u %10u %8u %6u\n",
+        result.Journal ? "journal" : "ordered",
+        result.Tasks,
+        result.Files,
+        (u64)result.Files * 1000000 / createUs,
+        (u64)result.Files * 1000000 / removeUs,
+        (createUs + removeUs) / (2 * result.Files),
+        result.Errors);
+}
+
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* File read benchmark through the VFS.
+
+   For each file size from 4 KB to 1 MB (x4 steps) a scratch file is
+   written under Dir, then Ops reads of ReadSize bytes are issued at
+   offsets walking through the file, followed by whole-file reads of
+   the same total volume.  Reads are served from the buffer cache once
+   warm, so the numbers measure the file system's own per-read cost
+   (inode lookup, block mapping, checksum verification) rather than the
+   device.  The scratch file is removed afterwards.
+
+   RunMeta measures metadata operations instead: Tasks tasks create
+   Files empty files in a scratch directory under Dir, then remove them,
+   once with the file system's metadata journal (group commit) and once
+   without it, where every operation writes its metadata home itself. */
+class FsBench
+{
+public:
+    struct Result
+    {
+        ulong FileSize;
+        ulong Ops;
+        u64 ElapsedNs;          /* small reads */
+        ulong FullOps;
+        u64 FullBytes;
+        u64 FullElapsedNs;      /* whole-file reads */
+        ulong Errors;
+    };
+
+    struct MetaResult
+    {
+        bool Journal;
+        ulong Tasks;
+        ulong Files;
+        u64 CreateNs;
+        u64 RemoveNs;
+        ulong Errors;
+    };
+
+    static bool RunRead(const char* dir, ulong readSize, ulong ops, Stdlib::Printer& printer);
+    static bool RunMeta(const char* dir, ulong files, ulong tasks, Stdlib::Printer& printer);
+
+    static void PrintHeader(Stdlib::Printer& printer);
+    static void Print(const Result& result, Stdlib::Printer& printer);
+    static void PrintMetaHeader(Stdlib::Printer& printer);
+    static void PrintMeta(const MetaResult& result, Stdlib::Printer& printer);
+
+    static const ulong MinFileSize = 4 * 1024;
+    static const ulong MaxFileSize = 1024 * 1024;
+    static const ulong MaxReadSize = 64 * 1024;
+    static const ulong MaxOps = 1000000;
+    static const ulong MaxMetaFiles = 1000; /* one nanofs directory, within its 1024 inodes */
+    static const ulong MaxMetaTasks = 8;
+    static const ulong Tag = 'FBch';
+
+private:
+    FsBench() = delete;
+    FsBench(const FsBench& other) = delete;
+    FsBench(FsBench&& other) = delete;
+    FsBench& operator=(const FsBench& other) = delete;
+    FsBench& operator=(FsBench&& other) = delete;
+
+    static bool RunOne(const char* path, ulong fileSize, ulong readSize, ulong ops,
+                       u8* buf, Result& result);
+
+    struct MetaJob
+    {
+        const char* Dir;
+        ulong First;
+        ulong Count;
+        bool Remove;
+        ulong Errors;
+    };
+
+    static void MetaTaskFunc(void* ctx);
+    static bool RunMetaPhase(MetaJob* jobs, ulong tasks, u64& elapsedNs, ulong& errors);
+};
+
+}
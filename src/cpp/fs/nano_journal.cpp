@@ -0,0 +1,846 @@
+#include "nano_journal.h"
+
+#include <lib/stdlib.h>
+#include <lib/checksum.h>
+#include <mm/new.h>
+#include <kernel/trace.h>
+#include <hal/cpu.h>
+
+namespace Kernel
+{
+
+NanoJournal::NanoJournal(BlockIo& io)
+    : Io(io)
+    , Opened(false)
+    , Start(0)
+    , LogBlocks(0)
+    , Limit(0)
+    , Head(0)
+    , Tail(0)
+    , Used(0)
+    , Sequence(0)
+    , TailSequence(0)
+    , DataPending(false)
+    , Running(nullptr)
+    , RunningCount(0)
+    , RunningCapacity(0)
+    , Revokes(nullptr)
+    , RevokeCount(0)
+    , RevokeCapacity(0)
+    , LoggedCount(0)
+    , ReplayRevokes(nullptr)
+    , ReplayRevokeCount(0)
+    , ReplayRevokeCapacity(0)
+{
+    Stdlib::MemSet(Buckets, 0, sizeof(Buckets));
+    Stdlib::MemSet(&Counters, 0, sizeof(Counters));
+}
+
+NanoJournal::~NanoJournal()
+{
+    FreeAll();
+}
+
+static void ComputeHeaderChecksum(NanoJournalHeader* hdr)
+{
+    hdr->Checksum = 0;
+    hdr->Checksum = Stdlib::Crc32(hdr, sizeof(*hdr));
+}
+
+static bool VerifyHeaderChecksum(NanoJournalHeader* hdr)
+{
+    u32 saved = hdr->Checksum;
+    hdr->Checksum = 0;
+    u32 computed = Stdlib::Crc32(hdr, sizeof(*hdr));
+    hdr->Checksum = saved;
+    return computed == saved;
+}
+
+bool NanoJournal::Format(BlockIo& io, u32 start, u32 blocks)
+{
+    if (blocks < NanoJournalMinBlocks)
+    {
+        Trace(0, "NanoJournal::Format: %u blocks, need %u", (ulong)blocks, (ulong)NanoJournalMinBlocks);
+        return false;
+    }
+
+    NanoJournalSuper* js = (NanoJournalSuper*)Mm::Alloc(NanoJournalBlockSize, 0);
+    if (js == nullptr)
+    {
+        Trace(0, "NanoJournal::Format: alloc failed");
+        return false;
+    }
+
+    /* Replay walks from the first log block and stops at the zeroed one,
+       and numbers start in a fresh range: transactions an older journal
+       left in the log never match */
+    Stdlib::MemSet(js, 0, sizeof(*js));
+    bool ok = io.WriteBlock(start + 1, js);
+
+    js->Magic = NanoJournalMagic;
+    js->Blocks = blocks;
+    js->Tail = 0;
+    js->Sequence = ((Hal::ReadCycleCounter() & 0xFFFFFFFFFF) << 16) + 1;
+    js->Checksum = Stdlib::Crc32(js, sizeof(*js));
+
+    ok = ok && io.Commit() && io.WriteBlock(start, js, true);
+    Mm::Free(js);
+    if (!ok)
+        Trace(0, "NanoJournal::Format: write super block %u failed", (ulong)start);
+    return ok;
+}
+
+bool NanoJournal::Open(u32 start, u32 blocks, u32 limit)
+{
+    if (Opened)
+        return true;
+
+    if (blocks < NanoJournalMinBlocks || blocks > NanoJournalMaxBlocks)
+    {
+        Trace(0, "NanoJournal::Open: bad size %u", (ulong)blocks);
+        return false;
+    }
+
+    NanoJournalSuper* js = (NanoJournalSuper*)Mm::Alloc(NanoJournalBlockSize, 0);
+    if (js == nullptr)
+    {
+        Trace(0, "NanoJournal::Open: alloc failed");
+        return false;
+    }
+
+    if (!Io.ReadBlock(start, js))
+    {
+        Trace(0, "NanoJournal::Open: read super block %u failed", (ulong)start);
+        Mm::Free(js);
+        return false;
+    }
+
+    u32 saved = js->Checksum;
+    js->Checksum = 0;
+    bool ok = js->Magic == NanoJournalMagic && Stdlib::Crc32(js, sizeof(*js)) == saved &&
+              js->Blocks == blocks && js->Tail < blocks - 1;
+    u32 tail = js->Tail;
+    u64 seq = js->Sequence;
+    Mm::Free(js);
+    if (!ok)
+    {
+        Trace(0, "NanoJournal::Open: bad super block at %u", (ulong)start);
+        return false;
+    }
+
+    Start = start;
+    LogBlocks = blocks - 1;
+    Limit = limit;
+
+    /* Pass one finds the committed transactions and what they revoked,
+       pass two writes their blocks home */
+    u32 pos = tail;
+    u64 count = 0;
+    u32 scanned = 0;
+    u32 length;
+    while (scanned < LogBlocks && WalkTransaction(pos, seq + count, false, length))
+    {
+        pos = (pos + length) % LogBlocks;
+        scanned += length;
+        count++;
+    }
+
+    pos = tail;
+    for (u64 i = 0; i < count && ok; i++)
+    {
+        ok = WalkTransaction(pos, seq + i, true, length);
+        pos = (pos + length) % LogBlocks;
+    }
+
+    if (ReplayRevokes != nullptr)
+        Mm::Free(ReplayRevokes);
+    ReplayRevokes = nullptr;
+    ReplayRevokeCount = 0;
+    ReplayRevokeCapacity = 0;
+
+    if (!ok)
+    {
+        Trace(0, "NanoJournal::Open: replay failed");
+        return false;
+    }
+
+    Head = pos;
+    Tail = pos;
+    Used = 0;
+    Sequence = seq + count;
+    TailSequence = Sequence;
+    DataPending = false;
+
+    /* Replayed blocks are home and durable before the log forgets them */
+    if (count != 0 && (!Io.Flush() || !WriteSuper()))
+    {
+        Trace(0, "NanoJournal::Open: cannot retire %u replayed transactions", (ulong)count);
+        return false;
+    }
+
+    Counters.Replayed += count;
+    if (count != 0)
+        Trace(0, "NanoJournal: replayed %u transactions up to %u", (ulong)count, (ulong)(Sequence - 1));
+
+    Opened = true;
+    return true;
+}
+
+bool NanoJournal::Close()
+{
+    if (!Opened)
+        return true;
+
+    bool ok = Commit() && Checkpoint();
+    FreeAll();
+    Opened = false;
+    return ok;
+}
+
+bool NanoJournal::IsOpen()
+{
+    return Opened;
+}
+
+u32 NanoJournal::Hash(u32 block)
+{
+    return (block * 0x9E3779B1) >> 24;
+}
+
+NanoJournal::Entry* NanoJournal::Find(u32 block)
+{
+    for (Entry* e = Buckets[Hash(block)]; e != nullptr; e = e->Next)
+    {
+        if (e->Block == block)
+            return e;
+    }
+    return nullptr;
+}
+
+void NanoJournal::Unlink(Entry* entry)
+{
+    Entry** link = &Buckets[Hash(entry->Block)];
+    while (*link != entry)
+        link = &(*link)->Next;
+    *link = entry->Next;
+}
+
+void NanoJournal::FreeEntry(Entry* entry)
+{
+    if (entry->Frozen != nullptr)
+        Mm::Free(entry->Frozen);
+    Mm::Free(entry->Data);
+    delete entry;
+}
+
+void NanoJournal::FreeAll()
+{
+    for (u32 i = 0; i < BucketCount; i++)
+    {
+        while (Buckets[i] != nullptr)
+        {
+            Entry* e = Buckets[i];
+            Buckets[i] = e->Next;
+            FreeEntry(e);
+        }
+    }
+
+    if (Running != nullptr)
+        Mm::Free(Running);
+    Running = nullptr;
+    RunningCount = 0;
+    RunningCapacity = 0;
+    if (Revokes != nullptr)
+        Mm::Free(Revokes);
+    Revokes = nullptr;
+    RevokeCount = 0;
+    RevokeCapacity = 0;
+    LoggedCount = 0;
+}
+
+bool NanoJournal::Read(u32 block, void* buf)
+{
+    Entry* e = Find(block);
+    if (e == nullptr)
+        return false;
+
+    Stdlib::MemCpy(buf, e->Data, NanoJournalBlockSize);
+    return true;
+}
+
+bool NanoJournal::AddRunning(Entry* entry)
+{
+    if (RunningCount == RunningCapacity)
+    {
+        u32 capacity = (RunningCapacity != 0) ? 2 * RunningCapacity : 64;
+        Entry** running = (Entry**)Mm::Alloc(capacity * sizeof(Entry*), 0);
+        if (running == nullptr)
+            return false;
+        if (RunningCount != 0)
+            Stdlib::MemCpy(running, Running, RunningCount * sizeof(Entry*));
+        if (Running != nullptr)
+            Mm::Free(Running);
+        Running = running;
+        RunningCapacity = capacity;
+    }
+
+    Running[RunningCount++] = entry;
+    return true;
+}
+
+bool NanoJournal::Log(u32 block, const void* buf)
+{
+    if (!Opened)
+        return false;
+
+    Entry* e = Find(block);
+    if (e == nullptr)
+    {
+        e = new (Mm::NoThrow) Entry();
+        u8* data = (u8*)Mm::Alloc(NanoJournalBlockSize, 0);
+        if (e == nullptr || data == nullptr || !AddRunning(e))
+        {
+            Trace(0, "NanoJournal::Log: alloc failed for block %u", (ulong)block);
+            delete e;
+            if (data != nullptr)
+                Mm::Free(data);
+            return false;
+        }
+
+        e->Block = block;
+        e->Running = true;
+        e->Logged = false;
+        e->Freed = false;
+        e->Data = data;
+        e->Frozen = nullptr;
+        e->Next = Buckets[Hash(block)];
+        Buckets[Hash(block)] = e;
+    }
+    else if (!e->Running)
+    {
+        /* Freed and reused within the transaction: this copy replaces
+           the revoke, older copies are overwritten by it at replay */
+        if (e->Freed)
+        {
+            for (u32 i = 0; i < RevokeCount; i++)
+            {
+                if (Revokes[i] == block)
+                {
+                    Revokes[i] = Revokes[--RevokeCount];
+                    break;
+                }
+            }
+            e->Freed = false;
+        }
+
+        /* The committed copy stays what a checkpoint writes home */
+        u8* data = nullptr;
+        if (e->Logged)
+        {
+            data = (u8*)Mm::Alloc(NanoJournalBlockSize, 0);
+            if (data == nullptr)
+            {
+                Trace(0, "NanoJournal::Log: alloc failed for block %u", (ulong)block);
+                return false;
+            }
+        }
+
+        if (!AddRunning(e))
+        {
+            Trace(0, "NanoJournal::Log: alloc failed for block %u", (ulong)block);
+            if (data != nullptr)
+                Mm::Free(data);
+            return false;
+        }
+
+        if (data != nullptr)
+        {
+            e->Frozen = e->Data;
+            e->Data = data;
+        }
+        e->Running = true;
+    }
+
+    Stdlib::MemCpy(e->Data, buf, NanoJournalBlockSize);
+    return true;
+}
+
+bool NanoJournal::AddRevoke(u32 block)
+{
+    if (RevokeCount == RevokeCapacity)
+    {
+        u32 capacity = (RevokeCapacity != 0) ? 2 * RevokeCapacity : 64;
+        u32* revokes = (u32*)Mm::Alloc(capacity * sizeof(u32), 0);
+        if (revokes == nullptr)
+            return false;
+        if (RevokeCount != 0)
+            Stdlib::MemCpy(revokes, Revokes, RevokeCount * sizeof(u32));
+        if (Revokes != nullptr)
+            Mm::Free(Revokes);
+        Revokes = revokes;
+        RevokeCapacity = capacity;
+    }
+
+    Revokes[RevokeCount++] = block;
+    return true;
+}
+
+bool NanoJournal::Revoke(u32 block)
+{
+    if (!Opened)
+        return true;
+
+    Entry* e = Find(block);
+    if (e == nullptr || e->Freed)
+        return true;
+
+    if (e->Logged && !AddRevoke(block))
+    {
+        Trace(0, "NanoJournal::Revoke: alloc failed for block %u", (ulong)block);
+        return false;
+    }
+
+    if (e->Running)
+    {
+        for (u32 i = 0; i < RunningCount; i++)
+        {
+            if (Running[i] == e)
+            {
+                Running[i] = Running[--RunningCount];
+                break;
+            }
+        }
+        e->Running = false;
+    }
+
+    if (!e->Logged)
+    {
+        Unlink(e);
+        FreeEntry(e);
+        return true;
+    }
+
+    /* A checkpoint before the revoke commits still writes the committed
+       copy home; the entry goes once the revoke is committed */
+    if (e->Frozen != nullptr)
+    {
+        Mm::Free(e->Data);
+        e->Data = e->Frozen;
+        e->Frozen = nullptr;
+    }
+    e->Freed = true;
+    return true;
+}
+
+void NanoJournal::OrderData()
+{
+    DataPending = true;
+}
+
+bool NanoJournal::HasRunning()
+{
+    return RunningCount != 0 || RevokeCount != 0;
+}
+
+/* A quarter of the log at most, so a commit fits once half the log is
+   checkpointed */
+bool NanoJournal::NeedCommit()
+{
+    u32 limit = LogBlocks / 4;
+    if (limit > NanoJournalMaxTx)
+        limit = NanoJournalMaxTx;
+    return RunningCount + RevokeCount >= limit;
+}
+
+u64 NanoJournal::GetSequence()
+{
+    return Sequence;
+}
+
+u32 NanoJournal::LogBlock(u32 pos)
+{
+    return Start + 1 + pos % LogBlocks;
+}
+
+bool NanoJournal::WriteSuper()
+{
+    NanoJournalSuper* js = (NanoJournalSuper*)Mm::Alloc(NanoJournalBlockSize, 0);
+    if (js == nullptr)
+    {
+        Trace(0, "NanoJournal: alloc super block failed");
+        return false;
+    }
+
+    Stdlib::MemSet(js, 0, sizeof(*js));
+    js->Magic = NanoJournalMagic;
+    js->Blocks = LogBlocks + 1;
+    js->Tail = Tail;
+    js->Sequence = TailSequence;
+    js->Checksum = Stdlib::Crc32(js, sizeof(*js));
+
+    bool ok = Io.WriteBlock(Start, js, true);
+    Mm::Free(js);
+    if (!ok)
+        Trace(0, "NanoJournal: write super block failed");
+    return ok;
+}
+
+bool NanoJournal::Commit()
+{
+    if (!Opened)
+        return false;
+
+    if (!HasRunning())
+    {
+        if (DataPending && !Io.Commit())
+            return false;
+        DataPending = false;
+        return true;
+    }
+
+    /* Block tags first, then the revoke tags, NanoJournalTagsPerBlock to
+       a descriptor */
+    u32 tags = RunningCount + RevokeCount;
+    u32 descs = (tags + NanoJournalTagsPerBlock - 1) / NanoJournalTagsPerBlock;
+    u32 needed = descs + RunningCount + 1;
+    if (needed > LogBlocks)
+    {
+        Trace(0, "NanoJournal::Commit: transaction of %u blocks exceeds the log (%u)",
+              (ulong)needed, (ulong)LogBlocks);
+        return false;
+    }
+
+    if (needed > LogBlocks - Used && !Checkpoint())
+        return false;
+
+    u8* headers = (u8*)Mm::Alloc((ulong)(descs + 1) * NanoJournalBlockSize, 0);
+    u32* blocks = (u32*)Mm::Alloc(needed * sizeof(u32), 0);
+    const void** bufs = (const void**)Mm::Alloc(needed * sizeof(void*), 0);
+    if (headers == nullptr || blocks == nullptr || bufs == nullptr)
+    {
+        Trace(0, "NanoJournal::Commit: alloc failed");
+        if (headers != nullptr)
+            Mm::Free(headers);
+        if (blocks != nullptr)
+            Mm::Free(blocks);
+        if (bufs != nullptr)
+            Mm::Free(bufs);
+        return false;
+    }
+    Stdlib::MemSet(headers, 0, (ulong)(descs + 1) * NanoJournalBlockSize);
+
+    u32 n = 0;
+    u32 entry = 0;
+    u32 revoke = 0;
+    for (u32 d = 0; d < descs; d++)
+    {
+        NanoJournalHeader* hdr = (NanoJournalHeader*)(headers + (ulong)d * NanoJournalBlockSize);
+        hdr->Magic = NanoJournalMagic;
+        hdr->Type = NanoJournalTypeDescriptor;
+        hdr->Sequence = Sequence;
+
+        u32 first = entry;
+        while (entry < RunningCount && hdr->Count < NanoJournalTagsPerBlock)
+        {
+            Entry* e = Running[entry++];
+            hdr->Tags[hdr->Count].Block = e->Block;
+            hdr->Tags[hdr->Count].Crc = Stdlib::Crc32(e->Data, NanoJournalBlockSize);
+            hdr->Count++;
+        }
+        while (revoke < RevokeCount && hdr->Count + hdr->RevokeCount < NanoJournalTagsPerBlock)
+        {
+            hdr->Tags[hdr->Count + hdr->RevokeCount].Block = Revokes[revoke++];
+            hdr->RevokeCount++;
+        }
+        ComputeHeaderChecksum(hdr);
+
+        blocks[n] = LogBlock(Head + n);
+        bufs[n++] = hdr;
+        for (u32 i = first; i < entry; i++)
+        {
+            blocks[n] = LogBlock(Head + n);
+            bufs[n++] = Running[i]->Data;
+        }
+    }
+
+    NanoJournalHeader* commit = (NanoJournalHeader*)(headers + (ulong)descs * NanoJournalBlockSize);
+    commit->Magic = NanoJournalMagic;
+    commit->Type = NanoJournalTypeCommit;
+    commit->Sequence = Sequence;
+    commit->Count = n;
+    ComputeHeaderChecksum(commit);
+    blocks[n] = LogBlock(Head + n);
+    bufs[n++] = commit;
+
+    /* Data the metadata points at is durable first; the log and commit
+       block then go out as one batch behind one flush.  A torn batch
+       fails its tags or commit block at replay. */
+    bool ok = (!DataPending || Io.Commit()) && Io.WriteBlocks(blocks, bufs, n) && Io.Commit();
+
+    Mm::Free(headers);
+    Mm::Free(blocks);
+    Mm::Free(bufs);
+    if (!ok)
+    {
+        Trace(0, "NanoJournal::Commit: write of transaction %u failed", (ulong)Sequence);
+        return false;
+    }
+
+    for (u32 i = 0; i < RunningCount; i++)
+    {
+        Entry* e = Running[i];
+        e->Running = false;
+        if (e->Frozen != nullptr)
+        {
+            Mm::Free(e->Frozen);
+            e->Frozen = nullptr;
+        }
+        if (!e->Logged)
+        {
+            e->Logged = true;
+            LoggedCount++;
+        }
+    }
+
+    /* Committed revokes: the old copies need not reach home any more */
+    for (u32 i = 0; i < RevokeCount; i++)
+    {
+        Entry* e = Find(Revokes[i]);
+        if (e != nullptr && e->Freed)
+        {
+            Unlink(e);
+            FreeEntry(e);
+            LoggedCount--;
+        }
+    }
+
+    Counters.Commits++;
+    Counters.Blocks += RunningCount;
+    RunningCount = 0;
+    RevokeCount = 0;
+    DataPending = false;
+    Head = (Head + needed) % LogBlocks;
+    Used += needed;
+    Sequence++;
+
+    /* Lazy checkpoint: committed blocks wait in memory, absorbing later
+       updates, until the log is half full */
+    if (Used > LogBlocks / 2)
+        return Checkpoint();
+    return true;
+}
+
+/* Write every committed block home in block order, flush, then move the
+   tail past everything committed */
+bool NanoJournal::Checkpoint()
+{
+    if (!Opened)
+        return false;
+
+    if (Used == 0)
+        return true;
+
+    Entry** logged = nullptr;
+    if (LoggedCount != 0)
+    {
+        logged = (Entry**)Mm::Alloc(LoggedCount * sizeof(Entry*), 0);
+        if (logged == nullptr)
+        {
+            Trace(0, "NanoJournal::Checkpoint: alloc failed");
+            return false;
+        }
+    }
+
+    u32 count = 0;
+    for (u32 i = 0; i < BucketCount; i++)
+    {
+        for (Entry* e = Buckets[i]; e != nullptr; e = e->Next)
+        {
+            if (e->Logged)
+                logged[count++] = e;
+        }
+    }
+
+    /* Insertion sort: adjacent home blocks merge into one request */
+    for (u32 i = 1; i < count; i++)
+    {
+        Entry* e = logged[i];
+        u32 j = i;
+        while (j > 0 && logged[j - 1]->Block > e->Block)
+        {
+            logged[j] = logged[j - 1];
+            j--;
+        }
+        logged[j] = e;
+    }
+
+    bool ok = true;
+    u32 blocks[NanoJournalCheckpointBatch];
+    const void* bufs[NanoJournalCheckpointBatch];
+    for (u32 i = 0; i < count && ok; i += NanoJournalCheckpointBatch)
+    {
+        u32 n = count - i;
+        if (n > NanoJournalCheckpointBatch)
+            n = NanoJournalCheckpointBatch;
+        for (u32 j = 0; j < n; j++)
+        {
+            Entry* e = logged[i + j];
+            blocks[j] = e->Block;
+            bufs[j] = (e->Frozen != nullptr) ? e->Frozen : e->Data;
+        }
+        ok = Io.WriteBlocks(blocks, bufs, n);
+    }
+
+    /* Home copies durable before the tail moves past their log copies */
+    if (ok)
+    {
+        Tail = Head;
+        TailSequence = Sequence;
+        ok = Io.Flush() && WriteSuper();
+    }
+
+    if (!ok)
+    {
+        Trace(0, "NanoJournal::Checkpoint: failed");
+        if (logged != nullptr)
+            Mm::Free(logged);
+        return false;
+    }
+
+    for (u32 i = 0; i < count; i++)
+    {
+        Entry* e = logged[i];
+        e->Logged = false;
+        if (e->Frozen != nullptr)
+        {
+            Mm::Free(e->Frozen);
+            e->Frozen = nullptr;
+        }
+        if (!e->Running)
+        {
+            Unlink(e);
+            FreeEntry(e);
+        }
+    }
+    if (logged != nullptr)
+        Mm::Free(logged);
+
+    LoggedCount = 0;
+    Used = 0;
+    Counters.Checkpoints++;
+    return true;
+}
+
+bool NanoJournal::AddReplayRevoke(u32 block, u64 seq)
+{
+    for (u32 i = 0; i < ReplayRevokeCount; i++)
+    {
+        if (ReplayRevokes[i].Block == block)
+        {
+            ReplayRevokes[i].Sequence = seq;
+            return true;
+        }
+    }
+
+    if (ReplayRevokeCount == ReplayRevokeCapacity)
+    {
+        u32 capacity = (ReplayRevokeCapacity != 0) ? 2 * ReplayRevokeCapacity : 64;
+        Revoked* revokes = (Revoked*)Mm::Alloc(capacity * sizeof(Revoked), 0);
+        if (revokes == nullptr)
+            return false;
+        if (ReplayRevokeCount != 0)
+            Stdlib::MemCpy(revokes, ReplayRevokes, ReplayRevokeCount * sizeof(Revoked));
+        if (ReplayRevokes != nullptr)
+            Mm::Free(ReplayRevokes);
+        ReplayRevokes = revokes;
+        ReplayRevokeCapacity = capacity;
+    }
+
+    ReplayRevokes[ReplayRevokeCount].Block = block;
+    ReplayRevokes[ReplayRevokeCount].Sequence = seq;
+    ReplayRevokeCount++;
+    return true;
+}
+
+bool NanoJournal::IsReplayRevoked(u32 block, u64 seq)
+{
+    for (u32 i = 0; i < ReplayRevokeCount; i++)
+    {
+        if (ReplayRevokes[i].Block == block)
+            return ReplayRevokes[i].Sequence >= seq;
+    }
+    return false;
+}
+
+/* Check the transaction seq at log block pos: descriptors and copies
+   intact, commit block present.  Without apply, record its revokes;
+   with apply, write its blocks home unless a transaction from seq on
+   revoked them.  length receives its log blocks. */
+bool NanoJournal::WalkTransaction(u32 pos, u64 seq, bool apply, u32& length)
+{
+    NanoJournalHeader* hdr = (NanoJournalHeader*)Mm::Alloc(NanoJournalBlockSize, 0);
+    u8* buf = (u8*)Mm::Alloc(NanoJournalBlockSize, 0);
+    if (hdr == nullptr || buf == nullptr)
+    {
+        Trace(0, "NanoJournal: alloc replay buffers failed");
+        if (hdr != nullptr)
+            Mm::Free(hdr);
+        if (buf != nullptr)
+            Mm::Free(buf);
+        return false;
+    }
+
+    bool ok = false;
+    u32 len = 0;
+    while (len < LogBlocks)
+    {
+        if (!Io.ReadBlock(LogBlock(pos + len), hdr) || hdr->Magic != NanoJournalMagic ||
+            hdr->Sequence != seq || !VerifyHeaderChecksum(hdr))
+            break;
+
+        if (hdr->Type == NanoJournalTypeCommit)
+        {
+            ok = (hdr->Count == len && len != 0);
+            len++;
+            break;
+        }
+
+        if (hdr->Type != NanoJournalTypeDescriptor ||
+            hdr->Count + hdr->RevokeCount > NanoJournalTagsPerBlock ||
+            len + 1 + hdr->Count >= LogBlocks)
+            break;
+        len++;
+
+        bool tagsOk = true;
+        for (u32 i = 0; i < hdr->Count && tagsOk; i++, len++)
+        {
+            const NanoJournalTag& tag = hdr->Tags[i];
+            tagsOk = tag.Block < Limit && (tag.Block < Start || tag.Block > Start + LogBlocks) &&
+                     Io.ReadBlock(LogBlock(pos + len), buf) &&
+                     Stdlib::Crc32(buf, NanoJournalBlockSize) == tag.Crc;
+            if (tagsOk && apply && !IsReplayRevoked(tag.Block, seq) && !Io.WriteBlock(tag.Block, buf))
+            {
+                Trace(0, "NanoJournal: replay write of block %u failed", (ulong)tag.Block);
+                tagsOk = false;
+            }
+        }
+
+        for (u32 i = 0; i < hdr->RevokeCount && tagsOk && !apply; i++)
+            tagsOk = AddReplayRevoke(hdr->Tags[hdr->Count + i].Block, seq);
+
+        if (!tagsOk)
+            break;
+    }
+
+    Mm::Free(hdr);
+    Mm::Free(buf);
+    length = len;
+    return ok;
+}
+
+void NanoJournal::GetStats(Stats& stats)
+{
+    stats = Counters;
+}
+
+}
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <include/types.h>
+#include <fs/block_io.h>
+
+namespace Kernel
+{
+
+static const u32 NanoJournalMagic      = 0x4C4E4A4E; // "NJNL"
+static const u32 NanoJournalBlockSize  = 4096;
+static const u32 NanoJournalMinBlocks  = 128;
+static const u32 NanoJournalMaxBlocks  = 2048;  // 8 MB
+static const u32 NanoJournalMaxTx      = 256;   // running blocks that call for a commit
+static const u32 NanoJournalCheckpointBatch = 64; // home writes submitted together
+
+static const u32 NanoJournalTypeDescriptor = 1;
+static const u32 NanoJournalTypeCommit     = 2;
+
+/* Block 0 of the journal region; the blocks after it are the log, used
+   as a ring.  Tail is the log block of the oldest transaction not yet
+   checkpointed and Sequence its number: replay starts there. */
+struct NanoJournalSuper
+{
+    u32 Magic;
+    u32 Checksum;       // CRC32 of this block (zeroed during computation)
+    u32 Blocks;         // region size, this block included
+    u32 Tail;
+    u64 Sequence;
+    u8  Padding[NanoJournalBlockSize - 24];
+};
+
+static_assert(sizeof(NanoJournalSuper) == NanoJournalBlockSize, "NanoJournalSuper must be 4 KB");
+
+/* A logged block: its home block and the CRC32 of the copy */
+struct NanoJournalTag
+{
+    u32 Block;
+    u32 Crc;
+};
+
+static const u32 NanoJournalTagsPerBlock = (NanoJournalBlockSize - 32) / sizeof(NanoJournalTag); // 508
+
+/* A transaction is one or more descriptors, each followed by the copies
+   of its Count blocks, then a commit block whose Count is the number of
+   log blocks before it.  The RevokeCount tags after a descriptor's block
+   tags name blocks freed by the transaction: copies of them in earlier
+   transactions are not replayed, the block may hold file data by now. */
+struct NanoJournalHeader
+{
+    u32 Magic;
+    u32 Type;
+    u64 Sequence;
+    u32 Count;
+    u32 RevokeCount;
+    u32 Checksum;       // CRC32 of this block (zeroed during computation)
+    u32 Reserved;
+    NanoJournalTag Tags[NanoJournalTagsPerBlock];
+};
+
+static_assert(sizeof(NanoJournalHeader) == NanoJournalBlockSize, "NanoJournalHeader must be 4 KB");
+
+/* Write-ahead log of file system metadata blocks.
+
+   Log() puts the new contents of a block into the running transaction
+   instead of writing it home; Read() returns the newest logged contents
+   of any block not yet checkpointed, so the caller reads its metadata
+   through the journal.  Commit() writes the running transaction to the
+   log as one batch and makes it durable with one device flush (two when
+   data written in place must reach the disk first, see OrderData()), so
+   operations that ran since the last commit share it.  Committed blocks
+   stay in memory; Checkpoint() writes them home, flushes and moves the
+   tail, lazily, once half the log is in use or on Close().  Open()
+   replays the committed transactions a crash left in the log. */
+class NanoJournal
+{
+public:
+    struct Stats
+    {
+        u64 Commits;
+        u64 Blocks;         // blocks logged by commits
+        u64 Checkpoints;
+        u64 Replayed;       // transactions replayed at open
+    };
+
+    NanoJournal(BlockIo& io);
+    ~NanoJournal();
+
+    /* Write an empty journal over blocks start..start + blocks - 1. */
+    static bool Format(BlockIo& io, u32 start, u32 blocks);
+
+    /* Replay what a crash left committed, then log after it.  Replayed
+       blocks must lie below limit and outside the region; replay stops
+       at the first transaction that does not check out. */
+    bool Open(u32 start, u32 blocks, u32 limit);
+
+    /* Commit, checkpoint and stop logging. */
+    bool Close();
+    bool IsOpen();
+
+    /* Copy the newest contents of block into buf; false if the journal
+       does not hold it. */
+    bool Read(u32 block, void* buf);
+    bool Log(u32 block, const void* buf);
+
+    /* Block was freed: drop its copy and keep earlier logged copies from
+       being replayed over whatever the block holds next. */
+    bool Revoke(u32 block);
+
+    /* Blocks were written in place that the running transaction's
+       metadata references; they are flushed before it commits. */
+    void OrderData();
+
+    bool HasRunning();
+    bool NeedCommit();
+
+    /* Number the running transaction commits as; smaller numbers are
+       committed. */
+    u64 GetSequence();
+
+    bool Commit();
+    bool Checkpoint();
+
+    void GetStats(Stats& stats);
+
+private:
+    NanoJournal(const NanoJournal& other) = delete;
+    NanoJournal(NanoJournal&& other) = delete;
+    NanoJournal& operator=(const NanoJournal& other) = delete;
+    NanoJournal& operator=(NanoJournal&& other) = delete;
+
+    struct Entry
+    {
+        u32 Block;
+        bool Running;       // in the running transaction
+        bool Logged;        // a committed copy is in the log, not yet home
+        bool Freed;         // revoked by the running transaction; Data is the committed copy
+        u8* Data;           // newest contents
+        u8* Frozen;         // committed contents while Running and Logged
+        Entry* Next;        // hash chain
+    };
+
+    struct Revoked
+    {
+        u32 Block;
+        u64 Sequence;
+    };
+
+    static const u32 BucketCount = 256;
+
+    static u32 Hash(u32 block);
+    Entry* Find(u32 block);
+    void Unlink(Entry* entry);
+    void FreeEntry(Entry* entry);
+    void FreeAll();
+    bool AddRunning(Entry* entry);
+    bool AddRevoke(u32 block);
+
+    u32 LogBlock(u32 pos);
+    bool WriteSuper();
+    bool WalkTransaction(u32 pos, u64 seq, bool apply, u32& length);
+    bool IsReplayRevoked(u32 block, u64 seq);
+    bool AddReplayRevoke(u32 block, u64 seq);
+
+    BlockIo& Io;
+    bool Opened;
+    u32 Start;          // region: super block, then LogBlocks of log
+    u32 LogBlocks;
+    u32 Limit;          // home blocks lie below
+    u32 Head;           // next log block to write
+    u32 Tail;
+    u32 Used;           // log blocks from Tail to Head
+    u64 Sequence;       // of the running transaction
+    u64 TailSequence;
+    bool DataPending;
+
+    Entry* Buckets[BucketCount];
+    Entry** Running;
+    u32 RunningCount;
+    u32 RunningCapacity;
+    u32* Revokes;       // running transaction's revoked blocks
+    u32 RevokeCount;
+    u32 RevokeCapacity;
+    u32 LoggedCount;
+
+    Revoked* ReplayRevokes;
+    u32 ReplayRevokeCount;
+    u32 ReplayRevokeCapacity;
+
+    Stats Counters;
+};
+
+}
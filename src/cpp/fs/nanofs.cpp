@@ -1,5 +1,6 @@
 #include "nanofs.h"
 
+#include <fs/buffer_cache.h>
 #include <lib/stdlib.h>
 #include <lib/bitmap.h>
 #include <lib/checksum.h>
@@ -11,18 +12,162 @@
 namespace Kernel
 {
 
+/* Maps a file's blocks for readahead, remembering the last extent so a
+   window inside one extent costs one tree walk */
+class NanoBlockMapper final : public BlockMapper
+{
+public:
+    NanoBlockMapper(NanoFs* fs, u32 inodeIdx, const NanoInode* inode)
+        : Fs(fs)
+        , InodeIdx(inodeIdx)
+        , Inode(inode)
+    {
+        Last.Logical = 0;
+        Last.Start = NanoNoBlock;
+        Last.Length = 0;
+    }
+
+    virtual bool MapBlock(u32 logical, u32& physical) override
+    {
+        if (logical < Last.Logical || logical - Last.Logical >= Last.Length)
+        {
+            if (!Fs->MapLogical(InodeIdx, Inode, logical, Last))
+            {
+                Last.Length = 0;
+                return false;
+            }
+        }
+
+        /* Holes read as zeros */
+        if (Last.Start == NanoNoBlock)
+        {
+            physical = 0;
+            return true;
+        }
+
+        physical = Fs->Super->DataStartBlock + Last.Start + (logical - Last.Logical);
+        return true;
+    }
+
+private:
+    NanoFs* Fs;
+    u32 InodeIdx;
+    const NanoInode* Inode;
+    NanoExtent Last;
+};
+
+NanoExtentList::NanoExtentList()
+    : Items(nullptr)
+    , Count(0)
+    , Capacity(0)
+{
+}
+
+NanoExtentList::~NanoExtentList()
+{
+    Clear();
+}
+
+bool NanoExtentList::Add(u32 logical, u32 start, u32 length, bool merge)
+{
+    if (merge && Count != 0)
+    {
+        NanoExtent& last = Items[Count - 1];
+        if (last.Logical + last.Length == logical && last.Start + last.Length == start)
+        {
+            last.Length += length;
+            return true;
+        }
+    }
+
+    if (Count == Capacity)
+    {
+        u32 capacity = (Capacity != 0) ? 2 * Capacity : 16;
+        NanoExtent* items = new (Mm::NoThrow) NanoExtent[capacity];
+        if (items == nullptr)
+            return false;
+
+        if (Count != 0)
+            Stdlib::MemCpy(items, Items, Count * sizeof(NanoExtent));
+        delete[] Items;
+        Items = items;
+        Capacity = capacity;
+    }
+
+    NanoExtent& ext = Items[Count++];
+    ext.Logical = logical;
+    ext.Start = start;
+    ext.Length = length;
+    return true;
+}
+
+void NanoExtentList::Clear()
+{
+    delete[] Items;
+    Items = nullptr;
+    Count = 0;
+    Capacity = 0;
+}
+
+u32 NanoExtentList::GetCount() const
+{
+    return Count;
+}
+
+const NanoExtent& NanoExtentList::Get(u32 index) const
+{
+    return Items[index];
+}
+
+u32 NanoExtentList::GetEnd() const
+{
+    if (Count == 0)
+        return 0;
+    return Items[Count - 1].Logical + Items[Count - 1].Length;
+}
+
+bool NanoExtentList::Find(u32 logical, u32& index) const
+{
+    u32 lo = 0;
+    u32 hi = Count;
+    while (lo < hi)
+    {
+        u32 mid = (lo + hi) / 2;
+        if (Items[mid].Logical <= logical)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == 0 || logical - Items[lo - 1].Logical >= Items[lo - 1].Length)
+        return false;
+    index = lo - 1;
+    return true;
+}
+
 NanoFs::NanoFs(BlockDevice* dev)
     : Io(dev, NanoBlockSize)
+    , Journal(Io)
     , Super(nullptr)
+    , DataBlocks(0)
+    , DataBitmap(nullptr)
+    , BitmapDirty(nullptr)
+    , InodeBitmap(nullptr)
+    , InodeBitmapDirty(0)
+    , AllocHint(0)
+    , DiscardBitmap(nullptr)
+    , DiscardPending(0)
+    , InodeBuf(nullptr)
+    , CsumBuf(nullptr)
+    , CsumBlock(NanoNoBlock)
     , Mounted(false)
 {
-    Stdlib::MemSet(VNodes, 0, sizeof(VNodes));
-    Stdlib::MemSet(LoadInProgress, 0, sizeof(LoadInProgress));
 }
 
 NanoFs::~NanoFs()
 {
     Unmount();
+    ReleaseGeometry();
     delete Super;
     Super = nullptr;
 }
@@ -32,18 +177,63 @@ void NanoFs::Unmount()
     if (!Mounted)
         return;
 
-    FlushSuper();
+    CommitJournal();
+    Journal.Close();
     Io.Flush();
+    IssueDiscards(true);
     Mounted = false;
 
-    for (u32 i = 0; i < NanoInodeCount; i++)
+    VNodes.Clear();
+    ReleaseGeometry();
+}
+
+bool NanoFs::Sync()
+{
+    if (!Mounted)
+        return false;
+
+    if (!CommitJournal() || !Io.Flush())
+        return false;
+
+    IssueDiscards(true);
+    return true;
+}
+
+u64 NanoFs::GetTransaction()
+{
+    if (!Mounted || !Journal.IsOpen())
+        return 0;
+    if (!Journal.HasRunning() && PendingFree.GetCount() == 0)
+        return 0;
+    return Journal.GetSequence();
+}
+
+/* Committed already if a later transaction is running */
+bool NanoFs::Commit(u64 transaction)
+{
+    if (!Mounted || !Journal.IsOpen() || transaction == 0 ||
+        transaction < Journal.GetSequence())
+        return true;
+    return CommitJournal();
+}
+
+bool NanoFs::SetJournal(bool on)
+{
+    if (!Mounted || Super->JournalBlocks == 0)
+        return false;
+
+    if (!on)
     {
-        if (VNodes[i] != nullptr)
-        {
-            delete VNodes[i];
-            VNodes[i] = nullptr;
-        }
+        bool ok = CommitJournal();
+        return Journal.Close() && ok;
     }
+
+    /* Everything home first: the log starts out empty */
+    if (Journal.IsOpen())
+        return true;
+    if (!FlushSuper() || !Io.Commit())
+        return false;
+    return Journal.Open(Super->JournalStart, Super->JournalBlocks, Super->TotalBlocks);
 }
 
 BlockDevice* NanoFs::GetDevice()
@@ -81,7 +271,11 @@ bool NanoFs::Mount()
         return false;
     }
 
-    if (Super->Version != NanoVersion)
+    if (Super->Version != NanoVersion && Super->Version != NanoVersionV6 &&
+        Super->Version != NanoVersionV5 &&
+        Super->Version != NanoVersionV4 &&
+        Super->Version != NanoVersionV3 && Super->Version != NanoVersionV2 &&
+        Super->Version != NanoVersionV1)
     {
         Trace(0, "NanoFs: unsupported version %u", (ulong)Super->Version);
         return false;
@@ -93,40 +287,350 @@ bool NanoFs::Mount()
         return false;
     }
 
-    /* All I/O uses the on-disk layout fields directly; a forged image
-       (e.g. InodeStartBlock = 0) would alias the superblock */
-    if (Super->BlockSize != NanoBlockSize ||
-        Super->InodeCount != NanoInodeCount ||
-        Super->DataBlockCount != NanoDataBlockCount ||
-        Super->InodeStartBlock != NanoInodeStart ||
-        Super->DataStartBlock != NanoDataStart)
+    /* Replay first: the superblock itself may be in the log */
+    if (Super->Version >= NanoVersionV5 && Super->JournalBlocks != 0 && !OpenJournal())
+        return false;
+
+    if (!LoadGeometry())
     {
-        Trace(0, "NanoFs: unsupported layout (blockSize %u inodes %u dataBlocks %u inodeStart %u dataStart %u)",
-              (ulong)Super->BlockSize, (ulong)Super->InodeCount,
-              (ulong)Super->DataBlockCount, (ulong)Super->InodeStartBlock,
-              (ulong)Super->DataStartBlock);
+        Journal.Close();
         return false;
     }
 
-    // Load root VNode (inode 0)
-    if (LoadVNode(0) == nullptr)
+    if (Super->Version != NanoVersion)
+    {
+        if (!Upgrade())
+        {
+            Trace(0, "NanoFs: upgrade from version %u failed", (ulong)Super->Version);
+            ReleaseGeometry();
+            return false;
+        }
+        if (Super->JournalBlocks != 0 && !Journal.IsOpen() && !OpenJournal())
+        {
+            ReleaseGeometry();
+            return false;
+        }
+    }
+
+    /* A few batches instead of a read per inode block as
+       MarkInUseAllocated and lookups go */
+    WarmInodeTable();
+
+    /* Only the root: directories are read as they are looked up */
+    VNode* root = LoadVNode(0);
+    if (root == nullptr || root->NodeType != VNode::TypeDir)
     {
         Trace(0, "NanoFs: failed to load root inode");
+        VNodes.Clear();
+        Journal.Close();
+        ReleaseGeometry();
         return false;
     }
 
-    MarkReachableAllocated();
+    MarkInUseAllocated();
+    if (Journal.HasRunning())
+        Journal.Commit();
 
     Mounted = true;
-    Trace(0, "NanoFs: mounted, %u inodes, %u data blocks",
-          (ulong)Super->InodeCount, (ulong)Super->DataBlockCount);
+    Trace(0, "NanoFs: mounted, %u inodes, %u data blocks, journal %u blocks",
+          (ulong)Super->InodeCount, (ulong)Super->DataBlockCount, (ulong)Super->JournalBlocks);
+    return true;
+}
+
+static bool RangesOverlap(u64 a, u64 aLen, u64 b, u64 bLen)
+{
+    return aLen != 0 && bLen != 0 && a < b + bLen && b < a + aLen;
+}
+
+/* A metadata region is either its own or, carved out by an upgrade,
+   wholly inside the data area */
+static bool RegionFits(u64 start, u64 len, u64 total, u64 dataStart, u64 data)
+{
+    if (start < 1 || start + len > total)
+        return false;
+    if (start >= dataStart && start + len <= dataStart + data)
+        return true;
+    return !RangesOverlap(start, len, dataStart, data);
+}
+
+/* All I/O uses the on-disk layout fields directly; a forged image (e.g.
+   InodeStartBlock = 0) would alias the superblock or let one region
+   overwrite another.  Checks the layout and loads the data bitmap. */
+bool NanoFs::LoadGeometry()
+{
+    ReleaseGeometry();
+
+    bool legacy = (Super->Version < NanoVersionV3);
+    if (legacy)
+    {
+        if (Super->BlockSize != NanoBlockSize ||
+            Super->InodeCount != NanoLegacyInodeCount ||
+            Super->DataBlockCount != NanoLegacyDataBlocks ||
+            Super->InodeStartBlock != NanoLegacyInodeStart ||
+            Super->DataStartBlock != NanoLegacyDataStart)
+        {
+            Trace(0, "NanoFs: unsupported v%u layout (blockSize %u inodes %u dataBlocks %u inodeStart %u dataStart %u)",
+                  (ulong)Super->Version, (ulong)Super->BlockSize, (ulong)Super->InodeCount,
+                  (ulong)Super->DataBlockCount, (ulong)Super->InodeStartBlock,
+                  (ulong)Super->DataStartBlock);
+            return false;
+        }
+
+        /* Fields a previous, interrupted upgrade may have set */
+        if (Super->ChecksumBlocks == 0)
+        {
+            Super->TotalBlocks = NanoLegacyDataStart + NanoLegacyDataBlocks;
+            Super->DataBitmapStart = 0;
+            Super->DataBitmapBlocks = 0;
+            Super->ChecksumStart = 0;
+        }
+    }
+
+    /* Padding before v5 */
+    if (Super->Version < NanoVersionV5)
+    {
+        Super->JournalStart = 0;
+        Super->JournalBlocks = 0;
+    }
+
+    /* Padding before v7 */
+    if (Super->Version < NanoVersion)
+    {
+        Super->InodeBitmapStart = 0;
+        Super->InodeBitmapBlocks = 0;
+    }
+
+    u64 devBlocks = 0;
+    BlockDevice* dev = Io.GetDevice();
+    if (dev != nullptr)
+        devBlocks = dev->GetCapacity() * dev->GetSectorSize() / NanoBlockSize;
+
+    u32 data = Super->DataBlockCount;
+    u64 total = Super->TotalBlocks;
+    u32 bitmapBlocks = (data + NanoBitsPerBlock - 1) / NanoBitsPerBlock;
+    u32 csumBlocks = (data + NanoChecksumsPerBlock - 1) / NanoChecksumsPerBlock;
+    u32 inodeCount = Super->InodeCount;
+    u32 inodeBlocks = (Super->Version >= NanoVersionV4) ? inodeCount / NanoInodesPerBlock : inodeCount;
+    u32 inodeBitmapBlocks = (inodeCount + NanoBitsPerBlock - 1) / NanoBitsPerBlock;
+    bool inSuper = (Super->DataBitmapBlocks == 0);
+    bool inodesInSuper = (Super->InodeBitmapBlocks == 0);
+    u64 inodes = Super->InodeStartBlock;
+    u64 inodeBitmap = Super->InodeBitmapStart;
+    u64 dataStart = Super->DataStartBlock;
+    u64 csum = Super->ChecksumStart;
+    u64 bitmap = Super->DataBitmapStart;
+    u64 journal = Super->JournalStart;
+    u32 journalBlocks = Super->JournalBlocks;
+
+    bool ok = Super->BlockSize == NanoBlockSize &&
+              data >= 1 && data <= NanoMaxDataBlocks &&
+              total <= devBlocks &&
+              dataStart >= 1 && dataStart + data <= total &&
+              RegionFits(inodes, inodeBlocks, total, dataStart, data);
+
+    /* The bitmap stays in the superblock on images from v1/v2 */
+    if (ok && inSuper)
+    {
+        ok = data <= sizeof(Super->DataBitmap) * 8;
+    }
+    else if (ok)
+    {
+        ok = Super->DataBitmapBlocks == bitmapBlocks &&
+             bitmap >= 1 && bitmap + bitmapBlocks <= total &&
+             !RangesOverlap(bitmap, bitmapBlocks, inodes, inodeBlocks) &&
+             !RangesOverlap(bitmap, bitmapBlocks, dataStart, data);
+    }
+
+    /* And so does the inode bitmap, with 1024 inodes, on images before v7 */
+    if (ok && inodesInSuper)
+    {
+        ok = inodeCount == NanoLegacyInodeCount;
+    }
+    else if (ok)
+    {
+        ok = inodeCount >= NanoMinInodeCount && inodeCount <= NanoMaxInodeCount &&
+             inodeCount % NanoInodesPerBlock == 0 &&
+             Super->InodeBitmapBlocks == inodeBitmapBlocks &&
+             inodeBitmap >= 1 && inodeBitmap + inodeBitmapBlocks <= total &&
+             !RangesOverlap(inodeBitmap, inodeBitmapBlocks, inodes, inodeBlocks) &&
+             !RangesOverlap(inodeBitmap, inodeBitmapBlocks, dataStart, data) &&
+             (inSuper || !RangesOverlap(inodeBitmap, inodeBitmapBlocks, bitmap, Super->DataBitmapBlocks));
+    }
+
+    if (ok && Super->ChecksumBlocks != 0)
+    {
+        ok = Super->ChecksumBlocks >= csumBlocks &&
+             RegionFits(csum, Super->ChecksumBlocks, total, dataStart, data) &&
+             !RangesOverlap(csum, Super->ChecksumBlocks, inodes, inodeBlocks) &&
+             (inSuper || !RangesOverlap(csum, Super->ChecksumBlocks, bitmap, bitmapBlocks)) &&
+             (inodesInSuper || !RangesOverlap(csum, Super->ChecksumBlocks, inodeBitmap, inodeBitmapBlocks));
+    }
+    else if (ok)
+    {
+        ok = legacy;
+    }
+
+    if (ok && journalBlocks != 0)
+    {
+        ok = journalBlocks >= NanoJournalMinBlocks && journalBlocks <= NanoJournalMaxBlocks &&
+             RegionFits(journal, journalBlocks, total, dataStart, data) &&
+             !RangesOverlap(journal, journalBlocks, inodes, inodeBlocks) &&
+             !RangesOverlap(journal, journalBlocks, csum, Super->ChecksumBlocks) &&
+             (inSuper || !RangesOverlap(journal, journalBlocks, bitmap, bitmapBlocks)) &&
+             (inodesInSuper || !RangesOverlap(journal, journalBlocks, inodeBitmap, inodeBitmapBlocks));
+    }
+
+    if (!ok)
+    {
+        Trace(0, "NanoFs: bad layout (total %u of %u, data %u at %u, inodes %u at %u, bitmap %u at %u, inode bitmap %u at %u, checksums %u at %u, journal %u at %u)",
+              total, devBlocks, (ulong)data, dataStart, (ulong)inodeCount, inodes,
+              (ulong)Super->DataBitmapBlocks, bitmap, (ulong)Super->InodeBitmapBlocks, inodeBitmap,
+              (ulong)Super->ChecksumBlocks, csum, (ulong)journalBlocks, journal);
+        return false;
+    }
+
+    DataBlocks = data;
+    BitmapDirty = new (Mm::NoThrow) u8[inSuper ? 1 : bitmapBlocks];
+    DiscardBitmap = (u8*)Mm::Alloc((ulong)bitmapBlocks * NanoBlockSize, 0);
+    CsumBuf = (u32*)Mm::Alloc(NanoBlockSize, 0);
+    InodeBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if (!inSuper)
+        DataBitmap = (u8*)Mm::Alloc((ulong)bitmapBlocks * NanoBlockSize, 0);
+    else
+        DataBitmap = Super->DataBitmap;
+    if (!inodesInSuper)
+        InodeBitmap = (u8*)Mm::Alloc((ulong)inodeBitmapBlocks * NanoBlockSize, 0);
+    else
+        InodeBitmap = Super->InodeBitmap;
+
+    if (BitmapDirty == nullptr || DiscardBitmap == nullptr || CsumBuf == nullptr ||
+        InodeBuf == nullptr || DataBitmap == nullptr || InodeBitmap == nullptr)
+    {
+        Trace(0, "NanoFs: alloc bitmaps for %u data blocks failed", (ulong)data);
+        ReleaseGeometry();
+        return false;
+    }
+
+    Stdlib::MemSet(BitmapDirty, 0, inSuper ? 1 : bitmapBlocks);
+    Stdlib::MemSet(DiscardBitmap, 0, (ulong)bitmapBlocks * NanoBlockSize);
+    DiscardPending = 0;
+    InodeBitmapDirty = 0;
+    CsumBlock = NanoNoBlock;
+    AllocHint = 0;
+
+    if (!inSuper && !Io.ReadBlockRange(Super->DataBitmapStart, bitmapBlocks, DataBitmap))
+    {
+        Trace(0, "NanoFs: read data bitmap failed");
+        ReleaseGeometry();
+        return false;
+    }
+    if (!inodesInSuper && !Io.ReadBlockRange(Super->InodeBitmapStart, inodeBitmapBlocks, InodeBitmap))
+    {
+        Trace(0, "NanoFs: read inode bitmap failed");
+        ReleaseGeometry();
+        return false;
+    }
     return true;
 }
 
+void NanoFs::ReleaseGeometry()
+{
+    if (Super != nullptr && DataBitmap != Super->DataBitmap && DataBitmap != nullptr)
+        Mm::Free(DataBitmap);
+    DataBitmap = nullptr;
+    if (Super != nullptr && InodeBitmap != Super->InodeBitmap && InodeBitmap != nullptr)
+        Mm::Free(InodeBitmap);
+    InodeBitmap = nullptr;
+    InodeBitmapDirty = 0;
+    delete[] BitmapDirty;
+    BitmapDirty = nullptr;
+    if (DiscardBitmap != nullptr)
+        Mm::Free(DiscardBitmap);
+    DiscardBitmap = nullptr;
+    DiscardPending = 0;
+    if (CsumBuf != nullptr)
+        Mm::Free(CsumBuf);
+    CsumBuf = nullptr;
+    CsumBlock = NanoNoBlock;
+    if (InodeBuf != nullptr)
+        Mm::Free(InodeBuf);
+    InodeBuf = nullptr;
+    DataBlocks = 0;
+}
+
+/* One inode per NanoBlocksPerInode data blocks within the limits, whole
+   inode table blocks */
+static u32 InodeCountFor(u64 data)
+{
+    u64 count = data / NanoBlocksPerInode;
+    if (count < NanoMinInodeCount)
+        count = NanoMinInodeCount;
+    if (count > NanoMaxInodeCount)
+        count = NanoMaxInodeCount;
+    return (u32)((count + NanoInodesPerBlock - 1) / NanoInodesPerBlock * NanoInodesPerBlock);
+}
+
+/* A 64th of the device within the journal's limits; none below 4 MB */
+static u32 JournalSize(u64 blocks)
+{
+    if (blocks < 8 * (u64)NanoJournalMinBlocks)
+        return 0;
+
+    u64 size = blocks / 64;
+    if (size < NanoJournalMinBlocks)
+        size = NanoJournalMinBlocks;
+    if (size > NanoJournalMaxBlocks)
+        size = NanoJournalMaxBlocks;
+    return (u32)size;
+}
+
 bool NanoFs::Format(BlockDevice* dev)
 {
     BlockIo io(dev, NanoBlockSize);
 
+    /* Size the regions from the device: the data area takes what the
+       superblock, journal, bitmaps, checksum table and inode table leave,
+       the last three sized in turn from the data area */
+    u64 devBlocks = 0;
+    if (dev != nullptr && dev->GetSectorSize() != 0)
+        devBlocks = dev->GetCapacity() * dev->GetSectorSize() / NanoBlockSize;
+
+    u32 journalBlocks = JournalSize(devBlocks);
+    u64 overhead = 1 + journalBlocks;
+    if (devBlocks <= overhead + NanoMinInodeCount / NanoInodesPerBlock + 3 + NanoMinDataBlocks)
+    {
+        Trace(0, "NanoFs::Format: device too small (%u blocks)", devBlocks);
+        return false;
+    }
+
+    u64 data = devBlocks - overhead - NanoMinInodeCount / NanoInodesPerBlock;
+    if (data > NanoMaxDataBlocks)
+        data = NanoMaxDataBlocks;
+    u32 bitmapBlocks = 0;
+    u32 csumBlocks = 0;
+    u32 inodeCount = 0;
+    u32 inodeBlocks = 0;
+    u32 inodeBitmapBlocks = 0;
+    for (u32 pass = 0; pass < 4; pass++)
+    {
+        bitmapBlocks = (u32)((data + NanoBitsPerBlock - 1) / NanoBitsPerBlock);
+        csumBlocks = (u32)((data + NanoChecksumsPerBlock - 1) / NanoChecksumsPerBlock);
+        inodeCount = InodeCountFor(data);
+        inodeBlocks = inodeCount / NanoInodesPerBlock;
+        inodeBitmapBlocks = (inodeCount + NanoBitsPerBlock - 1) / NanoBitsPerBlock;
+        u64 avail = devBlocks - overhead - bitmapBlocks - csumBlocks - inodeBlocks - inodeBitmapBlocks;
+        if (data > avail)
+            data = avail;
+    }
+
+    /* Only ever shrunk above: sized again for what is left, the regions
+       fit in what they were carved from */
+    bitmapBlocks = (u32)((data + NanoBitsPerBlock - 1) / NanoBitsPerBlock);
+    csumBlocks = (u32)((data + NanoChecksumsPerBlock - 1) / NanoChecksumsPerBlock);
+    inodeCount = InodeCountFor(data);
+    inodeBlocks = inodeCount / NanoInodesPerBlock;
+    inodeBitmapBlocks = (inodeCount + NanoBitsPerBlock - 1) / NanoBitsPerBlock;
+
     NanoSuperBlock* super = new (Mm::NoThrow) NanoSuperBlock();
     if (super == nullptr)
     {
@@ -139,10 +643,19 @@ bool NanoFs::Format(BlockDevice* dev)
     super->Magic = NanoMagic;
     super->Version = NanoVersion;
     super->BlockSize = NanoBlockSize;
-    super->InodeCount = NanoInodeCount;
-    super->DataBlockCount = NanoDataBlockCount;
-    super->InodeStartBlock = NanoInodeStart;
-    super->DataStartBlock = NanoDataStart;
+    super->InodeCount = inodeCount;
+    super->DataBlockCount = (u32)data;
+    super->DataBitmapStart = 1;
+    super->DataBitmapBlocks = bitmapBlocks;
+    super->InodeBitmapStart = super->DataBitmapStart + bitmapBlocks;
+    super->InodeBitmapBlocks = inodeBitmapBlocks;
+    super->ChecksumStart = super->InodeBitmapStart + inodeBitmapBlocks;
+    super->ChecksumBlocks = csumBlocks;
+    super->InodeStartBlock = super->ChecksumStart + csumBlocks;
+    super->JournalStart = super->InodeStartBlock + inodeBlocks;
+    super->JournalBlocks = journalBlocks;
+    super->DataStartBlock = super->JournalStart + journalBlocks;
+    super->TotalBlocks = super->DataStartBlock + (u32)data;
 
     // Generate UUID from TSC + uptime
     u64 tsc = Hal::ReadCycleCounter();
@@ -160,70 +673,96 @@ bool NanoFs::Format(BlockDevice* dev)
     Stdlib::MemCpy(&super->Uuid[8], &h3, 4);
     Stdlib::MemCpy(&super->Uuid[12], &h4, 4);
 
-    // Mark inode 0 as used (root dir)
-    Stdlib::Bitmap inodeBm(super->InodeBitmap, NanoInodeCount);
-    inodeBm.SetBit(0);
-
-    // Allocate one data block for root directory entries
-    Stdlib::Bitmap dataBm(super->DataBitmap, NanoDataBlockCount);
-    dataBm.SetBit(0);
-
     // Compute superblock checksum
     super->Checksum = 0;
     super->Checksum = Stdlib::Crc32(super, sizeof(*super));
 
-    bool ok = io.WriteBlock(0, super);
-    delete super;
+    /* One zeroed block serves the bitmaps, inode table and root dir */
+    u8* blockBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if (blockBuf == nullptr)
+    {
+        Trace(0, "NanoFs::Format: alloc block buf failed");
+        delete super;
+        return false;
+    }
 
+    // Data bitmap: only block 0 (root directory entries) is used; inode
+    // bitmap: only inode 0 (root directory).  The checksum table needs no
+    // initialisation: entries are only consulted for blocks a file wrote.
+    bool ok = true;
+    for (u32 i = 0; i < bitmapBlocks + inodeBitmapBlocks && ok; i++)
+    {
+        Stdlib::MemSet(blockBuf, 0, NanoBlockSize);
+        if (i == 0 || i == bitmapBlocks)
+            blockBuf[0] = 1;
+        ok = io.WriteBlock(super->DataBitmapStart + i, blockBuf);
+    }
     if (!ok)
     {
-        Trace(0, "NanoFs::Format: failed to write superblock");
+        Trace(0, "NanoFs::Format: failed to write bitmaps");
+        Mm::Free(blockBuf);
+        delete super;
         return false;
     }
 
-    // Write root inode (inode 0)
-    NanoInode* rootInode = new (Mm::NoThrow) NanoInode();
-    if (rootInode == nullptr)
+    // Inode table: root inode (inode 0) in the first block, the rest free
+    for (u32 i = 0; i < inodeBlocks && ok; i++)
+    {
+        Stdlib::MemSet(blockBuf, 0, NanoBlockSize);
+        if (i == 0)
+        {
+            NanoInode* rootInode = (NanoInode*)blockBuf;
+            rootInode->Type = NanoInodeTypeDir;
+            rootInode->Size = 0;
+            Stdlib::StrnCpy(rootInode->Name, "/", sizeof(rootInode->Name));
+            rootInode->ParentInode = 0;
+            rootInode->Flags = NanoInodeFlagHashedDir;
+            rootInode->RootCount = 1;
+            rootInode->ExtentCount = 1;
+            rootInode->Root[0].Logical = 0;
+            rootInode->Root[0].Start = 0; // first data block
+            rootInode->Root[0].Length = 1;
+
+            rootInode->Checksum = 0;
+            rootInode->Checksum = Stdlib::Crc32(rootInode, sizeof(*rootInode));
+        }
+        ok = io.WriteBlock(super->InodeStartBlock + i, blockBuf);
+    }
+    if (!ok)
     {
-        Trace(0, "NanoFs::Format: alloc root inode failed");
+        Trace(0, "NanoFs::Format: failed to write inode table");
+        Mm::Free(blockBuf);
+        delete super;
         return false;
     }
 
-    Stdlib::MemSet(rootInode, 0, sizeof(*rootInode));
-    rootInode->Type = NanoInodeTypeDir;
-    rootInode->Size = 0;
-    Stdlib::StrnCpy(rootInode->Name, "/", sizeof(rootInode->Name));
-    rootInode->ParentInode = 0;
-    rootInode->Blocks[0] = 0; // first data block
-    rootInode->DataChecksum = 0;
-
-    rootInode->Checksum = 0;
-    rootInode->Checksum = Stdlib::Crc32(rootInode, sizeof(*rootInode));
-
-    ok = io.WriteBlock(NanoInodeStart, rootInode);
-    delete rootInode;
+    // Zero out the root directory data block
+    Stdlib::MemSet(blockBuf, 0, NanoBlockSize);
+    ok = io.WriteBlock(super->DataStartBlock, blockBuf);
+    Mm::Free(blockBuf);
 
     if (!ok)
     {
-        Trace(0, "NanoFs::Format: failed to write root inode");
+        Trace(0, "NanoFs::Format: failed to write root dir data");
+        delete super;
         return false;
     }
 
-    // Zero out the root directory data block - reuse inode buffer space
-    u8* zeroBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (zeroBuf == nullptr)
+    if (journalBlocks != 0 && !NanoJournal::Format(io, super->JournalStart, journalBlocks))
     {
-        Trace(0, "NanoFs::Format: alloc zero buf failed");
+        Trace(0, "NanoFs::Format: failed to write journal");
+        delete super;
         return false;
     }
 
-    Stdlib::MemSet(zeroBuf, 0, NanoBlockSize);
-    ok = io.WriteBlock(NanoDataStart, zeroBuf);
-    Mm::Free(zeroBuf);
+    /* The superblock goes last, once everything it describes is written */
+    ok = io.WriteBlock(0, super);
+    u32 dataBlocks = super->DataBlockCount;
+    delete super;
 
     if (!ok)
     {
-        Trace(0, "NanoFs::Format: failed to write root dir data");
+        Trace(0, "NanoFs::Format: failed to write superblock");
         return false;
     }
 
@@ -233,7 +772,8 @@ bool NanoFs::Format(BlockDevice* dev)
         return false;
     }
 
-    Trace(0, "NanoFs::Format: done");
+    Trace(0, "NanoFs::Format: done, %u inodes, %u data blocks, journal %u blocks",
+          (ulong)inodeCount, (ulong)dataBlocks, (ulong)journalBlocks);
     return true;
 }
 
@@ -267,597 +807,2031 @@ void NanoFs::GetInfo(char* buf, ulong bufSize)
 
 VNode* NanoFs::GetRoot()
 {
-    return VNodes[0];
+    return VNodes.Find(0);
 }
 
 // --- Inode I/O ---
 
 bool NanoFs::ReadInode(u32 idx, NanoInode* out)
 {
-    if (idx >= NanoInodeCount)
+    if (idx >= Super->InodeCount)
     {
         Trace(0, "NanoFs::ReadInode: idx %u out of range", (ulong)idx);
         return false;
     }
 
-    if (!Io.ReadBlock(Super->InodeStartBlock + idx, out))
+    if (!ReadMeta(Super->InodeStartBlock + idx / NanoInodesPerBlock, InodeBuf))
     {
         Trace(0, "NanoFs::ReadInode: read block failed idx %u", (ulong)idx);
         return false;
     }
+
+    Stdlib::MemCpy(out, InodeBuf + (idx % NanoInodesPerBlock) * NanoInodeSize, NanoInodeSize);
     return true;
 }
 
+/* Read-modify-write of the table block: the other inodes in it are
+   written back as they are */
 bool NanoFs::WriteInode(u32 idx, const NanoInode* in, bool fua)
 {
-    if (idx >= NanoInodeCount)
+    if (idx >= Super->InodeCount)
     {
         Trace(0, "NanoFs::WriteInode: idx %u out of range", (ulong)idx);
         return false;
     }
 
-    if (!Io.WriteBlock(Super->InodeStartBlock + idx, in, fua))
+    u32 block = Super->InodeStartBlock + idx / NanoInodesPerBlock;
+    if (!ReadMeta(block, InodeBuf))
     {
-        Trace(0, "NanoFs::WriteInode: write block failed idx %u", (ulong)idx);
+        Trace(0, "NanoFs::WriteInode: read block failed idx %u", (ulong)idx);
         return false;
     }
-    return true;
-}
 
-bool NanoFs::FlushSuper()
-{
-    ComputeSuperChecksum();
-    if (!Io.WriteBlock(0, Super, true))
+    Stdlib::MemCpy(InodeBuf + (idx % NanoInodesPerBlock) * NanoInodeSize, in, NanoInodeSize);
+    if (!WriteMeta(block, InodeBuf, fua))
     {
-        Trace(0, "NanoFs::FlushSuper: write failed");
+        Trace(0, "NanoFs::WriteInode: write block failed idx %u", (ulong)idx);
         return false;
     }
     return true;
 }
 
-// --- Bitmap helpers ---
-
-/* Alloc* only set the bit in memory; the caller commits the bitmap with
-   FlushSuper *after* the inode/block contents are written, so a crash in
-   between leaves the slot free instead of leaked. Free* flush themselves. */
-long NanoFs::AllocInode()
+/* Bring the whole inode table into the buffer cache in batches of
+   NanoReadBatch blocks; best effort, ReadInode reads whatever is missing */
+bool NanoFs::WarmInodeTable()
 {
-    Stdlib::Bitmap bm(Super->InodeBitmap, NanoInodeCount);
-    long idx = bm.FindSetZeroBit();
-    if (idx < 0)
+    u32 tableBlocks = InodeTableBlocks();
+    u32 batch = (tableBlocks < NanoReadBatch) ? tableBlocks : NanoReadBatch;
+    u8* buf = (u8*)Mm::Alloc(batch * NanoBlockSize, 0);
+    if (buf == nullptr)
+        return false;
+
+    bool ok = true;
+    for (u32 done = 0; done < tableBlocks && ok; done += batch)
     {
-        Trace(0, "NanoFs::AllocInode: no free inodes");
-        return -1;
+        u32 count = (tableBlocks - done < batch) ? tableBlocks - done : batch;
+        ok = Io.ReadBlockRange(Super->InodeStartBlock + done, count, buf);
     }
-    return idx;
+    Mm::Free(buf);
+    return ok;
 }
 
-void NanoFs::FreeInode(u32 idx)
+/* One inode per block before v4 */
+u32 NanoFs::InodeTableBlocks()
 {
-    if (idx >= NanoInodeCount)
-        return;
-    Stdlib::Bitmap bm(Super->InodeBitmap, NanoInodeCount);
-    bm.ClearBit(idx);
-    FlushSuper();
+    if (Super->Version < NanoVersionV4)
+        return Super->InodeCount;
+    return Super->InodeCount / NanoInodesPerBlock;
 }
 
-long NanoFs::AllocDataBlock()
+/* Every inode but the root, as far as the largest table holds */
+u32 NanoFs::MaxDirEntries()
 {
-    Stdlib::Bitmap bm(Super->DataBitmap, NanoDataBlockCount);
-    long idx = bm.FindSetZeroBit();
-    if (idx < 0)
-    {
-        Trace(0, "NanoFs::AllocDataBlock: no free data blocks");
-        return -1;
-    }
-    return idx;
+    u32 inodes = Super->InodeCount - 1;
+    return (inodes < NanoDirMaxEntries) ? inodes : NanoDirMaxEntries;
 }
 
-void NanoFs::FreeDataBlock(u32 idx)
+/* Dirty bitmap blocks first, then the superblock (the commit point of
+   the bitmaps kept in it on upgraded images), all FUA.  With the journal
+   open they join the running transaction instead. */
+bool NanoFs::FlushSuper()
 {
-    if (idx >= NanoDataBlockCount)
-        return;
-    Stdlib::Bitmap bm(Super->DataBitmap, NanoDataBlockCount);
-    bm.ClearBit(idx);
-    FlushSuper();
-}
-
-/* Checksums are integrity, not authentication: a crafted image can carry a
-   valid, checksummed, reachable inode whose allocation bit is clear, or
-   live data blocks unmarked in the data bitmap. AllocInode/AllocDataBlock
-   would then hand out live metadata and the next create/write would clobber
-   the tree (e.g. the root directory's data block). Re-mark everything
-   reachable from the root as allocated; repairs persist with the next
-   superblock flush. Runs at mount, after LoadVNode(0) filled VNodes[]. */
-void NanoFs::MarkReachableAllocated()
-{
-    Stdlib::Bitmap inodeBm(Super->InodeBitmap, NanoInodeCount);
-    Stdlib::Bitmap dataBm(Super->DataBitmap, NanoDataBlockCount);
-
-    NanoInode* inode = new (Mm::NoThrow) NanoInode();
-    if (inode == nullptr)
-    {
-        Trace(0, "NanoFs: alloc inode failed, bitmap repair skipped");
-        return;
-    }
-
-    bool repaired = false;
-    for (u32 i = 0; i < NanoInodeCount; i++)
+    for (u32 i = 0; i < Super->DataBitmapBlocks; i++)
     {
-        if (VNodes[i] == nullptr)
+        if (!BitmapDirty[i])
             continue;
-
-        if (!inodeBm.TestBit(i))
+        if (!WriteMeta(Super->DataBitmapStart + i, DataBitmap + (ulong)i * NanoBlockSize, true))
         {
-            Trace(0, "NanoFs: reachable inode %u not marked allocated, repairing",
-                  (ulong)i);
-            inodeBm.SetBit(i);
-            repaired = true;
+            Trace(0, "NanoFs::FlushSuper: write bitmap block %u failed", (ulong)i);
+            return false;
         }
+        BitmapDirty[i] = 0;
+    }
 
-        if (!ReadInode(i, inode))
+    for (u32 i = 0; i < Super->InodeBitmapBlocks; i++)
+    {
+        if (!(InodeBitmapDirty & (1u << i)))
             continue;
-
-        u32 usedBlocks;
-        if (inode->Type == NanoInodeTypeDir)
-            usedBlocks = (inode->Size > 0) ? 1 : 0;
-        else
-            usedBlocks = (u32)(((u64)inode->Size + NanoBlockSize - 1) / NanoBlockSize);
-        if (usedBlocks > NanoMaxBlocks)
-            usedBlocks = NanoMaxBlocks;
-
-        for (u32 j = 0; j < usedBlocks; j++)
+        if (!WriteMeta(Super->InodeBitmapStart + i, InodeBitmap + (ulong)i * NanoBlockSize, true))
         {
-            u32 b = inode->Blocks[j];
-            if (b >= NanoDataBlockCount || dataBm.TestBit(b))
-                continue;
-            Trace(0, "NanoFs: live data block %u (inode %u) not marked allocated, repairing",
-                  (ulong)b, (ulong)i);
-            dataBm.SetBit(b);
-            repaired = true;
+            Trace(0, "NanoFs::FlushSuper: write inode bitmap block %u failed", (ulong)i);
+            return false;
         }
+        InodeBitmapDirty &= ~(1u << i);
     }
 
-    delete inode;
-
-    if (repaired)
-        FlushSuper();
+    ComputeSuperChecksum();
+    if (!WriteMeta(0, Super, true))
+    {
+        Trace(0, "NanoFs::FlushSuper: write failed");
+        return false;
+    }
+    return true;
 }
 
-// --- Checksum helpers ---
-
-void NanoFs::ComputeSuperChecksum()
+bool NanoFs::ReadMeta(u32 block, void* buf)
 {
-    Super->Checksum = 0;
-    Super->Checksum = Stdlib::Crc32(Super, sizeof(*Super));
+    if (Journal.IsOpen() && Journal.Read(block, buf))
+        return true;
+    return Io.ReadBlock(block, buf);
 }
 
-bool NanoFs::VerifySuperChecksum()
+bool NanoFs::WriteMeta(u32 block, const void* buf, bool fua)
 {
-    u32 saved = Super->Checksum;
-    Super->Checksum = 0;
-    u32 computed = Stdlib::Crc32(Super, sizeof(*Super));
-    Super->Checksum = saved;
-    return computed == saved;
+    if (Journal.IsOpen())
+        return Journal.Log(block, buf);
+    return Io.WriteBlock(block, buf, fua);
 }
 
-void NanoFs::ComputeInodeChecksum(NanoInode* inode)
+/* Checks the region far enough for replay to write only inside the
+   image, replays, then takes the superblock as the log left it */
+bool NanoFs::OpenJournal()
 {
-    inode->Checksum = 0;
-    inode->Checksum = Stdlib::Crc32(inode, sizeof(NanoInode));
+    u64 devBlocks = 0;
+    BlockDevice* dev = Io.GetDevice();
+    if (dev != nullptr)
+        devBlocks = dev->GetCapacity() * dev->GetSectorSize() / NanoBlockSize;
+
+    u64 start = Super->JournalStart;
+    u64 blocks = Super->JournalBlocks;
+    if (Super->TotalBlocks > devBlocks || start < 1 || start + blocks > Super->TotalBlocks ||
+        !Journal.Open((u32)start, (u32)blocks, Super->TotalBlocks))
+    {
+        Trace(0, "NanoFs: cannot open journal (%u blocks at %u)", (ulong)blocks, start);
+        return false;
+    }
+
+    if (!Io.ReadBlock(0, Super) || Super->Magic != NanoMagic || Super->Version < NanoVersionV5 ||
+        !VerifySuperChecksum() || Super->JournalStart != start || Super->JournalBlocks != blocks)
+    {
+        Trace(0, "NanoFs: bad superblock after journal replay");
+        Journal.Close();
+        return false;
+    }
+    return true;
 }
 
-bool NanoFs::VerifyInodeChecksum(NanoInode* inode)
+/* Data written in place that the running transaction will reference
+   must reach the disk before it: at its commit with the journal open,
+   now without */
+bool NanoFs::OrderData()
 {
-    u32 saved = inode->Checksum;
-    inode->Checksum = 0;
-    u32 computed = Stdlib::Crc32(inode, sizeof(NanoInode));
-    inode->Checksum = saved;
-    return computed == saved;
+    if (Journal.IsOpen())
+    {
+        Journal.OrderData();
+        return true;
+    }
+    return Io.Commit();
 }
 
-u32 NanoFs::ComputeDataChecksum(NanoInode* inode)
+/* Free what the running transaction stopped referencing, in the same
+   transaction, then commit it with one flush; only then may the freed
+   blocks be discarded.  Without the journal the bitmaps go home. */
+bool NanoFs::CommitJournal()
 {
-    if (inode->Type != NanoInodeTypeFile || inode->Size == 0)
-        return 0;
+    if (!Journal.IsOpen())
+        return FlushSuper();
 
-    u8* buf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (buf == nullptr)
-        return 0;
-
-    u32 result = 0;
-    u32 remaining = inode->Size;
-
-    for (u32 i = 0; i < NanoMaxBlocks && remaining > 0; i++)
+    bool ok = true;
+    for (u32 i = 0; i < PendingFree.GetCount(); i++)
     {
-        if (inode->Blocks[i] >= NanoDataBlockCount ||
-            !Io.ReadBlock(Super->DataStartBlock + inode->Blocks[i], buf))
+        const NanoExtent& run = PendingFree.Get(i);
+        for (u32 j = 0; j < run.Length; j++)
         {
-            Mm::Free(buf);
-            return 0;
+            SetDataBit(run.Start + j, false);
+            MarkDiscard(run.Start + j);
+            if (!Journal.Revoke(Super->DataStartBlock + run.Start + j))
+                ok = false;
         }
+    }
+    PendingFree.Clear();
 
-        u32 chunkSize = (remaining < NanoBlockSize) ? remaining : NanoBlockSize;
-        result ^= Stdlib::Crc32(buf, chunkSize);
-        remaining -= chunkSize;
+    if (!ok || !FlushSuper() || !Journal.Commit())
+    {
+        Trace(0, "NanoFs: journal commit failed");
+        return false;
     }
 
-    Mm::Free(buf);
-    return result;
+    IssueDiscards(false);
+    return true;
 }
 
-// --- VNode management ---
+// --- Bitmap helpers ---
 
-VNode* NanoFs::LoadVNode(u32 inodeIdx, u32 depth)
+/* Alloc* only set the bit in memory; the caller commits the bitmap with
+   FlushSuper *after* the inode/block contents are written, so a crash in
+   between leaves the slot free instead of leaked. Free* flush themselves. */
+long NanoFs::AllocInode()
 {
-    if (inodeIdx >= NanoInodeCount)
+    Stdlib::Bitmap bm(InodeBitmap, Super->InodeCount);
+    long idx = bm.FindSetZeroBit();
+    if (idx < 0)
     {
-        Trace(0, "NanoFs::LoadVNode: idx %u out of range", (ulong)inodeIdx);
-        return nullptr;
+        Trace(0, "NanoFs::AllocInode: no free inodes");
+        return -1;
     }
+    if (Super->InodeBitmapBlocks != 0)
+        InodeBitmapDirty |= 1u << (idx / NanoBitsPerBlock);
+    return idx;
+}
 
-    if (depth >= NanoMaxDirDepth)
-    {
-        Trace(0, "NanoFs::LoadVNode: dir depth limit %u hit at inode %u",
-              (ulong)NanoMaxDirDepth, (ulong)inodeIdx);
-        return nullptr;
-    }
+void NanoFs::FreeInode(u32 idx)
+{
+    if (idx >= Super->InodeCount)
+        return;
+    Stdlib::Bitmap bm(InodeBitmap, Super->InodeCount);
+    bm.ClearBit(idx);
+    if (Super->InodeBitmapBlocks != 0)
+        InodeBitmapDirty |= 1u << (idx / NanoBitsPerBlock);
+    FlushSuper();
+}
 
-    if (VNodes[inodeIdx] != nullptr)
-        return VNodes[inodeIdx];
+bool NanoFs::TestDataBit(u32 idx)
+{
+    return (DataBitmap[idx / 8] >> (idx % 8)) & 1;
+}
 
-    NanoInode* inode = new (Mm::NoThrow) NanoInode();
-    if (inode == nullptr)
-    {
-        Trace(0, "NanoFs::LoadVNode: alloc inode failed for %u", (ulong)inodeIdx);
-        return nullptr;
-    }
+void NanoFs::SetDataBit(u32 idx, bool value)
+{
+    if (value)
+        DataBitmap[idx / 8] |= (u8)(1 << (idx % 8));
+    else
+        DataBitmap[idx / 8] &= (u8)~(1 << (idx % 8));
 
-    if (!ReadInode(inodeIdx, inode))
+    if (Super->DataBitmapBlocks != 0)
+        BitmapDirty[idx / NanoBitsPerBlock] = 1;
+
+    /* Reused before its discard went out: it must not be discarded now */
+    if (value)
     {
-        Trace(0, "NanoFs::LoadVNode: read inode %u failed", (ulong)inodeIdx);
-        delete inode;
-        return nullptr;
+        Stdlib::Bitmap discard(DiscardBitmap, DataBlocks);
+        if (discard.TestBit(idx))
+        {
+            discard.ClearBit(idx);
+            DiscardPending--;
+        }
     }
+}
 
-    if (inode->Type == NanoInodeTypeFree)
+/* Free blocks from idx on, at most limit; whole free or used bytes are
+   stepped over at once */
+u32 NanoFs::FreeRunLength(u32 idx, u32 limit)
+{
+    u32 end = (DataBlocks - idx < limit) ? DataBlocks : idx + limit;
+    u32 i = idx;
+    while (i < end)
     {
-        Trace(0, "NanoFs::LoadVNode: inode %u is free", (ulong)inodeIdx);
-        delete inode;
-        return nullptr;
+        if ((i % 8) == 0 && end - i >= 8 && DataBitmap[i / 8] == 0)
+        {
+            i += 8;
+            continue;
+        }
+        if (TestDataBit(i))
+            break;
+        i++;
     }
+    return i - idx;
+}
 
-    if (!VerifyInodeChecksum(inode))
+/* Next fit from AllocHint: the first free run of want blocks, or failing
+   that the longest free run, so a file's blocks stay contiguous where the
+   free space allows */
+bool NanoFs::AllocRun(u32 want, u32& start, u32& length)
+{
+    start = 0;
+    length = 0;
+    if (want == 0)
+        return false;
+
+    u32 bestStart = 0;
+    u32 bestLength = 0;
+    u32 hint = (AllocHint < DataBlocks) ? AllocHint : 0;
+    u32 i = hint;
+    u32 scanned = 0;
+    while (scanned < DataBlocks)
     {
-        Trace(0, "NanoFs::LoadVNode: inode %u checksum mismatch", (ulong)inodeIdx);
-        delete inode;
-        return nullptr;
+        if (i >= DataBlocks)
+            i = 0;
+
+        if ((i % 8) == 0 && DataBlocks - i >= 8 && DataBitmap[i / 8] == 0xFF)
+        {
+            i += 8;
+            scanned += 8;
+            continue;
+        }
+        if (TestDataBit(i))
+        {
+            i++;
+            scanned++;
+            continue;
+        }
+
+        u32 run = FreeRunLength(i, want);
+        if (run > bestLength)
+        {
+            bestStart = i;
+            bestLength = run;
+            if (run == want)
+                break;
+        }
+        i += run;
+        scanned += run;
     }
 
-    VNode* vnode = new (Mm::NoThrow) VNode();
-    if (vnode == nullptr)
+    if (bestLength == 0)
     {
-        Trace(0, "NanoFs::LoadVNode: alloc vnode failed for %u", (ulong)inodeIdx);
-        delete inode;
-        return nullptr;
+        Trace(0, "NanoFs::AllocRun: no free data blocks");
+        return false;
     }
 
-    Stdlib::MemSet(vnode, 0, sizeof(VNode));
-    Stdlib::StrnCpy(vnode->Name, inode->Name, sizeof(vnode->Name));
-    vnode->NodeType = (inode->Type == NanoInodeTypeDir) ? VNode::TypeDir : VNode::TypeFile;
-    vnode->Parent = nullptr;
-    vnode->Children.Init();
-    vnode->SiblingLink.Init();
-    vnode->Data = nullptr;
-    vnode->Size = (inode->Type == NanoInodeTypeFile) ? inode->Size : 0;
-    vnode->Capacity = inodeIdx; // Repurpose Capacity to store inode index
+    for (u32 j = 0; j < bestLength; j++)
+        SetDataBit(bestStart + j, true);
+
+    start = bestStart;
+    length = bestLength;
+    AllocHint = bestStart + bestLength;
+    return true;
+}
 
-    VNodes[inodeIdx] = vnode;
-    LoadInProgress[inodeIdx] = 1;
+long NanoFs::AllocDataBlock()
+{
+    u32 start;
+    u32 length;
+    if (!AllocRun(1, start, length))
+        return -1;
+    return start;
+}
+
+void NanoFs::FreeDataBlock(u32 idx)
+{
+    NanoExtentList runs;
+    if (runs.Add(0, idx, 1))
+        FreeRuns(runs);
+}
 
-    // If directory, load children
-    if (inode->Type == NanoInodeTypeDir && inode->Size > 0)
+/* One bitmap flush for the whole set; with the journal open the blocks
+   wait for the next commit (CommitJournal) */
+void NanoFs::FreeRuns(const NanoExtentList& runs)
+{
+    bool freed = false;
+    for (u32 i = 0; i < runs.GetCount(); i++)
     {
-        // Read dir entries into a heap buffer to avoid 4 KB on stack per recursion level
-        u8* dirBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-        if (dirBuf == nullptr)
-        {
-            Trace(0, "NanoFs::LoadVNode: alloc dir buf failed for inode %u", (ulong)inodeIdx);
-        }
-        else if (inode->Blocks[0] >= NanoDataBlockCount ||
-                 !Io.ReadBlock(Super->DataStartBlock + inode->Blocks[0], dirBuf))
+        const NanoExtent& run = runs.Get(i);
+        if (run.Start >= DataBlocks || run.Length > DataBlocks - run.Start)
+            continue;
+        if (Journal.IsOpen())
         {
-            Trace(0, "NanoFs::LoadVNode: bad or unreadable dir block %u for inode %u",
-                  (ulong)inode->Blocks[0], (ulong)inodeIdx);
-            Mm::Free(dirBuf);
-            dirBuf = nullptr;
+            if (!PendingFree.Add(0, run.Start, run.Length, false))
+                Trace(0, "NanoFs: alloc failed, data blocks %u..%u leaked",
+                      (ulong)run.Start, (ulong)(run.Start + run.Length - 1));
+            continue;
         }
-
-        if (dirBuf != nullptr)
+        for (u32 j = 0; j < run.Length; j++)
         {
-            NanoDirEntry* entries = (NanoDirEntry*)dirBuf;
-            for (u32 i = 0; i < inode->Size && i < NanoMaxDirEntries; i++)
-            {
-                u32 childIdx = entries[i].InodeIndex;
-                VNode* child = LoadVNode(childIdx, depth + 1);
-                /* Guard against corrupted images: an entry referencing this
-                   dir itself, an ancestor still being loaded (a directory
-                   cycle, including the root), or an inode already linked
-                   elsewhere would corrupt the tree. */
-                if (child != nullptr && child != vnode &&
-                    !LoadInProgress[childIdx] &&
-                    child->SiblingLink.IsEmpty())
-                {
-                    child->Parent = vnode;
-                    vnode->Children.InsertTail(&child->SiblingLink);
-                }
-            }
-            Mm::Free(dirBuf);
+            SetDataBit(run.Start + j, false);
+            MarkDiscard(run.Start + j);
         }
+        freed = true;
     }
 
-    LoadInProgress[inodeIdx] = 0;
-    delete inode;
-    return vnode;
+    if (freed)
+        FlushSuper();
 }
 
-VNode* NanoFs::FindVNode(u32 inodeIdx)
+// --- Discard ---
+
+void NanoFs::MarkDiscard(u32 idx)
 {
-    if (inodeIdx >= NanoInodeCount)
-        return nullptr;
-    return VNodes[inodeIdx];
+    BlockDevice* dev = Io.GetDevice();
+    if (dev == nullptr || !dev->SupportsDiscard())
+        return;
+
+    Stdlib::Bitmap discard(DiscardBitmap, DataBlocks);
+    if (!discard.TestBit(idx))
+    {
+        discard.SetBit(idx);
+        DiscardPending++;
+    }
 }
 
-void NanoFs::FreeVNode(VNode* vnode)
+/* Online discard, batched per operation: the blocks freed by a write or
+   remove go out as coalesced extents after the operation committed.  A
+   block may only be discarded once no on-disk metadata references it; in
+   write-back mode that holds after Sync(), so only durable callers issue
+   there. */
+void NanoFs::IssueDiscards(bool durable)
 {
-    if (vnode == nullptr)
+    if (DiscardPending == 0)
+        return;
+    if (!durable && BufferCache::GetInstance().IsWriteback())
         return;
 
-    u32 idx = VNodeToInode(vnode);
-    if (idx < NanoInodeCount)
-        VNodes[idx] = nullptr;
-
-    vnode->SiblingLink.RemoveInit();
-    delete vnode;
+    DiscardRuns(DiscardBitmap, true);
+    Stdlib::MemSet(DiscardBitmap, 0, (DataBlocks + 7) / 8);
+    DiscardPending = 0;
 }
 
-u32 NanoFs::VNodeToInode(VNode* vnode)
+/* Discard every maximal run of data blocks whose bit in bits equals
+   value; returns the number of blocks discarded.  Failures are traced and
+   skipped, discard being advisory. */
+u64 NanoFs::DiscardRuns(const u8* bits, bool value)
 {
-    if (vnode == nullptr)
-        return (u32)-1;
-    return (u32)vnode->Capacity; // Capacity stores inode index
-}
+    Stdlib::Bitmap bm(const_cast<u8*>(bits), DataBlocks);
+    u64 discarded = 0;
+    u32 i = 0;
+    while (i < DataBlocks)
+    {
+        if (bm.TestBit(i) != value)
+        {
+            i++;
+            continue;
+        }
 
-// --- Directory helpers ---
+        u32 start = i;
+        while (i < DataBlocks && bm.TestBit(i) == value)
+            i++;
+
+        if (!Io.Discard(Super->DataStartBlock + start, i - start))
+        {
+            Trace(0, "NanoFs: discard of blocks %u..%u failed",
+                  (ulong)start, (ulong)(i - 1));
+            continue;
+        }
+        discarded += i - start;
+    }
+    return discarded;
+}
 
-bool NanoFs::AddDirEntry(u32 dirInodeIdx, u32 childInodeIdx)
+bool NanoFs::Trim(u64& bytes)
 {
-    NanoInode* dirInode = new (Mm::NoThrow) NanoInode();
-    if (dirInode == nullptr)
-    {
-        Trace(0, "NanoFs::AddDirEntry: alloc inode failed");
+    bytes = 0;
+    if (!Mounted)
         return false;
-    }
 
-    if (!ReadInode(dirInodeIdx, dirInode))
+    BlockDevice* dev = Io.GetDevice();
+    if (dev == nullptr || !dev->SupportsDiscard())
     {
-        Trace(0, "NanoFs::AddDirEntry: read dir inode %u failed", (ulong)dirInodeIdx);
-        delete dirInode;
+        Trace(0, "NanoFs::Trim: device does not support discard");
         return false;
     }
 
-    if (dirInode->Type != NanoInodeTypeDir)
-    {
-        Trace(0, "NanoFs::AddDirEntry: inode %u is not a dir", (ulong)dirInodeIdx);
-        delete dirInode;
+    /* Free blocks may still be referenced by the on-disk metadata until
+       it is durable */
+    if (!Sync())
         return false;
-    }
 
-    if (dirInode->Size >= NanoMaxDirEntries)
-    {
-        Trace(0, "NanoFs::AddDirEntry: dir %u full (%u entries)", (ulong)dirInodeIdx, (ulong)dirInode->Size);
-        delete dirInode;
+    bytes = DiscardRuns(DataBitmap, false) * NanoBlockSize;
+    return true;
+}
+
+bool NanoFs::MapExtents(VNode* file, bool write, FileExtentMap& map)
+{
+    if (!Mounted || file == nullptr || file->NodeType != VNode::TypeFile)
         return false;
-    }
 
-    if (dirInode->Blocks[0] >= NanoDataBlockCount)
+    u32 inodeIdx = VNodeToInode(file);
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    if (inode == nullptr)
     {
-        Trace(0, "NanoFs::AddDirEntry: dir %u bad data block %u",
-              (ulong)dirInodeIdx, (ulong)dirInode->Blocks[0]);
-        delete dirInode;
+        Trace(0, "NanoFs::MapExtents: alloc inode failed");
         return false;
     }
 
-    u8* dirBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (dirBuf == nullptr)
+    NanoExtentList extents;
+    NanoExtentList tree;
+    if (!ReadInode(inodeIdx, inode) || !VerifyInodeChecksum(inode) ||
+        inode->Size > NanoMaxFileSize || !LoadExtents(inodeIdx, inode, extents, &tree))
     {
-        Trace(0, "NanoFs::AddDirEntry: alloc dir buf failed");
-        delete dirInode;
+        Trace(0, "NanoFs::MapExtents: bad inode %u", (ulong)inodeIdx);
+        delete inode;
         return false;
     }
 
-    if (!Io.ReadBlock(Super->DataStartBlock + dirInode->Blocks[0], dirBuf))
+    /* Inline data has no sectors to map */
+    if (inode->Flags & NanoInodeFlagInline)
     {
-        Trace(0, "NanoFs::AddDirEntry: read dir block failed for inode %u", (ulong)dirInodeIdx);
-        Mm::Free(dirBuf);
-        delete dirInode;
+        Trace(0, "NanoFs::MapExtents: inode %u is inline", (ulong)inodeIdx);
+        delete inode;
         return false;
     }
 
-    NanoDirEntry* entries = (NanoDirEntry*)dirBuf;
-    entries[dirInode->Size].InodeIndex = childInodeIdx;
-    entries[dirInode->Size].Reserved = 0;
+    u32 sectorsPerBlock = Io.GetSectorsPerBlock();
+    u32 fileBlocks = (u32)(((u64)inode->Size + NanoBlockSize - 1) / NanoBlockSize);
 
-    dirInode->Size++;
-
-    bool ok = Io.WriteBlock(Super->DataStartBlock + dirInode->Blocks[0], dirBuf);
-    Mm::Free(dirBuf);
-
-    if (!ok)
+    /* Writes bypass the file system and cannot allocate: the holes get
+       zeroed blocks now, committed before the map is handed out */
+    if (write && fileBlocks != 0 && !FillHoles(inodeIdx, inode, extents, tree, fileBlocks))
     {
-        Trace(0, "NanoFs::AddDirEntry: write dir block failed for inode %u", (ulong)dirInodeIdx);
-        delete dirInode;
+        Trace(0, "NanoFs::MapExtents: cannot allocate the holes of inode %u", (ulong)inodeIdx);
+        delete inode;
         return false;
     }
 
-    ComputeInodeChecksum(dirInode);
-    ok = WriteInode(dirInodeIdx, dirInode);
-    if (!ok)
-        Trace(0, "NanoFs::AddDirEntry: write inode %u failed", (ulong)dirInodeIdx);
-    delete dirInode;
-    return ok;
-}
-
-bool NanoFs::RemoveDirEntry(u32 dirInodeIdx, u32 childInodeIdx)
-{
-    NanoInode* dirInode = new (Mm::NoThrow) NanoInode();
-    if (dirInode == nullptr)
+    map.Clear();
+    map.SetBlockSectors(sectorsPerBlock);
+    bool ok = true;
+    u32 next = 0;
+    for (u32 i = 0; i < extents.GetCount() && ok; i++)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: alloc inode failed");
-        return false;
+        const NanoExtent& ext = extents.Get(i);
+        if (ext.Logical > next)
+            ok = map.Add(FileExtentMap::Hole, (u64)(ext.Logical - next) * sectorsPerBlock);
+        if (ok)
+            ok = map.Add(Io.GetBlockSector(Super->DataStartBlock + ext.Start),
+                         (u64)ext.Length * sectorsPerBlock);
+        next = ext.Logical + ext.Length;
     }
+    if (ok && fileBlocks > next)
+        ok = map.Add(FileExtentMap::Hole, (u64)(fileBlocks - next) * sectorsPerBlock);
 
-    if (!ReadInode(dirInodeIdx, dirInode))
+    if (!ok)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: read dir inode %u failed", (ulong)dirInodeIdx);
-        delete dirInode;
+        Trace(0, "NanoFs::MapExtents: cannot map inode %u", (ulong)inodeIdx);
+        map.Clear();
+        delete inode;
         return false;
     }
+    map.SetSize(inode->Size);
 
-    if (dirInode->Type != NanoInodeTypeDir)
-    {
-        Trace(0, "NanoFs::RemoveDirEntry: inode %u is not a dir", (ulong)dirInodeIdx);
-        delete dirInode;
+    delete inode;
+    return true;
+}
+
+/* Checksums are integrity, not authentication: a crafted image can carry a
+   valid, checksummed, reachable inode whose allocation bit is clear, or
+   live data blocks unmarked in the data bitmap. AllocInode/AllocRun
+   would then hand out live metadata and the next create/write would clobber
+   the tree (e.g. the root directory's data block). Re-mark every inode in
+   use and its blocks as allocated, extent tree blocks included; repairs
+   persist with the next superblock flush. Runs at mount. Scanning the
+   fixed inode table rather than walking the tree keeps mount from reading
+   every directory, at the price of also keeping an orphan a crash left
+   behind allocated. */
+void NanoFs::MarkInUseAllocated()
+{
+    Stdlib::Bitmap inodeBm(InodeBitmap, Super->InodeCount);
+
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    if (inode == nullptr)
+    {
+        Trace(0, "NanoFs: alloc inode failed, bitmap repair skipped");
+        return;
+    }
+
+    bool repaired = false;
+
+    /* Tables an upgrade carved out of the data area */
+    for (u32 pass = 0; pass < 3; pass++)
+    {
+        u32 start = (pass == 0) ? Super->ChecksumStart :
+                    (pass == 1) ? Super->InodeStartBlock : Super->JournalStart;
+        u32 count = (pass == 0) ? Super->ChecksumBlocks :
+                    (pass == 1) ? InodeTableBlocks() : Super->JournalBlocks;
+        if (start < Super->DataStartBlock || start - Super->DataStartBlock >= DataBlocks)
+            continue;
+
+        start -= Super->DataStartBlock;
+        for (u32 j = 0; j < count; j++)
+        {
+            if (!TestDataBit(start + j))
+            {
+                Trace(0, "NanoFs: table block %u not marked allocated, repairing",
+                      (ulong)(start + j));
+                SetDataBit(start + j, true);
+                repaired = true;
+            }
+        }
+    }
+
+    NanoExtentList extents;
+    NanoExtentList treeBlocks;
+    for (u32 i = 0; i < Super->InodeCount; i++)
+    {
+        if (!ReadInode(i, inode) || inode->Type == NanoInodeTypeFree ||
+            !VerifyInodeChecksum(inode))
+            continue;
+
+        if (!inodeBm.TestBit(i))
+        {
+            Trace(0, "NanoFs: inode %u in use but not marked allocated, repairing",
+                  (ulong)i);
+            inodeBm.SetBit(i);
+            if (Super->InodeBitmapBlocks != 0)
+                InodeBitmapDirty |= 1u << (i / NanoBitsPerBlock);
+            repaired = true;
+        }
+
+        if (inode->Type == NanoInodeTypeDir)
+        {
+            u32 blocks[NanoDirMaxBlocks];
+            u32 count;
+            if (!DirBlocks(inode, blocks, count))
+                continue;
+            extents.Clear();
+            treeBlocks.Clear();
+            bool added = true;
+            for (u32 j = 0; j < count && added; j++)
+                added = extents.Add(j, blocks[j], 1);
+            if (!added)
+                continue;
+        }
+        else if (!LoadExtents(i, inode, extents, &treeBlocks))
+        {
+            continue;
+        }
+
+        for (u32 pass = 0; pass < 2; pass++)
+        {
+            const NanoExtentList& runs = (pass == 0) ? extents : treeBlocks;
+            for (u32 k = 0; k < runs.GetCount(); k++)
+            {
+                const NanoExtent& run = runs.Get(k);
+                for (u32 j = 0; j < run.Length; j++)
+                {
+                    u32 b = run.Start + j;
+                    if (TestDataBit(b))
+                        continue;
+                    Trace(0, "NanoFs: live data block %u (inode %u) not marked allocated, repairing",
+                          (ulong)b, (ulong)i);
+                    SetDataBit(b, true);
+                    repaired = true;
+                }
+            }
+        }
+    }
+
+    delete inode;
+
+    if (repaired)
+        FlushSuper();
+}
+
+// --- Checksum helpers ---
+
+void NanoFs::ComputeSuperChecksum()
+{
+    Super->Checksum = 0;
+    Super->Checksum = Stdlib::Crc32(Super, sizeof(*Super));
+}
+
+bool NanoFs::VerifySuperChecksum()
+{
+    u32 saved = Super->Checksum;
+    Super->Checksum = 0;
+    u32 computed = Stdlib::Crc32(Super, sizeof(*Super));
+    Super->Checksum = saved;
+    return computed == saved;
+}
+
+void NanoFs::ComputeInodeChecksum(NanoInode* inode)
+{
+    inode->Checksum = 0;
+    inode->Checksum = Stdlib::Crc32(inode, sizeof(NanoInode));
+}
+
+bool NanoFs::VerifyInodeChecksum(NanoInode* inode)
+{
+    u32 saved = inode->Checksum;
+    inode->Checksum = 0;
+    u32 computed = Stdlib::Crc32(inode, sizeof(NanoInode));
+    inode->Checksum = saved;
+    return computed == saved;
+}
+
+/* The checksum table holds one CRC32 per data block, NanoChecksumsPerBlock
+   to a table block; CsumBuf keeps the table block last used */
+bool NanoFs::ReadChecksum(u32 dataBlock, u32& crc)
+{
+    u32 tableBlock = dataBlock / NanoChecksumsPerBlock;
+    if (CsumBlock != tableBlock)
+    {
+        if (!Io.ReadBlock(Super->ChecksumStart + tableBlock, CsumBuf))
+        {
+            Trace(0, "NanoFs: read checksum table block %u failed", (ulong)tableBlock);
+            CsumBlock = NanoNoBlock;
+            return false;
+        }
+        CsumBlock = tableBlock;
+    }
+
+    crc = CsumBuf[dataBlock % NanoChecksumsPerBlock];
+    return true;
+}
+
+/* Entries of blocks not yet referenced by any inode: a crash before the
+   inode commit leaves stale entries of free blocks only */
+bool NanoFs::StoreChecksums(u32 dataBlock, const u32* crcs, u32 count)
+{
+    u32 i = 0;
+    while (i < count)
+    {
+        u32 block = dataBlock + i;
+        u32 tableBlock = block / NanoChecksumsPerBlock;
+        u32 slot = block % NanoChecksumsPerBlock;
+        u32 n = NanoChecksumsPerBlock - slot;
+        if (n > count - i)
+            n = count - i;
+
+        u32 unused;
+        if (!ReadChecksum(block, unused))
+            return false;
+
+        Stdlib::MemCpy(&CsumBuf[slot], &crcs[i], n * sizeof(u32));
+        if (!Io.WriteBlock(Super->ChecksumStart + tableBlock, CsumBuf))
+        {
+            Trace(0, "NanoFs: write checksum table block %u failed", (ulong)tableBlock);
+            CsumBlock = NanoNoBlock;
+            return false;
+        }
+        i += n;
+    }
+    return true;
+}
+
+bool NanoFs::VerifyBlockChecksum(const NanoInode* inode, u32 logical, u32 dataBlock, const void* data)
+{
+    if (!(inode->Flags & NanoInodeFlagBlockChecksums))
+        return true;
+
+    u64 used = inode->Size - (u64)logical * NanoBlockSize;
+    if (used > NanoBlockSize)
+        used = NanoBlockSize;
+
+    u32 crc;
+    if (!ReadChecksum(dataBlock, crc))
+        return false;
+    return Stdlib::Crc32(data, (ulong)used) == crc;
+}
+
+// --- Extent maps ---
+
+/* Leaf extents come in file order, inside the data area and the file
+   size limit */
+static bool AddLoadedExtent(NanoExtentList& extents, const NanoExtent& ext, u32 dataBlocks)
+{
+    if (ext.Length == 0 || ext.Start >= dataBlocks || ext.Length > dataBlocks - ext.Start ||
+        ext.Logical < extents.GetEnd() || ext.Logical > NanoMaxFileBlocks ||
+        ext.Length > NanoMaxFileBlocks - ext.Logical || extents.GetCount() >= dataBlocks)
+        return false;
+
+    return extents.Add(ext.Logical, ext.Start, ext.Length, false);
+}
+
+bool NanoFs::CheckExtentBlock(u32 inodeIdx, u32 block, NanoExtentBlock* node, u16 depth)
+{
+    if (block >= DataBlocks || !Io.ReadBlock(Super->DataStartBlock + block, node))
+    {
+        Trace(0, "NanoFs: cannot read extent block %u of inode %u",
+              (ulong)block, (ulong)inodeIdx);
+        return false;
+    }
+
+    u32 saved = node->Checksum;
+    node->Checksum = 0;
+    u32 computed = Stdlib::Crc32(node, sizeof(*node));
+    node->Checksum = saved;
+
+    if (node->Magic != NanoExtentMagic || computed != saved || node->Owner != inodeIdx ||
+        node->Depth != depth || node->Count == 0 || node->Count > NanoExtentsPerBlock)
+    {
+        Trace(0, "NanoFs: bad extent block %u of inode %u", (ulong)block, (ulong)inodeIdx);
+        return false;
+    }
+    return true;
+}
+
+bool NanoFs::LoadExtentBlock(u32 inodeIdx, u32 block, u16 depth, NanoExtentList& extents,
+                             NanoExtentList* treeBlocks)
+{
+    /* Heap, not stack: up to NanoMaxTreeDepth levels recurse */
+    NanoExtentBlock* node = (NanoExtentBlock*)Mm::Alloc(NanoBlockSize, 0);
+    if (node == nullptr)
+    {
+        Trace(0, "NanoFs: alloc extent block failed");
+        return false;
+    }
+
+    bool ok = CheckExtentBlock(inodeIdx, block, node, depth);
+    if (ok && treeBlocks != nullptr)
+        ok = treeBlocks->Add(block, block, 1);
+
+    for (u32 i = 0; i < node->Count && ok; i++)
+    {
+        if (depth == 0)
+            ok = AddLoadedExtent(extents, node->Entries[i], DataBlocks);
+        else
+            ok = LoadExtentBlock(inodeIdx, node->Entries[i].Start, depth - 1, extents, treeBlocks);
+    }
+
+    Mm::Free(node);
+    return ok;
+}
+
+/* The whole extent map of a file, and optionally the tree blocks holding
+   it (merged into runs) */
+bool NanoFs::LoadExtents(u32 inodeIdx, const NanoInode* inode, NanoExtentList& extents,
+                         NanoExtentList* treeBlocks)
+{
+    extents.Clear();
+    if (treeBlocks != nullptr)
+        treeBlocks->Clear();
+
+    /* Inline data: no blocks at all */
+    if (inode->Flags & NanoInodeFlagInline)
+    {
+        if (inode->Type == NanoInodeTypeFile && inode->Size <= NanoInlineSize &&
+            inode->Depth == 0 && inode->RootCount == 0 && inode->ExtentCount == 0)
+            return true;
+
+        Trace(0, "NanoFs: bad inline inode %u", (ulong)inodeIdx);
+        return false;
+    }
+
+    bool ok = inode->Depth <= NanoMaxTreeDepth && inode->RootCount <= NanoRootExtents;
+    for (u32 i = 0; i < inode->RootCount && ok; i++)
+    {
+        if (inode->Depth == 0)
+            ok = AddLoadedExtent(extents, inode->Root[i], DataBlocks);
+        else
+            ok = LoadExtentBlock(inodeIdx, inode->Root[i].Start, inode->Depth - 1, extents, treeBlocks);
+    }
+
+    /* Files map nothing past their size */
+    u32 fileBlocks = (u32)(((u64)inode->Size + NanoBlockSize - 1) / NanoBlockSize);
+    if (ok && (extents.GetCount() != inode->ExtentCount ||
+               (inode->Type == NanoInodeTypeFile && extents.GetEnd() > fileBlocks)))
+        ok = false;
+
+    if (!ok)
+    {
+        Trace(0, "NanoFs: bad extent map of inode %u", (ulong)inodeIdx);
+        extents.Clear();
+        if (treeBlocks != nullptr)
+            treeBlocks->Clear();
+    }
+    return ok;
+}
+
+/* Walk the tree down to the extent holding file block logical.  A hole
+   comes back with Start == NanoNoBlock and Length up to the next extent. */
+bool NanoFs::MapLogical(u32 inodeIdx, const NanoInode* inode, u32 logical, NanoExtent& ext)
+{
+    if (inode->Depth > NanoMaxTreeDepth || inode->RootCount > NanoRootExtents)
+    {
+        Trace(0, "NanoFs: bad extent root of inode %u", (ulong)inodeIdx);
+        return false;
+    }
+
+    const NanoExtent* entries = inode->Root;
+    u32 count = inode->RootCount;
+    u16 depth = inode->Depth;
+    u32 next = NanoMaxFileBlocks;
+    NanoExtentBlock* node = nullptr;
+    bool ok = true;
+
+    for (;;)
+    {
+        /* Entries at or before logical */
+        u32 lo = 0;
+        u32 hi = count;
+        while (lo < hi)
+        {
+            u32 mid = (lo + hi) / 2;
+            if (entries[mid].Logical <= logical)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo < count && entries[lo].Logical < next)
+            next = entries[lo].Logical;
+
+        bool hole = (lo == 0);
+        if (!hole && depth == 0)
+        {
+            const NanoExtent& found = entries[lo - 1];
+            if (found.Start >= DataBlocks || found.Length > DataBlocks - found.Start)
+            {
+                Trace(0, "NanoFs: bad extent of inode %u", (ulong)inodeIdx);
+                ok = false;
+                break;
+            }
+            if (logical - found.Logical < found.Length)
+            {
+                ext = found;
+                break;
+            }
+            hole = true;
+        }
+
+        if (hole)
+        {
+            ext.Logical = logical;
+            ext.Start = NanoNoBlock;
+            ext.Length = (next > logical) ? next - logical : 1;
+            break;
+        }
+
+        if (node == nullptr)
+        {
+            node = (NanoExtentBlock*)Mm::Alloc(NanoBlockSize, 0);
+            if (node == nullptr)
+            {
+                Trace(0, "NanoFs: alloc extent block failed");
+                ok = false;
+                break;
+            }
+        }
+
+        u32 child = entries[lo - 1].Start;
+        depth--;
+        if (!CheckExtentBlock(inodeIdx, child, node, depth))
+        {
+            ok = false;
+            break;
+        }
+        entries = node->Entries;
+        count = node->Count;
+    }
+
+    if (node != nullptr)
+        Mm::Free(node);
+    return ok;
+}
+
+/* Store extents as the inode's map: inline when they fit the root, else
+   in leaves of NanoExtentsPerBlock entries under index levels.  Tree
+   blocks are allocated and written here and returned in treeBlocks; the
+   caller commits them with the inode. */
+bool NanoFs::BuildTree(u32 inodeIdx, NanoInode* inode, const NanoExtentList& extents,
+                       NanoExtentList& treeBlocks)
+{
+    treeBlocks.Clear();
+    Stdlib::MemSet(inode->InlineData, 0, sizeof(inode->InlineData));
+    inode->Flags &= ~NanoInodeFlagInline;
+    inode->Depth = 0;
+    inode->RootCount = 0;
+    inode->ExtentCount = extents.GetCount();
+
+    NanoExtentList levels[2];
+    const NanoExtentList* src = &extents;
+    NanoExtentBlock* node = nullptr;
+    u16 depth = 0;
+    bool ok = true;
+
+    while (src->GetCount() > NanoRootExtents)
+    {
+        if (depth >= NanoMaxTreeDepth)
+        {
+            Trace(0, "NanoFs::BuildTree: inode %u too fragmented (%u extents)",
+                  (ulong)inodeIdx, (ulong)extents.GetCount());
+            ok = false;
+            break;
+        }
+
+        if (node == nullptr)
+        {
+            node = (NanoExtentBlock*)Mm::Alloc(NanoBlockSize, 0);
+            if (node == nullptr)
+            {
+                Trace(0, "NanoFs::BuildTree: alloc extent block failed");
+                ok = false;
+                break;
+            }
+        }
+
+        NanoExtentList& dst = levels[depth % 2];
+        dst.Clear();
+
+        u32 count = src->GetCount();
+        u32 nodesLeft = (count + NanoExtentsPerBlock - 1) / NanoExtentsPerBlock;
+        u32 runStart = 0;
+        u32 runLeft = 0;
+        for (u32 i = 0; i < count && ok; i += NanoExtentsPerBlock)
+        {
+            if (runLeft == 0 && !AllocRun(nodesLeft, runStart, runLeft))
+            {
+                ok = false;
+                break;
+            }
+
+            u32 block = runStart++;
+            runLeft--;
+            nodesLeft--;
+            if (!treeBlocks.Add(block, block, 1))
+            {
+                SetDataBit(block, false);
+                ok = false;
+                break;
+            }
+
+            u32 n = count - i;
+            if (n > NanoExtentsPerBlock)
+                n = NanoExtentsPerBlock;
+
+            Stdlib::MemSet(node, 0, sizeof(*node));
+            node->Magic = NanoExtentMagic;
+            node->Owner = inodeIdx;
+            node->Depth = depth;
+            node->Count = (u16)n;
+            for (u32 j = 0; j < n; j++)
+                node->Entries[j] = src->Get(i + j);
+            node->Checksum = Stdlib::Crc32(node, sizeof(*node));
+
+            if (!Io.WriteBlock(Super->DataStartBlock + block, node))
+            {
+                Trace(0, "NanoFs::BuildTree: write extent block %u failed", (ulong)block);
+                ok = false;
+                break;
+            }
+
+            ok = dst.Add(src->Get(i).Logical, block, 0, false);
+        }
+
+        /* Blocks of a run cut short by a failure */
+        for (u32 j = 0; j < runLeft; j++)
+            SetDataBit(runStart + j, false);
+
+        if (!ok)
+            break;
+
+        src = &dst;
+        depth++;
+    }
+
+    if (node != nullptr)
+        Mm::Free(node);
+
+    if (!ok)
+    {
+        FreeRuns(treeBlocks);
+        treeBlocks.Clear();
+        return false;
+    }
+
+    for (u32 i = 0; i < src->GetCount(); i++)
+        inode->Root[i] = src->Get(i);
+    inode->RootCount = (u16)src->GetCount();
+    inode->Depth = depth;
+    return true;
+}
+
+/* A directory's table blocks in order (see NanoDirEntry), inline in the
+   inode: the single block of its first extent if it is still packed */
+bool NanoFs::DirBlocks(const NanoInode* inode, u32* blocks, u32& count)
+{
+    count = 0;
+    if ((inode->Flags & NanoInodeFlagInline) || inode->Depth != 0 || inode->RootCount == 0 ||
+        inode->RootCount > NanoRootExtents)
+        return false;
+
+    if ((inode->Flags & NanoInodeFlagHashedDir) == 0)
+    {
+        if (inode->Root[0].Length == 0 || inode->Root[0].Start >= DataBlocks)
+            return false;
+        blocks[count++] = inode->Root[0].Start;
+        return true;
+    }
+
+    for (u32 k = 0; k < inode->RootCount; k++)
+    {
+        const NanoExtent& ext = inode->Root[k];
+        if (ext.Logical != count || ext.Length == 0 || ext.Length > NanoDirMaxBlocks - count ||
+            ext.Start >= DataBlocks || ext.Length > DataBlocks - ext.Start)
+            return false;
+        for (u32 j = 0; j < ext.Length; j++)
+            blocks[count++] = ext.Start + j;
+    }
+
+    /* The table doubles: a power of two */
+    return (count & (count - 1)) == 0;
+}
+
+// --- Upgrade ---
+
+/* v1-v3 inodes take a block each; their checksum covers the whole block */
+static bool VerifyBlockInodeChecksum(u8* raw)
+{
+    NanoInodeV3* inode = (NanoInodeV3*)raw;
+    u32 saved = inode->Checksum;
+    inode->Checksum = 0;
+    u32 computed = Stdlib::Crc32(raw, NanoBlockSize);
+    inode->Checksum = saved;
+    return computed == saved;
+}
+
+/* A table carved out of the data area: one contiguous run or nothing */
+bool NanoFs::AllocTable(u32 want, u32& start)
+{
+    u32 length;
+    if (!AllocRun(want, start, length))
+        return false;
+    if (length < want)
+    {
+        Trace(0, "NanoFs::Upgrade: no %u free contiguous blocks", (ulong)want);
+        for (u32 j = 0; j < length; j++)
+            SetDataBit(start + j, false);
+        return false;
+    }
+    return true;
+}
+
+/* Images before v5 have no journal, one is carved out of the data area
+   if it has room; older ones get their tables converted first (see
+   UpgradeTables).  Directories are hashed as they change (see
+   NanoDirEntry), so v5 images only take the version.  One superblock
+   write switches the image to v6.  A crash before that leaves the old
+   image intact, at worst with the new regions' blocks leaked on images
+   whose data bitmap lives outside the superblock. */
+bool NanoFs::Upgrade()
+{
+    u32 from = Super->Version;
+    if (from < NanoVersionV4 && !UpgradeTables())
+        return false;
+
+    if (from < NanoVersionV5)
+    {
+        u32 journalBlocks = JournalSize(DataBlocks);
+        u32 journalStart = 0;
+        if (journalBlocks != 0 && AllocTable(journalBlocks, journalStart))
+        {
+            if (!NanoJournal::Format(Io, Super->DataStartBlock + journalStart, journalBlocks))
+            {
+                for (u32 j = 0; j < journalBlocks; j++)
+                    SetDataBit(journalStart + j, false);
+                journalBlocks = 0;
+            }
+        }
+        else
+        {
+            journalBlocks = 0;
+        }
+
+        Super->JournalStart = (journalBlocks != 0) ? Super->DataStartBlock + journalStart : 0;
+        Super->JournalBlocks = journalBlocks;
+    }
+
+    Super->Version = NanoVersion;
+    CsumBlock = NanoNoBlock;
+    if (!FlushSuper())
+        return false;
+
+    Trace(0, "NanoFs: upgraded from version %u to %u, journal %u blocks",
+          (ulong)from, (ulong)NanoVersion, (ulong)Super->JournalBlocks);
+    return true;
+}
+
+/* Older images keep one inode per block: v1/v2 with a flat block map and
+   their checksums in the inode, v3 with an extent tree.  The old table is
+   left untouched: the compact inode table (and for v1/v2 the checksum
+   table) is carved out of the data area and written in full; Upgrade
+   switches the superblock over.  Inodes that an interrupted upgrade from
+   older code converted in place to the v3 layout carry NanoInodeMagic
+   where v1/v2 had zero padding. */
+bool NanoFs::UpgradeTables()
+{
+    u32 from = Super->Version;
+    bool legacy = (from < NanoVersionV3);
+    u32 csumStart = Super->ChecksumStart;
+    u32 csumBlocks = Super->ChecksumBlocks;
+    u32 inodeStart;
+
+    if (csumBlocks == 0)
+    {
+        csumBlocks = (DataBlocks + NanoChecksumsPerBlock - 1) / NanoChecksumsPerBlock;
+        if (!AllocTable(csumBlocks, csumStart))
+            return false;
+        csumStart += Super->DataStartBlock;
+    }
+
+    if (!AllocTable(NanoLegacyInodeTableBlocks, inodeStart))
+        return false;
+    inodeStart += Super->DataStartBlock;
+
+    /* v1/v2 checksums move to the table, recomputed from the data */
+    ulong tableSize = legacy ? (ulong)csumBlocks * NanoBlockSize : 0;
+    u32* table = legacy ? (u32*)Mm::Alloc(tableSize, 0) : nullptr;
+    NanoInode* inodes = (NanoInode*)Mm::Alloc(NanoLegacyInodeTableBlocks * NanoBlockSize, 0);
+    u8* raw = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if ((legacy && table == nullptr) || inodes == nullptr || raw == nullptr)
+    {
+        Trace(0, "NanoFs::Upgrade: alloc failed");
+        if (table != nullptr)
+            Mm::Free(table);
+        if (inodes != nullptr)
+            Mm::Free(inodes);
+        if (raw != nullptr)
+            Mm::Free(raw);
+        return false;
+    }
+    if (table != nullptr)
+        Stdlib::MemSet(table, 0, tableSize);
+    Stdlib::MemSet(inodes, 0, NanoLegacyInodeTableBlocks * NanoBlockSize);
+
+    Stdlib::Bitmap inodeBm(Super->InodeBitmap, NanoLegacyInodeCount);
+    bool ok = true;
+    ulong count = 0;
+    for (u32 i = 0; i < NanoLegacyInodeCount && ok; i++)
+    {
+        if (!inodeBm.TestBit(i))
+            continue;
+
+        if (!Io.ReadBlock(Super->InodeStartBlock + i, raw))
+        {
+            Trace(0, "NanoFs::Upgrade: read inode %u failed", (ulong)i);
+            ok = false;
+            break;
+        }
+
+        /* Left zeroed: LoadVNode skips it as it did the bad original */
+        if (((NanoInodeV3*)raw)->Type == NanoInodeTypeFree || !VerifyBlockInodeChecksum(raw))
+        {
+            Trace(0, "NanoFs::Upgrade: skipping bad inode %u", (ulong)i);
+            continue;
+        }
+
+        ok = UpgradeInode(i, raw, &inodes[i], table);
+        count++;
+    }
+
+    /* Tree blocks and both tables are durable before the superblock
+       points at them */
+    if (ok && legacy)
+        ok = Io.WriteBlockRange(csumStart, csumBlocks, table);
+    if (ok)
+        ok = Io.WriteBlockRange(inodeStart, NanoLegacyInodeTableBlocks, inodes) && Io.Commit();
+
+    if (table != nullptr)
+        Mm::Free(table);
+    Mm::Free(inodes);
+    Mm::Free(raw);
+    if (!ok)
+        return false;
+
+    Super->ChecksumStart = csumStart;
+    Super->ChecksumBlocks = csumBlocks;
+    Super->InodeStartBlock = inodeStart;
+    Trace(0, "NanoFs: converted %u inodes of version %u", count, (ulong)from);
+    return true;
+}
+
+/* Fills the compact inode from the raw old one.  Table is the checksum
+   table being rebuilt for v1/v2 images, nullptr for v3 ones. */
+bool NanoFs::UpgradeInode(u32 idx, const u8* old, NanoInode* inode, u32* table)
+{
+    const NanoInodeV3* v3 = (const NanoInodeV3*)old;
+    Stdlib::MemSet(inode, 0, sizeof(*inode));
+    inode->Type = v3->Type;
+    inode->Size = v3->Size;
+    Stdlib::MemCpy(inode->Name, v3->Name, sizeof(inode->Name));
+    inode->ParentInode = v3->ParentInode;
+
+    if (table == nullptr || v3->Magic == NanoInodeMagic)
+    {
+        /* Same extent map, tree blocks and their owner stay */
+        inode->Flags = v3->Flags;
+        inode->Depth = v3->Depth;
+        inode->RootCount = v3->RootCount;
+        inode->ExtentCount = v3->ExtentCount;
+        for (u32 i = 0; i < NanoRootExtents; i++)
+            inode->Root[i] = v3->Root[i];
+        ComputeInodeChecksum(inode);
+        if (table == nullptr || inode->Type != NanoInodeTypeFile ||
+            !(inode->Flags & NanoInodeFlagBlockChecksums))
+            return true;
+    }
+
+    u8* buf = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if (buf == nullptr)
+    {
+        Trace(0, "NanoFs::Upgrade: alloc block buf failed");
+        return false;
+    }
+
+    bool ok = true;
+    NanoExtentList extents;
+    NanoExtentList treeBlocks;
+
+    if (v3->Magic == NanoInodeMagic)
+    {
+        /* Converted in place by an interrupted upgrade: only the table
+           entries are missing */
+        if (!LoadExtents(idx, inode, extents, nullptr))
+        {
+            inode->Flags &= ~NanoInodeFlagBlockChecksums;
+            ComputeInodeChecksum(inode);
+        }
+
+        u64 remaining = inode->Size;
+        for (u32 i = 0; i < extents.GetCount() && ok; i++)
+        {
+            const NanoExtent& ext = extents.Get(i);
+            u64 pos = (u64)ext.Logical * NanoBlockSize;
+            for (u32 j = 0; j < ext.Length && ok && pos < remaining; j++, pos += NanoBlockSize)
+            {
+                u64 used = remaining - pos;
+                if (used > NanoBlockSize)
+                    used = NanoBlockSize;
+                ok = Io.ReadBlock(Super->DataStartBlock + ext.Start + j, buf);
+                if (ok)
+                    table[ext.Start + j] = Stdlib::Crc32(buf, (ulong)used);
+            }
+        }
+
+        Mm::Free(buf);
+        return ok;
+    }
+
+    const NanoLegacyInode* legacy = (const NanoLegacyInode*)old;
+    if (legacy->Type == NanoInodeTypeDir)
+    {
+        if (legacy->Blocks[0] < DataBlocks)
+            ok = extents.Add(0, legacy->Blocks[0], 1);
+        else
+            Trace(0, "NanoFs::Upgrade: dir inode %u has bad block %u",
+                  (ulong)idx, (ulong)legacy->Blocks[0]);
+    }
+    else if (legacy->Size > NanoLegacyMaxBlocks * NanoBlockSize)
+    {
+        Trace(0, "NanoFs::Upgrade: inode %u size %u exceeds max", (ulong)idx, (ulong)legacy->Size);
+        ok = false;
+    }
+    else
+    {
+        u32 blocks = (legacy->Size + NanoBlockSize - 1) / NanoBlockSize;
+        u32 remaining = legacy->Size;
+        u32 xorSum = 0;
+        bool match = true;
+        for (u32 j = 0; j < blocks && ok; j++)
+        {
+            u32 block = legacy->Blocks[j];
+            u32 used = (remaining < NanoBlockSize) ? remaining : NanoBlockSize;
+            ok = block < DataBlocks && Io.ReadBlock(Super->DataStartBlock + block, buf) &&
+                 extents.Add(j, block, 1);
+            if (!ok)
+            {
+                Trace(0, "NanoFs::Upgrade: cannot read block %u of inode %u",
+                      (ulong)j, (ulong)idx);
+                break;
+            }
+
+            u32 crc = Stdlib::Crc32(buf, used);
+            table[block] = crc;
+            xorSum ^= crc;
+            if (crc != legacy->BlockChecksums[j])
+                match = false;
+            remaining -= used;
+        }
+
+        /* Do not bless data that no longer matches what was recorded:
+           v2 kept per-block CRCs, v1 their XOR */
+        bool verified = (legacy->Flags & NanoInodeFlagBlockChecksums) ? match
+                                                                       : (legacy->DataChecksum == xorSum);
+        if (verified)
+            inode->Flags = NanoInodeFlagBlockChecksums;
+        else if (ok)
+            Trace(0, "NanoFs::Upgrade: inode %u data checksum mismatch, left unchecked",
+                  (ulong)idx);
+    }
+
+    if (ok)
+        ok = BuildTree(idx, inode, extents, treeBlocks);
+    if (ok)
+        ComputeInodeChecksum(inode);
+
+    Mm::Free(buf);
+    return ok;
+}
+
+// --- VNode management ---
+
+/* A VNode for inode inodeIdx, its children not loaded yet */
+VNode* NanoFs::LoadVNode(u32 inodeIdx)
+{
+    if (inodeIdx >= Super->InodeCount)
+    {
+        Trace(0, "NanoFs::LoadVNode: idx %u out of range", (ulong)inodeIdx);
+        return nullptr;
+    }
+
+    VNode* vnode = VNodes.Find(inodeIdx);
+    if (vnode != nullptr)
+        return vnode;
+
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    if (inode == nullptr)
+    {
+        Trace(0, "NanoFs::LoadVNode: alloc inode failed for %u", (ulong)inodeIdx);
+        return nullptr;
+    }
+
+    if (!ReadInode(inodeIdx, inode))
+    {
+        Trace(0, "NanoFs::LoadVNode: read inode %u failed", (ulong)inodeIdx);
+        delete inode;
+        return nullptr;
+    }
+
+    if (inode->Type == NanoInodeTypeFree)
+    {
+        Trace(0, "NanoFs::LoadVNode: inode %u is free", (ulong)inodeIdx);
+        delete inode;
+        return nullptr;
+    }
+
+    if (!VerifyInodeChecksum(inode))
+    {
+        Trace(0, "NanoFs::LoadVNode: inode %u checksum mismatch", (ulong)inodeIdx);
+        delete inode;
+        return nullptr;
+    }
+
+    vnode = VNodes.Create(inodeIdx, (inode->Type == NanoInodeTypeDir) ? VNode::TypeDir : VNode::TypeFile);
+    if (vnode == nullptr)
+    {
+        Trace(0, "NanoFs::LoadVNode: alloc vnode failed for %u", (ulong)inodeIdx);
+        delete inode;
+        return nullptr;
+    }
+
+    Stdlib::StrnCpy(vnode->Name, inode->Name, sizeof(vnode->Name));
+    vnode->Size = (inode->Type == NanoInodeTypeFile) ? inode->Size : 0;
+
+    delete inode;
+    return vnode;
+}
+
+/* Read dir's entries and link a VNode for each.  A dir whose inode or
+   block is bad, or that lies too deep, stays empty; false only on read
+   or allocation failure, to be retried by the next caller. */
+bool NanoFs::LoadChildren(VNode* dir)
+{
+    if (dir->Loaded)
+        return true;
+
+    u32 dirInodeIdx = VNodeToInode(dir);
+    if (VNodeCache::GetDepth(dir) + 1 >= NanoMaxDirDepth)
+    {
+        Trace(0, "NanoFs::LoadChildren: dir depth limit %u hit at inode %u",
+              (ulong)NanoMaxDirDepth, (ulong)dirInodeIdx);
+        VNodes.SetLoaded(dir);
+        return true;
+    }
+
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    u8* dirBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if (inode == nullptr || dirBuf == nullptr)
+    {
+        Trace(0, "NanoFs::LoadChildren: alloc failed for inode %u", (ulong)dirInodeIdx);
+        if (dirBuf != nullptr)
+            Mm::Free(dirBuf);
+        delete inode;
         return false;
     }
 
-    // Size drives entry iteration and an entries[Size - 1] write below; an
-    // unclamped on-disk value would walk past the 4 KB dir buffer.
-    if (!VerifyInodeChecksum(dirInode))
+    bool ok = true;
+    u32 blocks[NanoDirMaxBlocks];
+    u32 count = 0;
+    if (!ReadInode(dirInodeIdx, inode))
     {
-        Trace(0, "NanoFs::RemoveDirEntry: dir inode %u checksum mismatch", (ulong)dirInodeIdx);
-        delete dirInode;
+        Trace(0, "NanoFs::LoadChildren: read inode %u failed", (ulong)dirInodeIdx);
+        ok = false;
+    }
+    else if (!VerifyInodeChecksum(inode) || inode->Type != NanoInodeTypeDir ||
+             inode->Size == 0)
+    {
+        /* Nothing to list */
+    }
+    else if (!DirBlocks(inode, blocks, count))
+    {
+        Trace(0, "NanoFs::LoadChildren: bad dir blocks for inode %u", (ulong)dirInodeIdx);
+    }
+
+    /* A packed dir has Size entries at the start of its block, a table
+       its entries anywhere */
+    bool hashed = (inode->Flags & NanoInodeFlagHashedDir) != 0;
+    for (u32 b = 0; b < count && ok; b++)
+    {
+        if (!ReadMeta(Super->DataStartBlock + blocks[b], dirBuf))
+        {
+            Trace(0, "NanoFs::LoadChildren: read dir block %u failed for inode %u",
+                  (ulong)blocks[b], (ulong)dirInodeIdx);
+            ok = false;
+            break;
+        }
+
+        NanoDirEntry* entries = (NanoDirEntry*)dirBuf;
+        u32 slots = hashed ? NanoDirEntriesPerBlock :
+                    (inode->Size < NanoDirEntriesPerBlock ? inode->Size : NanoDirEntriesPerBlock);
+        for (u32 i = 0; i < slots; i++)
+        {
+            u32 childIdx = entries[i].InodeIndex;
+            /* Guard against corrupted images: an entry referencing this
+               dir itself or an ancestor (a directory cycle, including the
+               root), or an inode already linked elsewhere, would corrupt
+               the tree.  All of those are cached already. */
+            if (childIdx == 0 || childIdx >= Super->InodeCount || VNodes.Find(childIdx) != nullptr)
+                continue;
+
+            VNode* child = LoadVNode(childIdx);
+            if (child == nullptr)
+                continue;
+
+            DirIndex::Link(dir, child);
+        }
+    }
+
+    Mm::Free(dirBuf);
+    delete inode;
+
+    if (ok)
+        VNodes.SetLoaded(dir);
+    return ok;
+}
+
+bool NanoFs::LoadDir(VNode* dir)
+{
+    if (dir == nullptr || dir->NodeType != VNode::TypeDir)
         return false;
+
+    if (dir->Loaded)
+    {
+        VNodes.Touch(dir);
+        return true;
     }
 
-    if (dirInode->Size > NanoMaxDirEntries)
+    VNodes.ShrinkIfLow(dir);
+    return LoadChildren(dir);
+}
+
+void NanoFs::FreeVNode(VNode* vnode)
+{
+    VNodes.Free(vnode);
+}
+
+u32 NanoFs::VNodeToInode(VNode* vnode)
+{
+    if (vnode == nullptr)
+        return (u32)-1;
+    return (u32)vnode->Capacity; // Capacity stores inode index
+}
+
+// --- Directory helpers ---
+
+/* Of the name as stored: at most the 63 characters an inode keeps */
+u32 NanoFs::DirHash(const char* name)
+{
+    ulong len = 0;
+    while (len < sizeof(NanoInode::Name) - 1 && name[len] != '\0')
+        len++;
+    return Stdlib::Crc32(name, len);
+}
+
+static NanoDirEntry* FreeDirSlot(u8* block)
+{
+    NanoDirEntry* entries = (NanoDirEntry*)block;
+    for (u32 i = 0; i < NanoDirEntriesPerBlock; i++)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: dir %u size %u exceeds max %u",
-              (ulong)dirInodeIdx, (ulong)dirInode->Size, (ulong)NanoMaxDirEntries);
-        delete dirInode;
+        if (entries[i].InodeIndex == 0)
+            return &entries[i];
+    }
+    return nullptr;
+}
+
+/* Read a directory's inode and its table into buf (NanoDirMaxBlocks
+   blocks) */
+bool NanoFs::ReadDir(u32 dirInodeIdx, NanoInode* dirInode, u32* blocks, u32& count, u8* buf)
+{
+    if (!ReadInode(dirInodeIdx, dirInode))
+    {
+        Trace(0, "NanoFs::ReadDir: read dir inode %u failed", (ulong)dirInodeIdx);
         return false;
     }
 
-    if (dirInode->Blocks[0] >= NanoDataBlockCount)
+    if (dirInode->Type != NanoInodeTypeDir || !VerifyInodeChecksum(dirInode))
     {
-        Trace(0, "NanoFs::RemoveDirEntry: dir %u bad data block %u",
-              (ulong)dirInodeIdx, (ulong)dirInode->Blocks[0]);
-        delete dirInode;
+        Trace(0, "NanoFs::ReadDir: inode %u is not a valid dir", (ulong)dirInodeIdx);
         return false;
     }
 
-    u8* dirBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (dirBuf == nullptr)
+    // Size bounds the entries of a packed dir; an unclamped on-disk
+    // value would walk past its block
+    bool hashed = (dirInode->Flags & NanoInodeFlagHashedDir) != 0;
+    if (!DirBlocks(dirInode, blocks, count) ||
+        dirInode->Size > (hashed ? MaxDirEntries() : NanoDirEntriesPerBlock))
+    {
+        Trace(0, "NanoFs::ReadDir: dir %u has bad blocks or size %u",
+              (ulong)dirInodeIdx, (ulong)dirInode->Size);
+        return false;
+    }
+
+    for (u32 i = 0; i < count; i++)
+    {
+        if (!ReadMeta(Super->DataStartBlock + blocks[i], buf + i * NanoBlockSize))
+        {
+            Trace(0, "NanoFs::ReadDir: read dir block %u failed for inode %u",
+                  (ulong)blocks[i], (ulong)dirInodeIdx);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Turn a packed directory into a one-block table: hash its entries and
+   clear the slots after them */
+bool NanoFs::HashDir(NanoInode* dirInode, u8* buf)
+{
+    if (dirInode->RootCount != 1 || dirInode->Root[0].Length != 1)
+    {
+        Trace(0, "NanoFs::HashDir: dir has %u extents, %u blocks; left packed",
+              (ulong)dirInode->RootCount, (ulong)dirInode->Root[0].Length);
+        return false;
+    }
+
+    NanoInode* child = new (Mm::NoThrow) NanoInode();
+    if (child == nullptr)
+    {
+        Trace(0, "NanoFs::HashDir: alloc inode failed");
+        return false;
+    }
+
+    /* A child that cannot be read hashes to 0: the hash only picks the
+       block to look in first */
+    NanoDirEntry* entries = (NanoDirEntry*)buf;
+    u32 used = 0;
+    for (u32 i = 0; i < NanoDirEntriesPerBlock; i++)
+    {
+        u32 idx = (i < dirInode->Size) ? entries[i].InodeIndex : 0;
+        entries[i].InodeIndex = idx;
+        entries[i].Hash = 0;
+        if (idx == 0)
+            continue;
+        if (idx < Super->InodeCount && ReadInode(idx, child) && VerifyInodeChecksum(child))
+            entries[i].Hash = DirHash(child->Name);
+        used++;
+    }
+    delete child;
+
+    dirInode->Size = used;
+    dirInode->Flags |= NanoInodeFlagHashedDir;
+    return true;
+}
+
+/* Double the table.  Each entry moves to its block under the new size if
+   that has room, else stays put: lookups fall back to the other blocks */
+bool NanoFs::GrowDir(NanoInode* dirInode, u32* blocks, u32& count, u8* buf)
+{
+    if (count >= NanoDirMaxBlocks || dirInode->RootCount >= NanoRootExtents)
+        return false;
+
+    u32 start;
+    u32 length;
+    if (!AllocRun(count, start, length))
+        return false;
+    if (length < count)
+    {
+        for (u32 j = 0; j < length; j++)
+            SetDataBit(start + j, false);
+        return false;
+    }
+
+    NanoExtent& ext = dirInode->Root[dirInode->RootCount];
+    ext.Logical = count;
+    ext.Start = start;
+    ext.Length = count;
+    dirInode->RootCount++;
+    dirInode->ExtentCount++;
+
+    u32 newCount = 2 * count;
+    Stdlib::MemSet(buf + count * NanoBlockSize, 0, count * NanoBlockSize);
+    for (u32 j = 0; j < count; j++)
+        blocks[count + j] = start + j;
+
+    for (u32 b = 0; b < count; b++)
+    {
+        NanoDirEntry* entries = (NanoDirEntry*)(buf + b * NanoBlockSize);
+        for (u32 i = 0; i < NanoDirEntriesPerBlock; i++)
+        {
+            if (entries[i].InodeIndex == 0)
+                continue;
+
+            u32 home = entries[i].Hash % newCount;
+            if (home == b)
+                continue;
+
+            NanoDirEntry* slot = FreeDirSlot(buf + home * NanoBlockSize);
+            if (slot == nullptr)
+                continue;
+
+            *slot = entries[i];
+            entries[i].InodeIndex = 0;
+            entries[i].Hash = 0;
+        }
+    }
+
+    count = newCount;
+    return true;
+}
+
+bool NanoFs::AddDirEntry(u32 dirInodeIdx, u32 childInodeIdx, const char* name)
+{
+    NanoInode* dirInode = new (Mm::NoThrow) NanoInode();
+    u8* dirBuf = (u8*)Mm::Alloc(NanoDirMaxBlocks * NanoBlockSize, 0);
+    if (dirInode == nullptr || dirBuf == nullptr)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: alloc dir buf failed");
+        Trace(0, "NanoFs::AddDirEntry: alloc failed");
+        if (dirBuf != nullptr)
+            Mm::Free(dirBuf);
         delete dirInode;
         return false;
     }
 
-    if (!Io.ReadBlock(Super->DataStartBlock + dirInode->Blocks[0], dirBuf))
+    u32 blocks[NanoDirMaxBlocks];
+    u32 count = 0;
+    u32 dirty = 0;      // bit per table block to write back
+    bool grown = false;
+
+    bool ok = ReadDir(dirInodeIdx, dirInode, blocks, count, dirBuf);
+    if (ok && (dirInode->Flags & NanoInodeFlagHashedDir) == 0)
+    {
+        ok = HashDir(dirInode, dirBuf);
+        dirty = 1;
+    }
+
+    if (ok && dirInode->Size >= MaxDirEntries())
+    {
+        Trace(0, "NanoFs::AddDirEntry: dir %u full (%u entries)", (ulong)dirInodeIdx, (ulong)dirInode->Size);
+        ok = false;
+    }
+
+    /* Three quarters full: grow before the blocks fill and inserts spill
+       into the next ones */
+    if (ok && dirInode->Size + 1 > count * NanoDirEntriesPerBlock * 3 / 4 &&
+        GrowDir(dirInode, blocks, count, dirBuf))
+    {
+        grown = true;
+        dirty = (1u << count) - 1;
+    }
+
+    if (ok)
+    {
+        u32 hash = DirHash(name);
+        u32 home = hash % count;
+        NanoDirEntry* slot = nullptr;
+        for (u32 i = 0; i < count && slot == nullptr; i++)
+        {
+            u32 b = (home + i) % count;
+            slot = FreeDirSlot(dirBuf + b * NanoBlockSize);
+            if (slot != nullptr)
+                dirty |= 1u << b;
+        }
+
+        if (slot == nullptr)
+        {
+            Trace(0, "NanoFs::AddDirEntry: dir %u has no free slot", (ulong)dirInodeIdx);
+            ok = false;
+        }
+        else
+        {
+            slot->InodeIndex = childInodeIdx;
+            slot->Hash = hash;
+            dirInode->Size++;
+        }
+    }
+
+    for (u32 b = 0; b < count && ok; b++)
+    {
+        if ((dirty & (1u << b)) == 0)
+            continue;
+        if (!WriteMeta(Super->DataStartBlock + blocks[b], dirBuf + b * NanoBlockSize))
+        {
+            Trace(0, "NanoFs::AddDirEntry: write dir block failed for inode %u", (ulong)dirInodeIdx);
+            ok = false;
+        }
+    }
+    Mm::Free(dirBuf);
+
+    /* The table's new blocks are allocated before the inode points at
+       them */
+    if (ok && grown && !FlushSuper())
+    {
+        Trace(0, "NanoFs::AddDirEntry: bitmap commit failed for inode %u", (ulong)dirInodeIdx);
+        ok = false;
+    }
+
+    if (ok)
+    {
+        ComputeInodeChecksum(dirInode);
+        ok = WriteInode(dirInodeIdx, dirInode);
+        if (!ok)
+            Trace(0, "NanoFs::AddDirEntry: write inode %u failed", (ulong)dirInodeIdx);
+    }
+    delete dirInode;
+    return ok;
+}
+
+bool NanoFs::RemoveDirEntry(u32 dirInodeIdx, u32 childInodeIdx, const char* name)
+{
+    NanoInode* dirInode = new (Mm::NoThrow) NanoInode();
+    u8* dirBuf = (u8*)Mm::Alloc(NanoDirMaxBlocks * NanoBlockSize, 0);
+    if (dirInode == nullptr || dirBuf == nullptr)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: read dir block failed for inode %u", (ulong)dirInodeIdx);
-        Mm::Free(dirBuf);
+        Trace(0, "NanoFs::RemoveDirEntry: alloc failed");
+        if (dirBuf != nullptr)
+            Mm::Free(dirBuf);
         delete dirInode;
         return false;
     }
 
-    NanoDirEntry* entries = (NanoDirEntry*)dirBuf;
+    u32 blocks[NanoDirMaxBlocks];
+    u32 count = 0;
+    u32 dirty = 0;
 
-    // Find the entry
-    bool found = false;
-    for (u32 i = 0; i < dirInode->Size; i++)
+    bool ok = ReadDir(dirInodeIdx, dirInode, blocks, count, dirBuf);
+    if (ok && (dirInode->Flags & NanoInodeFlagHashedDir) == 0)
     {
-        if (entries[i].InodeIndex == childInodeIdx)
+        ok = HashDir(dirInode, dirBuf);
+        dirty = 1;
+    }
+
+    if (ok)
+    {
+        /* Its home block first, then where a full one spilled it */
+        u32 home = DirHash(name) % count;
+        bool found = false;
+        for (u32 i = 0; i < count && !found; i++)
         {
-            // Shift remaining entries
-            for (u32 j = i; j + 1 < dirInode->Size; j++)
+            u32 b = (home + i) % count;
+            NanoDirEntry* entries = (NanoDirEntry*)(dirBuf + b * NanoBlockSize);
+            for (u32 j = 0; j < NanoDirEntriesPerBlock; j++)
             {
-                entries[j] = entries[j + 1];
+                if (entries[j].InodeIndex == childInodeIdx)
+                {
+                    entries[j].InodeIndex = 0;
+                    entries[j].Hash = 0;
+                    dirty |= 1u << b;
+                    found = true;
+                    break;
+                }
             }
-            Stdlib::MemSet(&entries[dirInode->Size - 1], 0, sizeof(NanoDirEntry));
+        }
+
+        if (!found)
+        {
+            Trace(0, "NanoFs::RemoveDirEntry: child inode %u not in dir %u", (ulong)childInodeIdx, (ulong)dirInodeIdx);
+            ok = false;
+        }
+        else if (dirInode->Size != 0)
+        {
             dirInode->Size--;
-            found = true;
-            break;
         }
     }
 
-    if (!found)
+    for (u32 b = 0; b < count && ok; b++)
     {
-        Trace(0, "NanoFs::RemoveDirEntry: child inode %u not in dir %u", (ulong)childInodeIdx, (ulong)dirInodeIdx);
-        Mm::Free(dirBuf);
-        delete dirInode;
-        return false;
+        if ((dirty & (1u << b)) == 0)
+            continue;
+        if (!WriteMeta(Super->DataStartBlock + blocks[b], dirBuf + b * NanoBlockSize))
+        {
+            Trace(0, "NanoFs::RemoveDirEntry: write dir block failed for inode %u", (ulong)dirInodeIdx);
+            ok = false;
+        }
     }
-
-    bool ok = Io.WriteBlock(Super->DataStartBlock + dirInode->Blocks[0], dirBuf);
     Mm::Free(dirBuf);
 
-    if (!ok)
+    if (ok)
+    {
+        ComputeInodeChecksum(dirInode);
+        ok = WriteInode(dirInodeIdx, dirInode);
+        if (!ok)
+            Trace(0, "NanoFs::RemoveDirEntry: write inode %u failed", (ulong)dirInodeIdx);
+    }
+    delete dirInode;
+    return ok;
+}
+
+// --- FileSystem interface ---
+
+VNode* NanoFs::Lookup(VNode* dir, const char* name)
+{
+    if (dir == nullptr || name == nullptr)
+        return nullptr;
+
+    if (!LoadDir(dir))
+        return nullptr;
+
+    return DirIndex::Find(dir, name);
+}
+
+VNode* NanoFs::CreateFile(VNode* dir, const char* name)
+{
+    if (dir == nullptr || name == nullptr)
+    {
+        Trace(0, "NanoFs::CreateFile: null dir or name");
+        return nullptr;
+    }
+
+    if (dir->NodeType != VNode::TypeDir)
+    {
+        Trace(0, "NanoFs::CreateFile: parent is not a dir");
+        return nullptr;
+    }
+
+    if (!LoadDir(dir))
+    {
+        Trace(0, "NanoFs::CreateFile: cannot read the parent of '%s'", name);
+        return nullptr;
+    }
+
+    if (Lookup(dir, name) != nullptr)
+    {
+        Trace(0, "NanoFs::CreateFile: '%s' already exists", name);
+        return nullptr;
+    }
+
+    u32 dirInodeIdx = VNodeToInode(dir);
+
+    long inodeIdx = AllocInode();
+    if (inodeIdx < 0)
+        return nullptr;
+
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    if (inode == nullptr)
+    {
+        Trace(0, "NanoFs::CreateFile: alloc inode failed for '%s'", name);
+        FreeInode((u32)inodeIdx);
+        return nullptr;
+    }
+
+    Stdlib::MemSet(inode, 0, sizeof(*inode));
+    inode->Type = NanoInodeTypeFile;
+    inode->Size = 0;
+    Stdlib::StrnCpy(inode->Name, name, sizeof(inode->Name));
+    inode->ParentInode = dirInodeIdx;
+    inode->Flags = NanoInodeFlagBlockChecksums;
+
+    ComputeInodeChecksum(inode);
+    if (!WriteInode((u32)inodeIdx, inode))
     {
-        Trace(0, "NanoFs::RemoveDirEntry: write dir block failed for inode %u", (ulong)dirInodeIdx);
-        delete dirInode;
-        return false;
+        Trace(0, "NanoFs::CreateFile: write inode failed for '%s'", name);
+        delete inode;
+        FreeInode((u32)inodeIdx);
+        return nullptr;
     }
+    delete inode;
 
-    ComputeInodeChecksum(dirInode);
-    ok = WriteInode(dirInodeIdx, dirInode);
-    if (!ok)
-        Trace(0, "NanoFs::RemoveDirEntry: write inode %u failed", (ulong)dirInodeIdx);
-    delete dirInode;
-    return ok;
-}
-
-// --- FileSystem interface ---
-
-VNode* NanoFs::Lookup(VNode* dir, const char* name)
-{
-    if (dir == nullptr || name == nullptr)
+    /* Commit the inode bitmap now that the inode contents are on disk */
+    if (!FlushSuper())
+    {
+        Trace(0, "NanoFs::CreateFile: bitmap commit failed for '%s'", name);
+        FreeInode((u32)inodeIdx);
         return nullptr;
+    }
 
-    if (dir->NodeType != VNode::TypeDir)
+    if (!AddDirEntry(dirInodeIdx, (u32)inodeIdx, name))
+    {
+        Trace(0, "NanoFs::CreateFile: add dir entry failed for '%s'", name);
+        FreeInode((u32)inodeIdx);
         return nullptr;
+    }
 
-    Stdlib::ListEntry* head = &dir->Children;
-    Stdlib::ListEntry* entry = head->Flink;
-    while (entry != head)
+    VNode* vnode = VNodes.Create((u32)inodeIdx, VNode::TypeFile);
+    if (vnode == nullptr)
     {
-        VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
-        if (Stdlib::StrCmp(child->Name, name) == 0)
-            return child;
-        entry = entry->Flink;
+        Trace(0, "NanoFs::CreateFile: alloc vnode failed for '%s'", name);
+        RemoveDirEntry(dirInodeIdx, (u32)inodeIdx, name);
+        FreeInode((u32)inodeIdx);
+        return nullptr;
     }
 
-    return nullptr;
+    Stdlib::StrnCpy(vnode->Name, name, sizeof(vnode->Name));
+    DirIndex::Link(dir, vnode);
+
+    return vnode;
 }
 
-VNode* NanoFs::CreateFile(VNode* dir, const char* name)
+VNode* NanoFs::CreateDir(VNode* dir, const char* name)
 {
     if (dir == nullptr || name == nullptr)
     {
-        Trace(0, "NanoFs::CreateFile: null dir or name");
+        Trace(0, "NanoFs::CreateDir: null dir or name");
         return nullptr;
     }
 
     if (dir->NodeType != VNode::TypeDir)
     {
-        Trace(0, "NanoFs::CreateFile: parent is not a dir");
+        Trace(0, "NanoFs::CreateDir: parent is not a dir");
+        return nullptr;
+    }
+
+    if (!LoadDir(dir))
+    {
+        Trace(0, "NanoFs::CreateDir: cannot read the parent of '%s'", name);
         return nullptr;
     }
 
     if (Lookup(dir, name) != nullptr)
     {
-        Trace(0, "NanoFs::CreateFile: '%s' already exists", name);
+        Trace(0, "NanoFs::CreateDir: '%s' already exists", name);
         return nullptr;
     }
 
@@ -867,377 +2841,803 @@ VNode* NanoFs::CreateFile(VNode* dir, const char* name)
     if (inodeIdx < 0)
         return nullptr;
 
+    long dataIdx = AllocDataBlock();
+    if (dataIdx < 0)
+    {
+        FreeInode((u32)inodeIdx);
+        return nullptr;
+    }
+
+    // Zero out the new directory data block
+    u8* zeroBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
+    if (zeroBuf == nullptr)
+    {
+        Trace(0, "NanoFs::CreateDir: alloc zero buf failed for '%s'", name);
+        FreeDataBlock((u32)dataIdx);
+        FreeInode((u32)inodeIdx);
+        return nullptr;
+    }
+    Stdlib::MemSet(zeroBuf, 0, NanoBlockSize);
+    bool zeroOk = WriteMeta(Super->DataStartBlock + (u32)dataIdx, zeroBuf);
+    Mm::Free(zeroBuf);
+    if (!zeroOk)
+    {
+        Trace(0, "NanoFs::CreateDir: write zero block failed for '%s'", name);
+        FreeDataBlock((u32)dataIdx);
+        FreeInode((u32)inodeIdx);
+        return nullptr;
+    }
+
     NanoInode* inode = new (Mm::NoThrow) NanoInode();
     if (inode == nullptr)
     {
-        Trace(0, "NanoFs::CreateFile: alloc inode failed for '%s'", name);
+        Trace(0, "NanoFs::CreateDir: alloc inode failed for '%s'", name);
+        FreeDataBlock((u32)dataIdx);
         FreeInode((u32)inodeIdx);
         return nullptr;
     }
 
     Stdlib::MemSet(inode, 0, sizeof(*inode));
-    inode->Type = NanoInodeTypeFile;
+    inode->Type = NanoInodeTypeDir;
     inode->Size = 0;
     Stdlib::StrnCpy(inode->Name, name, sizeof(inode->Name));
     inode->ParentInode = dirInodeIdx;
-    inode->DataChecksum = 0;
+    inode->Flags = NanoInodeFlagHashedDir;
+    inode->RootCount = 1;
+    inode->ExtentCount = 1;
+    inode->Root[0].Logical = 0;
+    inode->Root[0].Start = (u32)dataIdx;
+    inode->Root[0].Length = 1;
 
     ComputeInodeChecksum(inode);
     if (!WriteInode((u32)inodeIdx, inode))
     {
-        Trace(0, "NanoFs::CreateFile: write inode failed for '%s'", name);
+        Trace(0, "NanoFs::CreateDir: write inode failed for '%s'", name);
         delete inode;
+        FreeDataBlock((u32)dataIdx);
         FreeInode((u32)inodeIdx);
         return nullptr;
     }
     delete inode;
 
-    /* Commit the inode bitmap now that the inode contents are on disk */
+    /* Commit the bitmaps now that the inode and data block are on disk */
     if (!FlushSuper())
     {
-        Trace(0, "NanoFs::CreateFile: bitmap commit failed for '%s'", name);
+        Trace(0, "NanoFs::CreateDir: bitmap commit failed for '%s'", name);
+        FreeDataBlock((u32)dataIdx);
         FreeInode((u32)inodeIdx);
         return nullptr;
     }
 
-    if (!AddDirEntry(dirInodeIdx, (u32)inodeIdx))
+    if (!AddDirEntry(dirInodeIdx, (u32)inodeIdx, name))
     {
-        Trace(0, "NanoFs::CreateFile: add dir entry failed for '%s'", name);
+        Trace(0, "NanoFs::CreateDir: add dir entry failed for '%s'", name);
+        FreeDataBlock((u32)dataIdx);
+        FreeInode((u32)inodeIdx);
+        return nullptr;
+    }
+
+    VNode* vnode = VNodes.Create((u32)inodeIdx, VNode::TypeDir);
+    if (vnode == nullptr)
+    {
+        Trace(0, "NanoFs::CreateDir: alloc vnode failed for '%s'", name);
+        RemoveDirEntry(dirInodeIdx, (u32)inodeIdx, name);
+        FreeDataBlock((u32)dataIdx);
         FreeInode((u32)inodeIdx);
         return nullptr;
     }
 
-    VNode* vnode = new (Mm::NoThrow) VNode();
-    if (vnode == nullptr)
+    Stdlib::StrnCpy(vnode->Name, name, sizeof(vnode->Name));
+    DirIndex::Link(dir, vnode);
+    VNodes.SetLoaded(vnode); // empty
+
+    return vnode;
+}
+
+bool NanoFs::Write(VNode* file, const void* data, ulong len)
+{
+    if (file == nullptr || file->NodeType != VNode::TypeFile)
+    {
+        Trace(0, "NanoFs::Write: null file or not a file");
+        return false;
+    }
+
+    if (len > NanoMaxFileSize)
+    {
+        Trace(0, "NanoFs::Write: len %u exceeds max %u", (ulong)len, (ulong)NanoMaxFileSize);
+        return false;
+    }
+
+    /* The file's blocks are freed and reallocated below */
+    file->Ra.Release();
+
+    u32 inodeIdx = VNodeToInode(file);
+    NanoInode* inode = new (Mm::NoThrow) NanoInode();
+    if (inode == nullptr)
+    {
+        Trace(0, "NanoFs::Write: alloc inode failed");
+        return false;
+    }
+
+    if (!ReadInode(inodeIdx, inode))
+    {
+        Trace(0, "NanoFs::Write: read inode %u failed", (ulong)inodeIdx);
+        delete inode;
+        return false;
+    }
+
+    // A corrupted inode's extent map cannot be trusted for freeing: an
+    // in-range garbage block index would free a block another file owns.
+    NanoExtentList oldExtents;
+    NanoExtentList oldTree;
+    if (!VerifyInodeChecksum(inode) || !LoadExtents(inodeIdx, inode, oldExtents, &oldTree))
+    {
+        Trace(0, "NanoFs::Write: inode %u checksum mismatch or bad extents", (ulong)inodeIdx);
+        delete inode;
+        return false;
+    }
+
+    // Old blocks must be freed only after the new inode is committed: the
+    // bitmap is FUA-flushed by FreeRuns, so freeing first leaves a crash
+    // window where the on-disk inode references blocks marked free.
+
+    // Small files live in the inode itself, otherwise allocate the new
+    // blocks as few contiguous runs as the free space allows
+    bool inlineData = (len != 0 && len <= NanoInlineSize);
+    u32 blockCount = inlineData ? 0 : (u32)((len + NanoBlockSize - 1) / NanoBlockSize);
+    NanoExtentList extents;
+    NanoExtentList tree;
+    bool ok = true;
+    for (u32 logical = 0; logical < blockCount;)
+    {
+        u32 start;
+        u32 length;
+        if (!AllocRun(blockCount - logical, start, length))
+        {
+            Trace(0, "NanoFs::Write: alloc block %u/%u failed for inode %u",
+                  (ulong)logical, (ulong)blockCount, (ulong)inodeIdx);
+            ok = false;
+            break;
+        }
+        if (!extents.Add(logical, start, length))
+        {
+            for (u32 j = 0; j < length; j++)
+                SetDataBit(start + j, false);
+            ok = false;
+            break;
+        }
+        logical += length;
+    }
+
+    // Write data to the new extents, a batch of adjacent blocks at a time
+    // so that they reach the device as merged requests
+    u32 batchMax = (blockCount < NanoWriteBatch) ? blockCount : NanoWriteBatch;
+    u8* wbuf = nullptr;
+    if (ok && batchMax != 0)
+    {
+        wbuf = (u8*)Mm::Alloc(batchMax * NanoBlockSize, 0);
+        if (wbuf == nullptr)
+        {
+            Trace(0, "NanoFs::Write: alloc write buf failed");
+            ok = false;
+        }
+    }
+
+    const u8* src = static_cast<const u8*>(data);
+    ulong remaining = len;
+    for (u32 i = 0; i < extents.GetCount() && ok; i++)
+    {
+        const NanoExtent& ext = extents.Get(i);
+        for (u32 off = 0; off < ext.Length && ok; off += batchMax)
+        {
+            u32 batchCount = ext.Length - off;
+            if (batchCount > batchMax)
+                batchCount = batchMax;
+
+            u32 crcs[NanoWriteBatch];
+            for (u32 j = 0; j < batchCount; j++)
+            {
+                u8* dst = wbuf + j * NanoBlockSize;
+                u32 chunkSize = (remaining < NanoBlockSize) ? (u32)remaining : NanoBlockSize;
+                Stdlib::MemSet(dst, 0, NanoBlockSize);
+                Stdlib::MemCpy(dst, src, chunkSize);
+                crcs[j] = Stdlib::Crc32(dst, chunkSize);
+                src += chunkSize;
+                remaining -= chunkSize;
+            }
+
+            if (!Io.WriteBlockRange(Super->DataStartBlock + ext.Start + off, batchCount, wbuf) ||
+                !StoreChecksums(ext.Start + off, crcs, batchCount))
+            {
+                Trace(0, "NanoFs::Write: write data blocks %u..%u failed for inode %u",
+                      (ulong)(ext.Logical + off), (ulong)(ext.Logical + off + batchCount - 1),
+                      (ulong)inodeIdx);
+                ok = false;
+            }
+        }
+    }
+
+    if (wbuf != nullptr)
+        Mm::Free(wbuf);
+
+    if (ok)
+        ok = BuildTree(inodeIdx, inode, extents, tree);
+
+    if (ok && inlineData)
+    {
+        Stdlib::MemCpy(inode->InlineData, data, len);
+        inode->Flags |= NanoInodeFlagInline;
+    }
+
+    // Success path: commit the new inode first, then free the old blocks.
+    // The data and tree blocks must be durable before the FUA inode commit
+    // references them, and the commit itself must be durable before the
+    // old blocks are freed -- otherwise a crash loses data the bitmap
+    // already accounts for.  An inline write has neither.
+    if (ok && blockCount != 0 && !OrderData())
+    {
+        Trace(0, "NanoFs::Write: data flush failed for inode %u", (ulong)inodeIdx);
+        ok = false;
+    }
+
+    /* Commit the data bitmap (new blocks used) before the inode that
+       references them; AllocRun only set the bits in memory */
+    if (ok && blockCount != 0 && !FlushSuper())
+    {
+        Trace(0, "NanoFs::Write: bitmap commit failed for inode %u", (ulong)inodeIdx);
+        ok = false;
+    }
+
+    if (ok)
+    {
+        inode->Size = (u32)len;
+        inode->Flags |= NanoInodeFlagBlockChecksums;
+        ComputeInodeChecksum(inode);
+        ok = WriteInode(inodeIdx, inode, true);
+        if (!ok)
+            Trace(0, "NanoFs::Write: commit inode %u failed", (ulong)inodeIdx);
+    }
+    delete inode;
+
+    if (!ok)
+    {
+        // The old on-disk inode still references the old blocks; release
+        // the new ones instead.
+        FreeRuns(extents);
+        FreeRuns(tree);
+        return false;
+    }
+
+    FreeRuns(oldExtents);
+    FreeRuns(oldTree);
+    IssueDiscards(false);
+
+    file->Size = len;
+    return true;
+}
+
+/* Both lists sorted by file block and disjoint */
+static bool MergeExtents(const NanoExtentList& a, const NanoExtentList& b, NanoExtentList& out)
+{
+    out.Clear();
+    u32 i = 0;
+    u32 j = 0;
+    while (i < a.GetCount() || j < b.GetCount())
+    {
+        bool fromA = (j >= b.GetCount()) ||
+                     (i < a.GetCount() && a.Get(i).Logical < b.Get(j).Logical);
+        const NanoExtent& ext = fromA ? a.Get(i++) : b.Get(j++);
+        if (!out.Add(ext.Logical, ext.Start, ext.Length))
+            return false;
+    }
+    return true;
+}
+
+/* Allocate data blocks for the holes of extents within file blocks
+   first..last.  Each hole is placed right behind the block before it
+   when that is free, so appends extend the file's last extent. */
+bool NanoFs::AllocHoles(const NanoExtentList& extents, u32 first, u32 last, NanoExtentList& added)
+{
+    u32 b = first;
+    while (b <= last)
+    {
+        u32 index;
+        if (extents.Find(b, index))
+        {
+            b = extents.Get(index).Logical + extents.Get(index).Length;
+            continue;
+        }
+
+        u32 end = last + 1;
+        for (u32 i = 0; i < extents.GetCount(); i++)
+        {
+            if (extents.Get(i).Logical > b)
+            {
+                if (extents.Get(i).Logical < end)
+                    end = extents.Get(i).Logical;
+                break;
+            }
+        }
+
+        if (b != 0 && extents.Find(b - 1, index))
+        {
+            const NanoExtent& prev = extents.Get(index);
+            AllocHint = prev.Start + prev.Length;
+        }
+
+        while (b < end)
+        {
+            u32 start;
+            u32 length;
+            if (!AllocRun(end - b, start, length))
+                return false;
+            if (!added.Add(b, start, length))
+            {
+                for (u32 j = 0; j < length; j++)
+                    SetDataBit(start + j, false);
+                return false;
+            }
+            b += length;
+        }
+    }
+    return true;
+}
+
+/* Give every hole of the file's first fileBlocks blocks zeroed data
+   blocks and turn block checksum verification off: the data will change
+   without passing through Write, the checksums cannot follow until the
+   file is rewritten.  The bitmap and inode are committed on return;
+   extents receives the new map. */
+bool NanoFs::FillHoles(u32 inodeIdx, NanoInode* inode, NanoExtentList& extents,
+                       const NanoExtentList& oldTree, u32 fileBlocks)
+{
+    NanoExtentList added;
+    NanoExtentList merged;
+    NanoExtentList tree;
+    if (!AllocHoles(extents, 0, fileBlocks - 1, added) || !MergeExtents(extents, added, merged))
+    {
+        FreeRuns(added);
+        return false;
+    }
+
+    if (added.GetCount() == 0 && !(inode->Flags & NanoInodeFlagBlockChecksums))
+        return true;
+
+    bool ok = true;
+    if (added.GetCount() != 0)
+    {
+        u8* zeros = (u8*)Mm::Alloc(NanoWriteBatch * NanoBlockSize, 0);
+        ok = (zeros != nullptr);
+        if (ok)
+            Stdlib::MemSet(zeros, 0, NanoWriteBatch * NanoBlockSize);
+
+        for (u32 i = 0; i < added.GetCount() && ok; i++)
+        {
+            const NanoExtent& run = added.Get(i);
+            for (u32 done = 0; done < run.Length && ok; done += NanoWriteBatch)
+            {
+                u32 count = run.Length - done;
+                if (count > NanoWriteBatch)
+                    count = NanoWriteBatch;
+                ok = Io.WriteBlockRange(Super->DataStartBlock + run.Start + done, count, zeros);
+            }
+        }
+        if (zeros != nullptr)
+            Mm::Free(zeros);
+
+        ok = ok && BuildTree(inodeIdx, inode, merged, tree) && OrderData() && FlushSuper();
+    }
+
+    if (ok)
     {
-        Trace(0, "NanoFs::CreateFile: alloc vnode failed for '%s'", name);
-        RemoveDirEntry(dirInodeIdx, (u32)inodeIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        inode->Flags &= ~NanoInodeFlagBlockChecksums;
+        ComputeInodeChecksum(inode);
+        ok = WriteInode(inodeIdx, inode, true);
     }
 
-    Stdlib::MemSet(vnode, 0, sizeof(VNode));
-    Stdlib::StrnCpy(vnode->Name, name, sizeof(vnode->Name));
-    vnode->NodeType = VNode::TypeFile;
-    vnode->Parent = dir;
-    vnode->Children.Init();
-    vnode->SiblingLink.Init();
-    vnode->Data = nullptr;
-    vnode->Size = 0;
-    vnode->Capacity = (ulong)inodeIdx;
+    if (!ok)
+    {
+        FreeRuns(added);
+        FreeRuns(tree);
+        return false;
+    }
 
-    VNodes[(u32)inodeIdx] = vnode;
-    dir->Children.InsertTail(&vnode->SiblingLink);
+    // The map outlives this call: the allocation must be durable first
+    if (added.GetCount() != 0)
+        FreeRuns(oldTree);
+    if (!CommitJournal())
+        return false;
+    IssueDiscards(false);
 
-    return vnode;
+    extents.Clear();
+    for (u32 i = 0; i < merged.GetCount() && ok; i++)
+    {
+        const NanoExtent& ext = merged.Get(i);
+        ok = extents.Add(ext.Logical, ext.Start, ext.Length);
+    }
+    return ok;
 }
 
-VNode* NanoFs::CreateDir(VNode* dir, const char* name)
+/* Rewrite the mapped file blocks among first..last in place: bytes below
+   min(old size, newSize) are kept, the rest zeroed, then len bytes of
+   data at file offset offset laid over and the checksums recomputed for
+   newSize.  Old contents are read (and verified) only for blocks the
+   data does not cover; an inline file's come from the inode.  A crash between a block and its checksum leaves
+   the block failing verification rather than silently torn. */
+bool NanoFs::RewriteBlocks(const NanoInode* inode, const NanoExtentList& oldExtents,
+                           const NanoExtentList& extents, u32 first, u32 last,
+                           const u8* data, u64 offset, ulong len, u64 newSize)
 {
-    if (dir == nullptr || name == nullptr)
-    {
-        Trace(0, "NanoFs::CreateDir: null dir or name");
-        return nullptr;
-    }
+    u32 batchMax = last - first + 1;
+    if (batchMax > NanoWriteBatch)
+        batchMax = NanoWriteBatch;
 
-    if (dir->NodeType != VNode::TypeDir)
+    u8* wbuf = (u8*)Mm::Alloc(batchMax * NanoBlockSize, 0);
+    if (wbuf == nullptr)
     {
-        Trace(0, "NanoFs::CreateDir: parent is not a dir");
-        return nullptr;
+        Trace(0, "NanoFs::RewriteBlocks: alloc write buf failed");
+        return false;
     }
 
-    if (Lookup(dir, name) != nullptr)
+    u64 keepEnd = (inode->Size < newSize) ? inode->Size : newSize;
+    u64 dataEnd = offset + len;
+    bool ok = true;
+    u32 b = first;
+    while (ok && b <= last)
     {
-        Trace(0, "NanoFs::CreateDir: '%s' already exists", name);
-        return nullptr;
-    }
+        u32 index;
+        if (!extents.Find(b, index))
+        {
+            b++;
+            continue;
+        }
 
-    u32 dirInodeIdx = VNodeToInode(dir);
+        const NanoExtent& ext = extents.Get(index);
+        u32 count = ext.Logical + ext.Length - b;
+        if (count > last + 1 - b)
+            count = last + 1 - b;
+        if (count > batchMax)
+            count = batchMax;
+        u32 phys = ext.Start + (b - ext.Logical);
 
-    long inodeIdx = AllocInode();
-    if (inodeIdx < 0)
-        return nullptr;
+        u32 crcs[NanoWriteBatch];
+        for (u32 j = 0; j < count && ok; j++)
+        {
+            u8* block = wbuf + (ulong)j * NanoBlockSize;
+            u64 blockStart = (u64)(b + j) * NanoBlockSize;
+            u64 keep = (keepEnd > blockStart) ? keepEnd - blockStart : 0;
+            if (keep > NanoBlockSize)
+                keep = NanoBlockSize;
+            bool covered = data != nullptr && offset <= blockStart && dataEnd >= blockStart + keep;
+
+            Stdlib::MemSet(block, 0, NanoBlockSize);
+            u32 oldIndex;
+            if (keep != 0 && !covered && (inode->Flags & NanoInodeFlagInline))
+            {
+                /* Inline data moving out to block 0; keep <= its size */
+                Stdlib::MemCpy(block, inode->InlineData, (ulong)keep);
+            }
+            else if (keep != 0 && !covered && oldExtents.Find(b + j, oldIndex))
+            {
+                const NanoExtent& old = oldExtents.Get(oldIndex);
+                u32 oldPhys = old.Start + (b + j - old.Logical);
+                if (!Io.ReadBlock(Super->DataStartBlock + oldPhys, block) ||
+                    !VerifyBlockChecksum(inode, b + j, oldPhys, block))
+                {
+                    Trace(0, "NanoFs::RewriteBlocks: cannot read block %u (data block %u)",
+                          (ulong)(b + j), (ulong)oldPhys);
+                    ok = false;
+                    break;
+                }
+                Stdlib::MemSet(block + keep, 0, (ulong)(NanoBlockSize - keep));
+            }
 
-    long dataIdx = AllocDataBlock();
-    if (dataIdx < 0)
-    {
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+            if (data != nullptr)
+            {
+                u64 from = (offset > blockStart) ? offset : blockStart;
+                u64 to = (dataEnd < blockStart + NanoBlockSize) ? dataEnd : blockStart + NanoBlockSize;
+                if (from < to)
+                    Stdlib::MemCpy(block + (from - blockStart), data + (from - offset), (ulong)(to - from));
+            }
+
+            u64 used = newSize - blockStart;
+            if (used > NanoBlockSize)
+                used = NanoBlockSize;
+            crcs[j] = Stdlib::Crc32(block, (ulong)used);
+        }
+
+        if (ok && (!Io.WriteBlockRange(Super->DataStartBlock + phys, count, wbuf) ||
+                   !StoreChecksums(phys, crcs, count)))
+        {
+            Trace(0, "NanoFs::RewriteBlocks: write blocks %u..%u failed",
+                  (ulong)b, (ulong)(b + count - 1));
+            ok = false;
+        }
+        b += count;
     }
 
-    // Zero out the new directory data block
-    u8* zeroBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (zeroBuf == nullptr)
+    Mm::Free(wbuf);
+    return ok;
+}
+
+bool NanoFs::WriteAt(VNode* file, const void* data, ulong len, ulong offset)
+{
+    if (file == nullptr || file->NodeType != VNode::TypeFile)
     {
-        Trace(0, "NanoFs::CreateDir: alloc zero buf failed for '%s'", name);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        Trace(0, "NanoFs::WriteAt: null file or not a file");
+        return false;
     }
-    Stdlib::MemSet(zeroBuf, 0, NanoBlockSize);
-    bool zeroOk = Io.WriteBlock(Super->DataStartBlock + (u32)dataIdx, zeroBuf);
-    Mm::Free(zeroBuf);
-    if (!zeroOk)
+
+    if (len == 0)
+        return true;
+
+    if (offset > NanoMaxFileSize || len > NanoMaxFileSize - offset)
     {
-        Trace(0, "NanoFs::CreateDir: write zero block failed for '%s'", name);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        Trace(0, "NanoFs::WriteAt: range %u+%u exceeds max %u",
+              (ulong)offset, (ulong)len, (ulong)NanoMaxFileSize);
+        return false;
     }
 
+    u32 inodeIdx = VNodeToInode(file);
     NanoInode* inode = new (Mm::NoThrow) NanoInode();
     if (inode == nullptr)
     {
-        Trace(0, "NanoFs::CreateDir: alloc inode failed for '%s'", name);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        Trace(0, "NanoFs::WriteAt: alloc inode failed");
+        return false;
     }
 
-    Stdlib::MemSet(inode, 0, sizeof(*inode));
-    inode->Type = NanoInodeTypeDir;
-    inode->Size = 0;
-    Stdlib::StrnCpy(inode->Name, name, sizeof(inode->Name));
-    inode->ParentInode = dirInodeIdx;
-    inode->Blocks[0] = (u32)dataIdx;
-    inode->DataChecksum = 0;
-
-    ComputeInodeChecksum(inode);
-    if (!WriteInode((u32)inodeIdx, inode))
+    NanoExtentList oldExtents;
+    NanoExtentList oldTree;
+    if (!ReadInode(inodeIdx, inode) || !VerifyInodeChecksum(inode) ||
+        !LoadExtents(inodeIdx, inode, oldExtents, &oldTree))
     {
-        Trace(0, "NanoFs::CreateDir: write inode failed for '%s'", name);
+        Trace(0, "NanoFs::WriteAt: bad inode %u", (ulong)inodeIdx);
         delete inode;
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        return false;
     }
-    delete inode;
 
-    /* Commit the bitmaps now that the inode and data block are on disk */
-    if (!FlushSuper())
+    u64 oldSize = inode->Size;
+    u64 end = (u64)offset + len;
+    u64 newSize = (end > oldSize) ? end : oldSize;
+    u32 first = (u32)(offset / NanoBlockSize);
+    u32 last = (u32)((end - 1) / NanoBlockSize);
+    bool isInline = (inode->Flags & NanoInodeFlagInline) != 0;
+
+    /* Still small and without blocks: patch the inline data in place */
+    if (newSize <= NanoInlineSize && (isInline || oldExtents.GetCount() == 0))
     {
-        Trace(0, "NanoFs::CreateDir: bitmap commit failed for '%s'", name);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        if (!isInline)
+        {
+            Stdlib::MemSet(inode->InlineData, 0, sizeof(inode->InlineData));
+            inode->Flags |= NanoInodeFlagInline;
+        }
+        Stdlib::MemCpy(inode->InlineData + offset, data, len);
+        inode->Size = (u32)newSize;
+        ComputeInodeChecksum(inode);
+        bool ok = WriteInode(inodeIdx, inode, true);
+        if (!ok)
+            Trace(0, "NanoFs::WriteAt: commit inode %u failed", (ulong)inodeIdx);
+        delete inode;
+        if (ok)
+            file->Size = (ulong)newSize;
+        return ok;
+    }
+
+    /* Blocks only for the holes the range covers: appends allocate just
+       the new blocks, overwrites none.  Inline data outgrowing the inode
+       moves to block 0. */
+    NanoExtentList added;
+    NanoExtentList extents;
+    NanoExtentList tree;
+    u32 allocFirst = first;
+    bool ok = true;
+    if (isInline && oldSize != 0)
+    {
+        if (first <= 1)
+            allocFirst = 0;
+        else
+            ok = AllocHoles(oldExtents, 0, 0, added);
+    }
+    ok = ok && AllocHoles(oldExtents, allocFirst, last, added) &&
+         MergeExtents(oldExtents, added, extents);
+
+    /* The bytes of the old last block past the old size become file
+       data: zero them and checksum the whole block */
+    u32 tailBlock = (u32)(oldSize / NanoBlockSize);
+    if (ok && newSize > oldSize && (oldSize % NanoBlockSize) != 0 && tailBlock < first)
+        ok = RewriteBlocks(inode, oldExtents, extents, tailBlock, tailBlock, nullptr, 0, 0, newSize);
+    if (ok)
+        ok = RewriteBlocks(inode, oldExtents, extents, first, last,
+                           static_cast<const u8*>(data), offset, len, newSize);
+
+    bool remap = (added.GetCount() != 0 || isInline);
+    if (ok && remap)
+        ok = BuildTree(inodeIdx, inode, extents, tree);
+    if (ok && isInline)
+        inode->Flags |= NanoInodeFlagBlockChecksums;
+
+    // The data (and new tree blocks) are durable before the inode commit
+    // references them; the data bitmap goes before the inode as well.
+    if (ok && !OrderData())
+    {
+        Trace(0, "NanoFs::WriteAt: data flush failed for inode %u", (ulong)inodeIdx);
+        ok = false;
     }
 
-    if (!AddDirEntry(dirInodeIdx, (u32)inodeIdx))
+    if (ok && remap && !FlushSuper())
     {
-        Trace(0, "NanoFs::CreateDir: add dir entry failed for '%s'", name);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        Trace(0, "NanoFs::WriteAt: bitmap commit failed for inode %u", (ulong)inodeIdx);
+        ok = false;
     }
 
-    VNode* vnode = new (Mm::NoThrow) VNode();
-    if (vnode == nullptr)
+    if (ok)
     {
-        Trace(0, "NanoFs::CreateDir: alloc vnode failed for '%s'", name);
-        RemoveDirEntry(dirInodeIdx, (u32)inodeIdx);
-        FreeDataBlock((u32)dataIdx);
-        FreeInode((u32)inodeIdx);
-        return nullptr;
+        inode->Size = (u32)newSize;
+        ComputeInodeChecksum(inode);
+        ok = WriteInode(inodeIdx, inode, true);
+        if (!ok)
+            Trace(0, "NanoFs::WriteAt: commit inode %u failed", (ulong)inodeIdx);
     }
+    delete inode;
 
-    Stdlib::MemSet(vnode, 0, sizeof(VNode));
-    Stdlib::StrnCpy(vnode->Name, name, sizeof(vnode->Name));
-    vnode->NodeType = VNode::TypeDir;
-    vnode->Parent = dir;
-    vnode->Children.Init();
-    vnode->SiblingLink.Init();
-    vnode->Data = nullptr;
-    vnode->Size = 0;
-    vnode->Capacity = (ulong)inodeIdx;
+    if (!ok)
+    {
+        FreeRuns(added);
+        FreeRuns(tree);
+        return false;
+    }
 
-    VNodes[(u32)inodeIdx] = vnode;
-    dir->Children.InsertTail(&vnode->SiblingLink);
+    if (remap)
+    {
+        FreeRuns(oldTree);
+        IssueDiscards(false);
+    }
 
-    return vnode;
+    file->Size = (ulong)newSize;
+    return true;
 }
 
-bool NanoFs::Write(VNode* file, const void* data, ulong len)
+bool NanoFs::Truncate(VNode* file, ulong size)
 {
     if (file == nullptr || file->NodeType != VNode::TypeFile)
     {
-        Trace(0, "NanoFs::Write: null file or not a file");
+        Trace(0, "NanoFs::Truncate: null file or not a file");
         return false;
     }
 
-    if (len > NanoMaxFileSize)
+    if (size > NanoMaxFileSize)
     {
-        Trace(0, "NanoFs::Write: len %u exceeds max %u", (ulong)len, (ulong)NanoMaxFileSize);
+        Trace(0, "NanoFs::Truncate: size %u exceeds max %u", (ulong)size, (ulong)NanoMaxFileSize);
         return false;
     }
 
+    /* Blocks past the new end are freed below */
+    file->Ra.Release();
+
     u32 inodeIdx = VNodeToInode(file);
     NanoInode* inode = new (Mm::NoThrow) NanoInode();
     if (inode == nullptr)
     {
-        Trace(0, "NanoFs::Write: alloc inode failed");
+        Trace(0, "NanoFs::Truncate: alloc inode failed");
         return false;
     }
 
-    if (!ReadInode(inodeIdx, inode))
+    NanoExtentList oldExtents;
+    NanoExtentList oldTree;
+    if (!ReadInode(inodeIdx, inode) || !VerifyInodeChecksum(inode) ||
+        !LoadExtents(inodeIdx, inode, oldExtents, &oldTree))
     {
-        Trace(0, "NanoFs::Write: read inode %u failed", (ulong)inodeIdx);
+        Trace(0, "NanoFs::Truncate: bad inode %u", (ulong)inodeIdx);
         delete inode;
         return false;
     }
 
-    // A corrupted inode's Size/Blocks cannot be trusted for freeing: an
-    // in-range garbage block index would free a block another file owns.
-    if (!VerifyInodeChecksum(inode))
+    u64 oldSize = inode->Size;
+    if (size == oldSize)
     {
-        Trace(0, "NanoFs::Write: inode %u checksum mismatch", (ulong)inodeIdx);
         delete inode;
-        return false;
+        return true;
     }
 
-    u32 oldBlockCount = (inode->Size > 0)
-        ? (inode->Size + NanoBlockSize - 1) / NanoBlockSize : 0;
-    if (oldBlockCount > NanoMaxBlocks)
-        oldBlockCount = NanoMaxBlocks;
-
-    // Old blocks must be freed only after the new inode is committed: the
-    // bitmap is FUA-flushed by FreeDataBlock, so freeing first leaves a crash
-    // window where the on-disk inode references blocks marked free.
-    u32 oldBlocks[NanoMaxBlocks];
-    Stdlib::MemCpy(oldBlocks, inode->Blocks, sizeof(oldBlocks));
-
-    if (len == 0)
+    bool isInline = (inode->Flags & NanoInodeFlagInline) != 0;
+    if (isInline && size <= NanoInlineSize)
     {
-        Stdlib::MemSet(inode->Blocks, 0, sizeof(inode->Blocks));
-        inode->Size = 0;
-        inode->DataChecksum = 0;
+        if (size < oldSize)
+            Stdlib::MemSet(inode->InlineData + size, 0, (ulong)(oldSize - size));
+        inode->Size = (u32)size;
         ComputeInodeChecksum(inode);
         bool ok = WriteInode(inodeIdx, inode, true);
-        delete inode;
         if (!ok)
-        {
-            Trace(0, "NanoFs::Write: truncate inode %u failed", (ulong)inodeIdx);
-            return false;
-        }
-        for (u32 i = 0; i < oldBlockCount; i++)
-            FreeDataBlock(oldBlocks[i]);
-        file->Size = 0;
-        return true;
+            Trace(0, "NanoFs::Truncate: commit inode %u failed", (ulong)inodeIdx);
+        delete inode;
+        if (ok)
+            file->Size = size;
+        return ok;
     }
 
-    // Allocate new data blocks into a temporary array first
-    u32 newBlockCount = ((u32)len + NanoBlockSize - 1) / NanoBlockSize;
-    u32 newBlocks[NanoMaxBlocks];
-    Stdlib::MemSet(newBlocks, 0, sizeof(newBlocks));
-
-    for (u32 i = 0; i < newBlockCount; i++)
+    /* Growing only moves the size: the new blocks are a hole.  Inline
+       data outgrowing the inode moves to block 0. */
+    u32 keepBlocks = (u32)(((u64)size + NanoBlockSize - 1) / NanoBlockSize);
+    NanoExtentList extents;
+    NanoExtentList freed;
+    NanoExtentList tree;
+    bool ok = true;
+    for (u32 i = 0; i < oldExtents.GetCount() && ok; i++)
     {
-        long blk = AllocDataBlock();
-        if (blk < 0)
+        const NanoExtent& ext = oldExtents.Get(i);
+        if (ext.Logical >= keepBlocks)
         {
-            Trace(0, "NanoFs::Write: alloc block %u/%u failed for inode %u",
-                  (ulong)i, (ulong)newBlockCount, (ulong)inodeIdx);
-            // Roll back already allocated new blocks
-            for (u32 j = 0; j < i; j++)
-                FreeDataBlock(newBlocks[j]);
-            delete inode;
-            return false;
+            ok = freed.Add(ext.Logical, ext.Start, ext.Length, false);
+        }
+        else if (ext.Length > keepBlocks - ext.Logical)
+        {
+            u32 keep = keepBlocks - ext.Logical;
+            ok = extents.Add(ext.Logical, ext.Start, keep, false) &&
+                 freed.Add(ext.Logical + keep, ext.Start + keep, ext.Length - keep, false);
+        }
+        else
+        {
+            ok = extents.Add(ext.Logical, ext.Start, ext.Length, false);
         }
-        newBlocks[i] = (u32)blk;
     }
 
-    // Write data to new blocks
-    u8* wbuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
-    if (wbuf == nullptr)
-    {
-        Trace(0, "NanoFs::Write: alloc write buf failed");
-        for (u32 j = 0; j < newBlockCount; j++)
-            FreeDataBlock(newBlocks[j]);
-        delete inode;
-        return false;
-    }
+    NanoExtentList added;
+    if (ok && isInline && oldSize != 0)
+        ok = AllocHoles(oldExtents, 0, 0, added) && MergeExtents(oldExtents, added, extents);
 
-    const u8* src = static_cast<const u8*>(data);
-    u32 remaining = (u32)len;
-    bool writeOk = true;
-    for (u32 i = 0; i < newBlockCount; i++)
+    /* The partial block at the lower of the two sizes is checksummed over
+       the bytes the new size covers; growing zeroes its old tail */
+    u64 boundary = (size < oldSize) ? size : oldSize;
+    if (ok && (boundary % NanoBlockSize) != 0)
     {
-        u32 chunkSize = (remaining < NanoBlockSize) ? remaining : NanoBlockSize;
-        Stdlib::MemSet(wbuf, 0, NanoBlockSize);
-        Stdlib::MemCpy(wbuf, src, chunkSize);
-
-        if (!Io.WriteBlock(Super->DataStartBlock + newBlocks[i], wbuf))
-        {
-            Trace(0, "NanoFs::Write: write data block %u failed for inode %u",
-                  (ulong)newBlocks[i], (ulong)inodeIdx);
-            writeOk = false;
-            break;
-        }
-
-        src += chunkSize;
-        remaining -= chunkSize;
+        u32 b = (u32)(boundary / NanoBlockSize);
+        ok = RewriteBlocks(inode, oldExtents, extents, b, b, nullptr, 0, 0, size);
     }
 
-    Mm::Free(wbuf);
+    bool remap = (freed.GetCount() != 0 || isInline);
+    if (ok && remap)
+        ok = BuildTree(inodeIdx, inode, extents, tree);
+    if (ok && isInline)
+        inode->Flags |= NanoInodeFlagBlockChecksums;
 
-    if (!writeOk)
+    if (ok && !OrderData())
     {
-        Trace(0, "NanoFs::Write: data write failed, rolling back inode %u", (ulong)inodeIdx);
-        // Roll back all new blocks
-        for (u32 j = 0; j < newBlockCount; j++)
-            FreeDataBlock(newBlocks[j]);
-        delete inode;
-        return false;
+        Trace(0, "NanoFs::Truncate: flush failed for inode %u", (ulong)inodeIdx);
+        ok = false;
     }
 
-    // Success path: commit the new inode first, then free the old blocks.
-    // The data blocks must be durable before the FUA inode commit references
-    // them, and the commit itself must be durable before the old blocks are
-    // freed (the bitmap is FUA-flushed by FreeDataBlock) -- otherwise a crash
-    // loses data the bitmap already accounts for.
-    if (!Io.Flush())
+    if (ok && (tree.GetCount() != 0 || added.GetCount() != 0) && !FlushSuper())
     {
-        Trace(0, "NanoFs::Write: data flush failed for inode %u", (ulong)inodeIdx);
-        for (u32 j = 0; j < newBlockCount; j++)
-            FreeDataBlock(newBlocks[j]);
-        delete inode;
-        return false;
+        Trace(0, "NanoFs::Truncate: bitmap commit failed for inode %u", (ulong)inodeIdx);
+        ok = false;
     }
 
-    /* Commit the data bitmap (new blocks used) before the inode that
-       references them; AllocDataBlock only set the bits in memory */
-    if (!FlushSuper())
+    if (ok)
     {
-        Trace(0, "NanoFs::Write: bitmap commit failed for inode %u", (ulong)inodeIdx);
-        for (u32 j = 0; j < newBlockCount; j++)
-            FreeDataBlock(newBlocks[j]);
-        delete inode;
-        return false;
+        inode->Size = (u32)size;
+        ComputeInodeChecksum(inode);
+        ok = WriteInode(inodeIdx, inode, true);
+        if (!ok)
+            Trace(0, "NanoFs::Truncate: commit inode %u failed", (ulong)inodeIdx);
     }
-
-    Stdlib::MemSet(inode->Blocks, 0, sizeof(inode->Blocks));
-    for (u32 i = 0; i < newBlockCount; i++)
-        inode->Blocks[i] = newBlocks[i];
-
-    inode->Size = (u32)len;
-    inode->DataChecksum = ComputeDataChecksum(inode);
-    ComputeInodeChecksum(inode);
-
-    bool ok = WriteInode(inodeIdx, inode, true);
     delete inode;
+
     if (!ok)
     {
-        Trace(0, "NanoFs::Write: commit inode %u failed", (ulong)inodeIdx);
-        // The old on-disk inode still references the old blocks; release the
-        // new blocks instead.
-        for (u32 j = 0; j < newBlockCount; j++)
-            FreeDataBlock(newBlocks[j]);
+        FreeRuns(added);
+        FreeRuns(tree);
         return false;
     }
 
-    for (u32 i = 0; i < oldBlockCount; i++)
-        FreeDataBlock(oldBlocks[i]);
+    // Freed only now that the inode no longer references them
+    if (remap)
+    {
+        FreeRuns(freed);
+        FreeRuns(oldTree);
+        IssueDiscards(false);
+    }
 
-    file->Size = len;
+    file->Size = size;
     return true;
 }
 
@@ -1271,8 +3671,8 @@ bool NanoFs::Read(VNode* file, void* buf, ulong len, ulong offset)
         return false;
     }
 
-    /* A forged Size > NanoMaxFileSize would make the block loop exit
-       early and silently return uninitialized buffer bytes */
+    /* A forged Size > NanoMaxFileSize would map blocks past the limit
+       the extent checks assume */
     if (inode->Size > NanoMaxFileSize)
     {
         Trace(0, "NanoFs::Read: inode %u size %u exceeds max %u",
@@ -1292,9 +3692,23 @@ bool NanoFs::Read(VNode* file, void* buf, ulong len, ulong offset)
     ulong avail = inode->Size - offset;
     ulong toRead = (len < avail) ? len : avail;
 
+    /* Small files: the data came with the inode */
+    if (inode->Flags & NanoInodeFlagInline)
+    {
+        bool inlineOk = inode->Size <= NanoInlineSize;
+        if (inlineOk)
+            Stdlib::MemCpy(buf, inode->InlineData + offset, toRead);
+        else
+            Trace(0, "NanoFs::Read: inode %u bad inline size %u",
+                  (ulong)inodeIdx, (ulong)inode->Size);
+        delete inode;
+        return inlineOk;
+    }
+
     u8* dst = static_cast<u8*>(buf);
     u32 blockOff = (u32)(offset / NanoBlockSize);
     u32 byteOff = (u32)(offset % NanoBlockSize);
+    u32 lastBlock = (u32)((offset + toRead - 1) / NanoBlockSize);
 
     u8* blockBuf = (u8*)Mm::Alloc(NanoBlockSize, 0);
     if (blockBuf == nullptr)
@@ -1306,33 +3720,89 @@ bool NanoFs::Read(VNode* file, void* buf, ulong len, ulong offset)
 
     ulong bytesRead = 0;
     bool ok = true;
+    NanoBlockMapper mapper(this, inodeIdx, inode);
+    u32 fileBlocks = (u32)(((u64)inode->Size + NanoBlockSize - 1) / NanoBlockSize);
+    u8* rangeBuf = nullptr;
+    NanoExtent ext;
+    ext.Logical = 0;
+    ext.Start = NanoNoBlock;
+    ext.Length = 0;
 
-    while (bytesRead < toRead && blockOff < NanoMaxBlocks)
+    while (ok && bytesRead < toRead)
     {
-        if (inode->Blocks[blockOff] >= NanoDataBlockCount)
+        if (blockOff < ext.Logical || blockOff - ext.Logical >= ext.Length)
         {
-            Trace(0, "NanoFs::Read: bad data block %u for inode %u",
-                  (ulong)inode->Blocks[blockOff], (ulong)inodeIdx);
-            ok = false;
-            break;
+            if (!MapLogical(inodeIdx, inode, blockOff, ext))
+            {
+                ok = false;
+                break;
+            }
         }
 
-        if (!Io.ReadBlock(Super->DataStartBlock + inode->Blocks[blockOff], blockBuf))
+        /* Blocks of this extent (or hole) the read still needs */
+        u32 count = ext.Logical + ext.Length - blockOff;
+        if (count > lastBlock + 1 - blockOff)
+            count = lastBlock + 1 - blockOff;
+
+        const u8* src = nullptr;
+        u32 dataBlock = ext.Start + (blockOff - ext.Logical);
+        if (ext.Start != NanoNoBlock)
         {
-            Trace(0, "NanoFs::Read: read data block %u failed for inode %u",
-                  (ulong)inode->Blocks[blockOff], (ulong)inodeIdx);
-            ok = false;
-            break;
+            if (count > NanoReadBatch)
+                count = NanoReadBatch;
+            if (count >= 2 && rangeBuf == nullptr)
+                rangeBuf = (u8*)Mm::Alloc(NanoReadBatch * NanoBlockSize, 0);
+
+            /* A contiguous run is one batch of merged requests, single
+               blocks go through readahead */
+            if (count >= 2 && rangeBuf != nullptr)
+            {
+                ok = Io.ReadBlockRange(Super->DataStartBlock + dataBlock, count, rangeBuf);
+                src = rangeBuf;
+            }
+            else
+            {
+                count = 1;
+                ok = file->Ra.Read(Io, mapper, blockOff, fileBlocks, blockBuf);
+                src = blockBuf;
+            }
+
+            if (!ok)
+            {
+                Trace(0, "NanoFs::Read: read data blocks %u..%u failed for inode %u",
+                      (ulong)blockOff, (ulong)(blockOff + count - 1), (ulong)inodeIdx);
+                break;
+            }
         }
 
-        u32 chunkSize = NanoBlockSize - byteOff;
-        if (chunkSize > toRead - bytesRead)
-            chunkSize = (u32)(toRead - bytesRead);
+        for (u32 j = 0; j < count && bytesRead < toRead; j++)
+        {
+            u32 chunkSize = NanoBlockSize - byteOff;
+            if (chunkSize > toRead - bytesRead)
+                chunkSize = (u32)(toRead - bytesRead);
+
+            if (src == nullptr)
+            {
+                Stdlib::MemSet(dst + bytesRead, 0, chunkSize);
+            }
+            else
+            {
+                /* Only the blocks actually read are verified */
+                const u8* block = src + (ulong)j * NanoBlockSize;
+                if (!VerifyBlockChecksum(inode, blockOff, dataBlock + j, block))
+                {
+                    Trace(0, "NanoFs: data checksum mismatch inode %u block %u",
+                          (ulong)inodeIdx, (ulong)blockOff);
+                    ok = false;
+                    break;
+                }
+                Stdlib::MemCpy(dst + bytesRead, block + byteOff, chunkSize);
+            }
 
-        Stdlib::MemCpy(dst + bytesRead, blockBuf + byteOff, chunkSize);
-        bytesRead += chunkSize;
-        byteOff = 0;
-        blockOff++;
+            bytesRead += chunkSize;
+            byteOff = 0;
+            blockOff++;
+        }
     }
 
     /* A short read means the caller would consume garbage after bytesRead */
@@ -1343,17 +3813,8 @@ bool NanoFs::Read(VNode* file, void* buf, ulong len, ulong offset)
         ok = false;
     }
 
-    // Verify data checksum
-    if (ok && inode->DataChecksum != 0)
-    {
-        u32 computed = ComputeDataChecksum(inode);
-        if (computed != inode->DataChecksum)
-        {
-            Trace(0, "NanoFs: data checksum mismatch inode %u", (ulong)inodeIdx);
-            ok = false;
-        }
-    }
-
+    if (rangeBuf != nullptr)
+        Mm::Free(rangeBuf);
     Mm::Free(blockBuf);
     delete inode;
     return ok;
@@ -1371,6 +3832,9 @@ bool NanoFs::RemoveRecursive(VNode* node)
 
     if (node->NodeType == VNode::TypeDir)
     {
+        if (!LoadChildren(node))
+            return false;
+
         // Recursively remove children
         while (!node->Children.IsEmpty())
         {
@@ -1378,6 +3842,10 @@ bool NanoFs::RemoveRecursive(VNode* node)
             VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
             if (!RemoveRecursive(child))
                 return false;
+
+            /* A large tree goes out in several transactions */
+            if (Journal.IsOpen() && Journal.NeedCommit() && !CommitJournal())
+                return false;
         }
     }
 
@@ -1389,22 +3857,27 @@ bool NanoFs::RemoveRecursive(VNode* node)
     }
     if (inode != nullptr)
     {
-        // Only free data blocks if Size/Blocks can be trusted: a corrupted
-        // inode could reference blocks another file owns, and an unclamped
-        // Size would walk past Blocks[] into Padding.
+        // Only free data blocks if the extent map can be trusted: a
+        // corrupted inode could reference blocks another file owns.
         if (ReadInode(inodeIdx, inode) && VerifyInodeChecksum(inode))
         {
+            u32 dirBlocks[NanoDirMaxBlocks];
+            u32 count;
+            NanoExtentList extents;
+            NanoExtentList treeBlocks;
             if (inode->Type == NanoInodeTypeDir)
             {
-                FreeDataBlock(inode->Blocks[0]);
+                if (DirBlocks(inode, dirBlocks, count))
+                {
+                    for (u32 j = 0; j < count; j++)
+                        FreeDataBlock(dirBlocks[j]);
+                }
             }
-            else if (inode->Type == NanoInodeTypeFile && inode->Size > 0)
+            else if (inode->Type == NanoInodeTypeFile &&
+                     LoadExtents(inodeIdx, inode, extents, &treeBlocks))
             {
-                u32 blockCount = (inode->Size + NanoBlockSize - 1) / NanoBlockSize;
-                if (blockCount > NanoMaxBlocks)
-                    blockCount = NanoMaxBlocks;
-                for (u32 i = 0; i < blockCount; i++)
-                    FreeDataBlock(inode->Blocks[i]);
+                FreeRuns(extents);
+                FreeRuns(treeBlocks);
             }
         }
 
@@ -1441,7 +3914,7 @@ bool NanoFs::Remove(VNode* node)
     u32 parentIdx = VNodeToInode(node->Parent);
 
     // Remove from parent directory on disk
-    if (!RemoveDirEntry(parentIdx, inodeIdx))
+    if (!RemoveDirEntry(parentIdx, inodeIdx, node->Name))
     {
         Trace(0, "NanoFs::Remove: remove dir entry failed inode %u from parent %u",
               (ulong)inodeIdx, (ulong)parentIdx);
@@ -1453,7 +3926,15 @@ bool NanoFs::Remove(VNode* node)
     if (!RemoveRecursive(node))
         return false;
 
-    return Io.Flush();
+    /* The journal commits it with the frees, see CommitJournal */
+    if (Journal.IsOpen())
+        return true;
+
+    if (!Io.Commit())
+        return false;
+
+    IssueDiscards(false);
+    return true;
 }
 
 }
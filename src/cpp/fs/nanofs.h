@@ -2,22 +2,57 @@
 
 #include <fs/filesystem.h>
 #include <fs/block_io.h>
+#include <fs/nano_journal.h>
+#include <fs/vnode_cache.h>
 
 namespace Kernel
 {
 
 static const u32 NanoMagic         = 0x4E414E4F; // "NANO"
-static const u32 NanoVersion       = 1;
+static const u32 NanoVersion       = 7; // inode count sized at Format, inode bitmap blocks
+static const u32 NanoVersionV6     = 6; // hashed directories
+static const u32 NanoVersionV5     = 5; // metadata journal
+static const u32 NanoVersionV4     = 4; // 256-byte inodes, 16 per block, inline small files
+static const u32 NanoVersionV3     = 3; // extent trees, geometry sized at Format, 4 KB inodes
+static const u32 NanoVersionV2     = 2; // flat block map, per-block checksums in the inode
+static const u32 NanoVersionV1     = 1; // flat block map, whole-file data checksum
 static const u32 NanoBlockSize     = 4096;
-static const u32 NanoInodeCount    = 1024;
-static const u32 NanoDataBlockCount = 16384;
-static const u32 NanoInodeStart    = 1;
-static const u32 NanoDataStart     = 1 + NanoInodeCount; // 1025
-static const u32 NanoMaxBlocks     = 256;
-static const u32 NanoMaxDirEntries = 256;
-static const u32 NanoMaxFileSize   = NanoMaxBlocks * NanoBlockSize; // 1 MB
-static const u32 NanoMaxDirDepth   = 32; // recursion cap for LoadVNode (32 KB kernel stack)
+static const u32 NanoLegacyInodeCount = 1024; // images before v7
+static const u32 NanoMinInodeCount = NanoLegacyInodeCount;
+static const u32 NanoMaxInodeCount = 65536; // 16 MB of inode table read at mount
+static const u32 NanoBlocksPerInode = 16;   // data blocks per inode sized at Format (64 KB)
+static const u32 NanoInodeSize     = 256;
+static const u32 NanoInodesPerBlock = NanoBlockSize / NanoInodeSize;
+static const u32 NanoLegacyInodeTableBlocks = NanoLegacyInodeCount / NanoInodesPerBlock; // 64
+static const u32 NanoMaxDataBlocks = 1 << 24;  // 64 GB of data, 2 MB of bitmap in memory
+static const u32 NanoMinDataBlocks = 64;
+static const u32 NanoBitsPerBlock  = NanoBlockSize * 8;
+static const u32 NanoChecksumsPerBlock = NanoBlockSize / 4;
+static const u32 NanoMaxFileSize   = 0x80000000; // 2 GB
+static const u32 NanoMaxFileBlocks = NanoMaxFileSize / NanoBlockSize;
+static const u32 NanoMaxDirDepth   = 32; // deepest dir populated: RemoveRecursive recursion (32 KB kernel stack)
+static const u32 NanoWriteBatch    = 32; // data blocks submitted together (merged by the I/O scheduler)
+static const u32 NanoReadBatch     = 64; // contiguous data blocks read as one batch
+static const u32 NanoNoBlock       = 0xFFFFFFFF;
 
+static_assert(NanoMaxInodeCount / NanoBitsPerBlock <= 32, "a dirty bit per inode bitmap block");
+
+// Fixed geometry of version 1 and 2 images
+static const u32 NanoLegacyDataBlocks = 16384;
+static const u32 NanoLegacyInodeStart = 1;
+static const u32 NanoLegacyDataStart  = 1 + NanoLegacyInodeCount; // 1025
+static const u32 NanoLegacyMaxBlocks  = 256;
+
+/* Layout (v7): superblock, data bitmap blocks, inode bitmap blocks,
+   checksum table (one CRC32 per data block), inode table, journal, data
+   blocks; all sized at Format from the device capacity, InodeCount
+   included (one inode per NanoBlocksPerInode data blocks, within
+   NanoMinInodeCount..NanoMaxInodeCount).  Images upgraded from older
+   versions keep their geometry: 1024 inodes with the inode bitmap in the
+   superblock (InodeBitmapBlocks == 0), v1/v2 keep the data bitmap there
+   too (DataBitmapBlocks == 0), and the checksum table (v1/v2), compact
+   inode table (v1-v3) and journal (v1-v4) are carved out of the data
+   area.  JournalBlocks is 0 on devices too small for one. */
 struct NanoSuperBlock
 {
     u32 Magic;
@@ -29,37 +64,184 @@ struct NanoSuperBlock
     u32 DataBlockCount;
     u32 InodeStartBlock;
     u32 DataStartBlock;
-    u8  InodeBitmap[128];
-    u8  DataBitmap[2048];
-    u8  Padding[NanoBlockSize - 48 - 128 - 2048];
+    u8  InodeBitmap[128];   // inode bitmap of upgraded images only
+    u8  DataBitmap[2048];   // data bitmap of upgraded images only
+    u32 TotalBlocks;
+    u32 DataBitmapStart;
+    u32 DataBitmapBlocks;
+    u32 ChecksumStart;
+    u32 ChecksumBlocks;
+    u32 JournalStart;
+    u32 JournalBlocks;
+    u32 InodeBitmapStart;
+    u32 InodeBitmapBlocks;
+    u8  Padding[NanoBlockSize - 48 - 128 - 2048 - 36];
 };
 
 static_assert(sizeof(NanoSuperBlock) == NanoBlockSize, "NanoSuperBlock must be 4 KB");
+static_assert(NanoJournalBlockSize == NanoBlockSize, "journal blocks are file system blocks");
+
+/* A run of Length data blocks at Start (relative to DataStartBlock)
+   holding file blocks from Logical on.  In index entries Start is the
+   child tree block and Length is unused. */
+struct NanoExtent
+{
+    u32 Logical;
+    u32 Start;
+    u32 Length;
+};
+
+static const u32 NanoRootExtents = 4;
+static const u32 NanoInodeMagic  = 0x45444F4E; // "NODE"
+static const u32 NanoInlineSize  = NanoInodeSize - 96;
 
+/* 16 to a block.  The extent root doubles as storage for the data of
+   files up to NanoInlineSize bytes (NanoInodeFlagInline). */
 struct NanoInode
 {
     u32 Type;           // 0 = free, 1 = file, 2 = dir
     u32 Size;           // file: byte count, dir: entry count
     char Name[64];
     u32 ParentInode;
+    u32 Checksum;       // CRC32 of this inode (zeroed during computation)
+    u32 Flags;
+    u16 Depth;          // 0: Root holds the extents, else tree blocks of depth Depth - 1
+    u16 RootCount;
+    u32 ExtentCount;    // extents in the whole map
+    u32 Reserved;
+    union
+    {
+        NanoExtent Root[NanoRootExtents];
+        u8 InlineData[NanoInlineSize];
+    };
+};
+
+static_assert(sizeof(NanoInode) == NanoInodeSize, "NanoInode must be 256 bytes");
+
+/* Inode of version 3 images, one per block, read only by the upgrade */
+struct NanoInodeV3
+{
+    u32 Type;
+    u32 Size;
+    char Name[64];
+    u32 ParentInode;
+    u32 Checksum;
+    u32 Flags;
+    u16 Depth;
+    u16 RootCount;
+    u32 ExtentCount;
+    NanoExtent Root[NanoRootExtents];
+    u8  Padding[NanoBlockSize - 80 - 4 - 4 - 4 - NanoRootExtents * 12 - 4];
+    u32 Magic;          // NanoInodeMagic, tells v3 inodes apart from v1/v2 ones
+};
+
+static_assert(sizeof(NanoInodeV3) == NanoBlockSize, "NanoInodeV3 must be 4 KB");
+
+static const u32 NanoExtentMagic = 0x5458454E; // "NEXT"
+static const u32 NanoExtentsPerBlock = (NanoBlockSize - 16) / sizeof(NanoExtent); // 340
+static const u32 NanoMaxTreeDepth = 3;
+
+/* Extent tree node, allocated from the data area.  Leaves (Depth 0)
+   hold extents, inner nodes index entries; both sorted by Logical. */
+struct NanoExtentBlock
+{
+    u32 Magic;
     u32 Checksum;       // CRC32 of this block (zeroed during computation)
-    u32 DataChecksum;   // CRC32 of file data (0 for dirs/empty)
-    u32 Blocks[NanoMaxBlocks];
-    u8  Padding[NanoBlockSize - 4 - 4 - 64 - 4 - 4 - 4 - NanoMaxBlocks * 4];
+    u32 Owner;          // inode index
+    u16 Depth;
+    u16 Count;
+    NanoExtent Entries[NanoExtentsPerBlock];
+};
+
+static_assert(sizeof(NanoExtentBlock) == NanoBlockSize, "NanoExtentBlock must be 4 KB");
+
+/* Inode of version 1 and 2 images, one per block, read only by the upgrade */
+struct NanoLegacyInode
+{
+    u32 Type;
+    u32 Size;
+    char Name[64];
+    u32 ParentInode;
+    u32 Checksum;
+    u32 DataChecksum;   // v1: XOR of per-block CRC32s of file data; 0 in v2
+    u32 Blocks[NanoLegacyMaxBlocks];
+    u32 BlockChecksums[NanoLegacyMaxBlocks]; // v2: CRC32 of the used bytes of each block
+    u32 Flags;
+    u8  Padding[NanoBlockSize - 4 - 4 - 64 - 4 - 4 - 4 - NanoLegacyMaxBlocks * 8 - 4];
 };
 
-static_assert(sizeof(NanoInode) == NanoBlockSize, "NanoInode must be 4 KB");
+static_assert(sizeof(NanoLegacyInode) == NanoBlockSize, "NanoLegacyInode must be 4 KB");
 
+/* A directory (NanoInodeFlagHashedDir) is a hash table of 1 to
+   NanoDirMaxBlocks blocks: the entry of a name hashing to Hash lives in
+   block Hash % blocks or, that one full, in one after it.  A free slot
+   has InodeIndex 0 (the root is nobody's child); the inode's Size counts
+   the entries.  Once three quarters full the table doubles, entries
+   moving to their new block where it has room, so creating, finding and
+   removing an entry touch one block.  Directories of images before v6
+   keep their entries packed at the start of one block until their first
+   change hashes them. */
 struct NanoDirEntry
 {
     u32 InodeIndex;
-    u32 Reserved;
+    u32 Hash;           // CRC32 of the child's name (hashed dirs)
 };
 
+static const u32 NanoDirEntriesPerBlock = NanoBlockSize / sizeof(NanoDirEntry); // 512
+static const u32 NanoDirMaxBlocks = 8;
+static const u32 NanoDirMaxEntries = NanoDirMaxBlocks * NanoDirEntriesPerBlock * 3 / 4; // 3072
+static_assert((1u << (NanoRootExtents - 1)) >= NanoDirMaxBlocks,
+              "a table doubling once per root extent must reach NanoDirMaxBlocks");
+static_assert(NanoDirMaxEntries >= NanoLegacyInodeCount - 1,
+              "directories of upgraded images must hold every inode");
+
 static const u32 NanoInodeTypeFree = 0;
 static const u32 NanoInodeTypeFile = 1;
 static const u32 NanoInodeTypeDir  = 2;
 
+// The checksum table entries of the file's blocks are valid. Off for
+// directories, for files mapped for direct writes (loop devices) and for
+// upgraded files whose data did not match their old checksums.
+static const u32 NanoInodeFlagBlockChecksums = 0x1;
+
+// The file's data is InlineData; it has no data blocks.
+static const u32 NanoInodeFlagInline = 0x2;
+
+// The directory's entries are hashed (see NanoDirEntry).
+static const u32 NanoInodeFlagHashedDir = 0x4;
+
+/* Growable in-memory array of extents */
+class NanoExtentList
+{
+public:
+    NanoExtentList();
+    ~NanoExtentList();
+
+    /* Append an entry; with merge, extend the last one instead when the
+       new run continues it both in the file and on disk. */
+    bool Add(u32 logical, u32 start, u32 length, bool merge = true);
+    void Clear();
+
+    u32 GetCount() const;
+    const NanoExtent& Get(u32 index) const;
+
+    /* File blocks covered: end of the last extent. */
+    u32 GetEnd() const;
+
+    /* Index of the extent holding file block logical; false in a hole. */
+    bool Find(u32 logical, u32& index) const;
+
+private:
+    NanoExtentList(const NanoExtentList& other) = delete;
+    NanoExtentList(NanoExtentList&& other) = delete;
+    NanoExtentList& operator=(const NanoExtentList& other) = delete;
+    NanoExtentList& operator=(NanoExtentList&& other) = delete;
+
+    NanoExtent* Items;
+    u32 Count;
+    u32 Capacity;
+};
+
 class NanoFs : public FileSystem
 {
 public:
@@ -71,14 +253,23 @@ public:
     virtual void GetInfo(char* buf, ulong bufSize) override;
     virtual bool Mount() override;
     virtual void Unmount() override;
+    virtual bool Sync() override;
     virtual VNode* GetRoot() override;
     virtual VNode* Lookup(VNode* dir, const char* name) override;
+    virtual bool LoadDir(VNode* dir) override;
     virtual VNode* CreateFile(VNode* dir, const char* name) override;
     virtual VNode* CreateDir(VNode* dir, const char* name) override;
     virtual bool Write(VNode* file, const void* data, ulong len) override;
     virtual bool Read(VNode* file, void* buf, ulong len, ulong offset) override;
     virtual bool Remove(VNode* node) override;
     virtual BlockDevice* GetDevice() override;
+    virtual bool Trim(u64& bytes) override;
+    virtual bool MapExtents(VNode* file, bool write, FileExtentMap& map) override;
+    virtual bool WriteAt(VNode* file, const void* data, ulong len, ulong offset) override;
+    virtual bool Truncate(VNode* file, ulong size) override;
+    virtual u64 GetTransaction() override;
+    virtual bool Commit(u64 transaction) override;
+    virtual bool SetJournal(bool on) override;
 
 private:
     NanoFs(const NanoFs& other) = delete;
@@ -86,38 +277,113 @@ private:
     NanoFs& operator=(const NanoFs& other) = delete;
     NanoFs& operator=(NanoFs&& other) = delete;
 
+    friend class NanoBlockMapper;
+
+    bool LoadGeometry();
+    void ReleaseGeometry();
+
     bool ReadInode(u32 idx, NanoInode* out);
+    bool WarmInodeTable();
     bool WriteInode(u32 idx, const NanoInode* in, bool fua = false);
     bool FlushSuper();
 
+    /* Metadata blocks go through the journal while it is open */
+    bool ReadMeta(u32 block, void* buf);
+    bool WriteMeta(u32 block, const void* buf, bool fua = false);
+    bool OpenJournal();
+    bool OrderData();
+    bool CommitJournal();
+
     long AllocInode();
     void FreeInode(u32 idx);
     long AllocDataBlock();
+    bool AllocRun(u32 want, u32& start, u32& length);
     void FreeDataBlock(u32 idx);
-    void MarkReachableAllocated();
+    void FreeRuns(const NanoExtentList& runs);
+    void SetDataBit(u32 idx, bool value);
+    bool TestDataBit(u32 idx);
+    u32  FreeRunLength(u32 idx, u32 limit);
+    void MarkDiscard(u32 idx);
+    void IssueDiscards(bool durable);
+    u64  DiscardRuns(const u8* bits, bool value);
+    void MarkInUseAllocated();
+    u32  InodeTableBlocks();
+    u32  MaxDirEntries();
+
+    /* Extent maps */
+    bool LoadExtents(u32 inodeIdx, const NanoInode* inode, NanoExtentList& extents,
+                     NanoExtentList* treeBlocks);
+    bool LoadExtentBlock(u32 inodeIdx, u32 block, u16 depth, NanoExtentList& extents,
+                         NanoExtentList* treeBlocks);
+    bool CheckExtentBlock(u32 inodeIdx, u32 block, NanoExtentBlock* node, u16 depth);
+    bool MapLogical(u32 inodeIdx, const NanoInode* inode, u32 logical, NanoExtent& ext);
+    bool BuildTree(u32 inodeIdx, NanoInode* inode, const NanoExtentList& extents,
+                   NanoExtentList& treeBlocks);
+    bool DirBlocks(const NanoInode* inode, u32* blocks, u32& count);
+
+    /* In-place updates */
+    bool AllocHoles(const NanoExtentList& extents, u32 first, u32 last, NanoExtentList& added);
+    bool FillHoles(u32 inodeIdx, NanoInode* inode, NanoExtentList& extents,
+                   const NanoExtentList& oldTree, u32 fileBlocks);
+    bool RewriteBlocks(const NanoInode* inode, const NanoExtentList& oldExtents,
+                       const NanoExtentList& extents, u32 first, u32 last,
+                       const u8* data, u64 offset, ulong len, u64 newSize);
 
     void ComputeSuperChecksum();
     bool VerifySuperChecksum();
     void ComputeInodeChecksum(NanoInode* inode);
     bool VerifyInodeChecksum(NanoInode* inode);
-    u32  ComputeDataChecksum(NanoInode* inode);
+    bool ReadChecksum(u32 dataBlock, u32& crc);
+    bool StoreChecksums(u32 dataBlock, const u32* crcs, u32 count);
+    bool VerifyBlockChecksum(const NanoInode* inode, u32 logical, u32 dataBlock, const void* data);
+    bool Upgrade();
+    bool UpgradeTables();
+    bool AllocTable(u32 want, u32& start);
+    bool UpgradeInode(u32 idx, const u8* old, NanoInode* inode, u32* table);
 
-    VNode* LoadVNode(u32 inodeIdx, u32 depth = 0);
-    VNode* FindVNode(u32 inodeIdx);
+    VNode* LoadVNode(u32 inodeIdx);
+    bool   LoadChildren(VNode* dir);
     void   FreeVNode(VNode* vnode);
     u32    VNodeToInode(VNode* vnode);
 
-    bool AddDirEntry(u32 dirInodeIdx, u32 childInodeIdx);
-    bool RemoveDirEntry(u32 dirInodeIdx, u32 childInodeIdx);
+    static u32 DirHash(const char* name);
+    bool ReadDir(u32 dirInodeIdx, NanoInode* dirInode, u32* blocks, u32& count, u8* buf);
+    bool HashDir(NanoInode* dirInode, u8* buf);
+    bool GrowDir(NanoInode* dirInode, u32* blocks, u32& count, u8* buf);
+    bool AddDirEntry(u32 dirInodeIdx, u32 childInodeIdx, const char* name);
+    bool RemoveDirEntry(u32 dirInodeIdx, u32 childInodeIdx, const char* name);
     bool RemoveRecursive(VNode* node);
 
     BlockIo Io;
+    NanoJournal Journal;
     NanoSuperBlock* Super;
-    VNode* VNodes[NanoInodeCount]; // in-memory VNode cache by inode index
-    // Inodes whose LoadVNode is still on the recursion stack. A dir entry
-    // referencing such an inode is a directory cycle in the on-disk image;
-    // linking it would put a cycle in the VFS tree (infinite recursion later).
-    u8 LoadInProgress[NanoInodeCount];
+    // VNodes by inode index, directories populated on first use. A cached
+    // dir's parent chain is cached too, so a dir entry naming a cached
+    // inode is a hard link or a cycle in the on-disk image and is skipped.
+    VNodeCache VNodes;
+    u32 DataBlocks;
+    // Data bitmap: Super->DataBitmap on upgraded images, else loaded from
+    // its blocks; BitmapDirty has a byte per bitmap block FlushSuper writes.
+    u8* DataBitmap;
+    u8* BitmapDirty;
+    // Inode bitmap: Super->InodeBitmap on upgraded images, else loaded
+    // from its blocks; InodeBitmapDirty has a bit per block.
+    u8* InodeBitmap;
+    u32 InodeBitmapDirty;
+    u32 AllocHint;      // next-fit start for AllocRun
+    // Data blocks freed but not yet discarded. Set only if the device can
+    // discard; a block allocated again leaves the set.
+    u8* DiscardBitmap;
+    u32 DiscardPending;
+    // Data blocks freed while the journal is open, released once the
+    // transaction that stopped referencing them commits: reused earlier,
+    // their new contents could land under the committed metadata.
+    NanoExtentList PendingFree;
+    // Inode table block being read or patched by ReadInode/WriteInode
+    u8* InodeBuf;
+    // Last checksum table block read, for runs of lookups in one block
+    u32* CsumBuf;
+    u32 CsumBlock;
     bool Mounted;
 };
 
@@ -1,15 +1,71 @@
 #include "procfs.h"
 
 #include <lib/stdlib.h>
+#include <include/const.h>
 #include <kernel/parameters.h>
 #include <kernel/interrupt.h>
 #include <kernel/trace.h>
+#include <block/block_stats.h>
+#include <block/block_qos.h>
+#include <mm/new.h>
 
 namespace Kernel
 {
 
+namespace
+{
+
+/* Printer collecting output into a bounded heap buffer */
+class BufferPrinter : public Stdlib::Printer
+{
+public:
+    BufferPrinter(char* buf, ulong size)
+        : Buf(buf)
+        , Size(size)
+        , Pos(0)
+    {
+    }
+
+    virtual void Printf(const char *fmt, ...) override
+    {
+        va_list args;
+        va_start(args, fmt);
+        VPrintf(fmt, args);
+        va_end(args);
+    }
+
+    virtual void VPrintf(const char *fmt, va_list args) override
+    {
+        if (Pos >= Size)
+            return;
+
+        int n = Stdlib::VsnPrintf(Buf + Pos, Size - Pos, fmt, args);
+        if (n > 0)
+            Pos += ((ulong)n < Size - Pos) ? (ulong)n : Size - Pos - 1;
+    }
+
+    virtual void PrintString(const char *s) override
+    {
+        Printf("%s", s);
+    }
+
+    virtual void Backspace() override
+    {
+    }
+
+    ulong GetLen() const { return Pos; }
+
+private:
+    char* Buf;
+    ulong Size;
+    ulong Pos;
+};
+
+}
+
 ProcFs::ProcFs()
     : InterruptsNode(nullptr)
+    , IostatNode(nullptr)
 {
 }
 
@@ -22,6 +78,11 @@ const char* ProcFs::GetName()
     return "procfs";
 }
 
+bool ProcFs::IsConcurrent()
+{
+    return false;
+}
+
 bool ProcFs::Mount()
 {
     VNode* root = GetRoot();
@@ -48,6 +109,11 @@ bool ProcFs::Mount()
     if (InterruptsNode != nullptr)
         RefreshInterrupts();
 
+    /* /proc/iostat — per-device and per-I/O-class block I/O totals, refreshed on each read */
+    IostatNode = CreateFile(root, "iostat");
+    if (IostatNode != nullptr)
+        RefreshIostat();
+
     return true;
 }
 
@@ -71,6 +137,20 @@ void ProcFs::RefreshInterrupts()
     RamFs::Write(InterruptsNode, buf, pos);
 }
 
+void ProcFs::RefreshIostat()
+{
+    static const ulong BufSize = 16 * Const::KB;
+    char* buf = static_cast<char*>(Mm::Alloc(BufSize, 0));
+    if (buf == nullptr)
+        return;
+
+    BufferPrinter printer(buf, BufSize);
+    BlockStats::DumpAll(printer);
+    BlockQos::DumpAll(printer);
+    RamFs::Write(IostatNode, buf, printer.GetLen());
+    Mm::Free(buf);
+}
+
 bool ProcFs::Read(VNode* file, void* buf, ulong len, ulong offset)
 {
     if (file == InterruptsNode)
@@ -78,6 +158,11 @@ bool ProcFs::Read(VNode* file, void* buf, ulong len, ulong offset)
         RefreshInterrupts();
         Stdlib::MemSet(buf, 0, len);
     }
+    else if (file == IostatNode && offset == 0)
+    {
+        RefreshIostat();
+        Stdlib::MemSet(buf, 0, len);
+    }
 
     return RamFs::Read(file, buf, len, offset);
 }
@@ -15,6 +15,9 @@ public:
     virtual bool Mount() override;
     virtual bool Read(VNode* file, void* buf, ulong len, ulong offset) override;
 
+    /* Read rewrites the dynamic files */
+    virtual bool IsConcurrent() override;
+
 private:
     ProcFs(const ProcFs& other) = delete;
     ProcFs(ProcFs&& other) = delete;
@@ -22,8 +25,10 @@ private:
     ProcFs& operator=(ProcFs&& other) = delete;
 
     void RefreshInterrupts();
+    void RefreshIostat();
 
     VNode* InterruptsNode;
+    VNode* IostatNode;
 };
 
 }
@@ -35,6 +35,11 @@ const char* RamFs::GetName()
     return "ramfs";
 }
 
+bool RamFs::IsConcurrent()
+{
+    return true;
+}
+
 VNode* RamFs::GetRoot()
 {
     return &Root;
@@ -72,7 +77,7 @@ void RamFs::FreeNode(VNode* node)
         node->Data = nullptr;
     }
 
-    node->SiblingLink.RemoveInit();
+    DirIndex::Unlink(node);
     delete node;
 }
 
@@ -88,6 +93,7 @@ void RamFs::FreeTree(VNode* node)
         VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
         FreeTree(child);
     }
+    node->Index.Release();
 
     // Don't delete the root (it's embedded, not heap-allocated)
     if (node != &Root)
@@ -109,16 +115,7 @@ VNode* RamFs::Lookup(VNode* dir, const char* name)
     if (dir->NodeType != VNode::TypeDir)
         return nullptr;
 
-    Stdlib::ListEntry* head = &dir->Children;
-    Stdlib::ListEntry* entry = head->Flink;
-    while (entry != head)
-    {
-        VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
-        if (Stdlib::StrCmp(child->Name, name) == 0)
-            return child;
-        entry = entry->Flink;
-    }
-    return nullptr;
+    return DirIndex::Find(dir, name);
 }
 
 VNode* RamFs::CreateFile(VNode* dir, const char* name)
@@ -146,8 +143,7 @@ VNode* RamFs::CreateFile(VNode* dir, const char* name)
     if (node == nullptr)
         return nullptr;
 
-    node->Parent = dir;
-    dir->Children.InsertTail(&node->SiblingLink);
+    DirIndex::Link(dir, node);
     return node;
 }
 
@@ -176,8 +172,7 @@ VNode* RamFs::CreateDir(VNode* dir, const char* name)
     if (node == nullptr)
         return nullptr;
 
-    node->Parent = dir;
-    dir->Children.InsertTail(&node->SiblingLink);
+    DirIndex::Link(dir, node);
     return node;
 }
 
@@ -242,6 +237,74 @@ bool RamFs::Read(VNode* file, void* buf, ulong len, ulong offset)
     return true;
 }
 
+/* Grow the buffer to hold size bytes, keeping the current contents */
+bool RamFs::Reserve(VNode* file, ulong size)
+{
+    if (size <= file->Capacity)
+        return true;
+
+    ulong newCap = 64;
+    while (newCap < size)
+        newCap *= 2;
+
+    u8* newBuf = (u8*)Mm::Alloc(newCap, 0);
+    if (newBuf == nullptr)
+    {
+        Trace(0, "RamFs::Reserve: alloc %u bytes failed", (ulong)newCap);
+        return false;
+    }
+
+    if (file->Data != nullptr)
+    {
+        Stdlib::MemCpy(newBuf, file->Data, file->Size);
+        Mm::Free(file->Data);
+    }
+
+    file->Data = newBuf;
+    file->Capacity = newCap;
+    return true;
+}
+
+bool RamFs::WriteAt(VNode* file, const void* data, ulong len, ulong offset)
+{
+    if (file == nullptr || file->NodeType != VNode::TypeFile)
+    {
+        Trace(0, "RamFs::WriteAt: null file or not a file");
+        return false;
+    }
+
+    if (len == 0)
+        return true;
+
+    if (offset + len < offset || !Reserve(file, offset + len))
+        return false;
+
+    if (offset > file->Size)
+        Stdlib::MemSet(file->Data + file->Size, 0, offset - file->Size);
+    Stdlib::MemCpy(file->Data + offset, data, len);
+    if (offset + len > file->Size)
+        file->Size = offset + len;
+    return true;
+}
+
+bool RamFs::Truncate(VNode* file, ulong size)
+{
+    if (file == nullptr || file->NodeType != VNode::TypeFile)
+    {
+        Trace(0, "RamFs::Truncate: null file or not a file");
+        return false;
+    }
+
+    if (size > file->Size)
+    {
+        if (!Reserve(file, size))
+            return false;
+        Stdlib::MemSet(file->Data + file->Size, 0, size - file->Size);
+    }
+    file->Size = size;
+    return true;
+}
+
 bool RamFs::Remove(VNode* node)
 {
     if (node == nullptr)
@@ -266,6 +329,7 @@ bool RamFs::Remove(VNode* node)
             VNode* child = CONTAINING_RECORD(entry, VNode, SiblingLink);
             FreeTree(child);
         }
+        node->Index.Release();
     }
 
     FreeNode(node);
@@ -20,6 +20,11 @@ public:
     virtual bool Write(VNode* file, const void* data, ulong len) override;
     virtual bool Read(VNode* file, void* buf, ulong len, ulong offset) override;
     virtual bool Remove(VNode* node) override;
+    virtual bool WriteAt(VNode* file, const void* data, ulong len, ulong offset) override;
+    virtual bool Truncate(VNode* file, ulong size) override;
+
+    /* Everything lives in the VNodes */
+    virtual bool IsConcurrent() override;
 
 private:
     RamFs(const RamFs& other) = delete;
@@ -30,6 +35,7 @@ private:
     VNode* AllocNode(const char* name, VNode::Type type);
     void FreeNode(VNode* node);
     void FreeTree(VNode* node);
+    bool Reserve(VNode* file, ulong size);
 
     VNode Root;
 };
@@ -0,0 +1,227 @@
+#include "readahead.h"
+
+#include <lib/stdlib.h>
+#include <kernel/trace.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+ReadaheadState::ReadaheadState()
+    : Bufs(nullptr)
+    , Cap(0)
+    , Start(0)
+    , End(0)
+    , Marker(0)
+    , Window(0)
+    , NextBlock(0)
+{
+}
+
+ReadaheadState::~ReadaheadState()
+{
+    Release();
+}
+
+u32 ReadaheadState::MaxBlocks(u32 blockSize)
+{
+    if (blockSize == 0)
+        return 0;
+
+    ulong bytes = MaxBytes;
+    ulong budget = BufferCache::GetInstance().GetBudget() / 8;
+    if (bytes > budget)
+        bytes = budget;
+    return (u32)(bytes / blockSize);
+}
+
+BufferCache::Buffer*& ReadaheadState::Slot(u32 block)
+{
+    return Bufs[block % Cap];
+}
+
+void ReadaheadState::ReleaseBefore(u32 block)
+{
+    auto& cache = BufferCache::GetInstance();
+
+    for (; Start < block && Start < End; Start++)
+    {
+        BufferCache::Buffer*& buf = Slot(Start);
+        if (buf != nullptr)
+        {
+            cache.Put(buf);
+            buf = nullptr;
+        }
+    }
+}
+
+void ReadaheadState::Release()
+{
+    if (Bufs != nullptr)
+    {
+        ReleaseBefore(End);
+        delete[] Bufs;
+    }
+
+    Bufs = nullptr;
+    Cap = 0;
+    Start = 0;
+    End = 0;
+    Marker = 0;
+}
+
+bool ReadaheadState::ReadDirect(BlockIo& io, BlockMapper& map, u32 block, void* dst)
+{
+    u32 physical;
+    if (!map.MapBlock(block, physical))
+        return false;
+
+    if (physical == 0)
+    {
+        Stdlib::MemSet(dst, 0, io.GetBlockSize());
+        return true;
+    }
+    return io.ReadBlock(physical, dst);
+}
+
+void ReadaheadState::Issue(BlockIo& io, BlockMapper& map, u32 count, u32 fileBlocks)
+{
+    if (End >= fileBlocks)
+        return;
+    if (count > fileBlocks - End)
+        count = fileBlocks - End;
+
+    if (Bufs == nullptr)
+    {
+        u32 cap = 2 * MaxBlocks(io.GetBlockSize());
+        if (cap == 0)
+            return;
+
+        Bufs = new (Mm::NoThrow) BufferCache::Buffer*[cap];
+        if (Bufs == nullptr)
+            return;
+        for (u32 i = 0; i < cap; i++)
+            Bufs[i] = nullptr;
+        Cap = cap;
+    }
+
+    if ((End - Start) + count > Cap)
+        count = Cap - (End - Start);
+    if (count == 0)
+        return;
+
+    u64* sectors = new (Mm::NoThrow) u64[count];
+    u32* blocks = new (Mm::NoThrow) u32[count];
+    BufferCache::Buffer** bufs = new (Mm::NoThrow) BufferCache::Buffer*[count];
+    if (sectors == nullptr || blocks == nullptr || bufs == nullptr)
+    {
+        delete[] sectors;
+        delete[] blocks;
+        delete[] bufs;
+        return;
+    }
+
+    u32 mapped = 0;
+    u32 issued = 0;
+    for (; mapped < count; mapped++)
+    {
+        u32 physical;
+        if (!map.MapBlock(End + mapped, physical))
+            break;
+
+        if (physical == 0)
+            continue;   /* hole: served as zeros by ReadDirect */
+
+        sectors[issued] = io.GetBlockSector(physical);
+        blocks[issued] = End + mapped;
+        issued++;
+    }
+
+    BufferCache::GetInstance().Prefetch(io.GetDevice(), sectors, issued, io.GetBlockSize(), bufs);
+    for (u32 i = 0; i < issued; i++)
+        Slot(blocks[i]) = bufs[i];
+    End += mapped;
+
+    delete[] bufs;
+    delete[] blocks;
+    delete[] sectors;
+}
+
+bool ReadaheadState::Read(BlockIo& io, BlockMapper& map, u32 block, u32 fileBlocks, void* dst)
+{
+    u32 maxBlocks = MaxBlocks(io.GetBlockSize());
+
+    /* Reading block 0 again starts a new stream */
+    if (block == 0 && NextBlock > 1)
+    {
+        Release();
+        Window = 0;
+    }
+
+    bool sequential = (block == 0 || block == NextBlock || block + 1 == NextBlock);
+    NextBlock = block + 1;
+
+    if (!sequential || maxBlocks == 0 || block >= fileBlocks)
+    {
+        Release();
+        Window = 0;
+        return ReadDirect(io, map, block, dst);
+    }
+
+    if (block < Start || block >= End)
+    {
+        /* Not started yet, or the reader got past the window: issue one
+           synchronously needed window and send the next one when the
+           reader is half-way through it. */
+        Release();
+        Start = block;
+        End = block;
+
+        u32 initial = (u32)(InitialBytes / io.GetBlockSize());
+        if (initial == 0)
+            initial = 1;
+        if (initial > maxBlocks)
+            initial = maxBlocks;
+
+        Window = (Window == 0) ? initial : Window * 2;
+        if (Window > maxBlocks)
+            Window = maxBlocks;
+
+        Issue(io, map, Window, fileBlocks);
+        Marker = Start + (End - Start) / 2;
+    }
+    else if (block == Marker && block != Start)
+    {
+        ReleaseBefore(block);
+
+        Window *= 2;
+        if (Window > maxBlocks)
+            Window = maxBlocks;
+
+        Marker = End;
+        Issue(io, map, Window, fileBlocks);
+    }
+
+    ReleaseBefore(block);
+
+    BufferCache::Buffer* buf = (block < End) ? Slot(block) : nullptr;
+    if (buf == nullptr)
+        return ReadDirect(io, map, block, dst);
+
+    auto& cache = BufferCache::GetInstance();
+    if (!cache.Wait(buf))
+    {
+        Slot(block) = nullptr;
+        cache.Put(buf);
+        return ReadDirect(io, map, block, dst);
+    }
+
+    Stdlib::MemCpy(dst, buf->Data, io.GetBlockSize());
+
+    /* End of file: nothing more to read ahead, unpin the window */
+    if (block + 1 >= fileBlocks)
+        Release();
+    return true;
+}
+
+}
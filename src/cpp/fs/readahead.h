@@ -0,0 +1,80 @@
+#pragma once
+
+#include <include/types.h>
+#include <include/const.h>
+#include <fs/block_io.h>
+#include <fs/buffer_cache.h>
+
+namespace Kernel
+{
+
+/* Translates a file's logical block to a device block for readahead.
+   physical 0 means a hole (reads as zeros); false means the block is
+   unmappable and the read fails. */
+class BlockMapper
+{
+public:
+    virtual bool MapBlock(u32 logical, u32& physical) = 0;
+
+protected:
+    ~BlockMapper() {}
+};
+
+/* Per-file sequential readahead, embedded in each VNode.
+
+   Reads are sequential when they continue at (or re-read) the block
+   after the previous one.  The first sequential read issues a window of
+   InitialBytes; the window then doubles up to MaxBytes.  Every window
+   is submitted asynchronously as one batch and its buffers stay
+   referenced here until consumed, so they cannot be evicted in the
+   meantime.  The marker block is the first block of the newest window:
+   reading it issues the next window, so the device always works one
+   window ahead of the reader.  A non-sequential read drops the window
+   and is served directly.
+
+   An all-zero object is the idle state (file systems clear new VNodes
+   with MemSet).  Callers serialize access per VNode. */
+class ReadaheadState
+{
+public:
+    ReadaheadState();
+    ~ReadaheadState();
+
+    /* Read logical block `block` of a file of fileBlocks blocks into
+       dst (one io block). */
+    bool Read(BlockIo& io, BlockMapper& map, u32 block, u32 fileBlocks, void* dst);
+
+    /* Drop the window, e.g. because the file's blocks were rewritten. */
+    void Release();
+
+    static const ulong InitialBytes = 16 * Const::KB;
+    static const ulong MaxBytes = Const::MB;
+
+private:
+    ReadaheadState(const ReadaheadState& other) = delete;
+    ReadaheadState(ReadaheadState&& other) = delete;
+    ReadaheadState& operator=(const ReadaheadState& other) = delete;
+    ReadaheadState& operator=(ReadaheadState&& other) = delete;
+
+    bool ReadDirect(BlockIo& io, BlockMapper& map, u32 block, void* dst);
+
+    /* Issue blocks [End, End + count) clipped to fileBlocks. */
+    void Issue(BlockIo& io, BlockMapper& map, u32 count, u32 fileBlocks);
+
+    /* Window limit in blocks: MaxBytes, capped to an eighth of the
+       buffer cache budget so several streams fit; 0 disables. */
+    static u32 MaxBlocks(u32 blockSize);
+
+    void ReleaseBefore(u32 block);
+    BufferCache::Buffer*& Slot(u32 block);
+
+    BufferCache::Buffer** Bufs;     /* ring of Cap entries, by block % Cap */
+    u32 Cap;
+    u32 Start;          /* first block held */
+    u32 End;            /* one past the last block issued */
+    u32 Marker;         /* reading it issues the next window */
+    u32 Window;         /* size of the newest window, blocks */
+    u32 NextBlock;      /* expected next block */
+};
+
+}
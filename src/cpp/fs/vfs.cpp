@@ -1,6 +1,9 @@
 #include "vfs.h"
+#include "buffer_cache.h"
+#include "dentry_cache.h"
 
 #include <block/block_device.h>
+#include <kernel/object_table.h>
 #include <lib/stdlib.h>
 #include <mm/new.h>
 #include <kernel/trace.h>
@@ -8,8 +11,183 @@
 namespace Kernel
 {
 
+namespace
+{
+
+/* An RwMutex held shared for a scope */
+class ReadLocked
+{
+public:
+    ReadLocked(RwMutex& lock)
+        : Lock(lock)
+    {
+        Lock.ReadLock();
+    }
+
+    ~ReadLocked()
+    {
+        Lock.ReadUnlock();
+    }
+
+private:
+    ReadLocked(const ReadLocked& other) = delete;
+    ReadLocked(ReadLocked&& other) = delete;
+    ReadLocked& operator=(const ReadLocked& other) = delete;
+    ReadLocked& operator=(ReadLocked&& other) = delete;
+
+    RwMutex& Lock;
+};
+
+/* An RwMutex held exclusively for a scope */
+class WriteLocked
+{
+public:
+    WriteLocked(RwMutex& lock)
+        : Lock(lock)
+    {
+        Lock.WriteLock();
+    }
+
+    ~WriteLocked()
+    {
+        Lock.WriteUnlock();
+    }
+
+private:
+    WriteLocked(const WriteLocked& other) = delete;
+    WriteLocked(WriteLocked&& other) = delete;
+    WriteLocked& operator=(const WriteLocked& other) = delete;
+    WriteLocked& operator=(WriteLocked&& other) = delete;
+
+    RwMutex& Lock;
+};
+
+}
+
+Vfs::MountEntry::MountEntry(const char* path, FileSystem* fs, bool readOnly,
+                            VNode* covered, FileSystem* parentFs)
+    : Fs(fs)
+    , ReadOnly(readOnly)
+    , MappedFiles(0)
+    , OpenFiles(0)
+    , Covered(covered)
+    , ParentFs(parentFs)
+{
+    Stdlib::StrnCpy(Path, path, MaxPath);
+}
+
+Vfs::FsLock::FsLock(MountEntry* mount)
+    : Lock(mount->Fs->IsConcurrent() ? nullptr : &mount->Lock)
+{
+    if (Lock != nullptr)
+        Lock->Lock();
+}
+
+Vfs::FsLock::~FsLock()
+{
+    if (Lock != nullptr)
+        Lock->Unlock();
+}
+
+Vfs::Walk::Walk()
+    : Mount(nullptr)
+    , Fs(nullptr)
+    , Node(nullptr)
+    , Parent(nullptr)
+    , Count(0)
+{
+    LastName[0] = '\0';
+}
+
+Vfs::Walk::~Walk()
+{
+    Release();
+}
+
+bool Vfs::Walk::Lock(VNode* node, bool write)
+{
+    if (Count == MaxWalkDepth)
+        return false;
+
+    if (write)
+        node->Lock.WriteLock();
+    else
+        node->Lock.ReadLock();
+    Held[Count] = node;
+    Write[Count] = write;
+    Count++;
+    return true;
+}
+
+void Vfs::Walk::Unlock()
+{
+    Count--;
+    if (Write[Count])
+        Held[Count]->Lock.WriteUnlock();
+    else
+        Held[Count]->Lock.ReadUnlock();
+}
+
+/* The node must not go away meanwhile: the caller holds its parent (or
+   it is the root of a mount) */
+void Vfs::Walk::Relock(bool write)
+{
+    if (Write[Count - 1] == write)
+        return;
+
+    VNode* node = Held[Count - 1];
+    Unlock();
+    Lock(node, write);
+}
+
+void Vfs::Walk::Keep(VNode* node, VNode* other)
+{
+    ulong kept = 0;
+    for (ulong i = 0; i < Count; i++)
+    {
+        if (Held[i] == node || Held[i] == other)
+        {
+            Held[kept] = Held[i];
+            Write[kept] = Write[i];
+            kept++;
+        }
+        else if (Write[i])
+            Held[i]->Lock.WriteUnlock();
+        else
+            Held[i]->Lock.ReadUnlock();
+    }
+    Count = kept;
+}
+
+void Vfs::Walk::Forget(VNode* node)
+{
+    ulong kept = 0;
+    for (ulong i = 0; i < Count; i++)
+    {
+        if (Held[i] != node)
+        {
+            Held[kept] = Held[i];
+            Write[kept] = Write[i];
+            kept++;
+        }
+    }
+    Count = kept;
+}
+
+void Vfs::Walk::Release()
+{
+    while (Count != 0)
+        Unlock();
+}
+
+VNode* Vfs::Walk::GetLast()
+{
+    return (Count != 0) ? Held[Count - 1] : nullptr;
+}
+
 Vfs::Vfs()
     : MountCount(0)
+    , RootFs(nullptr)
 {
     Stdlib::MemSet(Mounts, 0, sizeof(Mounts));
 }
@@ -38,12 +216,37 @@ bool Vfs::Mount(const char* path, FileSystem* fs, bool readOnly)
         return false;
     }
 
-    Stdlib::AutoLock lock(Lock);
+    WriteLocked mounts(MountLock);
 
-    // Check for duplicate mount path
-    for (ulong i = 0; i < MountCount; i++)
+    VNode* covered = nullptr;
+    FileSystem* parentFs = nullptr;
+    if (path[1] == '\0')
     {
-        if (Stdlib::StrCmp(Mounts[i].Path, path) == 0)
+        if (RootFs != nullptr)
+        {
+            Trace(0, "Vfs::Mount: already mounted on %s", path);
+            return false;
+        }
+    }
+    else
+    {
+        /* Nothing runs while MountLock is held exclusively: covered
+           stays without its lock */
+        Walk walk;
+        if (!ResolvePath(path, 0, walk) || walk.Node == nullptr)
+        {
+            Trace(0, "Vfs::Mount: mount point %s not found", path);
+            return false;
+        }
+        covered = walk.Node;
+        parentFs = walk.Fs;
+        if (covered->NodeType != VNode::TypeDir)
+        {
+            Trace(0, "Vfs::Mount: mount point %s is not a directory", path);
+            return false;
+        }
+        /* The walk crossed into the root of a mount */
+        if (covered == parentFs->GetRoot())
         {
             Trace(0, "Vfs::Mount: already mounted on %s", path);
             return false;
@@ -56,10 +259,10 @@ bool Vfs::Mount(const char* path, FileSystem* fs, bool readOnly)
     {
         for (ulong i = 0; i < MountCount; i++)
         {
-            if (Mounts[i].Fs->GetDevice() == dev)
+            if (Mounts[i]->Fs->GetDevice() == dev)
             {
                 Trace(0, "Vfs::Mount: device %s already mounted on %s",
-                      dev->GetName(), Mounts[i].Path);
+                      dev->GetName(), Mounts[i]->Path);
                 return false;
             }
         }
@@ -71,16 +274,29 @@ bool Vfs::Mount(const char* path, FileSystem* fs, bool readOnly)
         return false;
     }
 
+    MountEntry* mount = new (Mm::NoThrow) MountEntry(path, fs, readOnly, covered, parentFs);
+    if (mount == nullptr)
+    {
+        Trace(0, "Vfs::Mount: alloc mount failed for %s", path);
+        return false;
+    }
+
+    /* The device may have been written raw while unmounted. */
+    if (dev != nullptr)
+        BufferCache::GetInstance().Invalidate(dev);
+
     if (!fs->Mount())
     {
         Trace(0, "Vfs::Mount: fs->Mount() failed for %s", path);
+        delete mount;
         return false;
     }
 
-    Stdlib::StrnCpy(Mounts[MountCount].Path, path, MaxPath);
-    Mounts[MountCount].Fs = fs;
-    Mounts[MountCount].ReadOnly = readOnly;
-    MountCount++;
+    Mounts[MountCount++] = mount;
+    if (covered != nullptr)
+        covered->MountedFs = fs;
+    else
+        RootFs = fs;
     return true;
 }
 
@@ -92,15 +308,44 @@ FileSystem* Vfs::Unmount(const char* path)
         return nullptr;
     }
 
-    Stdlib::AutoLock lock(Lock);
+    WriteLocked mounts(MountLock);
 
     for (ulong i = 0; i < MountCount; i++)
     {
-        if (Stdlib::StrCmp(Mounts[i].Path, path) == 0)
+        MountEntry* mount = Mounts[i];
+        if (Stdlib::StrCmp(mount->Path, path) == 0)
         {
-            FileSystem* fs = Mounts[i].Fs;
+            FileSystem* fs = mount->Fs;
+            if (mount->MappedFiles != 0)
+            {
+                Trace(0, "Vfs::Unmount: %s has %u mapped files", path, mount->MappedFiles);
+                return nullptr;
+            }
+
+            if (mount->OpenFiles != 0)
+            {
+                Trace(0, "Vfs::Unmount: %s has %u open files", path, mount->OpenFiles);
+                return nullptr;
+            }
+
+            for (ulong j = 0; j < MountCount; j++)
+            {
+                if (Mounts[j]->ParentFs == fs)
+                {
+                    Trace(0, "Vfs::Unmount: %s is mounted under %s", Mounts[j]->Path, path);
+                    return nullptr;
+                }
+            }
 
             fs->Unmount();
+            if (fs->GetDevice() != nullptr)
+                BufferCache::GetInstance().Invalidate(fs->GetDevice());
+
+            if (mount->Covered != nullptr)
+                mount->Covered->MountedFs = nullptr;
+            else
+                RootFs = nullptr;
+            DentryCache::GetInstance().Purge();
 
             // Shift remaining entries
             for (ulong j = i; j + 1 < MountCount; j++)
@@ -108,7 +353,8 @@ FileSystem* Vfs::Unmount(const char* path)
                 Mounts[j] = Mounts[j + 1];
             }
             MountCount--;
-            Stdlib::MemSet(&Mounts[MountCount], 0, sizeof(MountEntry));
+            Mounts[MountCount] = nullptr;
+            delete mount;
             return fs;
         }
     }
@@ -116,88 +362,57 @@ FileSystem* Vfs::Unmount(const char* path)
     return nullptr;
 }
 
-bool Vfs::FindMount(const char* path, ulong& mountIdx, const char*& remainder)
+Vfs::MountEntry* Vfs::FindMount(FileSystem* fs)
 {
-    ulong bestLen = 0;
-    ulong bestIdx = 0;
-    bool found = false;
-
     for (ulong i = 0; i < MountCount; i++)
     {
-        ulong mlen = Stdlib::StrLen(Mounts[i].Path);
-        if (mlen == 0)
-            continue;
-
-        // Check if path starts with mount path
-        if (Stdlib::StrnCmp(path, Mounts[i].Path, mlen) != 0)
-            continue;
-
-        // Must match exactly or be followed by '/'
-        // Root mount "/" matches any absolute path
-        if (path[mlen] != '\0' && path[mlen] != '/' &&
-            !(mlen == 1 && Mounts[i].Path[0] == '/'))
-            continue;
-
-        if (mlen > bestLen)
-        {
-            bestLen = mlen;
-            bestIdx = i;
-            found = true;
-        }
+        if (Mounts[i]->Fs == fs)
+            return Mounts[i];
     }
-
-    if (!found)
-    {
-        Trace(0, "Vfs::FindMount: no mount for %s", path);
-        return false;
-    }
-
-    mountIdx = bestIdx;
-    remainder = path + bestLen;
-    if (*remainder == '/')
-        remainder++;
-
-    return true;
+    return nullptr;
 }
 
-bool Vfs::IsMountReadOnly(const char* path)
+/* fs->Lookup through the DentryCache.  A miss is cached only if dir
+   could be read: a failed read is not "no such entry".  The caller
+   holds dir */
+VNode* Vfs::Lookup(MountEntry* mount, VNode* dir, const char* name)
 {
-    ulong mountIdx;
-    const char* remainder;
-    if (!FindMount(path, mountIdx, remainder))
-        return false;
-    return Mounts[mountIdx].ReadOnly;
+    auto& dcache = DentryCache::GetInstance();
+
+    VNode* child;
+    if (dcache.Find(dir, name, child))
+        return child;
+
+    FileSystem* fs = mount->Fs;
+    FsLock lock(mount);
+    child = fs->Lookup(dir, name);
+    if (child != nullptr || fs->LoadDir(dir))
+        dcache.Insert(dir, name, child);
+    return child;
 }
 
-bool Vfs::ResolvePath(const char* path, FileSystem*& fs, VNode*& node,
-                      VNode*& parent, char* lastName, ulong lastNameSize)
+bool Vfs::ResolvePath(const char* path, ulong flags, Walk& walk)
 {
-    fs = nullptr;
-    node = nullptr;
-    parent = nullptr;
-    if (lastName)
-        lastName[0] = '\0';
-
-    ulong mountIdx;
-    const char* remainder;
-
-    if (!FindMount(path, mountIdx, remainder))
+    walk.Release();
+    walk.Mount = nullptr;
+    walk.Fs = nullptr;
+    walk.Node = nullptr;
+    walk.Parent = nullptr;
+    walk.LastName[0] = '\0';
+
+    if (RootFs == nullptr || path[0] != '/')
     {
         Trace(0, "Vfs::ResolvePath: no mount for %s", path);
         return false;
     }
 
-    fs = Mounts[mountIdx].Fs;
-    VNode* cur = fs->GetRoot();
+    walk.Mount = FindMount(RootFs);
+    walk.Fs = RootFs;
+    VNode* cur = RootFs->GetRoot();
+    walk.Lock(cur, false);
 
-    if (*remainder == '\0')
-    {
-        node = cur;
-        return true;
-    }
-
-    // Walk path components
-    const char* p = remainder;
+    // Walk path components, each dir held shared until the end
+    const char* p = path + 1;
     while (*p != '\0')
     {
         // Extract next component
@@ -224,22 +439,14 @@ bool Vfs::ResolvePath(const char* path, FileSystem*& fs, VNode*& node,
 
         // "." and ".." are not stored as children; resolve them here
         if (component[0] == '.' && component[1] == '\0')
-        {
-            if (*p == '\0')
-            {
-                node = cur;
-                return true;
-            }
             continue;
-        }
         if (component[0] == '.' && component[1] == '.' && component[2] == '\0')
         {
+            // The parent is held right below; the mount root stays put
             if (cur->Parent != nullptr)
-                cur = cur->Parent; // the mount root stays put
-            if (*p == '\0')
             {
-                node = cur;
-                return true;
+                walk.Unlock();
+                cur = walk.GetLast();
             }
             continue;
         }
@@ -247,47 +454,82 @@ bool Vfs::ResolvePath(const char* path, FileSystem*& fs, VNode*& node,
         // If there are more components, this must be a directory
         if (*p != '\0')
         {
-            VNode* child = fs->Lookup(cur, component);
+            VNode* child = Lookup(walk.Mount, cur, component);
             if (child == nullptr || child->NodeType != VNode::TypeDir)
             {
                 Trace(0, "Vfs::ResolvePath: component '%s' not found or not dir", component);
                 return false;
             }
+            /* A mount point stays as long as its mount: no need to
+               hold it too */
+            if (child->MountedFs != nullptr)
+            {
+                walk.Mount = FindMount(child->MountedFs);
+                walk.Fs = child->MountedFs;
+                child = walk.Fs->GetRoot();
+            }
+            if (!walk.Lock(child, false))
+            {
+                Trace(0, "Vfs::ResolvePath: %s is more than %u levels deep", path, MaxWalkDepth);
+                return false;
+            }
             cur = child;
+            continue;
+        }
+
+        // Last component, looked up in cur
+        if (flags & WalkParentWrite)
+            walk.Relock(true);
+
+        VNode* child = Lookup(walk.Mount, cur, component);
+        VNode* parent = cur;
+        if (child != nullptr && child->MountedFs != nullptr)
+        {
+            walk.Mount = FindMount(child->MountedFs);
+            walk.Fs = child->MountedFs;
+            child = walk.Fs->GetRoot();
+            parent = nullptr;
         }
         else
         {
-            // Last component
-            VNode* child = fs->Lookup(cur, component);
-            parent = cur;
-            if (lastName)
-                Stdlib::StrnCpy(lastName, component, lastNameSize);
-            if (child != nullptr)
-            {
-                node = child;
-            }
-            return true;
+            Stdlib::StrnCpy(walk.LastName, component, sizeof(walk.LastName));
+        }
+        walk.Node = child;
+        walk.Parent = parent;
+
+        /* The parent keeps child from going away (a mount root stays
+           anyway); the dirs above can go */
+        walk.Keep(parent);
+        if (child != nullptr && (flags & (WalkNodeRead | WalkNodeWrite)))
+        {
+            walk.Lock(child, (flags & WalkNodeWrite) != 0);
+            if (!(flags & WalkParentWrite))
+                walk.Keep(child);
         }
+        return true;
     }
 
-    node = cur;
+    // The path ends in the dir cur ("/", "." or ".."), held shared
+    walk.Node = cur;
+    walk.Keep(cur, cur->Parent);
+    if (flags & WalkNodeWrite)
+        walk.Relock(true);
+    walk.Keep(cur);
     return true;
 }
 
 bool Vfs::ListDir(const char* path, Stdlib::Printer& printer)
 {
-    Stdlib::AutoLock lock(Lock);
-
-    FileSystem* fs;
-    VNode* node;
-    VNode* parent;
+    ReadLocked mounts(MountLock);
+    Walk walk;
 
-    if (!ResolvePath(path, fs, node, parent, nullptr, 0))
+    if (!ResolvePath(path, WalkNodeRead, walk))
     {
         printer.Printf("path not found\n");
         return false;
     }
 
+    VNode* node = walk.Node;
     if (node == nullptr)
     {
         printer.Printf("path not found\n");
@@ -300,6 +542,16 @@ bool Vfs::ListDir(const char* path, Stdlib::Printer& printer)
         return false;
     }
 
+    /* Once loaded it stays so while held */
+    {
+        FsLock lock(walk.Mount);
+        if (!walk.Fs->LoadDir(node))
+        {
+            printer.Printf("read failed\n");
+            return false;
+        }
+    }
+
     Stdlib::ListEntry* head = &node->Children;
     Stdlib::ListEntry* entry = head->Flink;
     while (entry != head)
@@ -316,230 +568,855 @@ bool Vfs::ListDir(const char* path, Stdlib::Printer& printer)
     return true;
 }
 
-bool Vfs::ReadFile(const char* path, Stdlib::Printer& printer)
+bool Vfs::ReadFileAt(const char* path, void* buf, ulong len, ulong offset)
 {
-    Stdlib::AutoLock lock(Lock);
-
-    FileSystem* fs;
-    VNode* node;
-    VNode* parent;
+    ReadLocked mounts(MountLock);
+    Walk walk;
 
-    if (!ResolvePath(path, fs, node, parent, nullptr, 0))
+    if (!ResolvePath(path, WalkNodeRead, walk) || walk.Node == nullptr)
     {
-        printer.Printf("path not found\n");
+        Trace(0, "Vfs::ReadFileAt: %s not found", path);
         return false;
     }
 
-    if (node == nullptr)
+    VNode* node = walk.Node;
+    if (node->NodeType != VNode::TypeFile)
     {
-        printer.Printf("file not found\n");
+        Trace(0, "Vfs::ReadFileAt: %s is not a file", path);
         return false;
     }
 
-    if (node->NodeType != VNode::TypeFile)
+    if (len == 0 || offset >= node->Size || len > node->Size - offset)
+        return false;
+
+    FsLock lock(walk.Mount);
+    return walk.Fs->Read(node, buf, len, offset);
+}
+
+/* The file at path held exclusively for writing: on a writable mount,
+   created if missing and create is set, and not mapped.  Called with
+   MountLock held. */
+bool Vfs::ResolveForWrite(const char* path, const char* caller, bool create, Walk& walk)
+{
+    if (!ResolvePath(path, WalkNodeWrite, walk))
     {
-        printer.Printf("not a file\n");
+        Trace(0, "Vfs::%s: resolve failed for %s", caller, path);
         return false;
     }
 
-    if (node->Size == 0)
-        return true;
+    /* Again with the parent held exclusively, to create the file */
+    if (walk.Node == nullptr && create &&
+        !ResolvePath(path, WalkParentWrite | WalkNodeWrite, walk))
+    {
+        Trace(0, "Vfs::%s: resolve failed for %s", caller, path);
+        return false;
+    }
 
-    // Read content through fs->Read() so on-disk filesystems work
-    ulong size = node->Size;
-    u8* buf = (u8*)Mm::Alloc(size + 1, 0);
-    if (buf == nullptr)
+    if (walk.Mount->ReadOnly)
     {
-        Trace(0, "Vfs::ReadFile: alloc %u bytes failed", (ulong)size);
-        printer.Printf("read failed\n");
+        Trace(0, "Vfs::%s: %s is on a readonly mount", caller, path);
         return false;
     }
 
-    if (!fs->Read(node, buf, size, 0))
+    if (walk.Node == nullptr)
     {
-        Mm::Free(buf);
-        printer.Printf("read failed\n");
+        if (!create)
+        {
+            Trace(0, "Vfs::%s: %s not found", caller, path);
+            return false;
+        }
+
+        // Create file
+        if (walk.Parent == nullptr || walk.LastName[0] == '\0')
+        {
+            Trace(0, "Vfs::%s: no parent dir for %s", caller, path);
+            return false;
+        }
+
+        VNode* node;
+        {
+            FsLock lock(walk.Mount);
+            node = walk.Fs->CreateFile(walk.Parent, walk.LastName);
+        }
+        if (node == nullptr)
+        {
+            Trace(0, "Vfs::%s: create failed for %s", caller, path);
+            return false;
+        }
+
+        /* Nobody else got to it yet */
+        walk.Lock(node, true);
+        walk.Keep(node);
+        walk.Node = node;
+    }
+
+    if (walk.Node->NodeType != VNode::TypeFile)
+    {
+        Trace(0, "Vfs::%s: %s is not a file", caller, path);
         return false;
     }
 
-    // Print content character by character to handle non-null-terminated data
-    for (ulong i = 0; i < size; i++)
+    if (walk.Node->MapCount != 0)
     {
-        char c = (char)buf[i];
-        char tmp[2] = { c, '\0' };
-        printer.PrintString(tmp);
+        Trace(0, "Vfs::%s: %s is mapped", caller, path);
+        return false;
     }
-    Mm::Free(buf);
-    printer.Printf("\n");
+
     return true;
 }
 
 bool Vfs::WriteFile(const char* path, const void* data, ulong len)
 {
-    Stdlib::AutoLock lock(Lock);
+    FileSystem* fs;
+    u64 transaction;
+    {
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolveForWrite(path, "WriteFile", true, walk))
+            return false;
+        fs = walk.Fs;
 
-    if (IsMountReadOnly(path))
+        FsLock lock(walk.Mount);
+        if (!fs->Write(walk.Node, data, len))
+            return false;
+        transaction = fs->GetTransaction();
+    }
+    return CommitTransaction(fs, transaction);
+}
+
+bool Vfs::WriteFileAt(const char* path, const void* data, ulong len, ulong offset)
+{
+    FileSystem* fs;
+    u64 transaction;
     {
-        Trace(0, "Vfs::WriteFile: %s is on a readonly mount", path);
-        return false;
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolveForWrite(path, "WriteFileAt", true, walk))
+            return false;
+        fs = walk.Fs;
+
+        FsLock lock(walk.Mount);
+        if (!fs->WriteAt(walk.Node, data, len, offset))
+            return false;
+        transaction = fs->GetTransaction();
     }
+    return CommitTransaction(fs, transaction);
+}
 
+bool Vfs::AppendFile(const char* path, const void* data, ulong len)
+{
     FileSystem* fs;
-    VNode* node;
-    VNode* parent;
-    char lastName[64];
+    u64 transaction;
+    {
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolveForWrite(path, "AppendFile", true, walk))
+            return false;
+        fs = walk.Fs;
 
-    if (!ResolvePath(path, fs, node, parent, lastName, sizeof(lastName)))
+        FsLock lock(walk.Mount);
+        if (!fs->WriteAt(walk.Node, data, len, walk.Node->Size))
+            return false;
+        transaction = fs->GetTransaction();
+    }
+    return CommitTransaction(fs, transaction);
+}
+
+bool Vfs::TruncateFile(const char* path, ulong size)
+{
+    FileSystem* fs;
+    u64 transaction;
     {
-        Trace(0, "Vfs::WriteFile: resolve failed for %s", path);
-        return false;
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolveForWrite(path, "TruncateFile", false, walk))
+            return false;
+        fs = walk.Fs;
+
+        FsLock lock(walk.Mount);
+        if (!fs->Truncate(walk.Node, size))
+            return false;
+        transaction = fs->GetTransaction();
     }
+    return CommitTransaction(fs, transaction);
+}
 
-    if (node == nullptr)
+bool Vfs::CreateDir(const char* path)
+{
+    FileSystem* fs;
+    u64 transaction;
     {
-        // Create file
-        if (parent == nullptr || lastName[0] == '\0')
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolvePath(path, WalkParentWrite, walk))
         {
-            Trace(0, "Vfs::WriteFile: no parent dir for %s", path);
+            Trace(0, "Vfs::CreateDir: resolve failed for %s", path);
             return false;
         }
-        node = fs->CreateFile(parent, lastName);
-        if (node == nullptr)
+
+        if (walk.Mount->ReadOnly)
+        {
+            Trace(0, "Vfs::CreateDir: %s is on a readonly mount", path);
+            return false;
+        }
+
+        if (walk.Node != nullptr)
+        {
+            Trace(0, "Vfs::CreateDir: %s already exists", path);
+            return false; // already exists
+        }
+
+        if (walk.Parent == nullptr || walk.LastName[0] == '\0')
         {
-            Trace(0, "Vfs::WriteFile: create failed for %s", path);
+            Trace(0, "Vfs::CreateDir: no parent dir for %s", path);
             return false;
         }
+
+        fs = walk.Fs;
+        FsLock lock(walk.Mount);
+        if (fs->CreateDir(walk.Parent, walk.LastName) == nullptr)
+            return false;
+        transaction = fs->GetTransaction();
     }
+    return CommitTransaction(fs, transaction);
+}
 
-    if (node->NodeType != VNode::TypeFile)
+bool Vfs::CreateFile(const char* path)
+{
+    FileSystem* fs;
+    u64 transaction;
     {
-        Trace(0, "Vfs::WriteFile: %s is not a file", path);
-        return false;
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolvePath(path, WalkParentWrite, walk))
+        {
+            Trace(0, "Vfs::CreateFile: resolve failed for %s", path);
+            return false;
+        }
+
+        if (walk.Mount->ReadOnly)
+        {
+            Trace(0, "Vfs::CreateFile: %s is on a readonly mount", path);
+            return false;
+        }
+
+        if (walk.Node != nullptr)
+        {
+            Trace(0, "Vfs::CreateFile: %s already exists", path);
+            return false; // already exists
+        }
+
+        if (walk.Parent == nullptr || walk.LastName[0] == '\0')
+        {
+            Trace(0, "Vfs::CreateFile: no parent dir for %s", path);
+            return false;
+        }
+
+        fs = walk.Fs;
+        FsLock lock(walk.Mount);
+        if (fs->CreateFile(walk.Parent, walk.LastName) == nullptr)
+            return false;
+        transaction = fs->GetTransaction();
     }
+    return CommitTransaction(fs, transaction);
+}
+
+bool Vfs::Remove(const char* path)
+{
+    FileSystem* fs;
+    u64 transaction;
+    {
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!ResolvePath(path, WalkParentWrite | WalkNodeWrite, walk))
+        {
+            Trace(0, "Vfs::Remove: resolve failed for %s", path);
+            return false;
+        }
+
+        if (walk.Mount->ReadOnly)
+        {
+            Trace(0, "Vfs::Remove: %s is on a readonly mount", path);
+            return false;
+        }
+
+        VNode* node = walk.Node;
+        if (node == nullptr)
+        {
+            Trace(0, "Vfs::Remove: %s not found", path);
+            return false;
+        }
+
+        if (walk.Parent == nullptr)
+        {
+            Trace(0, "Vfs::Remove: %s is the root of a mount or ends in . or ..", path);
+            return false;
+        }
+
+        bool busy;
+        {
+            Stdlib::AutoLock lock(walk.Mount->Lock);
+            busy = IsBusy(node);
+        }
+        if (busy)
+        {
+            Trace(0, "Vfs::Remove: %s is or holds a mapped, open or locked file or a mount point", path);
+            return false;
+        }
+
+        fs = walk.Fs;
+        FsLock lock(walk.Mount);
+        bool ok = fs->Remove(node);
 
-    return fs->Write(node, data, len);
+        /* Freed unless it failed before getting that far */
+        if (ok || DirIndex::Find(walk.Parent, walk.LastName) != node)
+            walk.Forget(node);
+        if (!ok)
+            return false;
+        transaction = fs->GetTransaction();
+    }
+    return CommitTransaction(fs, transaction);
 }
 
-bool Vfs::CreateDir(const char* path)
+bool Vfs::Stat(const char* path, VNode::Type& type, ulong& size)
 {
-    Stdlib::AutoLock lock(Lock);
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    if (!ResolvePath(path, 0, walk) || walk.Node == nullptr)
+        return false;
+
+    type = walk.Node->NodeType;
+    size = (walk.Node->NodeType == VNode::TypeFile) ? walk.Node->Size : 0;
+    return true;
+}
 
-    if (IsMountReadOnly(path))
+bool Vfs::Open(const char* path, ulong flags, ulong& fd)
+{
+    fd = InvalidObjectId;
+    if ((flags & (OpenRead | OpenWrite)) == 0 ||
+        ((flags & (OpenCreate | OpenTruncate | OpenAppend)) != 0 && (flags & OpenWrite) == 0))
     {
-        Trace(0, "Vfs::CreateDir: %s is on a readonly mount", path);
+        Trace(0, "Vfs::Open: bad flags %u for %s", flags, path);
         return false;
     }
 
+    File* file;
     FileSystem* fs;
-    VNode* node;
-    VNode* parent;
-    char lastName[64];
+    u64 transaction;
+    {
+        ReadLocked mounts(MountLock);
+        Walk walk;
 
-    if (!ResolvePath(path, fs, node, parent, lastName, sizeof(lastName)))
+        if (flags & OpenWrite)
+        {
+            if (!ResolveForWrite(path, "Open", (flags & OpenCreate) != 0, walk))
+                return false;
+            if ((flags & OpenTruncate) && walk.Node->Size != 0)
+            {
+                FsLock lock(walk.Mount);
+                if (!walk.Fs->Truncate(walk.Node, 0))
+                {
+                    Trace(0, "Vfs::Open: truncate failed for %s", path);
+                    return false;
+                }
+            }
+        }
+        else
+        {
+            if (!ResolvePath(path, WalkNodeRead, walk) || walk.Node == nullptr)
+            {
+                Trace(0, "Vfs::Open: %s not found", path);
+                return false;
+            }
+            if (walk.Node->NodeType != VNode::TypeFile)
+            {
+                Trace(0, "Vfs::Open: %s is not a file", path);
+                return false;
+            }
+        }
+
+        fs = walk.Fs;
+        file = new (Mm::NoThrow) File(fs, walk.Node, flags);
+        if (file == nullptr)
+        {
+            Trace(0, "Vfs::Open: alloc file failed for %s", path);
+            return false;
+        }
+        {
+            Stdlib::AutoLock lock(walk.Mount->Lock);
+            walk.Node->OpenCount++;
+            walk.Mount->OpenFiles++;
+        }
+
+        FsLock lock(walk.Mount);
+        transaction = fs->GetTransaction();
+    }
+
+    /* The table holds the only reference; dropping it takes MountLock */
+    fd = Files.Insert(file);
+    file->Put();
+    if (fd == InvalidObjectId)
     {
-        Trace(0, "Vfs::CreateDir: resolve failed for %s", path);
+        Trace(0, "Vfs::Open: too many open files for %s", path);
+        CommitTransaction(fs, transaction);
         return false;
     }
 
-    if (node != nullptr)
+    if (!CommitTransaction(fs, transaction))
     {
-        Trace(0, "Vfs::CreateDir: %s already exists", path);
-        return false; // already exists
+        Close(fd);
+        fd = InvalidObjectId;
+        return false;
     }
+    return true;
+}
 
-    if (parent == nullptr || lastName[0] == '\0')
+bool Vfs::Close(ulong fd)
+{
+    Object* file = Files.Lookup(fd);
+    if (file == nullptr)
     {
-        Trace(0, "Vfs::CreateDir: no parent dir for %s", path);
+        Trace(0, "Vfs::Close: bad descriptor %u", fd);
         return false;
     }
 
-    return (fs->CreateDir(parent, lastName) != nullptr);
+    Files.Remove(fd);
+    file->Put();
+    return true;
 }
 
-bool Vfs::CreateFile(const char* path)
+/* The File of fd, with a reference, if it was opened for access.  Not
+   called with MountLock held: the last Put of a File takes it */
+File* Vfs::GetFile(ulong fd, ulong access, const char* caller)
 {
-    Stdlib::AutoLock lock(Lock);
+    File* file = static_cast<File*>(Files.Lookup(fd));
+    if (file == nullptr)
+    {
+        Trace(0, "Vfs::%s: bad descriptor %u", caller, fd);
+        return nullptr;
+    }
 
-    if (IsMountReadOnly(path))
+    if ((file->Flags & access) != access)
+    {
+        Trace(0, "Vfs::%s: descriptor %u is not open for %s", caller, fd,
+              (access == OpenRead) ? "reading" : "writing");
+        file->Put();
+        return nullptr;
+    }
+    return file;
+}
+
+/* Lock the VNode of file into walk.  Called with MountLock held */
+bool Vfs::LockFile(File* file, bool write, Walk& walk)
+{
+    /* UnmountAll at shutdown does not wait for open files */
+    walk.Mount = FindMount(file->Fs);
+    if (walk.Mount == nullptr)
     {
-        Trace(0, "Vfs::CreateFile: %s is on a readonly mount", path);
+        Trace(0, "Vfs: %s is no longer mounted", file->Node->Name);
         return false;
     }
 
-    FileSystem* fs;
-    VNode* node;
-    VNode* parent;
-    char lastName[64];
+    walk.Fs = file->Fs;
+    walk.Node = file->Node;
+    walk.Lock(file->Node, write);
+    return true;
+}
+
+/* Called with the VNode of walk held */
+bool Vfs::ReadAt(Walk& walk, void* buf, ulong len, ulong offset, ulong& done)
+{
+    VNode* node = walk.Node;
+    done = 0;
+    if (len == 0 || offset >= node->Size)
+        return true;
+
+    ulong count = Stdlib::Min(len, node->Size - offset);
+    FsLock lock(walk.Mount);
+    if (!walk.Fs->Read(node, buf, count, offset))
+    {
+        Trace(0, "Vfs::Read: %s: read of %u bytes at %u failed", node->Name, count, offset);
+        return false;
+    }
+    done = count;
+    return true;
+}
+
+/* Called with the VNode of walk held exclusively */
+bool Vfs::WriteAt(Walk& walk, const void* data, ulong len, ulong offset, u64& transaction)
+{
+    VNode* node = walk.Node;
+    transaction = 0;
+    if (node->MapCount != 0)
+    {
+        Trace(0, "Vfs::Write: %s is mapped", node->Name);
+        return false;
+    }
+
+    FsLock lock(walk.Mount);
+    if (len != 0 && !walk.Fs->WriteAt(node, data, len, offset))
+        return false;
+    transaction = walk.Fs->GetTransaction();
+    return true;
+}
+
+void Vfs::Release(File* file)
+{
+    ReadLocked mounts(MountLock);
+
+    /* UnmountAll at shutdown does not wait for open files */
+    MountEntry* mount = FindMount(file->Fs);
+    if (mount == nullptr)
+        return;
+
+    Stdlib::AutoLock lock(mount->Lock);
+    if (file->Node->OpenCount != 0)
+        file->Node->OpenCount--;
+    if (mount->OpenFiles != 0)
+        mount->OpenFiles--;
+}
+
+bool Vfs::Read(ulong fd, void* buf, ulong len, ulong& done)
+{
+    done = 0;
+    ObjectPtr<File> file(GetFile(fd, OpenRead, "Read"));
+    if (!file)
+        return false;
+
+    Stdlib::AutoLock position(file->PositionLock);
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    if (!LockFile(file.Get(), false, walk) ||
+        !ReadAt(walk, buf, len, file->Position, done))
+        return false;
+    file->Position += done;
+    return true;
+}
+
+bool Vfs::Write(ulong fd, const void* data, ulong len)
+{
+    ObjectPtr<File> file(GetFile(fd, OpenWrite, "Write"));
+    if (!file)
+        return false;
+
+    u64 transaction;
+    {
+        Stdlib::AutoLock position(file->PositionLock);
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!LockFile(file.Get(), true, walk))
+            return false;
+        ulong offset = (file->Flags & OpenAppend) ? file->Node->Size : file->Position;
+        if (!WriteAt(walk, data, len, offset, transaction))
+            return false;
+        file->Position = offset + len;
+    }
+    return CommitTransaction(file->Fs, transaction);
+}
+
+bool Vfs::PRead(ulong fd, void* buf, ulong len, ulong offset, ulong& done)
+{
+    done = 0;
+    ObjectPtr<File> file(GetFile(fd, OpenRead, "PRead"));
+    if (!file)
+        return false;
+
+    ReadLocked mounts(MountLock);
+    Walk walk;
+    return LockFile(file.Get(), false, walk) && ReadAt(walk, buf, len, offset, done);
+}
+
+bool Vfs::PWrite(ulong fd, const void* data, ulong len, ulong offset)
+{
+    ObjectPtr<File> file(GetFile(fd, OpenWrite, "PWrite"));
+    if (!file)
+        return false;
+
+    u64 transaction;
+    {
+        ReadLocked mounts(MountLock);
+        Walk walk;
+
+        if (!LockFile(file.Get(), true, walk) ||
+            !WriteAt(walk, data, len, offset, transaction))
+            return false;
+    }
+    return CommitTransaction(file->Fs, transaction);
+}
+
+bool Vfs::Seek(ulong fd, long offset, SeekWhence whence, ulong& position)
+{
+    ObjectPtr<File> file(GetFile(fd, 0, "Seek"));
+    if (!file)
+        return false;
+
+    Stdlib::AutoLock positionLock(file->PositionLock);
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    if (!LockFile(file.Get(), false, walk))
+        return false;
+
+    ulong base = 0;
+    if (whence == SeekCur)
+        base = file->Position;
+    else if (whence == SeekEnd)
+        base = file->Node->Size;
 
-    if (!ResolvePath(path, fs, node, parent, lastName, sizeof(lastName)))
+    if (offset < 0 && (ulong)-offset > base)
     {
-        Trace(0, "Vfs::CreateFile: resolve failed for %s", path);
+        Trace(0, "Vfs::Seek: descriptor %u: offset before the start", fd);
         return false;
     }
+    file->Position = base + offset;
+    position = file->Position;
+    return true;
+}
+
+bool Vfs::Stat(ulong fd, VNode::Type& type, ulong& size)
+{
+    ObjectPtr<File> file(GetFile(fd, 0, "Stat"));
+    if (!file)
+        return false;
+
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    if (!LockFile(file.Get(), false, walk))
+        return false;
+
+    type = file->Node->NodeType;
+    size = file->Node->Size;
+    return true;
+}
+
+/* Mapped or open files, mount points and VNodes others hold.  The
+   caller holds node exclusively, so nothing below can be reached anew.
+   Children not loaded yet cannot be any: a dir holding one is never
+   unloaded */
+bool Vfs::IsBusy(VNode* node)
+{
+    if (node->MapCount != 0 || node->OpenCount != 0 || node->MountedFs != nullptr)
+        return true;
 
-    if (node != nullptr)
+    if (node->NodeType == VNode::TypeDir)
     {
-        Trace(0, "Vfs::CreateFile: %s already exists", path);
-        return false; // already exists
+        for (Stdlib::ListEntry* e = node->Children.Flink; e != &node->Children; e = e->Flink)
+        {
+            VNode* child = CONTAINING_RECORD(e, VNode, SiblingLink);
+            if (!child->Lock.TryWriteLock())
+                return true;
+            child->Lock.WriteUnlock();
+
+            if (IsBusy(child))
+                return true;
+        }
     }
+    return false;
+}
+
+bool Vfs::MapFile(const char* path, bool write, FileExtentMap& map,
+                  FileSystem*& fs, VNode*& node)
+{
+    ReadLocked mounts(MountLock);
+    Walk walk;
 
-    if (parent == nullptr || lastName[0] == '\0')
+    if (!ResolvePath(path, WalkNodeWrite, walk) || walk.Node == nullptr)
     {
-        Trace(0, "Vfs::CreateFile: no parent dir for %s", path);
+        Trace(0, "Vfs::MapFile: %s not found", path);
         return false;
     }
+    fs = walk.Fs;
+    node = walk.Node;
 
-    return (fs->CreateFile(parent, lastName) != nullptr);
+    MountEntry* mount = walk.Mount;
+    if (write && mount->ReadOnly)
+    {
+        Trace(0, "Vfs::MapFile: %s is on a readonly mount", path);
+        return false;
+    }
+
+    if (node->NodeType != VNode::TypeFile || fs->GetDevice() == nullptr)
+    {
+        Trace(0, "Vfs::MapFile: %s is not a file on a block device", path);
+        return false;
+    }
+
+    {
+        FsLock lock(mount);
+
+        /* The extents are read and written behind the buffer cache */
+        if (!mount->ReadOnly && !fs->Sync())
+        {
+            Trace(0, "Vfs::MapFile: sync failed for %s", mount->Path);
+            return false;
+        }
+
+        if (!fs->MapExtents(node, write, map))
+        {
+            Trace(0, "Vfs::MapFile: %s cannot map %s", fs->GetName(), path);
+            return false;
+        }
+    }
+
+    Stdlib::AutoLock lock(mount->Lock);
+    node->MapCount++;
+    mount->MappedFiles++;
+    return true;
 }
 
-bool Vfs::Remove(const char* path)
+void Vfs::UnmapFile(FileSystem* fs, VNode* node)
 {
-    Stdlib::AutoLock lock(Lock);
+    ReadLocked mounts(MountLock);
 
-    if (IsMountReadOnly(path))
+    MountEntry* mount = FindMount(fs);
+    if (mount == nullptr)
+        return;
+
+    Stdlib::AutoLock lock(mount->Lock);
+    if (node->MapCount != 0)
+        node->MapCount--;
+    if (mount->MappedFiles != 0)
+        mount->MappedFiles--;
+}
+
+bool Vfs::IsDeviceMounted(BlockDevice* dev)
+{
+    ReadLocked mounts(MountLock);
+
+    for (ulong i = 0; i < MountCount; i++)
     {
-        Trace(0, "Vfs::Remove: %s is on a readonly mount", path);
+        if (Mounts[i]->Fs->GetDevice() == dev)
+            return true;
+    }
+    return false;
+}
+
+bool Vfs::Sync()
+{
+    bool ok = true;
+    {
+        ReadLocked mounts(MountLock);
+
+        for (ulong i = 0; i < MountCount; i++)
+        {
+            if (Mounts[i]->ReadOnly)
+                continue;
+
+            FsLock lock(Mounts[i]);
+            if (!Mounts[i]->Fs->Sync())
+            {
+                Trace(0, "Vfs::Sync: sync failed for %s", Mounts[i]->Path);
+                ok = false;
+            }
+        }
+    }
+
+    /* Blocks written outside a mount (e.g. format) */
+    if (!BufferCache::GetInstance().Sync(nullptr))
+        ok = false;
+    return ok;
+}
+
+bool Vfs::Trim(const char* path, u64& bytes)
+{
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    bytes = 0;
+    if (!ResolvePath(path, 0, walk) || walk.Node == nullptr)
+    {
+        Trace(0, "Vfs::Trim: %s not found", path);
         return false;
     }
 
-    FileSystem* fs;
-    VNode* node;
-    VNode* parent;
+    /* The whole file system, not the dir: let it go */
+    walk.Release();
+    if (walk.Mount->ReadOnly)
+    {
+        Trace(0, "Vfs::Trim: %s is read-only", walk.Mount->Path);
+        return false;
+    }
+
+    FsLock lock(walk.Mount);
+    return walk.Fs->Trim(bytes);
+}
 
-    if (!ResolvePath(path, fs, node, parent, nullptr, 0))
+bool Vfs::SetJournal(const char* path, bool on)
+{
+    ReadLocked mounts(MountLock);
+    Walk walk;
+
+    if (!ResolvePath(path, 0, walk) || walk.Node == nullptr)
     {
-        Trace(0, "Vfs::Remove: resolve failed for %s", path);
+        Trace(0, "Vfs::SetJournal: %s not found", path);
         return false;
     }
 
-    if (node == nullptr)
+    walk.Release();
+    if (walk.Mount->ReadOnly)
     {
-        Trace(0, "Vfs::Remove: %s not found", path);
+        Trace(0, "Vfs::SetJournal: %s is read-only", walk.Mount->Path);
         return false;
     }
 
-    return fs->Remove(node);
+    FsLock lock(walk.Mount);
+    return walk.Fs->SetJournal(on);
+}
+
+/* Group commit: the mount's lock was dropped after the operation, so
+   operations queued on it ran meanwhile and joined its transaction;
+   whichever commits first makes them all durable with one flush, the
+   others find theirs committed.  Called without MountLock held. */
+bool Vfs::CommitTransaction(FileSystem* fs, u64 transaction)
+{
+    if (transaction == 0)
+        return true;
+
+    ReadLocked mounts(MountLock);
+
+    /* Unmounting committed it */
+    MountEntry* mount = FindMount(fs);
+    if (mount == nullptr)
+        return true;
+
+    FsLock lock(mount);
+    return fs->Commit(transaction);
 }
 
 void Vfs::DumpMounts(Stdlib::Printer& printer)
 {
-    Stdlib::AutoLock lock(Lock);
+    ReadLocked mounts(MountLock);
 
     for (ulong i = 0; i < MountCount; i++)
     {
-        const char* rwStr = Mounts[i].ReadOnly ? "ro" : "rw";
+        MountEntry* mount = Mounts[i];
+        const char* rwStr = mount->ReadOnly ? "ro" : "rw";
         char info[64];
-        Mounts[i].Fs->GetInfo(info, sizeof(info));
+        {
+            FsLock lock(mount);
+            mount->Fs->GetInfo(info, sizeof(info));
+        }
         if (info[0] != '\0')
-            printer.Printf("%s on %s  %s  %s\n", Mounts[i].Fs->GetName(), Mounts[i].Path, info, rwStr);
+            printer.Printf("%s on %s  %s  %s\n", mount->Fs->GetName(), mount->Path, info, rwStr);
         else
-            printer.Printf("%s on %s  %s\n", Mounts[i].Fs->GetName(), Mounts[i].Path, rwStr);
+            printer.Printf("%s on %s  %s\n", mount->Fs->GetName(), mount->Path, rwStr);
     }
 }
 
 void Vfs::UnmountAll()
 {
-    Stdlib::AutoLock lock(Lock);
+    WriteLocked mounts(MountLock);
 
     /* Unmount in reverse path-length order (deepest first)
        so child mounts are torn down before parents. */
@@ -549,7 +1426,7 @@ void Vfs::UnmountAll()
         ulong longestIdx = 0;
         for (ulong i = 0; i < MountCount; i++)
         {
-            ulong len = Stdlib::StrLen(Mounts[i].Path);
+            ulong len = Stdlib::StrLen(Mounts[i]->Path);
             if (len >= longest)
             {
                 longest = len;
@@ -557,18 +1434,25 @@ void Vfs::UnmountAll()
             }
         }
 
-        Trace(0, "Vfs::UnmountAll: unmounting %s (%s)",
-              Mounts[longestIdx].Path, Mounts[longestIdx].Fs->GetName());
+        MountEntry* mount = Mounts[longestIdx];
+        Trace(0, "Vfs::UnmountAll: unmounting %s (%s)", mount->Path, mount->Fs->GetName());
 
-        FileSystem* fs = Mounts[longestIdx].Fs;
+        FileSystem* fs = mount->Fs;
         fs->Unmount();
         delete fs;
 
+        if (mount->Covered != nullptr)
+            mount->Covered->MountedFs = nullptr;
+        else
+            RootFs = nullptr;
+
         for (ulong j = longestIdx; j + 1 < MountCount; j++)
             Mounts[j] = Mounts[j + 1];
         MountCount--;
-        Stdlib::MemSet(&Mounts[MountCount], 0, sizeof(MountEntry));
+        Mounts[MountCount] = nullptr;
+        delete mount;
     }
+    DentryCache::GetInstance().Purge();
 }
 
 }
@@ -1,12 +1,39 @@
 #pragma once
 
 #include <fs/filesystem.h>
+#include <fs/file.h>
 #include <lib/printer.h>
 #include <kernel/mutex.h>
+#include <kernel/rw_mutex.h>
+#include <kernel/object_table.h>
 
 namespace Kernel
 {
 
+/* Locks, in the order they are taken:
+
+   1. MountLock: the mount table, RootFs and VNode::MountedFs.  Every
+      operation holds it shared throughout; Mount and Unmount take it
+      exclusively, waiting for what runs.
+   2. VNode::Lock, parent before child down a path; the root of a mount
+      counts as a child of the mount point's parent (mount points stay
+      as long as their mounts).  A walk holds the dirs it passes shared
+      until it reaches the last component, then keeps only what the
+      operation needs: the parent (exclusive to create or remove in it)
+      and the node (shared to read or list it, exclusive to write it).
+      VNodes are freed only with their parent held exclusively and none
+      of them held by anyone else (Remove refuses a subtree someone
+      holds part of, VNodeCache eviction skips it), so what an operation
+      holds stays put.
+   3. MountEntry::Lock, innermost: around each call into a file system
+      that is not FileSystem::IsConcurrent, and the open and mapped
+      counts.  Only VNode try-locks are taken under it.
+
+   A File's PositionLock comes before all three.  So operations on
+   different mounts do not wait for each other; on a concurrent file
+   system (ramfs) neither do operations on different files or reads of
+   one file, and on the rest (nanofs, ext2) path walks that hit the
+   DentryCache go on while a call into the file system runs. */
 class Vfs
 {
 public:
@@ -16,23 +43,106 @@ public:
         return instance;
     }
 
+    /* Mount fs on path: "/" first, then existing directories (mount
+       points).  Path walks cross from a mount point into the root of
+       the file system mounted on it. */
     bool Mount(const char* path, FileSystem* fs, bool readOnly = false);
     FileSystem* Unmount(const char* path);
 
     bool ListDir(const char* path, Stdlib::Printer& printer);
-    bool ReadFile(const char* path, Stdlib::Printer& printer);
     bool WriteFile(const char* path, const void* data, ulong len);
+
+    /* Write len bytes at offset of the file at path (created if
+       missing), rewriting only the blocks the range touches; a gap past
+       the end of the file reads as zeros. */
+    bool WriteFileAt(const char* path, const void* data, ulong len, ulong offset);
+
+    /* Write len bytes at the end of the file at path (created if
+       missing). */
+    bool AppendFile(const char* path, const void* data, ulong len);
+
+    /* Shrink or extend (with zeros) the file at path to size bytes. */
+    bool TruncateFile(const char* path, ulong size);
+
+    /* Read len bytes at offset of the file at path into buf; false if
+       the range does not lie within the file. */
+    bool ReadFileAt(const char* path, void* buf, ulong len, ulong offset);
     bool CreateDir(const char* path);
     bool CreateFile(const char* path);
     bool Remove(const char* path);
 
+    /* Type and size (0 for directories) of what path names; false if
+       nothing. */
+    bool Stat(const char* path, VNode::Type& type, ulong& size);
+
+    /* Open flags: OpenRead and/or OpenWrite, the rest only with
+       OpenWrite */
+    static const ulong OpenRead = 0x1;
+    static const ulong OpenWrite = 0x2;
+    static const ulong OpenCreate = 0x4;     /* create the file if missing */
+    static const ulong OpenTruncate = 0x8;   /* empty it first */
+    static const ulong OpenAppend = 0x10;    /* every Write goes to the end */
+
+    enum SeekWhence { SeekSet, SeekCur, SeekEnd };
+
+    /* Open the file at path at position 0; fd receives the descriptor.
+       While a file is open it can be neither removed nor evicted, and
+       its mount cannot be unmounted. */
+    bool Open(const char* path, ulong flags, ulong& fd);
+    bool Close(ulong fd);
+
+    /* Read up to len bytes at the position and advance past them; done
+       receives the count, 0 at the end of the file. */
+    bool Read(ulong fd, void* buf, ulong len, ulong& done);
+
+    /* Write len bytes at the position (the end with OpenAppend) and
+       advance past them. */
+    bool Write(ulong fd, const void* data, ulong len);
+
+    /* Read and Write at offset, leaving the position alone. */
+    bool PRead(ulong fd, void* buf, ulong len, ulong offset, ulong& done);
+    bool PWrite(ulong fd, const void* data, ulong len, ulong offset);
+
+    /* Move the position; past the end is allowed, a Write there leaves
+       a gap that reads as zeros.  position receives the new one. */
+    bool Seek(ulong fd, long offset, SeekWhence whence, ulong& position);
+
+    bool Stat(ulong fd, VNode::Type& type, ulong& size);
+
+    /* Make every mounted file system durable (write back dirty
+       buffers, flush device caches). */
+    bool Sync();
+
+    /* Discard the free space of the file system mounted at path; bytes
+       receives the amount discarded. */
+    bool Trim(const char* path, u64& bytes);
+
+    /* Turn the metadata journal of the file system mounted at path on
+       or off (FileSystem::SetJournal). */
+    bool SetJournal(const char* path, bool on);
+
+    /* Map the file at path for direct I/O on fs's device (see
+       FileSystem::MapExtents), after writing back the file system's
+       dirty blocks.  Until UnmapFile the file can be neither rewritten
+       nor removed and its mount cannot be unmounted.  write is refused
+       on read-only mounts. */
+    bool MapFile(const char* path, bool write, FileExtentMap& map,
+                 FileSystem*& fs, VNode*& node);
+    void UnmapFile(FileSystem* fs, VNode* node);
+
+    /* true if a mounted file system lives on dev. */
+    bool IsDeviceMounted(BlockDevice* dev);
+
     void DumpMounts(Stdlib::Printer& printer);
     void UnmountAll();
 
     static const ulong MaxMounts = 16;
     static const ulong MaxPath = 256;
+    static const ulong ChunkSize = 16 * 1024; /* per Read/Write when streaming a file (cat, wget) */
 
 private:
+    friend class File;
+
     Vfs();
     ~Vfs();
     Vfs(const Vfs& other) = delete;
@@ -42,18 +152,101 @@ private:
 
     struct MountEntry
     {
+        MountEntry(const char* path, FileSystem* fs, bool readOnly,
+                   VNode* covered, FileSystem* parentFs);
+
         char Path[MaxPath];
         FileSystem* Fs;
         bool ReadOnly;
+        ulong MappedFiles;      /* under Lock */
+        ulong OpenFiles;        /* under Lock */
+        VNode* Covered;         /* mount point, nullptr for "/" */
+        FileSystem* ParentFs;   /* the file system Covered belongs to */
+        Mutex Lock;
+    };
+
+    /* Holds mount's Lock across calls into its file system unless that
+       one is concurrent */
+    class FsLock
+    {
+    public:
+        FsLock(MountEntry* mount);
+        ~FsLock();
+
+    private:
+        FsLock(const FsLock& other) = delete;
+        FsLock(FsLock&& other) = delete;
+        FsLock& operator=(const FsLock& other) = delete;
+        FsLock& operator=(FsLock&& other) = delete;
+
+        Mutex* Lock;
     };
 
-    bool ResolvePath(const char* path, FileSystem*& fs, VNode*& node, VNode*& parent, char* lastName, ulong lastNameSize);
-    bool FindMount(const char* path, ulong& mountIdx, const char*& remainder);
-    bool IsMountReadOnly(const char* path);
+    static const ulong MaxWalkDepth = 64;   /* VNodes locked at once */
+
+    /* What ResolvePath found and the VNode locks it holds for the
+       operation, dropped by the destructor.  The last component was
+       looked up in Parent, named LastName; Node is nullptr if missing.
+       For the root of a mount (a mount point or "/" at the end) and
+       paths ending in "." or ".." Parent is nullptr. */
+    class Walk
+    {
+    public:
+        Walk();
+        ~Walk();
+
+        bool Lock(VNode* node, bool write);
+        void Unlock();                  /* the last one locked */
+        void Relock(bool write);        /* the last one, dropped and taken again */
+        void Keep(VNode* node, VNode* other = nullptr); /* drop the rest */
+        void Forget(VNode* node);       /* freed while locked */
+        void Release();
+        VNode* GetLast();
+
+        MountEntry* Mount;
+        FileSystem* Fs;
+        VNode* Node;
+        VNode* Parent;
+        char LastName[64];
+
+    private:
+        Walk(const Walk& other) = delete;
+        Walk(Walk&& other) = delete;
+        Walk& operator=(const Walk& other) = delete;
+        Walk& operator=(Walk&& other) = delete;
+
+        VNode* Held[MaxWalkDepth];
+        bool Write[MaxWalkDepth];
+        ulong Count;
+    };
+
+    /* ResolvePath flags; without any the walk keeps Parent shared,
+       which keeps Node from going away */
+    static const ulong WalkParentWrite = 0x1;   /* keep Parent exclusive */
+    static const ulong WalkNodeRead = 0x2;      /* keep Node shared */
+    static const ulong WalkNodeWrite = 0x4;     /* keep Node exclusive */
+
+    /* Called with MountLock held */
+    bool ResolvePath(const char* path, ulong flags, Walk& walk);
+    VNode* Lookup(MountEntry* mount, VNode* dir, const char* name);
+    MountEntry* FindMount(FileSystem* fs);
+    bool ResolveForWrite(const char* path, const char* caller, bool create, Walk& walk);
+    static bool IsBusy(VNode* node);
+    static void LockTree(VNode* dir);
+    static void UnlockTree(VNode* dir);
+    bool CommitTransaction(FileSystem* fs, u64 transaction);
+
+    File* GetFile(ulong fd, ulong access, const char* caller);
+    bool LockFile(File* file, bool write, Walk& walk);
+    bool ReadAt(Walk& walk, void* buf, ulong len, ulong offset, ulong& done);
+    bool WriteAt(Walk& walk, const void* data, ulong len, ulong offset, u64& transaction);
+    void Release(File* file);
 
-    MountEntry Mounts[MaxMounts];
+    MountEntry* Mounts[MaxMounts];
     ulong MountCount;
-    Mutex Lock;
+    FileSystem* RootFs;         /* mounted on "/", where every walk starts */
+    ObjectTable Files;          /* open files by descriptor */
+    RwMutex MountLock;
 };
 
 }
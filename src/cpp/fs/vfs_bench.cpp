@@ -0,0 +1,373 @@
+#include "vfs_bench.h"
+#include "vfs.h"
+#include "dentry_cache.h"
+
+#include <include/const.h>
+#include <kernel/cpu.h>
+#include <kernel/task.h>
+#include <kernel/time.h>
+#include <lib/stdlib.h>
+#include <mm/new.h>
+
+namespace Kernel
+{
+
+void VfsBench::LookupFunc(void* ctx)
+{
+    Job* job = static_cast<Job*>(ctx);
+    auto& vfs = Vfs::GetInstance();
+
+    for (ulong i = 0; i < Lookups; i++)
+    {
+        ulong idx = (job->Start + i) % (2 * Files);
+        VNode::Type type;
+        ulong size;
+        bool found = vfs.Stat(job->Paths + idx * Vfs::MaxPath, type, size);
+        if (found != (idx < Files))
+            job->Errors++;
+    }
+}
+
+void VfsBench::StressFunc(void* ctx)
+{
+    Job* job = static_cast<Job*>(ctx);
+    auto& vfs = Vfs::GetInstance();
+    const char* shared = job->Paths + StressShared * Vfs::MaxPath;
+    const char* created = job->Paths + StressCreated * Vfs::MaxPath;
+    u8 buf[StressIoSize];
+
+    for (ulong i = 0; i < StressOps; i++)
+    {
+        const char* file = job->Paths + ((job->Start + i / 8) % StressFiles) * Vfs::MaxPath;
+        ulong offset = ((i / 8) * StressIoSize) % StressFileSize;
+        VNode::Type type;
+        ulong size;
+        bool ok;
+        switch (i % 8)
+        {
+        case 0:
+        case 1:
+            ok = vfs.Stat(file, type, size);
+            break;
+        case 2:
+            ok = vfs.ReadFileAt(file, buf, sizeof(buf), offset);
+            break;
+        case 3:
+            ok = vfs.ReadFileAt(shared, buf, sizeof(buf), offset);
+            break;
+        case 4:
+            ok = vfs.WriteFileAt(file, buf, sizeof(buf), offset);
+            break;
+        case 5:
+            ok = !vfs.Stat(job->Paths + StressMissing * Vfs::MaxPath, type, size);
+            break;
+        case 6:
+            ok = vfs.CreateFile(created);
+            break;
+        default:
+            ok = vfs.Remove(created);
+            break;
+        }
+        if (!ok)
+            job->Errors++;
+    }
+}
+
+/* The jobs run as tasks spread over the running CPUs; one job runs
+   inline */
+bool VfsBench::RunPhase(void (*func)(void* ctx), Job* jobs, ulong tasks,
+                        u64& elapsedNs, ulong& errors)
+{
+    Stdlib::Time start = GetBootTime();
+    if (tasks == 1)
+    {
+        func(&jobs[0]);
+        elapsedNs = (GetBootTime() - start).GetValue();
+        errors += jobs[0].Errors;
+        return true;
+    }
+
+    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus();
+    ulong cpuIds[MaxTasks];
+    ulong cpus = 0;
+    for (ulong i = 0; i < 8 * sizeof(ulong) && cpus < tasks; i++)
+    {
+        if (cpuMask & (1UL << i))
+            cpuIds[cpus++] = i;
+    }
+    if (cpus == 0)
+        return false;
+
+    Task* taskObjs[MaxTasks] = {};
+    for (ulong i = 0; i < tasks; i++)
+    {
+        taskObjs[i] = Mm::TAlloc<Task, Tag>("vfsbench/%u", i);
+        if (taskObjs[i] == nullptr)
+            break;
+        taskObjs[i]->SetCpuAffinity(1UL << cpuIds[i % cpus]);
+    }
+
+    bool ok = true;
+    ulong started = 0;
+    start = GetBootTime();
+    for (ulong i = 0; i < tasks; i++)
+    {
+        if (taskObjs[i] == nullptr || !taskObjs[i]->Start(func, &jobs[i]))
+        {
+            ok = false;
+            break;
+        }
+        started++;
+    }
+    for (ulong i = 0; i < started; i++)
+        taskObjs[i]->Wait();
+    elapsedNs = (GetBootTime() - start).GetValue();
+
+    for (ulong i = 0; i < tasks; i++)
+    {
+        if (taskObjs[i] != nullptr)
+            taskObjs[i]->Put();
+        if (i < started)
+            errors += jobs[i].Errors;
+    }
+    return ok;
+}
+
+bool VfsBench::RunLookup(const char* dir, ulong depth, ulong tasks, Stdlib::Printer& printer)
+{
+    if (depth == 0 || depth > MaxDepth || tasks == 0 || tasks > MaxTasks)
+        return false;
+
+    /* ".vfsbench", "/dN" per level and "/fN" must fit */
+    char scratch[Vfs::MaxPath];
+    ulong dirLen = Stdlib::StrLen(dir);
+    if (dirLen == 0 || dirLen + 16 + 4 * depth + 8 >= sizeof(scratch))
+        return false;
+    Stdlib::SnPrintf(scratch, sizeof(scratch), "%s%s.vfsbench", dir,
+                     (dir[dirLen - 1] == '/') ? "" : "/");
+
+    auto& vfs = Vfs::GetInstance();
+    if (!vfs.CreateDir(scratch))
+    {
+        printer.Printf("cannot create %s\n", scratch);
+        return false;
+    }
+
+    char* paths = static_cast<char*>(Mm::Alloc(2 * Files * Vfs::MaxPath, 0));
+    bool ok = (paths != nullptr);
+
+    char deep[Vfs::MaxPath];
+    Stdlib::StrnCpy(deep, scratch, sizeof(deep));
+    for (ulong i = 0; i < depth && ok; i++)
+    {
+        ulong len = Stdlib::StrLen(deep);
+        Stdlib::SnPrintf(deep + len, sizeof(deep) - len, "/d%u", i);
+        ok = vfs.CreateDir(deep);
+    }
+    for (ulong i = 0; i < Files && ok; i++)
+    {
+        char* path = paths + i * Vfs::MaxPath;
+        Stdlib::SnPrintf(path, Vfs::MaxPath, "%s/f%u", deep, i);
+        ok = vfs.CreateFile(path);
+        Stdlib::SnPrintf(paths + (Files + i) * Vfs::MaxPath, Vfs::MaxPath, "%s/n%u", deep, i);
+    }
+    if (!ok)
+        printer.Printf("cannot create the scratch tree in %s\n", scratch);
+
+    auto& dcache = DentryCache::GetInstance();
+    bool enabled = dcache.IsEnabled();
+    if (ok)
+    {
+        printer.Printf("%u components per path, half of the paths missing\n", depth + 2);
+        PrintHeader(printer);
+    }
+    for (ulong pass = 0; pass < 2 && ok; pass++)
+    {
+        dcache.SetEnabled(pass == 0);
+
+        ulong count = 1;
+        for (;;)
+        {
+            Result result;
+            result.Cached = (pass == 0);
+            result.Tasks = count;
+            result.Lookups = count * Lookups;
+            result.ElapsedNs = 0;
+            result.Errors = 0;
+
+            Job jobs[MaxTasks];
+            for (ulong i = 0; i < count; i++)
+            {
+                jobs[i].Paths = paths;
+                jobs[i].Start = i;
+                jobs[i].Errors = 0;
+            }
+            ok = RunPhase(&VfsBench::LookupFunc, jobs, count, result.ElapsedNs, result.Errors);
+            if (!ok)
+                break;
+            Print(result, printer);
+
+            if (count == tasks)
+                break;
+            count = (2 * count < tasks) ? 2 * count : tasks;
+        }
+    }
+    dcache.SetEnabled(enabled);
+
+    vfs.Remove(scratch);
+    if (paths != nullptr)
+        Mm::Free(paths);
+    return ok;
+}
+
+bool VfsBench::WriteScratchFile(const char* path)
+{
+    u8 data[StressIoSize];
+    Stdlib::MemSet(data, 0x5A, sizeof(data));
+    for (ulong offset = 0; offset < StressFileSize; offset += sizeof(data))
+    {
+        if (!Vfs::GetInstance().WriteFileAt(path, data, sizeof(data), offset))
+            return false;
+    }
+    return true;
+}
+
+bool VfsBench::RunStress(const char* const* dirs, ulong dirCount, ulong tasks, Stdlib::Printer& printer)
+{
+    if (dirCount == 0 || dirCount > MaxStressDirs || tasks == 0 || tasks > MaxTasks)
+        return false;
+
+    /* "/.vfsstress/t7/f7" and the like must fit */
+    char scratch[MaxStressDirs][Vfs::MaxPath];
+    for (ulong i = 0; i < dirCount; i++)
+    {
+        ulong dirLen = Stdlib::StrLen(dirs[i]);
+        if (dirLen == 0 || dirLen + 32 >= Vfs::MaxPath)
+            return false;
+        Stdlib::SnPrintf(scratch[i], Vfs::MaxPath, "%s%s.vfsstress", dirs[i],
+                         (dirs[i][dirLen - 1] == '/') ? "" : "/");
+    }
+
+    auto& vfs = Vfs::GetInstance();
+    ulong created = 0;
+    bool ok = true;
+    for (ulong i = 0; i < dirCount && ok; i++)
+    {
+        char shared[Vfs::MaxPath];
+        Stdlib::SnPrintf(shared, sizeof(shared), "%s/shared", scratch[i]);
+        ok = vfs.CreateDir(scratch[i]);
+        if (ok)
+        {
+            created++;
+            ok = WriteScratchFile(shared);
+        }
+        if (!ok)
+            printer.Printf("cannot create %s\n", scratch[i]);
+    }
+
+    char* paths = static_cast<char*>(Mm::Alloc(tasks * StressPaths * Vfs::MaxPath, 0));
+    ok = ok && (paths != nullptr);
+    for (ulong i = 0; i < tasks && ok; i++)
+    {
+        const char* dir = scratch[i % dirCount];
+        char* taskPaths = paths + i * StressPaths * Vfs::MaxPath;
+        char taskDir[Vfs::MaxPath];
+        Stdlib::SnPrintf(taskDir, sizeof(taskDir), "%s/t%u", dir, i);
+        ok = vfs.CreateDir(taskDir);
+        for (ulong j = 0; j < StressFiles && ok; j++)
+        {
+            Stdlib::SnPrintf(taskPaths + j * Vfs::MaxPath, Vfs::MaxPath, "%s/f%u", taskDir, j);
+            ok = WriteScratchFile(taskPaths + j * Vfs::MaxPath);
+        }
+        Stdlib::SnPrintf(taskPaths + StressMissing * Vfs::MaxPath, Vfs::MaxPath, "%s/n", taskDir);
+        Stdlib::SnPrintf(taskPaths + StressCreated * Vfs::MaxPath, Vfs::MaxPath, "%s/x", taskDir);
+        Stdlib::SnPrintf(taskPaths + StressShared * Vfs::MaxPath, Vfs::MaxPath, "%s/shared", dir);
+        if (!ok)
+            printer.Printf("cannot create the files of %s\n", taskDir);
+    }
+
+    if (ok)
+    {
+        printer.Printf("%u ops per task: 2 stats, 2 reads (one shared), 1 write, 1 missing stat, 1 create, 1 remove in 8\n",
+            StressOps);
+        PrintStressHeader(printer);
+    }
+    ulong count = 1;
+    while (ok)
+    {
+        StressResult result;
+        result.Tasks = count;
+        result.Ops = count * StressOps;
+        result.ElapsedNs = 0;
+        result.Errors = 0;
+
+        Job jobs[MaxTasks];
+        for (ulong i = 0; i < count; i++)
+        {
+            jobs[i].Paths = paths + i * StressPaths * Vfs::MaxPath;
+            jobs[i].Start = i;
+            jobs[i].Errors = 0;
+        }
+        ok = RunPhase(&VfsBench::StressFunc, jobs, count, result.ElapsedNs, result.Errors);
+        if (!ok)
+            break;
+        PrintStress(result, printer);
+
+        if (count == tasks)
+            break;
+        count = (2 * count < tasks) ? 2 * count : tasks;
+    }
+
+    for (ulong i = 0; i < created; i++)
+        vfs.Remove(scratch[i]);
+    if (paths != nullptr)
+        Mm::Free(paths);
+    return ok;
+}
+
+void VfsBench::PrintHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%8s %6s %10s %12s %10s %6s\n",
+        "dcache", "tasks", "lookups", "lookups/s", "ns/lookup", "errors");
+}
+
+void VfsBench::Print(const Result& result, Stdlib::Printer& printer)
+{
+    u64 us = result.ElapsedNs / Const::NanoSecsInUsec;
+    if (us == 0)
+        us = 1;
+
+    /* Per lookup as one task sees it */
+    ulong perTask = result.Lookups / result.Tasks;
+    printer.Printf("%8s %6u %10u %12u %10u %6u\n",
+        result.Cached ? "on" : "off",
+        result.Tasks,
+        result.Lookups,
+        (u64)result.Lookups * 1000000 / us,
+        (perTask != 0) ? result.ElapsedNs / perTask : 0,
+        result.Errors);
+}
+
+void VfsBench::PrintStressHeader(Stdlib::Printer& printer)
+{
+    printer.Printf("%6s %10s %12s %10s %6s\n",
+        "tasks", "ops", "ops/s", "ns/op", "errors");
+}
+
+void VfsBench::PrintStress(const StressResult& result, Stdlib::Printer& printer)
+{
+    u64 us = result.ElapsedNs / Const::NanoSecsInUsec;
+    if (us == 0)
+        us = 1;
+
+    /* Per operation as one task sees it */
+    ulong perTask = result.Ops / result.Tasks;
+    printer.Printf("%6u %10u %12u %10u %6u\n",
+        result.Tasks,
+        result.Ops,
+        (u64)result.Ops * 1000000 / us,
+        (perTask != 0) ? result.ElapsedNs / perTask : 0,
+        result.Errors);
+}
+
+}
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <include/types.h>
+#include <lib/printer.h>
+
+namespace Kernel
+{
+
+/* VFS benchmarks, run for 1, 2, 4 ... up to Tasks tasks.
+
+   Lookup: a chain of Depth directories is created in a scratch
+   directory under Dir, with Files files in the deepest one.  Tasks then
+   resolve the full paths of those files and of as many names that do
+   not exist (negative lookups), Lookups times each, once with the
+   dentry cache and once with it bypassed so that every component goes
+   through FileSystem::Lookup.
+
+   Stress: task i works in a directory of its own in a scratch directory
+   under Dirs[i % DirCount], so tasks on different mounts or in
+   different directories contend only where the VFS makes them.  Each
+   runs StressOps operations cycling through stats of its files and of a
+   missing name, reads of its files and of a file all tasks of that
+   scratch directory share, writes into its files and the create and
+   remove of a file.
+
+   The scratch trees are removed afterwards. */
+class VfsBench
+{
+public:
+    struct Result
+    {
+        bool Cached;
+        ulong Tasks;
+        ulong Lookups;
+        u64 ElapsedNs;
+        ulong Errors;
+    };
+
+    struct StressResult
+    {
+        ulong Tasks;
+        ulong Ops;
+        u64 ElapsedNs;
+        ulong Errors;
+    };
+
+    static bool RunLookup(const char* dir, ulong depth, ulong tasks, Stdlib::Printer& printer);
+    static bool RunStress(const char* const* dirs, ulong dirCount, ulong tasks, Stdlib::Printer& printer);
+
+    static void PrintHeader(Stdlib::Printer& printer);
+    static void Print(const Result& result, Stdlib::Printer& printer);
+    static void PrintStressHeader(Stdlib::Printer& printer);
+    static void PrintStress(const StressResult& result, Stdlib::Printer& printer);
+
+    static const ulong MaxDepth = 16;
+    static const ulong MaxTasks = 8;
+    static const ulong Files = 16;
+    static const ulong Lookups = 20000;     /* per task */
+    static const ulong MaxStressDirs = 4;
+    static const ulong StressFiles = 8;     /* per task */
+    static const ulong StressFileSize = 4096;
+    static const ulong StressIoSize = 512;
+    static const ulong StressOps = 2000;    /* per task */
+    static const ulong Tag = 'VBch';
+
+private:
+    VfsBench() = delete;
+    VfsBench(const VfsBench& other) = delete;
+    VfsBench(VfsBench&& other) = delete;
+    VfsBench& operator=(const VfsBench& other) = delete;
+    VfsBench& operator=(VfsBench&& other) = delete;
+
+    /* Stress paths of a task: its StressFiles files, a missing name,
+       the file it creates and removes and the shared file */
+    static const ulong StressMissing = StressFiles;
+    static const ulong StressCreated = StressFiles + 1;
+    static const ulong StressShared = StressFiles + 2;
+    static const ulong StressPaths = StressFiles + 3;
+
+    struct Job
+    {
+        const char* Paths;      /* lookup: Files existing, then Files missing;
+                                   stress: StressPaths of the task */
+        ulong Start;
+        ulong Errors;
+    };
+
+    static void LookupFunc(void* ctx);
+    static void StressFunc(void* ctx);
+    static bool RunPhase(void (*func)(void* ctx), Job* jobs, ulong tasks,
+                         u64& elapsedNs, ulong& errors);
+    static bool WriteScratchFile(const char* path);
+};
+
+}
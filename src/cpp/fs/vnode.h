@@ -2,10 +2,15 @@
 
 #include <include/types.h>
 #include <lib/list_entry.h>
+#include <fs/readahead.h>
+#include <fs/dir_index.h>
+#include <kernel/rw_mutex.h>
 
 namespace Kernel
 {
 
+class FileSystem;
+
 struct VNode
 {
     enum Type { TypeDir, TypeFile };
@@ -15,11 +20,41 @@ struct VNode
     VNode* Parent;
     Stdlib::ListEntry Children;   // head of child list (for dirs)
     Stdlib::ListEntry SiblingLink; // link in parent's Children list
+    DirIndex Index;               // Children by name (for dirs); see DirIndex
+    VNode* NameNext;              // chain in the parent's Index
+
+    // Dirs of file systems that populate Children on first use (see
+    // FileSystem::LoadDir): set once they hold every entry
+    bool Loaded;
+    Stdlib::ListEntry LruLink;    // loaded dirs of a VNodeCache, oldest first
+    VNode* HashNext;              // VNodeCache chain
+
+    // Key of this dir's entries in the DentryCache, 0 until it has any
+    u64 DentryId;
+
+    // File system mounted on this dir (Vfs::Mount), nullptr if none
+    FileSystem* MountedFs;
 
     // File data (only for TypeFile)
     u8* Data;
     ulong Size;
     ulong Capacity;
+
+    // Sequential readahead window (block-backed file systems)
+    ReadaheadState Ra;
+
+    // Extent maps handed out by Vfs::MapFile (loop devices); while
+    // nonzero the file cannot be rewritten or removed
+    ulong MapCount;
+
+    // Descriptors open on the file (Vfs::Open); while nonzero it cannot
+    // be removed or evicted
+    ulong OpenCount;
+
+    // Taken by the Vfs (see the lock order in vfs.h): dirs shared to
+    // look names up or list, exclusive to add or drop entries; files
+    // shared to read, exclusive to write.  Unlocked when cleared.
+    RwMutex Lock;
 };
 
 }
@@ -0,0 +1,266 @@
+#include "vnode_cache.h"
+
+#include <lib/stdlib.h>
+#include <mm/new.h>
+#include <mm/page_table.h>
+#include <kernel/trace.h>
+
+namespace Kernel
+{
+
+VNodeCache::VNodeCache()
+    : Buckets(nullptr)
+    , BucketCount(0)
+    , Count(0)
+{
+    Lru.Init();
+}
+
+VNodeCache::~VNodeCache()
+{
+    Clear();
+}
+
+ulong VNodeCache::Hash(ulong ino, ulong buckets)
+{
+    return ino & (buckets - 1);
+}
+
+/* Twice as many buckets once the chains average two; if that allocation
+   fails the chains just get longer */
+void VNodeCache::Grow()
+{
+    ulong count = (BucketCount != 0) ? 2 * BucketCount : InitialBuckets;
+    VNode** buckets = static_cast<VNode**>(Mm::Alloc(count * sizeof(VNode*), 0));
+    if (buckets == nullptr)
+    {
+        if (BucketCount == 0)
+            Trace(0, "VNodeCache: alloc %u buckets failed", count);
+        return;
+    }
+    Stdlib::MemSet(buckets, 0, count * sizeof(VNode*));
+
+    for (ulong i = 0; i < BucketCount; i++)
+    {
+        VNode* node = Buckets[i];
+        while (node != nullptr)
+        {
+            VNode* next = node->HashNext;
+            ulong b = Hash(node->Capacity, count);
+            node->HashNext = buckets[b];
+            buckets[b] = node;
+            node = next;
+        }
+    }
+
+    if (Buckets != nullptr)
+        Mm::Free(Buckets);
+    Buckets = buckets;
+    BucketCount = count;
+}
+
+VNode* VNodeCache::Create(ulong ino, VNode::Type type)
+{
+    if (BucketCount == 0 || Count >= 2 * BucketCount)
+        Grow();
+    if (BucketCount == 0)
+        return nullptr;
+
+    VNode* node = new (Mm::NoThrow) VNode();
+    if (node == nullptr)
+    {
+        Trace(0, "VNodeCache: alloc vnode failed for inode %u", ino);
+        return nullptr;
+    }
+
+    Stdlib::MemSet(node, 0, sizeof(VNode));
+    node->NodeType = type;
+    node->Parent = nullptr;
+    node->Children.Init();
+    node->SiblingLink.Init();
+    node->LruLink.Init();
+    node->Data = nullptr;
+    node->Size = 0;
+    node->Capacity = ino;
+
+    ulong b = Hash(ino, BucketCount);
+    node->HashNext = Buckets[b];
+    Buckets[b] = node;
+    Count++;
+    return node;
+}
+
+VNode* VNodeCache::Find(ulong ino)
+{
+    if (BucketCount == 0)
+        return nullptr;
+
+    for (VNode* node = Buckets[Hash(ino, BucketCount)]; node != nullptr; node = node->HashNext)
+    {
+        if (node->Capacity == ino)
+            return node;
+    }
+    return nullptr;
+}
+
+void VNodeCache::Unhash(VNode* node)
+{
+    VNode** link = &Buckets[Hash(node->Capacity, BucketCount)];
+    while (*link != nullptr)
+    {
+        if (*link == node)
+        {
+            *link = node->HashNext;
+            node->HashNext = nullptr;
+            Count--;
+            return;
+        }
+        link = &(*link)->HashNext;
+    }
+}
+
+void VNodeCache::Free(VNode* node)
+{
+    if (node == nullptr)
+        return;
+
+    Unhash(node);
+    node->LruLink.RemoveInit();
+    DirIndex::Unlink(node);
+    delete node;
+}
+
+void VNodeCache::Clear()
+{
+    for (ulong i = 0; i < BucketCount; i++)
+    {
+        VNode* node = Buckets[i];
+        while (node != nullptr)
+        {
+            VNode* next = node->HashNext;
+            delete node;
+            node = next;
+        }
+    }
+
+    if (Buckets != nullptr)
+        Mm::Free(Buckets);
+    Buckets = nullptr;
+    BucketCount = 0;
+    Count = 0;
+    Lru.Init();
+}
+
+void VNodeCache::SetLoaded(VNode* dir)
+{
+    dir->Loaded = true;
+    Touch(dir);
+}
+
+void VNodeCache::Touch(VNode* dir)
+{
+    if (!dir->Loaded)
+        return;
+
+    dir->LruLink.RemoveInit();
+    Lru.InsertTail(&dir->LruLink);
+}
+
+bool VNodeCache::CanUnload(VNode* dir, VNode* keep)
+{
+    for (VNode* node = keep; node != nullptr; node = node->Parent)
+    {
+        if (node == dir)
+            return false;
+    }
+
+    for (Stdlib::ListEntry* e = dir->Children.Flink; e != &dir->Children; e = e->Flink)
+    {
+        VNode* child = CONTAINING_RECORD(e, VNode, SiblingLink);
+        if (child->MapCount != 0 || child->OpenCount != 0 || child->MountedFs != nullptr)
+            return false;
+        if (child->NodeType == VNode::TypeDir && child->Loaded)
+            return false;
+
+        /* An operation is past dir and holds the child */
+        if (!child->Lock.TryWriteLock())
+            return false;
+        child->Lock.WriteUnlock();
+    }
+    return true;
+}
+
+ulong VNodeCache::Unload(VNode* dir)
+{
+    ulong freed = 0;
+    while (!dir->Children.IsEmpty())
+    {
+        VNode* child = CONTAINING_RECORD(dir->Children.RemoveHead(), VNode, SiblingLink);
+        child->SiblingLink.Init();
+        Free(child);
+        freed++;
+    }
+    dir->Index.Release();
+
+    dir->Loaded = false;
+    dir->LruLink.RemoveInit();
+    return freed;
+}
+
+/* Unloading a dir can make its parent unloadable, which may sit earlier
+   in the list: pass again while that frees something */
+ulong VNodeCache::Shrink(VNode* keep, ulong target)
+{
+    ulong freed = 0;
+    bool progress = true;
+    while (freed < target && progress)
+    {
+        progress = false;
+        Stdlib::ListEntry* e = Lru.Flink;
+        while (e != &Lru && freed < target)
+        {
+            Stdlib::ListEntry* next = e->Flink;
+            VNode* dir = CONTAINING_RECORD(e, VNode, LruLink);
+
+            /* Walks looking into dir hold it; nobody gets to its
+               children past the exclusive lock */
+            if (dir->Lock.TryWriteLock())
+            {
+                if (CanUnload(dir, keep))
+                {
+                    freed += Unload(dir);
+                    progress = true;
+                }
+                dir->Lock.WriteUnlock();
+            }
+            e = next;
+        }
+    }
+    return freed;
+}
+
+void VNodeCache::ShrinkIfLow(VNode* keep)
+{
+    Mm::PageTable& pt = Mm::PageTable::GetInstance();
+    if (pt.GetFreePagesCount() >= pt.GetTotalPagesCount() / LowMemoryDivisor)
+        return;
+
+    ulong before = Count;
+    ulong freed = Shrink(keep, Count / 4 + 1);
+    Trace(0, "VNodeCache: low memory, freed %u of %u vnodes", freed, before);
+}
+
+ulong VNodeCache::GetCount()
+{
+    return Count;
+}
+
+u32 VNodeCache::GetDepth(VNode* node)
+{
+    u32 depth = 0;
+    for (VNode* p = node->Parent; p != nullptr; p = p->Parent)
+        depth++;
+    return depth;
+}
+
+}
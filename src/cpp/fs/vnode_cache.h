@@ -0,0 +1,83 @@
+#pragma once
+
+#include <include/types.h>
+#include <fs/vnode.h>
+
+namespace Kernel
+{
+
+/* The VNodes of a block-backed file system, by inode number (kept in
+   VNode::Capacity).
+
+   Directories are populated on first use, so only the part of the tree
+   that was looked at is in memory.  Populated directories sit on an LRU
+   list; when free memory runs low Shrink() drops the children of the
+   least recently used ones again, which the next LoadDir re-reads.  The
+   hash table grows with the number of VNodes: there is no fixed cap.
+   Callers serialize access (the mount's lock, see vfs.h); Shrink skips
+   dirs and children some operation holds the VNode lock of. */
+class VNodeCache
+{
+public:
+    VNodeCache();
+    ~VNodeCache();
+
+    /* A cleared VNode for inode ino, in the cache; nullptr if out of
+       memory.  Unlinked: the caller names it and links it into its
+       parent. */
+    VNode* Create(ulong ino, VNode::Type type);
+
+    VNode* Find(ulong ino);
+
+    /* Take node out of the cache, unlink it from its parent and free
+       it.  Its children must be gone already. */
+    void Free(VNode* node);
+
+    /* Free every VNode (unmount). */
+    void Clear();
+
+    /* dir now holds every entry: it becomes the most recently used. */
+    void SetLoaded(VNode* dir);
+    void Touch(VNode* dir);
+
+    /* Unload least recently used directories until at least target
+       VNodes are freed or none is left that can go.  keep and its
+       ancestors stay: the caller is walking that path.  So do dirs with
+       a loaded subdirectory (unloaded bottom up, every cached VNode
+       keeps its parent chain) and the parents of mapped or open files
+       and of mount points, and dirs or children locked by others.
+       Returns the number of VNodes freed. */
+    ulong Shrink(VNode* keep, ulong target);
+
+    /* Shrink by a quarter if free memory is low. */
+    void ShrinkIfLow(VNode* keep);
+
+    ulong GetCount();
+
+    /* Directory levels between node and the root. */
+    static u32 GetDepth(VNode* node);
+
+    /* Free pages below 1/LowMemoryDivisor of all pages */
+    static const ulong LowMemoryDivisor = 16;
+
+private:
+    VNodeCache(const VNodeCache& other) = delete;
+    VNodeCache(VNodeCache&& other) = delete;
+    VNodeCache& operator=(const VNodeCache& other) = delete;
+    VNodeCache& operator=(VNodeCache&& other) = delete;
+
+    static const ulong InitialBuckets = 256;
+
+    static ulong Hash(ulong ino, ulong buckets);
+    void Grow();
+    void Unhash(VNode* node);
+    bool CanUnload(VNode* dir, VNode* keep);
+    ulong Unload(VNode* dir);
+
+    VNode** Buckets;
+    ulong BucketCount;
+    ulong Count;
+    Stdlib::ListEntry Lru;
+};
+
+}
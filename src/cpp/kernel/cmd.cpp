@@ -9,6 +9,14 @@
 #include "watchdog.h"
 #include <block/block_device.h>
 #include <block/partition.h>
+#include <block/raid.h>
+#include <block/block_stats.h>
+#include <block/ramdisk.h>
+#include <block/loop.h>
+#include <block/block_bench.h>
+#include <block/block_trace.h>
+#include <block/block_completion.h>
+#include <block/block_qos.h>
 #include "parameters.h"
 #include <net/net_device.h>
 #include <net/net.h>
@@ -19,8 +27,11 @@
 #include <net/tcp.h>
 #include <net/http.h>
 #include <fs/vfs.h>
+#include <fs/fs_bench.h>
+#include <fs/vfs_bench.h>
 #include <fs/ramfs.h>
 #include <fs/nanofs.h>
+#include <fs/buffer_cache.h>
 #include "entropy.h"
 #include "console.h"
 #include "mutex.h"
@@ -185,6 +196,10 @@ static void CmdMemusage(const char* args, Stdlib::Printer& con)
 
     con.Printf("freePages: %u\n", pt.GetFreePagesCount());
     con.Printf("totalPages: %u\n", pt.GetTotalPagesCount());
+    con.Printf("bufferCachePages: %u\n",
+        BufferCache::GetInstance().GetCachedBytes() / Const::PageSize);
+    con.Printf("dirtyPages: %u\n",
+        BufferCache::GetInstance().GetDirtyBytes() / Const::PageSize);
 }
 
 static void CmdIrqstat(const char* args, Stdlib::Printer& con)
@@ -397,6 +412,1091 @@ static void CmdDiskwrite(const char* args, Stdlib::Printer& con)
     }
 }
 
+static void CmdBlksteer(const char* args, Stdlib::Printer& con)
+{
+    auto& completion = BlockCompletion::GetInstance();
+
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        completion.Dump(con);
+        return;
+    }
+
+    char buf[8];
+    Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+    if (Stdlib::StrCmp(buf, "on") == 0)
+        completion.SetEnabled(true);
+    else if (Stdlib::StrCmp(buf, "off") == 0)
+        completion.SetEnabled(false);
+    else
+    {
+        con.Printf("usage: blksteer [on|off]\n");
+        return;
+    }
+    con.Printf("completion steering %s\n", buf);
+}
+
+static void CmdBlkpoll(const char* args, Stdlib::Printer& con)
+{
+    auto& table = BlockDeviceTable::GetInstance();
+
+    const char* end;
+    const char* nameStart = Stdlib::NextToken(args, end);
+    if (!nameStart)
+    {
+        for (ulong i = 0; i < table.GetCount(); i++)
+        {
+            BlockDevice* dev = table.GetDevice(i);
+            if (!dev)
+                continue;
+            con.Printf("%s: ", dev->GetName());
+            con.Printf("%s\n", BlockPollState::ModeName(dev->GetPollMode()));
+        }
+        return;
+    }
+
+    char diskName[16];
+    Stdlib::TokenCopy(nameStart, end, diskName, sizeof(diskName));
+
+    BlockDevice* dev = table.Find(diskName);
+    if (!dev)
+    {
+        con.Printf("disk '%s' not found\n", diskName);
+        return;
+    }
+
+    const char* modeStart = Stdlib::NextToken(end, end);
+    if (!modeStart)
+    {
+        con.Printf("%s: %s\n", dev->GetName(),
+            BlockPollState::ModeName(dev->GetPollMode()));
+        dev->DumpPollStats(con);
+        return;
+    }
+
+    char modeBuf[16];
+    Stdlib::TokenCopy(modeStart, end, modeBuf, sizeof(modeBuf));
+
+    BlockPollState::Mode mode;
+    if (!BlockPollState::ParseMode(modeBuf, mode))
+    {
+        con.Printf("usage: blkpoll [disk] [off|poll|hybrid]\n");
+        return;
+    }
+
+    if (!dev->SetPollMode(mode))
+    {
+        con.Printf("%s: poll mode %s not supported\n", dev->GetName(), modeBuf);
+        return;
+    }
+    con.Printf("%s: poll mode %s\n", dev->GetName(), modeBuf);
+}
+
+static void CmdBlkstat(const char* args, Stdlib::Printer& con)
+{
+    auto& table = BlockDeviceTable::GetInstance();
+
+    const char* end;
+    const char* nameStart = Stdlib::NextToken(args, end);
+    if (nameStart)
+    {
+        char diskName[16];
+        Stdlib::TokenCopy(nameStart, end, diskName, sizeof(diskName));
+
+        BlockDevice* dev = table.Find(diskName);
+        if (!dev)
+        {
+            con.Printf("disk '%s' not found\n", diskName);
+            return;
+        }
+        if (!dev->GetIoQueue())
+        {
+            con.Printf("%s: no request queue\n", dev->GetName());
+            return;
+        }
+        con.Printf("%s:\n", dev->GetName());
+        dev->GetIoQueue()->Dump(con);
+        return;
+    }
+
+    /* Partitions share their parent's queue: report each queue once */
+    for (ulong i = 0; i < table.GetCount(); i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        if (!dev || !dev->GetIoQueue())
+            continue;
+
+        bool seen = false;
+        for (ulong j = 0; j < i; j++)
+        {
+            BlockDevice* other = table.GetDevice(j);
+            if (other && other->GetIoQueue() == dev->GetIoQueue())
+            {
+                seen = true;
+                break;
+            }
+        }
+        if (seen)
+            continue;
+
+        con.Printf("%s:\n", dev->GetName());
+        dev->GetIoQueue()->Dump(con);
+    }
+}
+
+static void CmdIostat(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: iostat [interval_sec [count]]\n";
+    ulong values[2] = { 0, 5 };     /* interval, count */
+    ulong valueCount = 0;
+
+    const char* end = args;
+    const char* tok;
+    while ((tok = Stdlib::NextToken(end, end)) != nullptr)
+    {
+        char buf[16];
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (valueCount == 2 || !Stdlib::ParseUlong(buf, values[valueCount]))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        valueCount++;
+    }
+
+    if (values[0] == 0)
+    {
+        BlockStats::DumpAll(con);
+        BlockQos::DumpAll(con);
+        return;
+    }
+
+    auto& table = BlockDeviceTable::GetInstance();
+    ulong devCount = table.GetCount();
+    BlockStats::Snapshot* prev = new (Mm::NoThrow) BlockStats::Snapshot[devCount];
+    BlockStats::Snapshot* cur = new (Mm::NoThrow) BlockStats::Snapshot;
+    BlockQos::Snapshot* qosPrev = new (Mm::NoThrow) BlockQos::Snapshot[devCount];
+    BlockQos::Snapshot* qosCur = new (Mm::NoThrow) BlockQos::Snapshot;
+    IoQueue** queues = new (Mm::NoThrow) IoQueue*[devCount];
+    if (prev == nullptr || cur == nullptr || qosPrev == nullptr || qosCur == nullptr ||
+        queues == nullptr)
+    {
+        delete[] queues;
+        delete qosCur;
+        delete[] qosPrev;
+        delete cur;
+        delete[] prev;
+        con.Printf("alloc failed\n");
+        return;
+    }
+
+    for (ulong i = 0; i < devCount; i++)
+    {
+        BlockDevice* dev = table.GetDevice(i);
+        if (dev && dev->GetStats())
+            dev->GetStats()->Read(prev[i]);
+
+        /* Per-class rows once per request queue: partitions share
+           their disk's queue */
+        queues[i] = dev ? dev->GetIoQueue() : nullptr;
+        for (ulong j = 0; j < i && queues[i] != nullptr; j++)
+        {
+            if (queues[j] == queues[i])
+                queues[i] = nullptr;
+        }
+        if (queues[i] != nullptr)
+            queues[i]->GetQos().Read(qosPrev[i]);
+    }
+
+    for (ulong n = 0; n < values[1]; n++)
+    {
+        Sleep(values[0] * Const::NanoSecsInSec);
+
+        BlockStats::PrintHeader(con);
+        for (ulong i = 0; i < devCount; i++)
+        {
+            BlockDevice* dev = table.GetDevice(i);
+            if (!dev || !dev->GetStats())
+                continue;
+
+            dev->GetStats()->Read(*cur);
+            BlockStats::Print(dev->GetName(), *cur, &prev[i], con);
+            prev[i] = *cur;
+        }
+
+        BlockQos::PrintHeader(con);
+        for (ulong i = 0; i < devCount; i++)
+        {
+            if (queues[i] == nullptr)
+                continue;
+
+            queues[i]->GetQos().Read(*qosCur);
+            BlockQos::Print(table.GetDevice(i)->GetName(), *qosCur, &qosPrev[i], con);
+            qosPrev[i] = *qosCur;
+        }
+    }
+
+    delete[] queues;
+    delete qosCur;
+    delete[] qosPrev;
+    delete cur;
+    delete[] prev;
+}
+
+static void CmdBlksched(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* nameStart = Stdlib::NextToken(args, end);
+    if (!nameStart)
+    {
+        con.Printf("usage: blksched <disk> [none|noop|deadline]\n");
+        return;
+    }
+
+    char diskName[16];
+    Stdlib::TokenCopy(nameStart, end, diskName, sizeof(diskName));
+
+    BlockDevice* dev = BlockDeviceTable::GetInstance().Find(diskName);
+    if (!dev)
+    {
+        con.Printf("disk '%s' not found\n", diskName);
+        return;
+    }
+
+    IoQueue* queue = dev->GetIoQueue();
+    if (!queue)
+    {
+        con.Printf("%s: no request queue\n", dev->GetName());
+        return;
+    }
+
+    const char* schedStart = Stdlib::NextToken(end, end);
+    if (!schedStart)
+    {
+        con.Printf("%s: %s\n", dev->GetName(), queue->GetSchedulerName());
+        return;
+    }
+
+    char schedName[16];
+    Stdlib::TokenCopy(schedStart, end, schedName, sizeof(schedName));
+
+    if (!queue->SetScheduler(schedName))
+    {
+        con.Printf("unknown scheduler '%s'\n", schedName);
+        return;
+    }
+    con.Printf("%s: scheduler %s\n", dev->GetName(), queue->GetSchedulerName());
+}
+
+static void CmdBlkqos(const char* args, Stdlib::Printer& con)
+{
+    const char* usage =
+        "usage: blkqos <disk> [on|off | target <us> | <fg|default|bg> iops|kbps|weight <n>]\n";
+
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    char diskName[16];
+    Stdlib::TokenCopy(tok, end, diskName, sizeof(diskName));
+
+    BlockDevice* dev = BlockDeviceTable::GetInstance().Find(diskName);
+    if (!dev)
+    {
+        con.Printf("disk '%s' not found\n", diskName);
+        return;
+    }
+
+    IoQueue* queue = dev->GetIoQueue();
+    if (!queue)
+    {
+        con.Printf("%s: no request queue\n", dev->GetName());
+        return;
+    }
+
+    BlockQos& qos = queue->GetQos();
+    tok = Stdlib::NextToken(end, end);
+    if (!tok)
+    {
+        qos.Dump(con);
+        return;
+    }
+
+    char words[3][16];
+    ulong wordCount = 0;
+    while (tok != nullptr)
+    {
+        if (wordCount == 3)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, words[wordCount], sizeof(words[wordCount]));
+        wordCount++;
+        tok = Stdlib::NextToken(end, end);
+    }
+
+    BlockRequest::Class cls;
+    ulong value;
+    bool ok;
+    if (wordCount == 1 && Stdlib::StrCmp(words[0], "on") == 0)
+    {
+        queue->SetQosEnabled(true);
+        ok = true;
+    }
+    else if (wordCount == 1 && Stdlib::StrCmp(words[0], "off") == 0)
+    {
+        queue->SetQosEnabled(false);
+        ok = true;
+    }
+    else if (wordCount == 2 && Stdlib::StrCmp(words[0], "target") == 0 &&
+             Stdlib::ParseUlong(words[1], value))
+    {
+        qos.SetLatencyTarget((u64)value * Const::NanoSecsInUsec);
+        ok = true;
+    }
+    else if (wordCount == 3 && BlockQos::ParseClass(words[0], cls) &&
+             Stdlib::ParseUlong(words[2], value))
+    {
+        if (Stdlib::StrCmp(words[1], "iops") == 0)
+            ok = qos.SetIopsLimit(cls, value);
+        else if (Stdlib::StrCmp(words[1], "kbps") == 0)
+            ok = qos.SetKbpsLimit(cls, value);
+        else if (Stdlib::StrCmp(words[1], "weight") == 0)
+            ok = qos.SetWeight(cls, value);
+        else
+            ok = false;
+    }
+    else
+    {
+        ok = false;
+    }
+
+    if (!ok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    /* Setting a limit turns QoS on */
+    if (Stdlib::StrCmp(words[0], "off") != 0 && !qos.GetEnabled())
+        queue->SetQosEnabled(true);
+
+    con.Printf("%s:\n", dev->GetName());
+    qos.Dump(con);
+}
+
+static void CmdIonice(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (tok == nullptr)
+    {
+        con.Printf("usage: ionice <fg|default|bg> <command>\n");
+        return;
+    }
+
+    char className[16];
+    Stdlib::TokenCopy(tok, end, className, sizeof(className));
+    const char* cmd = Stdlib::NextToken(end, end);
+    if (cmd == nullptr)
+    {
+        con.Printf("usage: ionice <fg|default|bg> <command>\n");
+        return;
+    }
+
+    BlockRequest::Class cls;
+    if (!BlockQos::ParseClass(className, cls))
+    {
+        con.Printf("unknown I/O class '%s'\n", className);
+        return;
+    }
+
+    /* Block requests submitted by this task take its class */
+    Task* task = Task::GetCurrentTask();
+    u8 saved = task->IoClass;
+    task->IoClass = cls;
+    Cmd::Dispatch(cmd, con);
+    task->IoClass = saved;
+}
+
+static void CmdBlktrace(const char* args, Stdlib::Printer& con)
+{
+    static const char* usage = "usage: blktrace [<disk> on|off | dump [max] | save <path> | clear]\n";
+    auto& trace = BlockTrace::GetInstance();
+
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        trace.DumpStatus(con);
+        return;
+    }
+
+    char word[64];
+    Stdlib::TokenCopy(tok, end, word, sizeof(word));
+
+    if (Stdlib::StrCmp(word, "dump") == 0)
+    {
+        ulong max = 64;
+        const char* maxStart = Stdlib::NextToken(end, end);
+        if (maxStart)
+        {
+            char num[16];
+            Stdlib::TokenCopy(maxStart, end, num, sizeof(num));
+            if (!Stdlib::ParseUlong(num, max))
+            {
+                con.Printf("%s", usage);
+                return;
+            }
+        }
+        trace.Dump(con, max);
+        return;
+    }
+
+    if (Stdlib::StrCmp(word, "clear") == 0)
+    {
+        trace.Clear();
+        return;
+    }
+
+    if (Stdlib::StrCmp(word, "save") == 0)
+    {
+        const char* pathStart = Stdlib::NextToken(end, end);
+        if (!pathStart)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+
+        char path[128];
+        Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
+
+        ulong events;
+        if (!trace.Save(path, events))
+        {
+            con.Printf("failed to write %s\n", path);
+            return;
+        }
+        con.Printf("%u events written to %s\n", events, path);
+        return;
+    }
+
+    BlockDevice* dev = BlockDeviceTable::GetInstance().Find(word);
+    if (!dev)
+    {
+        con.Printf("disk '%s' not found\n", word);
+        return;
+    }
+
+    const char* modeStart = Stdlib::NextToken(end, end);
+    if (!modeStart)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    char mode[8];
+    Stdlib::TokenCopy(modeStart, end, mode, sizeof(mode));
+
+    bool on;
+    if (Stdlib::StrCmp(mode, "on") == 0)
+        on = true;
+    else if (Stdlib::StrCmp(mode, "off") == 0)
+        on = false;
+    else
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    if (!trace.Enable(dev, on))
+    {
+        con.Printf("%s: tracing not supported\n", dev->GetName());
+        return;
+    }
+    con.Printf("%s: tracing %s\n", dev->GetName(), on ? "on" : "off");
+}
+
+static void CmdRaid(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        RaidDevice::DumpAll(con);
+        return;
+    }
+
+    char word[16];
+    Stdlib::TokenCopy(tok, end, word, sizeof(word));
+    if (Stdlib::StrCmp(word, "create") != 0)
+    {
+        con.Printf("usage: raid [create <name> <raid0|raid1> [chunkKB] <disk> <disk>...]\n");
+        return;
+    }
+
+    char name[16];
+    char levelBuf[16];
+    tok = Stdlib::NextToken(end, end);
+    if (!tok)
+    {
+        con.Printf("usage: raid create <name> <raid0|raid1> [chunkKB] <disk> <disk>...\n");
+        return;
+    }
+    Stdlib::TokenCopy(tok, end, name, sizeof(name));
+
+    tok = Stdlib::NextToken(end, end);
+    RaidDevice::Level level;
+    if (!tok)
+    {
+        con.Printf("usage: raid create <name> <raid0|raid1> [chunkKB] <disk> <disk>...\n");
+        return;
+    }
+    Stdlib::TokenCopy(tok, end, levelBuf, sizeof(levelBuf));
+    if (!RaidDevice::ParseLevel(levelBuf, level))
+    {
+        con.Printf("unknown raid level '%s'\n", levelBuf);
+        return;
+    }
+
+    /* Optional chunk size, then the member disks */
+    char members[RaidDevice::MaxMembers][16];
+    const char* memberNames[RaidDevice::MaxMembers];
+    ulong count = 0;
+    ulong chunkKb = RaidDevice::DefaultChunkKb;
+    bool first = true;
+    while ((tok = Stdlib::NextToken(end, end)) != nullptr)
+    {
+        char buf[16];
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+
+        ulong value;
+        if (first && Stdlib::ParseUlong(buf, value))
+        {
+            chunkKb = value;
+            first = false;
+            continue;
+        }
+        first = false;
+
+        if (count == RaidDevice::MaxMembers)
+        {
+            con.Printf("too many members (max %u)\n", RaidDevice::MaxMembers);
+            return;
+        }
+        Stdlib::StrnCpy(members[count], buf, sizeof(members[count]));
+        memberNames[count] = members[count];
+        count++;
+    }
+
+    RaidDevice* dev = RaidDevice::Create(name, level, chunkKb, memberNames, count);
+    if (!dev)
+    {
+        con.Printf("raid create failed\n");
+        return;
+    }
+    dev->Dump(con);
+}
+
+static void CmdRamdisk(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: ramdisk [create <sizeMB> [latencyUs] | latency <disk> <us>]\n";
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        RamDisk::DumpAll(con);
+        return;
+    }
+
+    char word[16];
+    Stdlib::TokenCopy(tok, end, word, sizeof(word));
+
+    if (Stdlib::StrCmp(word, "create") == 0)
+    {
+        char buf[16];
+        ulong sizeMb = 0;
+        ulong latencyUs = 0;
+
+        tok = Stdlib::NextToken(end, end);
+        if (!tok)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (!Stdlib::ParseUlong(buf, sizeMb))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+
+        tok = Stdlib::NextToken(end, end);
+        if (tok)
+        {
+            Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+            if (!Stdlib::ParseUlong(buf, latencyUs))
+            {
+                con.Printf("%s", usage);
+                return;
+            }
+        }
+
+        RamDisk* disk = RamDisk::Create(sizeMb, latencyUs);
+        if (!disk)
+        {
+            con.Printf("ramdisk create failed (1..%u MB)\n", RamDisk::MaxSizeMb);
+            return;
+        }
+        disk->Dump(con);
+        return;
+    }
+
+    if (Stdlib::StrCmp(word, "latency") == 0)
+    {
+        char diskName[16];
+        char buf[16];
+        ulong us = 0;
+
+        tok = Stdlib::NextToken(end, end);
+        if (!tok)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, diskName, sizeof(diskName));
+
+        tok = Stdlib::NextToken(end, end);
+        if (!tok)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (!Stdlib::ParseUlong(buf, us))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+
+        RamDisk* disk = RamDisk::Find(diskName);
+        if (!disk)
+        {
+            con.Printf("ram disk '%s' not found\n", diskName);
+            return;
+        }
+        disk->SetLatencyUs(us);
+        disk->Dump(con);
+        return;
+    }
+
+    con.Printf("%s", usage);
+}
+
+static void CmdLoop(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: loop [attach <path> [ro] | detach <loopN>]\n";
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        LoopDevice::DumpAll(con);
+        return;
+    }
+
+    char word[16];
+    Stdlib::TokenCopy(tok, end, word, sizeof(word));
+
+    if (Stdlib::StrCmp(word, "attach") == 0)
+    {
+        char path[Vfs::MaxPath];
+        char mode[8];
+        bool readOnly = false;
+
+        tok = Stdlib::NextToken(end, end);
+        if (!tok)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, path, sizeof(path));
+
+        tok = Stdlib::NextToken(end, end);
+        if (tok)
+        {
+            Stdlib::TokenCopy(tok, end, mode, sizeof(mode));
+            if (Stdlib::StrCmp(mode, "ro") != 0)
+            {
+                con.Printf("%s", usage);
+                return;
+            }
+            readOnly = true;
+        }
+
+        LoopDevice* dev = LoopDevice::Attach(path, readOnly);
+        if (!dev && !readOnly)
+        {
+            /* ext2 is mounted read-only and maps files read-only only */
+            dev = LoopDevice::Attach(path, true);
+            if (dev)
+                con.Printf("file system cannot write in place, attached read-only\n");
+        }
+        if (!dev)
+        {
+            con.Printf("loop attach failed\n");
+            return;
+        }
+        dev->Dump(con);
+        return;
+    }
+
+    if (Stdlib::StrCmp(word, "detach") == 0)
+    {
+        char name[16];
+
+        tok = Stdlib::NextToken(end, end);
+        if (!tok)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, name, sizeof(name));
+
+        LoopDevice* dev = LoopDevice::Find(name);
+        if (!dev)
+        {
+            con.Printf("loop device '%s' not found\n", name);
+            return;
+        }
+        if (!dev->Detach())
+            con.Printf("loop detach failed\n");
+        return;
+    }
+
+    con.Printf("%s", usage);
+}
+
+static void CmdBlkbench(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: blkbench <disk> <read|write> [seq|rand] [bsKB] [ops] [depth] [cpus]\n";
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (!tok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    char diskName[16];
+    Stdlib::TokenCopy(tok, end, diskName, sizeof(diskName));
+    BlockDevice* dev = BlockDeviceTable::GetInstance().Find(diskName);
+    if (!dev)
+    {
+        con.Printf("disk '%s' not found\n", diskName);
+        return;
+    }
+
+    char buf[16];
+    tok = Stdlib::NextToken(end, end);
+    if (!tok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+    Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+    bool write;
+    if (Stdlib::StrCmp(buf, "read") == 0)
+        write = false;
+    else if (Stdlib::StrCmp(buf, "write") == 0)
+        write = true;
+    else
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    bool random = false;
+    ulong values[4] = { 64, 1024, 8, 1 };  /* bsKB, ops, depth, cpus */
+    ulong valueCount = 0;
+    while ((tok = Stdlib::NextToken(end, end)) != nullptr)
+    {
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (valueCount == 0 && Stdlib::StrCmp(buf, "rand") == 0)
+            random = true;
+        else if (valueCount == 0 && Stdlib::StrCmp(buf, "seq") == 0)
+            random = false;
+        else if (valueCount < 4 && Stdlib::ParseUlong(buf, values[valueCount]))
+            valueCount++;
+        else
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+    }
+
+    BlockBench::Result result;
+    if (!BlockBench::RunParallel(dev, write, random, values[0] * Const::KB, values[1], values[2],
+                                 values[3], result))
+    {
+        con.Printf("blkbench failed (bs %u..%u KB in whole pages, depth 1..%u, cpus up to the running ones)\n",
+            Const::PageSize / Const::KB, BlockBench::MaxBlockSize / Const::KB,
+            BlockBench::MaxDepth);
+        return;
+    }
+    BlockBench::Print(dev, result, con);
+}
+
+static void CmdFsbench(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: fsbench [dir] [readBytes] [ops]\n"
+                        "       fsbench meta [dir] [files] [tasks]\n";
+    char dir[Vfs::MaxPath];
+    Stdlib::StrnCpy(dir, "/data", sizeof(dir));
+
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    bool meta = false;
+    if (tok)
+    {
+        Stdlib::TokenCopy(tok, end, dir, sizeof(dir));
+        tok = Stdlib::NextToken(end, end);
+    }
+    if (Stdlib::StrCmp(dir, "meta") == 0)
+    {
+        meta = true;
+        Stdlib::StrnCpy(dir, "/data", sizeof(dir));
+        if (tok)
+        {
+            Stdlib::TokenCopy(tok, end, dir, sizeof(dir));
+            tok = Stdlib::NextToken(end, end);
+        }
+    }
+
+    char buf[16];
+    ulong values[2] = { 100, 1000 };    /* readBytes, ops */
+    if (meta)
+    {
+        values[0] = 200;                /* files, tasks */
+        values[1] = 4;
+    }
+    for (ulong i = 0; i < 2 && tok; i++)
+    {
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (!Stdlib::ParseUlong(buf, values[i]))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        tok = Stdlib::NextToken(end, end);
+    }
+    if (tok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    if (meta)
+    {
+        if (!FsBench::RunMeta(dir, values[0], values[1], con))
+            con.Printf("fsbench meta failed (files 1..%u, tasks 1..%u and at most files, writable dir)\n",
+                FsBench::MaxMetaFiles, FsBench::MaxMetaTasks);
+        return;
+    }
+
+    if (!FsBench::RunRead(dir, values[0], values[1], con))
+        con.Printf("fsbench failed (readBytes 1..%u, ops 1..%u, writable dir)\n",
+            FsBench::MaxReadSize, FsBench::MaxOps);
+}
+
+static void CmdVfsbenchStress(const char* args, Stdlib::Printer& con, const char* usage)
+{
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    ulong tasks = 4;
+    char buf[16];
+    if (tok)
+    {
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (!Stdlib::ParseUlong(buf, tasks))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        tok = Stdlib::NextToken(end, end);
+    }
+
+    char dirs[VfsBench::MaxStressDirs][Vfs::MaxPath];
+    const char* dirPtrs[VfsBench::MaxStressDirs];
+    ulong dirCount = 0;
+    for (; tok; tok = Stdlib::NextToken(end, end))
+    {
+        if (dirCount == VfsBench::MaxStressDirs)
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        Stdlib::TokenCopy(tok, end, dirs[dirCount], sizeof(dirs[dirCount]));
+        dirPtrs[dirCount] = dirs[dirCount];
+        dirCount++;
+    }
+    if (dirCount == 0)
+    {
+        Stdlib::StrnCpy(dirs[0], "/", sizeof(dirs[0]));
+        dirPtrs[0] = dirs[0];
+        dirCount = 1;
+    }
+
+    if (!VfsBench::RunStress(dirPtrs, dirCount, tasks, con))
+        con.Printf("vfsbench stress failed (tasks 1..%u, 1..%u distinct writable dirs)\n",
+            VfsBench::MaxTasks, VfsBench::MaxStressDirs);
+}
+
+static void CmdVfsbench(const char* args, Stdlib::Printer& con)
+{
+    const char* usage = "usage: vfsbench [dir] [depth] [tasks]\n"
+                        "       vfsbench stress [tasks] [dir ...]\n";
+    char dir[Vfs::MaxPath];
+    Stdlib::StrnCpy(dir, "/", sizeof(dir));
+
+    const char* end;
+    const char* tok = Stdlib::NextToken(args, end);
+    if (tok)
+    {
+        Stdlib::TokenCopy(tok, end, dir, sizeof(dir));
+        if (Stdlib::StrCmp(dir, "stress") == 0)
+        {
+            CmdVfsbenchStress(end, con, usage);
+            return;
+        }
+        tok = Stdlib::NextToken(end, end);
+    }
+
+    char buf[16];
+    ulong values[2] = { 8, 4 };         /* depth, tasks */
+    for (ulong i = 0; i < 2 && tok; i++)
+    {
+        Stdlib::TokenCopy(tok, end, buf, sizeof(buf));
+        if (!Stdlib::ParseUlong(buf, values[i]))
+        {
+            con.Printf("%s", usage);
+            return;
+        }
+        tok = Stdlib::NextToken(end, end);
+    }
+    if (tok)
+    {
+        con.Printf("%s", usage);
+        return;
+    }
+
+    if (!VfsBench::RunLookup(dir, values[0], values[1], con))
+        con.Printf("vfsbench failed (depth 1..%u, tasks 1..%u, writable dir)\n",
+            VfsBench::MaxDepth, VfsBench::MaxTasks);
+}
+
+static void CmdBcache(const char* args, Stdlib::Printer& con)
+{
+    auto& cache = BufferCache::GetInstance();
+
+    const char* end;
+    const char* opStart = Stdlib::NextToken(args, end);
+    if (!opStart)
+    {
+        cache.Dump(con);
+        return;
+    }
+
+    char op[16];
+    Stdlib::TokenCopy(opStart, end, op, sizeof(op));
+
+    if (Stdlib::StrCmp(op, "drop") == 0)
+    {
+        cache.Invalidate(nullptr);
+        cache.Dump(con);
+        return;
+    }
+
+    if (Stdlib::StrCmp(op, "writeback") == 0)
+    {
+        const char* modeStart = Stdlib::NextToken(end, end);
+        char mode[8];
+        if (modeStart)
+            Stdlib::TokenCopy(modeStart, end, mode, sizeof(mode));
+
+        if (!modeStart || (Stdlib::StrCmp(mode, "on") != 0 && Stdlib::StrCmp(mode, "off") != 0))
+        {
+            con.Printf("usage: bcache writeback <on|off>\n");
+            return;
+        }
+
+        cache.SetWriteback(Stdlib::StrCmp(mode, "on") == 0);
+        cache.Dump(con);
+        return;
+    }
+
+    if (Stdlib::StrCmp(op, "budget") == 0)
+    {
+        const char* sizeStart = Stdlib::NextToken(end, end);
+        char sizeStr[16];
+        ulong kb = 0;
+        if (!sizeStart ||
+            Stdlib::TokenCopy(sizeStart, end, sizeStr, sizeof(sizeStr)) == 0 ||
+            !Stdlib::ParseUlong(sizeStr, kb))
+        {
+            con.Printf("usage: bcache budget <KB>\n");
+            return;
+        }
+
+        cache.SetBudget(kb * Const::KB);
+        cache.Dump(con);
+        return;
+    }
+
+    con.Printf("usage: bcache [drop|budget <KB>|writeback <on|off>]\n");
+}
+
+static void CmdSync(const char* args, Stdlib::Printer& con)
+{
+    (void)args;
+    auto& cache = BufferCache::GetInstance();
+    ulong dirty = cache.GetDirtyBytes();
+
+    if (!Vfs::GetInstance().Sync())
+    {
+        con.Printf("sync failed\n");
+        return;
+    }
+    con.Printf("synced %u KB\n", dirty / Const::KB);
+}
+
+static void CmdFstrim(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* pathStart = Stdlib::NextToken(args, end);
+    if (pathStart == nullptr)
+    {
+        con.Printf("usage: fstrim <path>\n");
+        return;
+    }
+    char path[Vfs::MaxPath];
+    Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
+
+    u64 bytes;
+    if (!Vfs::GetInstance().Trim(path, bytes))
+    {
+        con.Printf("fstrim failed\n");
+        return;
+    }
+    con.Printf("%s: %u KB trimmed\n", path, bytes / Const::KB);
+}
+
 static void CmdNet(const char* args, Stdlib::Printer& con)
 {
     (void)args;
@@ -421,13 +1521,97 @@ static void CmdTcpstat(const char* args, Stdlib::Printer& con)
     Tcp::GetInstance().Dump(con);
 }
 
+/* Writes a wget body to an open file in Vfs::ChunkSize pieces, however
+   the network delivers it */
+class WgetFileSink final : public HttpBodySink
+{
+public:
+    WgetFileSink(ulong fd, u8* buf)
+        : Fd(fd)
+        , Buf(buf)
+        , Len(0)
+    {
+    }
+
+    virtual bool Write(const u8* data, ulong len) override
+    {
+        while (len != 0)
+        {
+            ulong n = Stdlib::Min(len, Vfs::ChunkSize - Len);
+            Stdlib::MemCpy(Buf + Len, data, n);
+            Len += n;
+            data += n;
+            len -= n;
+            if (Len == Vfs::ChunkSize && !Flush())
+                return false;
+        }
+        return true;
+    }
+
+    bool Flush()
+    {
+        if (Len != 0 && !Vfs::GetInstance().Write(Fd, Buf, Len))
+            return false;
+        Len = 0;
+        return true;
+    }
+
+private:
+    ulong Fd;
+    u8* Buf;
+    ulong Len;
+};
+
+static void WgetToFile(HttpClient& client, const char* url, const char* path,
+                       Stdlib::Printer& con)
+{
+    auto& vfs = Vfs::GetInstance();
+    ulong fd;
+    if (!vfs.Open(path, Vfs::OpenWrite | Vfs::OpenCreate | Vfs::OpenTruncate, fd))
+    {
+        con.Printf("cannot open %s\n", path);
+        return;
+    }
+
+    u8* buf = (u8*)Mm::Alloc(Vfs::ChunkSize, 0);
+    if (buf == nullptr)
+    {
+        con.Printf("out of memory\n");
+        vfs.Close(fd);
+        return;
+    }
+
+    WgetFileSink sink(fd, buf);
+    HttpResponse resp = client.Get(url, &sink);
+    bool ok = resp.Ok && sink.Flush();
+    Mm::Free(buf);
+    vfs.Close(fd);
+
+    if (!ok)
+    {
+        con.Printf("wget: failed\n");
+        return;
+    }
+    con.Printf("HTTP %u, %u bytes saved to %s\n", (ulong)resp.StatusCode, resp.BodyLen, path);
+}
+
 static void CmdWget(const char* args, Stdlib::Printer& con)
 {
-    if (!args || args[0] == '\0')
+    const char* end;
+    const char* urlStart = Stdlib::NextToken(args, end);
+    if (urlStart == nullptr)
     {
-        con.Printf("usage: wget <url>\n");
+        con.Printf("usage: wget <url> [file]\n");
         return;
     }
+    char url[HttpMaxUrlHostLen + HttpMaxUrlPathLen];
+    Stdlib::TokenCopy(urlStart, end, url, sizeof(url));
+
+    char path[Vfs::MaxPath];
+    path[0] = '\0';
+    const char* pathStart = Stdlib::NextToken(end, end);
+    if (pathStart != nullptr)
+        Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
 
     NetDevice* dev = NetDeviceTable::GetInstance().Find("eth0");
     if (!dev)
@@ -437,7 +1621,13 @@ static void CmdWget(const char* args, Stdlib::Printer& con)
     }
 
     HttpClient client(dev);
-    HttpResponse resp = client.Get(args);
+    if (path[0] != '\0')
+    {
+        WgetToFile(client, url, path, con);
+        return;
+    }
+
+    HttpResponse resp = client.Get(url);
 
     if (!resp.Ok)
     {
@@ -906,7 +2096,40 @@ static void CmdCat(const char* args, Stdlib::Printer& con)
     }
     char path[Vfs::MaxPath];
     Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
-    Vfs::GetInstance().ReadFile(path, con);
+
+    auto& vfs = Vfs::GetInstance();
+    ulong fd;
+    if (!vfs.Open(path, Vfs::OpenRead, fd))
+    {
+        con.Printf("cannot open %s\n", path);
+        return;
+    }
+
+    char* buf = (char*)Mm::Alloc(Vfs::ChunkSize + 1, 0);
+    if (buf == nullptr)
+    {
+        con.Printf("out of memory\n");
+        vfs.Close(fd);
+        return;
+    }
+
+    /* A chunk at a time, so a file of any size goes through one buffer;
+       NUL bytes print as nothing */
+    ulong done;
+    bool ok;
+    while ((ok = vfs.Read(fd, buf, Vfs::ChunkSize, done)) && done != 0)
+    {
+        buf[done] = '\0';
+        for (ulong i = 0; i < done; i += Stdlib::StrLen(buf + i) + 1)
+            con.PrintString(buf + i);
+    }
+    Mm::Free(buf);
+    vfs.Close(fd);
+
+    if (ok)
+        con.Printf("\n");
+    else
+        con.Printf("read failed\n");
 }
 
 static void CmdWrite(const char* args, Stdlib::Printer& con)
@@ -927,7 +2150,16 @@ static void CmdWrite(const char* args, Stdlib::Printer& con)
         content++;
 
     ulong len = Stdlib::StrLen(content);
-    if (Vfs::GetInstance().WriteFile(path, content, len))
+    auto& vfs = Vfs::GetInstance();
+    ulong fd;
+    bool ok = false;
+    if (vfs.Open(path, Vfs::OpenWrite | Vfs::OpenCreate | Vfs::OpenTruncate, fd))
+    {
+        ok = vfs.Write(fd, content, len);
+        vfs.Close(fd);
+    }
+
+    if (ok)
     {
         con.Printf("wrote %u bytes\n", len);
     }
@@ -937,6 +2169,80 @@ static void CmdWrite(const char* args, Stdlib::Printer& con)
     }
 }
 
+static void CmdAppend(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* pathStart = Stdlib::NextToken(args, end);
+    if (pathStart == nullptr)
+    {
+        con.Printf("usage: append <path> <text>\n");
+        return;
+    }
+    char path[Vfs::MaxPath];
+    Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
+
+    // Rest of the line after path is the content, one line per append
+    const char* content = end;
+    while (*content == ' ')
+        content++;
+
+    char line[256];
+    ulong len = Stdlib::StrLen(content);
+    if (len + 1 >= sizeof(line))
+    {
+        con.Printf("line too long\n");
+        return;
+    }
+    Stdlib::MemCpy(line, content, len);
+    line[len++] = '\n';
+
+    if (Vfs::GetInstance().AppendFile(path, line, len))
+    {
+        con.Printf("appended %u bytes\n", len);
+    }
+    else
+    {
+        con.Printf("append failed\n");
+    }
+}
+
+static void CmdTruncate(const char* args, Stdlib::Printer& con)
+{
+    const char* end;
+    const char* pathStart = Stdlib::NextToken(args, end);
+    if (pathStart == nullptr)
+    {
+        con.Printf("usage: truncate <path> <bytes>\n");
+        return;
+    }
+    char path[Vfs::MaxPath];
+    Stdlib::TokenCopy(pathStart, end, path, sizeof(path));
+
+    const char* sizeStart = Stdlib::NextToken(end, end);
+    char sizeBuf[32];
+    ulong size;
+    if (sizeStart == nullptr)
+    {
+        con.Printf("usage: truncate <path> <bytes>\n");
+        return;
+    }
+    Stdlib::TokenCopy(sizeStart, end, sizeBuf, sizeof(sizeBuf));
+    if (!Stdlib::ParseUlong(sizeBuf, size))
+    {
+        con.Printf("invalid size\n");
+        return;
+    }
+
+    if (Vfs::GetInstance().TruncateFile(path, size))
+    {
+        con.Printf("%s: %u bytes\n", path, size);
+    }
+    else
+    {
+        con.Printf("truncate failed\n");
+    }
+}
+
 static void CmdMkdir(const char* args, Stdlib::Printer& con)
 {
     const char* end;
@@ -1274,11 +2580,28 @@ static const CmdEntry Commands[] = {
     { "partitions", CmdPartitions, "partitions <disk> - show partition table" },
     { "diskread",  CmdDiskread,  "diskread <disk> <sector> - read sector" },
     { "diskwrite", CmdDiskwrite, "diskwrite <disk> <sector> <hex> - write sector" },
+    { "blkstat",   CmdBlkstat,   "blkstat [disk] - show I/O scheduler merge and throughput stats" },
+    { "iostat",    CmdIostat,    "iostat [interval_sec [count]] - per-device and per-I/O-class IOPS, bandwidth and latency percentiles" },
+    { "blksched",  CmdBlksched,  "blksched <disk> [none|noop|deadline] - show or set I/O scheduler" },
+    { "blkqos",    CmdBlkqos,    "blkqos <disk> [on|off | target <us> | <class> iops|kbps|weight <n>] - per-class I/O QoS" },
+    { "ionice",    CmdIonice,    "ionice <fg|default|bg> <command> - run a command in an I/O class" },
+    { "blktrace",  CmdBlktrace,  "blktrace [<disk> on|off | dump [max] | save <path> | clear] - trace block requests" },
+    { "raid",      CmdRaid,      "raid [create <name> <raid0|raid1> [chunkKB] <disk> <disk>...] - list or assemble RAID arrays" },
+    { "ramdisk",   CmdRamdisk,   "ramdisk [create <sizeMB> [latencyUs] | latency <disk> <us>] - list or create RAM disks" },
+    { "loop",      CmdLoop,      "loop [attach <path> [ro] | detach <loopN>] - list, attach or detach file-backed disks" },
+    { "blkbench",  CmdBlkbench,  "blkbench <disk> <read|write> [seq|rand] [bsKB] [ops] [depth] [cpus] - raw disk benchmark" },
+    { "fsbench",   CmdFsbench,   "fsbench [meta] [dir] ... - file read or create/remove benchmark" },
+    { "vfsbench",  CmdVfsbench,  "vfsbench [stress] ... - path lookup or concurrent VFS benchmark" },
+    { "bcache",    CmdBcache,    "bcache [drop|budget <KB>|writeback <on|off>] - show or tune the buffer cache" },
+    { "sync",      CmdSync,      "sync - write back dirty blocks and flush disk caches" },
+    { "fstrim",    CmdFstrim,    "fstrim <path> - discard free space of a mounted file system" },
+    { "blksteer",  CmdBlksteer,  "blksteer [on|off] - steer block completions to the submitting CPU" },
+    { "blkpoll",   CmdBlkpoll,   "blkpoll [disk] [off|poll|hybrid] - I/O completion polling" },
     { "net",       CmdNet,       "net - list network devices" },
     { "arp",       CmdArp,       "arp - show ARP table" },
     { "icmpstat",  CmdIcmpstat,  "icmpstat - show ICMP statistics" },
     { "tcpstat",   CmdTcpstat,   "tcpstat - show TCP connections and statistics" },
-    { "wget",      CmdWget,      "wget <url> - HTTP GET request" },
+    { "wget",      CmdWget,      "wget <url> [file] - HTTP GET request, printed or streamed to a file" },
     { "udpsend",   CmdUdpsend,   "udpsend <ip> <port> <msg> - send UDP packet" },
     { "ping",      CmdPing,      "ping <ip|hostname> - send ICMP echo" },
     { "nslookup",  CmdNslookup,  "nslookup <hostname> - resolve hostname" },
@@ -1291,6 +2614,8 @@ static const CmdEntry Commands[] = {
     { "ls",        CmdLs,        "ls <path> - list directory" },
     { "cat",       CmdCat,       "cat <path> - show file content" },
     { "write",     CmdWrite,     "write <path> <text> - write to file" },
+    { "append",    CmdAppend,    "append <path> <text> - append a line to file" },
+    { "truncate",  CmdTruncate,  "truncate <path> <bytes> - set file size" },
     { "mkdir",     CmdMkdir,     "mkdir <path> - create directory" },
     { "touch",     CmdTouch,     "touch <path> - create empty file" },
     { "del",       CmdDel,       "del <path> - remove file or directory" },
@@ -540,6 +540,21 @@ ulong CpuTable::GetRunningCpus()
     return result;
 }
 
+ulong CpuTable::GetPossibleCpus()
+{
+    Stdlib::AutoLock lock(Lock);
+
+    ulong result = 0;
+    for (ulong i = 0; i < Stdlib::ArraySize(CpuArray); i++)
+    {
+        auto& cpu = CpuArray[i];
+        if (cpu.GetState() & Cpu::StateInited)
+            result |= 1UL << i;
+    }
+
+    return result;
+}
+
 void CpuTable::Reset()
 {
     Stdlib::AutoLock lock(Lock);
@@ -118,6 +118,9 @@ public:
 
     ulong GetRunningCpus();
 
+    /* CPUs found at boot, running or not yet started */
+    ulong GetPossibleCpus();
+
     void ExitAllExceptSelf();
 
     void SendIPIAllExclude(ulong excludeIndex);
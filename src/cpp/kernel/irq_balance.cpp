@@ -80,6 +80,7 @@ ulong IrqBalance::AssignIoApicIrq(u8 gsi)
     entry.Table = nullptr;
     entry.Index = 0;
     entry.Cpu = 0;
+    entry.PinCpu = MaxCpus;
     return Assign(entry);
 }
 
@@ -91,9 +92,36 @@ ulong IrqBalance::AssignMsix(MsixTable* table, u16 index)
     entry.Table = table;
     entry.Index = index;
     entry.Cpu = 0;
+    entry.PinCpu = MaxCpus;
     return Assign(entry);
 }
 
+bool IrqBalance::PinMsix(MsixTable* table, u16 index, ulong cpu)
+{
+    if (cpu >= MaxCpus)
+        return false;
+
+    Stdlib::AutoLock lock(Lock);
+
+    for (ulong i = 0; i < EntryCount; i++)
+    {
+        Entry& entry = Entries[i];
+        if (entry.Kind != KindMsix || entry.Table != table || entry.Index != index)
+            continue;
+
+        entry.PinCpu = cpu;
+        if (Balanced && (CpuTable::GetInstance().GetRunningCpus() & (1UL << cpu)))
+        {
+            entry.Cpu = cpu;
+            ApplyLockHeld(entry);
+        }
+        return true;
+    }
+
+    Trace(0, "IrqBalance: msix 0x%p[%u] not recorded", (ulong)table, (ulong)index);
+    return false;
+}
+
 void IrqBalance::RemoveMsix(MsixTable* table)
 {
     Stdlib::AutoLock lock(Lock);
@@ -123,10 +151,15 @@ void IrqBalance::Balance()
        the other CPUs (the BSP keeps the system IRQs) */
     NextCpu = CpuTable::GetInstance().GetBspIndex();
 
+    ulong cpuMask = CpuTable::GetInstance().GetRunningCpus();
     for (ulong i = 0; i < EntryCount; i++)
     {
-        Entries[i].Cpu = NextCpuLockHeld();
-        ApplyLockHeld(Entries[i]);
+        Entry& entry = Entries[i];
+        if (entry.PinCpu < MaxCpus && (cpuMask & (1UL << entry.PinCpu)))
+            entry.Cpu = entry.PinCpu;
+        else
+            entry.Cpu = NextCpuLockHeld();
+        ApplyLockHeld(entry);
     }
 
     Trace(0, "IrqBalance: %u irqs balanced over cpu mask 0x%p",
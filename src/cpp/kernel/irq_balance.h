@@ -32,6 +32,12 @@ public:
        into the table entry. */
     ulong AssignMsix(MsixTable* table, u16 index);
 
+    /* Steer an MSI-X vector recorded by AssignMsix to cpu, e.g. a
+       per-CPU queue's vector to its CPU. Balance() keeps pinned vectors
+       on their CPU if it runs and round-robins them otherwise; after
+       Balance() the vector is retargeted at once. */
+    bool PinMsix(MsixTable* table, u16 index, ulong cpu);
+
     /* Forget the MSI-X vectors of a table being destroyed. */
     void RemoveMsix(MsixTable* table);
 
@@ -56,6 +62,7 @@ private:
         u16 Index;
         MsixTable* Table;
         ulong Cpu;
+        ulong PinCpu;       /* MaxCpus if not pinned */
     };
 
     ulong Assign(Entry entry);
@@ -51,6 +51,9 @@
 
 #include <block/block_device.h>
 #include <block/partition.h>
+#include <block/raid.h>
+#include <block/ramdisk.h>
+#include <block/block_completion.h>
 #include <net/udp_shell.h>
 #include <net/tcp.h>
 #include <fs/vfs.h>
@@ -442,6 +445,8 @@ void BpStartup(void* ctx)
         MountRootFs();
 
         rust_init();
+        RamDisk::CreateFromParameters();
+        RaidDevice::AssembleFromParameters();
 
         VirtioNet::InitAll();
         VirtioRng::InitAll();
@@ -532,6 +537,7 @@ void BpStartup(void* ctx)
             Panic("Can't init softirq");
             return;
         }
+        BlockCompletion::GetInstance().Init();
 
         Tcp::GetInstance().Init();
 
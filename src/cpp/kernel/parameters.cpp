@@ -16,7 +16,12 @@ Parameters::Parameters()
     , UdpShellPort(0)
     , DnsEnabled(false)
     , RootAuto(false)
+    , BcacheMb(16)
+    , Writeback(false)
 {
+    BlkPoll[0] = '\0';
+    Raid[0] = '\0';
+    Ramdisk[0] = '\0';
 }
 
 Parameters::~Parameters()
@@ -88,6 +93,31 @@ bool Parameters::IsRootAuto()
     return RootAuto;
 }
 
+const char* Parameters::GetBlkPoll()
+{
+    return BlkPoll;
+}
+
+const char* Parameters::GetRaid()
+{
+    return Raid;
+}
+
+const char* Parameters::GetRamdisk()
+{
+    return Ramdisk;
+}
+
+ulong Parameters::GetBcacheMb()
+{
+    return BcacheMb;
+}
+
+bool Parameters::IsWriteback()
+{
+    return Writeback;
+}
+
 const char* Parameters::GetCmdline()
 {
     return Cmdline;
@@ -98,7 +128,7 @@ bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
     if (BugOn(start >= end))
         return false;
 
-    const size_t maxLen = 20;
+    const size_t maxLen = 64;
     char param[maxLen + 1];
     size_t len = end - start;
     if (len > maxLen)
@@ -225,6 +255,39 @@ bool Parameters::ParseParameter(const char *cmdline, size_t start, size_t end)
             Trace(0, "Unknown value %s, key %s", value, key);
         }
     }
+    else if (Stdlib::StrCmp(key, "blkpoll") == 0)
+    {
+        /* <mode> or <dev>:<mode>[,<dev>:<mode>...]; validated when the
+           devices register, since none exist yet */
+        Stdlib::StrnCpy(BlkPoll, value, sizeof(BlkPoll));
+    }
+    else if (Stdlib::StrCmp(key, "raid") == 0)
+    {
+        /* <name>:<level>[:<chunkKB>]:<disk>+<disk>[,...]; assembled
+           after the member disks are probed */
+        Stdlib::StrnCpy(Raid, value, sizeof(Raid));
+    }
+    else if (Stdlib::StrCmp(key, "ramdisk") == 0)
+    {
+        /* <sizeMB>[:<latencyUs>][,...] */
+        Stdlib::StrnCpy(Ramdisk, value, sizeof(Ramdisk));
+    }
+    else if (Stdlib::StrCmp(key, "bcache") == 0)
+    {
+        ulong mb = 0;
+        if (Stdlib::ParseUlong(value, mb) && mb <= 4096)
+        {
+            BcacheMb = mb;
+        }
+        else
+        {
+            Trace(0, "Invalid bcache size %s", value);
+        }
+    }
+    else if (Stdlib::StrCmp(key, "writeback") == 0)
+    {
+        Writeback = (Stdlib::StrCmp(value, "on") == 0);
+    }
     else if (Stdlib::StrCmp(key, "dns") == 0)
     {
         if (Stdlib::StrCmp(value, "on") == 0)
@@ -35,6 +35,13 @@ public:
 
     bool IsRootAuto();
 
+    const char* GetBlkPoll();
+    const char* GetRaid();
+    const char* GetRamdisk();
+
+    ulong GetBcacheMb();
+    bool IsWriteback();
+
     const char* GetCmdline();
 
     Parameters();
@@ -65,5 +72,10 @@ private:
     u16 UdpShellPort;
     bool DnsEnabled;
     bool RootAuto;
+    char BlkPoll[64];
+    char Raid[64];
+    char Ramdisk[32];
+    ulong BcacheMb;
+    bool Writeback;
 };
 }
\ No newline at end of file
@@ -25,6 +25,7 @@
 #include <drivers/msix.h>
 #include <hal/irqchip.h>
 #include <block/block_device.h>
+#include <block/block_stats.h>
 #include <net/net_device.h>
 #include <net/net_frame.h>
 #include <drivers/hpet.h>
@@ -319,6 +320,11 @@ unsigned long kernel_cpu_online_mask()
     return Kernel::CpuTable::GetInstance().GetRunningCpus();
 }
 
+unsigned long kernel_cpu_possible_mask()
+{
+    return Kernel::CpuTable::GetInstance().GetPossibleCpus();
+}
+
 } /* extern "C" */
 
 struct RustIPIAdapter
@@ -655,6 +661,14 @@ int kernel_msix_is_ready(unsigned long handle)
     return reinterpret_cast<Kernel::MsixTable*>(handle)->IsReady() ? 1 : 0;
 }
 
+int kernel_msix_set_affinity(unsigned long handle, unsigned short index,
+    unsigned long cpu)
+{
+    if (handle == 0)
+        return 0;
+    return reinterpret_cast<Kernel::MsixTable*>(handle)->SetAffinity(index, cpu) ? 1 : 0;
+}
+
 unsigned long kernel_task_spawn_ctx(
     void (*func)(void*), void* ctx)
 {
@@ -1124,16 +1138,27 @@ void kernel_msix_unregister_handler(unsigned long handle)
 
 /* ---- Block device bridge ---- */
 
+/* Multi-queue devices (QueueCount > 1) get the hardware queue of each
+   operation passed in: the submitting CPU's queue, so CPUs do not share
+   a submission lock or a completion vector.  A task may migrate between
+   picking the queue and the device using it; the queue is still valid,
+   just not local.  Single-queue devices always see queue 0. */
 struct RustBlockDeviceOps
 {
     const char* Name;
     unsigned long long Capacity;
     unsigned long long SectorSize;
-    int (*ReadSectors)(void* ctx, unsigned long long sector,
+    unsigned int QueueCount;    /* hardware queues, 0 is treated as 1 */
+    int (*ReadSectors)(void* ctx, unsigned int queue, unsigned long long sector,
                        void* buf, unsigned int count);
-    int (*WriteSectors)(void* ctx, unsigned long long sector,
+    int (*WriteSectors)(void* ctx, unsigned int queue, unsigned long long sector,
                         const void* buf, unsigned int count, int fua);
-    int (*Flush)(void* ctx);    /* may be nullptr */
+    int (*Flush)(void* ctx, unsigned int queue);        /* may be nullptr */
+    int (*SetPollMode)(void* ctx, unsigned int mode);   /* may be nullptr */
+    int (*Discard)(void* ctx, unsigned int queue, unsigned long long sector,
+                   unsigned long long count);           /* may be nullptr */
+    int (*WriteZeroes)(void* ctx, unsigned int queue, unsigned long long sector,
+                       unsigned long long count);       /* may be nullptr */
     void* Ctx;
 };
 
@@ -1141,30 +1166,86 @@ class RustBlockDevice : public Kernel::BlockDevice
 {
 public:
     RustBlockDeviceOps Ops;
+    Kernel::BlockPollState::Mode PollMode;
+    Kernel::BlockStats Stats;
 
     const char* GetName() override { return Ops.Name; }
     u64 GetCapacity() override { return (u64)Ops.Capacity; }
     u64 GetSectorSize() override { return (u64)Ops.SectorSize; }
+    ulong GetQueueCount() override { return Ops.QueueCount; }
+    Kernel::BlockStats* GetStats() override { return &Stats; }
+
+    unsigned int SelectQueue()
+    {
+        if (Ops.QueueCount <= 1)
+            return 0;
+        return (unsigned int)(Kernel::CpuTable::GetInstance().GetCurrentCpuId() % Ops.QueueCount);
+    }
 
     bool ReadSectors(u64 sector, void* buf, u32 count) override
     {
-        int rc = Ops.ReadSectors(Ops.Ctx, (unsigned long long)sector, buf,
+        u64 start = Stats.Begin(Kernel::BlockStats::OpRead);
+        int rc = Ops.ReadSectors(Ops.Ctx, SelectQueue(), (unsigned long long)sector, buf,
                                  (unsigned int)count);
+        Stats.End(Kernel::BlockStats::OpRead, start, (u64)count * Ops.SectorSize, rc == 0);
         return rc == 0;
     }
 
     bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua) override
     {
-        return Ops.WriteSectors(Ops.Ctx, (unsigned long long)sector, buf,
-                                (unsigned int)count, fua ? 1 : 0) == 0;
+        u64 start = Stats.Begin(Kernel::BlockStats::OpWrite);
+        bool ok = Ops.WriteSectors(Ops.Ctx, SelectQueue(), (unsigned long long)sector, buf,
+                                   (unsigned int)count, fua ? 1 : 0) == 0;
+        Stats.End(Kernel::BlockStats::OpWrite, start, (u64)count * Ops.SectorSize, ok);
+        return ok;
     }
 
     bool Flush() override
     {
         if (!Ops.Flush)
             return true;
-        return Ops.Flush(Ops.Ctx) == 0;
+        u64 start = Stats.Begin(Kernel::BlockStats::OpFlush);
+        bool ok = Ops.Flush(Ops.Ctx, SelectQueue()) == 0;
+        Stats.End(Kernel::BlockStats::OpFlush, start, 0, ok);
+        return ok;
     }
+
+    bool SupportsDiscard() override { return Ops.Discard != nullptr; }
+    bool SupportsWriteZeroes() override { return Ops.WriteZeroes != nullptr; }
+
+    bool Discard(u64 sector, u64 count) override
+    {
+        if (!Ops.Discard)
+            return false;
+        u64 start = Stats.Begin(Kernel::BlockStats::OpDiscard);
+        bool ok = Ops.Discard(Ops.Ctx, SelectQueue(), (unsigned long long)sector,
+                              (unsigned long long)count) == 0;
+        Stats.End(Kernel::BlockStats::OpDiscard, start, 0, ok);
+        return ok;
+    }
+
+    bool WriteZeroes(u64 sector, u64 count) override
+    {
+        if (!Ops.WriteZeroes)
+            return BlockDevice::WriteZeroes(sector, count);
+        u64 start = Stats.Begin(Kernel::BlockStats::OpDiscard);
+        bool ok = Ops.WriteZeroes(Ops.Ctx, SelectQueue(), (unsigned long long)sector,
+                                  (unsigned long long)count) == 0;
+        Stats.End(Kernel::BlockStats::OpDiscard, start, 0, ok);
+        return ok;
+    }
+
+    bool SetPollMode(Kernel::BlockPollState::Mode mode) override
+    {
+        if (!Ops.SetPollMode)
+            return mode == Kernel::BlockPollState::Off;
+        if (Ops.SetPollMode(Ops.Ctx, (unsigned int)mode) != 0)
+            return false;
+        PollMode = mode;
+        return true;
+    }
+
+    Kernel::BlockPollState::Mode GetPollMode() override { return PollMode; }
 };
 
 extern "C" {
@@ -1179,6 +1260,10 @@ unsigned long kernel_blockdev_register(const RustBlockDeviceOps* ops)
         return 0;
 
     dev->Ops = *ops;
+    if (dev->Ops.QueueCount == 0)
+        dev->Ops.QueueCount = 1;
+    dev->PollMode = Kernel::BlockPollState::Off;
+    dev->Stats.SetSectorSize((u32)ops->SectorSize);
 
     if (!Kernel::BlockDeviceTable::GetInstance().Register(dev))
     {
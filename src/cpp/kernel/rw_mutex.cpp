@@ -63,4 +63,14 @@ void RwMutex::WriteUnlock()
     WriterWaiting.Dec();
 }
 
+bool RwMutex::TryWriteLock()
+{
+    if (Value.Cmpxchg(-1, 0) != 0)
+        return false;
+
+    /* Paired with the Dec in WriteUnlock */
+    WriterWaiting.Inc();
+    return true;
+}
+
 }
@@ -19,6 +19,9 @@ namespace Kernel
  *
  * WriterWaiting: when non-zero, new readers back off and yield so the
  * writer can acquire without starvation.
+ *
+ * An all-zero object is unlocked, so it can sit in structures cleared
+ * with MemSet (VNode).
  */
 class RwMutex final
 {
@@ -32,6 +35,9 @@ public:
     void WriteLock();
     void WriteUnlock();
 
+    /* WriteLock if free right now; false instead of waiting. */
+    bool TryWriteLock();
+
 private:
     RwMutex(const RwMutex& other) = delete;
     RwMutex(RwMutex&& other) = delete;
@@ -13,6 +13,7 @@ namespace Kernel
 
 SoftIrq::SoftIrq()
     : Running(0)
+    , PerCpu(0)
     , Ready(0)
 {
     Stdlib::MemSet(Handlers, 0, sizeof(Handlers));
@@ -78,11 +79,15 @@ void SoftIrq::Stop()
 }
 
 void SoftIrq::Raise(ulong type)
+{
+    RaiseOn(CpuTable::GetInstance().GetCurrentCpuId(), type);
+}
+
+void SoftIrq::RaiseOn(ulong cpu, ulong type)
 {
     if (type >= MaxTypes)
         return;
 
-    ulong cpu = CpuTable::GetInstance().GetCurrentCpuId();
     if (BugOn(cpu >= MaxCpus))
         return;
 
@@ -97,6 +102,11 @@ void SoftIrq::Raise(ulong type)
         Hal::SendIpi(cpu, CpuTable::IPIVector);
 }
 
+bool SoftIrq::IsReadyOn(ulong cpu)
+{
+    return cpu < MaxCpus && Ready.Get() && CpuStates[cpu].TaskPtr != nullptr;
+}
+
 void SoftIrq::Register(ulong type, void (*handler)(void* ctx), void* ctx)
 {
     if (type >= MaxTypes)
@@ -106,6 +116,15 @@ void SoftIrq::Register(ulong type, void (*handler)(void* ctx), void* ctx)
     Handlers[type].Ctx = ctx;
 }
 
+void SoftIrq::RegisterPerCpu(ulong type, void (*handler)(void* ctx), void* ctx)
+{
+    if (type >= MaxTypes)
+        return;
+
+    Register(type, handler, ctx);
+    PerCpu.SetBit(type);
+}
+
 void SoftIrq::TaskFunc(void* ctx)
 {
     SoftIrq::GetInstance().Run(*static_cast<CpuState*>(ctx));
@@ -125,6 +144,17 @@ void SoftIrq::Run(CpuState& state)
             if (!state.Pending.TestBit(i))
                 continue;
 
+            if (PerCpu.TestBit(i))
+            {
+                state.Pending.ClearBit(i);
+                if (Handlers[i].Func)
+                {
+                    Handlers[i].Func(Handlers[i].Ctx);
+                    handled = true;
+                }
+                continue;
+            }
+
             if (Running.SetBit(i))
             {
                 /* Type is being handled on another CPU: keep the
@@ -25,13 +25,25 @@ public:
        The work runs on the CPU which raised it. */
     void Raise(ulong type);
 
+    /* Schedule deferred work on another CPU: sets its pending bit and
+       sends it an IPI unless the type was already pending there. */
+    void RaiseOn(ulong cpu, ulong type);
+
+    /* True once cpu has a soft IRQ task to run raised work. */
+    bool IsReadyOn(ulong cpu);
+
     /* Register a handler for a soft IRQ type */
     void Register(ulong type, void (*handler)(void* ctx), void* ctx);
 
+    /* Register a handler that works on per-CPU state only: it may run
+       on several CPUs at once instead of on one at a time. */
+    void RegisterPerCpu(ulong type, void (*handler)(void* ctx), void* ctx);
+
     static const ulong TypeNetRx = 0;
     static const ulong TypeBlkIo = 1;
     static const ulong TypeNetTx = 2;
     static const ulong TypeTcpTimer = 3;
+    static const ulong TypeBlkDone = 4;
     static const ulong MaxTypes = 8;
 
 private:
@@ -62,6 +74,8 @@ private:
        set and retries. */
     Atomic Running; /* bitmask of soft IRQ types being handled */
 
+    Atomic PerCpu; /* bitmask of types exempt from the Running exclusion */
+
     Atomic Ready; /* set once the per-CPU tasks are started */
 
     static void TaskFunc(void* ctx);
@@ -7,6 +7,7 @@
 #include "sched.h"
 #include "preempt.h"
 #include <mm/new.h>
+#include <block/block_request.h>
 
 namespace Kernel
 {
@@ -20,6 +21,7 @@ Task::Task()
     , Magic(TaskMagic)
     , CpuAffinity(~(0UL))
     , Pid(InvalidObjectId)
+    , IoClass(BlockRequest::ClassDefault)
     , StackPtr(nullptr)
     , Function(nullptr)
     , Ctx(nullptr)
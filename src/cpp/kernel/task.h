@@ -115,6 +115,7 @@ public:
     ulong Magic;
     ulong CpuAffinity;
     ulong Pid;
+    u8 IoClass;             /* BlockRequest::Class of the I/O it submits */
 
 private:
     Task(const Task& other) = delete;
@@ -6,6 +6,11 @@
 #include "stack_trace.h"
 #include <hal/cpu.h>
 #include <block/block_device.h>
+#include <fs/block_io.h>
+#include <fs/buffer_cache.h>
+#include <fs/dentry_cache.h>
+#include <fs/nano_journal.h>
+#include <fs/vnode.h>
 
 #include <lib/btree.h>
 #include <lib/error.h>
@@ -594,6 +599,642 @@ Stdlib::Error TestBlockDeviceTable()
     return MakeSuccess();
 }
 
+Stdlib::Error TestIoScheduler()
+{
+    Trace(0, "TestIoScheduler: started");
+
+    IoQueue* queue = new (Mm::NoThrow) IoQueue();
+    if (!queue)
+        return MakeError(Stdlib::Error::NoMemory);
+    queue->Init(512, 32, 256);
+
+    BlockRequest reqs[8];
+    Stdlib::Error err = MakeSuccess();
+
+    /* noop: three contiguous writes submitted out of order form one chain */
+    reqs[0].RequestType = BlockRequest::Write; reqs[0].Sector = 8;  reqs[0].SectorCount = 8;
+    reqs[1].RequestType = BlockRequest::Write; reqs[1].Sector = 0;  reqs[1].SectorCount = 8;
+    reqs[2].RequestType = BlockRequest::Write; reqs[2].Sector = 16; reqs[2].SectorCount = 8;
+    for (ulong i = 0; i < 3; i++)
+        queue->Add(&reqs[i]);
+
+    BlockRequest* head = queue->Dispatch();
+    if (head != &reqs[1] || head->TotalSectors != 24 || head->Segments != 3 ||
+        head->MergeNext != &reqs[0] || reqs[0].MergeNext != &reqs[2] ||
+        queue->Dispatch() != nullptr)
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    if (head)
+        queue->Complete(head, true);
+    for (ulong i = 0; i < 3; i++)
+        if (reqs[i].Completion.GetCounter() != 0 || !reqs[i].Success)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+
+    /* deadline: a flush is a barrier for both dispatch and merging */
+    if (err.Ok() && !queue->SetScheduler("deadline"))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    reqs[3].RequestType = BlockRequest::Write; reqs[3].Sector = 100; reqs[3].SectorCount = 8;
+    reqs[4].RequestType = BlockRequest::Flush;
+    reqs[5].RequestType = BlockRequest::Write; reqs[5].Sector = 108; reqs[5].SectorCount = 8;
+    for (ulong i = 3; i < 6; i++)
+        queue->Add(&reqs[i]);
+
+    for (ulong i = 3; i < 6; i++)
+    {
+        head = queue->Dispatch();
+        if (head != &reqs[i] || head->MergeNext != nullptr)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        if (head)
+            queue->Complete(head, true);
+    }
+
+    /* Adjacent discards are dispatched separately */
+    reqs[6].RequestType = BlockRequest::Discard; reqs[6].Sector = 200; reqs[6].SectorCount = 8;
+    reqs[7].RequestType = BlockRequest::Discard; reqs[7].Sector = 208; reqs[7].SectorCount = 8;
+    for (ulong i = 6; i < 8; i++)
+        queue->Add(&reqs[i]);
+
+    for (ulong i = 6; i < 8; i++)
+    {
+        head = queue->Dispatch();
+        if (head != &reqs[i] || head->MergeNext != nullptr || head->Segments != 0)
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        if (head)
+            queue->Complete(head, true);
+    }
+
+    /* Successful requests without data (the flush, the discards) are
+       not errors */
+    if (queue->GetErrors() != 0)
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    /* On failure some requests may still be queued; their WaitGroups
+       must reach zero before destruction */
+    for (ulong i = 0; i < 8; i++)
+        if (reqs[i].Completion.GetCounter() != 0)
+            reqs[i].Completion.Done();
+
+    delete queue;
+
+    Trace(0, "TestIoScheduler: complete");
+    return err;
+}
+
+/* Sparse RAM disk for the storage tests, never registered: a page per
+   block, allocated on first write, unwritten blocks read as zeros */
+class TestDisk final : public BlockDevice
+{
+public:
+    static const ulong Blocks = 192;
+    static const ulong SectorSize = 512;
+    static const ulong SectorsPerBlock = Const::PageSize / SectorSize;
+
+    TestDisk()
+    {
+        Stdlib::MemSet(Pages, 0, sizeof(Pages));
+    }
+
+    virtual ~TestDisk()
+    {
+        BufferCache::GetInstance().Invalidate(this);
+        for (ulong i = 0; i < Blocks; i++)
+        {
+            if (Pages[i] != nullptr)
+                Mm::Free(Pages[i]);
+        }
+    }
+
+    virtual const char* GetName() override { return "testdisk"; }
+    virtual u64 GetCapacity() override { return Blocks * SectorsPerBlock; }
+    virtual u64 GetSectorSize() override { return SectorSize; }
+
+    virtual bool ReadSectors(u64 sector, void* buf, u32 count) override
+    {
+        return Transfer(sector, static_cast<u8*>(buf), count, false);
+    }
+
+    virtual bool WriteSectors(u64 sector, const void* buf, u32 count, bool fua = false) override
+    {
+        (void)fua;
+        return Transfer(sector, static_cast<u8*>(const_cast<void*>(buf)), count, true);
+    }
+
+private:
+    TestDisk(const TestDisk& other) = delete;
+    TestDisk(TestDisk&& other) = delete;
+    TestDisk& operator=(const TestDisk& other) = delete;
+    TestDisk& operator=(TestDisk&& other) = delete;
+
+    bool Transfer(u64 sector, u8* buf, u32 count, bool write)
+    {
+        if (sector > GetCapacity() || count > GetCapacity() - sector)
+            return false;
+
+        for (u32 i = 0; i < count; i++, sector++, buf += SectorSize)
+        {
+            u8*& page = Pages[sector / SectorsPerBlock];
+            if (page == nullptr)
+            {
+                if (!write)
+                {
+                    Stdlib::MemSet(buf, 0, SectorSize);
+                    continue;
+                }
+                page = static_cast<u8*>(Mm::Alloc(Const::PageSize, Tag));
+                if (page == nullptr)
+                    return false;
+                Stdlib::MemSet(page, 0, Const::PageSize);
+            }
+
+            u8* data = page + (sector % SectorsPerBlock) * SectorSize;
+            if (write)
+                Stdlib::MemCpy(data, buf, SectorSize);
+            else
+                Stdlib::MemCpy(buf, data, SectorSize);
+        }
+        return true;
+    }
+
+    u8* Pages[Blocks];
+};
+
+/* Journal region of the journal tests; home blocks lie below it */
+static const u32 JournalStart = 32;
+static const u32 JournalBlocks = NanoJournalMinBlocks;
+
+static NanoJournal* JournalCreate(BlockIo& io)
+{
+    if (!NanoJournal::Format(io, JournalStart, JournalBlocks))
+        return nullptr;
+
+    NanoJournal* journal = new (Mm::NoThrow) NanoJournal(io);
+    if (journal != nullptr && !journal->Open(JournalStart, JournalBlocks, TestDisk::Blocks))
+    {
+        delete journal;
+        journal = nullptr;
+    }
+    return journal;
+}
+
+/* Drop journal the way a crash does, without commit or checkpoint, and
+   replay the log into a fresh one; replayed receives the transactions
+   the replay found */
+static NanoJournal* JournalCrash(NanoJournal* journal, BlockIo& io, u64& replayed)
+{
+    delete journal;
+
+    replayed = 0;
+    journal = new (Mm::NoThrow) NanoJournal(io);
+    if (journal == nullptr)
+        return nullptr;
+
+    if (!journal->Open(JournalStart, JournalBlocks, TestDisk::Blocks))
+    {
+        delete journal;
+        return nullptr;
+    }
+
+    NanoJournal::Stats stats;
+    journal->GetStats(stats);
+    replayed = stats.Replayed;
+    return journal;
+}
+
+static bool JournalClose(NanoJournal* journal)
+{
+    if (journal == nullptr)
+        return false;
+
+    bool ok = journal->Close();
+    delete journal;
+    return ok;
+}
+
+/* Log count blocks from first, every byte set to pattern */
+static bool JournalLog(NanoJournal& journal, u32 first, u32 count, u8 pattern, u8* buf)
+{
+    Stdlib::MemSet(buf, pattern, NanoJournalBlockSize);
+    for (u32 i = 0; i < count; i++)
+    {
+        if (!journal.Log(first + i, buf))
+            return false;
+    }
+    return true;
+}
+
+/* Home blocks first..first + count - 1 hold pattern */
+static bool JournalCheck(BlockIo& io, u32 first, u32 count, u8 pattern, u8* buf)
+{
+    for (u32 i = 0; i < count; i++)
+    {
+        if (!io.ReadBlock(first + i, buf))
+            return false;
+
+        for (u32 j = 0; j < NanoJournalBlockSize; j++)
+        {
+            if (buf[j] != pattern)
+            {
+                Trace(0, "TestNanoJournal: block %u holds 0x%x, expected 0x%x",
+                    (ulong)(first + i), (ulong)buf[j], (ulong)pattern);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+/* The second transaction's commit block is torn: only the first one is
+   replayed */
+static bool TestJournalTornCommit(BlockIo& io, u8* buf)
+{
+    NanoJournal* journal = JournalCreate(io);
+    bool ok = journal != nullptr &&
+              JournalLog(*journal, 1, 1, 0xA1, buf) && journal->Commit() &&
+              JournalLog(*journal, 1, 1, 0xA2, buf) && journal->Commit();
+
+    /* A transaction of one block is a descriptor, the copy and the
+       commit block: the second commit block is log block 5 */
+    u32 commit = JournalStart + 1 + 5;
+    if (ok && io.ReadBlock(commit, buf))
+    {
+        buf[NanoJournalBlockSize - 1] ^= 0xFF;
+        ok = io.WriteBlock(commit, buf);
+    }
+
+    u64 replayed;
+    journal = JournalCrash(journal, io, replayed);
+    ok = ok && journal != nullptr && replayed == 1 && JournalCheck(io, 1, 1, 0xA1, buf);
+    return JournalClose(journal) && ok;
+}
+
+/* Blocks 2..4 are committed, then 2 is freed and reused for data written
+   in place, 4 is freed and logged again in the same transaction: replay
+   must not bring back the old copy of 2 and must bring back the new
+   copy of 4 */
+static bool TestJournalRevoke(BlockIo& io, u8* buf)
+{
+    NanoJournal* journal = JournalCreate(io);
+    bool ok = journal != nullptr &&
+              JournalLog(*journal, 2, 3, 0xB1, buf) && journal->Commit() &&
+              journal->Revoke(2) && journal->Revoke(4) &&
+              JournalLog(*journal, 4, 1, 0xB2, buf) && journal->Commit();
+
+    Stdlib::MemSet(buf, 0xB3, NanoJournalBlockSize);
+    ok = ok && io.WriteBlock(2, buf);
+
+    u64 replayed;
+    journal = JournalCrash(journal, io, replayed);
+    ok = ok && journal != nullptr && replayed == 2 &&
+         JournalCheck(io, 2, 1, 0xB3, buf) &&
+         JournalCheck(io, 3, 1, 0xB1, buf) &&
+         JournalCheck(io, 4, 1, 0xB2, buf);
+    return JournalClose(journal) && ok;
+}
+
+/* Transactions of 20 blocks take 22 log blocks of the 127: the third
+   one checkpoints (more than half the log in use), the fourth and fifth
+   end at log block 110 and a sixth of 17 blocks wraps around the end
+   of the log, all three left for replay */
+static bool TestJournalWrap(BlockIo& io, u8* buf)
+{
+    NanoJournal* journal = JournalCreate(io);
+    bool ok = journal != nullptr;
+    for (u8 i = 0; i < 5 && ok; i++)
+        ok = JournalLog(*journal, 0, 20, (u8)(0xC0 + i), buf) && journal->Commit();
+    ok = ok && JournalLog(*journal, 0, 17, 0xC5, buf) && journal->Commit();
+
+    NanoJournal::Stats stats = {};
+    if (journal != nullptr)
+        journal->GetStats(stats);
+    ok = ok && stats.Checkpoints == 1;
+
+    u64 replayed;
+    journal = JournalCrash(journal, io, replayed);
+    ok = ok && journal != nullptr && replayed == 3 &&
+         JournalCheck(io, 0, 17, 0xC5, buf) &&
+         JournalCheck(io, 17, 3, 0xC4, buf);
+    return JournalClose(journal) && ok;
+}
+
+Stdlib::Error TestNanoJournal()
+{
+    Trace(0, "TestNanoJournal: started");
+
+    TestDisk* disk = new (Mm::NoThrow) TestDisk();
+    u8* buf = static_cast<u8*>(Mm::Alloc(NanoJournalBlockSize, Tag));
+    if (disk == nullptr || buf == nullptr)
+    {
+        delete disk;
+        if (buf != nullptr)
+            Mm::Free(buf);
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+
+    Stdlib::Error err = MakeSuccess();
+    {
+        BlockIo io(disk, NanoJournalBlockSize);
+        if (!TestJournalTornCommit(io, buf))
+        {
+            Trace(0, "TestNanoJournal: torn commit failed");
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        }
+        else if (!TestJournalRevoke(io, buf))
+        {
+            Trace(0, "TestNanoJournal: revoke failed");
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        }
+        else if (!TestJournalWrap(io, buf))
+        {
+            Trace(0, "TestNanoJournal: wrap failed");
+            err = MakeError(Stdlib::Error::Unsuccessful);
+        }
+    }
+
+    Mm::Free(buf);
+    delete disk;
+
+    Trace(0, "TestNanoJournal: complete");
+    return err;
+}
+
+/* A cleared VNode, the way file systems set up new ones */
+static void DentryInitNode(VNode* node, const char* name, VNode::Type type)
+{
+    Stdlib::MemSet(node, 0, sizeof(VNode));
+    Stdlib::StrnCpy(node->Name, name, sizeof(node->Name));
+    node->NodeType = type;
+    node->Children.Init();
+    node->SiblingLink.Init();
+}
+
+static bool DentryCached(VNode* dir, const char* name, VNode* expected)
+{
+    VNode* child = nullptr;
+    return DentryCache::GetInstance().Find(dir, name, child) && child == expected;
+}
+
+static bool DentryMissing(VNode* dir, const char* name)
+{
+    VNode* child;
+    return !DentryCache::GetInstance().Find(dir, name, child);
+}
+
+Stdlib::Error TestDentryCache()
+{
+    Trace(0, "TestDentryCache: started");
+
+    VNode* dir = new (Mm::NoThrow) VNode();
+    VNode* file = new (Mm::NoThrow) VNode();
+    if (dir == nullptr || file == nullptr)
+    {
+        delete dir;
+        delete file;
+        return MakeError(Stdlib::Error::NoMemory);
+    }
+    DentryInitNode(dir, "dir", VNode::TypeDir);
+    DentryInitNode(file, "a", VNode::TypeFile);
+
+    auto& cache = DentryCache::GetInstance();
+    bool enabled = cache.IsEnabled();
+    cache.SetEnabled(true);
+
+    Stdlib::Error err = MakeSuccess();
+
+    /* A negative entry goes when the name is created */
+    cache.Insert(dir, "a", nullptr);
+    if (!DentryCached(dir, "a", nullptr))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    DirIndex::Link(dir, file);
+    if (!DentryMissing(dir, "a"))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    /* A positive entry goes when the name is unlinked; other names stay */
+    cache.Insert(dir, "a", file);
+    cache.Insert(dir, "b", nullptr);
+    if (!DentryCached(dir, "a", file))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    DirIndex::Unlink(file);
+    if (!DentryMissing(dir, "a") || !DentryCached(dir, "b", nullptr))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    /* A VNode taking the memory of a freed dir starts without an id, and
+       the one it gets never matches the freed dir's entries */
+    u64 oldId = dir->DentryId;
+    cache.Insert(dir, "c", file);
+    DentryInitNode(dir, "dir", VNode::TypeDir);
+    if (dir->DentryId != 0 || !DentryMissing(dir, "b") || !DentryMissing(dir, "c"))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+    cache.Insert(dir, "d", nullptr);
+    if (dir->DentryId == 0 || dir->DentryId == oldId ||
+        !DentryMissing(dir, "b") || !DentryMissing(dir, "c") || !DentryCached(dir, "d", nullptr))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    /* Purge forgets positive and negative entries alike */
+    cache.Insert(dir, "a", file);
+    cache.Purge();
+    if (!DentryMissing(dir, "a") || !DentryMissing(dir, "d"))
+        err = MakeError(Stdlib::Error::Unsuccessful);
+
+    cache.SetEnabled(enabled);
+    delete file;
+    delete dir;
+
+    Trace(0, "TestDentryCache: complete");
+    return err;
+}
+
+/* Drives BlockQos admission with its own clock (a friend of BlockQos):
+   each case runs on a fresh BlockQos and ReqCount fresh requests */
+class BlockQosTest
+{
+public:
+    static bool Weights(BlockQos& qos, BlockRequest* reqs);
+    static bool Buckets(BlockQos& qos, BlockRequest* reqs);
+    static bool LatencyTarget(BlockQos& qos, BlockRequest* reqs);
+
+    static const ulong ReqCount = 32;
+
+private:
+    static const u64 Start = Const::NanoSecsInSec;
+
+    static void Queue(BlockQos& qos, BlockRequest* reqs, ulong count, BlockRequest::Class cls);
+    static void AdmitAll(BlockQos& qos, u64 now, ulong admitted[BlockQos::ClassMax]);
+};
+
+/* Queue count requests of 8 sectors (a 4 KB cost) in cls */
+void BlockQosTest::Queue(BlockQos& qos, BlockRequest* reqs, ulong count, BlockRequest::Class cls)
+{
+    static u64 seq = 0;
+
+    for (ulong i = 0; i < count; i++)
+    {
+        seq++;
+        reqs[i].RequestType = BlockRequest::Write;
+        reqs[i].IoClass = cls;
+        reqs[i].Sector = 8 * seq;
+        reqs[i].SectorCount = 8;
+        reqs[i].Seq = seq;
+        qos.Queue(&reqs[i]);
+    }
+}
+
+/* Admit at now until QoS holds everything back; admitted[cls] counts
+   what went */
+void BlockQosTest::AdmitAll(BlockQos& qos, u64 now, ulong admitted[BlockQos::ClassMax])
+{
+    for (;;)
+    {
+        BlockRequest* req = qos.Admit(now, 512);
+        if (req == nullptr)
+            break;
+        qos.Admitted(req);
+        admitted[req->IoClass]++;
+    }
+}
+
+/* Weights 8:1: a foreground request advances its virtual time by 2000,
+   a background one by 16000, so of the first 18 admitted two are
+   background (at virtual time 0 and 16000) */
+bool BlockQosTest::Weights(BlockQos& qos, BlockRequest* reqs)
+{
+    const BlockRequest::Class fg = BlockRequest::ClassForeground;
+    const BlockRequest::Class bg = BlockRequest::ClassBackground;
+
+    Queue(qos, &reqs[0], 20, fg);
+    Queue(qos, &reqs[20], 4, bg);
+
+    ulong admitted[BlockQos::ClassMax] = {};
+    for (ulong i = 0; i < 18; i++)
+    {
+        BlockRequest* req = qos.Admit(Start, 512);
+        if (req == nullptr)
+            break;
+        admitted[req->IoClass]++;
+    }
+    if (admitted[fg] != 16 || admitted[bg] != 2)
+    {
+        Trace(0, "TestBlockQos: weights admitted fg %u bg %u", admitted[fg], admitted[bg]);
+        return false;
+    }
+
+    /* An idle class starts at the current virtual time, without the
+       credit it banked while idle */
+    Queue(qos, &reqs[24], 1, BlockRequest::ClassDefault);
+    return qos.GlobalVTime != 0 && qos.Classes[BlockRequest::ClassDefault].VTime == qos.GlobalVTime;
+}
+
+/* 100 IOPS is 10 ms a request, and a class goes while its bucket is
+   full no more than BurstNs (20 ms) ahead: 3 requests at once, then one
+   per 10 ms.  A 400 KB/s cap on 4 KB requests is the same rate.  An
+   uncapped class is not held behind them. */
+bool BlockQosTest::Buckets(BlockQos& qos, BlockRequest* reqs)
+{
+    const BlockRequest::Class fg = BlockRequest::ClassForeground;
+    const BlockRequest::Class def = BlockRequest::ClassDefault;
+    const BlockRequest::Class bg = BlockRequest::ClassBackground;
+
+    qos.SetIopsLimit(def, 100);
+    qos.SetKbpsLimit(bg, 400);
+    Queue(qos, &reqs[0], 8, def);
+    Queue(qos, &reqs[8], 8, bg);
+    Queue(qos, &reqs[16], 4, fg);
+
+    ulong burst[BlockQos::ClassMax] = {};
+    AdmitAll(qos, Start, burst);
+    ulong refill[BlockQos::ClassMax] = {};
+    AdmitAll(qos, Start + 10 * Const::NanoSecsInMs, refill);
+    ulong later[BlockQos::ClassMax] = {};
+    AdmitAll(qos, Start + Const::NanoSecsInSec, later);
+
+    if (burst[def] != 3 || burst[bg] != 3 || burst[fg] != 4 ||
+        refill[def] != 1 || refill[bg] != 1 ||
+        later[def] != 3 || later[bg] != 3 ||
+        qos.Classes[def].Throttled != 3 || qos.Classes[bg].Throttled != 3)
+    {
+        Trace(0, "TestBlockQos: buckets admitted def %u/%u/%u bg %u/%u/%u",
+            burst[def], refill[def], later[def], burst[bg], refill[bg], later[bg]);
+        return false;
+    }
+    return true;
+}
+
+/* Target 1 ms: a window whose foreground p99 is 5 ms halves the
+   background depth, a window that meets the target raises it by one,
+   and so does a window without foreground I/O */
+bool BlockQosTest::LatencyTarget(BlockQos& qos, BlockRequest* reqs)
+{
+    qos.SetLatencyTarget(Const::NanoSecsInMs);
+    qos.WindowStart = Start;
+
+    const u64 latencies[2] = { 5 * Const::NanoSecsInMs, 10 * Const::NanoSecsInUsec };
+    const ulong depths[2] = { BlockQos::AdmitWindow / 2, BlockQos::AdmitWindow / 2 + 1 };
+    const ulong samples = BlockQos::WindowMinSamples;
+    u64 window = Start;
+    for (ulong w = 0; w < 2; w++)
+    {
+        /* The last sample closes the window */
+        for (ulong i = 0; i < samples; i++)
+        {
+            BlockRequest& req = reqs[w * samples + i];
+            u64 done = window + ((i + 1 < samples) ? Const::NanoSecsInMs : BlockQos::WindowNs);
+            req.IoClass = BlockRequest::ClassForeground;
+            req.SubmitTime = done - latencies[w];
+            qos.Done(&req, true, done, 512);
+        }
+        window += BlockQos::WindowNs;
+        if (qos.BackgroundDepth != depths[w])
+        {
+            Trace(0, "TestBlockQos: window %u depth %u", w, qos.BackgroundDepth);
+            return false;
+        }
+    }
+
+    /* The background class is held at the depth */
+    ulong admitted[BlockQos::ClassMax] = {};
+    Queue(qos, &reqs[16], 8, BlockRequest::ClassBackground);
+    AdmitAll(qos, window, admitted);
+    if (admitted[BlockRequest::ClassBackground] != depths[1])
+        return false;
+
+    reqs[16].SubmitTime = window;
+    qos.Done(&reqs[16], true, window + BlockQos::WindowNs, 512);
+    return qos.BackgroundDepth == depths[1] + 1 && qos.WindowMisses == 1;
+}
+
+Stdlib::Error TestBlockQos()
+{
+    Trace(0, "TestBlockQos: started");
+
+    bool (*cases[])(BlockQos& qos, BlockRequest* reqs) = {
+        BlockQosTest::Weights, BlockQosTest::Buckets, BlockQosTest::LatencyTarget,
+    };
+
+    SpinLock lock;
+    Stdlib::Error err = MakeSuccess();
+    for (ulong i = 0; i < sizeof(cases) / sizeof(cases[0]) && err.Ok(); i++)
+    {
+        BlockQos* qos = new (Mm::NoThrow) BlockQos(lock);
+        BlockRequest* reqs = new (Mm::NoThrow) BlockRequest[BlockQosTest::ReqCount];
+        if (qos == nullptr || reqs == nullptr)
+            err = MakeError(Stdlib::Error::NoMemory);
+        else if (!cases[i](*qos, reqs))
+            err = MakeError(Stdlib::Error::Unsuccessful);
+
+        /* Requests still queued are dropped with the BlockQos; their
+           WaitGroups must reach zero before destruction */
+        for (ulong j = 0; reqs != nullptr && j < BlockQosTest::ReqCount; j++)
+        {
+            if (reqs[j].Completion.GetCounter() != 0)
+                reqs[j].Completion.Done();
+        }
+        delete[] reqs;
+        delete qos;
+    }
+
+    Trace(0, "TestBlockQos: complete");
+    return err;
+}
+
 Stdlib::Error TestContiguousPages()
 {
     auto& pt = Mm::PageTable::GetInstance();
@@ -1913,6 +2554,22 @@ Stdlib::Error Test()
     if (!err.Ok())
         return err;
 
+    err = TestIoScheduler();
+    if (!err.Ok())
+        return err;
+
+    err = TestBlockQos();
+    if (!err.Ok())
+        return err;
+
+    err = TestNanoJournal();
+    if (!err.Ok())
+        return err;
+
+    err = TestDentryCache();
+    if (!err.Ok())
+        return err;
+
     err = TestContiguousPages();
     if (!err.Ok())
         return err;
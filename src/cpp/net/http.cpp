@@ -171,6 +171,74 @@ static bool HasChunkedEncoding(const u8* buf, ulong headerLen)
     return false;
 }
 
+/* Status line: HTTP/1.x SSS ... */
+static int ParseStatusCode(const u8* buf, ulong total)
+{
+    int status = 0;
+    ulong i = 0;
+
+    /* Skip "HTTP/1.x " */
+    while (i < total && buf[i] != ' ')
+        i++;
+    if (i < total)
+        i++; /* skip space */
+
+    /* Parse status code */
+    while (i < total && buf[i] >= '0' && buf[i] <= '9')
+    {
+        status = status * 10 + (int)(buf[i] - '0');
+        i++;
+    }
+    return status;
+}
+
+/* Offset of the body: past the header/body boundary \r\n\r\n, 0 if not
+   received yet */
+static ulong FindHeaderEnd(const u8* buf, ulong total)
+{
+    for (ulong j = 0; j + 3 < total; j++)
+    {
+        if (buf[j] == '\r' && buf[j + 1] == '\n' &&
+            buf[j + 2] == '\r' && buf[j + 3] == '\n')
+            return j + 4;
+    }
+    return 0;
+}
+
+/* Content-Length from the headers, 0 if absent */
+static ulong ParseContentLength(const u8* buf, ulong headerEnd)
+{
+    static const char clHeader[] = "Content-Length:";
+    static const ulong clHeaderLen = 15;
+    ulong length = 0;
+    for (ulong j = 0; j + clHeaderLen < headerEnd; j++)
+    {
+        bool match = true;
+        for (ulong k = 0; k < clHeaderLen; k++)
+        {
+            char a = (char)buf[j + k];
+            char b = clHeader[k];
+            /* Case-insensitive compare */
+            if (a >= 'A' && a <= 'Z') a = a + ('a' - 'A');
+            if (b >= 'A' && b <= 'Z') b = b + ('a' - 'A');
+            if (a != b) { match = false; break; }
+        }
+        if (match)
+        {
+            ulong v = j + clHeaderLen;
+            while (v < headerEnd && buf[v] == ' ')
+                v++;
+            while (v < headerEnd && buf[v] >= '0' && buf[v] <= '9')
+            {
+                length = length * 10 + (ulong)(buf[v] - '0');
+                v++;
+            }
+            break;
+        }
+    }
+    return length;
+}
+
 /* Decode chunk-size/CRLF framing (RFC 9112 7.1) from src into dst and return
    the decoded length. dst must hold srcLen bytes (the decoded body is never
    longer than the wire form). Trailers after the 0-size chunk are ignored;
@@ -230,6 +298,92 @@ static ulong DechunkBody(const u8* src, ulong srcLen, u8* dst)
     return out;
 }
 
+/* DechunkBody for a body that arrives piecemeal: the same decoding, fed
+   one received piece at a time, the data handed to a sink */
+class HttpDechunker final
+{
+public:
+    HttpDechunker()
+        : State(StateSize)
+        , Remaining(0)
+        , SawDigit(false)
+    {
+    }
+
+    bool IsDone() const { return State == StateDone; }
+
+    /* false if the sink refused data */
+    bool Feed(const u8* src, ulong len, HttpBodySink* sink, ulong& delivered)
+    {
+        ulong pos = 0;
+        while (pos < len && State != StateDone)
+        {
+            char c = (char)src[pos];
+            switch (State)
+            {
+            case StateSize:
+            {
+                /* Hex chunk size, optionally followed by ";extension" */
+                ulong digit;
+                if (c >= '0' && c <= '9')
+                    digit = (ulong)(c - '0');
+                else if (c >= 'a' && c <= 'f')
+                    digit = (ulong)(c - 'a') + 10;
+                else if (c >= 'A' && c <= 'F')
+                    digit = (ulong)(c - 'A') + 10;
+                else
+                {
+                    State = SawDigit ? StateSizeLine : StateDone;
+                    break;
+                }
+                Remaining = Remaining * 16 + digit;
+                SawDigit = true;
+                pos++;
+                break;
+            }
+            case StateSizeLine:
+                pos++;
+                if (c == '\n')
+                    State = (Remaining == 0) ? StateDone : StateData; /* 0: last chunk */
+                break;
+            case StateData:
+            {
+                ulong n = Stdlib::Min(Remaining, len - pos);
+                if (!sink->Write(src + pos, n))
+                    return false;
+                delivered += n;
+                pos += n;
+                Remaining -= n;
+                if (Remaining == 0)
+                    State = StateDataEnd;
+                break;
+            }
+            case StateDataEnd:
+                /* Skip the CRLF that terminates the chunk data */
+                if (c == '\r' || c == '\n')
+                    pos++;
+                if (c != '\r')
+                {
+                    State = StateSize;
+                    Remaining = 0;
+                    SawDigit = false;
+                }
+                break;
+            default:
+                break;
+            }
+        }
+        return true;
+    }
+
+private:
+    enum StateType { StateSize, StateSizeLine, StateData, StateDataEnd, StateDone };
+
+    StateType State;
+    ulong Remaining;
+    bool SawDigit;
+};
+
 bool HttpClient::RecvResponse(TcpConn* conn, HttpResponse& resp)
 {
     /* Receive into a temp buffer */
@@ -272,34 +426,8 @@ bool HttpClient::RecvResponse(TcpConn* conn, HttpResponse& resp)
         return false;
     }
 
-    /* Parse status line: HTTP/1.x SSS ... */
-    resp.StatusCode = 0;
-    ulong i = 0;
-
-    /* Skip "HTTP/1.x " */
-    while (i < total && buf[i] != ' ')
-        i++;
-    if (i < total)
-        i++; /* skip space */
-
-    /* Parse status code */
-    while (i < total && buf[i] >= '0' && buf[i] <= '9')
-    {
-        resp.StatusCode = resp.StatusCode * 10 + (int)(buf[i] - '0');
-        i++;
-    }
-
-    /* Find header/body boundary: \r\n\r\n */
-    ulong headerEnd = 0;
-    for (ulong j = 0; j + 3 < total; j++)
-    {
-        if (buf[j] == '\r' && buf[j + 1] == '\n' &&
-            buf[j + 2] == '\r' && buf[j + 3] == '\n')
-        {
-            headerEnd = j + 4;
-            break;
-        }
-    }
+    resp.StatusCode = ParseStatusCode(buf, total);
+    ulong headerEnd = FindHeaderEnd(buf, total);
 
     if (headerEnd == 0)
     {
@@ -312,36 +440,7 @@ bool HttpClient::RecvResponse(TcpConn* conn, HttpResponse& resp)
         return true;
     }
 
-    /* Extract Content-Length from headers if present */
-    resp.ContentLength = 0;
-    static const char clHeader[] = "Content-Length:";
-    static const ulong clHeaderLen = 15;
-    for (ulong j = 0; j + clHeaderLen < headerEnd; j++)
-    {
-        bool match = true;
-        for (ulong k = 0; k < clHeaderLen; k++)
-        {
-            char a = (char)buf[j + k];
-            char b = clHeader[k];
-            /* Case-insensitive compare */
-            if (a >= 'A' && a <= 'Z') a = a + ('a' - 'A');
-            if (b >= 'A' && b <= 'Z') b = b + ('a' - 'A');
-            if (a != b) { match = false; break; }
-        }
-        if (match)
-        {
-            ulong v = j + clHeaderLen;
-            while (v < headerEnd && buf[v] == ' ')
-                v++;
-            while (v < headerEnd && buf[v] >= '0' && buf[v] <= '9')
-            {
-                resp.ContentLength = resp.ContentLength * 10 +
-                                     (ulong)(buf[v] - '0');
-                v++;
-            }
-            break;
-        }
-    }
+    resp.ContentLength = ParseContentLength(buf, headerEnd);
 
     /* Body starts after header boundary */
     bool chunked = HasChunkedEncoding(buf, headerEnd);
@@ -374,6 +473,124 @@ bool HttpClient::RecvResponse(TcpConn* conn, HttpResponse& resp)
     return true;
 }
 
+/* Hand body bytes to the sink, decoding chunked framing */
+static bool DeliverBody(const u8* data, ulong len, bool chunked, HttpDechunker& dechunker,
+                        HttpBodySink* sink, ulong& delivered)
+{
+    if (len == 0)
+        return true;
+    if (chunked)
+        return dechunker.Feed(data, len, sink, delivered);
+    if (!sink->Write(data, len))
+        return false;
+    delivered += len;
+    return true;
+}
+
+/* RecvResponse for a body streamed to sink instead of collected in
+   resp.Body: HttpMaxResponseSize only bounds the headers, and the
+   buffer is reused for each piece of the body once they are parsed.
+   The body of a redirect is dropped. */
+bool HttpClient::RecvResponseTo(TcpConn* conn, HttpResponse& resp, HttpBodySink* sink)
+{
+    u8* buf = (u8*)Mm::Alloc(HttpMaxResponseSize, 'Http');
+    if (!buf)
+        return false;
+
+    ulong total = 0;
+    ulong headerEnd = 0;
+    bool chunked = false;
+    bool deliver = false;
+    HttpDechunker dechunker;
+    resp.BodyLen = 0;
+
+    Stdlib::Time bt = GetBootTime();
+    ulong deadline = bt.GetSecs() * 1000 + bt.GetUsecs() / 1000 + HttpRecvTimeoutMs;
+
+    for (;;)
+    {
+        if (total == HttpMaxResponseSize)
+        {
+            Trace(0, "HttpClient: headers over %u bytes", HttpMaxResponseSize);
+            Mm::Free(buf);
+            return false;
+        }
+
+        long got = Tcp::GetInstance().Recv(conn, buf + total,
+                                           HttpMaxResponseSize - total);
+        if (got < 0)
+        {
+            Mm::Free(buf);
+            return false;
+        }
+        if (got == 0)
+            break; /* EOF */
+
+        bt = GetBootTime();
+        deadline = bt.GetSecs() * 1000 + bt.GetUsecs() / 1000 + HttpRecvTimeoutMs;
+
+        ulong start = total;
+        total += (ulong)got;
+        if (headerEnd == 0)
+        {
+            headerEnd = FindHeaderEnd(buf, total);
+            if (headerEnd != 0)
+            {
+                resp.StatusCode = ParseStatusCode(buf, headerEnd);
+                resp.ContentLength = ParseContentLength(buf, headerEnd);
+                ExtractLocation(buf, headerEnd, resp.Location, sizeof(resp.Location));
+                chunked = HasChunkedEncoding(buf, headerEnd);
+                deliver = !resp.IsRedirect();
+                start = headerEnd;
+            }
+        }
+
+        if (headerEnd != 0)
+        {
+            if (deliver && !DeliverBody(buf + start, total - start, chunked, dechunker,
+                                        sink, resp.BodyLen))
+            {
+                Trace(0, "HttpClient: body sink failed at %u bytes", resp.BodyLen);
+                Mm::Free(buf);
+                return false;
+            }
+            total = 0;
+
+            if (chunked ? dechunker.IsDone()
+                        : (resp.ContentLength != 0 && resp.BodyLen >= resp.ContentLength))
+                break;
+        }
+
+        bt = GetBootTime();
+        if (bt.GetSecs() * 1000 + bt.GetUsecs() / 1000 > deadline)
+            break;
+    }
+
+    if (headerEnd == 0)
+    {
+        if (total == 0)
+        {
+            Mm::Free(buf);
+            return false;
+        }
+
+        /* No header boundary found -- treat entire response as body */
+        if (!sink->Write(buf, total))
+        {
+            Mm::Free(buf);
+            return false;
+        }
+        resp.BodyLen = total;
+    }
+    if (resp.ContentLength == 0 || chunked)
+        resp.ContentLength = resp.BodyLen;
+
+    resp.Ok = true;
+    resp.Err = MakeSuccess();
+    Mm::Free(buf);
+    return true;
+}
+
 void HttpClient::ExtractLocation(const u8* headers, ulong headerLen,
                                  char* loc, ulong locSize)
 {
@@ -414,7 +631,7 @@ void HttpClient::ExtractLocation(const u8* headers, ulong headerLen,
     loc[0] = '\0';
 }
 
-HttpResponse HttpClient::DoGet(const char* url)
+HttpResponse HttpClient::DoGet(const char* url, HttpBodySink* sink)
 {
     HttpResponse resp;
 
@@ -453,7 +670,7 @@ HttpResponse HttpClient::DoGet(const char* url)
     }
 
     /* Receive response */
-    if (!RecvResponse(conn, resp))
+    if (!((sink != nullptr) ? RecvResponseTo(conn, resp, sink) : RecvResponse(conn, resp)))
     {
         Trace(0, "HttpClient: failed to receive response");
         Tcp::GetInstance().Close(conn);
@@ -464,7 +681,7 @@ HttpResponse HttpClient::DoGet(const char* url)
     return resp;
 }
 
-HttpResponse HttpClient::Get(const char* url)
+HttpResponse HttpClient::Get(const char* url, HttpBodySink* sink)
 {
     char currentUrl[HttpMaxUrlHostLen + HttpMaxUrlPathLen];
     ulong urlLen = Stdlib::StrLen(url);
@@ -475,7 +692,7 @@ HttpResponse HttpClient::Get(const char* url)
 
     for (ulong attempt = 0; attempt <= HttpMaxRedirects; attempt++)
     {
-        HttpResponse resp = DoGet(currentUrl);
+        HttpResponse resp = DoGet(currentUrl, sink);
 
         if (!resp.Ok || !resp.IsRedirect())
             return resp;
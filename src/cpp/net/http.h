@@ -49,25 +49,39 @@ struct HttpResponse
     }
 };
 
+/* Takes a response body as it arrives (HttpClient::Get with a sink) */
+class HttpBodySink
+{
+public:
+    virtual ~HttpBodySink() {}
+
+    /* false aborts the transfer */
+    virtual bool Write(const u8* data, ulong len) = 0;
+};
+
 class HttpClient
 {
 public:
     HttpClient(NetDevice* dev);
     ~HttpClient();
 
-    /* HTTP GET -- connects, sends request, receives response, closes */
-    HttpResponse Get(const char* url);
+    /* HTTP GET -- connects, sends request, receives response, closes.
+       With a sink the body of the final response is written to it as
+       it arrives, of any size, and resp.Body stays nullptr; BodyLen
+       counts the bytes written. */
+    HttpResponse Get(const char* url, HttpBodySink* sink = nullptr);
 
 private:
     NetDevice* Dev;
 
-    HttpResponse DoGet(const char* url);
+    HttpResponse DoGet(const char* url, HttpBodySink* sink);
     bool ParseUrl(const char* url, char* host, ulong hostSize,
                   u16& port, char* path, ulong pathSize);
     bool ResolveHost(const char* host, Net::IpAddress& ip);
     bool SendRequest(TcpConn* conn, const char* method,
                      const char* host, const char* path);
     bool RecvResponse(TcpConn* conn, HttpResponse& resp);
+    bool RecvResponseTo(TcpConn* conn, HttpResponse& resp, HttpBodySink* sink);
     void ExtractLocation(const u8* headers, ulong headerLen, char* loc, ulong locSize);
 };
 
@@ -2,10 +2,10 @@
 extern crate alloc;
 
 use alloc::boxed::Box;
-use kcore::{trace, dma, io, msix, pci, block, sync};
+use kcore::{trace, cpu, dma, io, msix, pci, block, sync, task};
 use kcore::bitmap::BitMap;
 use kcore::consts::PAGE_SIZE;
-use kcore::time::poll_until_busy;
+use kcore::time::{self, poll_until_busy, Duration};
 
 mod spec;
 mod queue;
@@ -13,7 +13,7 @@ mod queue;
 use spec::*;
 use queue::Queue;
 
-use core::sync::atomic::{AtomicPtr, AtomicU16, AtomicU32, AtomicUsize, Ordering};
+use core::sync::atomic::{AtomicPtr, AtomicU16, AtomicU32, AtomicU64, AtomicUsize, Ordering};
 
 const MAX_DEVICES: usize = 8;
 static DEVICES: [AtomicPtr<NvmeDevice>; MAX_DEVICES] = {
@@ -22,7 +22,7 @@ static DEVICES: [AtomicPtr<NvmeDevice>; MAX_DEVICES] = {
 };
 static DEVICE_COUNT: AtomicU32 = AtomicU32::new(0);
 
-/* A note on inflight_status[]:
+/* A note on inflight_status[] (per I/O queue pair):
  * The ISR writes inflight_status[cid] BEFORE calling wg_done, so by the
  * time completion.wait() returns the write is visible (wg_done/wg_wait
  * provide the happens-before guarantee).  CID reuse while a command is
@@ -34,11 +34,65 @@ const PCI_CLASS_STORAGE:   u8 = 0x01;
 const PCI_SUBCLASS_NVME:   u8 = 0x08;
 const PCI_PROGIF_NVME:     u8 = 0x02;
 
-/* Number of pages to map for BAR0 (covers regs + doorbells for 2 queues) */
+/* Polled completion (see BlockPollState on the C++ side): spin for about
+ * twice the observed latency, clamped; a device slower than the upper
+ * clamp only gets the minimum.  Hybrid first sleeps for half of it. */
+const POLL_MIN_SPIN_NS:  u64 = 2_000;
+const POLL_MAX_SPIN_NS:  u64 = 100_000;
+const POLL_MIN_SLEEP_NS: u64 = 10_000;
+
+/* Number of pages to map for BAR0 (covers regs + doorbells for the admin
+ * queue and up to MAX_IO_QUEUES I/O queues at any sane CAP.DSTRD) */
 const BAR0_MAP_PAGES: usize = 32;
 
+/* One I/O queue pair per CPU, at most */
+const MAX_IO_QUEUES: usize = cpu::MAX_CPUS;
+
 /* ------------------------------------------------------------------ */
 
+/* One I/O submission/completion queue pair (qid = index + 1) with its own
+ * lock, CID space and MSI-X vector (table entry = index, pinned to CPU
+ * index).  The block layer submits on pair `cpu % queue_count`, so CPUs do
+ * not share a submission lock and completions are reaped on the CPU that
+ * issued the I/O. */
+#[allow(dead_code)]
+struct IoQueuePair {
+    /* Owning device, for the doorbells and the poll mode */
+    dev: *const NvmeDevice,
+    qid: u16,
+
+    sq: Queue,
+    cq: Queue,
+
+    io_lock: sync::SpinLock,
+
+    /* Serializes CQ consumption between the ISR and polling submitters.
+     * Never taken with io_lock held. */
+    cq_lock: sync::SpinLock,
+
+    /* EWMA of completion latency (ns), for the poll budget */
+    avg_latency_ns: AtomicU64,
+
+    /* Bitmask of in-use CID slots (1 = in use).  Replaces the linear
+     * next_cid counter — avoids CID reuse while a previous command is still
+     * in flight.  W=1 → 64 slots, matches IO_QUEUE_DEPTH=64.  Slots beyond
+     * the actual queue depth are permanently reserved at init so in-flight
+     * commands never exceed what the SQ can hold (spec full condition is
+     * depth-1 entries). */
+    cid_map: BitMap<1>,
+
+    /* In-flight WaitGroup handles indexed by CID.  0 = empty slot.
+     * Accessed from both the I/O submission path and the ISR. */
+    inflight: [AtomicUsize; IO_QUEUE_DEPTH],
+
+    /* Completion status written by the ISR before calling wg_done.
+     * 0 = success; non-zero = NVMe status field value (SC | SCT<<8).
+     * Accessed from both the I/O submission path and the ISR. */
+    inflight_status: [AtomicU16; IO_QUEUE_DEPTH],
+
+    irq: msix::MsixInterrupt,
+}
+
 #[allow(dead_code)]
 struct NvmeDevice {
     /* BAR0 mapping — must outlive `regs` */
@@ -48,13 +102,16 @@ struct NvmeDevice {
     /* Admin queues kept alive to retain DMA buffers */
     admin_sq:  Queue,
     admin_cq:  Queue,
-    io_sq:     Queue,
-    io_cq:     Queue,
 
-    io_lock: sync::SpinLock,
+    /* I/O queue pairs; slots [0, queue_count) are populated.  Boxed so the
+     * ISR context pointers stay valid. */
+    io_queues:   [Option<Box<IoQueuePair>>; MAX_IO_QUEUES],
+    queue_count: usize,
+
+    /* block::POLL_* completion mode */
+    poll_mode: AtomicU32,
 
     _msix_table: msix::MsixTable,
-    _msix_irq:   msix::MsixInterrupt,
 
     db_stride:   usize,
 
@@ -63,27 +120,11 @@ struct NvmeDevice {
      * is still fetching entries is DMA into freed memory. */
     disable_timeout_ms: u64,
 
-    /* Bitmask of in-use CID slots (1 = in use).  Replaces the linear
-     * next_cid counter — avoids CID reuse while a previous command is still
-     * in flight.  W=1 → 64 slots, matches IO_QUEUE_DEPTH=64.  Slots beyond
-     * the actual queue depth are permanently reserved at init so in-flight
-     * commands never exceed what the SQ can hold (spec full condition is
-     * depth-1 entries). */
-    cid_map: BitMap<1>,
-
     /* capacity and geometry */
     capacity:    u64,    /* total LBA count */
     sector_size: u32,    /* bytes per LBA */
     max_transfer: u32,   /* max sectors per command (2-PRP-entry limit) */
-
-    /* In-flight WaitGroup handles indexed by CID.  0 = empty slot.
-     * Accessed from both the I/O submission path and the ISR. */
-    inflight: [AtomicUsize; IO_QUEUE_DEPTH],
-
-    /* Completion status written by the ISR before calling wg_done.
-     * 0 = success; non-zero = NVMe status field value (SC | SCT<<8).
-     * Accessed from both the I/O submission path and the ISR. */
-    inflight_status: [AtomicU16; IO_QUEUE_DEPTH],
+    oncs:        u16,    /* Identify Controller optional NVM commands */
 
     /* device name for block registration */
     name_buf: [u8; 16],
@@ -94,18 +135,19 @@ impl Drop for NvmeDevice {
         /* Tear down in reverse dependency order:
          * 1. Disable the controller — stops command fetching and DMA into
          *    the queue buffers we are about to free
-         * 2. Unregister MSI-X ISR — stops new interrupt delivery
+         * 2. Unregister the MSI-X ISRs — stops new interrupt delivery
          * 3. Destroy MSI-X table — releases PCI vectors
-         * 4. Destroy spinlock — after no more concurrent access
-         * Remaining fields (queues, BAR mapping) drop implicitly after. */
+         * Remaining fields (queue pairs with their spinlocks, BAR mapping)
+         * drop implicitly after. */
         let cc = self.regs.read32(REG_CC);
         self.regs.write32(REG_CC, cc & !CC_EN);
         if !wait_csts_clear(&self.regs, CSTS_RDY, self.disable_timeout_ms) {
             trace!(0, "NVMe: controller did not go not-ready on shutdown");
         }
-        self._msix_irq.disarm();
+        for qp in self.io_queues.iter_mut().flatten() {
+            qp.irq.disarm();
+        }
         self._msix_table.disarm();
-        /* io_lock is dropped implicitly after this (SpinLock::drop calls destroy) */
     }
 }
 
@@ -179,10 +221,10 @@ fn init_device(dev: pci::PciDevice) {
         mqes, db_stride, to_ms);
 
     /* The fixed-size BAR0 mapping must cover the doorbells we use (qid 0
-     * and 1, SQ+CQ each).  An unusually large CAP.DSTRD would otherwise
-     * trip MmioRegion's bounds assert at doorbell-ring time. */
-    let max_db_end = DB_BASE + 3 * db_stride as usize + 4;
-    if max_db_end > BAR0_MAP_PAGES * PAGE_SIZE {
+     * and at least qid 1, SQ+CQ each; more I/O queues are clamped to it
+     * below).  An unusually large CAP.DSTRD would otherwise trip
+     * MmioRegion's bounds assert at doorbell-ring time. */
+    if db_end(1, db_stride as usize) > BAR0_MAP_PAGES * PAGE_SIZE {
         trace!(0, "NVMe: doorbell stride {} exceeds BAR0 mapping, skipping", db_stride);
         return;
     }
@@ -251,10 +293,14 @@ fn init_device(dev: pci::PciDevice) {
 
     let id_ctrl = unsafe { &*(id_buf.as_slice().as_ptr() as *const IdentifyController) };
     let mdts = id_ctrl.mdts;
+    let oncs = u16::from_le_bytes([
+        id_buf.as_slice()[ID_CTRL_ONCS_OFFSET],
+        id_buf.as_slice()[ID_CTRL_ONCS_OFFSET + 1],
+    ]);
 
     let sn = core::str::from_utf8(&id_ctrl.sn).unwrap_or("?").trim();
     let mn = core::str::from_utf8(&id_ctrl.mn).unwrap_or("?").trim();
-    trace!(0, "NVMe: ctrl sn={} mn={} mdts={}", sn, mn, mdts);
+    trace!(0, "NVMe: ctrl sn={} mn={} mdts={} oncs={:#x}", sn, mn, mdts, oncs);
 
     /* --- Identify Namespace 1 --- */
     let mut cmd = SubmissionEntry::new(OPC_IDENTIFY, admin.next_cid());
@@ -297,20 +343,28 @@ fn init_device(dev: pci::PciDevice) {
      * binding limit.  Computed in device sectors, not 512-byte units. */
     let max_transfer = (2 * PAGE_SIZE / sector_size as usize) as u32;
 
-    /* --- Allocate I/O queues --- */
-    let io_depth = IO_QUEUE_DEPTH.min(mqes);
-    let io_sq = match Queue::new(io_depth, 1, db_stride as usize) {
-        Some(q) => q,
-        None => { trace!(0, "NVMe: I/O SQ alloc failed"); disable_controller_on_error(&regs, to_ms); return; }
-    };
-    let io_cq = match Queue::new(io_depth, 1, db_stride as usize) {
-        Some(q) => q,
-        None => { trace!(0, "NVMe: I/O CQ alloc failed"); disable_controller_on_error(&regs, to_ms); return; }
-    };
+    /* --- Number of I/O queues: one pair per CPU --- */
+    let possible = cpu::possible_mask().count_ones() as usize;
+    let mut want = possible.clamp(1, MAX_IO_QUEUES);
+    while want > 1 && db_end(want, db_stride as usize) > BAR0_MAP_PAGES * PAGE_SIZE {
+        want -= 1;
+    }
 
-    let io_lock = match sync::SpinLock::new() {
-        Some(l) => l,
-        None => { trace!(0, "NVMe: spinlock alloc failed"); disable_controller_on_error(&regs, to_ms); return; }
+    /* Set Features (Number of Queues) must precede queue creation; the
+     * controller may grant fewer than requested. */
+    let mut cmd = SubmissionEntry::new(OPC_SET_FEATURES, admin.next_cid());
+    cmd.cdw10 = FEAT_NUM_QUEUES;
+    cmd.cdw11 = ((want as u32 - 1) << 16) | (want as u32 - 1);
+    let nr_queues = match admin_exec_dw0(&mut admin, &regs, cmd) {
+        Some(dw0) => {
+            let nsqa = (dw0 & 0xFFFF) as usize + 1;
+            let ncqa = (dw0 >> 16) as usize + 1;
+            want.min(nsqa).min(ncqa)
+        }
+        None => {
+            trace!(0, "NVMe: Set Features (Number of Queues) failed, using 1 queue");
+            1
+        }
     };
 
     /* --- Setup MSI-X --- */
@@ -318,8 +372,10 @@ fn init_device(dev: pci::PciDevice) {
         Some(t) => t,
         None => { trace!(0, "NVMe: MSI-X setup failed"); disable_controller_on_error(&regs, to_ms); return; }
     };
+    /* One vector per queue pair */
+    let nr_queues = nr_queues.min(msix_table.table_size().max(1) as usize);
 
-    /* Enable MSI-X in PCI config space BEFORE creating the I/O CQ.
+    /* Enable MSI-X in PCI config space BEFORE creating the I/O CQs.
      * QEMU's nvme_create_cq() only calls msix_vector_use() when MSI-X
      * is already enabled; without this, msix_notify() silently drops
      * the interrupt because the vector is not marked as "used". */
@@ -329,81 +385,76 @@ fn init_device(dev: pci::PciDevice) {
         trace!(0, "NVMe: pre-enabled MSI-X in PCI config (cap={:#x})", cap);
     }
 
-    /* --- Create I/O CQ (admin command) --- */
-    let mut cmd = SubmissionEntry::new(OPC_CREATE_IO_CQ, admin.next_cid());
-    cmd.nsid   = 0;
-    cmd.prp1   = io_cq.cq_phys();
-    cmd.cdw10  = ((io_depth as u32 - 1) << 16) | 1; /* QSIZE | QID=1 */
-    cmd.cdw11  = (0u32 << 16) | (CQ_IEN as u32) | (CQ_PC as u32); /* IV=0, IEN, PC */
-    if !admin_exec(&mut admin, &regs, cmd) {
-        trace!(0, "NVMe: Create I/O CQ failed");
-        disable_controller_on_error(&regs, to_ms);
-        return;
+    /* --- Create I/O queue pairs --- */
+    let io_depth = IO_QUEUE_DEPTH.min(mqes);
+    let mut io_queues: [Option<Box<IoQueuePair>>; MAX_IO_QUEUES] = Default::default();
+    let mut queue_count = 0usize;
+    for i in 0..nr_queues {
+        match create_io_queue(&mut admin, &regs, (i + 1) as u16, io_depth, db_stride as usize) {
+            Some(qp) => {
+                io_queues[i] = Some(qp);
+                queue_count += 1;
+            }
+            None => break,
+        }
     }
-
-    /* --- Create I/O SQ (admin command) --- */
-    let mut cmd = SubmissionEntry::new(OPC_CREATE_IO_SQ, admin.next_cid());
-    cmd.nsid   = 0;
-    cmd.prp1   = io_sq.sq_phys();
-    cmd.cdw10  = ((io_depth as u32 - 1) << 16) | 1; /* QSIZE | QID=1 */
-    cmd.cdw11  = (1u32 << 16) | (SQ_PC as u32);      /* CQID=1, PC */
-    if !admin_exec(&mut admin, &regs, cmd) {
-        trace!(0, "NVMe: Create I/O SQ failed");
+    if queue_count == 0 {
         disable_controller_on_error(&regs, to_ms);
         return;
     }
 
-    /* Build the NvmeDevice.  We need the pointer *before* registering MSI-X
-     * because the interrupt handler closure needs it.  We box it, get a raw
-     * pointer, then store the Box inside the struct after the fact. */
+    /* Build the NvmeDevice.  The queue pairs need its address (and the
+     * interrupt handlers theirs), so box it first and wire them up after. */
     let mut dev_box = Box::new(NvmeDevice {
         _bar_mapping: bar_mapping,
         regs,
         admin_sq: admin.sq,
         admin_cq: admin.cq,
-        io_sq,
-        io_cq,
-        io_lock,
+        io_queues,
+        queue_count,
+        poll_mode: AtomicU32::new(block::POLL_OFF),
         _msix_table: msix_table,
-        _msix_irq: msix::MsixInterrupt::empty(),
         db_stride: db_stride as usize,
         disable_timeout_ms: to_ms,
-        cid_map: {
-            let mut m = BitMap::new();
-            /* Permanently reserve slots the SQ cannot hold: at most
-             * depth-1 commands may be outstanding (NVMe full condition). */
-            for b in io_depth.saturating_sub(1)..IO_QUEUE_DEPTH {
-                m.set(b);
-            }
-            m
-        },
         capacity,
         sector_size,
         max_transfer,
-        inflight: {
-            const ZERO: AtomicUsize = AtomicUsize::new(0);
-            [ZERO; IO_QUEUE_DEPTH]
-        },
-        inflight_status: {
-            const ZERO: AtomicU16 = AtomicU16::new(0);
-            [ZERO; IO_QUEUE_DEPTH]
-        },
+        oncs,
         name_buf: [0u8; 16],
     });
 
-    /* --- Register MSI-X interrupt handler --- */
-    let ctx_ptr = dev_box.as_mut() as *mut NvmeDevice as *mut u8;
-    let msix_irq = match msix::MsixInterrupt::register(
-        &dev_box._msix_table, 0, nvme_msix_handler, ctx_ptr,
-    ) {
-        Some(irq) => irq,
-        None => {
-            trace!(0, "NVMe: MSI-X vector registration failed");
-            return;
+    /* --- Register the per-queue MSI-X interrupt handlers --- */
+    let dev_ptr = dev_box.as_ref() as *const NvmeDevice;
+    let mut registered = 0usize;
+    for i in 0..queue_count {
+        let d = dev_box.as_mut();
+        let qp = match d.io_queues[i].as_mut() {
+            Some(q) => q,
+            None => break,
+        };
+        qp.dev = dev_ptr;
+        let ctx_ptr = qp.as_mut() as *mut IoQueuePair as *mut u8;
+        match msix::MsixInterrupt::register(&d._msix_table, i as u16, nvme_msix_handler, ctx_ptr) {
+            Some(irq) => {
+                /* Completions for CPU i's queue are handled on CPU i */
+                d._msix_table.set_affinity(i as u16, i);
+                trace!(0, "NVMe: qid {} MSI-X vector={} registered", qp.qid, irq.vector());
+                qp.irq = irq;
+                registered += 1;
+            }
+            None => {
+                trace!(0, "NVMe: MSI-X vector registration failed for qid {}", qp.qid);
+                break;
+            }
         }
-    };
-    trace!(0, "NVMe: MSI-X vector={} registered", msix_irq.vector());
-    dev_box._msix_irq = msix_irq;
+    }
+    if registered == 0 {
+        return;
+    }
+    /* Queues without a vector stay created but unused: nothing submits
+     * on them, so no completion can be lost. */
+    dev_box.queue_count = registered;
+    trace!(0, "NVMe: {} I/O queue pairs (depth {})", registered, io_depth);
 
     /* Name the device with the next free index before registering (the
      * C++ side traces the name at registration time).  Init runs
@@ -425,9 +476,13 @@ fn init_device(dev: pci::PciDevice) {
         name:         unsafe { (*raw).name_buf.as_ptr() },
         capacity:     unsafe { (*raw).capacity },
         sector_size:  unsafe { (*raw).sector_size as u64 },
+        queue_count:  unsafe { (*raw).queue_count as u32 },
         read_sectors:  nvme_read_sectors,
         write_sectors: nvme_write_sectors,
         flush:         Some(nvme_flush),
+        set_poll_mode: Some(nvme_set_poll_mode),
+        discard:       if oncs & ONCS_DSM != 0 { Some(nvme_discard) } else { None },
+        write_zeroes:  if oncs & ONCS_WRITE_ZEROES != 0 { Some(nvme_write_zeroes) } else { None },
         ctx:           raw as *mut u8,
     };
 
@@ -458,6 +513,97 @@ pub fn shutdown() {
     trace!(0, "NVMe: shutdown complete");
 }
 
+/* End of the highest doorbell (CQ head of the last I/O queue) used with
+ * `io_queues` I/O queue pairs. */
+fn db_end(io_queues: usize, db_stride: usize) -> usize {
+    DB_BASE + (2 * io_queues + 1) * db_stride + 4
+}
+
+/* Allocate I/O queue pair `qid` and create it on the controller: CQ `qid`
+ * with interrupt vector qid-1, then SQ `qid` bound to it.  A failure is
+ * traced; queues already created stay valid. */
+fn create_io_queue(
+    admin: &mut AdminCtx, regs: &io::MmioRegion,
+    qid: u16, depth: usize, db_stride: usize,
+) -> Option<Box<IoQueuePair>> {
+    let sq = match Queue::new(depth, qid, db_stride) {
+        Some(q) => q,
+        None => { trace!(0, "NVMe: I/O SQ {} alloc failed", qid); return None; }
+    };
+    let cq = match Queue::new(depth, qid, db_stride) {
+        Some(q) => q,
+        None => { trace!(0, "NVMe: I/O CQ {} alloc failed", qid); return None; }
+    };
+    let io_lock = match sync::SpinLock::new() {
+        Some(l) => l,
+        None => { trace!(0, "NVMe: spinlock alloc failed"); return None; }
+    };
+    let cq_lock = match sync::SpinLock::new() {
+        Some(l) => l,
+        None => { trace!(0, "NVMe: spinlock alloc failed"); return None; }
+    };
+
+    /* --- Create I/O CQ (admin command) --- */
+    let mut cmd = SubmissionEntry::new(OPC_CREATE_IO_CQ, admin.next_cid());
+    cmd.nsid   = 0;
+    cmd.prp1   = cq.cq_phys();
+    cmd.cdw10  = ((depth as u32 - 1) << 16) | qid as u32;   /* QSIZE | QID */
+    cmd.cdw11  = ((qid as u32 - 1) << 16) | (CQ_IEN as u32) | (CQ_PC as u32); /* IV, IEN, PC */
+    if !admin_exec(admin, regs, cmd) {
+        trace!(0, "NVMe: Create I/O CQ {} failed", qid);
+        return None;
+    }
+
+    /* --- Create I/O SQ (admin command) --- */
+    let mut cmd = SubmissionEntry::new(OPC_CREATE_IO_SQ, admin.next_cid());
+    cmd.nsid   = 0;
+    cmd.prp1   = sq.sq_phys();
+    cmd.cdw10  = ((depth as u32 - 1) << 16) | qid as u32;   /* QSIZE | QID */
+    cmd.cdw11  = ((qid as u32) << 16) | (SQ_PC as u32);      /* CQID, PC */
+    if !admin_exec(admin, regs, cmd) {
+        trace!(0, "NVMe: Create I/O SQ {} failed", qid);
+        /* CQ `qid` is live on the controller, interrupts enabled, and
+         * posts into cq's memory: delete it before that memory is
+         * freed, or keep the memory if the controller will not let go */
+        let mut cmd = SubmissionEntry::new(OPC_DELETE_IO_CQ, admin.next_cid());
+        cmd.nsid   = 0;
+        cmd.cdw10  = qid as u32;                                  /* QID */
+        if !admin_exec(admin, regs, cmd) {
+            trace!(0, "NVMe: Delete I/O CQ {} failed, leaking its memory", qid);
+            core::mem::forget(cq);
+        }
+        return None;
+    }
+
+    Some(Box::new(IoQueuePair {
+        dev: core::ptr::null(),
+        qid,
+        sq,
+        cq,
+        io_lock,
+        cq_lock,
+        avg_latency_ns: AtomicU64::new(0),
+        cid_map: {
+            let mut m = BitMap::new();
+            /* Permanently reserve slots the SQ cannot hold: at most
+             * depth-1 commands may be outstanding (NVMe full condition). */
+            for b in depth.saturating_sub(1)..IO_QUEUE_DEPTH {
+                m.set(b);
+            }
+            m
+        },
+        inflight: {
+            const ZERO: AtomicUsize = AtomicUsize::new(0);
+            [ZERO; IO_QUEUE_DEPTH]
+        },
+        inflight_status: {
+            const ZERO: AtomicU16 = AtomicU16::new(0);
+            [ZERO; IO_QUEUE_DEPTH]
+        },
+        irq: msix::MsixInterrupt::empty(),
+    }))
+}
+
 /* ------------------------------------------------------------------ */
 /* Admin command polling helpers                                        */
 /* ------------------------------------------------------------------ */
@@ -479,24 +625,29 @@ impl AdminCtx {
 /* Submit one admin command and poll for its completion.
  * Returns true on success. */
 fn admin_exec(ctx: &mut AdminCtx, regs: &io::MmioRegion, cmd: SubmissionEntry) -> bool {
+    admin_exec_dw0(ctx, regs, cmd).is_some()
+}
+
+/* As admin_exec, returning the command-specific CQE dword 0 on success. */
+fn admin_exec_dw0(ctx: &mut AdminCtx, regs: &io::MmioRegion, cmd: SubmissionEntry) -> Option<u32> {
     let cid = (cmd.cdw0 >> 16) as u16;
     ctx.sq.submit(&cmd);
     ctx.sq.ring_sq_doorbell(regs);
 
     /* Spin-poll the admin CQ.  Global interrupts are disabled during init. */
-    let mut result: Option<bool> = None;
+    let mut result: Option<Option<u32>> = None;
     let completed = poll_until_busy(1_000_000, || {
         let _ = regs.read32(REG_VS); /* cheap delay */
         if let Some(cqe) = ctx.cq.poll_completion() {
             ctx.cq.ring_cq_doorbell(regs);
             if cqe.cid != cid {
                 trace!(0, "NVMe: admin CQE cid mismatch: got {} expected {}", cqe.cid, cid);
-                result = Some(false);
+                result = Some(None);
             } else if cqe.status_code() != 0 {
                 trace!(0, "NVMe: admin cmd {} status={:#x}", cid, cqe.status_code());
-                result = Some(false);
+                result = Some(None);
             } else {
-                result = Some(true);
+                result = Some(Some(cqe.dw0));
             }
             return true; /* stop polling */
         }
@@ -504,9 +655,9 @@ fn admin_exec(ctx: &mut AdminCtx, regs: &io::MmioRegion, cmd: SubmissionEntry) -
     });
     if !completed {
         trace!(0, "NVMe: admin command {} timed out", cid);
-        return false;
+        return None;
     }
-    result.unwrap_or(false)
+    result.flatten()
 }
 
 /* Poll until CSTS bit is set, or timeout.
@@ -537,30 +688,110 @@ fn disable_controller_on_error(regs: &io::MmioRegion, to_ms: u64) {
 /* ------------------------------------------------------------------ */
 
 extern "C" fn nvme_msix_handler(ctx: *mut u8) {
-    let dev = ctx as *mut NvmeDevice;
+    let qp = ctx as *mut IoQueuePair;
+
+    if reap_completions(qp) == 0 {
+        /* Not level 0: a shared/stray vector would otherwise spam the log.
+         * Also expected when a polling submitter consumed the CQE first. */
+        trace!(3, "NVMe: IRQ spurious (no CQEs)");
+    }
+}
+
+/* Consume all posted CQEs of one queue pair and signal their waiters.
+ * Called from the ISR and from polling submitters; returns the number of
+ * CQEs consumed. */
+fn reap_completions(qp: *mut IoQueuePair) -> u32 {
+    let _guard = unsafe { (*qp).cq_lock.lock() };
+    let regs = unsafe { &(*(*qp).dev).regs };
 
     let mut completed = 0u32;
     loop {
-        let cqe = match unsafe { (*dev).io_cq.poll_completion() } {
+        let cqe = match unsafe { (*qp).cq.poll_completion() } {
             Some(c) => c,
             None => break,
         };
-        unsafe { (*dev).io_cq.ring_cq_doorbell(&(*dev).regs) };
+        unsafe { (*qp).cq.ring_cq_doorbell(regs) };
 
         let cid = cqe.cid as usize % IO_QUEUE_DEPTH;
         /* Acquire pairs with the submitter's Release store of the handle */
-        let wg_handle = unsafe { (*dev).inflight[cid].load(Ordering::Acquire) };
+        let wg_handle = unsafe { (*qp).inflight[cid].load(Ordering::Acquire) };
         completed = completed + 1;
         if wg_handle != 0 {
-            unsafe { (*dev).inflight_status[cid].store(cqe.status_code(), Ordering::Relaxed) };
-            unsafe { (*dev).inflight[cid].store(0, Ordering::Release) };
+            unsafe { (*qp).inflight_status[cid].store(cqe.status_code(), Ordering::Relaxed) };
+            unsafe { (*qp).inflight[cid].store(0, Ordering::Release) };
             sync::waitgroup_done_raw(wg_handle);
         }
     }
-    if completed == 0 {
-        /* Not level 0: a shared/stray vector would otherwise spam the log */
-        trace!(3, "NVMe: IRQ spurious (no CQEs)");
+    completed
+}
+
+/* Queue pair for block-layer queue `queue` (the submitting CPU's). */
+fn io_queue(dev: *mut NvmeDevice, queue: u32) -> *mut IoQueuePair {
+    let idx = queue as usize % unsafe { (*dev).queue_count };
+    match unsafe { (*dev).io_queues[idx].as_mut() } {
+        Some(qp) => qp.as_mut() as *mut IoQueuePair,
+        None => core::ptr::null_mut(),
+    }
+}
+
+extern "C" fn nvme_set_poll_mode(ctx: *mut u8, mode: u32) -> i32 {
+    let dev = ctx as *mut NvmeDevice;
+
+    if mode > block::POLL_HYBRID {
+        return -1;
     }
+    unsafe { (*dev).poll_mode.store(mode, Ordering::Relaxed) };
+    0
+}
+
+fn poll_spin_budget(avg: u64) -> u64 {
+    if avg == 0 {
+        return POLL_MAX_SPIN_NS; /* no samples yet */
+    }
+    if avg > POLL_MAX_SPIN_NS {
+        return POLL_MIN_SPIN_NS;
+    }
+    (2 * avg).clamp(POLL_MIN_SPIN_NS, POLL_MAX_SPIN_NS)
+}
+
+/* Wait for the command in slot `cid`.  In poll modes the submitter spins
+ * on the CQ phase bit for a bounded, adaptive time; the interrupt stays
+ * enabled, so a command that outlives the budget completes as usual. */
+fn wait_for_cid(qp: *mut IoQueuePair, cid: u16, completion: &sync::Completion) {
+    let mode = unsafe { (*(*qp).dev).poll_mode.load(Ordering::Relaxed) };
+    if mode == block::POLL_OFF {
+        completion.wait();
+        return;
+    }
+
+    let start = time::boot_time().as_nanos();
+    let avg = unsafe { (*qp).avg_latency_ns.load(Ordering::Relaxed) };
+    if mode == block::POLL_HYBRID && avg / 2 >= POLL_MIN_SLEEP_NS {
+        task::sleep(Duration::from_nanos(avg / 2));
+    }
+
+    let budget = poll_spin_budget(avg);
+    loop {
+        if unsafe { (*qp).inflight[cid as usize].load(Ordering::Acquire) } == 0 {
+            break;
+        }
+        if unsafe { (*qp).cq.peek_cq() }.is_some() {
+            reap_completions(qp);
+        } else if time::boot_time().as_nanos() - start >= budget {
+            break;
+        } else {
+            core::hint::spin_loop();
+        }
+    }
+
+    /* Returns at once if the spin observed the completion; the reaper
+     * clears inflight[] before wg_done, so wait() still orders the
+     * status read below. */
+    completion.wait();
+
+    let latency = time::boot_time().as_nanos() - start;
+    let new_avg = if avg == 0 { latency } else { avg - avg / 8 + latency / 8 };
+    unsafe { (*qp).avg_latency_ns.store(new_avg, Ordering::Relaxed) };
 }
 
 /* ------------------------------------------------------------------ */
@@ -568,62 +799,155 @@ extern "C" fn nvme_msix_handler(ctx: *mut u8) {
 /* ------------------------------------------------------------------ */
 
 extern "C" fn nvme_read_sectors(
-    ctx: *mut u8, sector: u64, buf: *mut u8, count: u32,
+    ctx: *mut u8, queue: u32, sector: u64, buf: *mut u8, count: u32,
 ) -> i32 {
-    submit_io(ctx, sector, buf as *const u8, count, false, false)
+    submit_io(ctx, queue, sector, buf as *const u8, count, false, false)
 }
 
 extern "C" fn nvme_write_sectors(
-    ctx: *mut u8, sector: u64, buf: *const u8, count: u32, _fua: i32,
+    ctx: *mut u8, queue: u32, sector: u64, buf: *const u8, count: u32, _fua: i32,
 ) -> i32 {
-    submit_io(ctx, sector, buf, count, true, _fua != 0)
+    submit_io(ctx, queue, sector, buf, count, true, _fua != 0)
 }
 
-extern "C" fn nvme_flush(ctx: *mut u8) -> i32 {
+extern "C" fn nvme_flush(ctx: *mut u8, queue: u32) -> i32 {
     let dev = ctx as *mut NvmeDevice;
 
-    let completion = match sync::Completion::new() {
-        Some(c) => c,
-        None => return -1,
-    };
+    let mut cmd = SubmissionEntry::new(OPC_FLUSH, 0);
+    cmd.nsid = 1;
+    match exec_io_cmd(io_queue(dev, queue), cmd) {
+        Some(0) => 0,
+        Some(status) => {
+            trace!(0, "NVMe: flush status={:#x}", status);
+            -1
+        }
+        None => -1,
+    }
+}
+
+/* Submit one I/O command on `qp` (its CID is assigned here) and wait for
+ * it.  Returns the NVMe status, 0 on success, or None if it was not sent. */
+fn exec_io_cmd(qp: *mut IoQueuePair, mut cmd: SubmissionEntry) -> Option<u16> {
+    if qp.is_null() {
+        return None;
+    }
+    let completion = sync::Completion::new()?;
 
     let cid = {
-        let _guard = unsafe { (*dev).io_lock.lock() };
-        let cid = match alloc_cid(dev) {
+        let _guard = unsafe { (*qp).io_lock.lock() };
+        let cid = match alloc_cid(qp) {
             Some(c) => c,
             None => {
-                trace!(0, "NVMe: flush: all CID slots busy");
+                trace!(0, "NVMe: exec_io_cmd: all CID slots busy on qid {}", unsafe { (*qp).qid });
                 /* Disarm the completion (never submitted) before it drops. */
                 completion.complete();
-                return -1;
+                return None;
             }
         };
 
-        unsafe { (*dev).inflight_status[cid as usize].store(0, Ordering::Relaxed) };
+        unsafe { (*qp).inflight_status[cid as usize].store(0, Ordering::Relaxed) };
         /* Release: the handle must be visible to the ISR before the
          * doorbell write can trigger the completion */
-        unsafe { (*dev).inflight[cid as usize].store(completion.raw_handle(), Ordering::Release) };
-        let mut cmd = SubmissionEntry::new(OPC_FLUSH, cid);
-        cmd.nsid = 1;
-        unsafe { (*dev).io_sq.submit(&cmd) };
-        unsafe { (*dev).io_sq.ring_sq_doorbell(&(*dev).regs) };
+        unsafe { (*qp).inflight[cid as usize].store(completion.raw_handle(), Ordering::Release) };
+        cmd.set_cid(cid);
+        unsafe { (*qp).sq.submit(&cmd) };
+        unsafe { (*qp).sq.ring_sq_doorbell(&(*(*qp).dev).regs) };
         cid
     };
 
-    completion.wait();
+    wait_for_cid(qp, cid, &completion);
+
+    let status = unsafe { (*qp).inflight_status[cid as usize].load(Ordering::Acquire) };
+    { let _guard = unsafe { (*qp).io_lock.lock() }; free_cid(qp, cid); }
+    Some(status)
+}
 
-    let status = unsafe { (*dev).inflight_status[cid as usize].load(Ordering::Acquire) };
-    { let _guard = unsafe { (*dev).io_lock.lock() }; free_cid(dev, cid); }
+/* Deallocate [sector, sector + count) with Dataset Management.  One
+ * command carries up to DSM_MAX_RANGES ranges of at most u32::MAX
+ * blocks, listed in a single DMA page. */
+extern "C" fn nvme_discard(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32 {
+    let dev = ctx as *mut NvmeDevice;
+    let qp = io_queue(dev, queue);
 
-    if status != 0 {
-        trace!(0, "NVMe: flush status={:#x}", status);
+    if count == 0 {
+        return 0;
+    }
+    if sector > unsafe { (*dev).capacity } || count > unsafe { (*dev).capacity } - sector {
         return -1;
     }
+
+    let mut ranges = match dma::DmaBuffer::new(1) {
+        Some(b) => b,
+        None => return -1,
+    };
+
+    let mut next = sector;
+    let end = sector + count;
+    while next < end {
+        let list = ranges.as_mut_ptr() as *mut DsmRange;
+        let mut nr = 0usize;
+        while next < end && nr < DSM_MAX_RANGES {
+            let nlb = (end - next).min(u32::MAX as u64);
+            unsafe {
+                list.add(nr).write(DsmRange { cattr: 0, nlb: nlb as u32, slba: next });
+            }
+            next += nlb;
+            nr += 1;
+        }
+
+        let mut cmd = SubmissionEntry::new(OPC_DSM, 0);
+        cmd.nsid  = 1;
+        cmd.prp1  = ranges.phys();
+        cmd.cdw10 = nr as u32 - 1;
+        cmd.cdw11 = DSM_AD;
+        match exec_io_cmd(qp, cmd) {
+            Some(0) => {}
+            Some(status) => {
+                trace!(0, "NVMe: discard status={:#x} sector={} count={}", status, sector, count);
+                return -1;
+            }
+            None => return -1,
+        }
+    }
+    0
+}
+
+/* Zero [sector, sector + count) without a data transfer, in commands of
+ * at most WRITE_ZEROES_MAX_BLOCKS blocks. */
+extern "C" fn nvme_write_zeroes(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32 {
+    let dev = ctx as *mut NvmeDevice;
+    let qp = io_queue(dev, queue);
+
+    if sector > unsafe { (*dev).capacity } || count > unsafe { (*dev).capacity } - sector {
+        return -1;
+    }
+
+    let mut next = sector;
+    let end = sector + count;
+    while next < end {
+        let nlb = (end - next).min(WRITE_ZEROES_MAX_BLOCKS);
+
+        let mut cmd = SubmissionEntry::new(OPC_WRITE_ZEROES, 0);
+        cmd.nsid  = 1;
+        cmd.cdw10 = next as u32;
+        cmd.cdw11 = (next >> 32) as u32;
+        cmd.cdw12 = nlb as u32 - 1;
+        match exec_io_cmd(qp, cmd) {
+            Some(0) => {}
+            Some(status) => {
+                trace!(0, "NVMe: write zeroes status={:#x} sector={} count={}", status, next, nlb);
+                return -1;
+            }
+            None => return -1,
+        }
+        next += nlb;
+    }
     0
 }
 
 fn submit_io(
     ctx: *mut u8,
+    queue: u32,
     sector: u64,
     buf: *const u8,
     count: u32,
@@ -636,11 +960,6 @@ fn submit_io(
         return -1;
     }
 
-    let completion = match sync::Completion::new() {
-        Some(c) => c,
-        None => return -1,
-    };
-
     /* Build PRP entries before taking the lock. */
     let prp1 = dma::virt_to_phys(buf as *const u8);
     let offset_in_page = prp1 as usize & (PAGE_SIZE - 1);
@@ -650,10 +969,6 @@ fn submit_io(
          * a PRP *list* pointer and would DMA through garbage addresses. */
         trace!(0, "NVMe: transfer spans >2 pages (offset={} bytes={}), rejecting",
             offset_in_page, bytes_needed);
-        /* Disarm the completion before it drops: its handle was never handed
-         * to the device, so no ISR will complete it, and ~WaitGroup asserts a
-         * zero counter. */
-        completion.complete();
         return -1;
     }
     let prp2 = if offset_in_page + bytes_needed > PAGE_SIZE {
@@ -665,57 +980,33 @@ fn submit_io(
 
     let opcode = if is_write { OPC_WRITE } else { OPC_READ };
 
-    let cid = {
-        let _guard = unsafe { (*dev).io_lock.lock() };
-        let cid = match alloc_cid(dev) {
-            Some(c) => c,
-            None => {
-                trace!(0, "NVMe: submit_io: all CID slots busy");
-                /* Disarm the completion (never submitted) before it drops. */
-                completion.complete();
-                return -1;
-            }
-        };
-
-        unsafe { (*dev).inflight_status[cid as usize].store(0, Ordering::Relaxed) };
-        /* Release: the handle must be visible to the ISR before the
-         * doorbell write can trigger the completion */
-        unsafe { (*dev).inflight[cid as usize].store(completion.raw_handle(), Ordering::Release) };
-
-        let mut cmd = SubmissionEntry::new(opcode, cid);
-        cmd.nsid  = 1;
-        cmd.prp1  = prp1;
-        cmd.prp2  = prp2;
-        cmd.cdw10 = sector as u32;
-        cmd.cdw11 = (sector >> 32) as u32;
-        let fua_bit: u32 = if _fua { 1 << 30 } else { 0 };
-        cmd.cdw12 = fua_bit | (count as u32 - 1);
-
-        unsafe { (*dev).io_sq.submit(&cmd) };
-        unsafe { (*dev).io_sq.ring_sq_doorbell(&(*dev).regs) };
-        cid
-    };
-
-    completion.wait();
-
-    let status = unsafe { (*dev).inflight_status[cid as usize].load(Ordering::Acquire) };
-    { let _guard = unsafe { (*dev).io_lock.lock() }; free_cid(dev, cid); }
-
-    if status != 0 {
-        trace!(0, "NVMe: I/O status={:#x} sector={} count={}", status, sector, count);
-        return -1;
+    let mut cmd = SubmissionEntry::new(opcode, 0);
+    cmd.nsid  = 1;
+    cmd.prp1  = prp1;
+    cmd.prp2  = prp2;
+    cmd.cdw10 = sector as u32;
+    cmd.cdw11 = (sector >> 32) as u32;
+    let fua_bit: u32 = if _fua { 1 << 30 } else { 0 };
+    cmd.cdw12 = fua_bit | (count as u32 - 1);
+
+    match exec_io_cmd(io_queue(dev, queue), cmd) {
+        Some(0) => 0,
+        Some(status) => {
+            trace!(0, "NVMe: I/O status={:#x} sector={} count={}", status, sector, count);
+            -1
+        }
+        None => -1,
     }
-    0
 }
 
 /* Allocate a free command ID slot.  Returns None when all IO_QUEUE_DEPTH
- * slots are in use.  Caller must hold io_lock. */
-fn alloc_cid(dev: *mut NvmeDevice) -> Option<u16> {
-    unsafe { (*dev).cid_map.alloc().map(|c| c as u16) }
+ * slots are in use.  Caller must hold the queue pair's io_lock. */
+fn alloc_cid(qp: *mut IoQueuePair) -> Option<u16> {
+    unsafe { (*qp).cid_map.alloc().map(|c| c as u16) }
 }
 
 /* Free a command ID slot after its completion has been consumed.
- * Caller must hold io_lock. */
-fn free_cid(dev: *mut NvmeDevice, cid: u16) {
-    unsafe { (*dev).cid_map.free(cid as usize) }
+ * Caller must hold the queue pair's io_lock. */
+fn free_cid(qp: *mut IoQueuePair, cid: u16) {
+    unsafe { (*qp).cid_map.free(cid as usize) }
 }
@@ -52,16 +52,35 @@ pub const OPC_CREATE_IO_SQ: u8 = 0x01;
 pub const OPC_DELETE_IO_CQ: u8 = 0x04;
 pub const OPC_CREATE_IO_CQ: u8 = 0x05;
 pub const OPC_IDENTIFY:     u8 = 0x06;
+pub const OPC_SET_FEATURES: u8 = 0x09;
 
 /* NVMe I/O command opcodes */
 pub const OPC_FLUSH: u8 = 0x00;
 pub const OPC_WRITE: u8 = 0x01;
 pub const OPC_READ:  u8 = 0x02;
+pub const OPC_WRITE_ZEROES: u8 = 0x08;
+pub const OPC_DSM:   u8 = 0x09;  /* Dataset Management */
+
+/* Dataset Management: cdw11 Attribute - Deallocate; at most 256 ranges */
+pub const DSM_AD:         u32 = 1 << 2;
+pub const DSM_MAX_RANGES: usize = 256;
+
+/* Write Zeroes: NLB is a 16-bit 0-based count */
+pub const WRITE_ZEROES_MAX_BLOCKS: u64 = 1 << 16;
+
+/* Identify Controller ONCS (Optional NVM Command Support, 2 bytes) */
+pub const ID_CTRL_ONCS_OFFSET: usize = 520;
+pub const ONCS_DSM:          u16 = 1 << 2;
+pub const ONCS_WRITE_ZEROES: u16 = 1 << 3;
 
 /* Identify CNS values */
 pub const CNS_CONTROLLER: u32 = 0x01;
 pub const CNS_NAMESPACE:  u32 = 0x00;
 
+/* Set Features: Number of Queues (cdw11 / CQE dw0: NSQ[15:0], NCQ[31:16],
+ * both 0-based) */
+pub const FEAT_NUM_QUEUES: u32 = 0x07;
+
 /* CreateCQ/CreateSQ flags */
 pub const CQ_IEN:        u16 = 1 << 1;  /* Interrupts Enabled */
 pub const CQ_PC:         u16 = 1 << 0;  /* Physically Contiguous */
@@ -97,6 +116,10 @@ impl SubmissionEntry {
         e
     }
 
+    pub fn set_cid(&mut self, cid: u16) {
+        self.cdw0 = (self.cdw0 & 0xFFFF) | ((cid as u32) << 16);
+    }
+
     pub fn set_prps(&mut self, prp1: u64, prp2: u64) {
         self.prp1 = prp1;
         self.prp2 = prp2;
@@ -170,3 +193,12 @@ pub struct LbaFormat {
     pub lbads: u8,  /* LBA Data Size: sector size = 2^lbads */
     pub rp:   u8,   /* Relative Performance */
 }
+
+/* Dataset Management range (16 bytes) */
+#[repr(C)]
+#[derive(Clone, Copy, Default)]
+pub struct DsmRange {
+    pub cattr: u32,  /* Context Attributes */
+    pub nlb:   u32,  /* Length in logical blocks */
+    pub slba:  u64,  /* Starting LBA */
+}
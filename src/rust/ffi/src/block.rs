@@ -3,13 +3,17 @@ pub struct BlockDeviceOps {
     pub name: *const u8,
     pub capacity: u64,
     pub sector_size: u64,
+    pub queue_count: u32,
     pub read_sectors: extern "C" fn(
-        ctx: *mut u8, sector: u64, buf: *mut u8, count: u32,
+        ctx: *mut u8, queue: u32, sector: u64, buf: *mut u8, count: u32,
     ) -> i32,
     pub write_sectors: extern "C" fn(
-        ctx: *mut u8, sector: u64, buf: *const u8, count: u32, fua: i32,
+        ctx: *mut u8, queue: u32, sector: u64, buf: *const u8, count: u32, fua: i32,
     ) -> i32,
-    pub flush: Option<extern "C" fn(ctx: *mut u8) -> i32>,
+    pub flush: Option<extern "C" fn(ctx: *mut u8, queue: u32) -> i32>,
+    pub set_poll_mode: Option<extern "C" fn(ctx: *mut u8, mode: u32) -> i32>,
+    pub discard: Option<extern "C" fn(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32>,
+    pub write_zeroes: Option<extern "C" fn(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32>,
     pub ctx: *mut u8,
 }
 
@@ -12,6 +12,7 @@ extern "C" {
     pub fn kernel_msix_unmask(handle: usize, index: u16);
     pub fn kernel_msix_table_size(handle: usize) -> u16;
     pub fn kernel_msix_is_ready(handle: usize) -> i32;
+    pub fn kernel_msix_set_affinity(handle: usize, index: u16, cpu: usize) -> i32;
     pub fn kernel_msix_register_handler(
         msix_handle: usize, msix_index: u16,
         handler: extern "C" fn(*mut u8), ctx: *mut u8,
@@ -12,21 +12,42 @@ impl BlockDeviceRegistration {
     }
 }
 
+/// Completion modes, matching `BlockPollState::Mode` on the C++ side.
+pub const POLL_OFF: u32 = 0;
+pub const POLL_SPIN: u32 = 1;
+pub const POLL_HYBRID: u32 = 2;
+
 /// Ops table passed to `register`. All function pointers must remain valid
 /// for the lifetime of the kernel (static or leaked allocations).
+///
+/// Every I/O op gets the hardware queue to submit on: the current CPU's
+/// queue (`cpu % queue_count`), so a multi-queue device can give each CPU
+/// its own submission lock and completion vector.  The task may migrate
+/// while the op runs, so queues must still be locked.
 pub struct BlockDeviceOps {
     /// Null-terminated ASCII device name (e.g. b"nvme0\0").
     pub name: *const u8,
     pub capacity: u64,
     pub sector_size: u64,
+    /// Hardware queues; 1 for a single-queue device.
+    pub queue_count: u32,
     pub read_sectors: extern "C" fn(
-        ctx: *mut u8, sector: u64, buf: *mut u8, count: u32,
+        ctx: *mut u8, queue: u32, sector: u64, buf: *mut u8, count: u32,
     ) -> i32,
     pub write_sectors: extern "C" fn(
-        ctx: *mut u8, sector: u64, buf: *const u8, count: u32, fua: i32,
+        ctx: *mut u8, queue: u32, sector: u64, buf: *const u8, count: u32, fua: i32,
     ) -> i32,
     /// Optional. Pass `None` if the device has no write cache to flush.
-    pub flush: Option<extern "C" fn(ctx: *mut u8) -> i32>,
+    pub flush: Option<extern "C" fn(ctx: *mut u8, queue: u32) -> i32>,
+    /// Optional. Selects the completion mode for synchronous I/O; `mode`
+    /// is one of the `POLL_*` constants.  Pass `None` if the device can
+    /// only complete through its interrupt.
+    pub set_poll_mode: Option<extern "C" fn(ctx: *mut u8, mode: u32) -> i32>,
+    /// Optional. Deallocate `count` sectors; the data reads back as
+    /// undefined (or zeros, if the device says so) afterwards.
+    pub discard: Option<extern "C" fn(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32>,
+    /// Optional. Zero `count` sectors without a data transfer.
+    pub write_zeroes: Option<extern "C" fn(ctx: *mut u8, queue: u32, sector: u64, count: u64) -> i32>,
     pub ctx: *mut u8,
 }
 
@@ -37,9 +58,13 @@ pub fn register(ops: &BlockDeviceOps) -> Option<BlockDeviceRegistration> {
         name: ops.name,
         capacity: ops.capacity,
         sector_size: ops.sector_size,
+        queue_count: ops.queue_count,
         read_sectors: ops.read_sectors,
         write_sectors: ops.write_sectors,
         flush: ops.flush,
+        set_poll_mode: ops.set_poll_mode,
+        discard: ops.discard,
+        write_zeroes: ops.write_zeroes,
         ctx: ops.ctx,
     };
     let h = unsafe { block::kernel_blockdev_register(&ffi_ops) };
@@ -15,6 +15,12 @@ pub fn online_mask() -> u64 {
     unsafe { ffi::cpu::kernel_cpu_online_mask() as u64 }
 }
 
+/// Returns a bitmask of CPUs found at boot, including ones not started yet
+/// (drivers initialise before SMP bringup).
+pub fn possible_mask() -> u64 {
+    unsafe { ffi::cpu::kernel_cpu_possible_mask() as u64 }
+}
+
 /// Run `handler(ctx)` synchronously on the given CPU via IPI.
 /// Blocks the calling CPU until the remote CPU completes the call.
 /// Has no effect if `cpu` is out of range or `cpu` is not running.
@@ -51,6 +51,13 @@ impl MsixTable {
         unsafe { msix::kernel_msix_is_ready(self.handle) != 0 }
     }
 
+    /// Steer enabled entry `index` to `cpu` through the kernel irqbalance,
+    /// e.g. a per-CPU queue's vector to its CPU. Takes effect once SMP
+    /// bringup has balanced IRQs if `cpu` is not running yet.
+    pub fn set_affinity(&self, index: u16, cpu: usize) -> bool {
+        unsafe { msix::kernel_msix_set_affinity(self.handle, index, cpu) != 0 }
+    }
+
     pub fn disarm(&mut self) {
         if self.handle != 0 {
             unsafe { msix::kernel_msix_destroy(self.handle) }